@@ -14,31 +14,101 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-# Generate unicode_sciript_data.h from Unicode Scripts.txt
+# Generate unicode_script_map.h from Unicode Scripts.txt
 #
-# usage: ./gen_unicode_Scripts_code.pl < scripts > unicode_script_data.h
+# usage: ./gen_unicode_Scripts_code.pl < scripts > unicode_script_map.h
 #
-print "#ifndef UNICODE_SCRIPT_DATA_H_\n";
-print "#define UNICODE_SCRIPT_DATA_H_\n";
-print "namespace sentencepiece {\n";
-print "namespace unicode_script {\n";
-print "namespace {\n";
-print "void InitTable(std::unordered_map<char32, ScriptType> *smap) {\n";
-print "  CHECK_NOTNULL(smap)->clear();\n";
+# The table is emitted as a two-level lookup. Code points are split into
+# blocks of 2^$kBlockShift; kScriptBlockIndex maps a block to one of the
+# distinct blocks stored in kScriptBlocks. Unlisted code points are U_Common.
+
+use strict;
+
+my $kMaxCodePoint = 0x10FFFF;
+my $kBlockShift = 7;
+my $kBlockSize = 1 << $kBlockShift;
+
+my @script = ('Common') x ($kMaxCodePoint + 1);
 
 while (<>) {
   chomp;
   if (/^([0-9A-F]+)\s+;\s+(\S+)\s+\#/) {
-    printf("  (*smap)[0x%s] = U_%s;\n", $1, $2);
+    $script[hex($1)] = $2;
   } elsif (/^([0-9A-F]+)\.\.([0-9A-F]+)\s+;\s+(\S+)\s+\#/) {
-    printf("  for (char32 c = 0x%s; c <= 0x%s; ++c)\n", $1, $2);
-    printf("    (*smap)[c] = U_%s;\n", $3);
+    $script[$_] = $3 for (hex($1) .. hex($2));
   } else {
     next;
   }
 }
 
-print "}\n";
+my @blocks = ();
+my %block_id = ();
+my @index = ();
+for (my $begin = 0; $begin <= $kMaxCodePoint; $begin += $kBlockSize) {
+  my $key = join(' ', @script[$begin .. $begin + $kBlockSize - 1]);
+  if (!exists $block_id{$key}) {
+    $block_id{$key} = scalar(@blocks);
+    push(@blocks, $key);
+  }
+  push(@index, $block_id{$key});
+}
+die "too many distinct blocks" if (@blocks > 256);
+
+# Prints `items` separated by commas, wrapped at 80 columns.
+sub print_list {
+  my ($indent, @items) = @_;
+  my $line = $indent;
+  for my $item (@items) {
+    if (length($line) + length($item) + 1 > 80) {
+      $line =~ s/\s+$//;
+      print "$line\n";
+      $line = $indent;
+    }
+    $line .= "$item, ";
+  }
+  $line =~ s/\s+$//;
+  print "$line\n" if ($line ne '');
+}
+
+print <<'END';
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Generated by data/gen_unicode_scripts_code.pl. Do not edit.
+
+#ifndef UNICODE_SCRIPT_DATA_H_
+#define UNICODE_SCRIPT_DATA_H_
+namespace sentencepiece {
+namespace unicode_script {
+namespace {
+END
+printf("constexpr char32 kMaxScriptCodePoint = 0x%X;\n", $kMaxCodePoint);
+printf("constexpr int kScriptBlockShift = %d;\n", $kBlockShift);
+print "constexpr char32 kScriptBlockMask = (1 << kScriptBlockShift) - 1;\n\n";
+print "// Block of each code point, indexed by c >> kScriptBlockShift.\n";
+printf("constexpr uint8 kScriptBlockIndex[%d] = {\n", scalar(@index));
+print_list('    ', @index);
+print "};\n\n";
+print "// Script of each code point in a block, indexed by c & kScriptBlockMask.\n";
+printf("constexpr uint8 kScriptBlocks[%d][%d] = {\n", scalar(@blocks),
+       $kBlockSize);
+for my $key (@blocks) {
+  print "    {\n";
+  print_list('        ', map { "U_$_" } split(/ /, $key));
+  print "    },\n";
+}
+print "};\n";
 print "}  // namespace\n";
 print "}  // namespace unicode_script\n";
 print "}  // namespace sentencepiece\n";
@@ -167,12 +167,48 @@ class SentencePieceProcessor(object):
     def serialized_model_proto(self):
         return _sentencepiece.SentencePieceProcessor_serialized_model_proto(self)
 
+    def precompiled_model_file(self):
+        return _sentencepiece.SentencePieceProcessor_precompiled_model_file(self)
+
     def LoadFromFile(self, arg):
         return _sentencepiece.SentencePieceProcessor_LoadFromFile(self, arg)
 
+    def _SavePrecompiled(self, filename):
+        return _sentencepiece.SentencePieceProcessor__SavePrecompiled(self, filename)
+
     def DecodeIdsWithCheck(self, ids):
         return _sentencepiece.SentencePieceProcessor_DecodeIdsWithCheck(self, ids)
 
+    def _EncodeAsIdsBatch(self, inputs, num_threads):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsBatch(self, inputs, num_threads)
+
+    def _EncodeAsIdsFlat(self, inputs, num_threads):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsFlat(self, inputs, num_threads)
+
+    def _EncodeAsIdsWithOffsetsFlat(self, inputs, num_threads):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat(self, inputs, num_threads)
+
+    def _EncodeAsIdsPadded(self, inputs, num_threads, pad_id):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsIdsPadded(self, inputs, num_threads, pad_id)
+
+    def _DecodeIdsFlat(self, ids_buffer, offsets_buffer, num_threads):
+        return _sentencepiece.SentencePieceProcessor__DecodeIdsFlat(self, ids_buffer, offsets_buffer, num_threads)
+
+    def _DecodeIdsBuffer(self, ids_buffer, num_threads):
+        return _sentencepiece.SentencePieceProcessor__DecodeIdsBuffer(self, ids_buffer, num_threads)
+
+    def _MakePieceTable(self):
+        return _sentencepiece.SentencePieceProcessor__MakePieceTable(self)
+
+    def _EncodeAsPiecesCached(self, input, table):
+        return _sentencepiece.SentencePieceProcessor__EncodeAsPiecesCached(self, input, table)
+
+    def _SampleEncodeAsPiecesCached(self, input, nbest_size, alpha, table):
+        return _sentencepiece.SentencePieceProcessor__SampleEncodeAsPiecesCached(self, input, nbest_size, alpha, table)
+
+    def _NBestEncodeAsPiecesCached(self, input, nbest_size, table):
+        return _sentencepiece.SentencePieceProcessor__NBestEncodeAsPiecesCached(self, input, nbest_size, table)
+
     def DecodeIdsAsSerializedProtoWithCheck(self, ids):
         return _sentencepiece.SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck(self, ids)
 
@@ -214,6 +250,7 @@ class SentencePieceProcessor(object):
       self._enable_sampling = enable_sampling
       self._nbest_size = nbest_size
       self._alpha = alpha
+      self._piece_table = None
       if model_file or model_proto:
         self.Load(model_file=model_file, model_proto=model_proto)
 
@@ -226,11 +263,13 @@ class SentencePieceProcessor(object):
                reverse=None,
                enable_sampling=None,
                nbest_size=None,
-               alpha=None):
+               alpha=None,
+               num_threads=None):
       """Encode text input to segmented ids or tokens.
 
         Args:
-        input: input string. accepsts list of string.
+        input: input string. accepsts list of string, bytes-like objects,
+          e.g., memoryview, and pyarrow string arrays.
         out_type: output type. int or str.
         add_bos: Add <s> to the result (Default = false)
         add_eos: Add </s> to the result (Default = false) <s>/</s> is added after
@@ -244,6 +283,9 @@ class SentencePieceProcessor(object):
                       forward-filtering-and-backward-sampling algorithm.
         alpha: Soothing parameter for unigram sampling, and merge probability for
                BPE-dropout (probablity 'p' in BPE-dropout paper).
+        num_threads: the number of threads used to encode a list of inputs into
+                     ids without sampling (Default = 1). The GIL is released
+                     while encoding.
       """
 
       if out_type is None:
@@ -282,6 +324,9 @@ class SentencePieceProcessor(object):
           else:
             result = self.EncodeAsPieces(text)
 
+        return _postprocess(result)
+
+      def _postprocess(result):
         if reverse:
           result.reverse()
         if add_bos:
@@ -298,14 +343,110 @@ class SentencePieceProcessor(object):
 
         return result
 
+      if _is_arrow_strings(input):
+        if out_type is int and not enable_sampling:
+          results = self._EncodeAsIdsBatch(
+              _as_string_batch(input), 1 if num_threads is None else num_threads)
+          return [_postprocess(r) for r in results]
+        input = input.to_pylist()
+
       if type(input) is list:
+        if out_type is int and not enable_sampling:
+          results = self._EncodeAsIdsBatch(
+              input, 1 if num_threads is None else num_threads)
+          return [_postprocess(r) for r in results]
         return [_encode(n) for n in input]
 
       return _encode(input)
 
 
-    def Decode(self, input):
-      """Decode processed id or token sequences."""
+    def EncodeAsIdsFlat(self, input, num_threads=None, buffer_type='array'):
+      """Encodes a list of strings into one flat buffer of ids.
+
+      Unlike Encode(), this creates no Python int per id and releases the GIL
+      while encoding. The strings are not copied.
+
+      Args:
+        input: a list of str or bytes-like objects, a tuple (buffer, offsets)
+          of the concatenated strings, where input i is
+          buffer[offsets[i]:offsets[i + 1]], or a pyarrow string or binary
+          array, whose nulls are encoded as empty strings.
+        num_threads: the number of threads used to encode (Default = 1).
+        buffer_type: 'array' returns array.array, 'numpy' returns NumPy arrays.
+
+      Returns:
+        (ids, offsets), where the ids of input[i] are
+        ids[offsets[i]:offsets[i + 1]]. ids are int32 and offsets are int64.
+      """
+      ids, offsets = self._EncodeAsIdsFlat(
+          _as_string_batch(input), 1 if num_threads is None else num_threads)
+      return (_make_int_buffer(ids, 'i', buffer_type),
+              _make_int_buffer(offsets, 'q', buffer_type))
+
+
+    def EncodeAsIdsWithOffsetsFlat(self, input, num_threads=None,
+                                   buffer_type='array'):
+      """Same as EncodeAsIdsFlat(), also returning the byte offsets of the ids.
+
+      The offsets come from the normalizer alignment without building a
+      SentencePieceText, so framework ops can wrap them as they are.
+
+      Returns:
+        (ids, offsets, begins, ends), where input[i].encode('utf-8')[
+        begins[k]:ends[k]] is the surface of ids[k]. The first id of a repeat
+        run spans the whole run, and its markers are empty. begins and ends
+        are int64.
+      """
+      ids, offsets, begins, ends = self._EncodeAsIdsWithOffsetsFlat(
+          _as_string_batch(input), 1 if num_threads is None else num_threads)
+      return (_make_int_buffer(ids, 'i', buffer_type),
+              _make_int_buffer(offsets, 'q', buffer_type),
+              _make_int_buffer(begins, 'q', buffer_type),
+              _make_int_buffer(ends, 'q', buffer_type))
+
+
+    def EncodeAsIdsPadded(self, input, pad_id=None, num_threads=None):
+      """Encodes a list of strings into a 2-D NumPy array of int32 ids.
+
+      Row i holds the ids of input[i] followed by pad_id up to the length of
+      the longest input. The GIL is released while encoding.
+
+      Args:
+        input: the strings as accepted by EncodeAsIdsFlat().
+        pad_id: the padding id (Default = pad_id() of the model).
+        num_threads: the number of threads used to encode (Default = 1).
+      """
+      if pad_id is None:
+        pad_id = self.pad_id()
+        if pad_id < 0:
+          raise ValueError('The model has no <pad>. Specify pad_id.')
+      import numpy
+      ids, rows, width = self._EncodeAsIdsPadded(
+          _as_string_batch(input), 1 if num_threads is None else num_threads,
+          pad_id)
+      return numpy.frombuffer(ids, dtype=numpy.intc).reshape(rows, width)
+
+
+    def DecodeIdsFlat(self, ids, offsets, num_threads=None):
+      """Decodes the output of EncodeAsIdsFlat() into a list of strings.
+
+      ids and offsets can be any buffers of integers, e.g., array.array or
+      NumPy arrays. The GIL is released while decoding.
+      """
+      return self._DecodeIdsFlat(ids, offsets,
+                                 1 if num_threads is None else num_threads)
+
+
+    def Decode(self, input, num_threads=None):
+      """Decode processed id or token sequences.
+
+      input can also be a 1-D or 2-D buffer of ids, e.g., a NumPy array, whose
+      rows are decoded into a list of strings.
+      """
+
+      if _is_int_buffer(input):
+        return self._DecodeIdsBuffer(input,
+                                     1 if num_threads is None else num_threads)
 
       if not input:
         return self.DecodeIds([])
@@ -335,13 +476,30 @@ class SentencePieceProcessor(object):
       return self.GetPieceSize()
 
 
+    def SavePrecompiled(self, filename):
+      """Saves the model in the precompiled format.
+
+      A processor loaded from a precompiled model is pickled as the path of the
+      file, and unpickling maps the same file instead of parsing and compiling
+      the model again. The processes sharing the model, e.g., the workers of a
+      DataLoader, share its physical pages.
+      """
+      return self._SavePrecompiled(filename)
+
+
     def __getstate__(self):
+      model_file = self.precompiled_model_file()
+      if model_file:
+        return {'precompiled_model_file': os.path.abspath(model_file)}
       return self.serialized_model_proto()
 
 
-    def __setstate__(self, serialized_model_proto):
+    def __setstate__(self, state):
       self.__init__()
-      self.LoadFromSerializedProto(serialized_model_proto)
+      if isinstance(state, dict):
+        self.LoadFromFile(state['precompiled_model_file'])
+      else:
+        self.LoadFromSerializedProto(state)
 
 
     def __len__(self):
@@ -468,6 +626,8 @@ def SentencePieceTrainer__TrainFromMap4(args, iter):
 
 import re
 import csv
+import array
+import os
 import sys
 from io import StringIO
 from io import BytesIO
@@ -503,12 +663,115 @@ def _batchnize(classname, name):
   setattr(classname, name, _batched_func)
 
 
+def _make_int_buffer(data, typecode, buffer_type):
+  """Views the bytearray data as integers of the array typecode."""
+  if buffer_type == 'numpy':
+    import numpy
+    return numpy.frombuffer(data, dtype=numpy.dtype(typecode))
+  if buffer_type != 'array':
+    raise ValueError('buffer_type must be "array" or "numpy".')
+  result = array.array(typecode)
+  result.frombytes(data)
+  return result
+
+
+def _is_arrow_strings(obj):
+  """Returns True when obj is a pyarrow string or binary array."""
+  return (hasattr(obj, 'buffers') and hasattr(obj, 'offset') and
+          str(getattr(obj, 'type', '')) in ('string', 'binary', 'large_string',
+                                            'large_binary'))
+
+
+def _as_string_batch(input):
+  """Views a pyarrow string array as a tuple (values, offsets) of its buffers."""
+  if not _is_arrow_strings(input):
+    return input
+  _, offsets, values = input.buffers()[:3]
+  if offsets is None:
+    return []
+  typecode = 'q' if str(input.type).startswith('large_') else 'i'
+  offsets = memoryview(offsets).cast(typecode)
+  return (b'' if values is None else values,
+          offsets[input.offset:input.offset + len(input) + 1])
+
+
+def _is_int_buffer(obj):
+  """Returns True when obj is a buffer of ids rather than a list or string."""
+  if isinstance(obj, (list, tuple, int, str, bytes)):
+    return False
+  try:
+    memoryview(obj)
+  except TypeError:
+    return False
+  return True
+
+
+def _decode_ids(self, ids):
+  """DecodeIds() accepting a buffer of ids, e.g., array.array('i')."""
+  if _is_int_buffer(ids):
+    return self._DecodeIdsBuffer(ids, 1)
+  return self.DecodeIdsWithCheck(ids)
+
+
+def _get_piece_table(self):
+  """Returns the interned str of every piece, made once per loaded model."""
+  table = getattr(self, '_piece_table', None)
+  if table is None:
+    table = self._MakePieceTable()
+    self._piece_table = table
+  return table
+
+
+def _reset_piece_table(func):
+  """Drops the piece table when func loads another model."""
+  def _func(self, *args, **kwargs):
+    self._piece_table = None
+    return func(self, *args, **kwargs)
+  return _func
+
+
+def _encode_as_pieces(self, input):
+  if type(input) is not str:
+    return _encode_as_pieces_native(self, input)
+  return self._EncodeAsPiecesCached(input, _get_piece_table(self))
+
+
+def _sample_encode_as_pieces(self, input, nbest_size, alpha):
+  if type(input) is not str:
+    return _sample_encode_as_pieces_native(self, input, nbest_size, alpha)
+  return self._SampleEncodeAsPiecesCached(input, nbest_size, alpha,
+                                          _get_piece_table(self))
+
+
+def _nbest_encode_as_pieces(self, input, nbest_size):
+  if type(input) is not str:
+    return _nbest_encode_as_pieces_native(self, input, nbest_size)
+  return self._NBestEncodeAsPiecesCached(input, nbest_size,
+                                         _get_piece_table(self))
+
+
+def _id_to_piece(self, arg):
+  """IdToPiece() returning the shared str of the piece table."""
+  table = _get_piece_table(self)
+  size = len(table)
+  def _func(n):
+    if type(n) is not int:
+      return _id_to_piece_native(self, n)
+    if n < 0 or n >= size:
+      raise IndexError('piece id is out of range.')
+    return table[n]
+
+  if type(arg) is list:
+    return [_func(n) for n in arg]
+  return _func(arg)
+
+
 _sentencepiece_processor_init_native = SentencePieceProcessor.__init__
 setattr(SentencePieceProcessor, '__init__', SentencePieceProcessor.Init)
 
 SentencePieceProcessor.Tokenize = SentencePieceProcessor.Encode
 SentencePieceProcessor.Detokenize = SentencePieceProcessor.Decode
-SentencePieceProcessor.DecodeIds = SentencePieceProcessor.DecodeIdsWithCheck
+SentencePieceProcessor.DecodeIds = _decode_ids
 SentencePieceProcessor.DecodeIdsAsSerializedProto = SentencePieceProcessor.DecodeIdsAsSerializedProtoWithCheck
 
 for m in [
@@ -517,6 +780,19 @@ for m in [
 ]:
   _batchnize(SentencePieceProcessor, m)
 
+# Piece outputs share the str objects of the piece table.
+_encode_as_pieces_native = SentencePieceProcessor.EncodeAsPieces
+_sample_encode_as_pieces_native = SentencePieceProcessor.SampleEncodeAsPieces
+_nbest_encode_as_pieces_native = SentencePieceProcessor.NBestEncodeAsPieces
+_id_to_piece_native = SentencePieceProcessor.IdToPiece
+SentencePieceProcessor.EncodeAsPieces = _encode_as_pieces
+SentencePieceProcessor.SampleEncodeAsPieces = _sample_encode_as_pieces
+SentencePieceProcessor.NBestEncodeAsPieces = _nbest_encode_as_pieces
+SentencePieceProcessor.IdToPiece = _id_to_piece
+for m in ['LoadFromFile', 'LoadFromSerializedProto']:
+  setattr(SentencePieceProcessor, m,
+          _reset_piece_table(getattr(SentencePieceProcessor, m)))
+
 _add_snake_case(SentencePieceProcessor)
 _add_snake_case(SentencePieceTrainer)
 set_random_generator_seed = SetRandomGeneratorSeed
@@ -2,7 +2,10 @@
 %include exception.i
 
 %{
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <deque>
 #include <sentencepiece_processor.h>
 #include <sentencepiece_trainer.h>
 
@@ -41,10 +44,22 @@ class PyInputString {
       input_type_ = kByteInput;
     }
 #endif
-    else {
-      str_ = nullptr;
+    else if (PyObject_CheckBuffer(obj)) {
+      // Other bytes-like objects, e.g., memoryview and bytearray, viewed
+      // without a copy.
+      if (PyObject_GetBuffer(obj, &view_, PyBUF_SIMPLE) == 0) {
+        str_ = static_cast<char *>(view_.buf);
+        size_ = view_.len;
+        has_view_ = true;
+        input_type_ = kByteInput;
+      } else {
+        PyErr_Clear();
+      }
     }
   }
+  ~PyInputString() {
+    if (has_view_) PyBuffer_Release(&view_);
+  }
   const char* data() const { return str_; }
   Py_ssize_t size() const { return size_; }
   bool IsAvalable() const { return str_ != nullptr; }
@@ -59,9 +74,14 @@ class PyInputString {
   }
 
  private:
+  PyInputString(const PyInputString &) = delete;
+  PyInputString &operator=(const PyInputString &) = delete;
+
   PyObject* input_type_ = nullptr;
   char* str_ = nullptr;
   Py_ssize_t size_ = 0;
+  Py_buffer view_;
+  bool has_view_ = false;
 };
 
 PyObject* MakePyOutputString(const std::string& output,
@@ -98,11 +118,275 @@ int ToSwigError(sentencepiece::util::StatusCode code) {
   return SWIG_RuntimeError;
 }
 
+// Copies the integers of `in` of type S into `out` of type T. Returns
+// false when a value does not fit into T.
+template <typename S, typename T>
+bool CopyIntegers(const void *in, size_t size, T *out) {
+  const S *values = static_cast<const S *>(in);
+  for (size_t i = 0; i < size; ++i) {
+    const S value = values[i];
+    out[i] = static_cast<T>(value);
+    if (static_cast<S>(out[i]) != value || (value < 0) != (out[i] < 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies a C-contiguous buffer of integers, e.g., an array.array or a NumPy
+// array of any integer dtype, into `out` and its shape into `shape`. Sets a
+// Python error and returns false on failure.
+template <typename T>
+bool CopyIntegerBuffer(PyObject *obj, std::vector<T> *out,
+                       std::vector<Py_ssize_t> *shape = nullptr) {
+  Py_buffer view;
+  if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    return false;
+  }
+  const char *format = view.format == nullptr ? "B" : view.format;
+  if (*format == '@' || *format == '=') ++format;
+  const bool is_signed = format[0] != '\0' && format[1] == '\0' &&
+                         std::strchr("bhilqn", format[0]) != nullptr;
+  const bool is_unsigned = format[0] != '\0' && format[1] == '\0' &&
+                           std::strchr("BHILQN", format[0]) != nullptr;
+  const size_t size = view.itemsize == 0 ? 0 : view.len / view.itemsize;
+  out->resize(size);
+  bool ok = false;
+  if (is_signed || is_unsigned) {
+    switch (view.itemsize) {
+      case 1:
+        ok = is_signed ? CopyIntegers<int8_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint8_t>(view.buf, size, out->data());
+        break;
+      case 2:
+        ok = is_signed ? CopyIntegers<int16_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint16_t>(view.buf, size, out->data());
+        break;
+      case 4:
+        ok = is_signed ? CopyIntegers<int32_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint32_t>(view.buf, size, out->data());
+        break;
+      case 8:
+        ok = is_signed ? CopyIntegers<int64_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint64_t>(view.buf, size, out->data());
+        break;
+    }
+    if (!ok) PyErr_SetString(PyExc_OverflowError, "integer out of range");
+  } else {
+    PyErr_SetString(PyExc_TypeError, "buffer must contain integers");
+  }
+  if (ok && shape != nullptr) {
+    shape->assign(view.shape, view.shape + view.ndim);
+  }
+  PyBuffer_Release(&view);
+  return ok;
+}
+
+// Returns true if `obj` is a tuple (buffer, offsets) of concatenated
+// strings rather than a tuple of two strings.
+bool IsBufferAndOffsets(PyObject *obj) {
+  if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2) return false;
+  PyObject *offsets = PyTuple_GET_ITEM(obj, 1);
+  return PyObject_CheckBuffer(PyTuple_GET_ITEM(obj, 0)) &&
+         !PyUnicode_Check(offsets) && !PyBytes_Check(offsets);
+}
+
+// Reads `obj`, a buffer or a sequence of integers, into `offsets`. Returns
+// false without a Python error on failure.
+bool GetStringOffsets(PyObject *obj, std::vector<int64_t> *offsets) {
+  if (CopyIntegerBuffer(obj, offsets)) return true;
+  // Not a buffer of integers, e.g., a list.
+  PyErr_Clear();
+  PyObject *seq = PySequence_Fast(obj, "");
+  if (seq == nullptr) {
+    PyErr_Clear();
+    return false;
+  }
+  const Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+  offsets->resize(size);
+  for (Py_ssize_t i = 0; i < size; ++i) {
+    (*offsets)[i] = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(seq, i));
+  }
+  Py_DECREF(seq);
+  if (PyErr_Occurred()) {
+    PyErr_Clear();
+    return false;
+  }
+  return true;
+}
+
+// Returns true if `offsets` are non-decreasing within a buffer of `size`
+// bytes.
+bool IsValidStringOffsets(const std::vector<int64_t> &offsets,
+                          Py_ssize_t size) {
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    if (offsets[i - 1] < 0 || offsets[i - 1] > offsets[i] ||
+        offsets[i] > size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns a bytearray holding the raw bytes of `values`. NumPy views it
+// without a copy, and the view is writable.
+template <typename T>
+PyObject *MakePyByteArray(const std::vector<T> &values) {
+  return PyByteArray_FromStringAndSize(
+      reinterpret_cast<const char *>(values.data()),
+      values.size() * sizeof(T));
+}
+
+PyObject *MakePyOutputStringList(const std::vector<std::string> &outputs) {
+  PyObject *list = PyList_New(outputs.size());
+  if (list == nullptr) return nullptr;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    PyList_SetItem(list, i, MakePyOutputString(outputs[i], nullptr));
+  }
+  return list;
+}
+
+// Returns true if `table` is a list of a piece string per id of
+// `processor`, or sets a Python error.
+bool IsPieceTable(const sentencepiece::SentencePieceProcessor &processor,
+                  PyObject *table) {
+  if (!PyList_Check(table) ||
+      PyList_GET_SIZE(table) != processor.GetPieceSize()) {
+    PyErr_SetString(PyExc_ValueError, "piece table does not match the model");
+    return false;
+  }
+  return true;
+}
+
+// Returns the list of the pieces of `ids`. A piece with an empty text is
+// shared from `table`, the list of the piece strings of all ids, and the
+// others are made from their text.
+PyObject *MakePyPieceList(const std::vector<int> &ids,
+                          const std::vector<std::string> &pieces,
+                          PyObject *table) {
+  PyObject *list = PyList_New(ids.size());
+  if (list == nullptr) return nullptr;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    PyObject *item = nullptr;
+    if (pieces[i].empty()) {
+      item = PyList_GET_ITEM(table, ids[i]);
+      Py_INCREF(item);
+    } else {
+      item = MakePyOutputString(pieces[i], nullptr);
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+// The strings of a batch to encode, viewed without copies. The batch is
+// either
+//  - a list or a tuple of str, bytes or other bytes-like objects, or
+//  - a tuple (buffer, offsets) as fed to the trainer, e.g., the values and
+//    the offsets of an Arrow string array.
+// The strings are referenced until destruction, so that the views stay
+// valid while the GIL is released.
+class PyInputStringBatch {
+ public:
+  PyInputStringBatch() = default;
+
+  ~PyInputStringBatch() {
+    for (Py_buffer &view : buffers_) PyBuffer_Release(&view);
+    for (PyObject *obj : objects_) Py_DECREF(obj);
+  }
+
+  // Sets a Python error and returns false if `obj` is not a batch.
+  bool Init(PyObject *obj) {
+    if (IsBufferAndOffsets(obj)) {
+      std::vector<int64_t> offsets;
+      if (!GetStringOffsets(PyTuple_GET_ITEM(obj, 1), &offsets)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "offsets must be a sequence of integers");
+        return false;
+      }
+      const char *data = nullptr;
+      Py_ssize_t size = 0;
+      if (!AddBuffer(PyTuple_GET_ITEM(obj, 0), &data, &size)) return false;
+      if (!IsValidStringOffsets(offsets, size)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "offsets are out of range of the buffer");
+        return false;
+      }
+      views_.reserve(offsets.empty() ? 0 : offsets.size() - 1);
+      for (size_t i = 1; i < offsets.size(); ++i) {
+        views_.emplace_back(data + offsets[i - 1],
+                            offsets[i] - offsets[i - 1]);
+      }
+      return true;
+    }
+
+    if (!PyList_Check(obj) && !PyTuple_Check(obj)) {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      return false;
+    }
+    const Py_ssize_t size = PySequence_Fast_GET_SIZE(obj);
+    PyObject **items = PySequence_Fast_ITEMS(obj);
+    views_.reserve(size);
+    objects_.reserve(size);
+    for (Py_ssize_t i = 0; i < size; ++i) {
+      PyObject *item = items[i];
+      if (PyUnicode_Check(item) || PyBytes_Check(item)) {
+        const PyInputString ustring(item);
+        if (!ustring.IsAvalable()) {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          return false;
+        }
+        Py_INCREF(item);
+        objects_.push_back(item);
+        views_.emplace_back(ustring.data(), ustring.size());
+      } else {
+        const char *data = nullptr;
+        Py_ssize_t data_size = 0;
+        if (!AddBuffer(item, &data, &data_size)) return false;
+        views_.emplace_back(data, data_size);
+      }
+    }
+    return true;
+  }
+
+  std::vector<absl::string_view> *views() { return &views_; }
+
+ private:
+  PyInputStringBatch(const PyInputStringBatch &) = delete;
+  PyInputStringBatch &operator=(const PyInputStringBatch &) = delete;
+
+  // Views the bytes-like `obj` until destruction.
+  bool AddBuffer(PyObject *obj, const char **data, Py_ssize_t *size) {
+    Py_buffer view;
+    if (!PyObject_CheckBuffer(obj) ||
+        PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) != 0) {
+      PyErr_Clear();
+      PyErr_SetString(PyExc_TypeError, "list must contain strings");
+      return false;
+    }
+    buffers_.push_back(view);
+    *data = static_cast<const char *>(view.buf);
+    *size = view.len;
+    return true;
+  }
+
+  std::vector<absl::string_view> views_;
+  std::vector<PyObject *> objects_;
+  std::deque<Py_buffer> buffers_;  // not moved once exported.
+};
+
+// Feeds the items of a Python iterator to the trainer. An item is either
+// one sentence (str or bytes) or a batch of sentences, which is converted
+// with a single call into Python:
+//  - a list or a tuple of str or bytes.
+//  - a tuple (buffer, offsets) of a bytes-like object holding the
+//    concatenated sentences and n + 1 integer offsets, e.g., a NumPy array,
+//    so that sentence i is buffer[offsets[i]:offsets[i + 1]].
+// Trailing newlines of the sentences are removed.
 class PySentenceIterator : public sentencepiece::SentenceIterator {
   public:
   PySentenceIterator(PyObject *iter) : iter_(iter) {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
+    Next();
   }
 
   ~PySentenceIterator() {
@@ -110,12 +394,17 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
   }
 
   bool done() const override {
-    return item_ == nullptr;
+    return done_;
   }
 
   void Next() override {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
+    while (index_ == batch_.size()) {
+      if (done_ || !Fill()) {
+        done_ = true;
+        return;
+      }
+    }
+    value_.swap(batch_[index_++]);
   }
 
   const std::string &value() const override {
@@ -127,33 +416,111 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
   }
 
   private:
-   void CopyValue() {
-     if (item_ == nullptr) return;
-     const PyInputString ustring(item_);
+   static void AddSentence(const char *data, size_t size,
+                           std::vector<std::string> *batch) {
+     while (size > 0) {
+       if (data[size - 1] == '\r' || data[size - 1] == '\n')
+         --size;
+       else
+         break;
+     }
+     batch->emplace_back(data, size);
+   }
+
+   // Reads the next item into `batch_`. Returns false at the end or on
+   // errors.
+   bool Fill() {
+     batch_.clear();
+     index_ = 0;
+     PyObject *item = PyIter_Next(iter_);
+     if (item == nullptr) {
+       if (PyErr_Occurred()) {
+         PyErr_Clear();
+         SetError("Failed to get the next item of the iterator.");
+         return false;
+       }
+       return false;
+     }
+     const bool ok = CopyItem(item);
+     Py_DECREF(item);
+     return ok;
+   }
+
+   bool CopyItem(PyObject *item) {
+     const PyInputString ustring(item);
      if (ustring.IsAvalable()) {
-       const char *data = ustring.data();
-       size_t size = ustring.size();
-       while (size > 0) {
-         if (data[size - 1] == '\r' || data[size - 1] == '\n')
-           --size;
-         else
-           break;
+       AddSentence(ustring.data(), ustring.size(), &batch_);
+       return true;
+     }
+
+     if (IsBufferAndOffsets(item)) {
+       return CopyBuffer(PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+     }
+
+     if (PyList_Check(item) || PyTuple_Check(item)) {
+       const Py_ssize_t size = PySequence_Fast_GET_SIZE(item);
+       PyObject **items = PySequence_Fast_ITEMS(item);
+       batch_.reserve(size);
+       for (Py_ssize_t i = 0; i < size; ++i) {
+         const PyInputString ustring(items[i]);
+         if (!ustring.IsAvalable()) return SetError("Not a string.");
+         AddSentence(ustring.data(), ustring.size(), &batch_);
+       }
+       return true;
+     }
+
+     return SetError("Not a string.");
+   }
+
+   bool CopyBuffer(PyObject *buffer, PyObject *offsets_obj) {
+     std::vector<int64_t> offsets;
+     if (!GetStringOffsets(offsets_obj, &offsets)) {
+       return SetError("offsets must be a sequence of integers.");
+     }
+
+     Py_buffer view;
+     if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE) != 0) {
+       PyErr_Clear();
+       return SetError("Not a bytes-like object.");
+     }
+     const bool ok = IsValidStringOffsets(offsets, view.len);
+     if (ok) {
+       const char *data = static_cast<const char *>(view.buf);
+       batch_.reserve(offsets.empty() ? 0 : offsets.size() - 1);
+       for (size_t i = 1; i < offsets.size(); ++i) {
+         AddSentence(data + offsets[i - 1], offsets[i] - offsets[i - 1],
+                     &batch_);
        }
-       value_.assign(data, size);
-     } else {
-       status_ = sentencepiece::util::Status(sentencepiece::util::StatusCode::kInternal,
-                                             "Not a string.");
      }
-     Py_XDECREF(item_);
+     PyBuffer_Release(&view);
+     return ok || SetError("offsets are out of range of the buffer.");
    }
+
+   bool SetError(const char *message) {
+     status_ = sentencepiece::util::Status(
+         sentencepiece::util::StatusCode::kInternal, message);
+     return false;
+   }
+
    PyObject *iter_ = nullptr;
-   PyObject *item_ = nullptr;
+   bool done_ = false;
+   std::vector<std::string> batch_;
+   size_t index_ = 0;
    std::string value_;
    sentencepiece::util::Status status_;
 };
 }
 %}
 
+%init %{
+#ifdef Py_GIL_DISABLED
+  // The wrapper keeps no global state, and the const methods of a processor
+  // may run on many threads at once, each with a workspace of its thread,
+  // so the module runs without the GIL on free-threaded builds.
+  PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+%}
+
 %exception {
   try {
     $action
@@ -175,6 +542,80 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
 %ignore sentencepiece::SentencePieceProcessor::Encode;
 %ignore sentencepiece::SentencePieceProcessor::SampleEncode;
 %ignore sentencepiece::SentencePieceProcessor::NBestEncode;
+%ignore sentencepiece::SentencePieceProcessor::NBestEncodeBatch;
+%ignore sentencepiece::SentencePieceProcessor::SampleEncodeBatch;
+%ignore sentencepiece::SentencePieceProcessor::CalculateEntropy;
+%ignore sentencepiece::SentencePieceProcessor::PieceMarginals;
+%ignore sentencepiece::SentencePieceProcessor::EncodeIds;
+%ignore sentencepiece::SentencePieceProcessor::EncodePiecesWithIds;
+%ignore sentencepiece::SentencePieceProcessor::SampleEncodePiecesWithIds;
+%ignore sentencepiece::SentencePieceProcessor::NBestEncodePiecesWithIds;
+%ignore sentencepiece::SentencePieceProcessor::EncodePreNormalized;
+%ignore sentencepiece::SentencePieceProcessor::SetCheckPreNormalized;
+%ignore sentencepiece::SentencePieceProcessor::EncodePieces;
+%ignore sentencepiece::SentencePieceProcessor::EncodePieceViews;
+%ignore sentencepiece::SentencePieceProcessor::EncodeBatch;
+%ignore sentencepiece::SentencePieceProcessor::EncodeBatchBucketed;
+%ignore sentencepiece::SentencePieceProcessor::EncodeBatchPadded;
+%ignore sentencepiece::SentencePieceProcessor::CountTokens;
+%ignore sentencepiece::SentencePieceProcessor::CountTokensBatch;
+%ignore sentencepiece::SentencePieceProcessor::DecodeBatch;
+%ignore sentencepiece::SentencePieceProcessor::EncodeAsFlatResult;
+%ignore sentencepiece::SentencePieceProcessor::NBestEncodeAsFlatResult;
+%ignore sentencepiece::SentencePieceProcessor::LoadStatic;
+%ignore sentencepiece::SentencePieceProcessor::SetLoadMode;
+%ignore sentencepiece::SentencePieceProcessor::SetSelfTestMode;
+%ignore sentencepiece::SentencePieceProcessor::SelfTest;
+%ignore sentencepiece::SentencePieceProcessor::WarmUp;
+%ignore sentencepiece::SentencePieceProcessor::SetCollapseRepeatRuns;
+%ignore sentencepiece::SentencePieceProcessor::SetSampleBeam;
+%ignore sentencepiece::SentencePieceProcessor::SetEncodeCacheSize;
+%ignore sentencepiece::SentencePieceProcessor::SetSharedEncodeCache;
+%ignore sentencepiece::SentencePieceProcessor::SetWordCacheSize;
+%ignore sentencepiece::SentencePieceProcessor::SetEncodeMaxTokens;
+%ignore sentencepiece::SentencePieceProcessor::SetEncodeNumThreads;
+%ignore sentencepiece::SentencePieceProcessor::SetDecodeMaxRepeatCount;
+%ignore sentencepiece::SentencePieceProcessor::SetDecodeMaxExpansion;
+%ignore sentencepiece::SentencePieceProcessor::VerifyOutputsEquivalent;
+%ignore sentencepiece::SentencePieceProcessor::SerializeVocabularyCounts;
+%ignore sentencepiece::SentencePieceProcessor::GetStats;
+%ignore sentencepiece::SentencePieceProcessor::GetMemoryUsage;
+%ignore sentencepiece::SentencePieceProcessor::EncodeWorkspaceMemoryUsage;
+%ignore sentencepiece::SentencePieceProcessor::SetTracer;
+%ignore sentencepiece::SentencePieceProcessor::SetBatchEncodeBackend;
+%ignore sentencepiece::SentencePieceProcessor::batch_encode_backend;
+%ignore sentencepiece::SentencePieceProcessor::MakeVocabularyMask;
+%ignore sentencepiece::SentencePieceProcessor::MakeExtraOptions;
+%ignore sentencepiece::BatchEncodeBackend;
+%ignore sentencepiece::TruncationSide;
+%ignore sentencepiece::SelfTestMode;
+%ignore sentencepiece::LoadMode;
+%ignore sentencepiece::StaticModel;
+%ignore sentencepiece::VocabularyMask;
+%ignore sentencepiece::ExtraOptions;
+%ignore sentencepiece::EncodedPiece;
+%ignore sentencepiece::CompactPiece;
+%ignore sentencepiece::NBestIds;
+%ignore sentencepiece::FlatResultFlags;
+%ignore sentencepiece::FlatResultView;
+%ignore sentencepiece::EncodeWorkspace;
+%ignore sentencepiece::EncodeStats;
+%ignore sentencepiece::MemoryUsage;
+%ignore sentencepiece::WarmUpOptions;
+%ignore sentencepiece::TraceStage;
+%ignore sentencepiece::TraceStageName;
+%ignore sentencepiece::TraceEvent;
+%ignore sentencepiece::Tracer;
+%ignore sentencepiece::ChromeTraceWriter;
+%ignore sentencepiece::CompiledModel;
+%ignore sentencepiece::StreamingEncoder;
+%ignore sentencepiece::IncrementalEncoder;
+%ignore sentencepiece::StreamingDecoder;
+%ignore sentencepiece::ProcessorHandle;
+%ignore sentencepiece::MultiModelEncoder;
+%ignore sentencepiece::AsyncEncodeOptions;
+%ignore sentencepiece::AsyncEncodeResult;
+%ignore sentencepiece::AsyncEncoder;
 %ignore sentencepiece::SentencePieceProcessor::Decode;
 %ignore sentencepiece::SentencePieceProcessor::DecodeIds;
 %ignore sentencepiece::SentencePieceProcessor::DecodeIdsAsSerializedProto;
@@ -192,12 +633,20 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
 %ignore sentencepiece::SentencePieceTrainer::PieceProcecssor;
 %ignore sentencepiece::SentencePieceTrainer::SetPretokenizerForTraining;
 %ignore sentencepiece::SentencePieceTrainer::GetPretokenizerForTraining;
+%ignore sentencepiece::SentencePieceTrainer::SetShardReducerForTraining;
+%ignore sentencepiece::SentencePieceTrainer::GetShardReducerForTraining;
 
 %extend sentencepiece::SentencePieceProcessor {
   sentencepiece::util::Status LoadFromFile(absl::string_view arg) {
     return $self->Load(arg);
   }
 
+  void _SavePrecompiled(absl::string_view filename) {
+    const auto _status =
+        sentencepiece::io::SavePrecompiledModel(filename, $self->model_proto());
+    if (!_status.ok()) throw _status;
+  }
+
   std::string DecodeIdsWithCheck(
       const std::vector<int> &ids) const {
     for (int id : ids)
@@ -208,6 +657,185 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
     return $self->DecodeIds(ids);
   }
 
+  std::vector<std::vector<int>> _EncodeAsIdsBatch(
+      const std::vector<absl::string_view> &inputs, int num_threads) const {
+    std::vector<std::vector<int>> ids;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = $self->EncodeBatch(inputs, &ids, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    return ids;
+  }
+
+  // Returns (ids, offsets) as the bytearrays of native int32 and int64.
+  PyObject *_EncodeAsIdsFlat(const std::vector<absl::string_view> &inputs,
+                             int num_threads) const {
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = $self->EncodeBatch(inputs, &ids, &offsets, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    const std::vector<int64_t> offsets64(offsets.begin(), offsets.end());
+    return Py_BuildValue("(NN)", MakePyByteArray(ids),
+                         MakePyByteArray(offsets64));
+  }
+
+  // Returns (ids, offsets, begins, ends) as the bytearrays of native int32
+  // and int64, where begins and ends are the byte offsets of the ids.
+  PyObject *_EncodeAsIdsWithOffsetsFlat(
+      const std::vector<absl::string_view> &inputs, int num_threads) const {
+    std::vector<int> ids;
+    std::vector<size_t> offsets, begins, ends;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = $self->EncodeBatch(inputs, &ids, &offsets, &begins, &ends,
+                                num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    const std::vector<int64_t> offsets64(offsets.begin(), offsets.end());
+    const std::vector<int64_t> begins64(begins.begin(), begins.end());
+    const std::vector<int64_t> ends64(ends.begin(), ends.end());
+    return Py_BuildValue("(NNNN)", MakePyByteArray(ids),
+                         MakePyByteArray(offsets64), MakePyByteArray(begins64),
+                         MakePyByteArray(ends64));
+  }
+
+  // Returns (ids, rows, width), where ids is the bytearray of a row-major
+  // rows x width matrix of native int32 padded with `pad_id`.
+  PyObject *_EncodeAsIdsPadded(const std::vector<absl::string_view> &inputs,
+                               int num_threads, int pad_id) const {
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    std::vector<int> padded;
+    size_t width = 0;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = $self->EncodeBatch(inputs, &ids, &offsets, num_threads);
+    if (status.ok()) {
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        width = std::max(width, offsets[i + 1] - offsets[i]);
+      }
+      padded.resize(inputs.size() * width, pad_id);
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        std::copy(ids.begin() + offsets[i], ids.begin() + offsets[i + 1],
+                  padded.begin() + i * width);
+      }
+    }
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    return Py_BuildValue("(Nnn)", MakePyByteArray(padded),
+                         static_cast<Py_ssize_t>(inputs.size()),
+                         static_cast<Py_ssize_t>(width));
+  }
+
+  PyObject *_DecodeIdsFlat(PyObject *ids_buffer, PyObject *offsets_buffer,
+                           int num_threads) const {
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    if (!CopyIntegerBuffer(ids_buffer, &ids) ||
+        !CopyIntegerBuffer(offsets_buffer, &offsets)) {
+      return nullptr;
+    }
+    std::vector<std::string> outputs;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = $self->DecodeBatch(ids, offsets, &outputs, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    return MakePyOutputStringList(outputs);
+  }
+
+  // Decodes a 1-D buffer into a string, and the rows of a 2-D buffer into
+  // a list of strings.
+  PyObject *_DecodeIdsBuffer(PyObject *ids_buffer, int num_threads) const {
+    std::vector<int> ids;
+    std::vector<Py_ssize_t> shape;
+    if (!CopyIntegerBuffer(ids_buffer, &ids, &shape)) return nullptr;
+    if (shape.size() > 2) {
+      PyErr_SetString(PyExc_TypeError, "buffer must be 1-D or 2-D");
+      return nullptr;
+    }
+    const size_t rows = shape.size() == 2 ? shape[0] : 1;
+    const size_t cols = rows == 0 ? 0 : ids.size() / rows;
+    std::vector<size_t> offsets(rows + 1);
+    for (size_t i = 0; i <= rows; ++i) offsets[i] = i * cols;
+    std::vector<std::string> outputs;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = $self->DecodeBatch(ids, offsets, &outputs, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    if (shape.size() == 2) return MakePyOutputStringList(outputs);
+    return MakePyOutputString(outputs[0], nullptr);
+  }
+
+  // Returns the pieces of all ids as a list of interned str, which the
+  // piece outputs share instead of making a str per piece.
+  PyObject *_MakePieceTable() const {
+    const int size = $self->GetPieceSize();
+    PyObject *table = PyList_New(size);
+    if (table == nullptr) return nullptr;
+    for (int id = 0; id < size; ++id) {
+      const std::string &piece = $self->IdToPiece(id);
+      PyObject *item = PyUnicode_FromStringAndSize(piece.data(), piece.size());
+      if (item == nullptr) {
+        Py_DECREF(table);
+        return nullptr;
+      }
+#if PY_VERSION_HEX >= 0x03000000
+      PyUnicode_InternInPlace(&item);
+#endif
+      PyList_SET_ITEM(table, id, item);
+    }
+    return table;
+  }
+
+  PyObject *_EncodeAsPiecesCached(absl::string_view input,
+                                  PyObject *table) const {
+    if (!IsPieceTable(*$self, table)) return nullptr;
+    std::vector<int> ids;
+    std::vector<std::string> pieces;
+    const auto status = $self->EncodePiecesWithIds(input, &ids, &pieces);
+    if (!status.ok()) throw status;
+    return MakePyPieceList(ids, pieces, table);
+  }
+
+  PyObject *_SampleEncodeAsPiecesCached(absl::string_view input,
+                                        int nbest_size, float alpha,
+                                        PyObject *table) const {
+    if (!IsPieceTable(*$self, table)) return nullptr;
+    std::vector<int> ids;
+    std::vector<std::string> pieces;
+    const auto status = $self->SampleEncodePiecesWithIds(input, nbest_size,
+                                                         alpha, &ids, &pieces);
+    if (!status.ok()) throw status;
+    return MakePyPieceList(ids, pieces, table);
+  }
+
+  PyObject *_NBestEncodeAsPiecesCached(absl::string_view input,
+                                       int nbest_size, PyObject *table) const {
+    if (!IsPieceTable(*$self, table)) return nullptr;
+    std::vector<std::vector<int>> ids;
+    std::vector<std::vector<std::string>> pieces;
+    const auto status =
+        $self->NBestEncodePiecesWithIds(input, nbest_size, &ids, &pieces);
+    if (!status.ok()) throw status;
+    PyObject *list = PyList_New(ids.size());
+    if (list == nullptr) return nullptr;
+    for (size_t i = 0; i < ids.size(); ++i) {
+      PyObject *item = MakePyPieceList(ids[i], pieces[i], table);
+      if (item == nullptr) {
+        Py_DECREF(list);
+        return nullptr;
+      }
+      PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+  }
+
   util::bytes DecodeIdsAsSerializedProtoWithCheck(
       const std::vector<int> &ids) const {
     for (int id : ids)
@@ -257,6 +885,7 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
     self._enable_sampling = enable_sampling
     self._nbest_size = nbest_size
     self._alpha = alpha
+    self._piece_table = None
     if model_file or model_proto:
       self.Load(model_file=model_file, model_proto=model_proto)
 
@@ -269,11 +898,13 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
              reverse=None,
              enable_sampling=None,
              nbest_size=None,
-             alpha=None):
+             alpha=None,
+             num_threads=None):
     """Encode text input to segmented ids or tokens.
 
       Args:
-      input: input string. accepsts list of string.
+      input: input string. accepsts list of string, bytes-like objects,
+        e.g., memoryview, and pyarrow string arrays.
       out_type: output type. int or str.
       add_bos: Add <s> to the result (Default = false)
       add_eos: Add </s> to the result (Default = false) <s>/</s> is added after
@@ -287,6 +918,9 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
                     forward-filtering-and-backward-sampling algorithm.
       alpha: Soothing parameter for unigram sampling, and merge probability for
              BPE-dropout (probablity 'p' in BPE-dropout paper).
+      num_threads: the number of threads used to encode a list of inputs into
+                   ids without sampling (Default = 1). The GIL is released
+                   while encoding.
     """
 
     if out_type is None:
@@ -325,6 +959,9 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
         else:
           result = self.EncodeAsPieces(text)
 
+      return _postprocess(result)
+
+    def _postprocess(result):
       if reverse:
         result.reverse()
       if add_bos:
@@ -341,14 +978,110 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
 
       return result
 
+    if _is_arrow_strings(input):
+      if out_type is int and not enable_sampling:
+        results = self._EncodeAsIdsBatch(
+            _as_string_batch(input), 1 if num_threads is None else num_threads)
+        return [_postprocess(r) for r in results]
+      input = input.to_pylist()
+
     if type(input) is list:
+      if out_type is int and not enable_sampling:
+        results = self._EncodeAsIdsBatch(
+            input, 1 if num_threads is None else num_threads)
+        return [_postprocess(r) for r in results]
       return [_encode(n) for n in input]
 
     return _encode(input)
 
 
-  def Decode(self, input):
-    """Decode processed id or token sequences."""
+  def EncodeAsIdsFlat(self, input, num_threads=None, buffer_type='array'):
+    """Encodes a list of strings into one flat buffer of ids.
+
+    Unlike Encode(), this creates no Python int per id and releases the GIL
+    while encoding. The strings are not copied.
+
+    Args:
+      input: a list of str or bytes-like objects, a tuple (buffer, offsets)
+        of the concatenated strings, where input i is
+        buffer[offsets[i]:offsets[i + 1]], or a pyarrow string or binary
+        array, whose nulls are encoded as empty strings.
+      num_threads: the number of threads used to encode (Default = 1).
+      buffer_type: 'array' returns array.array, 'numpy' returns NumPy arrays.
+
+    Returns:
+      (ids, offsets), where the ids of input[i] are
+      ids[offsets[i]:offsets[i + 1]]. ids are int32 and offsets are int64.
+    """
+    ids, offsets = self._EncodeAsIdsFlat(
+        _as_string_batch(input), 1 if num_threads is None else num_threads)
+    return (_make_int_buffer(ids, 'i', buffer_type),
+            _make_int_buffer(offsets, 'q', buffer_type))
+
+
+  def EncodeAsIdsWithOffsetsFlat(self, input, num_threads=None,
+                                 buffer_type='array'):
+    """Same as EncodeAsIdsFlat(), also returning the byte offsets of the ids.
+
+    The offsets come from the normalizer alignment without building a
+    SentencePieceText, so framework ops can wrap them as they are.
+
+    Returns:
+      (ids, offsets, begins, ends), where input[i].encode('utf-8')[
+      begins[k]:ends[k]] is the surface of ids[k]. The first id of a repeat
+      run spans the whole run, and its markers are empty. begins and ends
+      are int64.
+    """
+    ids, offsets, begins, ends = self._EncodeAsIdsWithOffsetsFlat(
+        _as_string_batch(input), 1 if num_threads is None else num_threads)
+    return (_make_int_buffer(ids, 'i', buffer_type),
+            _make_int_buffer(offsets, 'q', buffer_type),
+            _make_int_buffer(begins, 'q', buffer_type),
+            _make_int_buffer(ends, 'q', buffer_type))
+
+
+  def EncodeAsIdsPadded(self, input, pad_id=None, num_threads=None):
+    """Encodes a list of strings into a 2-D NumPy array of int32 ids.
+
+    Row i holds the ids of input[i] followed by pad_id up to the length of
+    the longest input. The GIL is released while encoding.
+
+    Args:
+      input: the strings as accepted by EncodeAsIdsFlat().
+      pad_id: the padding id (Default = pad_id() of the model).
+      num_threads: the number of threads used to encode (Default = 1).
+    """
+    if pad_id is None:
+      pad_id = self.pad_id()
+      if pad_id < 0:
+        raise ValueError('The model has no <pad>. Specify pad_id.')
+    import numpy
+    ids, rows, width = self._EncodeAsIdsPadded(
+        _as_string_batch(input), 1 if num_threads is None else num_threads,
+        pad_id)
+    return numpy.frombuffer(ids, dtype=numpy.intc).reshape(rows, width)
+
+
+  def DecodeIdsFlat(self, ids, offsets, num_threads=None):
+    """Decodes the output of EncodeAsIdsFlat() into a list of strings.
+
+    ids and offsets can be any buffers of integers, e.g., array.array or
+    NumPy arrays. The GIL is released while decoding.
+    """
+    return self._DecodeIdsFlat(ids, offsets,
+                               1 if num_threads is None else num_threads)
+
+
+  def Decode(self, input, num_threads=None):
+    """Decode processed id or token sequences.
+
+    input can also be a 1-D or 2-D buffer of ids, e.g., a NumPy array, whose
+    rows are decoded into a list of strings.
+    """
+
+    if _is_int_buffer(input):
+      return self._DecodeIdsBuffer(input,
+                                   1 if num_threads is None else num_threads)
 
     if not input:
       return self.DecodeIds([])
@@ -378,13 +1111,30 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
     return self.GetPieceSize()
 
 
+  def SavePrecompiled(self, filename):
+    """Saves the model in the precompiled format.
+
+    A processor loaded from a precompiled model is pickled as the path of the
+    file, and unpickling maps the same file instead of parsing and compiling
+    the model again. The processes sharing the model, e.g., the workers of a
+    DataLoader, share its physical pages.
+    """
+    return self._SavePrecompiled(filename)
+
+
   def __getstate__(self):
+    model_file = self.precompiled_model_file()
+    if model_file:
+      return {'precompiled_model_file': os.path.abspath(model_file)}
     return self.serialized_model_proto()
 
 
-  def __setstate__(self, serialized_model_proto):
+  def __setstate__(self, state):
     self.__init__()
-    self.LoadFromSerializedProto(serialized_model_proto)
+    if isinstance(state, dict):
+      self.LoadFromFile(state['precompiled_model_file'])
+    else:
+      self.LoadFromSerializedProto(state)
 
 
   def __len__(self):
@@ -597,6 +1347,13 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
   $1 = out;
 }
 
+%typemap(in) const std::vector<absl::string_view>& (PyInputStringBatch batch) {
+  if (!batch.Init($input)) {
+    SWIG_fail;
+  }
+  $1 = batch.views();
+}
+
 %typemap(in) const std::vector<int>& {
   std::vector<int> *out = nullptr;
   if (PyList_Check($input)) {
@@ -689,6 +1446,8 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
 
 import re
 import csv
+import array
+import os
 import sys
 from io import StringIO
 from io import BytesIO
@@ -724,12 +1483,115 @@ def _batchnize(classname, name):
   setattr(classname, name, _batched_func)
 
 
+def _make_int_buffer(data, typecode, buffer_type):
+  """Views the bytearray data as integers of the array typecode."""
+  if buffer_type == 'numpy':
+    import numpy
+    return numpy.frombuffer(data, dtype=numpy.dtype(typecode))
+  if buffer_type != 'array':
+    raise ValueError('buffer_type must be "array" or "numpy".')
+  result = array.array(typecode)
+  result.frombytes(data)
+  return result
+
+
+def _is_arrow_strings(obj):
+  """Returns True when obj is a pyarrow string or binary array."""
+  return (hasattr(obj, 'buffers') and hasattr(obj, 'offset') and
+          str(getattr(obj, 'type', '')) in ('string', 'binary', 'large_string',
+                                            'large_binary'))
+
+
+def _as_string_batch(input):
+  """Views a pyarrow string array as a tuple (values, offsets) of its buffers."""
+  if not _is_arrow_strings(input):
+    return input
+  _, offsets, values = input.buffers()[:3]
+  if offsets is None:
+    return []
+  typecode = 'q' if str(input.type).startswith('large_') else 'i'
+  offsets = memoryview(offsets).cast(typecode)
+  return (b'' if values is None else values,
+          offsets[input.offset:input.offset + len(input) + 1])
+
+
+def _is_int_buffer(obj):
+  """Returns True when obj is a buffer of ids rather than a list or string."""
+  if isinstance(obj, (list, tuple, int, str, bytes)):
+    return False
+  try:
+    memoryview(obj)
+  except TypeError:
+    return False
+  return True
+
+
+def _decode_ids(self, ids):
+  """DecodeIds() accepting a buffer of ids, e.g., array.array('i')."""
+  if _is_int_buffer(ids):
+    return self._DecodeIdsBuffer(ids, 1)
+  return self.DecodeIdsWithCheck(ids)
+
+
+def _get_piece_table(self):
+  """Returns the interned str of every piece, made once per loaded model."""
+  table = getattr(self, '_piece_table', None)
+  if table is None:
+    table = self._MakePieceTable()
+    self._piece_table = table
+  return table
+
+
+def _reset_piece_table(func):
+  """Drops the piece table when func loads another model."""
+  def _func(self, *args, **kwargs):
+    self._piece_table = None
+    return func(self, *args, **kwargs)
+  return _func
+
+
+def _encode_as_pieces(self, input):
+  if type(input) is not str:
+    return _encode_as_pieces_native(self, input)
+  return self._EncodeAsPiecesCached(input, _get_piece_table(self))
+
+
+def _sample_encode_as_pieces(self, input, nbest_size, alpha):
+  if type(input) is not str:
+    return _sample_encode_as_pieces_native(self, input, nbest_size, alpha)
+  return self._SampleEncodeAsPiecesCached(input, nbest_size, alpha,
+                                          _get_piece_table(self))
+
+
+def _nbest_encode_as_pieces(self, input, nbest_size):
+  if type(input) is not str:
+    return _nbest_encode_as_pieces_native(self, input, nbest_size)
+  return self._NBestEncodeAsPiecesCached(input, nbest_size,
+                                         _get_piece_table(self))
+
+
+def _id_to_piece(self, arg):
+  """IdToPiece() returning the shared str of the piece table."""
+  table = _get_piece_table(self)
+  size = len(table)
+  def _func(n):
+    if type(n) is not int:
+      return _id_to_piece_native(self, n)
+    if n < 0 or n >= size:
+      raise IndexError('piece id is out of range.')
+    return table[n]
+
+  if type(arg) is list:
+    return [_func(n) for n in arg]
+  return _func(arg)
+
+
 _sentencepiece_processor_init_native = SentencePieceProcessor.__init__
 setattr(SentencePieceProcessor, '__init__', SentencePieceProcessor.Init)
 
 SentencePieceProcessor.Tokenize = SentencePieceProcessor.Encode
 SentencePieceProcessor.Detokenize = SentencePieceProcessor.Decode
-SentencePieceProcessor.DecodeIds = SentencePieceProcessor.DecodeIdsWithCheck
+SentencePieceProcessor.DecodeIds = _decode_ids
 SentencePieceProcessor.DecodeIdsAsSerializedProto = SentencePieceProcessor.DecodeIdsAsSerializedProtoWithCheck
 
 for m in [
@@ -738,6 +1600,19 @@ for m in [
 ]:
   _batchnize(SentencePieceProcessor, m)
 
+# Piece outputs share the str objects of the piece table.
+_encode_as_pieces_native = SentencePieceProcessor.EncodeAsPieces
+_sample_encode_as_pieces_native = SentencePieceProcessor.SampleEncodeAsPieces
+_nbest_encode_as_pieces_native = SentencePieceProcessor.NBestEncodeAsPieces
+_id_to_piece_native = SentencePieceProcessor.IdToPiece
+SentencePieceProcessor.EncodeAsPieces = _encode_as_pieces
+SentencePieceProcessor.SampleEncodeAsPieces = _sample_encode_as_pieces
+SentencePieceProcessor.NBestEncodeAsPieces = _nbest_encode_as_pieces
+SentencePieceProcessor.IdToPiece = _id_to_piece
+for m in ['LoadFromFile', 'LoadFromSerializedProto']:
+  setattr(SentencePieceProcessor, m,
+          _reset_piece_table(getattr(SentencePieceProcessor, m)))
+
 _add_snake_case(SentencePieceProcessor)
 _add_snake_case(SentencePieceTrainer)
 set_random_generator_seed = SetRandomGeneratorSeed
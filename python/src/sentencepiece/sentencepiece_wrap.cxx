@@ -2773,7 +2773,10 @@ namespace swig {
 }
 
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <deque>
 #include <sentencepiece_processor.h>
 #include <sentencepiece_trainer.h>
 
@@ -2812,10 +2815,22 @@ class PyInputString {
       input_type_ = kByteInput;
     }
 #endif
-    else {
-      str_ = nullptr;
+    else if (PyObject_CheckBuffer(obj)) {
+      // Other bytes-like objects, e.g., memoryview and bytearray, viewed
+      // without a copy.
+      if (PyObject_GetBuffer(obj, &view_, PyBUF_SIMPLE) == 0) {
+        str_ = static_cast<char *>(view_.buf);
+        size_ = view_.len;
+        has_view_ = true;
+        input_type_ = kByteInput;
+      } else {
+        PyErr_Clear();
+      }
     }
   }
+  ~PyInputString() {
+    if (has_view_) PyBuffer_Release(&view_);
+  }
   const char* data() const { return str_; }
   Py_ssize_t size() const { return size_; }
   bool IsAvalable() const { return str_ != nullptr; }
@@ -2830,9 +2845,14 @@ class PyInputString {
   }
 
  private:
+  PyInputString(const PyInputString &) = delete;
+  PyInputString &operator=(const PyInputString &) = delete;
+
   PyObject* input_type_ = nullptr;
   char* str_ = nullptr;
   Py_ssize_t size_ = 0;
+  Py_buffer view_;
+  bool has_view_ = false;
 };
 
 PyObject* MakePyOutputString(const std::string& output,
@@ -2869,11 +2889,275 @@ int ToSwigError(sentencepiece::util::StatusCode code) {
   return SWIG_RuntimeError;
 }
 
+// Copies the integers of `in` of type S into `out` of type T. Returns
+// false when a value does not fit into T.
+template <typename S, typename T>
+bool CopyIntegers(const void *in, size_t size, T *out) {
+  const S *values = static_cast<const S *>(in);
+  for (size_t i = 0; i < size; ++i) {
+    const S value = values[i];
+    out[i] = static_cast<T>(value);
+    if (static_cast<S>(out[i]) != value || (value < 0) != (out[i] < 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies a C-contiguous buffer of integers, e.g., an array.array or a NumPy
+// array of any integer dtype, into `out` and its shape into `shape`. Sets a
+// Python error and returns false on failure.
+template <typename T>
+bool CopyIntegerBuffer(PyObject *obj, std::vector<T> *out,
+                       std::vector<Py_ssize_t> *shape = nullptr) {
+  Py_buffer view;
+  if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    return false;
+  }
+  const char *format = view.format == nullptr ? "B" : view.format;
+  if (*format == '@' || *format == '=') ++format;
+  const bool is_signed = format[0] != '\0' && format[1] == '\0' &&
+                         std::strchr("bhilqn", format[0]) != nullptr;
+  const bool is_unsigned = format[0] != '\0' && format[1] == '\0' &&
+                           std::strchr("BHILQN", format[0]) != nullptr;
+  const size_t size = view.itemsize == 0 ? 0 : view.len / view.itemsize;
+  out->resize(size);
+  bool ok = false;
+  if (is_signed || is_unsigned) {
+    switch (view.itemsize) {
+      case 1:
+        ok = is_signed ? CopyIntegers<int8_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint8_t>(view.buf, size, out->data());
+        break;
+      case 2:
+        ok = is_signed ? CopyIntegers<int16_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint16_t>(view.buf, size, out->data());
+        break;
+      case 4:
+        ok = is_signed ? CopyIntegers<int32_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint32_t>(view.buf, size, out->data());
+        break;
+      case 8:
+        ok = is_signed ? CopyIntegers<int64_t>(view.buf, size, out->data())
+                       : CopyIntegers<uint64_t>(view.buf, size, out->data());
+        break;
+    }
+    if (!ok) PyErr_SetString(PyExc_OverflowError, "integer out of range");
+  } else {
+    PyErr_SetString(PyExc_TypeError, "buffer must contain integers");
+  }
+  if (ok && shape != nullptr) {
+    shape->assign(view.shape, view.shape + view.ndim);
+  }
+  PyBuffer_Release(&view);
+  return ok;
+}
+
+// Returns true if `obj` is a tuple (buffer, offsets) of concatenated
+// strings rather than a tuple of two strings.
+bool IsBufferAndOffsets(PyObject *obj) {
+  if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2) return false;
+  PyObject *offsets = PyTuple_GET_ITEM(obj, 1);
+  return PyObject_CheckBuffer(PyTuple_GET_ITEM(obj, 0)) &&
+         !PyUnicode_Check(offsets) && !PyBytes_Check(offsets);
+}
+
+// Reads `obj`, a buffer or a sequence of integers, into `offsets`. Returns
+// false without a Python error on failure.
+bool GetStringOffsets(PyObject *obj, std::vector<int64_t> *offsets) {
+  if (CopyIntegerBuffer(obj, offsets)) return true;
+  // Not a buffer of integers, e.g., a list.
+  PyErr_Clear();
+  PyObject *seq = PySequence_Fast(obj, "");
+  if (seq == nullptr) {
+    PyErr_Clear();
+    return false;
+  }
+  const Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+  offsets->resize(size);
+  for (Py_ssize_t i = 0; i < size; ++i) {
+    (*offsets)[i] = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(seq, i));
+  }
+  Py_DECREF(seq);
+  if (PyErr_Occurred()) {
+    PyErr_Clear();
+    return false;
+  }
+  return true;
+}
+
+// Returns true if `offsets` are non-decreasing within a buffer of `size`
+// bytes.
+bool IsValidStringOffsets(const std::vector<int64_t> &offsets,
+                          Py_ssize_t size) {
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    if (offsets[i - 1] < 0 || offsets[i - 1] > offsets[i] ||
+        offsets[i] > size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns a bytearray holding the raw bytes of `values`. NumPy views it
+// without a copy, and the view is writable.
+template <typename T>
+PyObject *MakePyByteArray(const std::vector<T> &values) {
+  return PyByteArray_FromStringAndSize(
+      reinterpret_cast<const char *>(values.data()),
+      values.size() * sizeof(T));
+}
+
+PyObject *MakePyOutputStringList(const std::vector<std::string> &outputs) {
+  PyObject *list = PyList_New(outputs.size());
+  if (list == nullptr) return nullptr;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    PyList_SetItem(list, i, MakePyOutputString(outputs[i], nullptr));
+  }
+  return list;
+}
+
+// Returns true if `table` is a list of a piece string per id of
+// `processor`, or sets a Python error.
+bool IsPieceTable(const sentencepiece::SentencePieceProcessor &processor,
+                  PyObject *table) {
+  if (!PyList_Check(table) ||
+      PyList_GET_SIZE(table) != processor.GetPieceSize()) {
+    PyErr_SetString(PyExc_ValueError, "piece table does not match the model");
+    return false;
+  }
+  return true;
+}
+
+// Returns the list of the pieces of `ids`. A piece with an empty text is
+// shared from `table`, the list of the piece strings of all ids, and the
+// others are made from their text.
+PyObject *MakePyPieceList(const std::vector<int> &ids,
+                          const std::vector<std::string> &pieces,
+                          PyObject *table) {
+  PyObject *list = PyList_New(ids.size());
+  if (list == nullptr) return nullptr;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    PyObject *item = nullptr;
+    if (pieces[i].empty()) {
+      item = PyList_GET_ITEM(table, ids[i]);
+      Py_INCREF(item);
+    } else {
+      item = MakePyOutputString(pieces[i], nullptr);
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return list;
+}
+
+// The strings of a batch to encode, viewed without copies. The batch is
+// either
+//  - a list or a tuple of str, bytes or other bytes-like objects, or
+//  - a tuple (buffer, offsets) as fed to the trainer, e.g., the values and
+//    the offsets of an Arrow string array.
+// The strings are referenced until destruction, so that the views stay
+// valid while the GIL is released.
+class PyInputStringBatch {
+ public:
+  PyInputStringBatch() = default;
+
+  ~PyInputStringBatch() {
+    for (Py_buffer &view : buffers_) PyBuffer_Release(&view);
+    for (PyObject *obj : objects_) Py_DECREF(obj);
+  }
+
+  // Sets a Python error and returns false if `obj` is not a batch.
+  bool Init(PyObject *obj) {
+    if (IsBufferAndOffsets(obj)) {
+      std::vector<int64_t> offsets;
+      if (!GetStringOffsets(PyTuple_GET_ITEM(obj, 1), &offsets)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "offsets must be a sequence of integers");
+        return false;
+      }
+      const char *data = nullptr;
+      Py_ssize_t size = 0;
+      if (!AddBuffer(PyTuple_GET_ITEM(obj, 0), &data, &size)) return false;
+      if (!IsValidStringOffsets(offsets, size)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "offsets are out of range of the buffer");
+        return false;
+      }
+      views_.reserve(offsets.empty() ? 0 : offsets.size() - 1);
+      for (size_t i = 1; i < offsets.size(); ++i) {
+        views_.emplace_back(data + offsets[i - 1],
+                            offsets[i] - offsets[i - 1]);
+      }
+      return true;
+    }
+
+    if (!PyList_Check(obj) && !PyTuple_Check(obj)) {
+      PyErr_SetString(PyExc_TypeError, "not a list");
+      return false;
+    }
+    const Py_ssize_t size = PySequence_Fast_GET_SIZE(obj);
+    PyObject **items = PySequence_Fast_ITEMS(obj);
+    views_.reserve(size);
+    objects_.reserve(size);
+    for (Py_ssize_t i = 0; i < size; ++i) {
+      PyObject *item = items[i];
+      if (PyUnicode_Check(item) || PyBytes_Check(item)) {
+        const PyInputString ustring(item);
+        if (!ustring.IsAvalable()) {
+          PyErr_SetString(PyExc_TypeError, "list must contain strings");
+          return false;
+        }
+        Py_INCREF(item);
+        objects_.push_back(item);
+        views_.emplace_back(ustring.data(), ustring.size());
+      } else {
+        const char *data = nullptr;
+        Py_ssize_t data_size = 0;
+        if (!AddBuffer(item, &data, &data_size)) return false;
+        views_.emplace_back(data, data_size);
+      }
+    }
+    return true;
+  }
+
+  std::vector<absl::string_view> *views() { return &views_; }
+
+ private:
+  PyInputStringBatch(const PyInputStringBatch &) = delete;
+  PyInputStringBatch &operator=(const PyInputStringBatch &) = delete;
+
+  // Views the bytes-like `obj` until destruction.
+  bool AddBuffer(PyObject *obj, const char **data, Py_ssize_t *size) {
+    Py_buffer view;
+    if (!PyObject_CheckBuffer(obj) ||
+        PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) != 0) {
+      PyErr_Clear();
+      PyErr_SetString(PyExc_TypeError, "list must contain strings");
+      return false;
+    }
+    buffers_.push_back(view);
+    *data = static_cast<const char *>(view.buf);
+    *size = view.len;
+    return true;
+  }
+
+  std::vector<absl::string_view> views_;
+  std::vector<PyObject *> objects_;
+  std::deque<Py_buffer> buffers_;  // not moved once exported.
+};
+
+// Feeds the items of a Python iterator to the trainer. An item is either
+// one sentence (str or bytes) or a batch of sentences, which is converted
+// with a single call into Python:
+//  - a list or a tuple of str or bytes.
+//  - a tuple (buffer, offsets) of a bytes-like object holding the
+//    concatenated sentences and n + 1 integer offsets, e.g., a NumPy array,
+//    so that sentence i is buffer[offsets[i]:offsets[i + 1]].
+// Trailing newlines of the sentences are removed.
 class PySentenceIterator : public sentencepiece::SentenceIterator {
   public:
   PySentenceIterator(PyObject *iter) : iter_(iter) {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
+    Next();
   }
 
   ~PySentenceIterator() {
@@ -2881,12 +3165,17 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
   }
 
   bool done() const override {
-    return item_ == nullptr;
+    return done_;
   }
 
   void Next() override {
-    item_ = PyIter_Next(iter_);
-    CopyValue();
+    while (index_ == batch_.size()) {
+      if (done_ || !Fill()) {
+        done_ = true;
+        return;
+      }
+    }
+    value_.swap(batch_[index_++]);
   }
 
   const std::string &value() const override {
@@ -2898,27 +3187,96 @@ class PySentenceIterator : public sentencepiece::SentenceIterator {
   }
 
   private:
-   void CopyValue() {
-     if (item_ == nullptr) return;
-     const PyInputString ustring(item_);
+   static void AddSentence(const char *data, size_t size,
+                           std::vector<std::string> *batch) {
+     while (size > 0) {
+       if (data[size - 1] == '\r' || data[size - 1] == '\n')
+         --size;
+       else
+         break;
+     }
+     batch->emplace_back(data, size);
+   }
+
+   // Reads the next item into `batch_`. Returns false at the end or on
+   // errors.
+   bool Fill() {
+     batch_.clear();
+     index_ = 0;
+     PyObject *item = PyIter_Next(iter_);
+     if (item == nullptr) {
+       if (PyErr_Occurred()) {
+         PyErr_Clear();
+         SetError("Failed to get the next item of the iterator.");
+         return false;
+       }
+       return false;
+     }
+     const bool ok = CopyItem(item);
+     Py_DECREF(item);
+     return ok;
+   }
+
+   bool CopyItem(PyObject *item) {
+     const PyInputString ustring(item);
      if (ustring.IsAvalable()) {
-       const char *data = ustring.data();
-       size_t size = ustring.size();
-       while (size > 0) {
-         if (data[size - 1] == '\r' || data[size - 1] == '\n')
-           --size;
-         else
-           break;
+       AddSentence(ustring.data(), ustring.size(), &batch_);
+       return true;
+     }
+
+     if (IsBufferAndOffsets(item)) {
+       return CopyBuffer(PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+     }
+
+     if (PyList_Check(item) || PyTuple_Check(item)) {
+       const Py_ssize_t size = PySequence_Fast_GET_SIZE(item);
+       PyObject **items = PySequence_Fast_ITEMS(item);
+       batch_.reserve(size);
+       for (Py_ssize_t i = 0; i < size; ++i) {
+         const PyInputString ustring(items[i]);
+         if (!ustring.IsAvalable()) return SetError("Not a string.");
+         AddSentence(ustring.data(), ustring.size(), &batch_);
        }
-       value_.assign(data, size);
-     } else {
-       status_ = sentencepiece::util::Status(sentencepiece::util::StatusCode::kInternal,
-                                             "Not a string.");
+       return true;
+     }
+
+     return SetError("Not a string.");
+   }
+
+   bool CopyBuffer(PyObject *buffer, PyObject *offsets_obj) {
+     std::vector<int64_t> offsets;
+     if (!GetStringOffsets(offsets_obj, &offsets)) {
+       return SetError("offsets must be a sequence of integers.");
+     }
+
+     Py_buffer view;
+     if (PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE) != 0) {
+       PyErr_Clear();
+       return SetError("Not a bytes-like object.");
      }
-     Py_XDECREF(item_);
+     const bool ok = IsValidStringOffsets(offsets, view.len);
+     if (ok) {
+       const char *data = static_cast<const char *>(view.buf);
+       batch_.reserve(offsets.empty() ? 0 : offsets.size() - 1);
+       for (size_t i = 1; i < offsets.size(); ++i) {
+         AddSentence(data + offsets[i - 1], offsets[i] - offsets[i - 1],
+                     &batch_);
+       }
+     }
+     PyBuffer_Release(&view);
+     return ok || SetError("offsets are out of range of the buffer.");
+   }
+
+   bool SetError(const char *message) {
+     status_ = sentencepiece::util::Status(
+         sentencepiece::util::StatusCode::kInternal, message);
+     return false;
    }
+
    PyObject *iter_ = nullptr;
-   PyObject *item_ = nullptr;
+   bool done_ = false;
+   std::vector<std::string> batch_;
+   size_t index_ = 0;
    std::string value_;
    sentencepiece::util::Status status_;
 };
@@ -3285,6 +3643,11 @@ SWIGINTERNINLINE PyObject*
 SWIGINTERN sentencepiece::util::Status sentencepiece_SentencePieceProcessor_LoadFromFile(sentencepiece::SentencePieceProcessor *self,absl::string_view arg){
     return self->Load(arg);
   }
+SWIGINTERN void sentencepiece_SentencePieceProcessor__SavePrecompiled(sentencepiece::SentencePieceProcessor *self,absl::string_view filename){
+    const auto _status =
+        sentencepiece::io::SavePrecompiledModel(filename, self->model_proto());
+    if (!_status.ok()) throw _status;
+  }
 SWIGINTERN std::string sentencepiece_SentencePieceProcessor_DecodeIdsWithCheck(sentencepiece::SentencePieceProcessor const *self,std::vector< int > const &ids){
     for (int id : ids)
       if (id < 0 || id >= self->GetPieceSize())
@@ -3293,6 +3656,157 @@ SWIGINTERN std::string sentencepiece_SentencePieceProcessor_DecodeIdsWithCheck(s
             "piece id is out of range.");
     return self->DecodeIds(ids);
   }
+SWIGINTERN std::vector< std::vector< int > > sentencepiece_SentencePieceProcessor__EncodeAsIdsBatch(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &inputs,int num_threads){
+    std::vector<std::vector<int>> ids;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = self->EncodeBatch(inputs, &ids, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    return ids;
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__EncodeAsIdsFlat(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &inputs,int num_threads){
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = self->EncodeBatch(inputs, &ids, &offsets, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    const std::vector<int64_t> offsets64(offsets.begin(), offsets.end());
+    return Py_BuildValue("(NN)", MakePyByteArray(ids),
+                         MakePyByteArray(offsets64));
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &inputs,int num_threads){
+    std::vector<int> ids;
+    std::vector<size_t> offsets, begins, ends;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = self->EncodeBatch(inputs, &ids, &offsets, &begins, &ends,
+                                num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    const std::vector<int64_t> offsets64(offsets.begin(), offsets.end());
+    const std::vector<int64_t> begins64(begins.begin(), begins.end());
+    const std::vector<int64_t> ends64(ends.begin(), ends.end());
+    return Py_BuildValue("(NNNN)", MakePyByteArray(ids),
+                         MakePyByteArray(offsets64), MakePyByteArray(begins64),
+                         MakePyByteArray(ends64));
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__EncodeAsIdsPadded(sentencepiece::SentencePieceProcessor const *self,std::vector< absl::string_view > const &inputs,int num_threads,int pad_id){
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    std::vector<int> padded;
+    size_t width = 0;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = self->EncodeBatch(inputs, &ids, &offsets, num_threads);
+    if (status.ok()) {
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        width = std::max(width, offsets[i + 1] - offsets[i]);
+      }
+      padded.resize(inputs.size() * width, pad_id);
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        std::copy(ids.begin() + offsets[i], ids.begin() + offsets[i + 1],
+                  padded.begin() + i * width);
+      }
+    }
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    return Py_BuildValue("(Nnn)", MakePyByteArray(padded),
+                         static_cast<Py_ssize_t>(inputs.size()),
+                         static_cast<Py_ssize_t>(width));
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__DecodeIdsFlat(sentencepiece::SentencePieceProcessor const *self,PyObject *ids_buffer,PyObject *offsets_buffer,int num_threads){
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    if (!CopyIntegerBuffer(ids_buffer, &ids) ||
+        !CopyIntegerBuffer(offsets_buffer, &offsets)) {
+      return nullptr;
+    }
+    std::vector<std::string> outputs;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = self->DecodeBatch(ids, offsets, &outputs, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    return MakePyOutputStringList(outputs);
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__DecodeIdsBuffer(sentencepiece::SentencePieceProcessor const *self,PyObject *ids_buffer,int num_threads){
+    std::vector<int> ids;
+    std::vector<Py_ssize_t> shape;
+    if (!CopyIntegerBuffer(ids_buffer, &ids, &shape)) return nullptr;
+    if (shape.size() > 2) {
+      PyErr_SetString(PyExc_TypeError, "buffer must be 1-D or 2-D");
+      return nullptr;
+    }
+    const size_t rows = shape.size() == 2 ? shape[0] : 1;
+    const size_t cols = rows == 0 ? 0 : ids.size() / rows;
+    std::vector<size_t> offsets(rows + 1);
+    for (size_t i = 0; i <= rows; ++i) offsets[i] = i * cols;
+    std::vector<std::string> outputs;
+    sentencepiece::util::Status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = self->DecodeBatch(ids, offsets, &outputs, num_threads);
+    Py_END_ALLOW_THREADS
+    if (!status.ok()) throw status;
+    if (shape.size() == 2) return MakePyOutputStringList(outputs);
+    return MakePyOutputString(outputs[0], nullptr);
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__MakePieceTable(sentencepiece::SentencePieceProcessor const *self){
+    const int size = self->GetPieceSize();
+    PyObject *table = PyList_New(size);
+    if (table == nullptr) return nullptr;
+    for (int id = 0; id < size; ++id) {
+      const std::string &piece = self->IdToPiece(id);
+      PyObject *item = PyUnicode_FromStringAndSize(piece.data(), piece.size());
+      if (item == nullptr) {
+        Py_DECREF(table);
+        return nullptr;
+      }
+#if PY_VERSION_HEX >= 0x03000000
+      PyUnicode_InternInPlace(&item);
+#endif
+      PyList_SET_ITEM(table, id, item);
+    }
+    return table;
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__EncodeAsPiecesCached(sentencepiece::SentencePieceProcessor const *self,absl::string_view input,PyObject *table){
+    if (!IsPieceTable(*self, table)) return nullptr;
+    std::vector<int> ids;
+    std::vector<std::string> pieces;
+    const auto status = self->EncodePiecesWithIds(input, &ids, &pieces);
+    if (!status.ok()) throw status;
+    return MakePyPieceList(ids, pieces, table);
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__SampleEncodeAsPiecesCached(sentencepiece::SentencePieceProcessor const *self,absl::string_view input,int nbest_size,float alpha,PyObject *table){
+    if (!IsPieceTable(*self, table)) return nullptr;
+    std::vector<int> ids;
+    std::vector<std::string> pieces;
+    const auto status = self->SampleEncodePiecesWithIds(input, nbest_size,
+                                                         alpha, &ids, &pieces);
+    if (!status.ok()) throw status;
+    return MakePyPieceList(ids, pieces, table);
+  }
+SWIGINTERN PyObject *sentencepiece_SentencePieceProcessor__NBestEncodeAsPiecesCached(sentencepiece::SentencePieceProcessor const *self,absl::string_view input,int nbest_size,PyObject *table){
+    if (!IsPieceTable(*self, table)) return nullptr;
+    std::vector<std::vector<int>> ids;
+    std::vector<std::vector<std::string>> pieces;
+    const auto status =
+        self->NBestEncodePiecesWithIds(input, nbest_size, &ids, &pieces);
+    if (!status.ok()) throw status;
+    PyObject *list = PyList_New(ids.size());
+    if (list == nullptr) return nullptr;
+    for (size_t i = 0; i < ids.size(); ++i) {
+      PyObject *item = MakePyPieceList(ids[i], pieces[i], table);
+      if (item == nullptr) {
+        Py_DECREF(list);
+        return nullptr;
+      }
+      PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+  }
 SWIGINTERN sentencepiece::util::bytes sentencepiece_SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck(sentencepiece::SentencePieceProcessor const *self,std::vector< int > const &ids){
     for (int id : ids)
       if (id < 0 || id >= self->GetPieceSize())
@@ -4866,6 +5380,40 @@ fail:
 }
 
 
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor_precompiled_model_file(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyObject *swig_obj[1] ;
+  std::string result;
+  
+  if (!args) SWIG_fail;
+  swig_obj[0] = args;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor_precompiled_model_file" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    try {
+      result = ((sentencepiece::SentencePieceProcessor const *)arg1)->precompiled_model_file();
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    PyObject *input_type = resultobj;
+    resultobj = MakePyOutputString(result, input_type);
+  }
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
 SWIGINTERN PyObject *_wrap_SentencePieceProcessor_LoadFromFile(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
@@ -4911,79 +5459,58 @@ fail:
 }
 
 
-SWIGINTERN PyObject *_wrap_SentencePieceProcessor_DecodeIdsWithCheck(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SavePrecompiled(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
-  std::vector< int > *arg2 = 0 ;
+  absl::string_view arg2 ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   PyObject *swig_obj[2] ;
-  std::string result;
   
-  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor_DecodeIdsWithCheck", 2, 2, swig_obj)) SWIG_fail;
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__SavePrecompiled", 2, 2, swig_obj)) SWIG_fail;
   res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
   if (!SWIG_IsOK(res1)) {
-    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor_DecodeIdsWithCheck" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__SavePrecompiled" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor *""'"); 
   }
   arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
   {
-    std::vector<int> *out = nullptr;
-    if (PyList_Check(swig_obj[1])) {
-      const size_t size = PyList_Size(swig_obj[1]);
-      out = new std::vector<int>(size);
-      for (size_t i = 0; i < size; ++i) {
-        PyObject *o = PyList_GetItem(swig_obj[1], i);
-        if (PyInt_Check(o)) {
-          (*out)[i] = static_cast<int>(PyInt_AsLong(o));
-        } else {
-          PyErr_SetString(PyExc_TypeError,"list must contain integers");
-          SWIG_fail;
-        }
-      }
-    } else {
-      PyErr_SetString(PyExc_TypeError,"not a list");
+    const PyInputString ustring(swig_obj[1]);
+    if (!ustring.IsAvalable()) {
+      PyErr_SetString(PyExc_TypeError, "not a string");
       SWIG_fail;
     }
-    arg2 = out;
+    resultobj = ustring.input_type();
+    arg2 = absl::string_view(ustring.data(), ustring.size());
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor_DecodeIdsWithCheck((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      sentencepiece_SentencePieceProcessor__SavePrecompiled(arg1,arg2);
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
       SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
     }
   }
-  {
-    PyObject *input_type = resultobj;
-    resultobj = MakePyOutputString(result, input_type);
-  }
-  {
-    delete arg2;
-  }
+  resultobj = SWIG_Py_Void();
   return resultobj;
 fail:
-  {
-    delete arg2;
-  }
   return NULL;
 }
 
 
-SWIGINTERN PyObject *_wrap_SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor_DecodeIdsWithCheck(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
   PyObject *resultobj = 0;
   sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
   std::vector< int > *arg2 = 0 ;
   void *argp1 = 0 ;
   int res1 = 0 ;
   PyObject *swig_obj[2] ;
-  sentencepiece::util::bytes result;
+  std::string result;
   
-  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck", 2, 2, swig_obj)) SWIG_fail;
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor_DecodeIdsWithCheck", 2, 2, swig_obj)) SWIG_fail;
   res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
   if (!SWIG_IsOK(res1)) {
-    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor_DecodeIdsWithCheck" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
   }
   arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
   {
@@ -5008,7 +5535,7 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor_DecodeIdsAsSerializedProtoWith
   }
   {
     try {
-      result = sentencepiece_SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      result = sentencepiece_SentencePieceProcessor_DecodeIdsWithCheck((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
@@ -5016,7 +5543,8 @@ SWIGINTERN PyObject *_wrap_SentencePieceProcessor_DecodeIdsAsSerializedProtoWith
     }
   }
   {
-    resultobj = MakePyOutputBytes(result);
+    PyObject *input_type = resultobj;
+    resultobj = MakePyOutputString(result, input_type);
   }
   {
     delete arg2;
@@ -5030,57 +5558,580 @@ fail:
 }
 
 
-SWIGINTERN PyObject *SentencePieceProcessor_swigregister(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
-  PyObject *obj;
-  if (!SWIG_Python_UnpackTuple(args, "swigregister", 1, 1, &obj)) return NULL;
-  SWIG_TypeNewClientData(SWIGTYPE_p_sentencepiece__SentencePieceProcessor, SWIG_NewClientData(obj));
-  return SWIG_Py_Void();
-}
-
-SWIGINTERN PyObject *SentencePieceProcessor_swiginit(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
-  return SWIG_Python_InitShadowInstance(args);
-}
-
-SWIGINTERN PyObject *_wrap_SetRandomGeneratorSeed(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsBatch(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
   PyObject *resultobj = 0;
-  unsigned int arg1 ;
-  unsigned int val1 ;
-  int ecode1 = 0 ;
-  PyObject *swig_obj[1] ;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  int arg3 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyInputStringBatch batch2 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[3] ;
+  std::vector< std::vector< int > > result;
   
-  if (!args) SWIG_fail;
-  swig_obj[0] = args;
-  ecode1 = SWIG_AsVal_unsigned_SS_int(swig_obj[0], &val1);
-  if (!SWIG_IsOK(ecode1)) {
-    SWIG_exception_fail(SWIG_ArgError(ecode1), "in method '" "SetRandomGeneratorSeed" "', argument " "1"" of type '" "unsigned int""'");
-  } 
-  arg1 = static_cast< unsigned int >(val1);
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsBatch", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsBatch" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    if (!batch2.Init(swig_obj[1])) {
+      SWIG_fail;
+    }
+    arg2 = batch2.views();
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsIdsBatch" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
   {
     try {
-      sentencepiece::SetRandomGeneratorSeed(arg1);
+      result = sentencepiece_SentencePieceProcessor__EncodeAsIdsBatch((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3);
       ReleaseResultObject(resultobj);
     }
     catch (const sentencepiece::util::Status &status) {
       SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
     }
   }
-  resultobj = SWIG_Py_Void();
+  {
+    resultobj = PyList_New((&result)->size());
+    for (size_t i = 0; i < (&result)->size(); ++i) {
+      PyObject *obj = PyList_New(result[i].size());
+      for (size_t j = 0; j < result[i].size(); ++j) {
+        PyList_SetItem(obj, j, PyInt_FromLong(static_cast<long>(result[i][j])));
+      }
+      PyList_SetItem(resultobj, i, obj);
+    }
+  }
   return resultobj;
 fail:
   return NULL;
 }
 
 
-SWIGINTERN PyObject *_wrap_SentencePieceTrainer__TrainFromString(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsFlat(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
   PyObject *resultobj = 0;
-  absl::string_view arg1 ;
-  PyObject *swig_obj[1] ;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  int arg3 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyInputStringBatch batch2 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[3] ;
+  PyObject *result = 0 ;
   
-  if (!args) SWIG_fail;
-  swig_obj[0] = args;
-  {
-    const PyInputString ustring(swig_obj[0]);
-    if (!ustring.IsAvalable()) {
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsFlat", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsFlat" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    if (!batch2.Init(swig_obj[1])) {
+      SWIG_fail;
+    }
+    arg2 = batch2.views();
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsIdsFlat" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__EncodeAsIdsFlat((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  int arg3 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyInputStringBatch batch2 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[3] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    if (!batch2.Init(swig_obj[1])) {
+      SWIG_fail;
+    }
+    arg2 = batch2.views();
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsIdsPadded(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< absl::string_view > *arg2 = 0 ;
+  int arg3 ;
+  int arg4 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyInputStringBatch batch2 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  PyObject *swig_obj[4] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsIdsPadded", 4, 4, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsIdsPadded" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    if (!batch2.Init(swig_obj[1])) {
+      SWIG_fail;
+    }
+    arg2 = batch2.views();
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__EncodeAsIdsPadded" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__EncodeAsIdsPadded" "', argument " "4"" of type '" "int""'");
+  }
+  arg4 = static_cast< int >(val4);
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__EncodeAsIdsPadded((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< absl::string_view > const &)*arg2,arg3,arg4);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsFlat(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  PyObject *arg2 = (PyObject *) 0 ;
+  PyObject *arg3 = (PyObject *) 0 ;
+  int arg4 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val4 ;
+  int ecode4 = 0 ;
+  PyObject *swig_obj[4] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__DecodeIdsFlat", 4, 4, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__DecodeIdsFlat" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  arg2 = swig_obj[1];
+  arg3 = swig_obj[2];
+  ecode4 = SWIG_AsVal_int(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__DecodeIdsFlat" "', argument " "4"" of type '" "int""'");
+  }
+  arg4 = static_cast< int >(val4);
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__DecodeIdsFlat((sentencepiece::SentencePieceProcessor const *)arg1,arg2,arg3,arg4);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__DecodeIdsBuffer(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  PyObject *arg2 = (PyObject *) 0 ;
+  int arg3 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[3] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__DecodeIdsBuffer", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__DecodeIdsBuffer" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  arg2 = swig_obj[1];
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__DecodeIdsBuffer" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__DecodeIdsBuffer((sentencepiece::SentencePieceProcessor const *)arg1,arg2,arg3);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__MakePieceTable(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyObject *swig_obj[1] ;
+  PyObject *result = 0 ;
+  
+  if (!args) SWIG_fail;
+  swig_obj[0] = args;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__MakePieceTable" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__MakePieceTable((sentencepiece::SentencePieceProcessor const *)arg1);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__EncodeAsPiecesCached(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  absl::string_view arg2 ;
+  PyObject *arg3 = (PyObject *) 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyObject *swig_obj[3] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__EncodeAsPiecesCached", 3, 3, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__EncodeAsPiecesCached" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    const PyInputString ustring(swig_obj[1]);
+    if (!ustring.IsAvalable()) {
+      PyErr_SetString(PyExc_TypeError, "not a string");
+      SWIG_fail;
+    }
+    resultobj = ustring.input_type();
+    arg2 = absl::string_view(ustring.data(), ustring.size());
+  }
+  arg3 = swig_obj[2];
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__EncodeAsPiecesCached((sentencepiece::SentencePieceProcessor const *)arg1,arg2,arg3);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__SampleEncodeAsPiecesCached(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  absl::string_view arg2 ;
+  int arg3 ;
+  float arg4 ;
+  PyObject *arg5 = (PyObject *) 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  float val4 ;
+  int ecode4 = 0 ;
+  PyObject *swig_obj[5] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__SampleEncodeAsPiecesCached", 5, 5, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__SampleEncodeAsPiecesCached" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    const PyInputString ustring(swig_obj[1]);
+    if (!ustring.IsAvalable()) {
+      PyErr_SetString(PyExc_TypeError, "not a string");
+      SWIG_fail;
+    }
+    resultobj = ustring.input_type();
+    arg2 = absl::string_view(ustring.data(), ustring.size());
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__SampleEncodeAsPiecesCached" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
+  ecode4 = SWIG_AsVal_float(swig_obj[3], &val4);
+  if (!SWIG_IsOK(ecode4)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode4), "in method '" "SentencePieceProcessor__SampleEncodeAsPiecesCached" "', argument " "4"" of type '" "float""'");
+  }
+  arg4 = static_cast< float >(val4);
+  arg5 = swig_obj[4];
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__SampleEncodeAsPiecesCached((sentencepiece::SentencePieceProcessor const *)arg1,arg2,arg3,arg4,arg5);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor__NBestEncodeAsPiecesCached(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  absl::string_view arg2 ;
+  int arg3 ;
+  PyObject *arg4 = (PyObject *) 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  int val3 ;
+  int ecode3 = 0 ;
+  PyObject *swig_obj[4] ;
+  PyObject *result = 0 ;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor__NBestEncodeAsPiecesCached", 4, 4, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor__NBestEncodeAsPiecesCached" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    const PyInputString ustring(swig_obj[1]);
+    if (!ustring.IsAvalable()) {
+      PyErr_SetString(PyExc_TypeError, "not a string");
+      SWIG_fail;
+    }
+    resultobj = ustring.input_type();
+    arg2 = absl::string_view(ustring.data(), ustring.size());
+  }
+  ecode3 = SWIG_AsVal_int(swig_obj[2], &val3);
+  if (!SWIG_IsOK(ecode3)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode3), "in method '" "SentencePieceProcessor__NBestEncodeAsPiecesCached" "', argument " "3"" of type '" "int""'");
+  }
+  arg3 = static_cast< int >(val3);
+  arg4 = swig_obj[3];
+  {
+    try {
+      result = (PyObject *)sentencepiece_SentencePieceProcessor__NBestEncodeAsPiecesCached((sentencepiece::SentencePieceProcessor const *)arg1,arg2,arg3,arg4);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = result;
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  sentencepiece::SentencePieceProcessor *arg1 = (sentencepiece::SentencePieceProcessor *) 0 ;
+  std::vector< int > *arg2 = 0 ;
+  void *argp1 = 0 ;
+  int res1 = 0 ;
+  PyObject *swig_obj[2] ;
+  sentencepiece::util::bytes result;
+  
+  if (!SWIG_Python_UnpackTuple(args, "SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck", 2, 2, swig_obj)) SWIG_fail;
+  res1 = SWIG_ConvertPtr(swig_obj[0], &argp1,SWIGTYPE_p_sentencepiece__SentencePieceProcessor, 0 |  0 );
+  if (!SWIG_IsOK(res1)) {
+    SWIG_exception_fail(SWIG_ArgError(res1), "in method '" "SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck" "', argument " "1"" of type '" "sentencepiece::SentencePieceProcessor const *""'"); 
+  }
+  arg1 = reinterpret_cast< sentencepiece::SentencePieceProcessor * >(argp1);
+  {
+    std::vector<int> *out = nullptr;
+    if (PyList_Check(swig_obj[1])) {
+      const size_t size = PyList_Size(swig_obj[1]);
+      out = new std::vector<int>(size);
+      for (size_t i = 0; i < size; ++i) {
+        PyObject *o = PyList_GetItem(swig_obj[1], i);
+        if (PyInt_Check(o)) {
+          (*out)[i] = static_cast<int>(PyInt_AsLong(o));
+        } else {
+          PyErr_SetString(PyExc_TypeError,"list must contain integers");
+          SWIG_fail;
+        }
+      }
+    } else {
+      PyErr_SetString(PyExc_TypeError,"not a list");
+      SWIG_fail;
+    }
+    arg2 = out;
+  }
+  {
+    try {
+      result = sentencepiece_SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck((sentencepiece::SentencePieceProcessor const *)arg1,(std::vector< int > const &)*arg2);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  {
+    resultobj = MakePyOutputBytes(result);
+  }
+  {
+    delete arg2;
+  }
+  return resultobj;
+fail:
+  {
+    delete arg2;
+  }
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *SentencePieceProcessor_swigregister(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *obj;
+  if (!SWIG_Python_UnpackTuple(args, "swigregister", 1, 1, &obj)) return NULL;
+  SWIG_TypeNewClientData(SWIGTYPE_p_sentencepiece__SentencePieceProcessor, SWIG_NewClientData(obj));
+  return SWIG_Py_Void();
+}
+
+SWIGINTERN PyObject *SentencePieceProcessor_swiginit(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  return SWIG_Python_InitShadowInstance(args);
+}
+
+SWIGINTERN PyObject *_wrap_SetRandomGeneratorSeed(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  unsigned int arg1 ;
+  unsigned int val1 ;
+  int ecode1 = 0 ;
+  PyObject *swig_obj[1] ;
+  
+  if (!args) SWIG_fail;
+  swig_obj[0] = args;
+  ecode1 = SWIG_AsVal_unsigned_SS_int(swig_obj[0], &val1);
+  if (!SWIG_IsOK(ecode1)) {
+    SWIG_exception_fail(SWIG_ArgError(ecode1), "in method '" "SetRandomGeneratorSeed" "', argument " "1"" of type '" "unsigned int""'");
+  } 
+  arg1 = static_cast< unsigned int >(val1);
+  {
+    try {
+      sentencepiece::SetRandomGeneratorSeed(arg1);
+      ReleaseResultObject(resultobj);
+    }
+    catch (const sentencepiece::util::Status &status) {
+      SWIG_exception(ToSwigError(status.code()), status.ToString().c_str());
+    }
+  }
+  resultobj = SWIG_Py_Void();
+  return resultobj;
+fail:
+  return NULL;
+}
+
+
+SWIGINTERN PyObject *_wrap_SentencePieceTrainer__TrainFromString(PyObject *SWIGUNUSEDPARM(self), PyObject *args) {
+  PyObject *resultobj = 0;
+  absl::string_view arg1 ;
+  PyObject *swig_obj[1] ;
+  
+  if (!args) SWIG_fail;
+  swig_obj[0] = args;
+  {
+    const PyInputString ustring(swig_obj[0]);
+    if (!ustring.IsAvalable()) {
       PyErr_SetString(PyExc_TypeError, "not a string");
       SWIG_fail;
     }
@@ -5396,8 +6447,20 @@ static PyMethodDef SwigMethods[] = {
 	 { "SentencePieceProcessor_eos_id", _wrap_SentencePieceProcessor_eos_id, METH_O, NULL},
 	 { "SentencePieceProcessor_pad_id", _wrap_SentencePieceProcessor_pad_id, METH_O, NULL},
 	 { "SentencePieceProcessor_serialized_model_proto", _wrap_SentencePieceProcessor_serialized_model_proto, METH_O, NULL},
+	 { "SentencePieceProcessor_precompiled_model_file", _wrap_SentencePieceProcessor_precompiled_model_file, METH_O, NULL},
 	 { "SentencePieceProcessor_LoadFromFile", _wrap_SentencePieceProcessor_LoadFromFile, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__SavePrecompiled", _wrap_SentencePieceProcessor__SavePrecompiled, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor_DecodeIdsWithCheck", _wrap_SentencePieceProcessor_DecodeIdsWithCheck, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsBatch", _wrap_SentencePieceProcessor__EncodeAsIdsBatch, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsFlat", _wrap_SentencePieceProcessor__EncodeAsIdsFlat, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat", _wrap_SentencePieceProcessor__EncodeAsIdsWithOffsetsFlat, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__EncodeAsIdsPadded", _wrap_SentencePieceProcessor__EncodeAsIdsPadded, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__DecodeIdsFlat", _wrap_SentencePieceProcessor__DecodeIdsFlat, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__DecodeIdsBuffer", _wrap_SentencePieceProcessor__DecodeIdsBuffer, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__MakePieceTable", _wrap_SentencePieceProcessor__MakePieceTable, METH_O, NULL},
+	 { "SentencePieceProcessor__EncodeAsPiecesCached", _wrap_SentencePieceProcessor__EncodeAsPiecesCached, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__SampleEncodeAsPiecesCached", _wrap_SentencePieceProcessor__SampleEncodeAsPiecesCached, METH_VARARGS, NULL},
+	 { "SentencePieceProcessor__NBestEncodeAsPiecesCached", _wrap_SentencePieceProcessor__NBestEncodeAsPiecesCached, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck", _wrap_SentencePieceProcessor_DecodeIdsAsSerializedProtoWithCheck, METH_VARARGS, NULL},
 	 { "SentencePieceProcessor_swigregister", SentencePieceProcessor_swigregister, METH_O, NULL},
 	 { "SentencePieceProcessor_swiginit", SentencePieceProcessor_swiginit, METH_VARARGS, NULL},
@@ -6185,6 +7248,12 @@ SWIG_init(void) {
   
   SWIG_InstallConstants(d,swig_const_table);
   
+#ifdef Py_GIL_DISABLED
+  // The wrapper keeps no global state, and the const methods of a processor
+  // may run on many threads at once, each with a workspace of its thread,
+  // so the module runs without the GIL on free-threaded builds.
+  PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
   SWIG_Python_SetConstant(d, "EncoderVersion_kOptimized",SWIG_From_int(static_cast< int >(sentencepiece::EncoderVersion::kOptimized)));
   SWIG_Python_SetConstant(d, "EncoderVersion_kOriginal",SWIG_From_int(static_cast< int >(sentencepiece::EncoderVersion::kOriginal)));
 #if PY_VERSION_HEX >= 0x03000000
@@ -15,6 +15,7 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.!
 
+import array
 import codecs
 import io
 import sentencepiece as spm
@@ -22,6 +23,7 @@ import unittest
 import sys
 import os
 import pickle
+import threading
 
 from collections import defaultdict
 
@@ -145,6 +147,23 @@ class TestSentencepieceProcessor(unittest.TestCase):
 
     self.assertEqual(id1, id2)
 
+  def test_pickle_precompiled(self):
+    self.sp_.SavePrecompiled('test_model.precompiled')
+    sp = spm.SentencePieceProcessor(model_file='test_model.precompiled')
+    self.assertEqual(
+        os.path.abspath('test_model.precompiled'),
+        os.path.abspath(sp.precompiled_model_file()))
+    self.assertEqual('', self.sp_.precompiled_model_file())
+
+    # Only the path is pickled.
+    data = pickle.dumps(sp)
+    self.assertLess(len(data), 1000)
+    sp2 = pickle.loads(data)
+    self.assertEqual(
+        sp.encode('hello world.', out_type=int),
+        sp2.encode('hello world.', out_type=int))
+    self.assertEqual(sp.serialized_model_proto(), sp2.serialized_model_proto())
+
   def test_train(self):
     spm.SentencePieceTrainer.Train('--input=' +
                                    os.path.join(data_dir, 'botchan.txt') +
@@ -188,6 +207,154 @@ class TestSentencepieceProcessor(unittest.TestCase):
     self.assertEqual([sp1.id_to_piece(i) for i in range(sp1.get_piece_size())],
                      [sp2.id_to_piece(i) for i in range(sp2.get_piece_size())])
 
+  def test_train_batched_iterator(self):
+    with open(os.path.join(data_dir, 'botchan.txt'), 'rb') as f:
+      lines = f.read().splitlines()
+
+    def batches():
+      for i in range(0, len(lines), 100):
+        yield lines[i:i + 100]
+
+    def buffers():
+      for i in range(0, len(lines), 100):
+        batch = lines[i:i + 100]
+        offsets = [0]
+        for line in batch:
+          offsets.append(offsets[-1] + len(line))
+        yield (b''.join(batch), offsets)
+
+    def pieces(iterator):
+      model = io.BytesIO()
+      spm.SentencePieceTrainer.train(
+          sentence_iterator=iterator, model_writer=model, vocab_size=1000)
+      sp = spm.SentencePieceProcessor(model_proto=model.getvalue())
+      return [sp.id_to_piece(i) for i in range(sp.get_piece_size())]
+
+    expected = pieces(iter(lines))
+    self.assertEqual(expected, pieces(batches()))
+    self.assertEqual(expected, pieces(buffers()))
+
+    with self.assertRaises(RuntimeError):
+      spm.SentencePieceTrainer.train(
+          sentence_iterator=iter([(b'abc', [0, 4])]),
+          model_writer=io.BytesIO(),
+          vocab_size=1000)
+
+  def test_flat_batch(self):
+    sp = spm.SentencePieceProcessor(
+        model_file=os.path.join('test', 'test_model.model'))
+    texts = ['hello world', '', 'Tokyo'] * 10
+    expected = sp.encode(texts)
+    for num_threads in [1, 4]:
+      ids, offsets = sp.encode_as_ids_flat(texts, num_threads=num_threads)
+      self.assertEqual('i', ids.typecode)
+      self.assertEqual(len(texts) + 1, len(offsets))
+      self.assertEqual(expected, [
+          ids[offsets[i]:offsets[i + 1]].tolist() for i in range(len(texts))
+      ])
+      self.assertEqual(
+          sp.decode(expected),
+          sp.decode_ids_flat(ids, offsets, num_threads=num_threads))
+
+    # DecodeIds and Decode accept buffers.
+    ids = array.array('i', expected[0])
+    self.assertEqual(sp.decode(expected[0]), sp.decode_ids(ids))
+    self.assertEqual(sp.decode(expected[0]), sp.decode(ids))
+    rows = array.array('i', expected[0] * 2)
+    self.assertEqual([sp.decode(expected[0])] * 2,
+                     sp.decode(memoryview(rows).cast(
+                         'B').cast('i', [2, len(expected[0])])))
+    with self.assertRaises(TypeError):
+      sp.decode_ids(array.array('d', [1.0]))
+
+  def test_flat_batch_with_offsets(self):
+    sp = spm.SentencePieceProcessor(
+        model_file=os.path.join('test', 'test_model.model'))
+    texts = ['hello world', '', 'Tokyo', ' I saw a girl '] * 10
+    ids, offsets, begins, ends = sp.encode_as_ids_with_offsets_flat(
+        texts, num_threads=2)
+    self.assertEqual('q', begins.typecode)
+    self.assertEqual(len(ids), len(begins))
+    self.assertEqual(len(ids), len(ends))
+    # The surfaces of a row cover its text when normalization keeps it.
+    for i, text in enumerate(texts[:3]):
+      data = text.encode('utf-8')
+      self.assertEqual(data, b''.join(
+          data[begins[k]:ends[k]] for k in range(offsets[i], offsets[i + 1])))
+
+    try:
+      from sentencepiece import sentencepiece_pb2
+    except ImportError:
+      self.skipTest('protobuf is not available')
+    for i, text in enumerate(texts):
+      spt = sentencepiece_pb2.SentencePieceText()
+      spt.ParseFromString(sp.encode_as_serialized_proto(text))
+      self.assertEqual([p.id for p in spt.pieces],
+                       ids[offsets[i]:offsets[i + 1]].tolist())
+      self.assertEqual([p.begin for p in spt.pieces],
+                       begins[offsets[i]:offsets[i + 1]].tolist())
+      self.assertEqual([p.end for p in spt.pieces],
+                       ends[offsets[i]:offsets[i + 1]].tolist())
+
+  def test_padded_batch(self):
+    sp = spm.SentencePieceProcessor(
+        model_file=os.path.join('test', 'test_model.model'))
+    texts = ['hello world', '', 'Tokyo']
+    expected = sp.encode(texts)
+    width = max(len(ids) for ids in expected)
+    with self.assertRaises(ValueError):
+      sp.encode_as_ids_padded(texts)
+    try:
+      import numpy
+    except ImportError:
+      self.skipTest('numpy is not available')
+    padded = sp.encode_as_ids_padded(texts, pad_id=-1, num_threads=2)
+    self.assertEqual((3, width), padded.shape)
+    for row, ids in zip(padded.tolist(), expected):
+      self.assertEqual(ids + [-1] * (width - len(ids)), row)
+    ids, offsets = sp.encode_as_ids_flat(texts, buffer_type='numpy')
+    self.assertEqual(numpy.int64, offsets.dtype)
+    self.assertEqual(sp.decode(expected[0]), sp.decode(ids[:offsets[1]]))
+    padded = sp.encode_as_ids_padded(texts, pad_id=sp.eos_id())
+    self.assertEqual(sp.decode(expected), sp.decode(padded))
+
+  def test_buffer_batch(self):
+    sp = spm.SentencePieceProcessor(
+        model_file=os.path.join('test', 'test_model.model'))
+    texts = ['hello world', '', 'Tokyo', ' I saw a girl ']
+    expected = sp.encode(texts)
+    data = ''.join(texts).encode('utf-8')
+    self.assertEqual(expected[0], sp.encode(memoryview(data)[:11]))
+    self.assertEqual(expected[2], sp.encode(bytearray(b'Tokyo')))
+    self.assertEqual(expected, sp.encode([memoryview(t.encode('utf-8'))
+                                          for t in texts], num_threads=2))
+
+    offsets = array.array('q', [0])
+    for text in texts:
+      offsets.append(offsets[-1] + len(text.encode('utf-8')))
+    ids, id_offsets = sp.encode_as_ids_flat((data, offsets), num_threads=2)
+    self.assertEqual(expected, [
+        ids[id_offsets[i]:id_offsets[i + 1]].tolist()
+        for i in range(len(texts))
+    ])
+    with self.assertRaises(ValueError):
+      sp.encode_as_ids_flat((data, [0, len(data) + 1]))
+    with self.assertRaises(TypeError):
+      sp.encode([b'abc', 1])
+
+    try:
+      import pyarrow
+    except ImportError:
+      self.skipTest('pyarrow is not available')
+    for type_ in [pyarrow.string(), pyarrow.large_string()]:
+      column = pyarrow.array(['x'] + texts, type=type_).slice(1)
+      self.assertEqual(expected, sp.encode(column))
+      ids, id_offsets = sp.encode_as_ids_flat(column)
+      self.assertEqual(expected, [
+          ids[id_offsets[i]:id_offsets[i + 1]].tolist()
+          for i in range(len(texts))
+      ])
+
   def test_train_kwargs(self):
     spm.SentencePieceTrainer.train(
         input=[os.path.join(data_dir, 'botchan.txt')],
@@ -347,6 +514,35 @@ class TestSentencepieceProcessor(unittest.TestCase):
     self.assertEqual([text, text2], sp.decode([ids, ids2]))
     self.assertEqual([text, text2], sp.decode([pieces, pieces2]))
 
+    # batch encoding with threads.
+    self.assertEqual([ids, ids2] * 10, sp.encode([text, text2] * 10,
+                                                 num_threads=4))
+    self.assertEqual([[sp.bos_id()] + ids, [sp.bos_id()] + ids2],
+                     sp.encode([text, text2], add_bos=True, num_threads=2))
+
+  def test_encode_from_threads(self):
+    # Encoders run concurrently, without the GIL on free-threaded builds, and
+    # the per-call options of one thread do not leak into another.
+    texts = ['hello world', 'I saw a girl with a telescope.', '', 'abc def']
+    expected = [self.sp_.encode(text) for text in texts]
+    expected_bos = [self.sp_.encode(text, add_bos=True) for text in texts]
+    errors = []
+
+    def run(offset):
+      for n in range(200):
+        i = (n + offset) % len(texts)
+        add_bos = (n % 2 == 0)
+        ids = self.sp_.encode(texts[i], add_bos=add_bos)
+        if ids != (expected_bos[i] if add_bos else expected[i]):
+          errors.append((texts[i], add_bos, ids))
+
+    threads = [threading.Thread(target=run, args=(t,)) for t in range(4)]
+    for thread in threads:
+      thread.start()
+    for thread in threads:
+      thread.join()
+    self.assertEqual([], errors)
+
   def test_new_api_init(self):
     sp = spm.SentencePieceProcessor(
         model_file=os.path.join('test', 'test_model.model'),
@@ -372,6 +568,32 @@ class TestSentencepieceProcessor(unittest.TestCase):
       ++ids2[' '.join(sp.encode('hello world', enable_sampling=False))]
     self.assertEqual(len(ids2), 1)
 
+  def test_cached_pieces(self):
+    text = 'I saw a girl with a telescope. \u2603\u2603'
+    pieces = self.sp_.EncodeAsPieces(text)
+    self.assertEqual(text, self.sp_.DecodePieces(pieces))
+    # Pieces of the vocab are the shared str of IdToPiece().
+    ids = self.sp_.EncodeAsIds(text)
+    for piece, id in zip(pieces, ids):
+      if not self.sp_.IsUnknown(id):
+        self.assertIs(piece, self.sp_.IdToPiece(id))
+    self.assertIs(self.sp_.IdToPiece(10), self.sp_.IdToPiece([10])[0])
+    self.assertEqual(
+        pieces,
+        [p.decode('utf-8') for p in self.sp_.EncodeAsPieces(text.encode('utf-8'))])
+
+    for nbest in self.sp_.NBestEncodeAsPieces(text, 5):
+      self.assertEqual(text, self.sp_.DecodePieces(nbest))
+    pieces = self.sp_.SampleEncodeAsPieces(text, -1, 0.5)
+    self.assertEqual(text, self.sp_.DecodePieces(pieces))
+
+    # Loading another model drops the table.
+    sp = spm.SentencePieceProcessor()
+    sp.Load(os.path.join('test', 'test_model.model'))
+    self.assertEqual(self.sp_.IdToPiece(100), sp.IdToPiece(100))
+    sp.Load(os.path.join('test', 'test_ja_model.model'))
+    self.assertEqual(self.jasp_.IdToPiece(100), sp.IdToPiece(100))
+
   def test_valid_range(self):
     size = self.sp_.piece_size()
     funcs = [
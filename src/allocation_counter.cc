@@ -0,0 +1,97 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "allocation_counter.h"
+
+#ifdef SPM_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace sentencepiece {
+namespace test {
+namespace {
+std::atomic<uint64> g_num_allocations(0);
+#ifdef SPM_NO_THREADLOCAL
+// Without thread_local, the count of the calling thread is not available
+// and falls back to the count of all threads.
+uint64 *ThreadAllocations() { return nullptr; }
+#else
+// A plain integer needs no dynamic initialization, so it is safe to use
+// from operator new while a thread starts or exits.
+thread_local uint64 g_num_thread_allocations = 0;
+uint64 *ThreadAllocations() { return &g_num_thread_allocations; }
+#endif  // SPM_NO_THREADLOCAL
+
+void *Allocate(size_t size) {
+  g_num_allocations.fetch_add(1, std::memory_order_relaxed);
+  uint64 *thread_allocations = ThreadAllocations();
+  if (thread_allocations != nullptr) ++*thread_allocations;
+  return std::malloc(size == 0 ? 1 : size);
+}
+}  // namespace
+
+bool AllocationCounterEnabled() { return true; }
+
+uint64 NumAllocations() {
+  return g_num_allocations.load(std::memory_order_relaxed);
+}
+
+uint64 NumThreadAllocations() {
+  const uint64 *thread_allocations = ThreadAllocations();
+  return thread_allocations != nullptr ? *thread_allocations
+                                       : NumAllocations();
+}
+
+}  // namespace test
+}  // namespace sentencepiece
+
+void *operator new(size_t size) {
+  void *ptr = sentencepiece::test::Allocate(size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return sentencepiece::test::Allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return sentencepiece::test::Allocate(size);
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+
+#else  // SPM_COUNT_ALLOCATIONS
+
+namespace sentencepiece {
+namespace test {
+bool AllocationCounterEnabled() { return false; }
+uint64 NumAllocations() { return 0; }
+uint64 NumThreadAllocations() { return 0; }
+}  // namespace test
+}  // namespace sentencepiece
+
+#endif  // SPM_COUNT_ALLOCATIONS
@@ -0,0 +1,41 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef ALLOCATION_COUNTER_H_
+#define ALLOCATION_COUNTER_H_
+
+#include "common.h"
+
+namespace sentencepiece {
+namespace test {
+
+// Counts the heap allocations of the binaries linked with
+// allocation_counter.cc, which replaces the global operator new. The test
+// and benchmark binaries link it unless SPM_COUNT_ALLOCATIONS is OFF, e.g.,
+// for a build with sanitizers which provide their own operator new.
+
+// Returns false when the allocations are not counted, in which case the
+// counters below are always 0.
+bool AllocationCounterEnabled();
+
+// Returns the number of operator new calls made so far by all threads.
+uint64 NumAllocations();
+
+// Returns the number of operator new calls made so far by the calling
+// thread. Unlike NumAllocations(), this is not affected by other threads.
+uint64 NumThreadAllocations();
+
+}  // namespace test
+}  // namespace sentencepiece
+#endif  // ALLOCATION_COUNTER_H_
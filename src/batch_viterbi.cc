@@ -0,0 +1,158 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "batch_viterbi.h"
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <utility>
+
+#include "model_interface.h"
+#include "third_party/absl/memory/memory.h"
+#include "util.h"
+
+namespace sentencepiece {
+
+FlatViterbiTables FlatViterbiModel::tables() const {
+  FlatViterbiTables tables;
+  tables.trie = trie.data();
+  tables.scores = scores.data();
+  tables.kinds = kinds.data();
+  tables.unk_id = unk_id;
+  tables.unk_score = unk_score;
+  tables.max_score = max_score;
+  tables.max_piece_size = max_piece_size;
+  return tables;
+}
+
+namespace {
+
+// The strings of a batch taken by one task of the host encoder.
+constexpr int64 kChunkSize = 16;
+
+// Every string i has room for one piece per byte from begins[i]. Moves the
+// |num_pieces| of every string right after those of the previous one and
+// sets |offsets|.
+void CompactPieces(const std::vector<size_t> &begins,
+                   const std::vector<int> &num_pieces, std::vector<int> *ids,
+                   std::vector<int> *lengths, std::vector<size_t> *offsets) {
+  offsets->resize(num_pieces.size() + 1);
+  (*offsets)[0] = 0;
+  size_t size = 0;
+  for (size_t i = 0; i < num_pieces.size(); ++i) {
+    std::copy(ids->begin() + begins[i],
+              ids->begin() + begins[i] + num_pieces[i], ids->begin() + size);
+    std::copy(lengths->begin() + begins[i],
+              lengths->begin() + begins[i] + num_pieces[i],
+              lengths->begin() + size);
+    size += num_pieces[i];
+    (*offsets)[i + 1] = size;
+  }
+  ids->resize(size);
+  lengths->resize(size);
+}
+
+// Returns the offsets of the strings in their concatenation.
+util::Status GetBegins(const std::vector<absl::string_view> &normalized,
+                       std::vector<size_t> *begins) {
+  begins->resize(normalized.size() + 1);
+  (*begins)[0] = 0;
+  for (size_t i = 0; i < normalized.size(); ++i) {
+    CHECK_LE_OR_RETURN(normalized[i].size(),
+                       static_cast<size_t>(std::numeric_limits<int>::max()))
+        << "The normalized string is too long.";
+    (*begins)[i + 1] = (*begins)[i] + normalized[i].size();
+  }
+  return util::OkStatus();
+}
+
+class UnavailableEncoder : public BatchViterbiEncoder {
+ public:
+  explicit UnavailableEncoder(util::Status status)
+      : status_(std::move(status)) {}
+
+  util::Status status() const override { return status_; }
+
+  util::Status Encode(const std::vector<absl::string_view> &normalized,
+                      int num_threads, std::vector<int> *ids,
+                      std::vector<int> *lengths,
+                      std::vector<size_t> *offsets) const override {
+    return status_;
+  }
+
+ private:
+  const util::Status status_;
+};
+
+// Runs FlatViterbi() on the CPU threads.
+class HostEncoder : public BatchViterbiEncoder {
+ public:
+  explicit HostEncoder(FlatViterbiModel model)
+      : model_(std::move(model)), tables_(model_.tables()) {}
+
+  util::Status status() const override { return util::OkStatus(); }
+
+  util::Status Encode(const std::vector<absl::string_view> &normalized,
+                      int num_threads, std::vector<int> *ids,
+                      std::vector<int> *lengths,
+                      std::vector<size_t> *offsets) const override {
+    CHECK_OR_RETURN(ids && lengths && offsets) << "output is null.";
+    std::vector<size_t> begins;
+    RETURN_IF_ERROR(GetBegins(normalized, &begins));
+    ids->resize(begins.back());
+    lengths->resize(begins.back());
+    std::vector<int> num_pieces(normalized.size());
+
+    auto encode = [&](int64 begin, int64 end) {
+      std::vector<FlatBestPath> paths;
+      for (int64 i = begin; i < end; ++i) {
+        const absl::string_view text = normalized[i];
+        paths.resize(text.size() + 1);
+        num_pieces[i] = FlatViterbi(tables_, text.data(), text.size(),
+                                    paths.data(), ids->data() + begins[i],
+                                    lengths->data() + begins[i]);
+      }
+    };
+    SharedParallelFor(normalized.size(), kChunkSize, num_threads, encode);
+
+    CompactPieces(begins, num_pieces, ids, lengths, offsets);
+    return util::OkStatus();
+  }
+
+ private:
+  const FlatViterbiModel model_;
+  const FlatViterbiTables tables_;  // into model_.
+};
+
+}  // namespace
+
+std::unique_ptr<BatchViterbiEncoder> NewBatchViterbiEncoder(
+    const ModelInterface &model, BatchEncodeBackend backend) {
+  FlatViterbiModel flat;
+  if (!model.ExportFlatViterbi(&flat)) {
+    return absl::make_unique<UnavailableEncoder>(util::UnimplementedError(
+        "Only the optimized unigram encoder runs on a batch encoder."));
+  }
+  switch (backend) {
+    case BatchEncodeBackend::kHost:
+      return absl::make_unique<HostEncoder>(std::move(flat));
+    default:
+      break;
+  }
+  return absl::make_unique<UnavailableEncoder>(
+      util::InvalidArgumentError("The backend has no batch encoder."));
+}
+
+}  // namespace sentencepiece
@@ -0,0 +1,70 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef BATCH_VITERBI_H_
+#define BATCH_VITERBI_H_
+
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "flat_viterbi.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+class ModelInterface;
+
+// The tables of FlatViterbiTables in host memory, exported by
+// ModelInterface::ExportFlatViterbi().
+struct FlatViterbiModel {
+  std::vector<uint32> trie;
+  std::vector<float> scores;
+  std::vector<uint8> kinds;
+  int unk_id = 0;
+  float unk_score = 0.0;
+  float max_score = 0.0;
+  int max_piece_size = 0;
+
+  // Returns the tables pointing into this model.
+  FlatViterbiTables tables() const;
+};
+
+// Segments batches of normalized strings with the tables of a unigram model,
+// as the optimized unigram encoder does. The tables are copied, so the
+// encoder does not refer to the model.
+class BatchViterbiEncoder {
+ public:
+  virtual ~BatchViterbiEncoder() {}
+
+  virtual util::Status status() const = 0;
+
+  // Segments the strings of |normalized| on up to |num_threads| threads.
+  // The pieces of normalized[i] are
+  // ids[offsets[i]] ... ids[offsets[i + 1] - 1], and |lengths| has their
+  // sizes in bytes. Can be called by multiple threads.
+  virtual util::Status Encode(const std::vector<absl::string_view> &normalized,
+                              int num_threads, std::vector<int> *ids,
+                              std::vector<int> *lengths,
+                              std::vector<size_t> *offsets) const = 0;
+};
+
+// Returns the encoder of |model| running on |backend|, which is kHost. The
+// status of the encoder tells why the model or the backend cannot be used.
+std::unique_ptr<BatchViterbiEncoder> NewBatchViterbiEncoder(
+    const ModelInterface &model, BatchEncodeBackend backend);
+
+}  // namespace sentencepiece
+#endif  // BATCH_VITERBI_H_
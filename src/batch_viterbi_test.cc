@@ -0,0 +1,208 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "batch_viterbi.h"
+
+#include <string>
+#include <vector>
+
+#include "filesystem.h"
+#include "normalizer.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "testharness.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "unigram_model.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace {
+
+std::vector<std::string> ReadLines(int max_lines) {
+  std::vector<std::string> lines;
+  auto input = filesystem::NewReadableFile(
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt"));
+  EXPECT_TRUE(input->status().ok());
+  std::string line;
+  while (input->ReadLine(&line) && lines.size() < max_lines) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+std::string TrainModel(const std::string &type) {
+  const std::string model_prefix = util::JoinPath(
+      absl::GetFlag(FLAGS_test_tmpdir), absl::StrCat("batch_viterbi_", type));
+  EXPECT_TRUE(
+      SentencePieceTrainer::Train(
+          absl::StrCat("--input=",
+                       util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                      "botchan.txt"),
+                       " --model_prefix=", model_prefix,
+                       " --vocab_size=1000 --model_type=", type,
+                       " --user_defined_symbols=<tag>,ing"))
+          .ok());
+  return model_prefix + ".model";
+}
+
+// Segments every line with `encoder` and compares the pieces with the ones
+// of `model`.
+void ExpectSameAsModel(const unigram::Model &model,
+                       const BatchViterbiEncoder &encoder,
+                       const std::vector<std::string> &normalized,
+                       int num_threads) {
+  const std::vector<absl::string_view> views(normalized.begin(),
+                                             normalized.end());
+  std::vector<int> ids, lengths;
+  std::vector<size_t> offsets;
+  ASSERT_TRUE(
+      encoder.Encode(views, num_threads, &ids, &lengths, &offsets).ok());
+  ASSERT_EQ(normalized.size() + 1, offsets.size());
+  ASSERT_EQ(ids.size(), offsets.back());
+  ASSERT_EQ(ids.size(), lengths.size());
+  for (size_t i = 0; i < normalized.size(); ++i) {
+    const EncodeResult expected = model.Encode(normalized[i]);
+    ASSERT_EQ(expected.size(), offsets[i + 1] - offsets[i]);
+    size_t pos = 0;
+    for (size_t j = 0; j < expected.size(); ++j) {
+      const size_t k = offsets[i] + j;
+      EXPECT_EQ(expected[j].second, ids[k]);
+      EXPECT_EQ(expected[j].first, views[i].substr(pos, lengths[k]));
+      pos += lengths[k];
+    }
+    EXPECT_EQ(normalized[i].size(), pos);
+  }
+}
+
+}  // namespace
+
+TEST(BatchViterbiTest, HostEncoderTest) {
+  ModelProto model_proto;
+  {
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(TrainModel("unigram")).ok());
+    model_proto = sp.model_proto();
+  }
+  const unigram::Model model(model_proto);
+  const normalizer::Normalizer normalizer(model_proto.normalizer_spec());
+
+  std::vector<std::string> normalized;
+  for (const auto &line : ReadLines(500)) {
+    normalized.emplace_back();
+    ASSERT_TRUE(normalizer.Normalize(line, &normalized.back(), nullptr).ok());
+  }
+  // Unknown characters, user defined pieces and empty strings.
+  normalized.push_back("");
+  normalized.push_back("\xE2\x96\x81\xE7\x8C\xAB<tag>singing\xF0\x9F\x98\x80");
+  normalized.push_back("\xE3\x81");  // truncated UTF-8.
+
+  auto encoder = NewBatchViterbiEncoder(model, BatchEncodeBackend::kHost);
+  ASSERT_TRUE(encoder->status().ok());
+  for (const int num_threads : {1, 4}) {
+    ExpectSameAsModel(model, *encoder, normalized, num_threads);
+  }
+
+  // The UNUSED pieces are never emitted.
+  model_proto.mutable_pieces(100)->set_type(ModelProto::SentencePiece::UNUSED);
+  const unigram::Model unused(model_proto);
+  encoder = NewBatchViterbiEncoder(unused, BatchEncodeBackend::kHost);
+  ASSERT_TRUE(encoder->status().ok());
+  ExpectSameAsModel(unused, *encoder, normalized, 2);
+
+  std::vector<int> ids, lengths;
+  std::vector<size_t> offsets;
+  EXPECT_TRUE(encoder->Encode({}, 1, &ids, &lengths, &offsets).ok());
+  EXPECT_EQ(std::vector<size_t>({0}), offsets);
+}
+
+TEST(BatchViterbiTest, UnavailableTest) {
+  ModelProto model_proto;
+  {
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(TrainModel("unigram")).ok());
+    model_proto = sp.model_proto();
+  }
+  unigram::Model model(model_proto);
+  EXPECT_TRUE(util::IsInvalidArgument(
+      NewBatchViterbiEncoder(model, BatchEncodeBackend::kDefault)->status()));
+  ASSERT_TRUE(model.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+  EXPECT_TRUE(util::IsUnimplemented(
+      NewBatchViterbiEncoder(model, BatchEncodeBackend::kHost)->status()));
+}
+
+TEST(BatchViterbiTest, SetBatchEncodeBackendTest) {
+  std::vector<std::string> lines = ReadLines(300);
+  lines.push_back("");
+  lines.push_back("aaaaaaaaaaaaaaaaaaaa <tag>");
+  lines.push_back(std::string(10000, 'x') + " " + std::string(5000, 'y'));
+  const std::vector<absl::string_view> inputs(lines.begin(), lines.end());
+
+  SentencePieceProcessor expected, sp;
+  const std::string filename = TrainModel("unigram");
+  ASSERT_TRUE(expected.Load(filename).ok());
+  ASSERT_TRUE(sp.Load(filename).ok());
+  EXPECT_EQ(BatchEncodeBackend::kDefault, sp.batch_encode_backend());
+  ASSERT_TRUE(sp.SetBatchEncodeBackend(BatchEncodeBackend::kHost).ok());
+  EXPECT_EQ(BatchEncodeBackend::kHost, sp.batch_encode_backend());
+
+  auto expect_same = [&]() {
+    std::vector<std::vector<int>> expected_ids, ids;
+    ASSERT_TRUE(expected.EncodeBatch(inputs, &expected_ids, 2).ok());
+    ASSERT_TRUE(sp.EncodeBatch(inputs, &ids, 2).ok());
+    EXPECT_EQ(expected_ids, ids);
+
+    std::vector<int> flat_ids;
+    std::vector<size_t> offsets;
+    ASSERT_TRUE(sp.EncodeBatch(inputs, &flat_ids, &offsets, 3).ok());
+    ASSERT_EQ(inputs.size() + 1, offsets.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(expected_ids[i],
+                std::vector<int>(flat_ids.begin() + offsets[i],
+                                 flat_ids.begin() + offsets[i + 1]));
+    }
+  };
+  expect_same();
+
+  ASSERT_TRUE(expected.SetEncodeExtraOptions("bos:eos:reverse").ok());
+  ASSERT_TRUE(sp.SetEncodeExtraOptions("bos:eos:reverse").ok());
+  expect_same();
+
+  // The vocabulary and the encoder version follow the model.
+  const std::vector<std::string> vocab = {"<tag>", "a", "e", "t", "\xE2\x96\x81"};
+  ASSERT_TRUE(expected.SetVocabulary(vocab).ok());
+  ASSERT_TRUE(sp.SetVocabulary(vocab).ok());
+  expect_same();
+  ASSERT_TRUE(expected.ResetVocabulary().ok());
+  ASSERT_TRUE(sp.ResetVocabulary().ok());
+  ASSERT_TRUE(expected.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+  ASSERT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+  expect_same();
+  ASSERT_TRUE(expected.SetEncoderVersion(EncoderVersion::kOptimized).ok());
+  ASSERT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOptimized).ok());
+
+  ASSERT_TRUE(expected.SetEncodeMaxTokens(5).ok());
+  ASSERT_TRUE(sp.SetEncodeMaxTokens(5).ok());
+  expect_same();
+
+  // Other models keep the default backend.
+  SentencePieceProcessor bpe;
+  ASSERT_TRUE(bpe.Load(TrainModel("bpe")).ok());
+  EXPECT_TRUE(util::IsUnimplemented(
+      bpe.SetBatchEncodeBackend(BatchEncodeBackend::kHost)));
+  EXPECT_EQ(BatchEncodeBackend::kDefault, bpe.batch_encode_backend());
+  ASSERT_TRUE(sp.SetBatchEncodeBackend(BatchEncodeBackend::kDefault).ok());
+}
+
+}  // namespace sentencepiece
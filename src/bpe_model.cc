@@ -14,75 +14,193 @@
 
 #include "bpe_model.h"
 
-#include <functional>
+#include <algorithm>
 #include <memory>
-#include <queue>
-#include <random>
 #include <utility>
 #include <vector>
 
 #include "freelist.h"
-#include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/memory/memory.h"
 #include "util.h"
 
 namespace sentencepiece {
 namespace bpe {
+namespace {
 
-Model::Model(const ModelProto &model_proto) {
-  model_proto_ = &model_proto;
-  InitializePieces();
+// Size of symbol pairs pre-allocated in a workspace.
+constexpr size_t kPreallocateSymbolPairSize = 256;
+
+struct SymbolPair {
+  int left;     // left index of this pair
+  int right;    // right index of this pair
+  float score;  // score of this pair. large is better.
+  size_t size;  // length of this piece
+  int id;       // id of this piece. Only set by ApplyMergeRules().
+};
+
+// Orders the agenda, a max-heap maintained with the same heap operations as
+// std::priority_queue.
+bool SymbolPairLess(const SymbolPair *h1, const SymbolPair *h2) {
+  return (h1->score < h2->score ||
+          (h1->score == h2->score && h1->left > h2->left));
 }
 
-Model::~Model() {}
+// Decides which merges BPE-dropout skips, each with probability `alpha`.
+// The coins are tossed 64 at a time by comparing raw 32-bit draws with an
+// integer threshold, so that a merge costs a shift of the mask instead of a
+// call of the generator and a conversion to a floating point number.
+class DropoutMask {
+ public:
+  explicit DropoutMask(float alpha)
+      : threshold_(alpha <= 0.0   ? 0
+                   : alpha >= 1.0 ? kAlways
+                                  : static_cast<uint64>(alpha * 4294967296.0)) {}
 
-std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
-    absl::string_view normalized, float alpha) const {
-  if (!status().ok() || normalized.empty()) {
-    return {};
+  bool Skip() {
+    if (threshold_ == 0) return false;
+    if (threshold_ == kAlways) return true;
+    if (remaining_ == 0) Refill();
+    const bool skip = mask_ & 1;
+    mask_ >>= 1;
+    --remaining_;
+    return skip;
   }
 
-  struct SymbolPair {
-    int left;     // left index of this pair
-    int right;    // right index of this pair
-    float score;  // score of this pair. large is better.
-    size_t size;  // length of this piece
-  };
+ private:
+  static constexpr uint64 kAlways = 1ULL << 32;
 
-  class SymbolPairComparator {
-   public:
-    const bool operator()(SymbolPair *h1, SymbolPair *h2) {
-      return (h1->score < h2->score ||
-              (h1->score == h2->score && h1->left > h2->left));
+  void Refill() {
+    if (rand_gen_.empty()) rand_gen_ = random::GetSamplingGenerator();
+    mask_ = 0;
+    for (int i = 0; i < 64; ++i) {
+      mask_ |= static_cast<uint64>(rand_gen_() < threshold_) << i;
     }
-  };
+    remaining_ = 64;
+  }
 
-  struct Symbol {
-    int prev;     // prev index of this symbol. -1 for BOS.
-    int next;     // next index of tihs symbol. -1 for EOS.
-    bool freeze;  // this symbol is never be merged.
-    absl::string_view piece;
-  };
+  const uint64 threshold_;
+  random::SamplingGenerator rand_gen_;
+  uint64 mask_ = 0;
+  int remaining_ = 0;
+};
+}  // namespace
+
+struct Model::Workspace {
+  Workspace() : symbol_pair_allocator(kPreallocateSymbolPairSize) {}
 
-  using Agenda = std::priority_queue<SymbolPair *, std::vector<SymbolPair *>,
-                                     SymbolPairComparator>;
-  Agenda agenda;
   std::vector<Symbol> symbols;
-  symbols.reserve(normalized.size());
+  std::vector<SymbolPair *> agenda;
+  model::FreeList<SymbolPair> symbol_pair_allocator;
+};
+
+Model::Model(const ModelProto &model_proto) {
+  model_proto_ = &model_proto;
+  InitializePieces();
+  if (!status().ok()) return;
+
+  // Builds the merge rules on piece ids, one for every split of a piece into
+  // two pieces.
+  has_complete_merge_rules_ = true;
+  for (const auto &it : pieces_) {
+    const absl::string_view piece = it.first;
+    const int id = it.second;
+    if (reserved_id_map_.find(piece) != reserved_id_map_.end()) {
+      // PieceToId() prefers the reserved piece.
+      has_complete_merge_rules_ = false;
+    }
+    const size_t first_char_len = string_util::OneCharLen(piece.data());
+    for (size_t pos = 0; pos < piece.size();) {
+      const size_t mblen = std::max<size_t>(
+          1, std::min(string_util::OneCharLen(piece.data() + pos),
+                      piece.size() - pos));
+      // Merges never produce user defined pieces, as the input spans of
+      // user defined pieces are frozen single symbols.
+      if (first_char_len < piece.size() && !IsUserDefinedInlined(id) &&
+          pieces_.find(piece.substr(pos, mblen)) == pieces_.end()) {
+        has_complete_merge_rules_ = false;
+      }
+      if (pos > 0) {
+        const auto left = pieces_.find(piece.substr(0, pos));
+        const auto right = pieces_.find(piece.substr(pos));
+        if (left != pieces_.end() && right != pieces_.end()) {
+          merge_rules_[MergeRuleKey(left->second, right->second)] = {
+              id, GetScore(id)};
+        }
+      }
+      pos += mblen;
+    }
+  }
+
+  // Unused pieces are merged like any other piece but resegmented into the
+  // two pieces they are merged from. Records that merge for every unused
+  // piece by segmenting the piece itself.
+  std::unique_ptr<Workspace> local;
+  Workspace *workspace = GetWorkspace(&local);
+  for (int id = 0; id < model_proto_->pieces_size(); ++id) {
+    if (!IsUnusedInlined(id)) continue;
+    const absl::string_view piece = model_proto_->pieces(id).piece();
+    std::pair<absl::string_view, absl::string_view> last_merge;
+    if (FindLastMerge(piece, workspace, &last_merge)) {
+      rev_merge_[piece] = last_merge;
+    }
+  }
+  unused_resegmentation_ = MakeResegmentation(nullptr);
+}
+
+bool Model::FindLastMerge(
+    absl::string_view piece, Workspace *workspace,
+    std::pair<absl::string_view, absl::string_view> *last_merge) const {
+  *last_merge = std::make_pair(absl::string_view(), absl::string_view());
+  ApplyMerges(piece, 0.0, workspace, last_merge);
+  return !workspace->symbols.empty() && workspace->symbols[0].next == -1 &&
+         !last_merge->first.empty();
+}
+
+Model::~Model() {}
+
+// static
+Model::Workspace *Model::GetWorkspace(std::unique_ptr<Workspace> *local) {
+#ifdef SPM_NO_THREADLOCAL
+  local->reset(new Workspace);
+  return local->get();
+#else
+  thread_local static Workspace workspace;
+  return &workspace;
+#endif
+}
 
-  // Reverse merge rules.
-  // key: merged symbol, value: pair of original symbols.
-  absl::flat_hash_map<absl::string_view,
-                      std::pair<absl::string_view, absl::string_view>,
-                      string_util::string_view_hash>
-      rev_merge;
+void Model::AddMemoryUsage(MemoryUsage *usage) const {
+  ModelInterface::AddMemoryUsage(usage);
+  usage->piece_maps +=
+      port::HashMapBytes(merge_rules_) + port::HashMapBytes(rev_merge_);
+  if (unused_resegmentation_ != nullptr) {
+    usage->piece_maps += port::ContainerBytes(unused_resegmentation_->offsets) +
+                         port::ContainerBytes(unused_resegmentation_->parts);
+  }
+#ifndef SPM_NO_THREADLOCAL
+  std::unique_ptr<Workspace> local;
+  const Workspace *workspace = GetWorkspace(&local);
+  usage->thread_buffers +=
+      port::ContainerBytes(workspace->symbols) +
+      port::ContainerBytes(workspace->agenda) +
+      workspace->symbol_pair_allocator.capacity() * sizeof(SymbolPair);
+#endif  // SPM_NO_THREADLOCAL
+}
 
-  // Pre-allocates SymbolPair for efficiency.
-  constexpr size_t kPreallocateSymbolPairSize = 256;
-  model::FreeList<SymbolPair> symbol_pair_allocator(kPreallocateSymbolPairSize);
+void Model::ApplyMerges(
+    absl::string_view normalized, float alpha, Workspace *workspace,
+    std::pair<absl::string_view, absl::string_view> *last_merge) const {
+  auto &symbols = workspace->symbols;
+  auto &agenda = workspace->agenda;
+  auto &symbol_pair_allocator = workspace->symbol_pair_allocator;
+  symbols.clear();
+  agenda.clear();
+  symbol_pair_allocator.Free();
+  symbols.reserve(normalized.size());
 
   // Lookup new symbol pair at [left, right] and inserts it to agenda.
-  auto MaybeAddNewSymbolPair = [this, &symbol_pair_allocator, &symbols, &agenda,
-                                &rev_merge](int left, int right) {
+  auto MaybeAddNewSymbolPair = [this, &symbol_pair_allocator, &symbols,
+                                &agenda](int left, int right) {
     if (left == -1 || right == -1 || symbols[left].freeze ||
         symbols[right].freeze)
       return;
@@ -98,13 +216,8 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     h->right = right;
     h->score = GetScore(it->second);
     h->size = piece.size();
-    agenda.push(h);
-
-    // Makes `rev_merge` for resegmentation.
-    if (IsUnusedInlined(it->second)) {
-      rev_merge[piece] =
-          std::make_pair(symbols[left].piece, symbols[right].piece);
-    }
+    agenda.push_back(h);
+    std::push_heap(agenda.begin(), agenda.end(), SymbolPairLess);
   };
 
   // Splits the input into character sequence
@@ -113,6 +226,7 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     Symbol s;
     const int mblen = matcher_->PrefixMatch(normalized, &s.freeze);
     s.piece = absl::string_view(normalized.data(), mblen);
+    s.id = -1;
     s.prev = index == 0 ? -1 : index - 1;
     normalized.remove_prefix(mblen);
     s.next = normalized.empty() ? -1 : index + 1;
@@ -120,29 +234,19 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     symbols.emplace_back(s);
   }
 
-  if (symbols.empty()) {
-    return {};
-  }
-
   // Lookup all bigrams.
   for (size_t i = 1; i < symbols.size(); ++i) {
     MaybeAddNewSymbolPair(i - 1, i);
   }
 
   // BPE-dropout: https://arxiv.org/pdf/1910.13267.pdf
-  std::mt19937 *rand_gen = nullptr;
-  auto skip_merge = [&]() {
-    if (alpha <= 0.0) return false;
-    if (alpha >= 1.0) return true;
-    if (rand_gen == nullptr) rand_gen = random::GetRandomGenerator();
-    std::uniform_real_distribution<> gen(0.0, 1.0);
-    return gen(*rand_gen) < alpha;
-  };
+  DropoutMask dropout(alpha);
 
   // Main loop.
   while (!agenda.empty()) {
-    SymbolPair *top = agenda.top();
-    agenda.pop();
+    std::pop_heap(agenda.begin(), agenda.end(), SymbolPairLess);
+    SymbolPair *top = agenda.back();
+    agenda.pop_back();
 
     // `top` is no longer available.
     if (symbols[top->left].piece.empty() || symbols[top->right].piece.empty() ||
@@ -154,7 +258,12 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     // Note that orignal BPE-dropout paper assumes that all merged symbols are
     // pre computed, but here we randomly skip merge opration inside this loop.
     // This implemenation is theoretically equivalent to the original one.
-    if (skip_merge()) continue;
+    if (dropout.Skip()) continue;
+
+    if (last_merge != nullptr) {
+      *last_merge =
+          std::make_pair(symbols[top->left].piece, symbols[top->right].piece);
+    }
 
     // Replaces symbols with `top` rule.
     symbols[top->left].piece = absl::string_view(
@@ -172,35 +281,238 @@ std::vector<std::pair<absl::string_view, int>> Model::SampleEncode(
     MaybeAddNewSymbolPair(symbols[top->left].prev, top->left);
     MaybeAddNewSymbolPair(top->left, symbols[top->left].next);
   }
+}
 
-  std::function<void(absl::string_view, EncodeResult *)> resegment;
-  resegment = [this, &resegment, &rev_merge](absl::string_view w,
-                                             EncodeResult *output) -> void {
-    const int id = PieceToId(w);
-    if (id == -1 || !IsUnusedInlined(id)) {
-      output->emplace_back(w, id);
+void Model::ApplyMergeRules(absl::string_view normalized, float alpha,
+                            Workspace *workspace) const {
+  auto &symbols = workspace->symbols;
+  auto &agenda = workspace->agenda;
+  auto &symbol_pair_allocator = workspace->symbol_pair_allocator;
+  symbols.clear();
+  agenda.clear();
+  symbol_pair_allocator.Free();
+  symbols.reserve(normalized.size());
+
+  // Looks up the merge rule of the pair at [left, right] and inserts it to
+  // agenda.
+  auto MaybeAddNewSymbolPair = [this, &symbol_pair_allocator, &symbols,
+                                &agenda](int left, int right) {
+    if (left == -1 || right == -1 || symbols[left].freeze ||
+        symbols[right].freeze || symbols[left].id < 0 ||
+        symbols[right].id < 0)
       return;
-    }
-    const auto p = rev_merge.find(w);
-    if (p == rev_merge.end()) {
-      // This block will never be called, as `rev_merge` stores all the
-      // resegmentation info for unused id.
-      output->emplace_back(w, id);
+    const auto it =
+        merge_rules_.find(MergeRuleKey(symbols[left].id, symbols[right].id));
+    if (it == merge_rules_.end()) {
       return;
     }
-    // Recursively resegment left and right symbols.
-    resegment(p->second.first, output);
-    resegment(p->second.second, output);
+    auto *h = symbol_pair_allocator.Allocate();
+    h->left = left;
+    h->right = right;
+    h->score = it->second.score;
+    h->size = symbols[left].piece.size() + symbols[right].piece.size();
+    h->id = it->second.id;
+    agenda.push_back(h);
+    std::push_heap(agenda.begin(), agenda.end(), SymbolPairLess);
   };
 
-  EncodeResult output;
+  // Splits the input into character sequence
+  int index = 0;
+  while (!normalized.empty()) {
+    Symbol s;
+    const int mblen = matcher_->PrefixMatch(normalized, &s.freeze);
+    s.piece = absl::string_view(normalized.data(), mblen);
+    const auto it = pieces_.find(s.piece);
+    s.id = it == pieces_.end() ? -1 : it->second;
+    s.prev = index == 0 ? -1 : index - 1;
+    normalized.remove_prefix(mblen);
+    s.next = normalized.empty() ? -1 : index + 1;
+    ++index;
+    symbols.emplace_back(s);
+  }
+
+  // Lookup all bigrams.
+  for (size_t i = 1; i < symbols.size(); ++i) {
+    MaybeAddNewSymbolPair(i - 1, i);
+  }
+
+  // Main loop. The same as in ApplyMerges(), which tosses the same coins in
+  // the same order.
+  DropoutMask dropout(alpha);
+  while (!agenda.empty()) {
+    std::pop_heap(agenda.begin(), agenda.end(), SymbolPairLess);
+    SymbolPair *top = agenda.back();
+    agenda.pop_back();
+
+    // `top` is no longer available.
+    if (symbols[top->left].piece.empty() || symbols[top->right].piece.empty() ||
+        symbols[top->left].piece.size() + symbols[top->right].piece.size() !=
+            top->size) {
+      continue;
+    }
+
+    if (dropout.Skip()) continue;
+
+    symbols[top->left].piece =
+        absl::string_view(symbols[top->left].piece.data(), top->size);
+    symbols[top->left].id = top->id;
+
+    symbols[top->left].next = symbols[top->right].next;
+    if (symbols[top->right].next >= 0) {
+      symbols[symbols[top->right].next].prev = top->left;
+    }
+    symbols[top->right].piece = absl::string_view("");
+
+    MaybeAddNewSymbolPair(symbols[top->left].prev, top->left);
+    MaybeAddNewSymbolPair(top->left, symbols[top->left].next);
+  }
+}
+
+void Model::Resegment(absl::string_view piece,
+                      const VocabularyMask *vocabulary,
+                      std::unique_ptr<Workspace> *merge_workspace,
+                      EncodeResult *output) const {
+  const int id = PieceToId(piece);
+  if (id == -1 || !IsUnusedInlined(id, vocabulary)) {
+    output->emplace_back(piece, id);
+    return;
+  }
+  std::pair<absl::string_view, absl::string_view> merge;
+  const auto p = rev_merge_.find(piece);
+  if (p != rev_merge_.end()) {
+    merge = p->second;
+  } else {
+    // Unused pieces which cannot be built from their own characters have
+    // no resegmentation rule.
+    if (vocabulary == nullptr) {
+      output->emplace_back(piece, id);
+      return;
+    }
+    if (*merge_workspace == nullptr) {
+      *merge_workspace = absl::make_unique<Workspace>();
+    }
+    if (!FindLastMerge(piece, merge_workspace->get(), &merge)) {
+      output->emplace_back(piece, id);
+      return;
+    }
+  }
+  // Recursively resegment left and right symbols. They are cut from `piece`
+  // so that the output keeps pointing into the normalized input.
+  const size_t left_size = merge.first.size();
+  Resegment(piece.substr(0, left_size), vocabulary, merge_workspace, output);
+  Resegment(piece.substr(left_size), vocabulary, merge_workspace, output);
+}
+
+std::unique_ptr<Model::Resegmentation> Model::MakeResegmentation(
+    const VocabularyMask *vocabulary) const {
+  auto resegmentation = absl::make_unique<Resegmentation>();
+  const int size = model_proto_->pieces_size();
+  resegmentation->offsets.resize(size + 1, 0);
+  std::unique_ptr<Workspace> merge_workspace;
+  EncodeResult parts;
+  for (int id = 0; id < size; ++id) {
+    if (IsUnusedInlined(id, vocabulary)) {
+      parts.clear();
+      Resegment(model_proto_->pieces(id).piece(), vocabulary, &merge_workspace,
+                &parts);
+      if (parts.size() > 1) {
+        for (const auto &part : parts) {
+          resegmentation->parts.emplace_back(part.first.size(), part.second);
+        }
+      }
+    }
+    resegmentation->offsets[id + 1] = resegmentation->parts.size();
+  }
+  return resegmentation;
+}
+
+std::shared_ptr<const void> Model::MakeVocabularyData(
+    const VocabularyMask &mask) const {
+  return std::shared_ptr<const Resegmentation>(MakeResegmentation(&mask));
+}
+
+void Model::AppendResegmented(absl::string_view piece,
+                              const Resegmentation &resegmentation,
+                              EncodeResult *output) const {
+  const int id = PieceToId(piece);
+  const auto &offsets = resegmentation.offsets;
+  if (id < 0 || id + 1 >= static_cast<int>(offsets.size()) ||
+      offsets[id] == offsets[id + 1]) {
+    output->emplace_back(piece, id);
+    return;
+  }
+  // The parts are cut from `piece` so that the output keeps pointing into
+  // the normalized input.
+  for (uint32 i = offsets[id]; i < offsets[id + 1]; ++i) {
+    const auto &part = resegmentation.parts[i];
+    output->emplace_back(piece.substr(0, part.first), part.second);
+    piece.remove_prefix(part.first);
+  }
+}
+
+void Model::EncodeInto(absl::string_view normalized,
+                       const VocabularyMask *vocabulary,
+                       EncodeResult *result) const {
+  vocabulary = ActiveVocabulary(vocabulary);
+  // The merges never cross the start of a word, so the words are encoded
+  // independently. The word cache holds the merges of the full vocabulary.
+  if (vocabulary == nullptr &&
+      EncodeWords(normalized,
+                  [this](absl::string_view word, EncodeResult *output) {
+                    SampleEncode(word, 0.0, nullptr, output);
+                  },
+                  result)) {
+    return;
+  }
+  SampleEncode(normalized, 0.0, vocabulary, result);
+}
+
+void Model::SampleEncode(absl::string_view normalized, float alpha,
+                         const VocabularyMask *vocabulary,
+                         EncodeResult *output) const {
+  output->clear();
+  if (!status().ok() || normalized.empty()) {
+    return;
+  }
+
+  std::unique_ptr<Workspace> local;
+  Workspace *workspace = GetWorkspace(&local);
+  const bool use_merge_rules = has_complete_merge_rules_;
+  if (use_merge_rules) {
+    ApplyMergeRules(normalized, alpha, workspace);
+  } else {
+    ApplyMerges(normalized, alpha, workspace, nullptr);
+  }
+  const auto &symbols = workspace->symbols;
+
+  if (symbols.empty()) {
+    return;
+  }
+
+  // The parts of the unused pieces, precomputed for the model and for the
+  // masks made for it.
+  const Resegmentation *resegmentation =
+      vocabulary == nullptr
+          ? unused_resegmentation_.get()
+          : static_cast<const Resegmentation *>(VocabularyData(vocabulary));
+
+  // Buffers for the merges of pieces out of `vocabulary`, which are not in
+  // rev_merge_.
+  std::unique_ptr<Workspace> merge_workspace;
+
   for (int index = 0; index != -1; index = symbols[index].next) {
     CHECK_GE(index, 0);
     CHECK_LT(index, static_cast<int>(symbols.size()));
-    resegment(symbols[index].piece, &output);
+    const Symbol &symbol = symbols[index];
+    if (use_merge_rules && symbol.id >= 0 &&
+        !IsUnusedInlined(symbol.id, vocabulary)) {
+      output->emplace_back(symbol.piece, symbol.id);
+    } else if (resegmentation != nullptr) {
+      AppendResegmented(symbol.piece, *resegmentation, output);
+    } else {
+      Resegment(symbol.piece, vocabulary, &merge_workspace, output);
+    }
   }
-
-  return output;
 }
 }  // namespace bpe
 }  // namespace sentencepiece
@@ -15,8 +15,13 @@
 #ifndef BPE_MODEL_H_
 #define BPE_MODEL_H_
 
+#include <memory>
+#include <utility>
+#include <vector>
+
 #include "model_interface.h"
 #include "sentencepiece_model.pb.h"
+#include "third_party/absl/container/flat_hash_map.h"
 
 namespace sentencepiece {
 namespace bpe {
@@ -33,19 +38,148 @@ class Model : public ModelInterface {
   ~Model() override;
 
   EncodeResult Encode(absl::string_view normalized) const override {
-    return SampleEncode(normalized, 0.0);
+    return EncodeWithVocabulary(normalized, nullptr);
+  }
+
+  EncodeResult EncodeWithVocabulary(
+      absl::string_view normalized,
+      const VocabularyMask *vocabulary) const override {
+    EncodeResult result;
+    EncodeInto(normalized, vocabulary, &result);
+    return result;
   }
 
+  void EncodeInto(absl::string_view normalized,
+                  const VocabularyMask *vocabulary,
+                  EncodeResult *result) const override;
+
   // Sampling with BPE-dropout: https://arxiv.org/pdf/1910.13267.pdf
   // `alpha` is dropout probability in BPE-dropout paper.
   // Skips merge operation with `alpha` probability.
   // When alpha <= 0.0, no sampling is performed.
   EncodeResult SampleEncode(absl::string_view normalized,
-                            float alpha) const override;
+                            float alpha) const override {
+    return SampleEncode(normalized, alpha, vocabulary_.get());
+  }
 
   bool IsSampleEncodeAvailable() const override { return true; }
 
   bool IsNBestEncodeAvailable() const override { return false; }
+
+  void AddMemoryUsage(MemoryUsage *usage) const override;
+
+  // Returns the Resegmentation of the pieces `mask` marks as unused.
+  std::shared_ptr<const void> MakeVocabularyData(
+      const VocabularyMask &mask) const override;
+
+ private:
+  struct Symbol {
+    int prev;     // prev index of this symbol. -1 for BOS.
+    int next;     // next index of tihs symbol. -1 for EOS.
+    bool freeze;  // this symbol is never be merged.
+    int id;       // id of `piece` in pieces_, or -1. Used by ApplyMergeRules.
+    absl::string_view piece;
+  };
+
+  // Merge of two adjacent pieces into the piece `id` with `score`.
+  struct MergeRule {
+    int id;
+    float score;
+  };
+
+  // Same as SampleEncode(normalized, alpha), but resegments the pieces
+  // `vocabulary` marks as unused, or the UNUSED pieces when `vocabulary` is
+  // nullptr.
+  EncodeResult SampleEncode(absl::string_view normalized, float alpha,
+                            const VocabularyMask *vocabulary) const {
+    EncodeResult output;
+    SampleEncode(normalized, alpha, vocabulary, &output);
+    return output;
+  }
+
+  // Same as above, but stores the pieces in `output`.
+  void SampleEncode(absl::string_view normalized, float alpha,
+                    const VocabularyMask *vocabulary,
+                    EncodeResult *output) const;
+
+  // Per-thread buffers of ApplyMerges(), defined in bpe_model.cc.
+  struct Workspace;
+
+  // Appends `piece` to `output`, recursively split back into the pieces it
+  // was merged from while it is unused. `merge_workspace` is allocated on
+  // demand for the merges which are not in rev_merge_.
+  void Resegment(absl::string_view piece, const VocabularyMask *vocabulary,
+                 std::unique_ptr<Workspace> *merge_workspace,
+                 EncodeResult *output) const;
+
+  // The unused pieces of a vocabulary flattened into the pieces Resegment()
+  // splits them into, so that the encoder looks them up instead of
+  // recursing through the merges.
+  struct Resegmentation {
+    // The parts of piece `id` are parts[offsets[id]] ...
+    // parts[offsets[id + 1] - 1]. Used pieces, and unused pieces kept
+    // whole, have none.
+    std::vector<uint32> offsets;
+    std::vector<std::pair<uint32, int>> parts;  // byte size and id.
+  };
+
+  // Precomputes Resegment() for every piece `vocabulary` marks as unused, or
+  // for the UNUSED pieces when `vocabulary` is nullptr.
+  std::unique_ptr<Resegmentation> MakeResegmentation(
+      const VocabularyMask *vocabulary) const;
+
+  // Appends `piece` to `output`, split into its parts in `resegmentation`.
+  void AppendResegmented(absl::string_view piece,
+                         const Resegmentation &resegmentation,
+                         EncodeResult *output) const;
+
+  // Returns the workspace of the calling thread. `local` owns the workspace
+  // when thread_local is disabled.
+  static Workspace *GetWorkspace(std::unique_ptr<Workspace> *local);
+
+  // Splits `normalized` into characters and merges them with the BPE rules
+  // into workspace->symbols, a linked list starting at index 0. Each merge is
+  // skipped with probability `alpha`. When `last_merge` is not nullptr, it
+  // receives the two pieces of the last merge.
+  void ApplyMerges(
+      absl::string_view normalized, float alpha, Workspace *workspace,
+      std::pair<absl::string_view, absl::string_view> *last_merge) const;
+
+  // Merges `piece` as ApplyMerges() does and returns true if it is merged
+  // into one symbol, in which case `last_merge` receives the last merge.
+  bool FindLastMerge(
+      absl::string_view piece, Workspace *workspace,
+      std::pair<absl::string_view, absl::string_view> *last_merge) const;
+
+  // Same as ApplyMerges(normalized, alpha, workspace, nullptr), but looks up
+  // pairs of piece ids in merge_rules_ instead of concatenated pieces.
+  // Requires has_complete_merge_rules_.
+  void ApplyMergeRules(absl::string_view normalized, float alpha,
+                       Workspace *workspace) const;
+
+  // Returns the key of the pair of pieces `left` and `right` in merge_rules_.
+  static uint64 MergeRuleKey(int left, int right) {
+    return (static_cast<uint64>(left) << 32) | static_cast<uint32>(right);
+  }
+
+  // Merge rules for every pair of pieces whose concatenation is a piece.
+  absl::flat_hash_map<uint64, MergeRule> merge_rules_;
+
+  // True if every merge ApplyMerges() can make is in merge_rules_, i.e.,
+  // every character of a mergeable piece is a piece itself.
+  bool has_complete_merge_rules_ = false;
+
+  FRIEND_TEST(BPEModelTest, EncodeWithMergeRulesTest);
+
+  // Reverse merge rules for resegmentation.
+  // key: unused piece, value: pair of pieces it is merged from.
+  absl::flat_hash_map<absl::string_view,
+                      std::pair<absl::string_view, absl::string_view>,
+                      string_util::string_view_hash>
+      rev_merge_;
+
+  // MakeResegmentation(nullptr), built with the model.
+  std::unique_ptr<const Resegmentation> unused_resegmentation_;
 };
 }  // namespace bpe
 }  // namespace sentencepiece
@@ -13,6 +13,7 @@
 // limitations under the License.!
 
 #include <cstdio>
+#include <random>
 #include <string>
 
 #include "bpe_model.h"
@@ -246,9 +247,88 @@ TEST(BPEModelTest, EncodeWithUnusedTest) {
     EXPECT_EQ("ab", result[0].first);
     EXPECT_EQ("c", result[1].first);
     EXPECT_EQ("d", result[2].first);
+
+    // Resegmented pieces point into the input.
+    const absl::string_view input = "abcdabcd";
+    const auto result2 = model.Encode(input);
+    EXPECT_EQ(6, result2.size());
+    size_t offset = 0;
+    for (size_t i = 0; i < result2.size(); ++i) {
+      EXPECT_EQ(result[i % 3].first, result2[i].first);
+      EXPECT_EQ(input.data() + offset, result2[i].first.data());
+      offset += result2[i].first.size();
+    }
   }
 }
 
+}  // namespace
+
+// Outside of the anonymous namespace to be a friend of Model.
+TEST(BPEModelTest, EncodeWithMergeRulesTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+
+  // All characters are pieces, so Encode() merges pairs of piece ids.
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  AddPiece(&model_proto, "c", 0.0);
+  AddPiece(&model_proto, "ab", -0.1);
+  AddPiece(&model_proto, "bc", -0.1);
+  AddPiece(&model_proto, "ca", -0.2);
+  AddPiece(&model_proto, "abc", -0.3);
+  AddPiece(&model_proto, "cab", -0.3);
+  AddPiece(&model_proto, "abca", -0.4);
+  AddPiece(&model_proto, "bcbc", -0.5);
+  AddPiece(&model_proto, "aa", -0.6);
+  model_proto.mutable_pieces(9)->set_type(ModelProto::SentencePiece::UNUSED);
+
+  const Model model(model_proto);
+  EXPECT_TRUE(model.has_complete_merge_rules_);
+
+  // The same model taking the generic merge loop on pieces.
+  Model generic(model_proto);
+  generic.has_complete_merge_rules_ = false;
+
+  // The same model resegmenting the unused "abc" by recursing on the merges.
+  Model recursive(model_proto);
+  ASSERT_TRUE(recursive.unused_resegmentation_ != nullptr);
+  recursive.unused_resegmentation_.reset();
+
+  std::mt19937 mt(0);
+  std::uniform_int_distribution<int> dist(0, 3);
+  EncodeResult reused;
+  for (int n = 0; n < 1000; ++n) {
+    std::string input;
+    for (int i = 0; i < n % 50; ++i) input += "abcx"[dist(mt)];
+    const auto expected = generic.Encode(input);
+    const auto result = model.Encode(input);
+    EXPECT_EQ(expected.size(), result.size());
+    for (size_t i = 0; i < result.size(); ++i) {
+      EXPECT_EQ(expected[i].first, result[i].first);
+      EXPECT_EQ(expected[i].second, result[i].second);
+    }
+    // EncodeInto() overwrites the previous result.
+    model.EncodeInto(input, nullptr, &reused);
+    EXPECT_EQ(result, reused);
+    EXPECT_EQ(recursive.Encode(input), result);
+
+    // Both loops toss the same coins for BPE-dropout.
+    for (const float alpha : {0.1f, 0.5f}) {
+      EncodeResult sampled, generic_sampled;
+      {
+        const random::ScopedCounterGenerator generator(n, 0);
+        sampled = model.SampleEncode(input, alpha);
+      }
+      {
+        const random::ScopedCounterGenerator generator(n, 0);
+        generic_sampled = generic.SampleEncode(input, alpha);
+      }
+      EXPECT_EQ(generic_sampled, sampled);
+    }
+  }
+}
+
+namespace {
+
 TEST(SampleModelTest, EncodeTest) {
   ModelProto model_proto = MakeBaseModelProto();
 
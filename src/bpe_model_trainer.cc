@@ -13,16 +13,27 @@
 // limitations under the License.!
 
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 #include <vector>
 
 #include "bpe_model_trainer.h"
 #include "third_party/absl/container/flat_hash_set.h"
+#include "third_party/absl/memory/memory.h"
 #include "util.h"
 
 namespace sentencepiece {
 namespace bpe {
+namespace {
+// Number of sentences converted to symbols by one task.
+constexpr int64 kSentenceChunkSize = 256;
+
+// Number of positions of the best symbol merged by one task.
+constexpr int64 kPositionChunkSize = 1024;
+}  // namespace
 
 std::string Trainer::Symbol::ToString() const {
   return string_util::UnicodeTextToUTF8(chars);
@@ -35,8 +46,7 @@ Trainer::Symbol *Trainer::GetCharSymbol(char32 c) {
   if (it != symbols_cache_.end()) {
     return it->second;
   }
-  Symbol *s = new Symbol;
-  allocated_.push_back(s);
+  Symbol *s = NewSymbol();
   s->is_unk = (kUNKChar == c);
   s->fp = c;
   s->chars.push_back(c);
@@ -68,8 +78,7 @@ Trainer::Symbol *Trainer::GetPairSymbol(const Symbol *left,
     return nullptr;
   }
 
-  Symbol *s = new Symbol;
-  allocated_.push_back(s);
+  Symbol *s = NewSymbol();
   s->fp = fp;
   s->left = left;
   s->right = right;
@@ -78,6 +87,29 @@ Trainer::Symbol *Trainer::GetPairSymbol(const Symbol *left,
   return s;
 }
 
+Trainer::Symbol *Trainer::NewSymbol() { return symbol_allocator_.Allocate(); }
+
+// static
+uint64 Trainer::TieKey(const Symbol &symbol) {
+  // Characters take 21 bits, so the length gets the upper 22 bits.
+  constexpr uint64 kMaxLength = (1ULL << 22) - 1;
+  const auto &chars = symbol.chars;
+  const uint64 length = std::min<uint64>(chars.size(), kMaxLength);
+  const uint64 c0 = chars.empty() ? 0 : chars[0];
+  const uint64 c1 = chars.size() < 2 ? 0 : chars[1];
+  return length << 42 | c0 << 21 | c1;
+}
+
+// static
+void Trainer::SortPositions(Symbol *symbol) {
+  if (symbol->positions_sorted) return;
+  auto &positions = symbol->positions;
+  std::sort(positions.begin(), positions.end());
+  positions.erase(std::unique(positions.begin(), positions.end()),
+                  positions.end());
+  symbol->positions_sorted = true;
+}
+
 void Trainer::ComputeFreq(Symbol *symbol) const {
   if (symbol->freq > 0) {  // if freq == 0, re-computation is required.
     return;
@@ -85,8 +117,12 @@ void Trainer::ComputeFreq(Symbol *symbol) const {
   // Avoids double-count. ("AAA" => only count the first "AA").
   Position prev_pos = {-1, 0};
   CHECK_EQ(0, symbol->freq);
-  for (auto it = symbol->positions.begin(); it != symbol->positions.end();) {
-    const Position pos = DecodePos(*it);
+  SortPositions(symbol);
+  // Valid positions are compacted to the front of the list.
+  auto &positions = symbol->positions;
+  size_t size = 0;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    const Position pos = DecodePos(positions[i]);
     // There are two same bigrams in "AAA", [AA] [AA], and we want to
     // remove the second one to avoid double counts.
     // If the right symbol in the first bigram and the left symbol in the
@@ -97,78 +133,246 @@ void Trainer::ComputeFreq(Symbol *symbol) const {
     if ((pos.sid == prev_pos.sid && pos.left == prev_pos.right) ||
         symbol->left != symbols_[pos.sid][pos.left] ||
         symbol->right != symbols_[pos.sid][pos.right]) {
-      it = symbol->positions.erase(it);
       // Initializes prev_pos.
       // In "AAAA", the last "AA" can be counted.
       prev_pos = {-1, 0};
     } else {
       symbol->freq += sentences_[pos.sid].second;
       prev_pos = pos;
-      ++it;
+      positions[size++] = positions[i];
     }
   }
+  positions.resize(size);
+}
+
+void Trainer::AddNewPair(int sid, int left, int right) {
+  if (left == -1 || right == -1) return;
+  AddNewPair(symbols_[sid][left], symbols_[sid][right],
+             EncodePos(sid, left, right));
 }
 
-int Trainer::GetNextIndex(int sid, int index) const {
-  for (size_t i = index + 1; i < symbols_[sid].size(); ++i) {
-    if (symbols_[sid][i] == nullptr) continue;
-    return i;
+void Trainer::AddNewPair(const Symbol *left, const Symbol *right,
+                         uint64 encoded_pos) {
+  auto *symbol = GetPairSymbol(left, right);
+  if (symbol != nullptr) {
+    if (symbol->freq == 0) dirty_symbols_.push_back(symbol);
+    if (!symbol->positions.empty() && encoded_pos <= symbol->positions.back()) {
+      symbol->positions_sorted = false;
+    }
+    symbol->positions.push_back(encoded_pos);
   }
-  return -1;
 }
 
-int Trainer::GetPrevIndex(int sid, int index) const {
-  for (int i = index - 1; i >= 0; --i) {
-    if (symbols_[sid][i] == nullptr) continue;
-    return i;
+void Trainer::ResetFreq(const Symbol *left, const Symbol *right,
+                        const Symbol *best) {
+  auto *symbol = GetPairSymbol(left, right);
+  if (symbol != nullptr && symbol != best) {
+    if (symbol->freq != 0) dirty_symbols_.push_back(symbol);
+    symbol->freq = 0;
   }
-  return -1;
 }
 
-void Trainer::AddNewPair(int sid, int left, int right) {
-  if (left == -1 || right == -1) return;
-  auto *symbol = GetPairSymbol(symbols_[sid][left], symbols_[sid][right]);
-  if (symbol != nullptr) {
-    active_symbols_.insert(symbol);
-    symbol->positions.insert(EncodePos(sid, left, right));
+bool Trainer::IsAlive(const Symbol *symbol) const {
+  const auto it = symbols_cache_.find(symbol->fp);
+  return it != symbols_cache_.end() && it->second == symbol;
+}
+
+void Trainer::UpdateAgenda() {
+  // A symbol can be listed more than once, but is pushed only once.
+  // ComputeFreq() only touches the symbol itself, so the frequencies are
+  // computed in parallel and pushed in the order of the list.
+  absl::flat_hash_set<const Symbol *> seen;
+  size_t size = 0;
+  for (Symbol *symbol : dirty_symbols_) {
+    if (!IsAlive(symbol) || symbol->freq > 0 || !seen.insert(symbol).second) {
+      continue;
+    }
+    dirty_symbols_[size++] = symbol;
+  }
+  dirty_symbols_.resize(size);
+
+  constexpr int64 kSymbolChunkSize = 64;
+  ParallelFor(dirty_symbols_.size(), kSymbolChunkSize,
+              [this](int64 begin, int64 end) {
+                for (int64 i = begin; i < end; ++i) {
+                  ComputeFreq(dirty_symbols_[i]);
+                }
+              });
+
+  for (Symbol *symbol : dirty_symbols_) {
+    agenda_.push({symbol->freq, TieKey(*symbol), symbol});
   }
+  dirty_symbols_.clear();
 }
 
-void Trainer::ResetFreq(int sid, int left, int right, const Symbol *best) {
-  if (left == -1 || right == -1) return;
-  auto *symbol = GetPairSymbol(symbols_[sid][left], symbols_[sid][right]);
-  if (symbol != nullptr && symbol != best) {
-    symbol->freq = 0;
+void Trainer::ParallelFor(int64 size, int64 chunk_size,
+                          const std::function<void(int64, int64)> &fn) const {
+  // Small inputs are not worth waking up the workers.
+  if (trainer_spec_.num_threads() <= 1 || size <= chunk_size) {
+    if (size > 0) fn(0, size);
+    return;
   }
+  pool()->ParallelFor(size, chunk_size, fn);
 }
 
-void Trainer::UpdateActiveSymbols() {
-  std::vector<Symbol *> symbols;
-  for (auto &it : symbols_cache_) {
-    Symbol *symbol = it.second;
-    if (symbol->IsBigram()) {
-      ComputeFreq(symbol);
-      symbols.push_back(symbol);
+Trainer::Symbol *Trainer::PopBestSymbol() {
+  UpdateAgenda();
+  while (!agenda_.empty()) {
+    const AgendaEntry top = agenda_.top();
+    agenda_.pop();
+    if (IsAlive(top.symbol) && top.freq == top.symbol->freq) {
+      return top.symbol;
     }
   }
+  return nullptr;
+}
 
-  // At least kMinActiveSymbolsSize symbols must be in |active_symbols_|.
-  constexpr int kMinActiveSymbolsSize = 1000;
+util::Status Trainer::MergeSymbol(Symbol *best_symbol,
+                                  std::vector<MergeUpdate> *updates) {
+  // Add new bigrams which are created after symbol replacement.
+  // We do not need to scan all characters, but scan the neighbors in
+  // best_symbol.
+  // Sentences are rewritten in parallel, each recording its affected
+  // bigrams in a MergeUpdate. The updates touch shared symbols, so they
+  // are applied afterwards in the order of best_symbol->positions.
+  SortPositions(best_symbol);
+  const std::vector<uint64> &positions = best_symbol->positions;
+  updates->resize(positions.size());
+  std::vector<Position> bad_positions;
+  std::mutex bad_positions_mutex;
+  ParallelFor(positions.size(), kPositionChunkSize, [&](int64 begin,
+                                                       int64 end) {
+    // A chunk must not start in the middle of a sentence, as the
+    // positions of one sentence depend on each other.
+    while (begin > 0 && begin < end &&
+           DecodePos(positions[begin - 1]).sid ==
+               DecodePos(positions[begin]).sid) {
+      ++begin;
+    }
+    if (begin >= end) return;
+    while (end < static_cast<int64>(positions.size()) &&
+           DecodePos(positions[end - 1]).sid ==
+               DecodePos(positions[end]).sid) {
+      ++end;
+    }
+    for (int64 i = begin; i < end; ++i) {
+      const Position pos = DecodePos(positions[i]);
+      MergeUpdate *update = &(*updates)[i];
+      update->skip = false;
 
-  // Keeps top 5% frequent symbols.
-  constexpr float kTopFrequentRatio = 0.05;
-  const int size =
-      std::min<int>(std::max<int>(kMinActiveSymbolsSize,
-                                  symbols_cache_.size() * kTopFrequentRatio),
-                    symbols.size());
+      if (symbols_[pos.sid][pos.left] == nullptr) {
+        // left index might be NULL (set in the previous iteration)
+        // when left_symbol == right_symbol.
+        update->skip = true;
+        continue;
+      }
+      if (symbols_[pos.sid][pos.right] == nullptr) {
+        std::lock_guard<std::mutex> lock(bad_positions_mutex);
+        bad_positions.push_back(pos);
+        update->skip = true;
+        continue;
+      }
 
-  std::partial_sort(symbols.begin(), symbols.begin() + size, symbols.end(),
-                    [](Symbol *s1, Symbol *s2) { return s1->freq > s2->freq; });
-  LOG(INFO) << "Updating active symbols. max_freq=" << symbols[0]->freq
-            << " min_freq=" << symbols[size - 1]->freq;
+      // We have three bigrams [prev, left], [left, right], [right, next],
+      // which are affected with this symbol replacement.
+      update->next = GetNextIndex(pos.sid, pos.right);
+      update->prev = GetPrevIndex(pos.sid, pos.left);
+      update->prev_symbol =
+          update->prev == -1 ? nullptr : symbols_[pos.sid][update->prev];
+      update->left_symbol = symbols_[pos.sid][pos.left];
+      update->right_symbol = symbols_[pos.sid][pos.right];
+      update->next_symbol =
+          update->next == -1 ? nullptr : symbols_[pos.sid][update->next];
+
+      // Merges two symbols.
+      symbols_[pos.sid][pos.left] = best_symbol;
+      symbols_[pos.sid][pos.right] = nullptr;
+      auto &links = links_[pos.sid];
+      links[pos.left].next = update->next;
+      if (update->next != -1) links[update->next].prev = pos.left;
+    }
+  });
+  CHECK_OR_RETURN(bad_positions.empty());
 
-  active_symbols_.clear();
-  active_symbols_.insert(symbols.begin(), symbols.begin() + size);
+  for (size_t i = 0; i < positions.size(); ++i) {
+    const MergeUpdate &update = (*updates)[i];
+    if (update.skip) continue;
+    const Position pos = DecodePos(positions[i]);
+
+    // Resets the frequencies of bigrams [prev, left] and [right, next].
+    if (update.prev != -1) {
+      ResetFreq(update.prev_symbol, update.left_symbol, best_symbol);
+    }
+    if (update.next != -1) {
+      ResetFreq(update.right_symbol, update.next_symbol, best_symbol);
+    }
+
+    // Makes new symbol bigrams [prev, left] and [left, next].
+    if (update.prev != -1) {
+      AddNewPair(update.prev_symbol, best_symbol,
+                 EncodePos(pos.sid, update.prev, pos.left));
+    }
+    if (update.next != -1) {
+      AddNewPair(best_symbol, update.next_symbol,
+                 EncodePos(pos.sid, pos.left, update.next));
+    }
+  }
+
+  // Removes best_symbol so it is not selected again.
+  symbols_cache_.erase(best_symbol->fp);
+
+  return util::OkStatus();
+}
+
+util::Status Trainer::MergeInitPieces(int vocab_size,
+                                      absl::flat_hash_set<std::string> *dup,
+                                      std::vector<MergeUpdate> *updates) {
+  std::vector<std::pair<std::string, float>> pieces;
+  RETURN_IF_ERROR(LoadInitPieces(&pieces));
+
+  // The symbols of the characters and the merged pieces by their text. A
+  // piece can be the bigram of any split into two of them.
+  absl::flat_hash_map<std::string, Symbol *> merged;
+  for (const auto &it : symbols_cache_) {
+    if (it.second->chars.size() == 1) {
+      merged.emplace(it.second->ToString(), it.second);
+    }
+  }
+
+  int num_merged = 0;
+  for (const auto &w : pieces) {
+    if (final_pieces_.size() >= static_cast<size_t>(vocab_size)) break;
+    const string_util::UnicodeText chars =
+        string_util::UTF8ToUnicodeText(w.first);
+    if (chars.size() <= 1 || !dup->insert(w.first).second) continue;
+    final_pieces_.emplace_back(w.first,
+                               -static_cast<float>(final_pieces_.size()));
+
+    // Merges the most frequent split of the piece.
+    UpdateAgenda();
+    Symbol *best_symbol = nullptr;
+    for (size_t i = 1; i < chars.size(); ++i) {
+      const auto left = merged.find(string_util::UnicodeTextToUTF8(
+          string_util::UnicodeText(chars.begin(), chars.begin() + i)));
+      const auto right = merged.find(string_util::UnicodeTextToUTF8(
+          string_util::UnicodeText(chars.begin() + i, chars.end())));
+      if (left == merged.end() || right == merged.end()) continue;
+      const auto it = symbols_cache_.find(
+          port::FingerprintCat(left->second->fp, right->second->fp));
+      if (it != symbols_cache_.end() && it->second->freq > 0 &&
+          (best_symbol == nullptr || it->second->freq > best_symbol->freq)) {
+        best_symbol = it->second;
+      }
+    }
+    if (best_symbol == nullptr) continue;
+    RETURN_IF_ERROR(MergeSymbol(best_symbol, updates));
+    merged.emplace(w.first, best_symbol);
+    ++num_merged;
+  }
+
+  LOG(INFO) << "Added " << final_pieces_.size() << " pieces of the initial "
+            << "model, of which " << num_merged << " occur in the corpus";
+  return util::OkStatus();
 }
 
 util::Status Trainer::Train() {
@@ -178,9 +382,11 @@ util::Status Trainer::Train() {
   CHECK_EQ_OR_RETURN(TrainerSpec::BPE, trainer_spec_.model_type());
 
   symbols_.clear();
-  allocated_.clear();
+  links_.clear();
+  symbol_allocator_.Free();
   symbols_cache_.clear();
-  active_symbols_.clear();
+  agenda_ = decltype(agenda_)();
+  dirty_symbols_.clear();
 
   // Load all sentences
   RETURN_IF_ERROR(LoadSentences());
@@ -189,12 +395,39 @@ util::Status Trainer::Train() {
     SplitSentencesByWhitespace();
   }
 
+  TrainerProfiler::Phase init_phase(profiler(), "init_symbols");
+  init_phase.set_sentences(sentences_.size());
+
   // Initializes symbols_. symbols_[sid][i] stores an unary symbol.
+  // Sentences only consist of required_chars_ and kUNKChar, so all unary
+  // symbols are created first and the sentences are converted in parallel.
+  for (const auto &it : required_chars_) GetCharSymbol(it.first);
+  GetCharSymbol(kUNKChar);
   symbols_.resize(sentences_.size());
-  for (size_t i = 0; i < sentences_.size(); ++i) {
-    for (const char32 c : string_util::UTF8ToUnicodeText(sentences_[i].first)) {
-      symbols_[i].push_back(GetCharSymbol(c));
+  links_.resize(sentences_.size());
+  std::vector<char32> bad_chars(sentences_.size(), 0);
+  ParallelFor(sentences_.size(), kSentenceChunkSize, [&](int64 begin,
+                                                        int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      for (const char32 c :
+           string_util::UTF8ToUnicodeText(sentences_[i].first)) {
+        const auto it = symbols_cache_.find(c);
+        if (it == symbols_cache_.end()) {
+          bad_chars[i] = c;
+          break;
+        }
+        symbols_[i].push_back(it->second);
+      }
+      const int size = symbols_[i].size();
+      links_[i].resize(size);
+      for (int j = 0; j < size; ++j) {
+        links_[i][j].prev = j - 1;
+        links_[i][j].next = j + 1 < size ? j + 1 : -1;
+      }
     }
+  });
+  for (const char32 c : bad_chars) {
+    CHECK_EQ_OR_RETURN(0, c) << "Unexpected character U+" << c;
   }
 
   // Makes all bigram symbols.
@@ -203,6 +436,7 @@ util::Status Trainer::Train() {
       AddNewPair(sid, i - 1, i);
     }
   }
+  init_phase.End();
 
   const int vocab_size =
       trainer_spec_.vocab_size() - meta_pieces_.size() - required_chars_.size();
@@ -213,101 +447,104 @@ util::Status Trainer::Train() {
   // e.g., "aaa" => "aa" + "a" or "a" + "aa".
   absl::flat_hash_set<std::string> dup;
 
-  // Main loop.
+  // Buffer for the merge of best_symbol.
+  std::vector<MergeUpdate> updates;
+
+  // Main loop. The profile has one record per kMergeProfileInterval merges.
+  constexpr size_t kMergeProfileInterval = 1000;
+  std::unique_ptr<TrainerProfiler::Phase> merge_phase;
+  int merge_records = 0;
   CHECK_OR_RETURN(final_pieces_.empty());
+  if (!trainer_spec_.init_model().empty()) {
+    RETURN_IF_ERROR(MergeInitPieces(vocab_size, &dup, &updates));
+  }
   while (final_pieces_.size() < static_cast<size_t>(vocab_size)) {
-    constexpr int kUpdateActiveSymbolsInteval = 100;
-    if (final_pieces_.size() % kUpdateActiveSymbolsInteval == 0) {
-      UpdateActiveSymbols();
+    if (merge_phase == nullptr) {
+      merge_phase =
+          absl::make_unique<TrainerProfiler::Phase>(profiler(), "merge");
     }
 
-    // Scanning active symbols, finds the best_symbol with highest freq.
-    Symbol *best_symbol = nullptr;
-    for (auto &it : active_symbols_) {
-      Symbol *symbol = it;
-      ComputeFreq(symbol);
-      // If the frequency is the same, take shorter symbol.
-      // if the length is the same, use lexicographical comparison
-      if (best_symbol == nullptr ||
-          (symbol->freq > best_symbol->freq ||
-           (symbol->freq == best_symbol->freq &&
-            (symbol->chars.size() < best_symbol->chars.size() ||
-             (symbol->chars.size() == best_symbol->chars.size() &&
-              symbol->ToString() < best_symbol->ToString()))))) {
-        best_symbol = symbol;
-      }
-    }
+    // Finds the best_symbol with highest freq.
+    Symbol *best_symbol = PopBestSymbol();
 
     if (best_symbol == nullptr) {
       LOG(WARNING) << "No valid symbol found";
       break;
     }
 
-    if (!dup.insert(best_symbol->ToString()).second) {
+    std::string piece = best_symbol->ToString();
+    if (!dup.insert(piece).second) {
       // Removes best_symbol so it is not selected again.
       symbols_cache_.erase(best_symbol->fp);
-      active_symbols_.erase(best_symbol);
       continue;
     }
 
     // Stores the best_symbol in the final output.
-    final_pieces_.emplace_back(best_symbol->ToString(),
+    final_pieces_.emplace_back(std::move(piece),
                                -static_cast<float>(final_pieces_.size()));
 
     if (final_pieces_.size() % 20 == 0) {
       LOG(INFO) << "Added: freq=" << best_symbol->freq
                 << " size=" << final_pieces_.size()
                 << " all=" << symbols_cache_.size()
-                << " active=" << active_symbols_.size()
-                << " piece=" << best_symbol->ToString();
+                << " piece=" << final_pieces_.back().first;
     }
 
-    // Add new bigrams which are created after symbol replacement.
-    // We do not need to scan all characters, but scan the neighbors in
-    // best_symbol.
-    for (const uint64 &encoded_pos : best_symbol->positions) {
-      const Position pos = DecodePos(encoded_pos);
+    if (final_pieces_.size() % kMergeProfileInterval == 0) {
+      merge_phase->set_iteration(merge_records++);
+      merge_phase->set_vocab_size(final_pieces_.size());
+      merge_phase.reset();
+    }
 
-      if (symbols_[pos.sid][pos.left] == nullptr) {
-        // left index might be NULL (set in the previous iteration)
-        // when left_symbol == right_symbol.
-        continue;
-      }
-      CHECK_OR_RETURN(symbols_[pos.sid][pos.right]);
+    RETURN_IF_ERROR(MergeSymbol(best_symbol, &updates));
+  }  // end of main loop
 
-      // We have three bigrams [prev, left], [left, right], [right, next],
-      // which are affected with this symbol replacement.
-      const int next = GetNextIndex(pos.sid, pos.right);
-      const int prev = GetPrevIndex(pos.sid, pos.left);
+  if (merge_phase != nullptr) {
+    merge_phase->set_iteration(merge_records++);
+    merge_phase->set_vocab_size(final_pieces_.size());
+    merge_phase.reset();
+  }
 
-      // Resets the frequencies of bigrams [prev, left] and [right, next].
-      ResetFreq(pos.sid, prev, pos.left, best_symbol);
-      ResetFreq(pos.sid, pos.right, next, best_symbol);
+  std::vector<std::string> required_pieces;
+  for (const auto &w : Sorted(required_chars_, pool())) {
+    required_pieces.push_back(GetCharSymbol(w.first)->ToString());
+  }
 
-      // Merges two symbols.
-      symbols_[pos.sid][pos.left] = best_symbol;
-      symbols_[pos.sid][pos.right] = nullptr;
+  // Releases the memory held by the symbols.
+  links_.clear();
+  for (size_t i = 0; i < symbol_allocator_.size(); ++i) {
+    *symbol_allocator_[i] = Symbol();
+  }
+  symbol_allocator_.Free();
+  symbols_cache_.clear();
 
-      // Makes new symbol bigrams [prev, left] and [left, next].
-      AddNewPair(pos.sid, prev, pos.left);
-      AddNewPair(pos.sid, pos.left, next);
+  // Adds required_chars_
+  auto add_required_pieces = [&]() {
+    for (const auto &piece : required_pieces) {
+      final_pieces_.emplace_back(piece,
+                                 -static_cast<float>(final_pieces_.size()));
     }
+  };
 
-    // Removes best_symbol so it is not selected again.
-    symbols_cache_.erase(best_symbol->fp);
-    active_symbols_.erase(best_symbol);
-  }  // end of main loop
-
-  // Adds required_chars_
-  for (const auto &w : Sorted(required_chars_)) {
-    const Symbol *symbol = GetCharSymbol(w.first);
-    final_pieces_.emplace_back(symbol->ToString(),
-                               -static_cast<float>(final_pieces_.size()));
+  if (trainer_spec_.vocab_sizes_size() == 0) {
+    add_required_pieces();
+    return Save();
   }
 
-  port::STLDeleteElements(&allocated_);
+  // The merges of a smaller vocab size are a prefix of the merges.
+  const auto merges = std::move(final_pieces_);
+  for (const int size : GetVocabSizes()) {
+    const int num_merges =
+        size - meta_pieces_.size() - required_pieces.size();
+    CHECK_GE_OR_RETURN(num_merges, 0);
+    final_pieces_.assign(
+        merges.begin(),
+        merges.begin() + std::min<size_t>(num_merges, merges.size()));
+    add_required_pieces();
+    RETURN_IF_ERROR(SaveForVocabSize(size));
+  }
 
-  return Save();
+  return util::OkStatus();
 }
 }  // namespace bpe
 }  // namespace sentencepiece
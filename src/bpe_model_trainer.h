@@ -15,12 +15,16 @@
 #ifndef BPE_MODEL_TRAINER_H_
 #define BPE_MODEL_TRAINER_H_
 
-#include <set>
+#include <functional>
+#include <queue>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "freelist.h"
 #include "sentencepiece_model.pb.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "trainer_interface.h"
 
 namespace sentencepiece {
@@ -33,7 +37,8 @@ class Trainer : public TrainerInterface {
           const NormalizerSpec &normalizer_spec,
           const NormalizerSpec &denormalizer_spec)
       : TrainerInterface::TrainerInterface(trainer_spec, normalizer_spec,
-                                           denormalizer_spec) {}
+                                           denormalizer_spec),
+        symbol_allocator_(kSymbolChunkSize) {}
 
   util::Status Train() override;
 
@@ -47,13 +52,20 @@ class Trainer : public TrainerInterface {
     uint64 fp;                       // fingerprint of this symbol.
     uint64 freq;                     // frequency of this symbol.
 
-    // Position list. Use set so that we can keep the order of occurrence.
-    // See EncodePos/DecodePos.
-    std::set<uint64> positions;
+    // Position list. New positions are appended, and SortPositions() sorts
+    // the list in the order of occurrence. See EncodePos/DecodePos.
+    std::vector<uint64> positions;
+    bool positions_sorted;  // true if |positions| is sorted and unique.
 
     bool IsBigram() const { return left != nullptr && right != nullptr; }
     std::string ToString() const;
-    Symbol() : left(nullptr), right(nullptr), is_unk(false), fp(0), freq(0) {}
+    Symbol()
+        : left(nullptr),
+          right(nullptr),
+          is_unk(false),
+          fp(0),
+          freq(0),
+          positions_sorted(true) {}
   };
 
   struct Position {
@@ -89,38 +101,130 @@ class Trainer : public TrainerInterface {
   // Gets symbol pair from left/right symbols. The return value is cached.
   Symbol *GetPairSymbol(const Symbol *left, const Symbol *right);
 
+  // Returns a new symbol from |symbol_allocator_|.
+  Symbol *NewSymbol();
+
+  // Sorts symbol->positions and removes duplicates.
+  static void SortPositions(Symbol *symbol);
+
   // Computes the frequency of |symbol| and update symbol->freq field.
   void ComputeFreq(Symbol *symbol) const;
 
-  // Returns the valid index before symbols_[sid][index].
-  int GetNextIndex(int sid, int index) const;
+  // Returns the valid index after symbols_[sid][index], or -1.
+  int GetNextIndex(int sid, int index) const {
+    return links_[sid][index].next;
+  }
 
-  // Returns the valid index after symbols_[sid][index].
-  int GetPrevIndex(int sid, int index) const;
+  // Returns the valid index before symbols_[sid][index], or -1.
+  int GetPrevIndex(int sid, int index) const {
+    return links_[sid][index].prev;
+  }
 
   // Makes a new bigram from [symbols_[sid][left], symbols_[sid][right]] and
-  // Adds it to symbols_cache_ and active_symbols_.
+  // adds it to symbols_cache_. Bigrams of unknown frequency are added to
+  // |dirty_symbols_|.
   void AddNewPair(int sid, int left, int right);
 
-  // Resets the fequency of bigram [symbols_[sid][left] symbols_[sid][right]],
-  // if this bigram is not |best|.
-  void ResetFreq(int sid, int left, int right, const Symbol *best);
+  // Same as above, but takes the symbols and the encoded position of the
+  // bigram.
+  void AddNewPair(const Symbol *left, const Symbol *right, uint64 encoded_pos);
+
+  // Resets the fequency of bigram [left, right], if this bigram is not |best|.
+  void ResetFreq(const Symbol *left, const Symbol *right, const Symbol *best);
+
+  // Bigrams affected by merging one position of the best symbol. Filled in
+  // parallel and applied in order of the positions.
+  struct MergeUpdate {
+    bool skip;  // true if the position is no longer merged.
+    int prev;   // index before the left symbol, or -1.
+    int next;   // index after the right symbol, or -1.
+    const Symbol *prev_symbol;
+    const Symbol *left_symbol;
+    const Symbol *right_symbol;
+    const Symbol *next_symbol;
+  };
+
+  // Merges all the positions of |best_symbol|, records the new bigrams
+  // around them and removes |best_symbol| from symbols_cache_. |updates| is
+  // a buffer reused across the merges.
+  util::Status MergeSymbol(Symbol *best_symbol,
+                           std::vector<MergeUpdate> *updates);
+
+  // Adds the pieces of spec.init_model() to final_pieces_ in the order of
+  // their merges, up to |vocab_size| pieces, and merges the bigram of every
+  // piece that occurs in the sentences. The pieces are added to |dup|.
+  util::Status MergeInitPieces(int vocab_size,
+                               absl::flat_hash_set<std::string> *dup,
+                               std::vector<MergeUpdate> *updates);
+
+  // Calls `fn` on chunks of [0, size) on pool(), or on the calling thread
+  // when training is single-threaded or `size` is small.
+  void ParallelFor(int64 size, int64 chunk_size,
+                   const std::function<void(int64, int64)> &fn) const;
+
+  // Returns true if |symbol| is in symbols_cache_, i.e., it has not been
+  // selected nor removed.
+  bool IsAlive(const Symbol *symbol) const;
 
-  // Updates |active_symbols_| by copying the top 5% frequent symbols in
-  // symbols_cache_.
-  void UpdateActiveSymbols();
+  // Computes the frequencies of |dirty_symbols_| and pushes them to
+  // |agenda_|.
+  void UpdateAgenda();
+
+  // Pops the bigram with the highest frequency from |agenda_|.
+  // Returns nullptr if no bigram is left.
+  Symbol *PopBestSymbol();
 
   // All unique symbols. Key is a fingerprint of Symbol.
   absl::flat_hash_map<uint64, Symbol *> symbols_cache_;
 
-  // Set of symbols from which we find the best symbol in each iteration.
-  std::set<Symbol *> active_symbols_;
+  // Bigram with its frequency at the time it was pushed to |agenda_|.
+  struct AgendaEntry {
+    uint64 freq;
+    uint64 tie_key;  // TieKey() of the symbol.
+    Symbol *symbol;
+  };
+
+  // Returns a key ordering symbols by their length and then by their first
+  // two characters, as the tie-break of AgendaEntryLess does, so that most
+  // ties are broken without looking at the symbols.
+  static uint64 TieKey(const Symbol &symbol);
+
+  // Orders AgendaEntry by frequency. If the frequency is the same, takes
+  // the shorter symbol. If the length is the same, uses lexicographical
+  // comparison.
+  struct AgendaEntryLess {
+    bool operator()(const AgendaEntry &e1, const AgendaEntry &e2) const {
+      if (e1.freq != e2.freq) return e1.freq < e2.freq;
+      if (e1.tie_key != e2.tie_key) return e1.tie_key > e2.tie_key;
+      return e2.symbol->chars < e1.symbol->chars;
+    }
+  };
+
+  // Max-heap of bigrams. An entry is stale when its frequency differs from
+  // the current frequency of the symbol or the symbol is no longer alive;
+  // stale entries are skipped when popped. A symbol whose frequency
+  // changes is pushed again through |dirty_symbols_|.
+  std::priority_queue<AgendaEntry, std::vector<AgendaEntry>, AgendaEntryLess>
+      agenda_;
+
+  // Bigrams whose frequency needs to be recomputed.
+  std::vector<Symbol *> dirty_symbols_;
 
-  // Stores symbols allocated in heap so that we can delete them at onece.
-  std::vector<Symbol *> allocated_;
+  // Allocates all symbols in chunks so that we can free them at once.
+  static constexpr size_t kSymbolChunkSize = 1024;
+  model::FreeList<Symbol> symbol_allocator_;
 
   // Sentences. symbols_[sid][index] stores a symbol in sentence_[sid][index].
   std::vector<std::vector<Symbol *>> symbols_;
+
+  // Indices of the valid slots around symbols_[sid][index], as in the
+  // symbols of bpe::Model::Encode(), so that neighbors are found without
+  // skipping the slots emptied by merges. Only meaningful for valid slots.
+  struct Link {
+    int prev;
+    int next;
+  };
+  std::vector<std::vector<Link>> links_;
 };
 }  // namespace bpe
 }  // namespace sentencepiece
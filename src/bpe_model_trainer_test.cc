@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <cstdio>
 #include <string>
 #include <vector>
 
@@ -33,7 +34,8 @@ namespace {
 
 std::string RunTrainer(
     const std::vector<std::string> &input, int size,
-    const std::vector<std::string> &user_defined_symbols = {}) {
+    const std::vector<std::string> &user_defined_symbols = {},
+    int num_threads = 1) {
   const std::string input_file =
       util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "input");
   const std::string model_prefix =
@@ -50,6 +52,7 @@ std::string RunTrainer(
   trainer_spec.add_input(input_file);
   trainer_spec.set_vocab_size(size - 3);  // remove <unk>, <s>, </s>
   trainer_spec.set_model_prefix(model_prefix);
+  trainer_spec.set_num_threads(num_threads);
 
   NormalizerSpec normalizer_spec;
   normalizer_spec.set_name("identity");
@@ -89,6 +92,19 @@ TEST(BPETrainerTest, BasicTest) {
             RunTrainer({"pen", "pineapple", "apple"}, 20, {"app"}));
 }
 
+TEST(BPETrainerTest, MultiThreadTest) {
+  // Enough occurrences for the merges to be split across threads.
+  std::vector<std::string> input;
+  const std::vector<std::string> words = {"abracadabra", "pineapple",
+                                          "apple", "hellohe", "cadabra"};
+  for (int i = 0; i < 5000; ++i) {
+    input.emplace_back(words[i % words.size()] + words[(i / 7) % words.size()] +
+                       " " + words[(i / 3) % words.size()]);
+  }
+  const std::string expected = RunTrainer(input, 60, {}, 1);
+  EXPECT_EQ(expected, RunTrainer(input, 60, {}, 4));
+}
+
 static constexpr char kTestInputData[] = "wagahaiwa_nekodearu.txt";
 
 TEST(BPETrainerTest, EndToEndTest) {
@@ -129,11 +145,92 @@ TEST(BPETrainerTest, EndToEndTest) {
   EXPECT_EQ(WS
             " 吾輩 《 わが はい 》 は猫 である 。 名前 はまだ 無い 。 "
             "どこで 生 れた か とん と見 当 《 けんとう 》 が つかぬ 。 "
-            "何でも 薄 暗 いじ め じ め した 所で ニャー ニャー 泣 いていた "
+            "何でも 薄 暗 いじ め じ め した 所で ニャー (#startrepeat) 2 "
+            "(#endrepeat) 泣 いていた "
             "事 だけは 記憶 している 。",
             absl::StrJoin(tok, " "));
 }
 
+TEST(BPETrainerTest, VocabSizesTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_sizes");
+
+  auto load_pieces = [](const std::string &filename) {
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(filename).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                               " --model_type=bpe --vocab_sizes=1000,500"))
+                  .ok());
+
+  // Every model is the one of a training for its size.
+  for (const int size : {500, 1000}) {
+    ASSERT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --model_type=bpe --vocab_size=", size))
+                    .ok());
+    const auto pieces =
+        load_pieces(absl::StrCat(prefix, ".", size, ".model"));
+    EXPECT_EQ(size, pieces.size());
+    EXPECT_EQ(load_pieces(absl::StrCat(prefix, ".model")), pieces);
+  }
+
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --model_type=word --vocab_sizes=1000,500"))
+                   .ok());
+}
+
+TEST(BPETrainerTest, InitModelTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_init");
+
+  auto train = [&](absl::string_view flags) {
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --model_type=bpe", flags))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  // Continuing from the merges of a smaller model on the same corpus makes
+  // the same merges as a training from scratch.
+  const auto expected = train(" --vocab_size=1000");
+  train(" --vocab_size=500");
+  const std::string init_model = absl::StrCat(prefix, ".init.model");
+  std::rename(absl::StrCat(prefix, ".model").c_str(), init_model.c_str());
+  EXPECT_EQ(expected,
+            train(absl::StrCat(" --vocab_size=1000 --init_model=", init_model)));
+
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --model_type=unigram --vocab_size=1000",
+                                " --init_model=", init_model))
+                   .ok());
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --model_type=bpe --vocab_size=1000",
+                                " --init_model=__not_found__.model"))
+                   .ok());
+}
+
 }  // namespace
 }  // namespace bpe
 }  // namespace sentencepiece
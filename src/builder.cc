@@ -109,6 +109,18 @@ std::vector<Builder::Chars> ExpandUnnormalized(
   CHECK_EQ(nfkd.size(), results[0].size());
   return results;
 }
+
+// Calls `fn(begin, end)` for consecutive chunks of at most `chunk_size`
+// elements covering [0, size) with `num_threads` threads.
+void ParallelFor(int num_threads, int64 size, int64 chunk_size,
+                 const std::function<void(int64, int64)> &fn) {
+  if (num_threads <= 1 || size <= chunk_size) {
+    fn(0, size);
+    return;
+  }
+  ThreadPool pool(num_threads - 1);
+  pool.ParallelFor(size, chunk_size, fn);
+}
 #endif
 
 // Normalizes `src` with `chars_map` and returns normalized Chars.
@@ -289,50 +301,91 @@ util::Status Builder::GetPrecompiledCharsMap(const std::string &name,
 }
 
 // static
-util::Status Builder::BuildNFKCMap(CharsMap *chars_map) {
+util::Status Builder::BuildNFKCMap(CharsMap *chars_map, int num_threads) {
 #ifdef ENABLE_NFKC_COMPILE
   LOG(INFO) << "Running BuildNFKCMap";
 
-  // Set of fully NFKD decomposed characters.
-  std::set<Builder::Chars> nfkd_decomposed;
+  // Results of a range of code points.
+  struct CodePointRange {
+    // Set of fully NFKD decomposed characters.
+    std::set<Builder::Chars> nfkd_decomposed;
 
-  // Fully normalized one character to unnormalized one character map.
-  std::map<char32, std::set<char32>> norm2orig;
+    // Fully normalized one character to unnormalized one character map.
+    std::map<char32, std::set<char32>> norm2orig;
 
-  Builder::CharsMap nfkc_map;  // The final NFKC mapping.
+    // Single character to NFKC mapping.
+    Builder::CharsMap nfkc_map;
+  };
 
-  constexpr int kMaxUnicode = 0x10FFFF;
-  for (char32 cp = 1; cp <= kMaxUnicode; ++cp) {
-    if (!U_IS_UNICODE_CHAR(cp)) {
-      continue;
-    }
-    // Aggregates single character to fully NFKC normalized characters.
-    const auto nfkc = ToNFKC({cp});
-    if (nfkc.size() >= 2 || (nfkc.size() == 1 && nfkc[0] != cp)) {
-      nfkc_map[{cp}] = nfkc;
-    }
-    const auto nfkd = ToNFKD({cp});
-    if (nfkd.size() == 1) {
-      // Aggregates reverse mapping from normalized to unnormalized character.
-      norm2orig[nfkd[0]].insert(cp);
-    } else {
-      // One character is decomposed into multiple characters.
-      nfkd_decomposed.insert(nfkd);
-    }
-  }
+  // The code points are swept in parallel. The ranges are merged in order,
+  // so that the mapping does not depend on `num_threads`.
+  constexpr int64 kCodePointChunkSize = 0x4000;
+  std::vector<CodePointRange> ranges(kMaxUnicode / kCodePointChunkSize + 1);
+  ParallelFor(num_threads, kMaxUnicode + 1, kCodePointChunkSize,
+              [&ranges](int64 begin, int64 end) {
+                for (char32 cp = std::max<int64>(begin, 1); cp < end; ++cp) {
+                  if (!U_IS_UNICODE_CHAR(cp)) {
+                    continue;
+                  }
+                  auto *range = &ranges[cp / kCodePointChunkSize];
+                  // Aggregates single character to fully NFKC normalized
+                  // characters.
+                  const auto nfkc = ToNFKC({cp});
+                  if (nfkc.size() >= 2 || (nfkc.size() == 1 && nfkc[0] != cp)) {
+                    range->nfkc_map[{cp}] = nfkc;
+                  }
+                  const auto nfkd = ToNFKD({cp});
+                  if (nfkd.size() == 1) {
+                    // Aggregates reverse mapping from normalized to
+                    // unnormalized character.
+                    range->norm2orig[nfkd[0]].insert(cp);
+                  } else {
+                    // One character is decomposed into multiple characters.
+                    range->nfkd_decomposed.insert(nfkd);
+                  }
+                }
+              });
 
-  for (const auto &nfkd : nfkd_decomposed) {
-    const auto nfkc = ToNFC(nfkd);
-    // This case is already covered by single-character to NFKC mapping.
-    if (nfkc == nfkd) {
-      continue;
+  std::set<Builder::Chars> nfkd_decomposed;
+  std::map<char32, std::set<char32>> norm2orig;
+  Builder::CharsMap nfkc_map;  // The final NFKC mapping.
+  for (auto &range : ranges) {
+    nfkd_decomposed.insert(range.nfkd_decomposed.begin(),
+                           range.nfkd_decomposed.end());
+    for (const auto &p : range.norm2orig) {
+      norm2orig[p.first].insert(p.second.begin(), p.second.end());
     }
-    // Expand all possible sequences which are normalized into the same
-    // `nfkd`.
-    for (const auto &nfkd_orig : ExpandUnnormalized(nfkd, norm2orig)) {
-      if (nfkd_orig != nfkc) {
-        nfkc_map[nfkd_orig] = nfkc;
-      }
+    nfkc_map.insert(range.nfkc_map.begin(), range.nfkc_map.end());
+  }
+  ranges.clear();
+
+  // Expands all possible sequences which are normalized into the same
+  // `nfkd` in parallel. The rules are added in the order of `nfkd`.
+  const std::vector<Builder::Chars> decomposed(nfkd_decomposed.begin(),
+                                               nfkd_decomposed.end());
+  std::vector<std::vector<std::pair<Builder::Chars, Builder::Chars>>> expanded(
+      decomposed.size());
+  ParallelFor(num_threads, decomposed.size(), 64,
+              [&decomposed, &norm2orig, &expanded](int64 begin, int64 end) {
+                for (int64 i = begin; i < end; ++i) {
+                  const auto &nfkd = decomposed[i];
+                  const auto nfkc = ToNFC(nfkd);
+                  // This case is already covered by single-character to
+                  // NFKC mapping.
+                  if (nfkc == nfkd) {
+                    continue;
+                  }
+                  for (auto &nfkd_orig : ExpandUnnormalized(nfkd, norm2orig)) {
+                    if (nfkd_orig != nfkc) {
+                      expanded[i].emplace_back(std::move(nfkd_orig), nfkc);
+                    }
+                  }
+                }
+              });
+
+  for (auto &rules : expanded) {
+    for (auto &p : rules) {
+      nfkc_map[p.first] = std::move(p.second);
     }
   }
 
@@ -347,12 +400,12 @@ util::Status Builder::BuildNFKCMap(CharsMap *chars_map) {
   return util::OkStatus();
 }
 
-util::Status Builder::BuildNmtNFKCMap(CharsMap *chars_map) {
+util::Status Builder::BuildNmtNFKCMap(CharsMap *chars_map, int num_threads) {
 #ifdef ENABLE_NFKC_COMPILE
   LOG(INFO) << "Running BuildNmtNFKCMap";
 
   CharsMap nfkc_map;
-  RETURN_IF_ERROR(Builder::BuildNFKCMap(&nfkc_map));
+  RETURN_IF_ERROR(Builder::BuildNFKCMap(&nfkc_map, num_threads));
 
   // Other code points considered as whitespace.
   nfkc_map[{0x0009}] = {0x20};  // TAB
@@ -447,10 +500,10 @@ util::Status Builder::MergeUnicodeCaseFoldMap(Builder::CharsMap *chars_map) {
 }
 
 // static
-util::Status Builder::BuildNFKC_CFMap(CharsMap *chars_map) {
+util::Status Builder::BuildNFKC_CFMap(CharsMap *chars_map, int num_threads) {
 #ifdef ENABLE_NFKC_COMPILE
   CharsMap nfkc_map;
-  RETURN_IF_ERROR(Builder::BuildNFKCMap(&nfkc_map));
+  RETURN_IF_ERROR(Builder::BuildNFKCMap(&nfkc_map, num_threads));
   RETURN_IF_ERROR(Builder::MergeUnicodeCaseFoldMap(&nfkc_map));
   *chars_map = std::move(nfkc_map);
 #else
@@ -462,10 +515,11 @@ util::Status Builder::BuildNFKC_CFMap(CharsMap *chars_map) {
 }
 
 //  static
-util::Status Builder::BuildNmtNFKC_CFMap(CharsMap *chars_map) {
+util::Status Builder::BuildNmtNFKC_CFMap(CharsMap *chars_map,
+                                        int num_threads) {
 #ifdef ENABLE_NFKC_COMPILE
   CharsMap nfkc_map;
-  RETURN_IF_ERROR(Builder::BuildNmtNFKCMap(&nfkc_map));
+  RETURN_IF_ERROR(Builder::BuildNmtNFKCMap(&nfkc_map, num_threads));
   RETURN_IF_ERROR(Builder::MergeUnicodeCaseFoldMap(&nfkc_map));
   *chars_map = std::move(nfkc_map);
 #else
@@ -89,20 +89,27 @@ class Builder {
   //     normalizer is the goal of SentencePiece.
   //
   // TODO(taku): Make NFC, NFD, and NFKD mapping if necessary.
-  static util::Status BuildNFKCMap(CharsMap *chars_map);
+  //
+  // The Unicode code points and the expansion of decomposed characters are
+  // processed with `num_threads` threads. The mapping is the same for any
+  // number of threads.
+  static util::Status BuildNFKCMap(CharsMap *chars_map, int num_threads = 1);
 
   // Makes an NFKC-based mapping with NMT specific modifications around
   // whitespaces.
-  static util::Status BuildNmtNFKCMap(CharsMap *chars_map);
+  static util::Status BuildNmtNFKCMap(CharsMap *chars_map,
+                                      int num_threads = 1);
 
   // Merge Unicode case folding mapping into `chars_map`.
   static util::Status MergeUnicodeCaseFoldMap(CharsMap *chars_map);
 
   // Makes NFKC with Unicode case folding.
-  static util::Status BuildNFKC_CFMap(CharsMap *chars_map);
+  static util::Status BuildNFKC_CFMap(CharsMap *chars_map,
+                                      int num_threads = 1);
 
   // Makes NMT NFKC with Unicode case folding.
-  static util::Status BuildNmtNFKC_CFMap(CharsMap *chars_map);
+  static util::Status BuildNmtNFKC_CFMap(CharsMap *chars_map,
+                                         int num_threads = 1);
 
   static util::Status BuildUncaserMap(CharsMap *chars_map);
   static util::Status BuildRecaserMap(CharsMap *chars_map);
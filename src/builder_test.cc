@@ -55,6 +55,11 @@ TEST(BuilderTest, BuildNFKCMapTest) {
 #ifdef ENABLE_NFKC_COMPILE
   EXPECT_TRUE(Builder::BuildNFKCMap(&chars_map).ok());
   EXPECT_TRUE(!chars_map.empty());
+
+  // The mapping does not depend on the number of threads.
+  Builder::CharsMap parallel_chars_map;
+  EXPECT_TRUE(Builder::BuildNFKCMap(&parallel_chars_map, 4).ok());
+  EXPECT_EQ(chars_map, parallel_chars_map);
 #else
   EXPECT_TRUE(Builder::BuildNFKCMap(&chars_map).ok());
 #endif
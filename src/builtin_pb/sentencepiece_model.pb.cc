@@ -267,6 +267,8 @@ const int TrainerSpec::kUnkIdFieldNumber;
 const int TrainerSpec::kBosIdFieldNumber;
 const int TrainerSpec::kEosIdFieldNumber;
 const int TrainerSpec::kPadIdFieldNumber;
+const int TrainerSpec::kCorpusMemoryBudgetMbFieldNumber;
+const int TrainerSpec::kSeedFromUniqueWordsFieldNumber;
 const int TrainerSpec::kUnkPieceFieldNumber;
 const int TrainerSpec::kBosPieceFieldNumber;
 const int TrainerSpec::kEosPieceFieldNumber;
@@ -289,7 +291,9 @@ TrainerSpec::TrainerSpec(const TrainerSpec& from)
       input_(from.input_),
       accept_language_(from.accept_language_),
       control_symbols_(from.control_symbols_),
-      user_defined_symbols_(from.user_defined_symbols_) {
+      user_defined_symbols_(from.user_defined_symbols_),
+      vocab_sizes_(from.vocab_sizes_),
+      candidate_models_(from.candidate_models_) {
   _internal_metadata_.MergeFrom(from._internal_metadata_);
   _extensions_.MergeFrom(from._extensions_);
   model_prefix_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
@@ -324,9 +328,25 @@ TrainerSpec::TrainerSpec(const TrainerSpec& from)
   if (from.has_pad_piece()) {
     pad_piece_.AssignWithDefault(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_pad_piece_.get(), from.pad_piece_);
   }
+  checkpoint_dir_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  if (from.has_checkpoint_dir()) {
+    checkpoint_dir_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.checkpoint_dir_);
+  }
+  profile_output_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  if (from.has_profile_output()) {
+    profile_output_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.profile_output_);
+  }
+  corpus_cache_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  if (from.has_corpus_cache()) {
+    corpus_cache_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.corpus_cache_);
+  }
+  init_model_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  if (from.has_init_model()) {
+    init_model_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.init_model_);
+  }
   ::memcpy(&self_test_sample_size_, &from.self_test_sample_size_,
-    static_cast<size_t>(reinterpret_cast<char*>(&pad_id_) -
-    reinterpret_cast<char*>(&self_test_sample_size_)) + sizeof(pad_id_));
+    static_cast<size_t>(reinterpret_cast<char*>(&prune_score_margin_) -
+    reinterpret_cast<char*>(&self_test_sample_size_)) + sizeof(prune_score_margin_));
   // @@protoc_insertion_point(copy_constructor:sentencepiece.TrainerSpec)
 }
 
@@ -339,6 +359,10 @@ void TrainerSpec::SharedCtor() {
   bos_piece_.UnsafeSetDefault(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_bos_piece_.get());
   eos_piece_.UnsafeSetDefault(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_eos_piece_.get());
   pad_piece_.UnsafeSetDefault(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_pad_piece_.get());
+  checkpoint_dir_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  profile_output_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  corpus_cache_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  init_model_.UnsafeSetDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
   ::memset(&self_test_sample_size_, 0, static_cast<size_t>(
       reinterpret_cast<char*>(&train_extremely_large_corpus_) -
       reinterpret_cast<char*>(&self_test_sample_size_)) + sizeof(train_extremely_large_corpus_));
@@ -360,6 +384,17 @@ void TrainerSpec::SharedCtor() {
   bos_id_ = 1;
   eos_id_ = 2;
   pad_id_ = -1;
+  corpus_memory_budget_mb_ = 0;
+  seed_from_unique_words_ = false;
+  resume_ = false;
+  seek_sampling_ = false;
+  em_batch_size_ = 0;
+  em_tolerance_ = 0.0001f;
+  compact_repeat_counts_ = false;
+  max_memory_mb_ = 0;
+  dedup_input_sentences_ = false;
+  prune_incremental_rounds_ = 0;
+  prune_score_margin_ = 0.5f;
 }
 
 TrainerSpec::~TrainerSpec() {
@@ -376,6 +411,10 @@ void TrainerSpec::SharedDtor() {
   bos_piece_.DestroyNoArena(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_bos_piece_.get());
   eos_piece_.DestroyNoArena(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_eos_piece_.get());
   pad_piece_.DestroyNoArena(&::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_pad_piece_.get());
+  checkpoint_dir_.DestroyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  profile_output_.DestroyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  corpus_cache_.DestroyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  init_model_.DestroyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
 }
 
 void TrainerSpec::SetCachedSize(int size) const {
@@ -397,7 +436,9 @@ void TrainerSpec::Clear() {
   input_.Clear();
   accept_language_.Clear();
   control_symbols_.Clear();
+  candidate_models_.Clear();
   user_defined_symbols_.Clear();
+  vocab_sizes_.Clear();
   cached_has_bits = _has_bits_[0];
   if (cached_has_bits & 255u) {
     if (cached_has_bits & 0x00000001u) {
@@ -452,12 +493,35 @@ void TrainerSpec::Clear() {
     vocabulary_output_piece_score_ = true;
   }
   cached_has_bits = _has_bits_[1];
-  if (cached_has_bits & 15u) {
+  if (cached_has_bits & 0x00000040u) {
+    checkpoint_dir_.ClearNonDefaultToEmptyNoArena();
+  }
+  if (cached_has_bits & 0x00000100u) {
+    profile_output_.ClearNonDefaultToEmptyNoArena();
+  }
+  if (cached_has_bits & 0x00000800u) {
+    corpus_cache_.ClearNonDefaultToEmptyNoArena();
+  }
+  if (cached_has_bits & 0x00004000u) {
+    init_model_.ClearNonDefaultToEmptyNoArena();
+  }
+  if (cached_has_bits & 191u) {
     hard_vocab_limit_ = true;
     bos_id_ = 1;
     eos_id_ = 2;
     pad_id_ = -1;
-  }
+    corpus_memory_budget_mb_ = 0;
+    seed_from_unique_words_ = false;
+    resume_ = false;
+  }
+  seek_sampling_ = false;
+  em_batch_size_ = 0;
+  em_tolerance_ = 0.0001f;
+  compact_repeat_counts_ = false;
+  max_memory_mb_ = 0;
+  dedup_input_sentences_ = false;
+  prune_incremental_rounds_ = 0;
+  prune_score_margin_ = 0.5f;
   _has_bits_.Clear();
   _internal_metadata_.Clear();
 }
@@ -1021,6 +1085,238 @@ bool TrainerSpec::MergePartialFromCodedStream(
         break;
       }
 
+      // optional int32 corpus_memory_budget_mb = 50 [default = 0];
+      case 50: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(144u /* 400 & 0xFF */)) {
+          set_has_corpus_memory_budget_mb();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   ::google::protobuf::int32, ::google::protobuf::internal::WireFormatLite::TYPE_INT32>(
+                 input, &corpus_memory_budget_mb_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional bool seed_from_unique_words = 51 [default = false];
+      case 51: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(152u /* 408 & 0xFF */)) {
+          set_has_seed_from_unique_words();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   bool, ::google::protobuf::internal::WireFormatLite::TYPE_BOOL>(
+                 input, &seed_from_unique_words_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional string checkpoint_dir = 52;
+      case 52: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(162u /* 418 & 0xFF */)) {
+          DO_(::google::protobuf::internal::WireFormatLite::ReadString(
+                input, this->mutable_checkpoint_dir()));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional bool resume = 53 [default = false];
+      case 53: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(168u /* 424 & 0xFF */)) {
+          set_has_resume();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   bool, ::google::protobuf::internal::WireFormatLite::TYPE_BOOL>(
+                 input, &resume_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional string profile_output = 54;
+      case 54: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(178u /* 434 & 0xFF */)) {
+          DO_(::google::protobuf::internal::WireFormatLite::ReadString(
+                input, this->mutable_profile_output()));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional bool seek_sampling = 55 [default = false];
+      case 55: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(184u /* 440 & 0xFF */)) {
+          set_has_seek_sampling();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   bool, ::google::protobuf::internal::WireFormatLite::TYPE_BOOL>(
+                 input, &seek_sampling_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // repeated int32 vocab_sizes = 57;
+      case 57: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(200u /* 456 & 0xFF */)) {
+          DO_((::google::protobuf::internal::WireFormatLite::ReadRepeatedPrimitive<
+                   ::google::protobuf::int32, ::google::protobuf::internal::WireFormatLite::TYPE_INT32>(
+                 2, 456u, input, this->mutable_vocab_sizes())));
+        } else if (
+            static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(202u /* 458 & 0xFF */)) {
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPackedPrimitiveNoInline<
+                   ::google::protobuf::int32, ::google::protobuf::internal::WireFormatLite::TYPE_INT32>(
+                 input, this->mutable_vocab_sizes())));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional string corpus_cache = 58;
+      case 58: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(210u /* 466 & 0xFF */)) {
+          DO_(::google::protobuf::internal::WireFormatLite::ReadString(
+                input, this->mutable_corpus_cache()));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+      // optional int32 em_batch_size = 59 [default = 0];
+      case 59: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(216u /* 472 & 0xFF */)) {
+          set_has_em_batch_size();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   ::google::protobuf::int32, ::google::protobuf::internal::WireFormatLite::TYPE_INT32>(
+                 input, &em_batch_size_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional float em_tolerance = 60 [default = 0.0001];
+      case 60: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(229u /* 485 & 0xFF */)) {
+          set_has_em_tolerance();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   float, ::google::protobuf::internal::WireFormatLite::TYPE_FLOAT>(
+                 input, &em_tolerance_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional string init_model = 61;
+      case 61: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(234u /* 490 & 0xFF */)) {
+          DO_(::google::protobuf::internal::WireFormatLite::ReadString(
+                input, this->mutable_init_model()));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // repeated string candidate_models = 62;
+      case 62: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(242u /* 498 & 0xFF */)) {
+          DO_(::google::protobuf::internal::WireFormatLite::ReadString(
+                input, this->add_candidate_models()));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional bool compact_repeat_counts = 63 [default = false];
+      case 63: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(248u /* 504 & 0xFF */)) {
+          set_has_compact_repeat_counts();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   bool, ::google::protobuf::internal::WireFormatLite::TYPE_BOOL>(
+                 input, &compact_repeat_counts_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional int32 max_memory_mb = 64 [default = 0];
+      case 64: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(0u /* 512 & 0xFF */)) {
+          set_has_max_memory_mb();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   ::google::protobuf::int32, ::google::protobuf::internal::WireFormatLite::TYPE_INT32>(
+                 input, &max_memory_mb_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional bool dedup_input_sentences = 65 [default = false];
+      case 65: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(8u /* 520 & 0xFF */)) {
+          set_has_dedup_input_sentences();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   bool, ::google::protobuf::internal::WireFormatLite::TYPE_BOOL>(
+                 input, &dedup_input_sentences_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional int32 prune_incremental_rounds = 66 [default = 0];
+      case 66: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(16u /* 528 & 0xFF */)) {
+          set_has_prune_incremental_rounds();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   ::google::protobuf::int32, ::google::protobuf::internal::WireFormatLite::TYPE_INT32>(
+                 input, &prune_incremental_rounds_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
+      // optional float prune_score_margin = 67 [default = 0.5];
+      case 67: {
+        if (static_cast< ::google::protobuf::uint8>(tag) ==
+            static_cast< ::google::protobuf::uint8>(29u /* 541 & 0xFF */)) {
+          set_has_prune_score_margin();
+          DO_((::google::protobuf::internal::WireFormatLite::ReadPrimitive<
+                   float, ::google::protobuf::internal::WireFormatLite::TYPE_FLOAT>(
+                 input, &prune_score_margin_)));
+        } else {
+          goto handle_unusual;
+        }
+        break;
+      }
+
       default: {
       handle_unusual:
         if (tag == 0) {
@@ -1271,6 +1567,97 @@ void TrainerSpec::SerializeWithCachedSizes(
     ::google::protobuf::internal::WireFormatLite::WriteBool(49, this->train_extremely_large_corpus(), output);
   }
 
+  cached_has_bits = _has_bits_[1];
+  // optional int32 corpus_memory_budget_mb = 50 [default = 0];
+  if (cached_has_bits & 0x00000010u) {
+    ::google::protobuf::internal::WireFormatLite::WriteInt32(50, this->corpus_memory_budget_mb(), output);
+  }
+
+  // optional bool seed_from_unique_words = 51 [default = false];
+  if (cached_has_bits & 0x00000020u) {
+    ::google::protobuf::internal::WireFormatLite::WriteBool(51, this->seed_from_unique_words(), output);
+  }
+
+  // optional string checkpoint_dir = 52;
+  if (cached_has_bits & 0x00000040u) {
+    ::google::protobuf::internal::WireFormatLite::WriteStringMaybeAliased(
+      52, this->checkpoint_dir(), output);
+  }
+
+  // optional bool resume = 53 [default = false];
+  if (cached_has_bits & 0x00000080u) {
+    ::google::protobuf::internal::WireFormatLite::WriteBool(53, this->resume(), output);
+  }
+
+  // optional string profile_output = 54;
+  if (cached_has_bits & 0x00000100u) {
+    ::google::protobuf::internal::WireFormatLite::WriteStringMaybeAliased(
+      54, this->profile_output(), output);
+  }
+
+  // optional bool seek_sampling = 55 [default = false];
+  if (cached_has_bits & 0x00000200u) {
+    ::google::protobuf::internal::WireFormatLite::WriteBool(55, this->seek_sampling(), output);
+  }
+
+  // repeated int32 vocab_sizes = 57;
+  for (int i = 0, n = this->vocab_sizes_size(); i < n; i++) {
+    ::google::protobuf::internal::WireFormatLite::WriteInt32(
+      57, this->vocab_sizes(i), output);
+  }
+
+  // optional string corpus_cache = 58;
+  if (cached_has_bits & 0x00000800u) {
+    ::google::protobuf::internal::WireFormatLite::WriteStringMaybeAliased(
+      58, this->corpus_cache(), output);
+  }
+  // optional int32 em_batch_size = 59 [default = 0];
+  if (cached_has_bits & 0x00001000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteInt32(59, this->em_batch_size(), output);
+  }
+
+  // optional float em_tolerance = 60 [default = 0.0001];
+  if (cached_has_bits & 0x00002000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteFloat(60, this->em_tolerance(), output);
+  }
+
+  // optional string init_model = 61;
+  if (cached_has_bits & 0x00004000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteStringMaybeAliased(
+      61, this->init_model(), output);
+  }
+
+  // repeated string candidate_models = 62;
+  for (int i = 0, n = this->candidate_models_size(); i < n; i++) {
+    ::google::protobuf::internal::WireFormatLite::WriteString(
+      62, this->candidate_models(i), output);
+  }
+
+  // optional bool compact_repeat_counts = 63 [default = false];
+  if (cached_has_bits & 0x00008000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteBool(63, this->compact_repeat_counts(), output);
+  }
+
+  // optional int32 max_memory_mb = 64 [default = 0];
+  if (cached_has_bits & 0x00010000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteInt32(64, this->max_memory_mb(), output);
+  }
+
+  // optional bool dedup_input_sentences = 65 [default = false];
+  if (cached_has_bits & 0x00020000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteBool(65, this->dedup_input_sentences(), output);
+  }
+
+  // optional int32 prune_incremental_rounds = 66 [default = 0];
+  if (cached_has_bits & 0x00040000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteInt32(66, this->prune_incremental_rounds(), output);
+  }
+
+  // optional float prune_score_margin = 67 [default = 0.5];
+  if (cached_has_bits & 0x00080000u) {
+    ::google::protobuf::internal::WireFormatLite::WriteFloat(67, this->prune_score_margin(), output);
+  }
+
   // Extension range [200, 536870912)
   _extensions_.SerializeWithCachedSizes(
       200, 536870912, output);
@@ -1527,7 +1914,7 @@ size_t TrainerSpec::ByteSizeLong() const {
     }
 
   }
-  if (_has_bits_[32 / 32] & 15u) {
+  if (_has_bits_[32 / 32] & 255u) {
     // optional bool hard_vocab_limit = 33 [default = true];
     if (has_hard_vocab_limit()) {
       total_size += 2 + 1;
@@ -1554,7 +1941,114 @@ size_t TrainerSpec::ByteSizeLong() const {
           this->pad_id());
     }
 
+    // optional int32 corpus_memory_budget_mb = 50 [default = 0];
+    if (has_corpus_memory_budget_mb()) {
+      total_size += 2 +
+        ::google::protobuf::internal::WireFormatLite::Int32Size(
+          this->corpus_memory_budget_mb());
+    }
+
+    // optional bool seed_from_unique_words = 51 [default = false];
+    if (has_seed_from_unique_words()) {
+      total_size += 2 + 1;
+    }
+
+    // optional string checkpoint_dir = 52;
+    if (has_checkpoint_dir()) {
+      total_size += 2 +
+        ::google::protobuf::internal::WireFormatLite::StringSize(
+          this->checkpoint_dir());
+    }
+
+    // optional bool resume = 53 [default = false];
+    if (has_resume()) {
+      total_size += 2 + 1;
+    }
+
+  }
+  // optional string profile_output = 54;
+  if (has_profile_output()) {
+    total_size += 2 +
+      ::google::protobuf::internal::WireFormatLite::StringSize(
+        this->profile_output());
+  }
+
+  // optional bool seek_sampling = 55 [default = false];
+  if (has_seek_sampling()) {
+    total_size += 2 + 1;
+  }
+
+  // repeated int32 vocab_sizes = 57;
+  {
+    size_t data_size = ::google::protobuf::internal::WireFormatLite::
+      Int32Size(this->vocab_sizes_);
+    total_size += 2 *
+                  ::google::protobuf::internal::FromIntSize(this->vocab_sizes_size());
+    total_size += data_size;
+  }
+
+  // repeated string candidate_models = 62;
+  total_size += 2 *
+      ::google::protobuf::internal::FromIntSize(this->candidate_models_size());
+  for (int i = 0, n = this->candidate_models_size(); i < n; i++) {
+    total_size += ::google::protobuf::internal::WireFormatLite::StringSize(
+      this->candidate_models(i));
   }
+
+  // optional string corpus_cache = 58;
+  if (has_corpus_cache()) {
+    total_size += 2 +
+      ::google::protobuf::internal::WireFormatLite::StringSize(
+        this->corpus_cache());
+  }
+  // optional int32 em_batch_size = 59 [default = 0];
+  if (has_em_batch_size()) {
+    total_size += 2 +
+      ::google::protobuf::internal::WireFormatLite::Int32Size(
+        this->em_batch_size());
+  }
+
+  // optional float em_tolerance = 60 [default = 0.0001];
+  if (has_em_tolerance()) {
+    total_size += 2 + 4;
+  }
+
+  // optional string init_model = 61;
+  if (has_init_model()) {
+    total_size += 2 +
+      ::google::protobuf::internal::WireFormatLite::StringSize(
+        this->init_model());
+  }
+
+  // optional bool compact_repeat_counts = 63 [default = false];
+  if (has_compact_repeat_counts()) {
+    total_size += 2 + 1;
+  }
+
+  // optional int32 max_memory_mb = 64 [default = 0];
+  if (has_max_memory_mb()) {
+    total_size += 2 +
+      ::google::protobuf::internal::WireFormatLite::Int32Size(
+        this->max_memory_mb());
+  }
+
+  // optional bool dedup_input_sentences = 65 [default = false];
+  if (has_dedup_input_sentences()) {
+    total_size += 2 + 1;
+  }
+
+  // optional int32 prune_incremental_rounds = 66 [default = 0];
+  if (has_prune_incremental_rounds()) {
+    total_size += 2 +
+      ::google::protobuf::internal::WireFormatLite::Int32Size(
+        this->prune_incremental_rounds());
+  }
+
+  // optional float prune_score_margin = 67 [default = 0.5];
+  if (has_prune_score_margin()) {
+    total_size += 2 + 4;
+  }
+
   int cached_size = ::google::protobuf::internal::ToCachedSize(total_size);
   SetCachedSize(cached_size);
   return total_size;
@@ -1577,6 +2071,8 @@ void TrainerSpec::MergeFrom(const TrainerSpec& from) {
   accept_language_.MergeFrom(from.accept_language_);
   control_symbols_.MergeFrom(from.control_symbols_);
   user_defined_symbols_.MergeFrom(from.user_defined_symbols_);
+  vocab_sizes_.MergeFrom(from.vocab_sizes_);
+  candidate_models_.MergeFrom(from.candidate_models_);
   cached_has_bits = from._has_bits_[0];
   if (cached_has_bits & 255u) {
     if (cached_has_bits & 0x00000001u) {
@@ -1694,7 +2190,7 @@ void TrainerSpec::MergeFrom(const TrainerSpec& from) {
     _has_bits_[0] |= cached_has_bits;
   }
   cached_has_bits = from._has_bits_[1];
-  if (cached_has_bits & 15u) {
+  if (cached_has_bits & 255u) {
     if (cached_has_bits & 0x00000001u) {
       hard_vocab_limit_ = from.hard_vocab_limit_;
     }
@@ -1707,8 +2203,65 @@ void TrainerSpec::MergeFrom(const TrainerSpec& from) {
     if (cached_has_bits & 0x00000008u) {
       pad_id_ = from.pad_id_;
     }
+    if (cached_has_bits & 0x00000010u) {
+      corpus_memory_budget_mb_ = from.corpus_memory_budget_mb_;
+    }
+    if (cached_has_bits & 0x00000020u) {
+      seed_from_unique_words_ = from.seed_from_unique_words_;
+    }
+    if (cached_has_bits & 0x00000040u) {
+      set_has_checkpoint_dir();
+      checkpoint_dir_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.checkpoint_dir_);
+    }
+    if (cached_has_bits & 0x00000080u) {
+      resume_ = from.resume_;
+    }
     _has_bits_[1] |= cached_has_bits;
   }
+  if (cached_has_bits & 0x00000100u) {
+    set_has_profile_output();
+    profile_output_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.profile_output_);
+  }
+  if (cached_has_bits & 0x00000200u) {
+    set_has_seek_sampling();
+    seek_sampling_ = from.seek_sampling_;
+  }
+  if (cached_has_bits & 0x00000800u) {
+    set_has_corpus_cache();
+    corpus_cache_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.corpus_cache_);
+  }
+  if (cached_has_bits & 0x00001000u) {
+    set_has_em_batch_size();
+    em_batch_size_ = from.em_batch_size_;
+  }
+  if (cached_has_bits & 0x00002000u) {
+    set_has_em_tolerance();
+    em_tolerance_ = from.em_tolerance_;
+  }
+  if (cached_has_bits & 0x00004000u) {
+    set_has_init_model();
+    init_model_.AssignWithDefault(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), from.init_model_);
+  }
+  if (cached_has_bits & 0x00008000u) {
+    set_has_compact_repeat_counts();
+    compact_repeat_counts_ = from.compact_repeat_counts_;
+  }
+  if (cached_has_bits & 0x00010000u) {
+    set_has_max_memory_mb();
+    max_memory_mb_ = from.max_memory_mb_;
+  }
+  if (cached_has_bits & 0x00020000u) {
+    set_has_dedup_input_sentences();
+    dedup_input_sentences_ = from.dedup_input_sentences_;
+  }
+  if (cached_has_bits & 0x00040000u) {
+    set_has_prune_incremental_rounds();
+    prune_incremental_rounds_ = from.prune_incremental_rounds_;
+  }
+  if (cached_has_bits & 0x00080000u) {
+    set_has_prune_score_margin();
+    prune_score_margin_ = from.prune_score_margin_;
+  }
 }
 
 void TrainerSpec::CopyFrom(const TrainerSpec& from) {
@@ -1736,6 +2289,8 @@ void TrainerSpec::InternalSwap(TrainerSpec* other) {
   accept_language_.InternalSwap(CastToBase(&other->accept_language_));
   control_symbols_.InternalSwap(CastToBase(&other->control_symbols_));
   user_defined_symbols_.InternalSwap(CastToBase(&other->user_defined_symbols_));
+  vocab_sizes_.InternalSwap(&other->vocab_sizes_);
+  candidate_models_.InternalSwap(CastToBase(&other->candidate_models_));
   model_prefix_.Swap(&other->model_prefix_, &::google::protobuf::internal::GetEmptyStringAlreadyInited(),
     GetArenaNoVirtual());
   input_format_.Swap(&other->input_format_, &::google::protobuf::internal::GetEmptyStringAlreadyInited(),
@@ -1752,6 +2307,14 @@ void TrainerSpec::InternalSwap(TrainerSpec* other) {
     GetArenaNoVirtual());
   pad_piece_.Swap(&other->pad_piece_, &::sentencepiece::TrainerSpec::_i_give_permission_to_break_this_code_default_pad_piece_.get(),
     GetArenaNoVirtual());
+  checkpoint_dir_.Swap(&other->checkpoint_dir_, &::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+    GetArenaNoVirtual());
+  profile_output_.Swap(&other->profile_output_, &::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+    GetArenaNoVirtual());
+  corpus_cache_.Swap(&other->corpus_cache_, &::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+    GetArenaNoVirtual());
+  init_model_.Swap(&other->init_model_, &::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+    GetArenaNoVirtual());
   swap(self_test_sample_size_, other->self_test_sample_size_);
   swap(input_sentence_size_, other->input_sentence_size_);
   swap(mining_sentence_size_, other->mining_sentence_size_);
@@ -1780,6 +2343,17 @@ void TrainerSpec::InternalSwap(TrainerSpec* other) {
   swap(bos_id_, other->bos_id_);
   swap(eos_id_, other->eos_id_);
   swap(pad_id_, other->pad_id_);
+  swap(corpus_memory_budget_mb_, other->corpus_memory_budget_mb_);
+  swap(seed_from_unique_words_, other->seed_from_unique_words_);
+  swap(resume_, other->resume_);
+  swap(seek_sampling_, other->seek_sampling_);
+  swap(em_batch_size_, other->em_batch_size_);
+  swap(em_tolerance_, other->em_tolerance_);
+  swap(compact_repeat_counts_, other->compact_repeat_counts_);
+  swap(max_memory_mb_, other->max_memory_mb_);
+  swap(dedup_input_sentences_, other->dedup_input_sentences_);
+  swap(prune_incremental_rounds_, other->prune_incremental_rounds_);
+  swap(prune_score_margin_, other->prune_score_margin_);
   swap(_has_bits_[0], other->_has_bits_[0]);
   swap(_has_bits_[1], other->_has_bits_[1]);
   _internal_metadata_.Swap(&other->_internal_metadata_);
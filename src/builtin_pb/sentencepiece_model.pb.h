@@ -618,6 +618,176 @@ class TrainerSpec : public ::google::protobuf::MessageLite /* @@protoc_insertion
   void set_pad_id(::google::protobuf::int32 value);
 
   GOOGLE_PROTOBUF_EXTENSION_ACCESSORS(TrainerSpec)
+  // optional int32 corpus_memory_budget_mb = 50 [default = 0];
+  bool has_corpus_memory_budget_mb() const;
+  void clear_corpus_memory_budget_mb();
+  static const int kCorpusMemoryBudgetMbFieldNumber = 50;
+  ::google::protobuf::int32 corpus_memory_budget_mb() const;
+  void set_corpus_memory_budget_mb(::google::protobuf::int32 value);
+
+  // optional bool seed_from_unique_words = 51 [default = false];
+  bool has_seed_from_unique_words() const;
+  void clear_seed_from_unique_words();
+  static const int kSeedFromUniqueWordsFieldNumber = 51;
+  bool seed_from_unique_words() const;
+  void set_seed_from_unique_words(bool value);
+
+  // optional string checkpoint_dir = 52;
+  bool has_checkpoint_dir() const;
+  void clear_checkpoint_dir();
+  static const int kCheckpointDirFieldNumber = 52;
+  const ::std::string& checkpoint_dir() const;
+  void set_checkpoint_dir(const ::std::string& value);
+  #if LANG_CXX11
+  void set_checkpoint_dir(::std::string&& value);
+  #endif
+  void set_checkpoint_dir(const char* value);
+  void set_checkpoint_dir(const char* value, size_t size);
+  ::std::string* mutable_checkpoint_dir();
+  ::std::string* release_checkpoint_dir();
+  void set_allocated_checkpoint_dir(::std::string* checkpoint_dir);
+
+  // optional bool resume = 53 [default = false];
+  bool has_resume() const;
+  void clear_resume();
+  static const int kResumeFieldNumber = 53;
+  bool resume() const;
+  void set_resume(bool value);
+
+  // optional bool seek_sampling = 55 [default = false];
+  bool has_seek_sampling() const;
+  void clear_seek_sampling();
+  static const int kSeekSamplingFieldNumber = 55;
+  bool seek_sampling() const;
+  void set_seek_sampling(bool value);
+
+  // optional string profile_output = 54;
+  bool has_profile_output() const;
+  void clear_profile_output();
+  static const int kProfileOutputFieldNumber = 54;
+  const ::std::string& profile_output() const;
+  void set_profile_output(const ::std::string& value);
+  #if LANG_CXX11
+  void set_profile_output(::std::string&& value);
+  #endif
+  void set_profile_output(const char* value);
+  void set_profile_output(const char* value, size_t size);
+  ::std::string* mutable_profile_output();
+  ::std::string* release_profile_output();
+  void set_allocated_profile_output(::std::string* profile_output);
+
+  // repeated int32 vocab_sizes = 57;
+  int vocab_sizes_size() const;
+  void clear_vocab_sizes();
+  static const int kVocabSizesFieldNumber = 57;
+  ::google::protobuf::int32 vocab_sizes(int index) const;
+  void set_vocab_sizes(int index, ::google::protobuf::int32 value);
+  void add_vocab_sizes(::google::protobuf::int32 value);
+  const ::google::protobuf::RepeatedField< ::google::protobuf::int32 >&
+      vocab_sizes() const;
+  ::google::protobuf::RepeatedField< ::google::protobuf::int32 >*
+      mutable_vocab_sizes();
+
+  // repeated string candidate_models = 62;
+  int candidate_models_size() const;
+  void clear_candidate_models();
+  static const int kCandidateModelsFieldNumber = 62;
+  const ::std::string& candidate_models(int index) const;
+  ::std::string* mutable_candidate_models(int index);
+  void set_candidate_models(int index, const ::std::string& value);
+  #if LANG_CXX11
+  void set_candidate_models(int index, ::std::string&& value);
+  #endif
+  void set_candidate_models(int index, const char* value);
+  void set_candidate_models(int index, const char* value, size_t size);
+  ::std::string* add_candidate_models();
+  void add_candidate_models(const ::std::string& value);
+  #if LANG_CXX11
+  void add_candidate_models(::std::string&& value);
+  #endif
+  void add_candidate_models(const char* value);
+  void add_candidate_models(const char* value, size_t size);
+  const ::google::protobuf::RepeatedPtrField< ::std::string>& candidate_models() const;
+  ::google::protobuf::RepeatedPtrField< ::std::string>* mutable_candidate_models();
+
+  // optional string corpus_cache = 58;
+  bool has_corpus_cache() const;
+  void clear_corpus_cache();
+  static const int kCorpusCacheFieldNumber = 58;
+  const ::std::string& corpus_cache() const;
+  void set_corpus_cache(const ::std::string& value);
+  #if LANG_CXX11
+  void set_corpus_cache(::std::string&& value);
+  #endif
+  void set_corpus_cache(const char* value);
+  void set_corpus_cache(const char* value, size_t size);
+  ::std::string* mutable_corpus_cache();
+  ::std::string* release_corpus_cache();
+  void set_allocated_corpus_cache(::std::string* corpus_cache);
+  // optional int32 em_batch_size = 59 [default = 0];
+  bool has_em_batch_size() const;
+  void clear_em_batch_size();
+  static const int kEmBatchSizeFieldNumber = 59;
+  ::google::protobuf::int32 em_batch_size() const;
+  void set_em_batch_size(::google::protobuf::int32 value);
+
+  // optional float em_tolerance = 60 [default = 0.0001];
+  bool has_em_tolerance() const;
+  void clear_em_tolerance();
+  static const int kEmToleranceFieldNumber = 60;
+  float em_tolerance() const;
+  void set_em_tolerance(float value);
+
+  // optional bool compact_repeat_counts = 63 [default = false];
+  bool has_compact_repeat_counts() const;
+  void clear_compact_repeat_counts();
+  static const int kCompactRepeatCountsFieldNumber = 63;
+  bool compact_repeat_counts() const;
+  void set_compact_repeat_counts(bool value);
+
+  // optional int32 max_memory_mb = 64 [default = 0];
+  bool has_max_memory_mb() const;
+  void clear_max_memory_mb();
+  static const int kMaxMemoryMbFieldNumber = 64;
+  ::google::protobuf::int32 max_memory_mb() const;
+  void set_max_memory_mb(::google::protobuf::int32 value);
+
+  // optional bool dedup_input_sentences = 65 [default = false];
+  bool has_dedup_input_sentences() const;
+  void clear_dedup_input_sentences();
+  static const int kDedupInputSentencesFieldNumber = 65;
+  bool dedup_input_sentences() const;
+  void set_dedup_input_sentences(bool value);
+
+  // optional int32 prune_incremental_rounds = 66 [default = 0];
+  bool has_prune_incremental_rounds() const;
+  void clear_prune_incremental_rounds();
+  static const int kPruneIncrementalRoundsFieldNumber = 66;
+  ::google::protobuf::int32 prune_incremental_rounds() const;
+  void set_prune_incremental_rounds(::google::protobuf::int32 value);
+
+  // optional float prune_score_margin = 67 [default = 0.5];
+  bool has_prune_score_margin() const;
+  void clear_prune_score_margin();
+  static const int kPruneScoreMarginFieldNumber = 67;
+  float prune_score_margin() const;
+  void set_prune_score_margin(float value);
+
+  // optional string init_model = 61;
+  bool has_init_model() const;
+  void clear_init_model();
+  static const int kInitModelFieldNumber = 61;
+  const ::std::string& init_model() const;
+  void set_init_model(const ::std::string& value);
+  #if LANG_CXX11
+  void set_init_model(::std::string&& value);
+  #endif
+  void set_init_model(const char* value);
+  void set_init_model(const char* value, size_t size);
+  ::std::string* mutable_init_model();
+  ::std::string* release_init_model();
+  void set_allocated_init_model(::std::string* init_model);
+
   // @@protoc_insertion_point(class_scope:sentencepiece.TrainerSpec)
  private:
   void set_has_input_format();
@@ -680,6 +850,36 @@ class TrainerSpec : public ::google::protobuf::MessageLite /* @@protoc_insertion
   void clear_has_eos_id();
   void set_has_pad_id();
   void clear_has_pad_id();
+  void set_has_corpus_memory_budget_mb();
+  void clear_has_corpus_memory_budget_mb();
+  void set_has_seed_from_unique_words();
+  void clear_has_seed_from_unique_words();
+  void set_has_checkpoint_dir();
+  void clear_has_checkpoint_dir();
+  void set_has_resume();
+  void clear_has_resume();
+  void set_has_profile_output();
+  void clear_has_profile_output();
+  void set_has_seek_sampling();
+  void clear_has_seek_sampling();
+  void set_has_corpus_cache();
+  void clear_has_corpus_cache();
+  void set_has_em_batch_size();
+  void clear_has_em_batch_size();
+  void set_has_em_tolerance();
+  void clear_has_em_tolerance();
+  void set_has_init_model();
+  void clear_has_init_model();
+  void set_has_compact_repeat_counts();
+  void clear_has_compact_repeat_counts();
+  void set_has_max_memory_mb();
+  void clear_has_max_memory_mb();
+  void set_has_dedup_input_sentences();
+  void clear_has_dedup_input_sentences();
+  void set_has_prune_incremental_rounds();
+  void clear_has_prune_incremental_rounds();
+  void set_has_prune_score_margin();
+  void clear_has_prune_score_margin();
   void set_has_unk_piece();
   void clear_has_unk_piece();
   void set_has_bos_piece();
@@ -701,6 +901,8 @@ class TrainerSpec : public ::google::protobuf::MessageLite /* @@protoc_insertion
   ::google::protobuf::RepeatedPtrField< ::std::string> accept_language_;
   ::google::protobuf::RepeatedPtrField< ::std::string> control_symbols_;
   ::google::protobuf::RepeatedPtrField< ::std::string> user_defined_symbols_;
+  ::google::protobuf::RepeatedField< ::google::protobuf::int32 > vocab_sizes_;
+  ::google::protobuf::RepeatedPtrField< ::std::string> candidate_models_;
   ::google::protobuf::internal::ArenaStringPtr model_prefix_;
   ::google::protobuf::internal::ArenaStringPtr input_format_;
   ::google::protobuf::internal::ArenaStringPtr required_chars_;
@@ -724,6 +926,10 @@ class TrainerSpec : public ::google::protobuf::MessageLite /* @@protoc_insertion
   static ::google::protobuf::internal::ExplicitlyConstructed< ::std::string> _i_give_permission_to_break_this_code_default_pad_piece_;
   private:
   ::google::protobuf::internal::ArenaStringPtr pad_piece_;
+  ::google::protobuf::internal::ArenaStringPtr checkpoint_dir_;
+  ::google::protobuf::internal::ArenaStringPtr profile_output_;
+  ::google::protobuf::internal::ArenaStringPtr corpus_cache_;
+  ::google::protobuf::internal::ArenaStringPtr init_model_;
   ::google::protobuf::int32 self_test_sample_size_;
   ::google::protobuf::int32 input_sentence_size_;
   ::google::protobuf::int32 mining_sentence_size_;
@@ -752,6 +958,17 @@ class TrainerSpec : public ::google::protobuf::MessageLite /* @@protoc_insertion
   ::google::protobuf::int32 bos_id_;
   ::google::protobuf::int32 eos_id_;
   ::google::protobuf::int32 pad_id_;
+  ::google::protobuf::int32 corpus_memory_budget_mb_;
+  bool seed_from_unique_words_;
+  bool resume_;
+  bool seek_sampling_;
+  ::google::protobuf::int32 em_batch_size_;
+  float em_tolerance_;
+  bool compact_repeat_counts_;
+  ::google::protobuf::int32 max_memory_mb_;
+  bool dedup_input_sentences_;
+  ::google::protobuf::int32 prune_incremental_rounds_;
+  float prune_score_margin_;
   mutable ::google::protobuf::internal::CachedSize _cached_size_;
   friend struct ::protobuf_sentencepiece_5fmodel_2eproto::TableStruct;
 };
@@ -2702,6 +2919,632 @@ inline void TrainerSpec::set_pad_id(::google::protobuf::int32 value) {
   // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.pad_id)
 }
 
+// optional int32 corpus_memory_budget_mb = 50 [default = 0];
+inline bool TrainerSpec::has_corpus_memory_budget_mb() const {
+  return (_has_bits_[1] & 0x00000010u) != 0;
+}
+inline void TrainerSpec::set_has_corpus_memory_budget_mb() {
+  _has_bits_[1] |= 0x00000010u;
+}
+inline void TrainerSpec::clear_has_corpus_memory_budget_mb() {
+  _has_bits_[1] &= ~0x00000010u;
+}
+inline void TrainerSpec::clear_corpus_memory_budget_mb() {
+  corpus_memory_budget_mb_ = 0;
+  clear_has_corpus_memory_budget_mb();
+}
+inline ::google::protobuf::int32 TrainerSpec::corpus_memory_budget_mb() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.corpus_memory_budget_mb)
+  return corpus_memory_budget_mb_;
+}
+inline void TrainerSpec::set_corpus_memory_budget_mb(::google::protobuf::int32 value) {
+  set_has_corpus_memory_budget_mb();
+  corpus_memory_budget_mb_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.corpus_memory_budget_mb)
+}
+
+// optional bool seed_from_unique_words = 51 [default = false];
+inline bool TrainerSpec::has_seed_from_unique_words() const {
+  return (_has_bits_[1] & 0x00000020u) != 0;
+}
+inline void TrainerSpec::set_has_seed_from_unique_words() {
+  _has_bits_[1] |= 0x00000020u;
+}
+inline void TrainerSpec::clear_has_seed_from_unique_words() {
+  _has_bits_[1] &= ~0x00000020u;
+}
+inline void TrainerSpec::clear_seed_from_unique_words() {
+  seed_from_unique_words_ = false;
+  clear_has_seed_from_unique_words();
+}
+inline bool TrainerSpec::seed_from_unique_words() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.seed_from_unique_words)
+  return seed_from_unique_words_;
+}
+inline void TrainerSpec::set_seed_from_unique_words(bool value) {
+  set_has_seed_from_unique_words();
+  seed_from_unique_words_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.seed_from_unique_words)
+}
+
+// optional string checkpoint_dir = 52;
+inline bool TrainerSpec::has_checkpoint_dir() const {
+  return (_has_bits_[1] & 0x00000040u) != 0;
+}
+inline void TrainerSpec::set_has_checkpoint_dir() {
+  _has_bits_[1] |= 0x00000040u;
+}
+inline void TrainerSpec::clear_has_checkpoint_dir() {
+  _has_bits_[1] &= ~0x00000040u;
+}
+inline void TrainerSpec::clear_checkpoint_dir() {
+  checkpoint_dir_.ClearToEmptyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  clear_has_checkpoint_dir();
+}
+inline const ::std::string& TrainerSpec::checkpoint_dir() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.checkpoint_dir)
+  return checkpoint_dir_.GetNoArena();
+}
+inline void TrainerSpec::set_checkpoint_dir(const ::std::string& value) {
+  set_has_checkpoint_dir();
+  checkpoint_dir_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), value);
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.checkpoint_dir)
+}
+#if LANG_CXX11
+inline void TrainerSpec::set_checkpoint_dir(::std::string&& value) {
+  set_has_checkpoint_dir();
+  checkpoint_dir_.SetNoArena(
+    &::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::move(value));
+  // @@protoc_insertion_point(field_set_rvalue:sentencepiece.TrainerSpec.checkpoint_dir)
+}
+#endif
+inline void TrainerSpec::set_checkpoint_dir(const char* value) {
+  GOOGLE_DCHECK(value != NULL);
+  set_has_checkpoint_dir();
+  checkpoint_dir_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::string(value));
+  // @@protoc_insertion_point(field_set_char:sentencepiece.TrainerSpec.checkpoint_dir)
+}
+inline void TrainerSpec::set_checkpoint_dir(const char* value, size_t size) {
+  set_has_checkpoint_dir();
+  checkpoint_dir_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+      ::std::string(reinterpret_cast<const char*>(value), size));
+  // @@protoc_insertion_point(field_set_pointer:sentencepiece.TrainerSpec.checkpoint_dir)
+}
+inline ::std::string* TrainerSpec::mutable_checkpoint_dir() {
+  set_has_checkpoint_dir();
+  // @@protoc_insertion_point(field_mutable:sentencepiece.TrainerSpec.checkpoint_dir)
+  return checkpoint_dir_.MutableNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline ::std::string* TrainerSpec::release_checkpoint_dir() {
+  // @@protoc_insertion_point(field_release:sentencepiece.TrainerSpec.checkpoint_dir)
+  if (!has_checkpoint_dir()) {
+    return NULL;
+  }
+  clear_has_checkpoint_dir();
+  return checkpoint_dir_.ReleaseNonDefaultNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline void TrainerSpec::set_allocated_checkpoint_dir(::std::string* checkpoint_dir) {
+  if (checkpoint_dir != NULL) {
+    set_has_checkpoint_dir();
+  } else {
+    clear_has_checkpoint_dir();
+  }
+  checkpoint_dir_.SetAllocatedNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), checkpoint_dir);
+  // @@protoc_insertion_point(field_set_allocated:sentencepiece.TrainerSpec.checkpoint_dir)
+}
+
+// optional bool resume = 53 [default = false];
+inline bool TrainerSpec::has_resume() const {
+  return (_has_bits_[1] & 0x00000080u) != 0;
+}
+inline void TrainerSpec::set_has_resume() {
+  _has_bits_[1] |= 0x00000080u;
+}
+inline void TrainerSpec::clear_has_resume() {
+  _has_bits_[1] &= ~0x00000080u;
+}
+inline void TrainerSpec::clear_resume() {
+  resume_ = false;
+  clear_has_resume();
+}
+inline bool TrainerSpec::resume() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.resume)
+  return resume_;
+}
+inline void TrainerSpec::set_resume(bool value) {
+  set_has_resume();
+  resume_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.resume)
+}
+
+// optional bool seek_sampling = 55 [default = false];
+inline bool TrainerSpec::has_seek_sampling() const {
+  return (_has_bits_[1] & 0x00000200u) != 0;
+}
+inline void TrainerSpec::set_has_seek_sampling() {
+  _has_bits_[1] |= 0x00000200u;
+}
+inline void TrainerSpec::clear_has_seek_sampling() {
+  _has_bits_[1] &= ~0x00000200u;
+}
+inline void TrainerSpec::clear_seek_sampling() {
+  seek_sampling_ = false;
+  clear_has_seek_sampling();
+}
+inline bool TrainerSpec::seek_sampling() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.seek_sampling)
+  return seek_sampling_;
+}
+inline void TrainerSpec::set_seek_sampling(bool value) {
+  set_has_seek_sampling();
+  seek_sampling_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.seek_sampling)
+}
+
+// repeated int32 vocab_sizes = 57;
+inline int TrainerSpec::vocab_sizes_size() const {
+  return vocab_sizes_.size();
+}
+inline void TrainerSpec::clear_vocab_sizes() {
+  vocab_sizes_.Clear();
+}
+inline ::google::protobuf::int32 TrainerSpec::vocab_sizes(int index) const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.vocab_sizes)
+  return vocab_sizes_.Get(index);
+}
+inline void TrainerSpec::set_vocab_sizes(int index, ::google::protobuf::int32 value) {
+  vocab_sizes_.Set(index, value);
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.vocab_sizes)
+}
+inline void TrainerSpec::add_vocab_sizes(::google::protobuf::int32 value) {
+  vocab_sizes_.Add(value);
+  // @@protoc_insertion_point(field_add:sentencepiece.TrainerSpec.vocab_sizes)
+}
+inline const ::google::protobuf::RepeatedField< ::google::protobuf::int32 >&
+TrainerSpec::vocab_sizes() const {
+  // @@protoc_insertion_point(field_list:sentencepiece.TrainerSpec.vocab_sizes)
+  return vocab_sizes_;
+}
+inline ::google::protobuf::RepeatedField< ::google::protobuf::int32 >*
+TrainerSpec::mutable_vocab_sizes() {
+  // @@protoc_insertion_point(field_mutable_list:sentencepiece.TrainerSpec.vocab_sizes)
+  return &vocab_sizes_;
+}
+
+// optional string corpus_cache = 58;
+inline bool TrainerSpec::has_corpus_cache() const {
+  return (_has_bits_[1] & 0x00000800u) != 0;
+}
+inline void TrainerSpec::set_has_corpus_cache() {
+  _has_bits_[1] |= 0x00000800u;
+}
+inline void TrainerSpec::clear_has_corpus_cache() {
+  _has_bits_[1] &= ~0x00000800u;
+}
+inline void TrainerSpec::clear_corpus_cache() {
+  corpus_cache_.ClearToEmptyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  clear_has_corpus_cache();
+}
+inline const ::std::string& TrainerSpec::corpus_cache() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.corpus_cache)
+  return corpus_cache_.GetNoArena();
+}
+inline void TrainerSpec::set_corpus_cache(const ::std::string& value) {
+  set_has_corpus_cache();
+  corpus_cache_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), value);
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.corpus_cache)
+}
+#if LANG_CXX11
+inline void TrainerSpec::set_corpus_cache(::std::string&& value) {
+  set_has_corpus_cache();
+  corpus_cache_.SetNoArena(
+    &::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::move(value));
+  // @@protoc_insertion_point(field_set_rvalue:sentencepiece.TrainerSpec.corpus_cache)
+}
+#endif
+inline void TrainerSpec::set_corpus_cache(const char* value) {
+  GOOGLE_DCHECK(value != NULL);
+  set_has_corpus_cache();
+  corpus_cache_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::string(value));
+  // @@protoc_insertion_point(field_set_char:sentencepiece.TrainerSpec.corpus_cache)
+}
+inline void TrainerSpec::set_corpus_cache(const char* value, size_t size) {
+  set_has_corpus_cache();
+  corpus_cache_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+      ::std::string(reinterpret_cast<const char*>(value), size));
+  // @@protoc_insertion_point(field_set_pointer:sentencepiece.TrainerSpec.corpus_cache)
+}
+inline ::std::string* TrainerSpec::mutable_corpus_cache() {
+  set_has_corpus_cache();
+  // @@protoc_insertion_point(field_mutable:sentencepiece.TrainerSpec.corpus_cache)
+  return corpus_cache_.MutableNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline ::std::string* TrainerSpec::release_corpus_cache() {
+  // @@protoc_insertion_point(field_release:sentencepiece.TrainerSpec.corpus_cache)
+  if (!has_corpus_cache()) {
+    return NULL;
+  }
+  clear_has_corpus_cache();
+  return corpus_cache_.ReleaseNonDefaultNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline void TrainerSpec::set_allocated_corpus_cache(::std::string* corpus_cache) {
+  if (corpus_cache != NULL) {
+    set_has_corpus_cache();
+  } else {
+    clear_has_corpus_cache();
+  }
+  corpus_cache_.SetAllocatedNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), corpus_cache);
+  // @@protoc_insertion_point(field_set_allocated:sentencepiece.TrainerSpec.corpus_cache)
+}
+// optional string init_model = 61;
+inline bool TrainerSpec::has_init_model() const {
+  return (_has_bits_[1] & 0x00004000u) != 0;
+}
+inline void TrainerSpec::set_has_init_model() {
+  _has_bits_[1] |= 0x00004000u;
+}
+inline void TrainerSpec::clear_has_init_model() {
+  _has_bits_[1] &= ~0x00004000u;
+}
+inline void TrainerSpec::clear_init_model() {
+  init_model_.ClearToEmptyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  clear_has_init_model();
+}
+inline const ::std::string& TrainerSpec::init_model() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.init_model)
+  return init_model_.GetNoArena();
+}
+inline void TrainerSpec::set_init_model(const ::std::string& value) {
+  set_has_init_model();
+  init_model_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), value);
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.init_model)
+}
+#if LANG_CXX11
+inline void TrainerSpec::set_init_model(::std::string&& value) {
+  set_has_init_model();
+  init_model_.SetNoArena(
+    &::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::move(value));
+  // @@protoc_insertion_point(field_set_rvalue:sentencepiece.TrainerSpec.init_model)
+}
+#endif
+inline void TrainerSpec::set_init_model(const char* value) {
+  GOOGLE_DCHECK(value != NULL);
+  set_has_init_model();
+  init_model_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::string(value));
+  // @@protoc_insertion_point(field_set_char:sentencepiece.TrainerSpec.init_model)
+}
+inline void TrainerSpec::set_init_model(const char* value, size_t size) {
+  set_has_init_model();
+  init_model_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+      ::std::string(reinterpret_cast<const char*>(value), size));
+  // @@protoc_insertion_point(field_set_pointer:sentencepiece.TrainerSpec.init_model)
+}
+inline ::std::string* TrainerSpec::mutable_init_model() {
+  set_has_init_model();
+  // @@protoc_insertion_point(field_mutable:sentencepiece.TrainerSpec.init_model)
+  return init_model_.MutableNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline ::std::string* TrainerSpec::release_init_model() {
+  // @@protoc_insertion_point(field_release:sentencepiece.TrainerSpec.init_model)
+  if (!has_init_model()) {
+    return NULL;
+  }
+  clear_has_init_model();
+  return init_model_.ReleaseNonDefaultNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline void TrainerSpec::set_allocated_init_model(::std::string* init_model) {
+  if (init_model != NULL) {
+    set_has_init_model();
+  } else {
+    clear_has_init_model();
+  }
+  init_model_.SetAllocatedNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), init_model);
+  // @@protoc_insertion_point(field_set_allocated:sentencepiece.TrainerSpec.init_model)
+}
+
+// repeated string candidate_models = 62;
+inline int TrainerSpec::candidate_models_size() const {
+  return candidate_models_.size();
+}
+inline void TrainerSpec::clear_candidate_models() {
+  candidate_models_.Clear();
+}
+inline const ::std::string& TrainerSpec::candidate_models(int index) const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.candidate_models)
+  return candidate_models_.Get(index);
+}
+inline ::std::string* TrainerSpec::mutable_candidate_models(int index) {
+  // @@protoc_insertion_point(field_mutable:sentencepiece.TrainerSpec.candidate_models)
+  return candidate_models_.Mutable(index);
+}
+inline void TrainerSpec::set_candidate_models(int index, const ::std::string& value) {
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.candidate_models)
+  candidate_models_.Mutable(index)->assign(value);
+}
+#if LANG_CXX11
+inline void TrainerSpec::set_candidate_models(int index, ::std::string&& value) {
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.candidate_models)
+  candidate_models_.Mutable(index)->assign(std::move(value));
+}
+#endif
+inline void TrainerSpec::set_candidate_models(int index, const char* value) {
+  GOOGLE_DCHECK(value != NULL);
+  candidate_models_.Mutable(index)->assign(value);
+  // @@protoc_insertion_point(field_set_char:sentencepiece.TrainerSpec.candidate_models)
+}
+inline void TrainerSpec::set_candidate_models(int index, const char* value, size_t size) {
+  candidate_models_.Mutable(index)->assign(
+    reinterpret_cast<const char*>(value), size);
+  // @@protoc_insertion_point(field_set_pointer:sentencepiece.TrainerSpec.candidate_models)
+}
+inline ::std::string* TrainerSpec::add_candidate_models() {
+  // @@protoc_insertion_point(field_add_mutable:sentencepiece.TrainerSpec.candidate_models)
+  return candidate_models_.Add();
+}
+inline void TrainerSpec::add_candidate_models(const ::std::string& value) {
+  candidate_models_.Add()->assign(value);
+  // @@protoc_insertion_point(field_add:sentencepiece.TrainerSpec.candidate_models)
+}
+#if LANG_CXX11
+inline void TrainerSpec::add_candidate_models(::std::string&& value) {
+  candidate_models_.Add(std::move(value));
+  // @@protoc_insertion_point(field_add:sentencepiece.TrainerSpec.candidate_models)
+}
+#endif
+inline void TrainerSpec::add_candidate_models(const char* value) {
+  GOOGLE_DCHECK(value != NULL);
+  candidate_models_.Add()->assign(value);
+  // @@protoc_insertion_point(field_add_char:sentencepiece.TrainerSpec.candidate_models)
+}
+inline void TrainerSpec::add_candidate_models(const char* value, size_t size) {
+  candidate_models_.Add()->assign(reinterpret_cast<const char*>(value), size);
+  // @@protoc_insertion_point(field_add_pointer:sentencepiece.TrainerSpec.candidate_models)
+}
+inline const ::google::protobuf::RepeatedPtrField< ::std::string>&
+TrainerSpec::candidate_models() const {
+  // @@protoc_insertion_point(field_list:sentencepiece.TrainerSpec.candidate_models)
+  return candidate_models_;
+}
+inline ::google::protobuf::RepeatedPtrField< ::std::string>*
+TrainerSpec::mutable_candidate_models() {
+  // @@protoc_insertion_point(field_mutable_list:sentencepiece.TrainerSpec.candidate_models)
+  return &candidate_models_;
+}
+
+// optional int32 em_batch_size = 59 [default = 0];
+inline bool TrainerSpec::has_em_batch_size() const {
+  return (_has_bits_[1] & 0x00001000u) != 0;
+}
+inline void TrainerSpec::set_has_em_batch_size() {
+  _has_bits_[1] |= 0x00001000u;
+}
+inline void TrainerSpec::clear_has_em_batch_size() {
+  _has_bits_[1] &= ~0x00001000u;
+}
+inline void TrainerSpec::clear_em_batch_size() {
+  em_batch_size_ = 0;
+  clear_has_em_batch_size();
+}
+inline ::google::protobuf::int32 TrainerSpec::em_batch_size() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.em_batch_size)
+  return em_batch_size_;
+}
+inline void TrainerSpec::set_em_batch_size(::google::protobuf::int32 value) {
+  set_has_em_batch_size();
+  em_batch_size_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.em_batch_size)
+}
+
+// optional float em_tolerance = 60 [default = 0.0001];
+inline bool TrainerSpec::has_em_tolerance() const {
+  return (_has_bits_[1] & 0x00002000u) != 0;
+}
+inline void TrainerSpec::set_has_em_tolerance() {
+  _has_bits_[1] |= 0x00002000u;
+}
+inline void TrainerSpec::clear_has_em_tolerance() {
+  _has_bits_[1] &= ~0x00002000u;
+}
+inline void TrainerSpec::clear_em_tolerance() {
+  em_tolerance_ = 0.0001f;
+  clear_has_em_tolerance();
+}
+inline float TrainerSpec::em_tolerance() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.em_tolerance)
+  return em_tolerance_;
+}
+inline void TrainerSpec::set_em_tolerance(float value) {
+  set_has_em_tolerance();
+  em_tolerance_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.em_tolerance)
+}
+
+// optional bool compact_repeat_counts = 63 [default = false];
+inline bool TrainerSpec::has_compact_repeat_counts() const {
+  return (_has_bits_[1] & 0x00008000u) != 0;
+}
+inline void TrainerSpec::set_has_compact_repeat_counts() {
+  _has_bits_[1] |= 0x00008000u;
+}
+inline void TrainerSpec::clear_has_compact_repeat_counts() {
+  _has_bits_[1] &= ~0x00008000u;
+}
+inline void TrainerSpec::clear_compact_repeat_counts() {
+  compact_repeat_counts_ = false;
+  clear_has_compact_repeat_counts();
+}
+inline bool TrainerSpec::compact_repeat_counts() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.compact_repeat_counts)
+  return compact_repeat_counts_;
+}
+inline void TrainerSpec::set_compact_repeat_counts(bool value) {
+  set_has_compact_repeat_counts();
+  compact_repeat_counts_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.compact_repeat_counts)
+}
+
+// optional int32 max_memory_mb = 64 [default = 0];
+inline bool TrainerSpec::has_max_memory_mb() const {
+  return (_has_bits_[1] & 0x00010000u) != 0;
+}
+inline void TrainerSpec::set_has_max_memory_mb() {
+  _has_bits_[1] |= 0x00010000u;
+}
+inline void TrainerSpec::clear_has_max_memory_mb() {
+  _has_bits_[1] &= ~0x00010000u;
+}
+inline void TrainerSpec::clear_max_memory_mb() {
+  max_memory_mb_ = 0;
+  clear_has_max_memory_mb();
+}
+inline ::google::protobuf::int32 TrainerSpec::max_memory_mb() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.max_memory_mb)
+  return max_memory_mb_;
+}
+inline void TrainerSpec::set_max_memory_mb(::google::protobuf::int32 value) {
+  set_has_max_memory_mb();
+  max_memory_mb_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.max_memory_mb)
+}
+
+// optional bool dedup_input_sentences = 65 [default = false];
+inline bool TrainerSpec::has_dedup_input_sentences() const {
+  return (_has_bits_[1] & 0x00020000u) != 0;
+}
+inline void TrainerSpec::set_has_dedup_input_sentences() {
+  _has_bits_[1] |= 0x00020000u;
+}
+inline void TrainerSpec::clear_has_dedup_input_sentences() {
+  _has_bits_[1] &= ~0x00020000u;
+}
+inline void TrainerSpec::clear_dedup_input_sentences() {
+  dedup_input_sentences_ = false;
+  clear_has_dedup_input_sentences();
+}
+inline bool TrainerSpec::dedup_input_sentences() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.dedup_input_sentences)
+  return dedup_input_sentences_;
+}
+inline void TrainerSpec::set_dedup_input_sentences(bool value) {
+  set_has_dedup_input_sentences();
+  dedup_input_sentences_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.dedup_input_sentences)
+}
+
+// optional int32 prune_incremental_rounds = 66 [default = 0];
+inline bool TrainerSpec::has_prune_incremental_rounds() const {
+  return (_has_bits_[1] & 0x00040000u) != 0;
+}
+inline void TrainerSpec::set_has_prune_incremental_rounds() {
+  _has_bits_[1] |= 0x00040000u;
+}
+inline void TrainerSpec::clear_has_prune_incremental_rounds() {
+  _has_bits_[1] &= ~0x00040000u;
+}
+inline void TrainerSpec::clear_prune_incremental_rounds() {
+  prune_incremental_rounds_ = 0;
+  clear_has_prune_incremental_rounds();
+}
+inline ::google::protobuf::int32 TrainerSpec::prune_incremental_rounds() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.prune_incremental_rounds)
+  return prune_incremental_rounds_;
+}
+inline void TrainerSpec::set_prune_incremental_rounds(::google::protobuf::int32 value) {
+  set_has_prune_incremental_rounds();
+  prune_incremental_rounds_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.prune_incremental_rounds)
+}
+
+// optional float prune_score_margin = 67 [default = 0.5];
+inline bool TrainerSpec::has_prune_score_margin() const {
+  return (_has_bits_[1] & 0x00080000u) != 0;
+}
+inline void TrainerSpec::set_has_prune_score_margin() {
+  _has_bits_[1] |= 0x00080000u;
+}
+inline void TrainerSpec::clear_has_prune_score_margin() {
+  _has_bits_[1] &= ~0x00080000u;
+}
+inline void TrainerSpec::clear_prune_score_margin() {
+  prune_score_margin_ = 0.5f;
+  clear_has_prune_score_margin();
+}
+inline float TrainerSpec::prune_score_margin() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.prune_score_margin)
+  return prune_score_margin_;
+}
+inline void TrainerSpec::set_prune_score_margin(float value) {
+  set_has_prune_score_margin();
+  prune_score_margin_ = value;
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.prune_score_margin)
+}
+
+// optional string profile_output = 54;
+inline bool TrainerSpec::has_profile_output() const {
+  return (_has_bits_[1] & 0x00000100u) != 0;
+}
+inline void TrainerSpec::set_has_profile_output() {
+  _has_bits_[1] |= 0x00000100u;
+}
+inline void TrainerSpec::clear_has_profile_output() {
+  _has_bits_[1] &= ~0x00000100u;
+}
+inline void TrainerSpec::clear_profile_output() {
+  profile_output_.ClearToEmptyNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+  clear_has_profile_output();
+}
+inline const ::std::string& TrainerSpec::profile_output() const {
+  // @@protoc_insertion_point(field_get:sentencepiece.TrainerSpec.profile_output)
+  return profile_output_.GetNoArena();
+}
+inline void TrainerSpec::set_profile_output(const ::std::string& value) {
+  set_has_profile_output();
+  profile_output_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), value);
+  // @@protoc_insertion_point(field_set:sentencepiece.TrainerSpec.profile_output)
+}
+#if LANG_CXX11
+inline void TrainerSpec::set_profile_output(::std::string&& value) {
+  set_has_profile_output();
+  profile_output_.SetNoArena(
+    &::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::move(value));
+  // @@protoc_insertion_point(field_set_rvalue:sentencepiece.TrainerSpec.profile_output)
+}
+#endif
+inline void TrainerSpec::set_profile_output(const char* value) {
+  GOOGLE_DCHECK(value != NULL);
+  set_has_profile_output();
+  profile_output_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), ::std::string(value));
+  // @@protoc_insertion_point(field_set_char:sentencepiece.TrainerSpec.profile_output)
+}
+inline void TrainerSpec::set_profile_output(const char* value, size_t size) {
+  set_has_profile_output();
+  profile_output_.SetNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(),
+      ::std::string(reinterpret_cast<const char*>(value), size));
+  // @@protoc_insertion_point(field_set_pointer:sentencepiece.TrainerSpec.profile_output)
+}
+inline ::std::string* TrainerSpec::mutable_profile_output() {
+  set_has_profile_output();
+  // @@protoc_insertion_point(field_mutable:sentencepiece.TrainerSpec.profile_output)
+  return profile_output_.MutableNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline ::std::string* TrainerSpec::release_profile_output() {
+  // @@protoc_insertion_point(field_release:sentencepiece.TrainerSpec.profile_output)
+  if (!has_profile_output()) {
+    return NULL;
+  }
+  clear_has_profile_output();
+  return profile_output_.ReleaseNonDefaultNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited());
+}
+inline void TrainerSpec::set_allocated_profile_output(::std::string* profile_output) {
+  if (profile_output != NULL) {
+    set_has_profile_output();
+  } else {
+    clear_has_profile_output();
+  }
+  profile_output_.SetAllocatedNoArena(&::google::protobuf::internal::GetEmptyStringAlreadyInited(), profile_output);
+  // @@protoc_insertion_point(field_set_allocated:sentencepiece.TrainerSpec.profile_output)
+}
+
 // optional string unk_piece = 45 [default = "<unk>"];
 inline bool TrainerSpec::has_unk_piece() const {
   return (_has_bits_[0] & 0x00000010u) != 0;
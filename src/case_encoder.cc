@@ -14,6 +14,8 @@
 
 #include "case_encoder.h"
 
+#include <algorithm>
+
 namespace sentencepiece {
 namespace normalizer {
 
@@ -86,9 +88,10 @@ inline int delta(int state, char c) {
   return a != -1 ? fsa[state][a] : s;
 }
 
-// finds longest sequence that is accepted by the fsa starting 
-// from the beginning up to given length
-size_t searchLongestSuffix(const char* data, size_t length) {
+// finds longest sequence that is accepted by the fsa starting
+// from the beginning up to given length. `stop` is set to the position of
+// the character that led to the sink state, or to `length`.
+size_t searchLongestSuffix(const char* data, size_t length, size_t* stop) {
   // init
   size_t found = npos;
   int state = 0;
@@ -102,8 +105,10 @@ size_t searchLongestSuffix(const char* data, size_t length) {
     state = delta(state, data[i]);
     
     // if we ended up in a sink state, return what we found so far
-    if(state == s)
+    if(state == s) {
+      *stop = i;
       return found;
+    }
 
     // not a sink state, so check if it's an acceptor state and move pointer if yes
     if(accept[state])
@@ -112,6 +117,7 @@ size_t searchLongestSuffix(const char* data, size_t length) {
 
   // we reached the end of the string, check if it makes us reach an acceptor state
   // in which case the whole sequence is matched
+  *stop = length;
   state = delta(state, '$');
   if(state != s && accept[state])
       found = length;
@@ -120,16 +126,36 @@ size_t searchLongestSuffix(const char* data, size_t length) {
 }
 
 // find all the longest sequences that match the fsa in the string and return matched spans
-// note, this is greedy and we restart search after the previous longest sequence
-std::vector<std::pair<const char*, const char*>> search(const std::string& input) {
-  std::vector<std::pair<const char*, const char*>> results;
-  for(size_t i = 0; i < input.length(); ++i) {
-    size_t found = searchLongestSuffix(input.data() + i, input.length() - i);
+// note, this is greedy and we restart search after the previous longest sequence.
+//
+// An attempt that matches nothing resumes at the character it stopped at
+// instead of the next one. A match starts with an uppercase word, and an
+// attempt started at a later word of the failed one goes through the same
+// states for fewer words (the states for the first, second and further words
+// have the same sink transitions), so it stops at the same character without
+// reaching the acceptor state. Every character is hence read once, except the
+// ones read past the end of a match.
+void search(const std::string& input,
+            std::vector<std::pair<const char*, const char*>>* results) {
+  results->clear();
+  const char* data = input.data();
+  const size_t length = input.length();
+  size_t i = 0;
+  while(i < length) {
+    size_t stop = 0;
+    const size_t found = searchLongestSuffix(data + i, length - i, &stop);
     if(found != npos) {
-      results.emplace_back(input.data() + i, input.data() + i + found);
-      i += found - 1;
+      results->emplace_back(data + i, data + i + found);
+      i += found;
+    } else {
+      i += std::max<size_t>(stop, 1);
     }
   }
+}
+
+std::vector<std::pair<const char*, const char*>> search(const std::string& input) {
+  std::vector<std::pair<const char*, const char*>> results;
+  search(input, &results);
   return results;
 }
 
@@ -15,6 +15,7 @@
 #ifndef NORMALIZER_CASE_ENCODER_H_
 #define NORMALIZER_CASE_ENCODER_H_
 
+#include <cstring>
 #include <memory>
 #include <set>
 #include <string>
@@ -30,6 +31,10 @@ namespace normalizer {
 
 std::vector<std::pair<const char*, const char*>> search(const std::string& input);
 
+// Same as above, but stores the spans in `results`, which is cleared first.
+void search(const std::string& input,
+            std::vector<std::pair<const char*, const char*>>* results);
+
 constexpr char cUppercase    = 'U';
 constexpr char cAllUppercase = 'A';
 constexpr char cTitlecase    = 'T';
@@ -38,35 +43,63 @@ constexpr char cPunctuation  = 'P';
 constexpr char cSpace        = ' ';
 
 class CaseEncoder {
+public:
+  // Normalizes the prefix of the input with the rules of `context`. A plain
+  // function pointer is used since it is called for every character.
+  typedef std::pair<absl::string_view, int> (*Normalizer)(const void* context,
+                                                          absl::string_view input);
+
 protected:
-  typedef std::function<std::pair<absl::string_view, int>(absl::string_view)> Normalizer;
-  Normalizer normalizer_;
+  Normalizer normalizer_ = nullptr;
+  const void* context_ = nullptr;
 
 public:
   virtual ~CaseEncoder() {}
   
   virtual std::pair<absl::string_view, int> normalizePrefix(absl::string_view input) {
-    return normalizer_(input);
+    return normalizer_(context_, input);
   }
 
-  virtual void setNormalizer(Normalizer normalizer) {
+  virtual void setNormalizer(Normalizer normalizer, const void* context) {
     normalizer_ = normalizer;
+    context_ = context;
   }
 
-  virtual void postProcess(std::string* normalized, std::vector<size_t>* norm_to_orig) {}
+  // Rewrites `normalized` and `norm_to_orig` in place once the whole input
+  // has been normalized. The first `offset` bytes of `normalized` (e.g. the
+  // dummy prefix) were not produced by normalizePrefix and are left untouched.
+  // `norm_to_orig` is nullptr when the caller does not track alignments.
+  virtual void postProcess(std::string* normalized, std::vector<size_t>* norm_to_orig,
+                           size_t offset) {}
+  virtual void postProcess(std::string* normalized, std::vector<uint32>* norm_to_orig,
+                           size_t offset) {}
+
+  // Clears the per-sentence state so that the same instance can be reused
+  // for the next input. Buffers keep their capacity.
+  virtual void Reset() {}
 
   static std::unique_ptr<CaseEncoder> Create(bool, bool, bool);
 };
 
-class UpperCaseEncoder : public CaseEncoder {
+class UpperCaseEncoder final : public CaseEncoder {
 private:
+  // Bytes of all buffered "chars", concatenated.
   std::string buffer_;
   std::string signature_;
   int offset_ = 0;
 
-  // This is a queue consisting of all buffered "chars" and
-  // the corresponding number of consumed bytes
-  std::vector<std::pair<std::string, int> > buffer_queue_;
+  // A buffered "char" as a span of buffer_ and the corresponding number of
+  // consumed bytes.
+  struct BufferedChar {
+    size_t begin;
+    size_t size;
+    int consumed;
+  };
+
+  // This is a queue consisting of all buffered "chars". Spans are used
+  // instead of per-char strings so that buffering does not allocate once
+  // the buffers have grown.
+  std::vector<BufferedChar> buffer_queue_;
   int dump_buffer_from_ = -1;
   
   int state_{0};
@@ -74,260 +107,352 @@ private:
   bool seenThreeSpans_{false};
   bool removeExtraWhiteSpace_{false};
 
+  // Matches of search() in postProcess(), kept to reuse the allocation.
+  std::vector<std::pair<const char*, const char*>> matches_;
+
+  // Returns the next buffered "char" with its consumed bytes.
+  std::pair<absl::string_view, int> dump() {
+    const auto &c = buffer_queue_[dump_buffer_from_++];
+    return {absl::string_view(buffer_.data() + c.begin, c.size), c.consumed};
+  }
+
 public:
-  UpperCaseEncoder(bool removeExtraWhiteSpace)
+  explicit UpperCaseEncoder(bool removeExtraWhiteSpace = false)
   : removeExtraWhiteSpace_(removeExtraWhiteSpace) {}
 
+  void Reset() {
+    buffer_.clear();
+    signature_.clear();
+    offset_ = 0;
+    buffer_queue_.clear();
+    dump_buffer_from_ = -1;
+    state_ = 0;
+    spans_ = 0;
+    seenThreeSpans_ = false;
+  }
+
+  void setRemoveExtraWhiteSpace(bool removeExtraWhiteSpace) {
+    removeExtraWhiteSpace_ = removeExtraWhiteSpace;
+  }
+
   std::pair<absl::string_view, int> normalizePrefix(absl::string_view orig_input) {
     // dump_buffer_from controls the return process for characters and consumed bytes
     // When this is -1, we are in "collection" mode and just keep adding to the buffer.
     // When collection is complete at some logical point, we set this to 0 to force an
     // element-wise buffer dump until it is exhausted. The following "if" block is
     // responsible for this.
-    if((dump_buffer_from_ >= 0) && (dump_buffer_from_ < buffer_queue_.size())) {
-      return buffer_queue_[dump_buffer_from_++];
-    }
+    if((dump_buffer_from_ >= 0) && (dump_buffer_from_ < buffer_queue_.size()))
+      return dump();
 
     // Since the buffer is exhausted, we reset the dump_buffer_from_ flag to -1
     // indicating that we are now again in character "collection" mode.
     if(dump_buffer_from_ > -1) {
       dump_buffer_from_ = -1;
       buffer_queue_.clear();
-
-      // This just results in the normalizePrefix function getting called again with
-      // the same arguments by the caller.
-      return {nullptr, 0};
     }
 
-    const auto input = orig_input.substr(offset_);
-    auto p = CaseEncoder::normalizePrefix(input);
-    auto sp = p.first;
-    int consumed = p.second;
-
-    bool last = input.size() == (size_t)consumed;
-    decltype(p) ret;
-
-    // Calling this results in returning the empty token with a zero consumed
-    // count that essentially results in normalizePrefix being called again with
-    // exactly same arguments. However, we record the number of bytes consumed in
-    // an offset so our view of the string does move with the correct amount.
-    // We need to do this because returning an empty character, and a non-empty
-    // consumed count will result in the caller messing up the norm_to_orig
-    // mapping that it tracks.
-    auto null = [this](int consumed) -> std::pair<absl::string_view, int> {
-      offset_ += consumed;
-      return {{nullptr, 0}, 0};
-    };
+    // Collecting a character returns the empty token with a zero consumed
+    // count to the caller, which then calls normalizePrefix again with exactly
+    // the same arguments. Instead, the loop collects all characters up to the
+    // next logical point in one call and records the number of bytes consumed
+    // in an offset so our view of the string does move with the correct
+    // amount. Returning an empty character with a non-empty consumed count
+    // would result in the caller messing up the norm_to_orig mapping that it
+    // tracks.
+    for(;;) {
+      const auto input = orig_input.substr(offset_);
+      auto p = CaseEncoder::normalizePrefix(input);
+      auto sp = p.first;
+      int consumed = p.second;
+
+      // Outside of an uppercase word, characters without a case or punctuation
+      // marker are returned as they are. This is the common case, which only
+      // has to be recorded in the signature.
+      if(state_ == 0 && (sp.empty() || (sp[0] != cUppercase && sp[0] != cPunctuation &&
+                                        sp[0] != cSpace))) {
+        spans_ = 0;
+        signature_.append(sp.size(), 'l');
+        return p;
+      }
 
-    // This function is responsible for collecting a character and corresponding
-    // number of consumed bytes in the buffer. We do _not_ want to return the characters
-    // processed at this time, and instead just record the current state, and let the caller
-    // call us again with the exact same input after the internal state is transitioned.
-    // Once we are in the terminal state, we can dump the buffer collected by this point.
-    auto buffer = [this, p](absl::string_view sp, int override_consumed = -1) {
-      auto cur_buf_last = buffer_.size();
-      buffer_.append(sp.data(), sp.size());
-      auto tmp_str = std::string(buffer_).substr(cur_buf_last, sp.size());
-      // ASSERT: concat([buffer_queue[0]]) == buffer_
-      buffer_queue_.push_back({tmp_str, override_consumed == -1 ? p.second : override_consumed});
-    };
+      bool last = input.size() == (size_t)consumed;
 
-    auto isUpper  = [=](absl::string_view sp) { return sp[0] == cUppercase;   };
-    auto isPunct  = [=](absl::string_view sp) { return sp[0] == cPunctuation; };
-    auto isSpace  = [=](absl::string_view sp) { return sp[0] == ' '; };
+      // This function is responsible for collecting a character and corresponding
+      // number of consumed bytes in the buffer. We do _not_ want to return the characters
+      // processed at this time, and instead just record the current state, and collect
+      // the next character after the internal state is transitioned.
+      // Once we are in the terminal state, we can dump the buffer collected by this point.
+      auto buffer = [this, p](absl::string_view sp, int override_consumed = -1) {
+        // ASSERT: concat([buffer_queue[0]]) == buffer_
+        buffer_queue_.push_back({buffer_.size(), sp.size(),
+                                 override_consumed == -1 ? p.second : override_consumed});
+        buffer_.append(sp.data(), sp.size());
+      };
 
-    if(state_ == 0) {
-      buffer_.clear();
-      buffer_queue_.clear();
-      offset_ = 0;
-    }
+      auto isUpper  = [=](absl::string_view sp) { return sp[0] == cUppercase;   };
+      auto isPunct  = [=](absl::string_view sp) { return sp[0] == cPunctuation; };
+      auto isSpace  = [=](absl::string_view sp) { return sp[0] == ' '; };
 
-    if(isUpper(sp)) {
       if(state_ == 0) {
-        buffer(sp);
-        buffer_[0] = cTitlecase;
-        buffer_queue_.front().first[0] = cTitlecase;
-        
-        state_ = 1;
-        ret = null(consumed);
-        
-        signature_.append("U");
-        signature_.append(sp.size() - 1, 'u');
-
-      } else if(state_ == 1 || state_ == 2) {
-        if(state_ == 1)
-          spans_++;
-        
-        sp.remove_prefix(1);
-        buffer(sp);
-        buffer_queue_.front().first[0] = cUppercase;
-        buffer_[0] = cUppercase;
-        state_ = 2;
-        ret = null(consumed);
-
-        signature_.append(sp.size(), 'u');
-      }  
-
-      if(last) {
-        dump_buffer_from_ = 0;
-        return null(0);
+        buffer_.clear();
+        buffer_queue_.clear();
+        offset_ = 0;
       }
-    } else {
-      if(isPunct(sp)) {
-        if(state_ == 1)
-          spans_++;
 
-        sp.remove_prefix(1);
-        signature_.append(sp.size(), 'p');
-      } else if(state_ == 2 && !isSpace(sp)) {
-        spans_ = 0;
-        buffer(std::string(1, cLowercase), 0);
-        signature_.append("L");
-        signature_.append(sp.size(), 'l');
-      } else if(isSpace(sp)) {
-        if(state_ == 1)
-          spans_++;
-        if(!removeExtraWhiteSpace_ || signature_.empty() || signature_.back() != 's')
-          signature_.append("sss");
+      if(isUpper(sp)) {
+        if(state_ == 0) {
+          buffer(sp);
+          buffer_[0] = cTitlecase;
+
+          state_ = 1;
+          offset_ += consumed;
+          
+          signature_.append("U");
+          signature_.append(sp.size() - 1, 'u');
+
+        } else if(state_ == 1 || state_ == 2) {
+          if(state_ == 1)
+            spans_++;
+          
+          sp.remove_prefix(1);
+          buffer(sp);
+          buffer_[0] = cUppercase;
+          state_ = 2;
+          offset_ += consumed;
+
+          signature_.append(sp.size(), 'u');
+        }  
+
+        if(last) {
+          dump_buffer_from_ = 0;
+          return dump();
+        }
       } else {
-        spans_ = 0;
-        signature_.append(sp.size(), 'l');
-      }
+        if(isPunct(sp)) {
+          if(state_ == 1)
+            spans_++;
+
+          sp.remove_prefix(1);
+          signature_.append(sp.size(), 'p');
+        } else if(state_ == 2 && !isSpace(sp)) {
+          spans_ = 0;
+          buffer(absl::string_view(&cLowercase, 1), 0);
+          signature_.append("L");
+          signature_.append(sp.size(), 'l');
+        } else if(isSpace(sp)) {
+          if(state_ == 1)
+            spans_++;
+          if(!removeExtraWhiteSpace_ || signature_.empty() || signature_.back() != 's')
+            signature_.append("sss");
+        } else {
+          spans_ = 0;
+          signature_.append(sp.size(), 'l');
+        }
 
-      if(!buffer_.empty()) {
-        buffer(sp);
-        offset_ = 0;
-        dump_buffer_from_ = 0;
+        if(!buffer_.empty()) {
+          buffer(sp);
+          offset_ = 0;
+          dump_buffer_from_ = 0;
+          state_ = 0;
+          return dump();
+        } else {
+          p.first = sp;
+        }
+        
         state_ = 0;
-        return null(0);
-      } else {
-        p.first = sp;
       }
-      
-      state_ = 0;
-      ret = p;
-    }
 
-    if(spans_ >= 3)
-      seenThreeSpans_ = true;
+      if(spans_ >= 3)
+        seenThreeSpans_ = true;
 
-    return ret;
+      if(state_ == 0)
+        return p;
+    }
+  }
+  // Replaces the per-word uppercase markers of spans of three or more
+  // all-caps words with a single cAllUppercase marker, followed by
+  // cLowercase if the span does not end the sentence or precede another
+  // uppercase word. Every span drops at least three markers and adds at most
+  // two, so the rewrite never overtakes the read position and can be done in
+  // place.
+  virtual void postProcess(std::string* normalized, std::vector<size_t>* norm_to_orig,
+                           size_t offset) {
+    postProcessAligned(normalized, norm_to_orig, offset);
+  }
+  virtual void postProcess(std::string* normalized, std::vector<uint32>* norm_to_orig,
+                           size_t offset) {
+    postProcessAligned(normalized, norm_to_orig, offset);
   }
 
-  virtual void postProcess(std::string* normalized, std::vector<size_t>* norm_to_orig) { 
+private:
+  template <typename T>
+  void postProcessAligned(std::string* normalized, std::vector<T>* norm_to_orig,
+                          size_t offset) {
     if(!seenThreeSpans_)
       return;
 
-    std::string normalized_temp;
-    normalized_temp.reserve(normalized->size());
-    
-    std::vector<size_t> norm_to_orig_temp;
-    norm_to_orig_temp.reserve(norm_to_orig->size());
-
-    const char* sig_it = signature_.data();
-
-    auto nrm_it = normalized->cbegin();
-    auto n2o_it = norm_to_orig->cbegin();
-
-    for(const auto& span : search(signature_)) {
-      size_t len = std::distance(sig_it, span.first);
-      
-      normalized_temp.insert(normalized_temp.end(), nrm_it, nrm_it + len);
-      norm_to_orig_temp.insert(norm_to_orig_temp.end(), n2o_it, n2o_it + len);
-
-      sig_it += len; 
-      nrm_it += len;
-      n2o_it += len;
-      normalized_temp.push_back(cAllUppercase);
-      norm_to_orig_temp.push_back(*n2o_it);
-            
+    // The signature describes the bytes after `offset`. Trailing whitespace
+    // may have been trimmed from `normalized` after it was recorded.
+    const size_t size = normalized->size();
+    if(offset > size)
+      return;
+    if(signature_.size() > size - offset)
+      signature_.resize(size - offset);
+
+    char* nrm = &(*normalized)[0];
+    T* n2o = norm_to_orig != nullptr ? norm_to_orig->data() : nullptr;
+
+    const char* sig_begin = signature_.data();
+    const char* sig_end = sig_begin + signature_.size();
+    const char* sig_it = sig_begin;
+
+    size_t r = offset;  // read position
+    size_t w = offset;  // write position
+
+    auto copy = [&](size_t len) {
+      if(w != r) {
+        std::memmove(nrm + w, nrm + r, len);
+        if(n2o)
+          std::memmove(n2o + w, n2o + r, len * sizeof(*n2o));
+      }
+      r += len;
+      w += len;
+    };
+
+    // Inserts `c` aligned to the current read position.
+    auto put = [&](char c) {
+      nrm[w] = c;
+      if(n2o)
+        n2o[w] = n2o[r];
+      ++w;
+    };
+
+    search(signature_, &matches_);
+    for(const auto& span : matches_) {
+      const size_t len = std::distance(sig_it, span.first);
+      copy(len);
+      sig_it += len;
+
+      put(cAllUppercase);
+
       while(sig_it != span.second) {
         if(*sig_it == cUppercase) {
-          sig_it++; 
-          nrm_it++;
-          n2o_it++;
-        }
-        sig_it++;
-        normalized_temp.push_back(*nrm_it++);
-        norm_to_orig_temp.push_back(*n2o_it++);
-      }
-      if(sig_it != signature_.data() + signature_.length()) { 
-        if(*sig_it != cUppercase) {
-          normalized_temp.push_back(cLowercase);
-          norm_to_orig_temp.push_back(*n2o_it);
+          ++sig_it;
+          ++r;
         }
+        ++sig_it;
+        copy(1);
       }
+      if(sig_it != sig_end && *sig_it != cUppercase)
+        put(cLowercase);
     }
 
-    if(nrm_it != normalized->cend())
-      normalized_temp.insert(normalized_temp.end(), nrm_it, normalized->cend());
-    if(n2o_it != norm_to_orig->cend())
-      norm_to_orig_temp.insert(norm_to_orig_temp.end(), n2o_it, norm_to_orig->cend());
+    copy(size - r);
+    normalized->resize(w);
 
-    normalized->swap(normalized_temp);
-    norm_to_orig->swap(norm_to_orig_temp);
+    // norm_to_orig has one more entry than normalized.
+    if(n2o) {
+      n2o[w] = n2o[r];
+      norm_to_orig->resize(w + 1);
+    }
   }
 };
 
-class UpperCaseDecoder : public CaseEncoder {
+class UpperCaseDecoder final : public CaseEncoder {
 private:
-  std::unique_ptr<std::string> buffer_;
+  // Maximum number of bytes passed to the normalizer while the current byte
+  // is marked. The case rules are a marker followed by one character, so
+  // only rules starting with cUppercase longer than this are cut.
+  static constexpr size_t kLookaheadSize = 32;
+
+  // The rest of the input from the current position. The input itself is
+  // never modified: if `marked_` is set, its first byte is read as
+  // cUppercase instead.
   absl::string_view input_;
+  bool marked_{false};
+
+  // cUppercase followed by the next bytes of input_, used as the normalizer
+  // input while the first byte is marked.
+  char lookahead_[kLookaheadSize];
 
   int state_ = 0;
   bool allUp_{false};
 
+  // Reads the first byte of input_ as cUppercase.
+  void mark(int skip) {
+    input_.remove_prefix(skip);
+    marked_ = true;
+  }
+
+  void skip(int skip) {
+    input_.remove_prefix(skip);
+    marked_ = false;
+  }
+
 public:
   UpperCaseDecoder() {}
 
+  void Reset() {
+    input_ = absl::string_view();
+    marked_ = false;
+    state_ = 0;
+    allUp_ = false;
+  }
+
   std::pair<absl::string_view, int> normalizePrefix(absl::string_view input) {
-    if(!buffer_) {
-      buffer_.reset(new std::string(input.data(), input.size()));
-      input_ = absl::string_view(*buffer_);
-    }
+    if(input_.data() == nullptr)
+      input_ = input;
 
-    if(input_[0] == cAllUppercase) {
-      const_cast<char&>(input_[0]) = cUppercase;
+    char first = marked_ ? cUppercase : input_[0];
+    if(first == cAllUppercase) {
+      first = cUppercase;
+      marked_ = true;
       allUp_ = true;
-    } else if (input_[0] == cTitlecase) {
+    } else if (first == cTitlecase) {
       allUp_ = false;
-    } else if (input_[0] == cLowercase) {
+    } else if (first == cLowercase) {
       allUp_ = false;
     }
 
-    auto p = CaseEncoder::normalizePrefix(input_);
+    absl::string_view view = input_;
+    if(marked_) {
+      const size_t size =
+          input_.size() < kLookaheadSize ? input_.size() : kLookaheadSize;
+      lookahead_[0] = cUppercase;
+      std::memcpy(lookahead_ + 1, input_.data() + 1, size - 1);
+      view = absl::string_view(lookahead_, size);
+    }
+
+    auto p = CaseEncoder::normalizePrefix(view);
     int consumed = p.second;
 
-    if(input_[0] == cUppercase) {
+    if(first == cUppercase) {
       if(state_ == 0) { 
-        input_.remove_prefix(consumed - 1);
-        const_cast<char&>(input_[0]) = cUppercase;
+        mark(consumed - 1);
         state_ = 1;
       } else if(state_ == 1) {
         if(consumed > 1) {
-          input_.remove_prefix(consumed - 1);
-          const_cast<char&>(input_[0]) = cUppercase;
+          mark(consumed - 1);
           p.second = consumed - 1;
           state_ = 1;
         } else {
-          input_.remove_prefix(consumed);
+          skip(consumed);
           p.first.remove_prefix(1);
           p.second = 0;
           state_ = 0;
         }
       }
-    } else if(input_[0] == cLowercase) {
-      input_.remove_prefix(consumed);
+    } else if(first == cLowercase) {
+      skip(consumed);
       p.first.remove_prefix(1);
       state_ = 0;
     } else {
       if(allUp_) {
         p.first = absl::string_view(input.data(), p.first.size());
-        input_.remove_prefix(consumed - 1);
-        const_cast<char&>(input_[0]) = cUppercase;
+        mark(consumed - 1);
         state_ = 1;
       } else {
-        input_.remove_prefix(consumed);
+        skip(consumed);
         state_ = 0;
       }
     }
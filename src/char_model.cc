@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+
 #include "char_model.h"
 #include "util.h"
 
@@ -21,10 +23,33 @@ namespace character {
 Model::Model(const ModelProto &model_proto) {
   model_proto_ = &model_proto;
   InitializePieces();
+  if (!status().ok()) return;
+
+  // Only the pieces of one BMP character can be found in bmp_ids_.
+  auto bmp_code_point = [](absl::string_view piece) -> int {
+    size_t mblen = 0;
+    const char32 c = string_util::DecodeUTF8(piece, &mblen);
+    if (mblen != piece.size() || c > 0xFFFF || c == kUnicodeError) return -1;
+    return static_cast<int>(c);
+  };
+  int max_code_point = -1;
+  for (const auto &sp : model_proto_->pieces()) {
+    max_code_point = std::max(max_code_point, bmp_code_point(sp.piece()));
+  }
+  bmp_ids_.assign(max_code_point + 1, unk_id_);
+  for (const auto &sp : model_proto_->pieces()) {
+    const int c = bmp_code_point(sp.piece());
+    if (c >= 0) bmp_ids_[c] = PieceToId(sp.piece());
+  }
 }
 
 Model::~Model() {}
 
+void Model::AddMemoryUsage(MemoryUsage *usage) const {
+  ModelInterface::AddMemoryUsage(usage);
+  usage->piece_maps += port::ContainerBytes(bmp_ids_);
+}
+
 EncodeResult Model::Encode(absl::string_view normalized) const {
   if (!status().ok() || normalized.empty()) {
     return {};
@@ -35,7 +60,14 @@ EncodeResult Model::Encode(absl::string_view normalized) const {
   while (!normalized.empty()) {
     const int mblen = matcher_->PrefixMatch(normalized);
     absl::string_view w(normalized.data(), mblen);
-    output.emplace_back(w, PieceToId(w));
+    // Single characters are looked up in bmp_ids_ without hashing.
+    size_t clen = 0;
+    const char32 c = string_util::DecodeUTF8(w, &clen);
+    if (clen == w.size() && c < bmp_ids_.size() && c != kUnicodeError) {
+      output.emplace_back(w, bmp_ids_[c]);
+    } else {
+      output.emplace_back(w, PieceToId(w));
+    }
     normalized.remove_prefix(mblen);
   }
 
@@ -15,6 +15,8 @@
 #ifndef CHAR_MODEL_H_
 #define CHAR_MODEL_H_
 
+#include <vector>
+
 #include "model_interface.h"
 #include "sentencepiece_model.pb.h"
 
@@ -28,6 +30,13 @@ class Model : public ModelInterface {
   ~Model() override;
 
   EncodeResult Encode(absl::string_view normalized) const override;
+
+  void AddMemoryUsage(MemoryUsage *usage) const override;
+
+ private:
+  // Ids of the BMP characters up to the largest one in the vocab, indexed by
+  // code point. Characters not in the vocab have the unk id.
+  std::vector<int> bmp_ids_;
 };
 }  // namespace character
 }  // namespace sentencepiece
@@ -13,6 +13,7 @@
 // limitations under the License.!
 
 #include <string>
+#include <vector>
 
 #include "char_model.h"
 #include "testharness.h"
@@ -106,6 +107,26 @@ TEST(ModelTest, EncodeTest) {
   EXPECT_EQ("d", result[5].first);
 }
 
+TEST(ModelTest, EncodeIdTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+
+  AddPiece(&model_proto, WS);                // 3
+  AddPiece(&model_proto, "a");               // 4
+  AddPiece(&model_proto, "\xe3\x81\x82");    // 5 (U+3042)
+  AddPiece(&model_proto, "\xf0\x9f\x98\x80");  // 6 (U+1F600)
+  AddPiece(&model_proto, "\xef\xbf\xbd");    // 7 (U+FFFD)
+
+  const Model model(model_proto);
+  const std::string broken_utf8 = std::string("\xe3\x81\x82").substr(0, 1);
+  std::vector<int> ids;
+  for (const auto &p :
+       model.Encode(WS "ab\xe3\x81\x82\xf0\x9f\x98\x80\xef\xbf\xbd" +
+                    broken_utf8)) {
+    ids.push_back(p.second);
+  }
+  EXPECT_EQ(std::vector<int>({3, 4, 0, 5, 6, 7, 0}), ids);
+}
+
 TEST(CharModelTest, NotSupportedTest) {
   ModelProto model_proto = MakeBaseModelProto();
   const Model model(model_proto);
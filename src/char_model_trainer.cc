@@ -12,7 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
 
 #include "char_model.h"
 #include "char_model_trainer.h"
@@ -39,12 +43,19 @@ util::Status Trainer::Train() {
 
   const auto logsum = std::log(static_cast<float>(sum));
 
+  // Only the most frequent characters are sorted, in stripes on the pool.
+  const int num_shards = std::max(1, trainer_spec_.num_threads());
+  std::vector<std::vector<std::pair<char32, int64>>> shards(num_shards);
+  size_t i = 0;
+  for (const auto &it : required_chars_) {
+    shards[i++ % num_shards].push_back(it);
+  }
+  const size_t num_pieces = trainer_spec_.use_all_vocab()
+                                ? std::numeric_limits<size_t>::max()
+                                : static_cast<size_t>(vocab_size);
+
   CHECK_OR_RETURN(final_pieces_.empty());
-  for (const auto &it : Sorted(required_chars_)) {
-    if (!trainer_spec_.use_all_vocab() &&
-        final_pieces_.size() == static_cast<size_t>(vocab_size)) {
-      break;
-    }
+  for (const auto &it : SortedTopK(&shards, num_pieces, pool())) {
     final_pieces_.emplace_back(
         string_util::UnicodeCharToUTF8(it.first),
         std::log(static_cast<float>(it.second)) - logsum);
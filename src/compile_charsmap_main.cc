@@ -12,23 +12,39 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #include "builder.h"
 #include "filesystem.h"
 #include "init.h"
+#include "normalizer.h"
 #include "sentencepiece_processor.h"
 #include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/str_split.h"
 #include "third_party/absl/strings/string_view.h"
+#include "util.h"
 
 using sentencepiece::normalizer::Builder;
 
 ABSL_FLAG(bool, output_precompiled_header, false,
           "make normalization_rule.h file");
+ABSL_FLAG(bool, output_specialized_header, false,
+          "make specialized_normalizer_rule.h file");
+ABSL_FLAG(std::string, specialized_rules, "nmt_nfkc",
+          "comma separated rules whose tables are written to "
+          "specialized_normalizer_rule.h");
+ABSL_FLAG(int32, num_threads,
+          std::max<int32>(1, std::thread::hardware_concurrency()),
+          "number of threads used to build the NFKC based rules");
+ABSL_FLAG(std::string, cache_dir, "",
+          "directory of compiled charsmaps. Rules whose content has not "
+          "changed are read from here instead of being compiled again.");
 
 namespace sentencepiece {
 namespace {
@@ -97,6 +113,46 @@ std::string ToHexData(absl::string_view data) {
   return os.str();
 }
 
+// Returns a fingerprint of the rules in `chars_map`.
+uint64 FingerprintCharsMap(const Builder::CharsMap &chars_map) {
+  uint64 fp = chars_map.size();
+  for (const auto &p : chars_map) {
+    fp = port::FingerprintCat(fp, p.first.size());
+    for (const char32 c : p.first) fp = port::FingerprintCat(fp, c);
+    fp = port::FingerprintCat(fp, p.second.size());
+    for (const char32 c : p.second) fp = port::FingerprintCat(fp, c);
+  }
+  return fp;
+}
+
+// Compiles `chars_map` into `output`. With a non-empty `cache_dir`, the
+// compiled blob is stored under the fingerprint of `chars_map`, and read
+// from there when the same rules are compiled again.
+util::Status CompileCharsMapWithCache(const Builder::CharsMap &chars_map,
+                                      absl::string_view cache_dir,
+                                      std::string *output) {
+  if (cache_dir.empty()) return Builder::CompileCharsMap(chars_map, output);
+
+  std::stringstream os;
+  os << std::hex << std::setw(16) << std::setfill('0')
+     << FingerprintCharsMap(chars_map) << ".bin";
+  const std::string filename = util::JoinPath(cache_dir, os.str());
+
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    if (input->status().ok() && input->ReadAll(output)) {
+      LOG(INFO) << "Read compiled charsmap from " << filename;
+      return util::OkStatus();
+    }
+  }
+
+  RETURN_IF_ERROR(Builder::CompileCharsMap(chars_map, output));
+  auto cache = filesystem::NewWritableFile(filename, true);
+  RETURN_IF_ERROR(cache->status());
+  CHECK_OR_RETURN(cache->Write(*output));
+  return util::OkStatus();
+}
+
 std::string MakeHeader(
     const std::vector<std::pair<std::string, std::string>> &data) {
   constexpr char kHeader[] =
@@ -152,19 +208,90 @@ struct BinaryBlob {
   return os.str();
 }
 
+// Returns the SpecializedCharsMap tables of the precompiled charsmaps in
+// `data` whose names are in `names`.
+std::string MakeSpecializedHeader(
+    const std::vector<std::pair<std::string, std::string>> &data,
+    const std::vector<std::string> &names) {
+  constexpr char kHeader[] =
+      R"(#ifndef SPECIALIZED_NORMALIZER_RULE_H_
+#define SPECIALIZED_NORMALIZER_RULE_H_
+// Generated by compile_charsmap --output_specialized_header.
+namespace sentencepiece {
+namespace normalizer {
+namespace {
+
+)";
+
+  constexpr char kFooter[] = R"(
+}  // namespace
+}  // namespace normalizer
+}  // namespace sentencepiece
+#endif  // SPECIALIZED_NORMALIZER_RULE_H_
+)";
+
+  std::stringstream os;
+  os << kHeader;
+  std::vector<std::pair<std::string, uint64>> tables;
+  for (const auto &p : data) {
+    if (std::find(names.begin(), names.end(), p.first) == names.end()) {
+      continue;
+    }
+    std::vector<int32> values;
+    CHECK_OK(normalizer::Normalizer::BuildSpecializedCharsMap(p.second,
+                                                              &values));
+    os << "constexpr int32 kSpecializedCharsMap_" << p.first << "[] = {\n";
+    for (size_t c = 0; c < values.size(); ++c) {
+      os << values[c] << (c % 8 == 7 ? ",\n" : ", ");
+    }
+    os << "};\n\n";
+    tables.emplace_back(
+        p.first,
+        normalizer::Normalizer::FingerprintPrecompiledCharsMap(p.second));
+  }
+  CHECK(!tables.empty()) << "no rule matches --specialized_rules.";
+
+  os << "constexpr SpecializedCharsMap kSpecializedCharsMaps[] = {\n";
+  for (const auto &p : tables) {
+    os << "{ \"" << p.first << "\", 0x" << std::hex << p.second << std::dec
+       << "ULL, kSpecializedCharsMap_" << p.first << " },\n";
+  }
+  os << "};\n";
+  os << kFooter;
+
+  return os.str();
+}
+
 }  // namespace
 }  // namespace sentencepiece
 
 int main(int argc, char **argv) {
   sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
 
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  CHECK_GE(num_threads, 1);
+  const std::string cache_dir = absl::GetFlag(FLAGS_cache_dir);
+
   const std::vector<std::pair<
       std::string,
       std::function<sentencepiece::util::Status(Builder::CharsMap *)>>>
-      kRuleList = {{"nfkc", Builder::BuildNFKCMap},
-                   {"nmt_nfkc", Builder::BuildNmtNFKCMap},
-                   {"nfkc_cf", Builder::BuildNFKC_CFMap},
-                   {"nmt_nfkc_cf", Builder::BuildNmtNFKC_CFMap},
+      kRuleList = {{"nfkc",
+                    [num_threads](Builder::CharsMap *chars_map) {
+                      return Builder::BuildNFKCMap(chars_map, num_threads);
+                    }},
+                   {"nmt_nfkc",
+                    [num_threads](Builder::CharsMap *chars_map) {
+                      return Builder::BuildNmtNFKCMap(chars_map, num_threads);
+                    }},
+                   {"nfkc_cf",
+                    [num_threads](Builder::CharsMap *chars_map) {
+                      return Builder::BuildNFKC_CFMap(chars_map, num_threads);
+                    }},
+                   {"nmt_nfkc_cf",
+                    [num_threads](Builder::CharsMap *chars_map) {
+                      return Builder::BuildNmtNFKC_CFMap(chars_map,
+                                                         num_threads);
+                    }},
                    {"case_uncaser", Builder::BuildUncaserMap},
                    {"case_recaser", Builder::BuildRecaserMap}};
 
@@ -175,7 +302,8 @@ int main(int argc, char **argv) {
 
     // Write Header.
     std::string index;
-    CHECK_OK(Builder::CompileCharsMap(normalized_map, &index));
+    CHECK_OK(sentencepiece::CompileCharsMapWithCache(normalized_map, cache_dir,
+                                                     &index));
     data.emplace_back(p.first, index);
 
     // Write TSV file.
@@ -190,5 +318,16 @@ int main(int argc, char **argv) {
     output->Write(sentencepiece::MakeHeader(data));
   }
 
+  if (absl::GetFlag(FLAGS_output_specialized_header)) {
+    constexpr char kSpecializedHeaderFileName[] =
+        "specialized_normalizer_rule.h";
+    const std::vector<std::string> names =
+        absl::StrSplit(absl::GetFlag(FLAGS_specialized_rules), ",");
+    auto output =
+        sentencepiece::filesystem::NewWritableFile(kSpecializedHeaderFileName);
+    CHECK_OK(output->status());
+    output->Write(sentencepiece::MakeSpecializedHeader(data, names));
+  }
+
   return 0;
 }
@@ -0,0 +1,338 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "cpu_dispatch.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "third_party/absl/strings/string_view.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The AVX2 kernels are compiled with a function target attribute rather
+// than with -mavx2 on the whole file, so that nothing else in the library
+// can use AVX2 on a processor without it.
+#if defined(SPM_ENABLE_CPU_DISPATCH) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SPM_HAVE_AVX2_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SPM_HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#if defined(SPM_ENABLE_CPU_DISPATCH) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+namespace sentencepiece {
+namespace cpu {
+namespace {
+
+// The scalar kernels, which also finish the tails of the vector ones.
+
+size_t ASCIIPrefixLengthScalar(const char *begin, const char *end) {
+  const char *p = begin;
+  constexpr uint64 kHighBits = 0x8080808080808080ULL;
+  while (end - p >= 8) {
+    uint64 word;
+    memcpy(&word, p, sizeof(word));
+    if (word & kHighBits) break;
+    p += 8;
+  }
+  while (p < end && static_cast<unsigned char>(*p) < 0x80) ++p;
+  return p - begin;
+}
+
+size_t DecodeASCIIPrefixScalar(const char *begin, const char *end,
+                               char32 *output) {
+  const char *p = begin;
+  while (p < end && static_cast<unsigned char>(*p) < 0x80) {
+    *output++ = static_cast<unsigned char>(*p++);
+  }
+  return p - begin;
+}
+
+const char *FindThreeBytesScalar(const char *begin, const char *end,
+                                 const char *key) {
+  const char *p = begin;
+  while (end - p >= 3) {
+    p = static_cast<const char *>(memchr(p, key[0], end - p - 2));
+    if (p == nullptr) return end;
+    if (p[1] == key[1] && p[2] == key[2]) return p;
+    ++p;
+  }
+  return end;
+}
+
+#if defined(__SSE2__)
+size_t ASCIIPrefixLengthSSE2(const char *begin, const char *end) {
+  const char *p = begin;
+  while (end - p >= 16) {
+    const int mask = _mm_movemask_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+    if (mask != 0) return p - begin + __builtin_ctz(mask);
+    p += 16;
+  }
+  return p - begin + ASCIIPrefixLengthScalar(p, end);
+}
+
+size_t DecodeASCIIPrefixSSE2(const char *begin, const char *end,
+                             char32 *output) {
+  const char *p = begin;
+  const __m128i zero = _mm_setzero_si128();
+  while (end - p >= 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    if (_mm_movemask_epi8(bytes) != 0) break;
+    const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    __m128i *out = reinterpret_cast<__m128i *>(output);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+    p += 16;
+    output += 16;
+  }
+  return p - begin + DecodeASCIIPrefixScalar(p, end, output);
+}
+
+// Matches the three bytes at 16 positions at once.
+const char *FindThreeBytesSSE2(const char *begin, const char *end,
+                               const char *key) {
+  const char *p = begin;
+  const __m128i b0 = _mm_set1_epi8(key[0]);
+  const __m128i b1 = _mm_set1_epi8(key[1]);
+  const __m128i b2 = _mm_set1_epi8(key[2]);
+  while (end - p >= 18) {
+    const __m128i m = _mm_and_si128(
+        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),
+                       b0),
+        _mm_and_si128(
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1)), b1),
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2)),
+                b2)));
+    const int mask = _mm_movemask_epi8(m);
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return FindThreeBytesScalar(p, end, key);
+}
+#endif  // __SSE2__
+
+#ifdef SPM_HAVE_AVX2_KERNELS
+__attribute__((target("avx2"))) size_t ASCIIPrefixLengthAVX2(
+    const char *begin, const char *end) {
+  const char *p = begin;
+  while (end - p >= 32) {
+    const int mask = _mm256_movemask_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+    if (mask != 0) return p - begin + __builtin_ctz(mask);
+    p += 32;
+  }
+  return p - begin + ASCIIPrefixLengthScalar(p, end);
+}
+
+__attribute__((target("avx2"))) size_t DecodeASCIIPrefixAVX2(
+    const char *begin, const char *end, char32 *output) {
+  const char *p = begin;
+  while (end - p >= 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    if (_mm_movemask_epi8(bytes) != 0) break;
+    __m256i *out = reinterpret_cast<__m256i *>(output);
+    _mm256_storeu_si256(out, _mm256_cvtepu8_epi32(bytes));
+    _mm256_storeu_si256(out + 1,
+                        _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+    p += 16;
+    output += 16;
+  }
+  return p - begin + DecodeASCIIPrefixScalar(p, end, output);
+}
+
+__attribute__((target("avx2"))) const char *FindThreeBytesAVX2(
+    const char *begin, const char *end, const char *key) {
+  const char *p = begin;
+  const __m256i b0 = _mm256_set1_epi8(key[0]);
+  const __m256i b1 = _mm256_set1_epi8(key[1]);
+  const __m256i b2 = _mm256_set1_epi8(key[2]);
+  while (end - p >= 34) {
+    const __m256i m = _mm256_and_si256(
+        _mm256_cmpeq_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)), b0),
+        _mm256_and_si256(
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 1)),
+                b1),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 2)),
+                b2)));
+    const int mask = _mm256_movemask_epi8(m);
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return FindThreeBytesScalar(p, end, key);
+}
+#endif  // SPM_HAVE_AVX2_KERNELS
+
+#ifdef SPM_HAVE_NEON_KERNELS
+// NEON has no movemask, so a block with a hit is finished by the scalar
+// kernel, which stops within it.
+size_t ASCIIPrefixLengthNEON(const char *begin, const char *end) {
+  const char *p = begin;
+  while (end - p >= 16) {
+    const uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+    if (vmaxvq_u8(bytes) >= 0x80) break;
+    p += 16;
+  }
+  return p - begin + ASCIIPrefixLengthScalar(p, end);
+}
+
+size_t DecodeASCIIPrefixNEON(const char *begin, const char *end,
+                             char32 *output) {
+  const char *p = begin;
+  while (end - p >= 16) {
+    const uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+    if (vmaxvq_u8(bytes) >= 0x80) break;
+    const uint16x8_t lo = vmovl_u8(vget_low_u8(bytes));
+    const uint16x8_t hi = vmovl_u8(vget_high_u8(bytes));
+    vst1q_u32(output, vmovl_u16(vget_low_u16(lo)));
+    vst1q_u32(output + 4, vmovl_u16(vget_high_u16(lo)));
+    vst1q_u32(output + 8, vmovl_u16(vget_low_u16(hi)));
+    vst1q_u32(output + 12, vmovl_u16(vget_high_u16(hi)));
+    p += 16;
+    output += 16;
+  }
+  return p - begin + DecodeASCIIPrefixScalar(p, end, output);
+}
+
+const char *FindThreeBytesNEON(const char *begin, const char *end,
+                               const char *key) {
+  const char *p = begin;
+  const uint8x16_t b0 = vdupq_n_u8(static_cast<uint8_t>(key[0]));
+  const uint8x16_t b1 = vdupq_n_u8(static_cast<uint8_t>(key[1]));
+  const uint8x16_t b2 = vdupq_n_u8(static_cast<uint8_t>(key[2]));
+  while (end - p >= 18) {
+    const uint8_t *q = reinterpret_cast<const uint8_t *>(p);
+    const uint8x16_t m =
+        vandq_u8(vceqq_u8(vld1q_u8(q), b0),
+                 vandq_u8(vceqq_u8(vld1q_u8(q + 1), b1),
+                          vceqq_u8(vld1q_u8(q + 2), b2)));
+    if (vmaxvq_u8(m) != 0) return FindThreeBytesScalar(p, p + 18, key);
+    p += 16;
+  }
+  return FindThreeBytesScalar(p, end, key);
+}
+#endif  // SPM_HAVE_NEON_KERNELS
+
+const Kernels kKernels[kNumLevels] = {
+    {kScalar, ASCIIPrefixLengthScalar, DecodeASCIIPrefixScalar,
+     FindThreeBytesScalar},
+#if defined(__SSE2__)
+    {kSSE2, ASCIIPrefixLengthSSE2, DecodeASCIIPrefixSSE2, FindThreeBytesSSE2},
+#else
+    {kScalar, nullptr, nullptr, nullptr},
+#endif
+#ifdef SPM_HAVE_AVX2_KERNELS
+    {kAVX2, ASCIIPrefixLengthAVX2, DecodeASCIIPrefixAVX2, FindThreeBytesAVX2},
+#else
+    {kScalar, nullptr, nullptr, nullptr},
+#endif
+#ifdef SPM_HAVE_NEON_KERNELS
+    {kNEON, ASCIIPrefixLengthNEON, DecodeASCIIPrefixNEON, FindThreeBytesNEON},
+#else
+    {kScalar, nullptr, nullptr, nullptr},
+#endif
+};
+
+const char *const kLevelNames[kNumLevels] = {"scalar", "sse2", "avx2",
+                                             "neon"};
+
+bool ProcessorSupports(Level level) {
+  switch (level) {
+    case kScalar:
+      return true;
+    case kSSE2:
+      // Only compiled when the compiler may assume SSE2 anyway.
+      return true;
+    case kAVX2:
+#ifdef SPM_HAVE_AVX2_KERNELS
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#else
+      return false;
+#endif
+    case kNEON:
+#if defined(SPM_HAVE_NEON_KERNELS) && defined(SPM_ENABLE_CPU_DISPATCH) && \
+    defined(__linux__)
+      return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#else
+      // Advanced SIMD is part of the AArch64 base architecture.
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+const Kernels &SelectKernels() {
+  Level best = kScalar;
+  for (int l = kScalar; l < kNumLevels; ++l) {
+    // The levels of one architecture are ordered, and only the levels of the
+    // target architecture are compiled.
+    if (IsSupported(static_cast<Level>(l))) best = static_cast<Level>(l);
+  }
+  const char *forced = std::getenv("SPM_CPU_LEVEL");
+  if (forced == nullptr || *forced == '\0') return kKernels[best];
+  for (int l = kScalar; l < kNumLevels; ++l) {
+    if (absl::string_view(forced) != kLevelNames[l]) continue;
+    if (IsSupported(static_cast<Level>(l))) return kKernels[l];
+    LOG(WARNING) << "SPM_CPU_LEVEL=" << forced
+                 << " is not supported. Uses " << kLevelNames[best] << ".";
+    return kKernels[best];
+  }
+  LOG(WARNING) << "Unknown SPM_CPU_LEVEL=" << forced << ". Uses "
+               << kLevelNames[best] << ".";
+  return kKernels[best];
+}
+}  // namespace
+
+const char *LevelName(Level level) {
+  return level >= kScalar && level < kNumLevels ? kLevelNames[level]
+                                                : "unknown";
+}
+
+bool IsSupported(Level level) {
+  if (level < kScalar || level >= kNumLevels) return false;
+  return kKernels[level].ascii_prefix_length != nullptr &&
+         ProcessorSupports(level);
+}
+
+const Kernels &GetKernels() {
+  static const Kernels &kernels = SelectKernels();
+  return kernels;
+}
+
+const Kernels &GetKernels(Level level) {
+  return IsSupported(level) ? kKernels[level] : kKernels[kScalar];
+}
+
+}  // namespace cpu
+}  // namespace sentencepiece
@@ -0,0 +1,67 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef CPU_DISPATCH_H_
+#define CPU_DISPATCH_H_
+
+#include <cstddef>
+
+#include "common.h"
+
+namespace sentencepiece {
+namespace cpu {
+
+// The instruction sets the SIMD kernels are compiled for. kScalar is the
+// portable reference the other levels must agree with.
+enum Level { kScalar, kSSE2, kAVX2, kNEON, kNumLevels };
+
+// The kernels of one level. They give the same results on every level.
+struct Kernels {
+  Level level;
+
+  // Returns the number of ASCII bytes at the beginning of [begin, end).
+  size_t (*ascii_prefix_length)(const char *begin, const char *end);
+
+  // Widens the ASCII bytes at the beginning of [begin, end) into `output` and
+  // returns their number. `output` must have room for end - begin characters.
+  size_t (*decode_ascii_prefix)(const char *begin, const char *end,
+                                char32 *output);
+
+  // Returns the first p in [begin, end) such that the three bytes from p are
+  // key[0], key[1] and key[2], or `end` if there is none.
+  const char *(*find_three_bytes)(const char *begin, const char *end,
+                                  const char *key);
+};
+
+// Returns the name of `level`, as SPM_CPU_LEVEL spells it.
+const char *LevelName(Level level);
+
+// Returns true if this build has the kernels of `level` and the processor
+// runs them.
+bool IsSupported(Level level);
+
+// Returns the kernels of the best supported level, selected on the first
+// call. Setting the environment variable SPM_CPU_LEVEL to "scalar", "sse2",
+// "avx2" or "neon" selects that level instead when it is supported, so that
+// one binary can test and benchmark each of its kernels.
+const Kernels &GetKernels();
+
+// Returns the kernels of `level`, or those of kScalar if it is not
+// supported.
+const Kernels &GetKernels(Level level);
+
+}  // namespace cpu
+}  // namespace sentencepiece
+
+#endif  // CPU_DISPATCH_H_
@@ -0,0 +1,97 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "cpu_dispatch.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "testharness.h"
+
+namespace sentencepiece {
+namespace cpu {
+namespace {
+
+TEST(CpuDispatchTest, SelectionTest) {
+  EXPECT_TRUE(IsSupported(kScalar));
+  EXPECT_FALSE(IsSupported(kNumLevels));
+  EXPECT_TRUE(IsSupported(GetKernels().level));
+  EXPECT_EQ(kScalar, GetKernels(kScalar).level);
+  for (int l = kScalar; l < kNumLevels; ++l) {
+    const Level level = static_cast<Level>(l);
+    EXPECT_EQ(IsSupported(level) ? level : kScalar, GetKernels(level).level);
+  }
+  EXPECT_EQ(std::string("scalar"), LevelName(kScalar));
+  EXPECT_EQ(std::string("avx2"), LevelName(kAVX2));
+  EXPECT_EQ(std::string("unknown"), LevelName(kNumLevels));
+}
+
+// Every supported level agrees with the scalar kernels around the block
+// boundaries of the vector ones.
+TEST(CpuDispatchTest, KernelsMatchScalarTest) {
+  const Kernels &scalar = GetKernels(kScalar);
+  const char kSpace[] = "\xe2\x96\x81";
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> dist(0, 15);
+  for (int l = kScalar + 1; l < kNumLevels; ++l) {
+    if (!IsSupported(static_cast<Level>(l))) continue;
+    const Kernels &kernels = GetKernels(static_cast<Level>(l));
+    for (int trial = 0; trial < 2000; ++trial) {
+      std::string text(dist(gen) * 5, 'a');
+      for (char &c : text) {
+        const int r = dist(gen);
+        if (r == 0) c = '\xc3';
+        if (r == 1) c = '\xe2';
+        if (r == 2) c = '\x96';
+        if (r == 3) c = '\x81';
+      }
+      if (dist(gen) == 0 && text.size() >= 3) {
+        text.replace(dist(gen) % (text.size() - 2), 3, kSpace);
+      }
+      const char *begin = text.data();
+      const char *end = text.data() + text.size();
+      EXPECT_EQ(scalar.ascii_prefix_length(begin, end),
+                kernels.ascii_prefix_length(begin, end));
+      EXPECT_EQ(scalar.find_three_bytes(begin, end, kSpace),
+                kernels.find_three_bytes(begin, end, kSpace));
+
+      std::vector<char32> expected(text.size()), actual(text.size());
+      const size_t n =
+          scalar.decode_ascii_prefix(begin, end, expected.data());
+      EXPECT_EQ(n, kernels.decode_ascii_prefix(begin, end, actual.data()));
+      expected.resize(n);
+      actual.resize(n);
+      EXPECT_EQ(expected, actual);
+    }
+  }
+}
+
+TEST(CpuDispatchTest, ScalarKernelsTest) {
+  const Kernels &scalar = GetKernels(kScalar);
+  const std::string text = "abcdefghij\xe2\x96\x81xyz";
+  const char *begin = text.data();
+  const char *end = text.data() + text.size();
+  EXPECT_EQ(10, scalar.ascii_prefix_length(begin, end));
+  EXPECT_EQ(begin + 10, scalar.find_three_bytes(begin, end, "\xe2\x96\x81"));
+  EXPECT_EQ(end, scalar.find_three_bytes(begin, end, "xyw"));
+  EXPECT_EQ(end - 3, scalar.find_three_bytes(begin, end, "xyz"));
+  std::vector<char32> output(text.size());
+  EXPECT_EQ(10, scalar.decode_ascii_prefix(begin, end, output.data()));
+  EXPECT_EQ('j', output[9]);
+}
+
+}  // namespace
+}  // namespace cpu
+}  // namespace sentencepiece
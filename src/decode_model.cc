@@ -0,0 +1,30 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "decode_model.h"
+
+namespace sentencepiece {
+
+DecodeModel::DecodeModel(const ModelProto &model_proto) {
+  model_proto_ = &model_proto;
+  InitializePieces();
+}
+
+DecodeModel::~DecodeModel() {}
+
+EncodeResult DecodeModel::Encode(absl::string_view normalized) const {
+  return {};
+}
+
+}  // namespace sentencepiece
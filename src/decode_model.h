@@ -0,0 +1,37 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+
+#ifndef DECODE_MODEL_H_
+#define DECODE_MODEL_H_
+
+#include "model_interface.h"
+#include "sentencepiece_model.pb.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// The pieces of a model without its encoder, which a processor loaded with
+// LoadMode::kDecodeOnly uses to decode ids. Only the piece tables are built,
+// not the tries or the merge rules of the model type, so loading is cheaper
+// than with ModelFactory::Create(). Encode() returns no pieces.
+class DecodeModel : public ModelInterface {
+ public:
+  explicit DecodeModel(const ModelProto &model_proto);
+  ~DecodeModel() override;
+
+  EncodeResult Encode(absl::string_view normalized) const override;
+};
+}  // namespace sentencepiece
+#endif  // DECODE_MODEL_H_
@@ -0,0 +1,98 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "encode_cache.h"
+
+#include <algorithm>
+
+#include "util.h"
+
+namespace sentencepiece {
+
+constexpr int EncodeCache::kDefaultNumShards;
+
+EncodeCache::EncodeCache(size_t max_bytes, int num_shards)
+    : max_bytes_(max_bytes),
+      max_shard_bytes_(max_bytes / std::max(num_shards, 1)),
+      shards_(std::max(num_shards, 1)) {}
+
+// static
+EncodeCache::Key EncodeCache::MakeKey(absl::string_view input) {
+  return Key{input, string_util::string_view_hash()(input)};
+}
+
+// static
+size_t EncodeCache::EntryBytes(absl::string_view input, size_t num_ids) {
+  // The list node and the index node with their pointers.
+  constexpr size_t kOverhead =
+      sizeof(Entry) + sizeof(Key) + 6 * sizeof(void *);
+  return kOverhead + input.size() + num_ids * sizeof(int);
+}
+
+bool EncodeCache::Lookup(absl::string_view input, std::vector<int> *ids) {
+  const Key key = MakeKey(input);
+  Shard *shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  const auto it = shard->index.find(key);
+  if (it == shard->index.end()) return false;
+  shard->entries.splice(shard->entries.begin(), shard->entries, it->second);
+  ids->assign(it->second->ids.begin(), it->second->ids.end());
+  return true;
+}
+
+void EncodeCache::Insert(absl::string_view input,
+                         const std::vector<int> &ids) {
+  const size_t entry_bytes = EntryBytes(input, ids.size());
+  if (entry_bytes > max_shard_bytes_) return;
+
+  const Key key = MakeKey(input);
+  Shard *shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  if (shard->index.count(key) > 0) return;  // inserted by another thread.
+
+  while (!shard->entries.empty() &&
+         shard->bytes + entry_bytes > max_shard_bytes_) {
+    const Entry &last = shard->entries.back();
+    shard->bytes -= EntryBytes(last.input, last.ids.size());
+    shard->index.erase(MakeKey(last.input));
+    shard->entries.pop_back();
+  }
+
+  shard->entries.push_front(Entry{std::string(input.data(), input.size()),
+                                  ids});
+  // The key refers to the string in the list node, which never moves.
+  shard->index.emplace(Key{shard->entries.front().input, key.hash},
+                       shard->entries.begin());
+  shard->bytes += entry_bytes;
+}
+
+void EncodeCache::Clear() {
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.index.clear();
+    shard.entries.clear();
+    shard.bytes = 0;
+  }
+}
+
+size_t EncodeCache::bytes() const {
+  size_t bytes = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    bytes += shard.bytes;
+  }
+  return bytes;
+}
+
+}  // namespace sentencepiece
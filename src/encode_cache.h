@@ -0,0 +1,124 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef ENCODE_CACHE_H_
+#define ENCODE_CACHE_H_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// A cache from inputs to the ids SentencePieceProcessor encodes them into.
+// Must be usable by any number of threads.
+class EncodeCacheInterface {
+ public:
+  virtual ~EncodeCacheInterface() {}
+
+  // Returns true and stores the ids of `input` in `ids` if it is cached.
+  virtual bool Lookup(absl::string_view input, std::vector<int> *ids) = 0;
+
+  // Caches `ids` for `input`.
+  virtual void Insert(absl::string_view input, const std::vector<int> &ids) = 0;
+
+  // Called when the model or the encode options of the processor change.
+  // The ids cached before must not be returned anymore. `fingerprint`
+  // identifies the model and the options the next ids are encoded with, and
+  // the model has `piece_size` pieces.
+  virtual void Invalidate(uint64 fingerprint, int piece_size) = 0;
+
+  // Returns the bytes of the cache counted by GetMemoryUsage().
+  virtual size_t bytes() const = 0;
+
+  // Returns true if the entries are shared with other processes, which need
+  // the fingerprint passed to Invalidate().
+  virtual bool is_shared() const = 0;
+};
+
+// A bounded cache from inputs to the ids they are encoded into, which can be
+// used by any number of threads. The inputs are spread over shards by their
+// hash, and each shard evicts its least recently used entries when the
+// entries exceed its part of the memory bound.
+class EncodeCache : public EncodeCacheInterface {
+ public:
+  // Keeps the keys and ids of the entries, with an estimate of their
+  // bookkeeping, within `max_bytes` bytes.
+  explicit EncodeCache(size_t max_bytes, int num_shards = kDefaultNumShards);
+
+  bool Lookup(absl::string_view input, std::vector<int> *ids) override;
+
+  // Entries larger than a shard are not cached.
+  void Insert(absl::string_view input, const std::vector<int> &ids) override;
+
+  // Removes all entries, whatever `fingerprint` is.
+  void Invalidate(uint64 fingerprint, int piece_size) override { Clear(); }
+
+  // Removes all entries.
+  void Clear();
+
+  size_t max_bytes() const { return max_bytes_; }
+
+  // Returns the bytes of the entries as they are counted for the bound.
+  size_t bytes() const override;
+
+  bool is_shared() const override { return false; }
+
+  static constexpr int kDefaultNumShards = 16;
+
+ private:
+  struct Entry {
+    std::string input;
+    std::vector<int> ids;
+  };
+
+  // An input and its hash, which is computed once for both the shard and
+  // the bucket.
+  struct Key {
+    absl::string_view input;
+    size_t hash;
+    bool operator==(const Key &other) const { return input == other.input; }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const { return key.hash; }
+  };
+
+  struct Shard {
+    mutable std::mutex mutex;
+    std::list<Entry> entries;  // the most recently used first.
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    size_t bytes = 0;
+  };
+
+  static Key MakeKey(absl::string_view input);
+  static size_t EntryBytes(absl::string_view input, size_t num_ids);
+
+  Shard *GetShard(const Key &key) {
+    return &shards_[(key.hash >> 8) % shards_.size()];
+  }
+
+  const size_t max_bytes_;
+  const size_t max_shard_bytes_;
+  std::vector<Shard> shards_;
+};
+
+}  // namespace sentencepiece
+#endif  // ENCODE_CACHE_H_
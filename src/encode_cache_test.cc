@@ -0,0 +1,101 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "encode_cache.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "testharness.h"
+
+namespace sentencepiece {
+namespace {
+
+TEST(EncodeCacheTest, LookupAndInsertTest) {
+  EncodeCache cache(1 << 20);
+  std::vector<int> ids = {7};
+  EXPECT_FALSE(cache.Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({7}), ids);
+  EXPECT_EQ(0, cache.bytes());
+
+  cache.Insert("abc", {1, 2, 3});
+  cache.Insert("", {});
+  EXPECT_TRUE(cache.Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), ids);
+  EXPECT_TRUE(cache.Lookup("", &ids));
+  EXPECT_TRUE(ids.empty());
+  EXPECT_FALSE(cache.Lookup("ab", &ids));
+  EXPECT_GT(cache.bytes(), 0);
+
+  // The first entry is kept.
+  cache.Insert("abc", {4});
+  EXPECT_TRUE(cache.Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), ids);
+
+  cache.Clear();
+  EXPECT_FALSE(cache.Lookup("abc", &ids));
+  EXPECT_EQ(0, cache.bytes());
+}
+
+TEST(EncodeCacheTest, EvictionTest) {
+  // One shard holding a few entries.
+  EncodeCache cache(1024, 1);
+  const std::vector<int> ids(16, 1);
+  for (int i = 0; i < 100; ++i) {
+    cache.Insert(std::to_string(i), ids);
+    EXPECT_LE(cache.bytes(), cache.max_bytes());
+  }
+
+  std::vector<int> output;
+  EXPECT_TRUE(cache.Lookup("99", &output));
+  EXPECT_FALSE(cache.Lookup("0", &output));
+
+  // The least recently used entry is evicted first.
+  for (int i = 0; i < 100; ++i) {
+    if (cache.Lookup(std::to_string(i), &output)) {
+      cache.Insert("new", ids);
+      EXPECT_TRUE(cache.Lookup(std::to_string(i), &output));
+      break;
+    }
+  }
+
+  // An entry larger than the shard is not cached.
+  cache.Insert("large", std::vector<int>(1024, 1));
+  EXPECT_FALSE(cache.Lookup("large", &output));
+  EXPECT_TRUE(cache.Lookup("new", &output));
+}
+
+TEST(EncodeCacheTest, ThreadsTest) {
+  EncodeCache cache(1 << 16, 4);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&cache]() {
+      std::vector<int> ids;
+      for (int i = 0; i < 1000; ++i) {
+        const std::string input = std::to_string(i % 100);
+        if (cache.Lookup(input, &ids)) {
+          EXPECT_EQ(std::vector<int>({i % 100}), ids);
+        } else {
+          cache.Insert(input, {i % 100});
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  EXPECT_LE(cache.bytes(), cache.max_bytes());
+}
+
+}  // namespace
+}  // namespace sentencepiece
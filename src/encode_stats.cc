@@ -0,0 +1,328 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "encode_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "filesystem.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace stats {
+
+#ifdef SPM_ENABLE_STATS
+namespace {
+struct Counters {
+  Counters() {
+    for (auto &value : values) value.store(0, std::memory_order_relaxed);
+  }
+  std::atomic<uint64> values[kNumCounters];
+};
+
+// Keeps the counters of the live threads and the sums of the exited ones.
+struct Registry {
+  std::mutex mutex;
+  std::vector<const Counters *> live;
+  uint64 exited[kNumCounters] = {};
+};
+
+// Never destroyed, since threads may exit after the static destructors.
+Registry *GetRegistry() {
+  static Registry *registry = new Registry;
+  return registry;
+}
+
+#ifdef SPM_NO_THREADLOCAL
+// All threads share one set of counters.
+Counters *GetCounters() {
+  static Counters *counters = [] {
+    auto *counters = new Counters;
+    auto *registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    registry->live.push_back(counters);
+    return counters;
+  }();
+  return counters;
+}
+#else
+// The counters of one thread, which only this thread writes. They are
+// folded into Registry::exited when the thread exits.
+struct ThreadCounters : public Counters {
+  ThreadCounters() {
+    auto *registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    registry->live.push_back(this);
+  }
+
+  ~ThreadCounters() {
+    auto *registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (int i = 0; i < kNumCounters; ++i) {
+      registry->exited[i] += values[i].load(std::memory_order_relaxed);
+    }
+    registry->live.erase(
+        std::find(registry->live.begin(), registry->live.end(), this));
+  }
+};
+
+Counters *GetCounters() {
+  thread_local static ThreadCounters counters;
+  return &counters;
+}
+#endif  // SPM_NO_THREADLOCAL
+}  // namespace
+
+void Add(Counter counter, uint64 value) {
+#ifdef SPM_NO_THREADLOCAL
+  GetCounters()->values[counter].fetch_add(value, std::memory_order_relaxed);
+#else
+  // No other thread writes these counters, so a plain load and store does.
+  auto &v = GetCounters()->values[counter];
+  v.store(v.load(std::memory_order_relaxed) + value,
+          std::memory_order_relaxed);
+#endif
+}
+#endif  // SPM_ENABLE_STATS
+
+EncodeStats GetStats() {
+  EncodeStats stats;
+#ifdef SPM_ENABLE_STATS
+  uint64 sums[kNumCounters];
+  {
+    auto *registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    std::copy(registry->exited, registry->exited + kNumCounters, sums);
+    for (const auto *counters : registry->live) {
+      for (int i = 0; i < kNumCounters; ++i) {
+        sums[i] += counters->values[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+  stats.enabled = true;
+  stats.num_calls = sums[kNumCalls];
+  stats.normalize_ns = sums[kNormalizeNs];
+  stats.case_encode_ns = sums[kCaseEncodeNs];
+  stats.model_encode_ns = sums[kModelEncodeNs];
+  stats.rle_ns = sums[kRleNs];
+  stats.proto_ns = sums[kProtoNs];
+  stats.bytes_in = sums[kBytesIn];
+  stats.bytes_out = sums[kBytesOut];
+  stats.tokens_out = sums[kTokensOut];
+  stats.lattice_nodes = sums[kLatticeNodes];
+  stats.cache_hits = sums[kCacheHits];
+  stats.cache_misses = sums[kCacheMisses];
+  stats.sample_pruned_mass_ppb = sums[kSamplePrunedMass];
+#endif  // SPM_ENABLE_STATS
+  return stats;
+}
+
+namespace {
+// Hands out the ids of the requests of all tracers.
+std::atomic<uint64> g_next_request_id(1);
+
+// The SplitMix64 finalizer, which spreads consecutive request ids evenly.
+uint64 MixRequestId(uint64 x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+#ifndef SPM_NO_THREADLOCAL
+// The trace of the calling thread and the depth of its nested scopes.
+struct ThreadTrace {
+  ActiveTrace trace;
+  bool active = false;
+  int depth = 0;
+};
+
+ThreadTrace *GetThreadTrace() {
+  thread_local static ThreadTrace thread_trace;
+  return &thread_trace;
+}
+#endif  // SPM_NO_THREADLOCAL
+
+TraceStage StageOf(Counter counter) {
+  switch (counter) {
+    case kNormalizeNs:
+      return TraceStage::kNormalize;
+    case kCaseEncodeNs:
+      return TraceStage::kCaseEncode;
+    case kRleNs:
+      return TraceStage::kRle;
+    case kProtoNs:
+      return TraceStage::kBuildOutput;
+    default:
+      return TraceStage::kSegment;
+  }
+}
+}  // namespace
+
+#ifndef SPM_NO_THREADLOCAL
+ActiveTrace *CurrentTrace() {
+  auto *thread_trace = GetThreadTrace();
+  return thread_trace->active ? &thread_trace->trace : nullptr;
+}
+#endif  // SPM_NO_THREADLOCAL
+
+void ScopedTrace::Begin(Tracer *tracer, size_t input_bytes) {
+#ifndef SPM_NO_THREADLOCAL
+  auto *thread_trace = GetThreadTrace();
+  begun_ = true;
+  if (thread_trace->depth++ > 0) return;
+  const uint64 request_id =
+      g_next_request_id.fetch_add(1, std::memory_order_relaxed);
+  if (!tracer->ShouldTrace(request_id)) return;
+  thread_trace->trace.tracer = tracer;
+  thread_trace->trace.request_id = request_id;
+  thread_trace->trace.input_bytes = input_bytes;
+  thread_trace->active = true;
+#endif  // SPM_NO_THREADLOCAL
+}
+
+void ScopedTrace::End() {
+#ifndef SPM_NO_THREADLOCAL
+  auto *thread_trace = GetThreadTrace();
+  if (--thread_trace->depth == 0) {
+    thread_trace->active = false;
+    thread_trace->trace = ActiveTrace();
+  }
+#endif  // SPM_NO_THREADLOCAL
+}
+
+void PhaseTimer::Report(Counter counter, int64 now, size_t num_tokens) const {
+  Report(StageOf(counter), now, num_tokens);
+}
+
+void PhaseTimer::Report(TraceStage stage, int64 now,
+                        size_t num_tokens) const {
+  TraceEvent event;
+  event.stage = stage;
+  event.request_id = trace_->request_id;
+  event.begin_ns = start_;
+  event.end_ns = now;
+  event.input_bytes = trace_->input_bytes;
+  event.num_tokens = num_tokens;
+  trace_->tracer->OnEvent(event);
+}
+
+}  // namespace stats
+
+const char *TraceStageName(TraceStage stage) {
+  switch (stage) {
+    case TraceStage::kNormalize:
+      return "normalize";
+    case TraceStage::kCaseEncode:
+      return "case_encode";
+    case TraceStage::kSegment:
+      return "segment";
+    case TraceStage::kBuildOutput:
+      return "build_output";
+    case TraceStage::kRle:
+      return "rle";
+    case TraceStage::kDecode:
+      return "decode";
+  }
+  return "unknown";
+}
+
+Tracer::Tracer(double sample_rate) {
+  if (sample_rate >= 1.0) {
+    threshold_ = ~static_cast<uint64>(0);
+  } else if (sample_rate <= 0.0) {
+    threshold_ = 0;
+  } else {
+    threshold_ = static_cast<uint64>(sample_rate * 18446744073709551616.0);
+  }
+}
+
+Tracer::~Tracer() {}
+
+bool Tracer::ShouldTrace(uint64 request_id) const {
+  if (threshold_ == 0) return false;
+  if (threshold_ == ~static_cast<uint64>(0)) return true;
+  return stats::MixRequestId(request_id) < threshold_;
+}
+
+struct ChromeTraceWriter::Rep {
+  struct Event {
+    TraceEvent event;
+    size_t tid;  // small numbers in the order the threads appear.
+  };
+  mutable std::mutex mutex;
+  std::vector<Event> events;
+  std::vector<std::thread::id> threads;
+};
+
+ChromeTraceWriter::ChromeTraceWriter(double sample_rate)
+    : Tracer(sample_rate), rep_(new Rep) {}
+
+ChromeTraceWriter::~ChromeTraceWriter() {}
+
+void ChromeTraceWriter::OnEvent(const TraceEvent &event) {
+  const auto id = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(rep_->mutex);
+  auto it = std::find(rep_->threads.begin(), rep_->threads.end(), id);
+  if (it == rep_->threads.end()) it = rep_->threads.insert(it, id);
+  const size_t tid = it - rep_->threads.begin() + 1;
+  rep_->events.push_back({event, tid});
+}
+
+std::string ChromeTraceWriter::ToJson() const {
+  std::lock_guard<std::mutex> lock(rep_->mutex);
+  std::string output = "{\"traceEvents\":[";
+  for (size_t i = 0; i < rep_->events.size(); ++i) {
+    const auto &e = rep_->events[i];
+    if (i > 0) output += ",";
+    // Complete events take the begin time and the duration in microseconds.
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "{\"name\":\"%s\",\"cat\":\"sentencepiece\",\"ph\":\"X\","
+             "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%llu,"
+             "\"args\":{\"request_id\":%llu,\"input_bytes\":%llu,"
+             "\"num_tokens\":%llu}}",
+             TraceStageName(e.event.stage), e.event.begin_ns / 1000.0,
+             (e.event.end_ns - e.event.begin_ns) / 1000.0,
+             static_cast<unsigned long long>(e.tid),
+             static_cast<unsigned long long>(e.event.request_id),
+             static_cast<unsigned long long>(e.event.input_bytes),
+             static_cast<unsigned long long>(e.event.num_tokens));
+    output += buf;
+  }
+  output += "]}";
+  return output;
+}
+
+util::Status ChromeTraceWriter::WriteFile(absl::string_view filename) const {
+  auto output = filesystem::NewWritableFile(filename);
+  RETURN_IF_ERROR(output->status());
+  CHECK_OR_RETURN(output->Write(ToJson()));
+  return util::OkStatus();
+}
+
+void ChromeTraceWriter::Clear() {
+  std::lock_guard<std::mutex> lock(rep_->mutex);
+  rep_->events.clear();
+  rep_->threads.clear();
+}
+
+}  // namespace sentencepiece
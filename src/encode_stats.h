@@ -0,0 +1,143 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef ENCODE_STATS_H_
+#define ENCODE_STATS_H_
+
+#include <chrono>
+
+#include "common.h"
+#include "sentencepiece_processor.h"
+
+namespace sentencepiece {
+namespace stats {
+
+// The counters of EncodeStats.
+enum Counter {
+  kNumCalls,
+  kNormalizeNs,
+  kCaseEncodeNs,
+  kModelEncodeNs,
+  kRleNs,
+  kProtoNs,
+  kBytesIn,
+  kBytesOut,
+  kTokensOut,
+  kLatticeNodes,
+  kCacheHits,
+  kCacheMisses,
+  kSamplePrunedMass,
+  kNumCounters
+};
+
+#ifdef SPM_ENABLE_STATS
+constexpr bool kStatsEnabled = true;
+
+// Adds |value| to |counter| of the calling thread.
+void Add(Counter counter, uint64 value);
+#else
+// Without SPM_ENABLE_STATS, the counters compile to nothing.
+constexpr bool kStatsEnabled = false;
+
+inline void Add(Counter counter, uint64 value) {}
+#endif  // SPM_ENABLE_STATS
+
+// The request the calling thread is tracing.
+struct ActiveTrace {
+  Tracer *tracer = nullptr;
+  uint64 request_id = 0;
+  size_t input_bytes = 0;
+};
+
+#ifdef SPM_NO_THREADLOCAL
+// Tracing needs thread_local.
+inline ActiveTrace *CurrentTrace() { return nullptr; }
+#else
+// Returns the trace of the calling thread, or nullptr if its current request
+// is not traced.
+ActiveTrace *CurrentTrace();
+#endif
+
+// Makes |tracer| trace the current request of the calling thread while it
+// lives, if |tracer| samples it. A scope within another one does nothing,
+// so that the request is the outermost call.
+class ScopedTrace {
+ public:
+  ScopedTrace(Tracer *tracer, size_t input_bytes) {
+    if (tracer != nullptr) Begin(tracer, input_bytes);
+  }
+
+  ~ScopedTrace() {
+    if (begun_) End();
+  }
+
+  ScopedTrace(const ScopedTrace &) = delete;
+  ScopedTrace &operator=(const ScopedTrace &) = delete;
+
+ private:
+  void Begin(Tracer *tracer, size_t input_bytes);
+  void End();
+
+  bool begun_ = false;
+};
+
+// Returns the time of the steady clock in nanoseconds.
+inline int64 NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Times the consecutive phases of a call. Lap() adds the time since the
+// construction or the previous Lap() to |counter|, reports it to the trace
+// of the calling thread and returns it. The clock is only read when the
+// counters are enabled or the request is traced.
+class PhaseTimer {
+ public:
+  PhaseTimer() : trace_(CurrentTrace()) {
+    if (kStatsEnabled || trace_ != nullptr) start_ = NowNs();
+  }
+
+  uint64 Lap(Counter counter, size_t num_tokens = 0) {
+    if (!kStatsEnabled && trace_ == nullptr) return 0;
+    const int64 now = NowNs();
+    const uint64 ns = now - start_;
+    Add(counter, ns);
+    if (trace_ != nullptr) Report(counter, now, num_tokens);
+    start_ = now;
+    return ns;
+  }
+
+  // Same as above, but only reports the phase to the trace as |stage|.
+  void Lap(TraceStage stage, size_t num_tokens = 0) {
+    if (trace_ == nullptr) return;
+    const int64 now = NowNs();
+    Report(stage, now, num_tokens);
+    start_ = now;
+  }
+
+ private:
+  void Report(Counter counter, int64 now, size_t num_tokens) const;
+  void Report(TraceStage stage, int64 now, size_t num_tokens) const;
+
+  ActiveTrace *trace_;
+  int64 start_ = 0;
+};
+
+// Returns the sums of the counters of all threads.
+EncodeStats GetStats();
+
+}  // namespace stats
+}  // namespace sentencepiece
+#endif  // ENCODE_STATS_H_
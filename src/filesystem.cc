@@ -12,18 +12,39 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include "filesystem.h"
 #include "third_party/absl/memory/memory.h"
 #include "util.h"
 
+#ifdef SPM_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef SPM_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
 #if defined(OS_WIN) && defined(UNICODE) && defined(_UNICODE)
 #define WPATH(path) (::sentencepiece::win32::Utf8ToWide(path).c_str())
 #else
 #define WPATH(path) (path)
 #endif
 
+#ifndef OS_WIN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPM_HAVE_MMAP
+#endif
+
 namespace sentencepiece {
 namespace filesystem {
 
@@ -50,6 +71,13 @@ class PosixReadableFile : public ReadableFile {
     return static_cast<bool>(std::getline(*is_, *line));
   }
 
+  bool Read(size_t size, std::string *data) {
+    data->resize(size);
+    return size == 0 ||
+           (is_->read(&(*data)[0], size) &&
+            static_cast<size_t>(is_->gcount()) == size);
+  }
+
   bool ReadAll(std::string *line) {
     if (is_ == &std::cin) {
       LOG(ERROR) << "ReadAll is not supported for stdin.";
@@ -65,6 +93,408 @@ class PosixReadableFile : public ReadableFile {
   std::istream *is_;
 };
 
+#ifdef SPM_HAVE_MMAP
+// Reads a regular file through a read-only memory mapping. Lines are
+// returned as views into the mapping, with the same splitting as
+// std::getline.
+class MmapReadableFile : public ReadableFile {
+ public:
+  // Returns nullptr if |filename| cannot be mapped, e.g., it is not a
+  // regular file or it is empty.
+  static std::unique_ptr<MmapReadableFile> Open(absl::string_view filename) {
+    const int fd = ::open(std::string(filename).c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED) return nullptr;
+#ifdef MADV_SEQUENTIAL
+    ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+    return std::unique_ptr<MmapReadableFile>(new MmapReadableFile(
+        static_cast<const char *>(data), static_cast<size_t>(st.st_size)));
+  }
+
+  ~MmapReadableFile() {
+    ::munmap(const_cast<char *>(data_), size_);
+  }
+
+  util::Status status() const { return util::OkStatus(); }
+
+  bool ReadLine(std::string *line) {
+    absl::string_view view;
+    if (!ReadLineView(&view)) return false;
+    line->assign(view.data(), view.size());
+    return true;
+  }
+
+  bool ReadLineView(absl::string_view *line) {
+    if (pos_ == size_) return false;
+    const char *begin = data_ + pos_;
+    const char *end =
+        static_cast<const char *>(std::memchr(begin, '\n', size_ - pos_));
+    if (end == nullptr) {
+      *line = absl::string_view(begin, size_ - pos_);
+      pos_ = size_;
+    } else {
+      *line = absl::string_view(begin, end - begin);
+      pos_ += line->size() + 1;
+    }
+    return true;
+  }
+
+  bool Read(size_t size, std::string *data) {
+    if (size > size_ - pos_) return false;
+    data->assign(data_ + pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+  bool ReadAll(std::string *line) {
+    line->assign(data_ + pos_, size_ - pos_);
+    pos_ = size_;
+    return true;
+  }
+
+  bool ReadAllView(absl::string_view *data) {
+    *data = absl::string_view(data_ + pos_, size_ - pos_);
+    pos_ = size_;
+    return true;
+  }
+
+ private:
+  MmapReadableFile(const char *data, size_t size) : data_(data), size_(size) {}
+
+  const char *data_ = nullptr;
+  const size_t size_ = 0;
+  size_t pos_ = 0;
+};
+#endif  // SPM_HAVE_MMAP
+
+// Decompresses a stream given block by block.
+class Decompressor {
+ public:
+  virtual ~Decompressor() {}
+
+  // Appends the bytes decompressed from |input| to |output|.
+  virtual util::Status Decompress(absl::string_view input,
+                                  std::string *output) = 0;
+
+  // Returns an error if the stream ends in the middle of a frame.
+  virtual util::Status Finish() = 0;
+};
+
+// The size of the output buffer grown by the decompressors at a time.
+constexpr size_t kDecompressChunkSize = 1 << 16;
+
+#ifdef SPM_ENABLE_ZLIB
+// Decompresses gzip and zlib streams. Concatenated gzip members, as
+// written by parallel compressors, are read as one stream.
+class GzipDecompressor : public Decompressor {
+ public:
+  GzipDecompressor() {
+    std::memset(&stream_, 0, sizeof(stream_));
+    // 32 detects the gzip or zlib header.
+    if (inflateInit2(&stream_, 15 + 32) != Z_OK) {
+      status_ = util::InternalError("inflateInit2 failed.");
+    }
+  }
+
+  ~GzipDecompressor() { inflateEnd(&stream_); }
+
+  util::Status Decompress(absl::string_view input, std::string *output) {
+    RETURN_IF_ERROR(status_);
+    stream_.next_in =
+        reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream_.avail_in = static_cast<uInt>(input.size());
+    while (true) {
+      if (ended_) {
+        if (stream_.avail_in == 0) break;
+        inflateReset(&stream_);
+        ended_ = false;
+      }
+      const size_t offset = output->size();
+      output->resize(offset + kDecompressChunkSize);
+      stream_.next_out = reinterpret_cast<Bytef *>(&(*output)[offset]);
+      stream_.avail_out = kDecompressChunkSize;
+      const int ret = inflate(&stream_, Z_NO_FLUSH);
+      const bool full = stream_.avail_out == 0;
+      output->resize(offset + kDecompressChunkSize - stream_.avail_out);
+      if (ret == Z_STREAM_END) {
+        ended_ = true;
+      } else if (ret == Z_BUF_ERROR) {
+        break;  // needs more input.
+      } else if (ret != Z_OK) {
+        status_ = util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+                  << "gzip: "
+                  << (stream_.msg != nullptr ? stream_.msg : "broken data");
+        return status_;
+      } else if (stream_.avail_in == 0 && !full) {
+        break;
+      }
+    }
+    return util::OkStatus();
+  }
+
+  util::Status Finish() {
+    RETURN_IF_ERROR(status_);
+    if (!ended_) return util::DataLossError("gzip: unexpected end of file.");
+    return util::OkStatus();
+  }
+
+ private:
+  util::Status status_;
+  z_stream stream_;
+  bool ended_ = false;
+};
+#endif  // SPM_ENABLE_ZLIB
+
+#ifdef SPM_ENABLE_ZSTD
+// Decompresses zstd streams of one or more frames.
+class ZstdDecompressor : public Decompressor {
+ public:
+  ZstdDecompressor() : context_(ZSTD_createDCtx()) {}
+  ~ZstdDecompressor() { ZSTD_freeDCtx(context_); }
+
+  util::Status Decompress(absl::string_view input, std::string *output) {
+    ZSTD_inBuffer in = {input.data(), input.size(), 0};
+    bool full = false;
+    while (in.pos < in.size || full) {
+      const size_t offset = output->size();
+      output->resize(offset + kDecompressChunkSize);
+      ZSTD_outBuffer out = {&(*output)[offset], kDecompressChunkSize, 0};
+      const size_t ret = ZSTD_decompressStream(context_, &out, &in);
+      output->resize(offset + out.pos);
+      if (ZSTD_isError(ret)) {
+        return util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+               << "zstd: " << ZSTD_getErrorName(ret);
+      }
+      full = out.pos == out.size;
+      remaining_ = ret;
+    }
+    return util::OkStatus();
+  }
+
+  util::Status Finish() {
+    if (remaining_ != 0) {
+      return util::DataLossError("zstd: unexpected end of file.");
+    }
+    return util::OkStatus();
+  }
+
+ private:
+  ZSTD_DCtx *context_ = nullptr;
+  size_t remaining_ = 0;  // 0 at the end of a frame.
+};
+#endif  // SPM_ENABLE_ZSTD
+
+// Reads a compressed file. A thread reads and decompresses the file into a
+// bounded queue of blocks, while the caller splits the blocks into lines.
+// Lines within a block are returned as views into the block.
+class DecompressingReadableFile : public ReadableFile {
+ public:
+  DecompressingReadableFile(absl::string_view filename,
+                            std::unique_ptr<Decompressor> decompressor)
+      : is_(WPATH(filename.data()), std::ios::binary | std::ios::in),
+        decompressor_(std::move(decompressor)) {
+    if (!is_) {
+      status_ = util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
+                << "\"" << filename.data() << "\": " << util::StrError(errno);
+      done_ = true;
+      return;
+    }
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  ~DecompressingReadableFile() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  util::Status status() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return status_;
+  }
+
+  bool ReadLine(std::string *line) {
+    absl::string_view view;
+    if (!ReadLineView(&view)) return false;
+    line->assign(view.data(), view.size());
+    return true;
+  }
+
+  bool ReadLineView(absl::string_view *line) {
+    bool partial = false;
+    while (true) {
+      if (pos_ == block_.size() && !NextBlock()) {
+        if (!partial) return false;
+        *line = line_;
+        return true;
+      }
+      const char *begin = block_.data() + pos_;
+      const size_t size = block_.size() - pos_;
+      const char *end = static_cast<const char *>(std::memchr(begin, '\n', size));
+      if (end == nullptr) {
+        // The line continues in the next block.
+        if (!partial) line_.clear();
+        line_.append(begin, size);
+        partial = true;
+        pos_ = block_.size();
+        continue;
+      }
+      if (partial) {
+        line_.append(begin, end - begin);
+        *line = line_;
+      } else {
+        *line = absl::string_view(begin, end - begin);
+      }
+      pos_ += end - begin + 1;
+      return true;
+    }
+  }
+
+  bool Read(size_t size, std::string *data) {
+    data->clear();
+    while (data->size() < size) {
+      if (pos_ == block_.size() && !NextBlock()) return false;
+      const size_t n = std::min(size - data->size(), block_.size() - pos_);
+      data->append(block_, pos_, n);
+      pos_ += n;
+    }
+    return true;
+  }
+
+  bool ReadAll(std::string *line) {
+    line->assign(block_, pos_, std::string::npos);
+    pos_ = block_.size();
+    while (NextBlock()) {
+      line->append(block_);
+      pos_ = block_.size();
+    }
+    return status().ok();
+  }
+
+ private:
+  static constexpr size_t kInputBlockSize = 1 << 18;
+  static constexpr size_t kMaxQueueSize = 4;
+
+  // Moves the next decompressed block to block_. Returns false at the end
+  // of the file or on an error.
+  bool NextBlock() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return done_ || !queue_.empty(); });
+    if (queue_.empty()) return false;
+    block_.swap(queue_.front());
+    queue_.pop_front();
+    pos_ = 0;
+    lock.unlock();
+    cv_.notify_all();
+    return true;
+  }
+
+  void Run() {
+    std::string input(kInputBlockSize, '\0');
+    util::Status status;
+    while (status.ok()) {
+      is_.read(&input[0], input.size());
+      const size_t size = is_.gcount();
+      if (size == 0) break;
+      std::string block;
+      status = decompressor_->Decompress(absl::string_view(input.data(), size),
+                                         &block);
+      if (block.empty()) continue;
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || queue_.size() < kMaxQueueSize; });
+      if (stop_) return;
+      queue_.push_back(std::move(block));
+      lock.unlock();
+      cv_.notify_all();
+    }
+    if (status.ok() && is_.bad()) {
+      status = util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+               << util::StrError(errno);
+    }
+    if (status.ok()) status = decompressor_->Finish();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      status_ = status;
+      done_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  std::ifstream is_;
+  std::unique_ptr<Decompressor> decompressor_;
+
+  // Owned by the caller.
+  std::string block_;
+  size_t pos_ = 0;
+  std::string line_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::string> queue_;
+  util::Status status_;
+  bool done_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// A file which cannot be read, with the reason in status().
+class UnreadableFile : public ReadableFile {
+ public:
+  explicit UnreadableFile(util::Status status) : status_(std::move(status)) {}
+
+  util::Status status() const { return status_; }
+  bool ReadLine(std::string *line) { return false; }
+  bool ReadAll(std::string *line) { return false; }
+
+ private:
+  const util::Status status_;
+};
+
+// Returns a reader of |filename| if it starts with the magic bytes of a
+// supported compression format, or nullptr otherwise.
+std::unique_ptr<ReadableFile> NewDecompressingReadableFile(
+    absl::string_view filename) {
+  char magic[4] = {};
+  {
+    std::ifstream is(WPATH(filename.data()), std::ios::binary | std::ios::in);
+    if (!is.read(magic, sizeof(magic))) return nullptr;
+  }
+  std::unique_ptr<Decompressor> decompressor;
+  const char *format = nullptr;
+  if (std::memcmp(magic, "\x1f\x8b", 2) == 0) {
+    format = "gzip";
+#ifdef SPM_ENABLE_ZLIB
+    decompressor = absl::make_unique<GzipDecompressor>();
+#endif
+  } else if (std::memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+    format = "zstd";
+#ifdef SPM_ENABLE_ZSTD
+    decompressor = absl::make_unique<ZstdDecompressor>();
+#endif
+  } else {
+    return nullptr;
+  }
+  if (decompressor == nullptr) {
+    // Fails instead of reading the compressed bytes as text.
+    return absl::make_unique<UnreadableFile>(
+        util::StatusBuilder(util::StatusCode::kUnimplemented, GTL_LOC)
+        << "\"" << filename.data() << "\" is compressed with " << format
+        << ", which is not supported by this build.");
+  }
+  return absl::make_unique<DecompressingReadableFile>(filename,
+                                                      std::move(decompressor));
+}
+
 class PosixWritableFile : public WritableFile {
  public:
   PosixWritableFile(absl::string_view filename, bool is_binary = false)
@@ -92,16 +522,132 @@ class PosixWritableFile : public WritableFile {
 
   bool WriteLine(absl::string_view text) { return Write(text) && Write("\n"); }
 
+  bool Flush() {
+    os_->flush();
+    return os_->good();
+  }
+
  private:
   util::Status status_;
   std::ostream *os_;
 };
 
+// Collects the writes in a buffer of kBufferSize bytes and writes the full
+// buffers to |file| on a dedicated thread. A writer only waits when the
+// previous buffer is still being written.
+class BufferedWritableFile : public WritableFile {
+ public:
+  explicit BufferedWritableFile(std::unique_ptr<WritableFile> file)
+      : file_(std::move(file)) {
+    status_ = file_->status();
+    if (!status_.ok()) return;
+    buffer_.reserve(kBufferSize + kBufferSize / 4);
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  ~BufferedWritableFile() {
+    if (!thread_.joinable()) return;
+    Submit(true);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  util::Status status() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return status_;
+  }
+
+  bool Write(absl::string_view text) {
+    buffer_.append(text.data(), text.size());
+    return buffer_.size() < kBufferSize ? ok() : Submit(false);
+  }
+
+  bool WriteLine(absl::string_view text) {
+    buffer_.append(text.data(), text.size());
+    buffer_ += '\n';
+    return buffer_.size() < kBufferSize ? ok() : Submit(false);
+  }
+
+  // Waits until all the writes so far are written and flushed to the file.
+  bool Flush() { return thread_.joinable() && Submit(true); }
+
+ private:
+  static constexpr size_t kBufferSize = 1 << 22;
+
+  bool ok() const { return status().ok(); }
+
+  // Hands buffer_ to the thread, and waits until it is written when |flush|.
+  bool Submit(bool flush) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!thread_.joinable()) return false;
+    cv_.wait(lock, [this]() { return !pending_; });
+    if (status_.ok() && (flush || !buffer_.empty())) {
+      back_.swap(buffer_);
+      pending_ = true;
+      flush_ = flush;
+      cv_.notify_all();
+    }
+    buffer_.clear();
+    if (flush) cv_.wait(lock, [this]() { return !pending_; });
+    return status_.ok();
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return pending_ || stop_; });
+      if (!pending_) return;
+      const bool flush = flush_;
+      lock.unlock();
+      // back_ is not touched by the writer while pending_ is set.
+      const bool ok = file_->Write(back_) && (!flush || file_->Flush());
+      util::Status status;
+      if (!ok) {
+        status = util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+                 << "Failed to write: " << util::StrError(errno);
+      }
+      back_.clear();
+      lock.lock();
+      if (!ok) status_ = status;
+      pending_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  const std::unique_ptr<WritableFile> file_;
+
+  // Filled by the writer.
+  std::string buffer_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::string back_;  // written by the thread while pending_ is set.
+  bool pending_ = false;
+  bool flush_ = false;
+  bool stop_ = false;
+  util::Status status_;
+  std::thread thread_;
+};
+
 using DefaultReadableFile = PosixReadableFile;
 using DefaultWritableFile = PosixWritableFile;
 
 std::unique_ptr<ReadableFile> NewReadableFile(absl::string_view filename,
                                               bool is_binary) {
+  if (!filename.empty() && !is_binary) {
+    auto file = NewDecompressingReadableFile(filename);
+    if (file) return file;
+  }
+#ifdef SPM_HAVE_MMAP
+  if (!filename.empty()) {
+    auto file = MmapReadableFile::Open(filename);
+    if (file) return file;
+  }
+#endif
   return absl::make_unique<DefaultReadableFile>(filename, is_binary);
 }
 
@@ -110,5 +656,44 @@ std::unique_ptr<WritableFile> NewWritableFile(absl::string_view filename,
   return absl::make_unique<DefaultWritableFile>(filename, is_binary);
 }
 
+std::unique_ptr<WritableFile> NewBufferedWritableFile(
+    absl::string_view filename, bool is_binary) {
+  return absl::make_unique<BufferedWritableFile>(
+      NewWritableFile(filename, is_binary));
+}
+
+util::Status PrefaultMemory(absl::string_view data, bool lock) {
+  if (data.empty()) return util::OkStatus();
+#ifdef SPM_HAVE_MMAP
+  const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+#else
+  const size_t page_size = 4096;
+#endif
+#if defined(SPM_HAVE_MMAP) && defined(MADV_WILLNEED)
+  // madvise() needs an address aligned to a page.
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(data.data()) &
+                          ~static_cast<uintptr_t>(page_size - 1);
+  const size_t length =
+      reinterpret_cast<uintptr_t>(data.data()) + data.size() - begin;
+  ::madvise(reinterpret_cast<void *>(begin), length, MADV_WILLNEED);
+#endif
+  // The pages of a mapping are only read in when touched.
+  unsigned char sum = data.back();
+  for (size_t i = 0; i < data.size(); i += page_size) sum += data[i];
+  volatile unsigned char sink = sum;
+  (void)sink;
+  if (!lock) return util::OkStatus();
+#ifdef SPM_HAVE_MMAP
+  if (::mlock(data.data(), data.size()) != 0) {
+    return util::StatusBuilder(util::StatusCode::kPermissionDenied, GTL_LOC)
+           << "mlock() failed: " << util::StrError(errno)
+           << ". Raise RLIMIT_MEMLOCK (ulimit -l).";
+  }
+  return util::OkStatus();
+#else
+  return util::UnimplementedError("Locking memory is not supported.");
+#endif
+}
+
 }  // namespace filesystem
 }  // namespace sentencepiece
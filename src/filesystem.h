@@ -36,6 +36,30 @@ class ReadableFile {
   virtual util::Status status() const = 0;
   virtual bool ReadLine(std::string *line) = 0;
   virtual bool ReadAll(std::string *line) = 0;
+
+  // Reads exactly |size| bytes into |data|. Returns false at the end of
+  // the file or if fewer bytes are left.
+  virtual bool Read(size_t size, std::string *data) { return false; }
+
+  // Reads a line without copying it when the file is memory-mapped.
+  // |line| is valid until the next read or the destruction of this file.
+  virtual bool ReadLineView(absl::string_view *line) {
+    if (!ReadLine(&buffer_)) return false;
+    *line = buffer_;
+    return true;
+  }
+
+  // Reads the rest of the file without copying it when the file is
+  // memory-mapped. |data| is valid until the next read or the destruction
+  // of this file.
+  virtual bool ReadAllView(absl::string_view *data) {
+    if (!ReadAll(&buffer_)) return false;
+    *data = buffer_;
+    return true;
+  }
+
+ private:
+  std::string buffer_;
 };
 
 class WritableFile {
@@ -47,13 +71,32 @@ class WritableFile {
   virtual util::Status status() const = 0;
   virtual bool Write(absl::string_view text) = 0;
   virtual bool WriteLine(absl::string_view text) = 0;
+
+  // Pushes the buffered text to the file.
+  virtual bool Flush() { return true; }
 };
 
+// Regular files are memory-mapped where mmap is available. stdin (empty
+// |filename|), pipes and other files are read with std::istream. Text files
+// compressed with gzip or zstd, detected by their magic bytes, are
+// decompressed on a background thread when the build has zlib or libzstd.
 std::unique_ptr<ReadableFile> NewReadableFile(absl::string_view filename,
                                               bool is_binary = false);
 std::unique_ptr<WritableFile> NewWritableFile(absl::string_view filename,
                                               bool is_binary = false);
 
+// Returns a file whose writes are collected in a large buffer and written by
+// a dedicated thread, for the output of the command line tools. The writes
+// may only reach the file at Flush() or the destruction of the file, and
+// write errors are reported by a later Write(), Flush() or status().
+std::unique_ptr<WritableFile> NewBufferedWritableFile(
+    absl::string_view filename, bool is_binary = false);
+
+// Reads every page of `data`, e.g., a memory-mapped file, so that its pages
+// are resident before they are used. With `lock`, also locks them in memory
+// with mlock(), which fails without the permission to lock that much memory.
+util::Status PrefaultMemory(absl::string_view data, bool lock);
+
 }  // namespace filesystem
 }  // namespace sentencepiece
 #endif  // FILESYSTEM_H_
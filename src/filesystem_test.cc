@@ -17,7 +17,106 @@
 #include "third_party/absl/strings/str_cat.h"
 #include "util.h"
 
+#ifdef SPM_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef SPM_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
 namespace sentencepiece {
+namespace {
+
+#if defined(SPM_ENABLE_ZLIB) || defined(SPM_ENABLE_ZSTD)
+// Returns lines across several decompressed blocks, without a newline at
+// the end.
+std::string MakeLongText() {
+  std::string text;
+  for (int i = 0; i < 100000; ++i) {
+    text += "line " + std::to_string(i) + std::string(i % 37, 'x') + "\n";
+    if (i % 1000 == 0) text += "\n";
+  }
+  text += "last";
+  return text;
+}
+
+// Reads |filename| with all the readers and compares it with |text|.
+void ExpectText(const std::string &filename, const std::string &text) {
+  std::vector<std::string> expected(1);
+  for (const char c : text) {
+    if (c == '\n') {
+      expected.emplace_back();
+    } else {
+      expected.back() += c;
+    }
+  }
+
+  std::vector<std::string> lines;
+  std::string line;
+  auto input = filesystem::NewReadableFile(filename);
+  EXPECT_OK(input->status());
+  while (input->ReadLine(&line)) lines.push_back(line);
+  EXPECT_OK(input->status());
+  EXPECT_TRUE(expected == lines);
+
+  lines.clear();
+  absl::string_view view;
+  input = filesystem::NewReadableFile(filename);
+  while (input->ReadLineView(&view)) lines.emplace_back(view);
+  EXPECT_TRUE(expected == lines);
+
+  input = filesystem::NewReadableFile(filename);
+  EXPECT_TRUE(input->ReadLine(&line));
+  EXPECT_TRUE(input->ReadAll(&line));
+  EXPECT_TRUE(text.substr(text.find('\n') + 1) == line);
+}
+
+// Expects an error after reading the first half of |compressed|.
+void ExpectTruncatedError(const std::string &filename,
+                          const std::string &compressed) {
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(compressed.substr(0, compressed.size() / 2));
+  }
+  auto input = filesystem::NewReadableFile(filename);
+  absl::string_view line;
+  while (input->ReadLineView(&line)) {
+  }
+  EXPECT_FALSE(input->status().ok());
+}
+#endif
+
+#ifdef SPM_ENABLE_ZLIB
+std::string GzipCompress(absl::string_view input) {
+  z_stream stream;
+  std::memset(&stream, 0, sizeof(stream));
+  // 16 writes the gzip header.
+  EXPECT_EQ(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                               15 + 16, 8, Z_DEFAULT_STRATEGY));
+  std::string output(deflateBound(&stream, input.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef *>(&output[0]);
+  stream.avail_out = output.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+  output.resize(stream.total_out);
+  deflateEnd(&stream);
+  return output;
+}
+#endif
+
+#ifdef SPM_ENABLE_ZSTD
+std::string ZstdCompress(absl::string_view input) {
+  std::string output(ZSTD_compressBound(input.size()), '\0');
+  const size_t size =
+      ZSTD_compress(&output[0], output.size(), input.data(), input.size(), 3);
+  EXPECT_FALSE(ZSTD_isError(size));
+  output.resize(size);
+  return output;
+}
+#endif
+}  // namespace
 
 TEST(UtilTest, FilesystemTest) {
   const std::vector<std::string> kData = {
@@ -46,6 +145,128 @@ TEST(UtilTest, FilesystemTest) {
   }
 }
 
+TEST(UtilTest, FilesystemReadLineViewTest) {
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "test_file_view");
+  const std::vector<std::pair<std::string, std::vector<std::string>>> kData =
+      {{"", {}},
+       {"\n", {""}},
+       {"a", {"a"}},
+       {"a\n", {"a"}},
+       {"a\n\nbc\r\nd", {"a", "", "bc\r", "d"}}};
+
+  for (const auto &data : kData) {
+    {
+      auto output = filesystem::NewWritableFile(filename, true);
+      output->Write(data.first);
+    }
+
+    // std::getline and the zero-copy reader split lines in the same way.
+    std::vector<std::string> lines;
+    std::string line;
+    auto input = filesystem::NewReadableFile(filename);
+    EXPECT_OK(input->status());
+    while (input->ReadLine(&line)) lines.push_back(line);
+    EXPECT_EQ(data.second, lines);
+
+    lines.clear();
+    absl::string_view view;
+    input = filesystem::NewReadableFile(filename);
+    while (input->ReadLineView(&view)) lines.emplace_back(view);
+    EXPECT_EQ(data.second, lines);
+
+    input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&line));
+    EXPECT_EQ(data.first, line);
+
+    // Reads the same bytes in blocks of two.
+    std::string all, block;
+    input = filesystem::NewReadableFile(filename, true);
+    while (input->Read(2, &block)) all += block;
+    EXPECT_EQ(data.first.substr(0, data.first.size() / 2 * 2), all);
+  }
+}
+
+#ifdef SPM_ENABLE_ZLIB
+TEST(UtilTest, FilesystemGzipTest) {
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "test_file.gz");
+  const std::string text = MakeLongText();
+
+  // Two members, as written by parallel compressors.
+  const size_t half = text.size() / 2;
+  const std::string compressed =
+      GzipCompress(text.substr(0, half)) + GzipCompress(text.substr(half));
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(compressed);
+  }
+  ExpectText(filename, text);
+
+  // Binary reads return the compressed bytes.
+  std::string data;
+  auto input = filesystem::NewReadableFile(filename, true);
+  EXPECT_TRUE(input->ReadAll(&data));
+  EXPECT_TRUE(compressed == data);
+
+  ExpectTruncatedError(filename, compressed);
+}
+#endif  // SPM_ENABLE_ZLIB
+
+#ifdef SPM_ENABLE_ZSTD
+TEST(UtilTest, FilesystemZstdTest) {
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "test_file.zst");
+  const std::string text = MakeLongText();
+
+  // Two frames.
+  const size_t half = text.size() / 2;
+  const std::string compressed =
+      ZstdCompress(text.substr(0, half)) + ZstdCompress(text.substr(half));
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(compressed);
+  }
+  ExpectText(filename, text);
+  ExpectTruncatedError(filename, compressed);
+}
+#endif  // SPM_ENABLE_ZSTD
+
+TEST(UtilTest, FilesystemBufferedWritableFileTest) {
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "test_file_buffered");
+  // More than one buffer of lines.
+  std::string expected;
+  {
+    auto output = filesystem::NewBufferedWritableFile(filename);
+    EXPECT_OK(output->status());
+    for (int i = 0; i < 500000; ++i) {
+      const std::string line = "line " + std::to_string(i);
+      EXPECT_TRUE(i % 2 == 0 ? output->WriteLine(line)
+                             : output->Write(line + "\n"));
+      expected += line + "\n";
+    }
+    EXPECT_TRUE(output->Flush());
+
+    // Flushed writes can be read while the file is open.
+    std::string data;
+    EXPECT_TRUE(filesystem::NewReadableFile(filename, true)->ReadAll(&data));
+    EXPECT_TRUE(expected == data);
+
+    EXPECT_TRUE(output->Write("tail"));
+  }
+  // The rest is written when the file is destroyed.
+  std::string data;
+  EXPECT_TRUE(filesystem::NewReadableFile(filename, true)->ReadAll(&data));
+  EXPECT_TRUE(expected + "tail" == data);
+
+  auto output = filesystem::NewBufferedWritableFile(
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "__UNKNOWN__", "f"));
+  EXPECT_FALSE(output->status().ok());
+  EXPECT_FALSE(output->Write("a"));
+  EXPECT_FALSE(output->Flush());
+}
+
 TEST(UtilTest, FilesystemInvalidFileTest) {
   auto input = filesystem::NewReadableFile("__UNKNOWN__FILE__");
   EXPECT_FALSE(input->status().ok());
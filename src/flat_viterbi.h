@@ -0,0 +1,152 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef FLAT_VITERBI_H_
+#define FLAT_VITERBI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The Viterbi of unigram::Model::EncodeOptimized() over plain arrays, which
+// the batch encoder runs for whole batches on the CPU threads.
+
+namespace sentencepiece {
+
+// The kinds of the pieces in FlatViterbiTables::kinds.
+enum FlatPieceKind : uint8_t {
+  kFlatNormal = 0,
+  kFlatUserDefined = 1,  // scored as length * max_score - 0.1.
+  kFlatUnused = 2,       // never emitted.
+};
+
+// The read-only tables of a unigram model.
+struct FlatViterbiTables {
+  const uint32_t *trie = nullptr;  // units of the double-array trie.
+  const float *scores = nullptr;   // by piece id.
+  const uint8_t *kinds = nullptr;  // FlatPieceKind by piece id.
+  int unk_id = 0;
+  float unk_score = 0.0;  // of an unknown character.
+  float max_score = 0.0;
+  int max_piece_size = 0;  // in bytes.
+};
+
+// The best path ending at a byte position.
+struct FlatBestPath {
+  float score;
+  int starts_at;  // of the last piece, or -1 if no path ends here.
+  int id;         // of the last piece.
+};
+
+// Returns the offset of the children of the trie unit |unit|.
+inline uint32_t FlatTrieOffset(uint32_t unit) {
+  return (unit >> 10) << ((unit & (1U << 9)) >> 6);
+}
+
+// Follows the transition labeled |c| from the trie unit |*node|. Returns
+// false if there is none. Same as one step of Darts::DoubleArray::traverse().
+inline bool FlatTrieNext(const uint32_t *trie, uint32_t *node,
+                         unsigned char c) {
+  const uint32_t next = *node ^ FlatTrieOffset(trie[*node]) ^ c;
+  if ((trie[next] & ((1U << 31) | 0xFF)) != c) return false;
+  *node = next;
+  return true;
+}
+
+// Returns the value of the key ending at the trie unit |node|, or -1.
+inline int FlatTrieValue(const uint32_t *trie, uint32_t node) {
+  const uint32_t unit = trie[node];
+  if (((unit >> 8) & 1) == 0) return -1;
+  return static_cast<int>(trie[node ^ FlatTrieOffset(unit)] &
+                          ((1U << 31) - 1));
+}
+
+// Segments the |size| bytes of |text| with the scratch |paths| of size + 1
+// elements. Writes the ids and the byte lengths of the pieces to |ids| and
+// |lengths|, which have room for |size| pieces, and returns their number.
+// The scores are added as in EncodeOptimized(), in double precision except
+// for unknown characters, so that ties break the same way.
+inline int FlatViterbi(const FlatViterbiTables &tables, const char *text,
+                       int size, FlatBestPath *paths, int *ids, int *lengths) {
+  if (size <= 0) return 0;
+  for (int i = 0; i <= size; ++i) {
+    paths[i].score = 0.0;
+    paths[i].starts_at = -1;
+    paths[i].id = -1;
+  }
+  for (int starts_at = 0; starts_at < size;) {
+    const float score_till_here = paths[starts_at].score;
+    const unsigned char lead = static_cast<unsigned char>(text[starts_at]);
+    int mblen = lead < 0xC0 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+    if (mblen > size - starts_at) mblen = size - starts_at;
+    const int key_end = size - starts_at < tables.max_piece_size
+                            ? size
+                            : starts_at + tables.max_piece_size;
+    bool has_single_node = false;
+    uint32_t node = 0;
+    for (int key_pos = starts_at; key_pos < key_end;) {
+      if (!FlatTrieNext(tables.trie, &node,
+                        static_cast<unsigned char>(text[key_pos]))) {
+        break;
+      }
+      ++key_pos;
+      const int id = FlatTrieValue(tables.trie, node);
+      if (id < 0 || tables.kinds[id] == kFlatUnused) continue;
+      const int length = key_pos - starts_at;
+      const double score =
+          tables.kinds[id] == kFlatUserDefined
+              ? static_cast<float>(length) * tables.max_score - 0.1
+              : tables.scores[id];
+      const double candidate = score + score_till_here;
+      FlatBestPath &target = paths[key_pos];
+      if (target.starts_at == -1 || candidate > target.score) {
+        target.score = static_cast<float>(candidate);
+        target.starts_at = starts_at;
+        target.id = id;
+      }
+      if (length == mblen) has_single_node = true;
+    }
+    if (!has_single_node) {
+      FlatBestPath &target = paths[starts_at + mblen];
+      const float candidate = tables.unk_score + score_till_here;
+      if (target.starts_at == -1 || candidate > target.score) {
+        target.score = candidate;
+        target.starts_at = starts_at;
+        target.id = tables.unk_id;
+      }
+    }
+    starts_at += mblen;
+  }
+
+  // Backtracks, then reverses the pieces.
+  int num_pieces = 0;
+  for (int ends_at = size; ends_at > 0;) {
+    const FlatBestPath &path = paths[ends_at];
+    ids[num_pieces] = path.id;
+    lengths[num_pieces] = ends_at - path.starts_at;
+    ++num_pieces;
+    ends_at = path.starts_at;
+  }
+  for (int i = 0, j = num_pieces - 1; i < j; ++i, --j) {
+    const int id = ids[i];
+    ids[i] = ids[j];
+    ids[j] = id;
+    const int length = lengths[i];
+    lengths[i] = lengths[j];
+    lengths[j] = length;
+  }
+  return num_pieces;
+}
+
+}  // namespace sentencepiece
+#endif  // FLAT_VITERBI_H_
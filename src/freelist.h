@@ -15,8 +15,8 @@
 #ifndef FREELIST_H_
 #define FREELIST_H_
 
-#include <string.h>
-
+#include <algorithm>
+#include <cstddef>
 #include <vector>
 
 namespace sentencepiece {
@@ -27,17 +27,23 @@ template <class T>
 class FreeList {
  public:
   FreeList() = delete;
-  explicit FreeList(size_t chunk_size) : chunk_size_(chunk_size) {}
+  // With `lazy_clear`, an element is value-initialized when it is allocated
+  // and Free() only resets the indices, so that Free() is O(1) regardless of
+  // how many elements were used before. Otherwise Free() clears the used
+  // chunks.
+  explicit FreeList(size_t chunk_size, bool lazy_clear = false)
+      : chunk_size_(chunk_size), lazy_clear_(lazy_clear) {}
   virtual ~FreeList() {
     for (auto& chunk : freelist_) delete[] chunk;
   }
 
   // `Free` doesn't free the object but reuse the allocated memory chunks.
   void Free() {
-    const int size = std::min<int>(chunk_index_ + 1, freelist_.size());
-    for (int i = 0; i < size; ++i) {
-      T* chunk = freelist_[i];
-      memset(static_cast<void*>(chunk), 0, sizeof(*chunk) * chunk_size_);
+    if (!lazy_clear_) {
+      const size_t size = std::min(chunk_index_ + 1, freelist_.size());
+      for (size_t i = 0; i < size; ++i) {
+        std::fill(freelist_[i], freelist_[i] + chunk_size_, T());
+      }
     }
     chunk_index_ = 0;
     element_index_ = 0;
@@ -46,6 +52,10 @@ class FreeList {
   // Returns the number of allocated elements.
   size_t size() const { return chunk_size_ * chunk_index_ + element_index_; }
 
+  // Returns the number of elements the allocated chunks hold, including the
+  // ones Free() made available again.
+  size_t capacity() const { return chunk_size_ * freelist_.size(); }
+
   // Returns the element as an array.
   T* operator[](size_t index) const {
     return freelist_[index / chunk_size_] + index % chunk_size_;
@@ -59,12 +69,12 @@ class FreeList {
     }
 
     if (chunk_index_ == freelist_.size()) {
-      T* chunk = new T[chunk_size_];
-      memset(static_cast<void*>(chunk), 0, sizeof(*chunk) * chunk_size_);
+      T* chunk = new T[chunk_size_]();
       freelist_.push_back(chunk);
     }
 
     T* result = freelist_[chunk_index_] + element_index_;
+    if (lazy_clear_) *result = T();
     ++element_index_;
 
     return result;
@@ -77,6 +87,7 @@ class FreeList {
   size_t element_index_ = 0;
   size_t chunk_index_ = 0;
   const size_t chunk_size_ = 0;
+  const bool lazy_clear_ = false;
 };
 }  // namespace model
 }  // namespace sentencepiece
@@ -44,5 +44,44 @@ TEST(FreeListTest, BasicTest) {
     EXPECT_EQ(0, *n);
   }
 }
+
+TEST(FreeListTest, ReuseTest) {
+  struct Pair {
+    int first;
+    float second;
+    const Pair *next;
+  };
+  FreeList<Pair> l(4, true);
+
+  for (int i = 0; i < 10; ++i) {
+    Pair *p = l.Allocate();
+    p->first = i;
+    p->second = 1.0;
+    p->next = p;
+  }
+
+  // Only the elements handed out again are cleared.
+  l.Free();
+  for (int i = 0; i < 3; ++i) {
+    Pair *p = l.Allocate();
+    EXPECT_EQ(0, p->first);
+    EXPECT_EQ(0.0, p->second);
+    EXPECT_EQ(nullptr, p->next);
+  }
+  EXPECT_EQ(3, l.size());
+  EXPECT_EQ(3, l[3]->first);
+}
+
+TEST(FreeListTest, ClearTest) {
+  for (const bool lazy_clear : {false, true}) {
+    FreeList<int> l(4, lazy_clear);
+    for (int i = 0; i < 10; ++i) *l.Allocate() = i + 1;
+    l.Free();
+    for (int i = 0; i < 10; ++i) {
+      EXPECT_EQ(lazy_clear ? i + 1 : 0, *l[i]);
+    }
+    for (int i = 0; i < 10; ++i) EXPECT_EQ(0, *l.Allocate());
+  }
+}
 }  // namespace model
 }  // namespace sentencepiece
@@ -0,0 +1,262 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "memory_plan.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "filesystem.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace {
+
+// Bytes of a sentence in SentenceStore besides its text: the offset and the
+// frequency.
+constexpr double kSentenceOverhead = 16;
+
+// Bytes of CharAttributes per character of the seed extraction.
+constexpr double kAttributeBytesPerChar = 2;
+
+// Bytes per character of the BPE trainer: the symbol pointer and the links
+// of the slot, and the position in the list of its bigram.
+constexpr double kBpeBytesPerChar = 32;
+
+// Bytes of a seed piece in the unigram trainer: the string and score, and
+// its share of the trie.
+constexpr double kPieceBytes = 64;
+
+// Bytes of the lattice and the scratch space of one E-step thread.
+constexpr double kLatticeBytes = 8 << 20;
+
+constexpr double kMB = 1 << 20;
+
+// A peak of |per_sentence| * sentences + |fixed| bytes.
+struct LinearCost {
+  double per_sentence = 0;
+  double fixed = 0;
+
+  double At(double sentences) const { return per_sentence * sentences + fixed; }
+};
+
+struct PhaseCosts {
+  LinearCost load, seed, train;
+};
+
+PhaseCosts GetPhaseCosts(const TrainerSpec &trainer_spec,
+                         const CorpusStats &stats, bool large_suffix_array) {
+  const double chars = stats.line_bytes * stats.chars_per_byte;
+  const double resident = stats.line_bytes + kSentenceOverhead;
+  PhaseCosts costs;
+
+  // The normalized sentences are rewritten into new pools while the loaded
+  // ones are still alive.
+  costs.load.per_sentence = 2 * resident;
+
+  const bool unigram = trainer_spec.model_type() == TrainerSpec::UNIGRAM;
+  if (unigram && trainer_spec.candidate_models_size() == 0) {
+    // The characters, the suffix array with the boundaries and the depths
+    // of the internal nodes, and the character attributes.
+    const double index_bytes = large_suffix_array ? 8 : 4;
+    double per_char = 4 + 4 * index_bytes + kAttributeBytesPerChar;
+    if (trainer_spec.seed_from_unique_words()) per_char += 8 + index_bytes;
+    costs.seed.per_sentence = resident + chars * per_char;
+  }
+
+  switch (trainer_spec.model_type()) {
+    case TrainerSpec::UNIGRAM: {
+      // The sentence order, and the pieces with the expected counts of
+      // every thread.
+      const double pieces = trainer_spec.seed_sentencepiece_size();
+      const int threads = std::max(1, trainer_spec.num_threads());
+      costs.train.per_sentence = resident + 8;
+      costs.train.fixed =
+          pieces * kPieceBytes + threads * (pieces * 8 + kLatticeBytes);
+      break;
+    }
+    case TrainerSpec::BPE:
+      costs.train.per_sentence = resident + chars * kBpeBytesPerChar;
+      break;
+    default:
+      costs.train.per_sentence = resident;
+      break;
+  }
+  return costs;
+}
+
+// Returns the largest number of sentences whose phases all fit in
+// |budget| bytes, or -1 if none does.
+int64 MaxSentences(const PhaseCosts &costs, double budget) {
+  double max_sentences = std::numeric_limits<int32>::max();
+  for (const LinearCost &cost : {costs.load, costs.seed, costs.train}) {
+    if (cost.fixed > budget) return -1;
+    if (cost.per_sentence > 0) {
+      max_sentences =
+          std::min(max_sentences, (budget - cost.fixed) / cost.per_sentence);
+    }
+  }
+  return static_cast<int64>(max_sentences);
+}
+
+}  // namespace
+
+util::Status EstimateCorpusStats(const std::vector<std::string> &files,
+                                 int64 max_sample_lines, CorpusStats *stats) {
+  CHECK_OR_RETURN(!files.empty()) << "No input files.";
+  CHECK_GT_OR_RETURN(max_sample_lines, 0);
+  *stats = CorpusStats();
+
+  const int64 lines_per_file =
+      std::max<int64>(1, max_sample_lines / files.size());
+  int64 total_bytes = 0;
+  int64 line_bytes = 0;
+  int64 chars = 0;
+  bool compressed = false;
+  for (const auto &filename : files) {
+    std::ifstream is(WPATH(filename.c_str()), std::ios::binary | std::ios::in);
+    if (!is) {
+      return util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
+             << "\"" << filename << "\": " << util::StrError(errno);
+    }
+    char magic[4] = {};
+    is.read(magic, sizeof(magic));
+    compressed |=
+        (is.gcount() >= 2 && std::memcmp(magic, "\x1f\x8b", 2) == 0) ||
+        (is.gcount() == 4 && std::memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0);
+    is.clear();
+    is.seekg(0, std::ios::end);
+    total_bytes += static_cast<int64>(is.tellg());
+
+    auto input = filesystem::NewReadableFile(filename);
+    RETURN_IF_ERROR(input->status());
+    absl::string_view line;
+    for (int64 n = 0; n < lines_per_file && input->ReadLineView(&line); ++n) {
+      ++stats->sampled_lines;
+      line_bytes += line.size();
+      for (const char c : line) {
+        // Counts the bytes that are not UTF-8 continuation bytes.
+        if ((c & 0xC0) != 0x80) ++chars;
+      }
+    }
+  }
+
+  if (stats->sampled_lines == 0) {
+    stats->lines = 0;
+    return util::OkStatus();
+  }
+  stats->line_bytes = static_cast<double>(line_bytes) / stats->sampled_lines;
+  if (line_bytes > 0) {
+    stats->chars_per_byte = static_cast<double>(chars) / line_bytes;
+  }
+  if (!compressed) {
+    stats->lines = static_cast<int64>(
+        std::ceil(total_bytes / (stats->line_bytes + 1)));
+  }
+  return util::OkStatus();
+}
+
+int64 MemoryPlan::peak_bytes() const {
+  return std::max(load_bytes, std::max(seed_bytes, train_bytes));
+}
+
+std::string MemoryPlan::ToString() const {
+  auto mb = [](int64 bytes) {
+    return absl::StrCat(static_cast<int64>(std::ceil(bytes / kMB)), " MB");
+  };
+  std::string result = absl::StrCat(
+      "sentences=", sentences == 0 ? "all" : absl::StrCat(sentences),
+      " suffix_array=", large_suffix_array ? "64-bit" : "32-bit",
+      " load_sentences=", mb(load_bytes));
+  if (seed_bytes > 0) {
+    result += absl::StrCat(" seed_extraction=", mb(seed_bytes));
+  }
+  result += absl::StrCat(" training=", mb(train_bytes),
+                         " peak=", mb(peak_bytes()),
+                         " budget=", mb(budget_bytes));
+  return result;
+}
+
+util::Status MakeMemoryPlan(const TrainerSpec &trainer_spec,
+                            const CorpusStats &stats, int64 min_sentences,
+                            MemoryPlan *plan) {
+  CHECK_GT_OR_RETURN(trainer_spec.max_memory_mb(), 0);
+  *plan = MemoryPlan();
+  plan->budget_bytes = static_cast<int64>(trainer_spec.max_memory_mb()) << 20;
+  const double budget = plan->budget_bytes;
+
+  // The number of sentences the corpus or the sampling gives.
+  int64 wanted = stats.lines;
+  if (trainer_spec.input_sentence_size() > 0 &&
+      (wanted < 0 || trainer_spec.input_sentence_size() < wanted)) {
+    wanted = trainer_spec.input_sentence_size();
+  }
+
+  // A 32-bit suffix array takes at most 2^31 - 1 characters, and a 64-bit
+  // one fits fewer sentences. Picks the width that loads more of them.
+  const double chars_per_sentence =
+      std::max(1.0, stats.line_bytes * stats.chars_per_byte);
+  const PhaseCosts costs32 = GetPhaseCosts(trainer_spec, stats, false);
+  const PhaseCosts costs64 = GetPhaseCosts(trainer_spec, stats, true);
+  const bool has_seed = costs32.seed.per_sentence > 0;
+  int64 max32 = MaxSentences(costs32, budget);
+  if (has_seed) {
+    max32 = std::min(max32,
+                     static_cast<int64>(std::numeric_limits<int32>::max() /
+                                        chars_per_sentence));
+  }
+  const int64 max64 = MaxSentences(costs64, budget);
+  int64 sentences = max32;
+  if (max32 < std::min(wanted < 0 ? max64 : wanted, max64)) {
+    sentences = max64;
+    plan->large_suffix_array = true;
+  }
+  if (wanted >= 0) sentences = std::min(sentences, wanted);
+
+  const PhaseCosts &costs = plan->large_suffix_array ? costs64 : costs32;
+  const double size = std::max<int64>(sentences, 0);
+  plan->load_bytes = static_cast<int64>(costs.load.At(size));
+  plan->seed_bytes = has_seed ? static_cast<int64>(costs.seed.At(size)) : 0;
+  plan->train_bytes = static_cast<int64>(costs.train.At(size));
+
+  const int64 needed =
+      stats.lines >= 0 ? std::min(min_sentences, stats.lines) : min_sentences;
+  if (sentences < needed) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted, GTL_LOC)
+           << "--max_memory_mb=" << trainer_spec.max_memory_mb()
+           << " is too small to train on " << needed
+           << " sentences: " << plan->ToString();
+  }
+
+  // Loads all sentences when the corpus is known to fit.
+  plan->sentences =
+      stats.lines >= 0 && sentences >= stats.lines ? 0 : sentences;
+  return util::OkStatus();
+}
+
+void ApplyMemoryPlan(const MemoryPlan &plan, TrainerSpec *trainer_spec) {
+  if (plan.sentences > 0) {
+    trainer_spec->set_input_sentence_size(static_cast<int32>(plan.sentences));
+  }
+  if (plan.seed_bytes > 0) {
+    trainer_spec->set_train_extremely_large_corpus(plan.large_suffix_array);
+  }
+}
+
+}  // namespace sentencepiece
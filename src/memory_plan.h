@@ -0,0 +1,73 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef MEMORY_PLAN_H_
+#define MEMORY_PLAN_H_
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+
+namespace sentencepiece {
+
+// Statistics of the input files, from their sizes and their first lines.
+struct CorpusStats {
+  int64 lines = -1;             // estimated number of lines, -1 if unknown.
+  int64 sampled_lines = 0;      // number of lines the means are taken over.
+  double line_bytes = 0.0;      // mean bytes of a line without the newline.
+  double chars_per_byte = 1.0;  // mean characters per byte of a line.
+};
+
+// Reads up to |max_sample_lines| lines from the beginning of |files|, split
+// evenly between the files. The number of lines is only estimated for
+// uncompressed files, from their sizes.
+util::Status EstimateCorpusStats(const std::vector<std::string> &files,
+                                 int64 max_sample_lines, CorpusStats *stats);
+
+// A plan of the training that fits TrainerSpec::max_memory_mb(). The peaks
+// are estimated from the sizes of the data structures of each phase, and are
+// not exact.
+struct MemoryPlan {
+  int64 budget_bytes = 0;
+  int64 sentences = 0;              // sentences to load, 0 for all of them.
+  bool large_suffix_array = false;  // 64-bit indices of the suffix array.
+
+  // Estimated peak bytes of the phases.
+  int64 load_bytes = 0;  // loading and normalizing the sentences.
+  int64 seed_bytes = 0;  // unigram seed extraction.
+  int64 train_bytes = 0;  // EM for unigram, merges for BPE.
+
+  int64 peak_bytes() const;
+  std::string ToString() const;
+};
+
+// Picks the number of sentences and the width of the suffix array so that
+// every phase of a training with |trainer_spec| on a corpus with |stats|
+// fits in trainer_spec.max_memory_mb(). Takes at most
+// trainer_spec.input_sentence_size() sentences if it is set. Fails when
+// fewer than |min_sentences| sentences, or all of them if the corpus is
+// smaller, would fit.
+util::Status MakeMemoryPlan(const TrainerSpec &trainer_spec,
+                            const CorpusStats &stats, int64 min_sentences,
+                            MemoryPlan *plan);
+
+// Sets input_sentence_size and train_extremely_large_corpus of
+// |trainer_spec| to the choices of |plan|.
+void ApplyMemoryPlan(const MemoryPlan &plan, TrainerSpec *trainer_spec);
+
+}  // namespace sentencepiece
+#endif  // MEMORY_PLAN_H_
@@ -0,0 +1,147 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "memory_plan.h"
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "filesystem.h"
+#include "sentencepiece_trainer.h"
+#include "testharness.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace {
+
+TEST(MemoryPlanTest, EstimateCorpusStatsTest) {
+  const std::string filename = util::JoinPath(
+      absl::GetFlag(FLAGS_test_tmpdir), "memory_plan_corpus.txt");
+  {
+    auto output = filesystem::NewWritableFile(filename);
+    // 9 bytes and 5 characters per line.
+    for (int i = 0; i < 1000; ++i) {
+      output->WriteLine("abc\xe3\x81\x82\xe3\x81\x84");
+    }
+  }
+
+  CorpusStats stats;
+  ASSERT_TRUE(EstimateCorpusStats({filename}, 100, &stats).ok());
+  EXPECT_EQ(100, stats.sampled_lines);
+  EXPECT_EQ(1000, stats.lines);
+  EXPECT_NEAR(9.0, stats.line_bytes, 1e-6);
+  EXPECT_NEAR(5.0 / 9, stats.chars_per_byte, 1e-6);
+
+  // The sample is split between the files.
+  ASSERT_TRUE(EstimateCorpusStats({filename, filename}, 100, &stats).ok());
+  EXPECT_EQ(100, stats.sampled_lines);
+  EXPECT_EQ(2000, stats.lines);
+
+  EXPECT_FALSE(EstimateCorpusStats({}, 100, &stats).ok());
+  EXPECT_FALSE(
+      EstimateCorpusStats({filename + ".__UNKNOWN__"}, 100, &stats).ok());
+}
+
+TEST(MemoryPlanTest, MakeMemoryPlanTest) {
+  TrainerSpec trainer_spec;
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.set_num_threads(4);
+  trainer_spec.set_seed_sentencepiece_size(100000);
+  trainer_spec.set_max_memory_mb(1024);
+
+  CorpusStats stats;
+  stats.lines = 100000;
+  stats.line_bytes = 100;
+  stats.chars_per_byte = 1.0;
+
+  // A small corpus is loaded as a whole.
+  MemoryPlan plan;
+  ASSERT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_EQ(0, plan.sentences);
+  EXPECT_FALSE(plan.large_suffix_array);
+  EXPECT_GT(plan.seed_bytes, plan.load_bytes);
+  EXPECT_GE(plan.budget_bytes, plan.peak_bytes());
+
+  // A larger one is sampled to fit.
+  stats.lines = 100000000;
+  ASSERT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_LT(10000, plan.sentences);
+  EXPECT_GT(stats.lines, plan.sentences);
+  EXPECT_GE(plan.budget_bytes, plan.peak_bytes());
+  EXPECT_LT(plan.budget_bytes * 0.9, plan.peak_bytes());
+  TrainerSpec applied = trainer_spec;
+  ApplyMemoryPlan(plan, &applied);
+  EXPECT_EQ(plan.sentences, applied.input_sentence_size());
+  EXPECT_FALSE(applied.train_extremely_large_corpus());
+
+  // input_sentence_size is kept when it fits, and so is an unknown size.
+  trainer_spec.set_input_sentence_size(20000);
+  ASSERT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_EQ(20000, plan.sentences);
+  stats.lines = -1;
+  ASSERT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_EQ(20000, plan.sentences);
+  trainer_spec.clear_input_sentence_size();
+
+  // A suffix array of more than 2^31 characters needs 64-bit indices.
+  trainer_spec.set_max_memory_mb(1 << 20);
+  ASSERT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_TRUE(plan.large_suffix_array);
+  EXPECT_LT(std::numeric_limits<int32>::max() / 100, plan.sentences);
+  ApplyMemoryPlan(plan, &applied);
+  EXPECT_TRUE(applied.train_extremely_large_corpus());
+
+  // BPE has no suffix array.
+  trainer_spec.set_model_type(TrainerSpec::BPE);
+  ASSERT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_FALSE(plan.large_suffix_array);
+  EXPECT_EQ(0, plan.seed_bytes);
+
+  // Fails when the budget does not fit the minimum sample.
+  trainer_spec.set_model_type(TrainerSpec::UNIGRAM);
+  trainer_spec.set_max_memory_mb(16);
+  const auto status = MakeMemoryPlan(trainer_spec, stats, 10000, &plan);
+  EXPECT_TRUE(util::IsResourceExhausted(status));
+  trainer_spec.set_max_memory_mb(512);
+  stats.lines = 1000;
+  EXPECT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  stats.lines = 1000000;
+  EXPECT_TRUE(MakeMemoryPlan(trainer_spec, stats, 10000, &plan).ok());
+  EXPECT_FALSE(MakeMemoryPlan(trainer_spec, stats, 10000000, &plan).ok());
+}
+
+TEST(MemoryPlanTest, TrainTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string model =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "memory_plan");
+  const std::string args = absl::StrCat(
+      "--input=", input, " --model_prefix=", model, " --vocab_size=1000");
+
+  EXPECT_TRUE(util::IsResourceExhausted(
+      SentencePieceTrainer::Train(absl::StrCat(args, " --max_memory_mb=1"))));
+  ASSERT_TRUE(
+      SentencePieceTrainer::Train(absl::StrCat(args, " --max_memory_mb=4096"))
+          .ok());
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model + ".model").ok());
+  EXPECT_EQ(1000, sp.GetPieceSize());
+  EXPECT_EQ(4096, sp.model_proto().trainer_spec().max_memory_mb());
+  EXPECT_EQ(0, sp.model_proto().trainer_spec().input_sentence_size());
+}
+
+}  // namespace
+}  // namespace sentencepiece
@@ -13,11 +13,18 @@
 // limitations under the License.!
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <unordered_map>
 
+#include "case_encoder.h"
+#include "cpu_dispatch.h"
 #include "model_interface.h"
 #include "sentencepiece_model.pb.h"
 #include "third_party/absl/memory/memory.h"
-#include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/strings/str_cat.h"
 #include "util.h"
 
 namespace sentencepiece {
@@ -49,15 +56,131 @@ absl::string_view ModelInterface::pad_piece() const {
 #undef RETURN_PIECE
 
 int ModelInterface::PieceToId(absl::string_view piece) const {
-  auto it = reserved_id_map_.find(piece);
-  if (it != reserved_id_map_.end()) {
-    return it->second;
+  if (piece_ids_.empty()) return unk_id_;
+  const size_t mask = piece_ids_.size() - 1;
+  for (size_t i = PieceIdSlotIndex(piece);; i = (i + 1) & mask) {
+    const PieceIdSlot &slot = piece_ids_[i];
+    if (slot.id < 0) return unk_id_;
+    if (slot.size == piece.size() &&
+        memcmp(slot.data, piece.data(), piece.size()) == 0) {
+      return slot.id;
+    }
+  }
+}
+
+void ModelInterface::PiecesToIds(EncodeResult *output) const {
+  if (piece_ids_.empty()) {
+    for (auto &p : *output) p.second = unk_id_;
+    return;
+  }
+
+  // Locates and prefetches the first slots of a batch of pieces before
+  // probing any of them, so that their cache misses overlap.
+  constexpr size_t kBatchSize = 16;
+  const size_t mask = piece_ids_.size() - 1;
+  size_t slots[kBatchSize];
+  for (size_t begin = 0; begin < output->size(); begin += kBatchSize) {
+    const size_t end = std::min(begin + kBatchSize, output->size());
+    for (size_t k = begin; k < end; ++k) {
+      slots[k - begin] = PieceIdSlotIndex((*output)[k].first);
+#if defined(__GNUC__)
+      __builtin_prefetch(&piece_ids_[slots[k - begin]]);
+#endif
+    }
+    for (size_t k = begin; k < end; ++k) {
+      const absl::string_view piece = (*output)[k].first;
+      int id = unk_id_;
+      for (size_t i = slots[k - begin];; i = (i + 1) & mask) {
+        const PieceIdSlot &slot = piece_ids_[i];
+        if (slot.id < 0) break;
+        if (slot.size == piece.size() &&
+            memcmp(slot.data, piece.data(), piece.size()) == 0) {
+          id = slot.id;
+          break;
+        }
+      }
+      (*output)[k].second = id;
+    }
   }
-  auto it2 = pieces_.find(piece);
-  if (it2 != pieces_.end()) {
-    return it2->second;
+}
+
+void ModelInterface::ToCompactEncodeResult(const EncodeResult &pieces,
+                                           CompactEncodeResult *result) const {
+  result->resize(pieces.size());
+  uint32 begin = 0;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    const int id = pieces[i].second;
+    const uint32 length = IsControl(id) ? 0 : pieces[i].first.size();
+    (*result)[i] = {begin, length, id};
+    begin += length;
   }
-  return unk_id_;
+}
+
+void ModelInterface::ToEncodeResult(absl::string_view normalized,
+                                    const CompactEncodeResult &result,
+                                    EncodeResult *pieces) const {
+  pieces->resize(result.size());
+  for (size_t i = 0; i < result.size(); ++i) {
+    const CompactPiece &p = result[i];
+    (*pieces)[i].first =
+        IsControl(p.id) ? absl::string_view(IdToPiece(p.id))
+                        : absl::ClippedSubstr(normalized, p.begin, p.length);
+    (*pieces)[i].second = p.id;
+  }
+}
+
+size_t ModelInterface::PieceIdSlotIndex(absl::string_view piece) const {
+  // Hashes eight bytes at a time. Fibonacci hashing then moves the
+  // well-mixed high bits of the product to the index.
+  constexpr uint64 kMultiplier = 0x9E3779B97F4A7C15ULL;
+  uint64 hash = piece.size();
+  size_t i = 0;
+  for (; i + 8 <= piece.size(); i += 8) {
+    uint64 word;
+    memcpy(&word, piece.data() + i, sizeof(word));
+    hash = (hash ^ word) * kMultiplier;
+  }
+  if (i < piece.size()) {
+    uint64 word = 0;
+    for (size_t j = piece.size(); j > i; --j) {
+      word = (word << 8) | static_cast<uint8>(piece[j - 1]);
+    }
+    hash = (hash ^ word) * kMultiplier;
+  }
+  hash = (hash ^ (hash >> 29)) * kMultiplier;
+  return hash >> piece_ids_shift_;
+}
+
+void ModelInterface::BuildPieceIds() {
+  // At most half of the slots are used, which keeps the probe sequences
+  // short.
+  const size_t num_pieces = pieces_.size() + reserved_id_map_.size();
+  size_t size = 2;
+  piece_ids_shift_ = 63;
+  while (size < 2 * num_pieces) {
+    size *= 2;
+    --piece_ids_shift_;
+  }
+  piece_ids_.assign(size, PieceIdSlot());
+
+  const size_t mask = size - 1;
+  auto insert = [&](absl::string_view piece, int id) {
+    for (size_t i = PieceIdSlotIndex(piece);; i = (i + 1) & mask) {
+      PieceIdSlot &slot = piece_ids_[i];
+      if (slot.id < 0) {
+        slot.data = piece.data();
+        slot.size = piece.size();
+        slot.id = id;
+        return;
+      }
+      if (absl::string_view(slot.data, slot.size) == piece) return;
+    }
+  };
+
+  // Reserved pieces take precedence over the normal pieces with the same
+  // string.
+  for (const auto &it : reserved_id_map_) insert(it.first, it.second);
+  for (const auto &it : pieces_) insert(it.first, it.second);
 }
 
 void ModelInterface::InitializePieces() {
@@ -65,8 +188,16 @@ void ModelInterface::InitializePieces() {
   reserved_id_map_.clear();
   unk_id_ = -1;
 
+  scores_.clear();
+  types_.clear();
+  byte_to_id_.clear();
+  id_to_byte_.clear();
+  scores_.reserve(model_proto_->pieces_size());
+  types_.reserve(model_proto_->pieces_size());
+
   std::set<absl::string_view> user_defined_symbols;
   std::vector<bool> byte_found(256, false);
+  std::vector<int> byte_ids(256, -1);
 
   for (int i = 0; i < model_proto_->pieces_size(); ++i) {
     const auto &sp = model_proto_->pieces(i);
@@ -75,6 +206,9 @@ void ModelInterface::InitializePieces() {
       return;
     }
 
+    scores_.push_back(sp.score());
+    types_.push_back(static_cast<uint8>(sp.type()));
+
     const bool is_normal_piece =
         (sp.type() == ModelProto::SentencePiece::NORMAL ||
          sp.type() == ModelProto::SentencePiece::USER_DEFINED ||
@@ -107,6 +241,7 @@ void ModelInterface::InitializePieces() {
       const int byte = PieceToByte(sp.piece());
       if (0 <= byte && byte < 256) {
         byte_found[byte] = true;
+        byte_ids[byte] = i;
       } else {
         status_ =
             util::InternalError("byte piece " + sp.piece() + " is invalid.");
@@ -128,66 +263,370 @@ void ModelInterface::InitializePieces() {
           "there are not 256 byte pieces although `byte_fallback` is true.");
       return;
     }
+
+    // The byte pieces are consecutive in trained models, so `id_to_byte_`
+    // usually has 256 entries.
+    byte_to_id_ = std::move(byte_ids);
+    const auto range =
+        std::minmax_element(byte_to_id_.begin(), byte_to_id_.end());
+    byte_ids_begin_ = *range.first;
+    id_to_byte_.assign(*range.second - *range.first + 1, -1);
+    for (int byte = 0; byte < 256; ++byte) {
+      id_to_byte_[byte_to_id_[byte] - byte_ids_begin_] = byte;
+    }
   }
 
   matcher_ = absl::make_unique<normalizer::PrefixMatcher>(user_defined_symbols);
+
+  BuildPieceIds();
+  InitializeSpecialPieceIds();
+}
+
+std::string ModelInterface::QuantizeTables() const {
+  const size_t size = scores_.size();
+  float max_abs_score = 0.0;
+  for (const float score : scores_) {
+    max_abs_score = std::max(max_abs_score, std::fabs(score));
+  }
+  const float scale = max_abs_score > 0.0 ? max_abs_score / 32767 : 1.0;
+
+  std::string table(sizeof(float) + 2 * size + (size + 1) / 2, '\0');
+  uint32 scale_bits;
+  memcpy(&scale_bits, &scale, sizeof(scale_bits));
+  for (int i = 0; i < 4; ++i) table[i] = (scale_bits >> (8 * i)) & 0xFF;
+  char *scores = &table[sizeof(float)];
+  char *types = scores + 2 * size;
+  for (size_t id = 0; id < size; ++id) {
+    const auto q = static_cast<int16>(std::lround(scores_[id] / scale));
+    scores[2 * id] = static_cast<uint16>(q) & 0xFF;
+    scores[2 * id + 1] = static_cast<uint16>(q) >> 8;
+    types[id / 2] |= (types_[id] & 0xF) << (id % 2 == 0 ? 0 : 4);
+  }
+  return table;
+}
+
+void ModelInterface::SetQuantizedTables(absl::string_view table) {
+  if (!status().ok()) return;
+
+  const size_t size = scores_.size();
+  if (table.size() != sizeof(float) + 2 * size + (size + 1) / 2) {
+    status_ = util::InternalError("invalid quantized score table.");
+    return;
+  }
+
+  // The int16 scores are used in place when they are aligned and in the
+  // host byte order.
+  bool in_place = reinterpret_cast<uintptr_t>(table.data()) % 4 == 0;
+#ifdef IS_BIG_ENDIAN
+  in_place = false;
+#endif
+  if (!in_place) {
+    quantized_buffer_.assign(table.data(), table.size());
+    for (size_t i = sizeof(float); i + 1 < 2 * size + sizeof(float);
+         i += 2) {
+      const uint16 q = static_cast<uint8>(quantized_buffer_[i]) |
+                       (static_cast<uint8>(quantized_buffer_[i + 1]) << 8);
+      memcpy(&quantized_buffer_[i], &q, sizeof(q));
+    }
+    table = quantized_buffer_;
+  }
+
+  uint32 scale_bits = 0;
+  for (int i = 3; i >= 0; --i) {
+    scale_bits = (scale_bits << 8) | static_cast<uint8>(table[i]);
+  }
+  memcpy(&score_scale_, &scale_bits, sizeof(score_scale_));
+
+  // The types must be the ones of the pieces of this model.
+  const auto *types =
+      reinterpret_cast<const uint8 *>(table.data() + sizeof(float) + 2 * size);
+  for (size_t id = 0; id < size; ++id) {
+    if (((types[id / 2] >> (id % 2 == 0 ? 0 : 4)) & 0xF) != types_[id]) {
+      status_ = util::InternalError(
+          "quantized score table does not match the pieces.");
+      quantized_buffer_.clear();
+      return;
+    }
+  }
+
+  quantized_scores_ =
+      reinterpret_cast<const int16 *>(table.data() + sizeof(float));
+  packed_types_ = types;
+  std::vector<float>().swap(scores_);
+  std::vector<uint8>().swap(types_);
+}
+
+std::string RepeatCountPiece(int i) {
+  return absl::StrCat("<rep:", RepeatCountPieceValue(i), ">");
+}
+
+void ModelInterface::InitializeSpecialPieceIds() {
+  // Sub classes may override PieceToId(), so the lookup built by
+  // InitializePieces() is used directly.
+  auto piece_to_id = [this](absl::string_view piece) {
+    return ModelInterface::PieceToId(piece);
+  };
+  auto control_id = [&](absl::string_view piece) {
+    const int id = piece_to_id(piece);
+    return IsControlInlined(id) ? id : -1;
+  };
+
+  special_ids_ = SpecialPieceIds();
+  special_ids_.unk = unk_id_;
+  special_ids_.bos = control_id(bos_piece());
+  special_ids_.eos = control_id(eos_piece());
+  special_ids_.pad = control_id(pad_piece());
+
+  special_ids_.start_repeat = piece_to_id(kStartRepeatSymbol);
+  special_ids_.end_repeat = piece_to_id(kEndRepeatSymbol);
+  for (int d = 0; d < 10; ++d) {
+    const char digit = '0' + d;
+    special_ids_.digits[d] = piece_to_id(absl::string_view(&digit, 1));
+  }
+
+  auto case_marker_id = [&](char c) {
+    return piece_to_id(absl::string_view(&c, 1));
+  };
+  special_ids_.upper = case_marker_id(normalizer::cUppercase);
+  special_ids_.all_upper = case_marker_id(normalizer::cAllUppercase);
+  special_ids_.title = case_marker_id(normalizer::cTitlecase);
+  special_ids_.lower = case_marker_id(normalizer::cLowercase);
+  special_ids_.punctuation = case_marker_id(normalizer::cPunctuation);
+
+  special_ids_.has_repeat_counts = true;
+  for (int i = 0; i < kNumRepeatCountPieces; ++i) {
+    const int id = piece_to_id(RepeatCountPiece(i));
+    special_ids_.repeat_counts[i] = id;
+    if (!IsControlInlined(id)) special_ids_.has_repeat_counts = false;
+  }
 }
 
+namespace {
+// Space symbol (U+2581)
+constexpr char kSpaceSymbol[] = "\xe2\x96\x81";
+
+// Returns the first U+2581 in [begin, end) that starts a character when
+// [begin, end) is split into characters with OneCharLen(), or `end` if there
+// is none. The candidates are found without decoding the characters.
+const char *FindSpaceSymbol(const char *begin, const char *end) {
+  // `known` is a character boundary at or before the candidates. A character
+  // is at most four bytes long, so a candidate starts a character unless a
+  // lead byte in the three bytes before it spans it. Then, which only
+  // happens in malformed UTF-8, the characters are walked from `known`.
+  const char *known = begin;
+  auto starts_character = [&](const char *p) {
+    bool spanned = false;
+    for (int back = 1; back <= 3 && p - back >= known; ++back) {
+      spanned |= string_util::OneCharLen(p - back) > static_cast<size_t>(back);
+    }
+    if (!spanned) return true;
+    while (known < p) {
+      known += std::min<size_t>(string_util::OneCharLen(known), end - known);
+    }
+    return known == p;
+  };
+
+  const cpu::Kernels &kernels = cpu::GetKernels();
+  for (const char *p = begin;; ++p) {
+    p = kernels.find_three_bytes(p, end, kSpaceSymbol);
+    if (p == end || starts_character(p)) return p;
+  }
+}
+
+#ifndef SPM_NO_THREADLOCAL
+// The words of one model cached by one thread. `pieces` holds the byte
+// length and the id of each piece of the words.
+struct WordCache {
+  uint64 generation = 0;
+  std::unordered_map<absl::string_view, std::pair<uint32, uint32>,
+                     string_util::string_view_hash>
+      index;  // word -> [begin, end) of its pieces.
+  std::deque<std::string> words;  // keys of `index`, which never move.
+  std::vector<std::pair<uint32, int>> pieces;
+  EncodeResult word_result;  // buffer of the words being encoded.
+};
+
+// Returns the word caches of the calling thread, the most recently used
+// first.
+std::deque<WordCache> *GetWordCaches() {
+  thread_local static std::deque<WordCache> caches;
+  return &caches;
+}
+
+// Returns the word cache of `generation` for the calling thread. A thread
+// keeps the caches of a few models, replacing the least recently used.
+WordCache *GetWordCache(uint64 generation) {
+  constexpr size_t kMaxModels = 4;
+  std::deque<WordCache> &caches = *GetWordCaches();
+  for (auto it = caches.begin(); it != caches.end(); ++it) {
+    if (it->generation != generation) continue;
+    if (it != caches.begin()) {
+      WordCache cache = std::move(*it);
+      caches.erase(it);
+      caches.push_front(std::move(cache));
+    }
+    return &caches.front();
+  }
+  if (caches.size() >= kMaxModels) caches.pop_back();
+  caches.emplace_front();
+  caches.front().generation = generation;
+  return &caches.front();
+}
+#endif  // SPM_NO_THREADLOCAL
+}  // namespace
+
 std::vector<absl::string_view> SplitIntoWords(absl::string_view text,
                                               bool treat_whitespace_as_suffix) {
   const char *begin = text.data();
   const char *end = text.data() + text.size();
+  constexpr size_t kSpaceSymbolSize = sizeof(kSpaceSymbol) - 1;
 
-  // Space symbol (U+2581)
-  const absl::string_view kSpaceSymbol = "\xe2\x96\x81";
-
+  // Words are delimited by the U+2581 characters, which are found without
+  // decoding the characters in between.
   std::vector<absl::string_view> result;
-  if (treat_whitespace_as_suffix) {
-    if (begin < end) result.emplace_back(begin, 0);
-    while (begin < end) {
-      const int mblen =
-          std::min<int>(string_util::OneCharLen(begin), end - begin);
-      const bool is_ws = absl::string_view(begin, mblen) == kSpaceSymbol;
-      result.back() =
-          absl::string_view(result.back().data(), result.back().size() + mblen);
-      begin += mblen;
-      if (begin < end && is_ws) result.emplace_back(begin, 0);
-    }
-  } else {
-    while (begin < end) {
-      const int mblen =
-          std::min<int>(string_util::OneCharLen(begin), end - begin);
-      if (begin == text.data() ||
-          absl::string_view(begin, mblen) == kSpaceSymbol)
-        result.emplace_back(begin, 0);  // add empty string piece.
-      result.back() =
-          absl::string_view(result.back().data(), result.back().size() + mblen);
-      begin += mblen;
-    }
+  if (begin == end) return result;
+  const char *word = begin;
+  for (const char *ws = FindSpaceSymbol(begin, end); ws < end;
+       ws = FindSpaceSymbol(ws + kSpaceSymbolSize, end)) {
+    const char *boundary =
+        treat_whitespace_as_suffix ? ws + kSpaceSymbolSize : ws;
+    if (boundary == begin || boundary == end) continue;
+    result.emplace_back(word, boundary - word);
+    word = boundary;
   }
+  result.emplace_back(word, end - word);
 
   return result;
 }
 
+util::Status ModelInterface::SetSampleBeam(float beam) {
+  CHECK_OR_RETURN(beam >= 0.0 && beam <= 1.0)
+      << "The sample beam must be in [0, 1].";
+  sample_beam_ = beam;
+  return util::OkStatus();
+}
+
+util::Status ModelInterface::SetWordCacheSize(int max_words) {
+  CHECK_GE_OR_RETURN(max_words, 0);
+  if (max_words > 0) {
+    CHECK_OR_RETURN(model_proto_ != nullptr) << "Model is not initialized.";
+    for (const auto &sp : model_proto_->pieces()) {
+      if (sp.piece().find(kSpaceSymbol, 1) != std::string::npos) {
+        return util::StatusBuilder(util::StatusCode::kFailedPrecondition,
+                                   GTL_LOC)
+               << "The word cache is not available, since the piece "
+               << sp.piece() << " has white space after its first character.";
+      }
+    }
+  }
+
+  static std::atomic<uint64> next_generation(1);
+  word_cache_size_ = max_words;
+  word_cache_generation_ = max_words > 0 ? next_generation++ : 0;
+  return util::OkStatus();
+}
+
+void ModelInterface::AddMemoryUsage(MemoryUsage *usage) const {
+  usage->piece_maps += port::HashMapBytes(pieces_) +
+                       port::HashMapBytes(reserved_id_map_) +
+                       port::ContainerBytes(piece_ids_);
+  usage->score_tables +=
+      port::ContainerBytes(scores_) + port::ContainerBytes(types_) +
+      port::ContainerBytes(quantized_buffer_) +
+      port::ContainerBytes(byte_to_id_) + port::ContainerBytes(id_to_byte_);
+  if (matcher_ != nullptr) usage->prefix_matcher += matcher_->MemoryUsage();
+
+#ifndef SPM_NO_THREADLOCAL
+  if (word_cache_generation_ == 0) return;
+  for (const WordCache &cache : *GetWordCaches()) {
+    if (cache.generation != word_cache_generation_) continue;
+    uint64 bytes = port::HashMapBytes(cache.index) +
+                   port::ContainerBytes(cache.pieces) +
+                   port::ContainerBytes(cache.word_result) +
+                   cache.words.size() * sizeof(std::string);
+    for (const auto &word : cache.words) bytes += port::ContainerBytes(word);
+    usage->thread_buffers += bytes;
+  }
+#endif  // SPM_NO_THREADLOCAL
+}
+
+bool ModelInterface::EncodeWords(
+    absl::string_view normalized,
+    const std::function<void(absl::string_view, EncodeResult *)> &encode_word,
+    EncodeResult *results) const {
+#ifdef SPM_NO_THREADLOCAL
+  return false;
+#else
+  if (word_cache_generation_ == 0) return false;
+
+  WordCache *cache = GetWordCache(word_cache_generation_);
+  results->clear();
+  const char *end = normalized.data() + normalized.size();
+  for (const char *begin = normalized.data(); begin < end;) {
+    // Every word but the first one starts with U+2581.
+    const char *next = FindSpaceSymbol(
+        begin + std::min<size_t>(string_util::OneCharLen(begin), end - begin),
+        end);
+    const absl::string_view word(begin, next - begin);
+    begin = next;
+
+    const auto it = cache->index.find(word);
+    if (it != cache->index.end()) {
+      size_t offset = 0;
+      for (uint32 i = it->second.first; i < it->second.second; ++i) {
+        const auto &piece = cache->pieces[i];
+        results->emplace_back(word.substr(offset, piece.first), piece.second);
+        offset += piece.first;
+      }
+      continue;
+    }
+
+    EncodeResult &word_result = cache->word_result;
+    encode_word(word, &word_result);
+    results->insert(results->end(), word_result.begin(), word_result.end());
+
+    if (cache->index.size() >= static_cast<size_t>(word_cache_size_)) {
+      cache->index.clear();
+      cache->words.clear();
+      cache->pieces.clear();
+    }
+    const uint32 first = cache->pieces.size();
+    for (const auto &piece : word_result) {
+      cache->pieces.emplace_back(piece.first.size(), piece.second);
+    }
+    cache->words.emplace_back(word.data(), word.size());
+    cache->index.emplace(cache->words.back(),
+                         std::make_pair(first, cache->pieces.size()));
+  }
+  return true;
+#endif  // SPM_NO_THREADLOCAL
+}
+
+namespace {
+constexpr char kHexDigits[] = "0123456789ABCDEF";
+
+int HexDigitToInt(char c) {
+  if ('0' <= c && c <= '9') return c - '0';
+  if ('A' <= c && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+}  // namespace
+
 std::string ByteToPiece(unsigned char c) {
-  return absl::StrFormat("<0x%02X>", c);
+  const char piece[] = {'<', '0', 'x', kHexDigits[c >> 4], kHexDigits[c & 15],
+                        '>'};
+  return std::string(piece, sizeof(piece));
 }
 
 int PieceToByte(absl::string_view piece) {
-  using PieceToByteMap = absl::flat_hash_map<std::string, unsigned char>;
-  static const auto *const kMap = []() -> PieceToByteMap * {
-    auto *m = new PieceToByteMap();
-    for (int i = 0; i < 256; ++i) {
-      (*m)[ByteToPiece(i)] = i;
-    }
-    return m;
-  }();
-  const auto it = kMap->find(std::string(piece));
-  if (it == kMap->end()) {
+  // Only the pieces written by ByteToPiece(), with uppercase digits.
+  if (piece.size() != 6 || piece[0] != '<' || piece[1] != '0' ||
+      piece[2] != 'x' || piece[5] != '>') {
     return -1;
-  } else {
-    return it->second;
   }
+  const int high = HexDigitToInt(piece[3]);
+  const int low = HexDigitToInt(piece[4]);
+  return high < 0 || low < 0 ? -1 : high * 16 + low;
 }
 
 }  // namespace sentencepiece
@@ -15,6 +15,7 @@
 #ifndef MODEL_INTERFACE_H_
 #define MODEL_INTERFACE_H_
 
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
@@ -46,7 +47,74 @@ int PieceToByte(absl::string_view piece);
 using EncodeResult = std::vector<std::pair<absl::string_view, int>>;
 using NBestEncodeResult = std::vector<std::pair<EncodeResult, float>>;
 
+// The pieces of EncodeResult as byte ranges of the normalized string, which
+// take 12 bytes instead of 24.
+using CompactEncodeResult = std::vector<CompactPiece>;
+static_assert(sizeof(CompactPiece) == 12, "CompactPiece is not packed.");
+
+// A run of n > 1 identical pieces is encoded as the piece followed by
+// kStartRepeatSymbol, the decimal digits of n and kEndRepeatSymbol.
+constexpr char kStartRepeatSymbol[] = "(#startrepeat)";
+constexpr char kEndRepeatSymbol[] = "(#endrepeat)";
+
+// A model trained with TrainerSpec::compact_repeat_counts has the control
+// pieces "<rep:N>" of kNumRepeatCountPieces counts: 1 .. 15 and the powers of
+// two from 16 to 2^20. A run of n > 1 identical pieces is then encoded as the
+// piece followed by count pieces whose counts sum to n - 1, largest first.
+constexpr int kNumRepeatCountPieces = 32;
+
+// Returns the count of the i-th count piece.
+constexpr int RepeatCountPieceValue(int i) {
+  return i < 15 ? i + 1 : 1 << (i - 11);
+}
+
+// Returns the i-th count piece, e.g., "<rep:16>".
+std::string RepeatCountPiece(int i);
+
+// Ids of special pieces, resolved once in ModelInterface::InitializePieces()
+// so that encode/decode loops only compare integers.
+struct SpecialPieceIds {
+  // Reserved pieces. -1 if the piece is not defined with the expected type
+  // (UNKNOWN for unk, CONTROL for the others).
+  int unk = -1;
+  int bos = -1;
+  int eos = -1;
+  int pad = -1;
+
+  // Repeat markers, the digits "0".."9" and the case markers emitted by the
+  // case encoder. Pieces not in the vocab are mapped to the unk id, as
+  // PieceToId() does.
+  int start_repeat = 0;
+  int end_repeat = 0;
+  int digits[10] = {0};
+  int upper = 0;
+  int all_upper = 0;
+  int title = 0;
+  int lower = 0;
+  int punctuation = 0;
+
+  // Ids of the count pieces, set only if the model has all of them as
+  // control pieces.
+  bool has_repeat_counts = false;
+  int repeat_counts[kNumRepeatCountPieces] = {0};
+
+  // Returns the count of `id` if it is a count piece, or 0.
+  int RepeatCount(int id) const {
+    if (!has_repeat_counts) return 0;
+    // The trainer reserves the count pieces with consecutive ids.
+    const int i = id - repeat_counts[0];
+    if (i >= 0 && i < kNumRepeatCountPieces && repeat_counts[i] == id) {
+      return RepeatCountPieceValue(i);
+    }
+    for (int k = 0; k < kNumRepeatCountPieces; ++k) {
+      if (repeat_counts[k] == id) return RepeatCountPieceValue(k);
+    }
+    return 0;
+  }
+};
+
 class ModelProto;
+struct FlatViterbiModel;
 
 // Underlying model interface.
 // Given a normalized string, returns a sequence of sentence pieces with ids.
@@ -76,6 +144,40 @@ class ModelInterface {
     return matcher_.get();
   }
 
+  // Returns the ids of special pieces resolved at load time.
+  const SpecialPieceIds &special_piece_ids() const { return special_ids_; }
+
+  // Returns the scores and the types of the pieces as a table for
+  // SetQuantizedTables(): a little-endian float scale, the scores as
+  // little-endian int16 multiples of the scale, and the types packed in four
+  // bits each. The table takes 2.5 bytes per piece instead of 5.
+  std::string QuantizeTables() const;
+
+  // Makes the encoders read the scores and the types from `table`, made by
+  // QuantizeTables() of a model with the same pieces, and frees the float
+  // tables. `table` is used in place when it is suitably aligned, and should
+  // then not be deleted until the model is destroyed. Sets the status on
+  // errors. GetScore() still returns the scores of the model proto.
+  void SetQuantizedTables(absl::string_view table);
+
+  // Returns what this model precomputes for encoding with `mask`, which
+  // SentencePieceProcessor::MakeVocabularyMask() stores in the mask, or
+  // nullptr. `mask` has its unused pieces set.
+  virtual std::shared_ptr<const void> MakeVocabularyData(
+      const VocabularyMask &mask) const {
+    return nullptr;
+  }
+
+  // Restricts the vocabulary of all the encoders to `vocabulary`, or reverts
+  // to the piece types of the model when nullptr. Must not be called while
+  // other threads are encoding.
+  void SetVocabularyMask(std::shared_ptr<const VocabularyMask> vocabulary) {
+    vocabulary_ = std::move(vocabulary);
+  }
+
+  // Returns the vocabulary set by SetVocabularyMask(), or nullptr.
+  const VocabularyMask *vocabulary_mask() const { return vocabulary_.get(); }
+
   // Sets the encoder version. Currently only unigram has an optimized encoder.
   // The optimized version is always used by default if there is one, so
   // normally users do not need to call this function. This function is provided
@@ -89,10 +191,64 @@ class ModelInterface {
   // Returns the current encoder version in use.
   virtual EncoderVersion GetEncoderVersion() const { return encoder_version_; }
 
+  // Caches the pieces of up to `max_words` words in every thread, so that
+  // EncodeInto() segments a word seen before without running the model
+  // again. 0 disables the cache. Fails unless U+2581 only starts pieces, as
+  // a segmentation then never crosses the start of a word. Must not be
+  // called while other threads are encoding.
+  util::Status SetWordCacheSize(int max_words);
+
+  int word_cache_size() const { return word_cache_size_; }
+
+  // Prunes the lattices of SampleEncode() and SampleEncodeAndScore() with
+  // the relative beam `beam` of unigram::Lattice::SamplePruned(). 0 samples
+  // from the full lattices. Must not be called while other threads are
+  // encoding.
+  util::Status SetSampleBeam(float beam);
+
+  float sample_beam() const { return sample_beam_; }
+
   // Given a normalized string, returns a sequence of sentence pieces with ids.
   // The concatenation of pieces must be the same as `normalized`.
   virtual EncodeResult Encode(absl::string_view normalized) const = 0;
 
+  // Same as Encode(), but restricts the vocabulary to `vocabulary` instead of
+  // the one set by SetVocabularyMask() when it is not nullptr.
+  virtual EncodeResult EncodeWithVocabulary(
+      absl::string_view normalized, const VocabularyMask *vocabulary) const {
+    if (vocabulary == nullptr) return Encode(normalized);
+    LOG(ERROR) << "Not implemented.";
+    return EncodeResult();
+  }
+
+  // Same as EncodeWithVocabulary(), but stores the pieces in `result`. Models
+  // overriding it reuse the capacity of `result` and allocate nothing once
+  // their per-thread buffers have grown to the input size.
+  virtual void EncodeInto(absl::string_view normalized,
+                          const VocabularyMask *vocabulary,
+                          EncodeResult *result) const {
+    *result = EncodeWithVocabulary(normalized, vocabulary);
+  }
+
+  // Same as EncodeInto(), but stores the pieces as byte ranges of
+  // `normalized`, which must be shorter than 4GB. `pieces` is scratch space
+  // for the models which only implement EncodeInto().
+  virtual void EncodeCompact(absl::string_view normalized,
+                             const VocabularyMask *vocabulary,
+                             EncodeResult *pieces,
+                             CompactEncodeResult *result) const {
+    EncodeInto(normalized, vocabulary, pieces);
+    ToCompactEncodeResult(*pieces, result);
+  }
+
+  // Converts the pieces of `normalized` between EncodeResult and
+  // CompactEncodeResult.
+  void ToCompactEncodeResult(const EncodeResult &pieces,
+                             CompactEncodeResult *result) const;
+  void ToEncodeResult(absl::string_view normalized,
+                      const CompactEncodeResult &result,
+                      EncodeResult *pieces) const;
+
   // The same as above, but returns nbest result with score.
   virtual NBestEncodeResult NBestEncode(absl::string_view normalized,
                                         int nbest_size) const {
@@ -100,15 +256,72 @@ class ModelInterface {
     return NBestEncodeResult();
   }
 
+  // Calls `fn` with the results of NBestEncode() and their scores, best
+  // first, until `fn` returns false. The result passed to `fn` is only valid
+  // during the call, so that models finding the results one by one need not
+  // keep them all.
+  virtual void VisitNBestEncode(
+      absl::string_view normalized, int nbest_size,
+      const std::function<bool(const EncodeResult &, float)> &fn) const {
+    for (const auto &result : NBestEncode(normalized, nbest_size)) {
+      if (!fn(result.first, result.second)) break;
+    }
+  }
+
   virtual EncodeResult SampleEncode(absl::string_view normalized,
                                     float alpha) const {
     LOG(ERROR) << "Not implemented.";
     return EncodeResult();
   }
 
+  // Draws `num_samples` segmentations in the same way as SampleEncode() and
+  // returns them with their log-probabilities. When `unique` is true,
+  // repeated segmentations are returned only once.
+  virtual NBestEncodeResult SampleEncodeAndScore(absl::string_view normalized,
+                                                 float alpha, int num_samples,
+                                                 bool unique) const {
+    LOG(ERROR) << "Not implemented.";
+    return NBestEncodeResult();
+  }
+
+  // Returns the entropy of the distribution over the segmentations of
+  // `normalized` that SampleEncode(normalized, alpha) draws from.
+  virtual float CalculateEntropy(absl::string_view normalized,
+                                 float alpha) const {
+    LOG(ERROR) << "Not implemented.";
+    return 0.0;
+  }
+
+  // Adds to (*marginals)[id] the expected number of occurrences of piece
+  // `id` in a segmentation of `normalized` drawn as SampleEncode(normalized,
+  // alpha) does. `marginals` must have GetPieceSize() elements.
+  virtual void PopulateMarginals(absl::string_view normalized, float alpha,
+                                 std::vector<float> *marginals) const {
+    LOG(ERROR) << "Not implemented.";
+  }
+
+  // Return true if CalculateEntropy and PopulateMarginals return valid
+  // results.
+  virtual bool IsLatticeStatisticsAvailable() const { return false; }
+
+  // Adds the bytes of the tables of this model to `usage`, with the buffers
+  // the calling thread keeps for it. Models with their own tables or
+  // buffers add them after calling this method.
+  virtual void AddMemoryUsage(MemoryUsage *usage) const;
+
+  // Copies the tables of the encoder to `flat` for the batch encoders of
+  // batch_viterbi.h. Returns false if the model segments otherwise, e.g.,
+  // with another model type or encoder version.
+  virtual bool ExportFlatViterbi(FlatViterbiModel *flat) const {
+    return false;
+  }
+
   // Return true if SampleEncode returns a valid result.
   virtual bool IsSampleEncodeAvailable() const { return false; }
 
+  // Return true if SampleEncodeAndScore returns a valid result.
+  virtual bool IsSampleEncodeAndScoreAvailable() const { return false; }
+
   // Return true if NBestEncode returns a valid result.
   virtual bool IsNBestEncodeAvailable() const { return false; }
 
@@ -147,6 +360,7 @@ class ModelInterface {
 
   // Returns true if `id` is unused symbol.
   virtual bool IsUnused(int id) const {
+    if (vocabulary_ != nullptr) return vocabulary_->IsUnused(id);
     return (model_proto_->pieces(id).type() ==
             ModelProto::SentencePiece::UNUSED);
   }
@@ -166,6 +380,24 @@ class ModelInterface {
     return model_proto_ && model_proto_->trainer_spec().byte_fallback();
   }
 
+  // Returns the id of the byte piece of `byte`, which is the same as
+  // PieceToId(ByteToPiece(byte)) but looked up in a table built at load time
+  // when byte fallback is enabled.
+  int ByteToId(unsigned char byte) const {
+    return byte_to_id_.empty() ? PieceToId(ByteToPiece(byte))
+                               : byte_to_id_[byte];
+  }
+
+  // Returns the byte of the byte piece `id`, or -1 if `id` is not a byte
+  // piece, the same as PieceToByte(IdToPiece(id)) for byte pieces.
+  int IdToByte(int id) const {
+    if (id_to_byte_.empty()) {
+      return IsByte(id) ? PieceToByte(IdToPiece(id)) : -1;
+    }
+    const size_t index = static_cast<size_t>(id - byte_ids_begin_);
+    return index < id_to_byte_.size() ? id_to_byte_[index] : -1;
+  }
+
   // Verifies if the `expected` and `actual` outputs are equivalent. `expected`
   // and `actual` are sentence pieces joined by space (` `). Normally it means
   // that the two strings are identical. In some model, due to float rounding
@@ -179,33 +411,85 @@ class ModelInterface {
  protected:
   void InitializePieces();
 
-  // Non-virtual (inlined) implementation for faster execution.
+  // Resolves `special_ids_`. Called at the end of InitializePieces().
+  void InitializeSpecialPieceIds();
+
+  // Builds `piece_ids_` from `pieces_` and `reserved_id_map_`. Called by
+  // InitializePieces().
+  void BuildPieceIds();
+
+  // Sets the id of every piece in `output` in the same way as
+  // ModelInterface::PieceToId(), but looks up a batch of pieces at a time.
+  void PiecesToIds(EncodeResult *output) const;
+
+  // Encodes `normalized` word by word when the word cache is enabled and
+  // returns true. Words found in the cache of the calling thread are copied
+  // from it, and the others are encoded with `encode_word`, which stores the
+  // pieces of one word in its second argument. Returns false, doing
+  // nothing, when the cache is disabled.
+  bool EncodeWords(
+      absl::string_view normalized,
+      const std::function<void(absl::string_view, EncodeResult *)>
+          &encode_word,
+      EncodeResult *results) const;
+
+  // Returns the first slot of `piece_ids_` to probe for `piece`.
+  size_t PieceIdSlotIndex(absl::string_view piece) const;
+
+  // Non-virtual (inlined) implementation for faster execution. They read
+  // the flat tables filled by InitializePieces(), or the quantized ones set
+  // by SetQuantizedTables(), instead of the pieces in `model_proto_`.
   inline float GetScoreInlined(int id) const {
-    return model_proto_->pieces(id).score();
+    return quantized_scores_ != nullptr ? score_scale_ * quantized_scores_[id]
+                                        : scores_[id];
+  }
+
+  inline int PieceTypeInlined(int id) const {
+    return packed_types_ != nullptr
+               ? (packed_types_[id >> 1] >> ((id & 1) << 2)) & 0xF
+               : types_[id];
   }
 
   inline bool IsUnknownInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::UNKNOWN);
+    return PieceTypeInlined(id) == ModelProto::SentencePiece::UNKNOWN;
   }
 
   inline bool IsControlInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::CONTROL);
+    return PieceTypeInlined(id) == ModelProto::SentencePiece::CONTROL;
   }
 
   inline bool IsUnusedInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::UNUSED);
+    return PieceTypeInlined(id) == ModelProto::SentencePiece::UNUSED;
+  }
+
+  // Same as IsUnusedInlined(id), but follows `vocabulary` when it is not
+  // nullptr.
+  inline bool IsUnusedInlined(int id, const VocabularyMask *vocabulary) const {
+    return vocabulary != nullptr ? vocabulary->IsUnused(id)
+                                 : IsUnusedInlined(id);
+  }
+
+  // Returns the MakeVocabularyData() of this model stored in `vocabulary`,
+  // or nullptr if the mask was made for another model.
+  const void *VocabularyData(const VocabularyMask *vocabulary) const {
+    return vocabulary != nullptr && vocabulary->model_ == this
+               ? vocabulary->model_data_.get()
+               : nullptr;
+  }
+
+  // Returns `vocabulary`, or the one set by SetVocabularyMask() when it is
+  // nullptr.
+  const VocabularyMask *ActiveVocabulary(
+      const VocabularyMask *vocabulary) const {
+    return vocabulary != nullptr ? vocabulary : vocabulary_.get();
   }
 
   inline bool IsUserDefinedInlined(int id) const {
-    return (model_proto_->pieces(id).type() ==
-            ModelProto::SentencePiece::USER_DEFINED);
+    return PieceTypeInlined(id) == ModelProto::SentencePiece::USER_DEFINED;
   }
 
   inline bool IsByteInlined(int id) const {
-    return (model_proto_->pieces(id).type() == ModelProto::SentencePiece::BYTE);
+    return PieceTypeInlined(id) == ModelProto::SentencePiece::BYTE;
   }
 
   const ModelProto *model_proto_ = nullptr;
@@ -219,13 +503,63 @@ class ModelInterface {
   // piece -> id map for control, unknown, and byte pieces
   PieceToIdMap reserved_id_map_;
 
+  // A piece and its id in `piece_ids_`. `id` is -1 for empty slots.
+  struct PieceIdSlot {
+    const char *data = nullptr;
+    uint32 size = 0;
+    int id = -1;
+  };
+
+  // Open-addressing table of all pieces, so that PieceToId() resolves a
+  // piece with one probe in most cases instead of looking it up in
+  // `reserved_id_map_` and `pieces_`. The size is a power of two.
+  std::vector<PieceIdSlot> piece_ids_;
+  int piece_ids_shift_ = 63;  // 64 - log2(piece_ids_.size()).
+
+  // Scores and types (ModelProto::SentencePiece::Type) of the pieces indexed
+  // by id. Emptied by SetQuantizedTables().
+  std::vector<float> scores_;
+  std::vector<uint8> types_;
+
+  // The tables set by SetQuantizedTables(), or nullptr. A score is
+  // `score_scale_` times its int16, and the type of piece `id` is the low
+  // (even id) or high (odd id) four bits of packed_types_[id / 2]. They
+  // point into the table given to SetQuantizedTables(), or into
+  // `quantized_buffer_` when it had to be copied.
+  const int16 *quantized_scores_ = nullptr;
+  const uint8 *packed_types_ = nullptr;
+  float score_scale_ = 0.0;
+  std::string quantized_buffer_;
+
+  // Byte piece tables of byte fallback models, empty for other models.
+  // `id_to_byte_` covers the ids from `byte_ids_begin_` to the last byte
+  // piece, with -1 for the other pieces in that range.
+  std::vector<int> byte_to_id_;
+  std::vector<int16> id_to_byte_;
+  int byte_ids_begin_ = 0;
+
+  // Vocabulary restriction set by SetVocabularyMask(). Overrides the UNUSED
+  // types in `types_` when not nullptr.
+  std::shared_ptr<const VocabularyMask> vocabulary_;
+
   // unknown id.
   int unk_id_ = 0;
 
+  // Ids of reserved, repeat and case marker pieces.
+  SpecialPieceIds special_ids_;
+
   // The encoder version. Currently it is only effective for unigram model but
   // ignored by other models.
   EncoderVersion encoder_version_ = EncoderVersion::kOptimized;
 
+  // Set by SetWordCacheSize(). The per-thread caches belong to a generation,
+  // which is unique to a model and its cache size, or 0 when disabled.
+  int word_cache_size_ = 0;
+
+  // Set by SetSampleBeam().
+  float sample_beam_ = 0.0;
+  uint64 word_cache_generation_ = 0;
+
   // status.
   util::Status status_;
 };
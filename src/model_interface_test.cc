@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <random>
+
 #include "model_factory.h"
 #include "model_interface.h"
 #include "testharness.h"
@@ -206,6 +208,59 @@ TEST(ModelInterfaceTest, PieceToIdTest) {
   }
 }
 
+TEST(ModelInterfaceTest, PieceToIdPrefixTest) {
+  for (const auto type : kModelTypes) {
+    ModelProto model_proto = MakeBaseModelProto(type);
+    AddPiece(&model_proto, "ab", 0.1);   // 3
+    AddPiece(&model_proto, "abc", 0.2);  // 4
+    AddPiece(&model_proto, "<s>", 0.3);  // 5, shadowed by the control piece.
+
+    auto model = ModelFactory::Create(model_proto);
+    EXPECT_TRUE(model->status().ok());
+
+    EXPECT_EQ(3, model->PieceToId("ab"));
+    EXPECT_EQ(4, model->PieceToId("abc"));
+    EXPECT_EQ(1, model->PieceToId("<s>"));
+    EXPECT_EQ(0, model->PieceToId("a"));
+    EXPECT_EQ(0, model->PieceToId("abcd"));
+    EXPECT_EQ(0, model->PieceToId(absl::string_view("abc", 1)));
+    EXPECT_EQ(0, model->PieceToId(absl::string_view("abc", 0)));
+  }
+}
+
+TEST(ModelInterfaceTest, SpecialPieceIdsTest) {
+  for (const auto type : kModelTypes) {
+    ModelProto model_proto = MakeBaseModelProto(type);
+    AddPiece(&model_proto, "a");               // 3
+    AddPiece(&model_proto, "(#startrepeat)");  // 4
+    AddPiece(&model_proto, "(#endrepeat)");    // 5
+    AddPiece(&model_proto, "3");               // 6
+    AddPiece(&model_proto, "U");               // 7
+    AddPiece(&model_proto, "<pad>");           // 8
+    model_proto.mutable_pieces(8)->set_type(
+        ModelProto::SentencePiece::USER_DEFINED);
+
+    auto model = ModelFactory::Create(model_proto);
+    EXPECT_TRUE(model->status().ok());
+
+    const auto &special = model->special_piece_ids();
+    EXPECT_EQ(0, special.unk);
+    EXPECT_EQ(1, special.bos);
+    EXPECT_EQ(2, special.eos);
+    EXPECT_EQ(-1, special.pad);  // not a control symbol.
+    EXPECT_EQ(4, special.start_repeat);
+    EXPECT_EQ(5, special.end_repeat);
+    for (int d = 0; d < 10; ++d) {
+      EXPECT_EQ(d == 3 ? 6 : 0, special.digits[d]);
+    }
+    EXPECT_EQ(7, special.upper);
+    EXPECT_EQ(0, special.all_upper);
+    EXPECT_EQ(0, special.title);
+    EXPECT_EQ(0, special.lower);
+    EXPECT_EQ(0, special.punctuation);
+  }
+}
+
 TEST(ModelInterfaceTest, InvalidModelTest) {
   // Empty piece.
   {
@@ -250,6 +305,32 @@ TEST(ModelInterfaceTest, ByteFallbackModelTest) {
     AddPiece(&model_proto, "a");
     auto model = ModelFactory::Create(model_proto);
     EXPECT_TRUE(model->status().ok());
+
+    for (int i = 0; i < 256; ++i) {
+      const int id = model->ByteToId(i);
+      EXPECT_EQ(model->PieceToId(ByteToPiece(i)), id);
+      EXPECT_EQ(i, model->IdToByte(id));
+    }
+    EXPECT_EQ(-1, model->IdToByte(-1));
+    EXPECT_EQ(-1, model->IdToByte(0));
+    EXPECT_EQ(-1, model->IdToByte(model->PieceToId("a")));
+    EXPECT_EQ(-1, model->IdToByte(model->GetPieceSize()));
+  }
+
+  // The byte pieces need not be consecutive.
+  {
+    ModelProto model_proto = MakeBaseModelProto(TrainerSpec::BPE, true);
+    for (int i = 0; i < 256; ++i) {
+      AddPiece(&model_proto, "x" + std::to_string(i));
+      AddBytePiece(&model_proto, 255 - i);
+    }
+    auto model = ModelFactory::Create(model_proto);
+    EXPECT_TRUE(model->status().ok());
+    for (int i = 0; i < 256; ++i) {
+      EXPECT_EQ(model->PieceToId(ByteToPiece(i)), model->ByteToId(i));
+      EXPECT_EQ(i, model->IdToByte(model->ByteToId(i)));
+      EXPECT_EQ(-1, model->IdToByte(model->PieceToId("x" + std::to_string(i))));
+    }
   }
 
   // `byte_fallback` is true, but there are not 256 byte pieces.
@@ -412,6 +493,44 @@ TEST(ModelInterfaceTest, SplitIntoWordsSuffixTest) {
   }
 }
 
+TEST(ModelInterfaceTest, SplitIntoWordsMalformedTest) {
+  // Splits `text` by decoding every character, as SplitIntoWords() did
+  // before it searched for U+2581 directly.
+  auto split = [](absl::string_view text, bool suffix) {
+    std::vector<absl::string_view> result;
+    const char *begin = text.data();
+    const char *end = text.data() + text.size();
+    if (suffix && begin < end) result.emplace_back(begin, 0);
+    while (begin < end) {
+      const int mblen =
+          std::min<int>(string_util::OneCharLen(begin), end - begin);
+      const bool is_ws = absl::string_view(begin, mblen) == WS;
+      if (!suffix && (begin == text.data() || is_ws)) {
+        result.emplace_back(begin, 0);
+      }
+      result.back() =
+          absl::string_view(result.back().data(), result.back().size() + mblen);
+      begin += mblen;
+      if (suffix && begin < end && is_ws) result.emplace_back(begin, 0);
+    }
+    return result;
+  };
+
+  // Lead bytes before U+2581 may swallow it. Long inputs also go through
+  // the 16-byte scan.
+  const char kBytes[] = {'\xe2', '\x96', '\x81', 'a', '\xc3', '\xf0', '\x80'};
+  std::mt19937 mt(0);
+  std::uniform_int_distribution<int> dist(0, sizeof(kBytes) - 1);
+  for (int n = 0; n < 1000; ++n) {
+    std::string text;
+    const int length = n % 64;
+    for (int i = 0; i < length; ++i) text += kBytes[dist(mt)];
+    for (const bool suffix : {false, true}) {
+      EXPECT_EQ(split(text, suffix), SplitIntoWords(text, suffix));
+    }
+  }
+}
+
 TEST(ModelInterfaceTest, ByteToPieceTest) {
   EXPECT_EQ(ByteToPiece(0), "<0x00>");
   EXPECT_EQ(ByteToPiece(1), "<0x01>");
@@ -469,5 +588,57 @@ TEST(ModelInterfaceTest, VerifyOutputsEquivalent) {
   }
 }
 
+TEST(ModelInterfaceTest, EncodeCompactTest) {
+  for (const auto type : kModelTypes) {
+    ModelProto model_proto = MakeBaseModelProto(type);
+    AddPiece(&model_proto, "a", 0.1);
+    AddPiece(&model_proto, "b", 0.2);
+    AddPiece(&model_proto, "ab", 0.3);
+    AddPiece(&model_proto, "abc", 0.4);
+    AddPiece(&model_proto, "c", 0.5);
+    AddPiece(&model_proto, "\xE2\x96\x81", 0.6);
+    AddPiece(&model_proto, "\xE2\x96\x81" "ab", 0.7);
+    auto model = ModelFactory::Create(model_proto);
+    ASSERT_TRUE(model->status().ok());
+
+    for (const absl::string_view normalized :
+         {"", "abc", "\xE2\x96\x81" "abcx" "\xE2\x96\x81" "abab",
+          "\xE2\x96\x81" "ab" "\xE3\x81\x82" "c"}) {
+      EncodeResult expected, pieces;
+      CompactEncodeResult result;
+      model->EncodeInto(normalized, nullptr, &expected);
+      model->EncodeCompact(normalized, nullptr, &pieces, &result);
+      EncodeResult converted;
+      model->ToEncodeResult(normalized, result, &converted);
+      EXPECT_EQ(expected, converted);
+
+      CompactEncodeResult expected_compact;
+      model->ToCompactEncodeResult(expected, &expected_compact);
+      ASSERT_EQ(expected_compact.size(), result.size());
+      for (size_t i = 0; i < result.size(); ++i) {
+        EXPECT_EQ(expected_compact[i].begin, result[i].begin);
+        EXPECT_EQ(expected_compact[i].length, result[i].length);
+        EXPECT_EQ(expected_compact[i].id, result[i].id);
+      }
+    }
+  }
+
+  // Control symbols cover no input.
+  ModelProto model_proto = MakeBaseModelProto(TrainerSpec::UNIGRAM);
+  AddPiece(&model_proto, "a");
+  auto model = ModelFactory::Create(model_proto);
+  const EncodeResult pieces = {{"<s>", 1}, {"a", 3}, {"a", 3}, {"</s>", 2}};
+  CompactEncodeResult result;
+  model->ToCompactEncodeResult(pieces, &result);
+  ASSERT_EQ(4, result.size());
+  EXPECT_EQ(0, result[0].length);
+  EXPECT_EQ(1, result[2].begin);
+  EXPECT_EQ(2, result[3].begin);
+  EXPECT_EQ(0, result[3].length);
+  EncodeResult converted;
+  model->ToEncodeResult("aa", result, &converted);
+  EXPECT_EQ(pieces, converted);
+}
+
 }  // namespace
 }  // namespace sentencepiece
@@ -14,10 +14,14 @@
 
 #include "normalizer.h"
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
 #include <utility>
 #include <vector>
 
 #include "common.h"
+#include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/match.h"
 #include "third_party/absl/strings/string_view.h"
@@ -25,11 +29,100 @@
 #include "third_party/darts_clone/darts.h"
 #include "util.h"
 #include "case_encoder.h"
+#include "encode_stats.h"
+#include "specialized_normalizer_rule.h"
 
 namespace sentencepiece {
 namespace normalizer {
 
 constexpr int Normalizer::kMaxTrieResultsSize;
+constexpr int Normalizer::kUserDefinedSymbolValue;
+constexpr int32 SpecializedCharsMap::kNoRule;
+constexpr int32 SpecializedCharsMap::kTrie;
+
+namespace {
+// The byte length of U+2581, which escapes a space.
+constexpr size_t kSpaceSymbolSize = 3;
+
+// Returns a case encoder of type T. Case encoders keep their buffers between
+// inputs, so each thread reuses one instance rather than allocating it for
+// every Normalize() call. `local` owns the instance when thread_local is
+// disabled.
+template <typename T>
+T *GetCaseEncoder(std::unique_ptr<CaseEncoder> *local) {
+#ifdef SPM_NO_THREADLOCAL
+  T *encoder = new T;
+  local->reset(encoder);
+#else
+  thread_local static T instance;
+  T *encoder = &instance;
+#endif
+  encoder->Reset();
+  return encoder;
+}
+
+// Appends every key of `trie` below `node_pos` and its value to `entries`
+// in lexicographical order. At the root, only the bytes in `first_bytes`
+// are expanded. Unlike Builder::DecompileCharsMap(), this reads the units
+// of the double array directly, which is several times faster than calling
+// traverse() for every byte of every node.
+void CollectTrieKeys(const Darts::DoubleArray &trie, size_t node_pos,
+                     const std::bitset<256> &first_bytes, std::string *key,
+                     std::vector<std::pair<std::string, int>> *entries) {
+  using Unit = Darts::Details::DoubleArrayUnit;
+  const Unit *units = static_cast<const Unit *>(trie.array());
+  const size_t base = node_pos ^ units[node_pos].offset();
+  for (unsigned int c = 1; c <= 255; ++c) {
+    if (key->empty() && !first_bytes[c]) continue;
+    const size_t child_pos = base ^ c;
+    if (child_pos >= trie.size() || units[child_pos].label() != c) continue;
+    key->push_back(static_cast<char>(c));
+    const Unit &child = units[child_pos];
+    if (child.has_leaf()) {
+      entries->emplace_back(*key, units[child_pos ^ child.offset()].value());
+    }
+    CollectTrieKeys(trie, child_pos, first_bytes, key, entries);
+    key->pop_back();
+  }
+}
+
+// Returns true if a key of `trie` is longer than the key ending at
+// `node_pos`.
+bool HasChildren(const Darts::DoubleArray &trie, size_t node_pos) {
+  using Unit = Darts::Details::DoubleArrayUnit;
+  const Unit *units = static_cast<const Unit *>(trie.array());
+  const size_t base = node_pos ^ units[node_pos].offset();
+  for (unsigned int c = 1; c <= 255; ++c) {
+    const size_t child_pos = base ^ c;
+    if (child_pos < trie.size() && units[child_pos].label() == c) return true;
+  }
+  return false;
+}
+
+// Returns the bytes that start at least one key of `trie`.
+std::bitset<256> GetFirstBytes(const Darts::DoubleArray &trie) {
+  std::bitset<256> first_bytes;
+  for (int c = 0; c < 256; ++c) {
+    const char key = static_cast<char>(c);
+    size_t node_pos = 0, key_pos = 0;
+    first_bytes[c] = trie.traverse(&key, node_pos, key_pos, 1) != -2;
+  }
+  return first_bytes;
+}
+}  // namespace
+
+struct Normalizer::CharsMap {
+  uint64 fingerprint = 0;  // of |blob|.
+  std::string blob;        // the precompiled charsmap.
+#ifdef IS_BIG_ENDIAN
+  // Stores the blob for TRIE encoded in big-endian.
+  std::string buffer;
+#endif
+  Darts::DoubleArray trie;  // points into |blob| or |buffer|.
+  std::bitset<256> first_bytes;
+  const char *normalized = nullptr;  // into |blob|.
+  const SpecializedCharsMap *specialized = nullptr;
+};
 
 Normalizer::Normalizer(const NormalizerSpec &spec,
                        const TrainerSpec &trainer_spec)
@@ -47,35 +140,210 @@ Normalizer::Normalizer(const NormalizerSpec &spec)
 Normalizer::~Normalizer() {}
 
 void Normalizer::Init() {
+  options_ = Options(
+      spec_->escape_whitespaces(), spec_->remove_extra_whitespaces(),
+      !treat_whitespace_as_suffix_ && spec_->add_dummy_prefix(),
+      treat_whitespace_as_suffix_ && spec_->add_dummy_prefix());
+
+  // The options of the default spec, of the spec without the dummy prefix
+  // and of spm_normalize have their own loops.
+  const bool escape = options_.escape_whitespaces();
+  const bool prefix = options_.add_dummy_prefix();
+  SetNormalizeFns<Options>();
+  if (options_.remove_extra_whitespaces() && !options_.add_dummy_suffix()) {
+    if (escape && prefix) {
+      SetNormalizeFns<FixedOptions<true, true, true>>();
+    } else if (escape) {
+      SetNormalizeFns<FixedOptions<true, true, false>>();
+    } else if (!prefix) {
+      SetNormalizeFns<FixedOptions<false, true, false>>();
+    }
+  }
+
   absl::string_view index = spec_->precompiled_charsmap();
   if (index.empty()) {
     LOG(INFO) << "precompiled_charsmap is empty. use identity normalization.";
   } else {
-    absl::string_view trie_blob, normalized;
+    status_ = GetSharedCharsMap(index, &charsmap_);
+    if (!status_.ok()) return;
+    trie_ = &charsmap_->trie;
+    trie_first_bytes_ = charsmap_->first_bytes;
+    normalized_ = charsmap_->normalized;
+    specialized_ = charsmap_->specialized;
+  }
+}
+
+namespace {
+// The charsmaps of the live normalizers by fingerprint. The entry of a
+// charsmap is removed when its last normalizer is destroyed.
+struct CharsMapRegistry {
+  std::mutex mutex;
+  absl::flat_hash_map<uint64, std::weak_ptr<const Normalizer::CharsMap>> maps;
+};
+
+// Never destroyed, since normalizers may outlive the static destructors.
+CharsMapRegistry *GetCharsMapRegistry() {
+  static CharsMapRegistry *registry = new CharsMapRegistry;
+  return registry;
+}
+}  // namespace
+
+// static
+util::Status Normalizer::GetSharedCharsMap(
+    absl::string_view blob, std::shared_ptr<const CharsMap> *charsmap) {
+  const uint64 fingerprint = FingerprintPrecompiledCharsMap(blob);
+  auto *registry = GetCharsMapRegistry();
+  {
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    const auto it = registry->maps.find(fingerprint);
+    if (it != registry->maps.end()) {
+      *charsmap = it->second.lock();
+      if (*charsmap != nullptr && (*charsmap)->blob == blob) {
+        return util::OkStatus();
+      }
+    }
+  }
+
+  // Decodes the blob without the lock. Two normalizers of a new blob may
+  // both decode it, and the later one is then not shared.
+  auto decoded = absl::make_unique<CharsMap>();
+  decoded->fingerprint = fingerprint;
+  decoded->blob.assign(blob.data(), blob.size());
+  absl::string_view trie_blob, normalized;
 #ifdef IS_BIG_ENDIAN
-    status_ = DecodePrecompiledCharsMap(index, &trie_blob, &normalized,
-                                        &precompiled_charsmap_buffer_);
+  RETURN_IF_ERROR(DecodePrecompiledCharsMap(decoded->blob, &trie_blob,
+                                            &normalized, &decoded->buffer));
 #else
-    status_ = DecodePrecompiledCharsMap(index, &trie_blob, &normalized);
+  RETURN_IF_ERROR(
+      DecodePrecompiledCharsMap(decoded->blob, &trie_blob, &normalized));
 #endif
-    if (!status_.ok()) return;
 
-    // Reads the body of double array.
-    trie_ = absl::make_unique<Darts::DoubleArray>();
+  // The second arg of set_array is not the size of blob,
+  // but the number of double array units.
+  decoded->trie.set_array(const_cast<char *>(trie_blob.data()),
+                          trie_blob.size() / decoded->trie.unit_size());
+  decoded->first_bytes = GetFirstBytes(decoded->trie);
+  decoded->normalized = normalized.data();
+  for (const auto &specialized : kSpecializedCharsMaps) {
+    if (specialized.fingerprint == fingerprint) {
+      decoded->specialized = &specialized;
+    }
+  }
+
+  // The deleter removes the entry, unless it was replaced meanwhile.
+  charsmap->reset(decoded.release(), [](const CharsMap *map) {
+    auto *registry = GetCharsMapRegistry();
+    {
+      std::lock_guard<std::mutex> lock(registry->mutex);
+      const auto it = registry->maps.find(map->fingerprint);
+      if (it != registry->maps.end() && it->second.expired()) {
+        registry->maps.erase(it);
+      }
+    }
+    delete map;
+  });
 
-    // The second arg of set_array is not the size of blob,
-    // but the number of double array units.
-    trie_->set_array(const_cast<char *>(trie_blob.data()),
-                     trie_blob.size() / trie_->unit_size());
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  auto &entry = registry->maps[fingerprint];
+  if (entry.expired()) entry = *charsmap;
+  return util::OkStatus();
+}
 
-    normalized_ = normalized.data();
+// static
+size_t Normalizer::NumSharedCharsMaps() {
+  auto *registry = GetCharsMapRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  size_t num_maps = 0;
+  for (const auto &it : registry->maps) {
+    if (!it.second.expired()) ++num_maps;
+  }
+  return num_maps;
+}
+
+// static
+size_t Normalizer::SharedCharsMapsMemoryUsage() {
+  auto *registry = GetCharsMapRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  size_t bytes = 0;
+  for (const auto &it : registry->maps) {
+    const auto charsmap = it.second.lock();
+    if (charsmap == nullptr) continue;
+    bytes += sizeof(CharsMap) + port::ContainerBytes(charsmap->blob);
+#ifdef IS_BIG_ENDIAN
+    bytes += port::ContainerBytes(charsmap->buffer);
+#endif
   }
+  return bytes;
+}
+
+void Normalizer::SetPrefixMatcher(const PrefixMatcher *matcher) {
+  matcher_ = matcher;
+  merged_trie_.reset();
+  if (matcher_ == nullptr || matcher_->trie_ == nullptr) return;
+
+  // Only the rules sharing their first byte with a user defined symbol are
+  // merged, since the other positions never match a symbol. A user defined
+  // symbol takes precedence over the rule of the same key.
+  user_defined_first_bytes_ = matcher_->first_bytes_;
+  std::vector<std::pair<std::string, int>> rules, symbols;
+  std::string key;
+  if (trie_ != nullptr) {
+    CollectTrieKeys(*trie_, 0, user_defined_first_bytes_, &key, &rules);
+  }
+  CollectTrieKeys(*matcher_->trie_, 0, user_defined_first_bytes_, &key,
+                  &symbols);
+
+  // Merges the sorted keys.
+  std::vector<const char *> keys;
+  std::vector<int> values;
+  keys.reserve(rules.size() + symbols.size());
+  values.reserve(rules.size() + symbols.size());
+  auto rule = rules.begin(), symbol = symbols.begin();
+  while (rule != rules.end() || symbol != symbols.end()) {
+    if (symbol == symbols.end() ||
+        (rule != rules.end() && rule->first < symbol->first)) {
+      keys.push_back(rule->first.c_str());
+      values.push_back(rule->second << 1);
+      ++rule;
+    } else {
+      if (rule != rules.end() && rule->first == symbol->first) ++rule;
+      keys.push_back(symbol->first.c_str());
+      values.push_back(kUserDefinedSymbolValue);
+      ++symbol;
+    }
+  }
+
+  merged_trie_ = absl::make_unique<Darts::DoubleArray>();
+  CHECK_EQ(0, merged_trie_->build(keys.size(), keys.data(), nullptr,
+                                  values.data()));
+}
+
+template <typename OptionsT>
+void Normalizer::SetNormalizeFns() {
+  normalize_fn_ = &Normalizer::NormalizeWithOptions<OptionsT, size_t>;
+  normalize32_fn_ = &Normalizer::NormalizeWithOptions<OptionsT, uint32>;
 }
 
 util::Status Normalizer::Normalize(absl::string_view input,
                                    std::string *normalized,
                                    std::vector<size_t> *norm_to_orig) const {
-  norm_to_orig->clear();
+  return NormalizeAligned(input, normalized, norm_to_orig, normalize_fn_);
+}
+
+util::Status Normalizer::Normalize(absl::string_view input,
+                                   std::string *normalized,
+                                   std::vector<uint32> *norm_to_orig) const {
+  CHECK_LT_OR_RETURN(input.size(), static_cast<size_t>(kuint32max))
+      << "The input is too long for 32-bit alignments.";
+  return NormalizeAligned(input, normalized, norm_to_orig, normalize32_fn_);
+}
+
+template <typename T>
+util::Status Normalizer::NormalizeAligned(absl::string_view input,
+                                          std::string *normalized,
+                                          std::vector<T> *norm_to_orig,
+                                          NormalizeFn<T> normalize_fn) const {
+  if (norm_to_orig != nullptr) norm_to_orig->clear();
   normalized->clear();
 
   if (input.empty()) {
@@ -84,10 +352,63 @@ util::Status Normalizer::Normalize(absl::string_view input,
 
   RETURN_IF_ERROR(status());
 
-  int consumed = 0;
+  std::unique_ptr<CaseEncoder> local_case_encoder;
+  if (spec_->encode_case() && spec_->decode_case()) {
+    LOG(ERROR) << "Cannot set both encodeCase=true and decodeCase=true";
+  } else if (spec_->encode_case()) {
+    stats::PhaseTimer timer;
+    auto *encoder = GetCaseEncoder<UpperCaseEncoder>(&local_case_encoder);
+    encoder->setRemoveExtraWhiteSpace(spec_->remove_extra_whitespaces());
+    const auto status =
+        NormalizeWithCaseEncoder(input, encoder, normalized, norm_to_orig);
+    timer.Lap(stats::kCaseEncodeNs);
+    return status;
+  } else if (spec_->decode_case()) {
+    auto *decoder = GetCaseEncoder<UpperCaseDecoder>(&local_case_encoder);
+    return NormalizeWithCaseEncoder(input, decoder, normalized, norm_to_orig);
+  }
+
+  return (this->*normalize_fn)(input, normalized, norm_to_orig);
+}
+
+template <typename OptionsT, typename T>
+util::Status Normalizer::NormalizeWithOptions(
+    absl::string_view input, std::string *normalized,
+    std::vector<T> *norm_to_orig) const {
+  return NormalizeInternal(
+      input, OptionsT(options_),
+      [this](absl::string_view input) { return NormalizePrefix(input); },
+      nullptr, normalized, norm_to_orig);
+}
+
+template <typename EncoderT, typename T>
+util::Status Normalizer::NormalizeWithCaseEncoder(
+    absl::string_view input, EncoderT *case_encoder, std::string *normalized,
+    std::vector<T> *norm_to_orig) const {
+  case_encoder->setNormalizer(
+      [](const void *normalizer, absl::string_view input) {
+        return static_cast<const Normalizer *>(normalizer)->NormalizePrefix(
+            input);
+      },
+      this);
+  // The encoders are final, so that this call is not virtual.
+  return NormalizeInternal(
+      input, options_,
+      [case_encoder](absl::string_view input) {
+        return case_encoder->normalizePrefix(input);
+      },
+      case_encoder, normalized, norm_to_orig);
+}
+
+template <typename OptionsT, typename NormalizePrefixFn, typename T>
+util::Status Normalizer::NormalizeInternal(
+    absl::string_view input, const OptionsT &options,
+    NormalizePrefixFn normalize_prefix, CaseEncoder *case_encoder,
+    std::string *normalized, std::vector<T> *norm_to_orig) const {
+  size_t consumed = 0;
 
   // Ignores heading space.
-  if (spec_->remove_extra_whitespaces()) {
+  if (options.remove_extra_whitespaces()) {
     while (!input.empty()) {
       const auto p = NormalizePrefix(input);
       if (p.first != " ") {
@@ -103,25 +424,33 @@ util::Status Normalizer::Normalize(absl::string_view input,
     return util::OkStatus();
   }
 
-  // Reserves the output buffer to avoid re-allocations.
-  const size_t kReservedSize = input.size() * 3;
-  normalized->reserve(kReservedSize);
-  norm_to_orig->reserve(kReservedSize);
+  // Reserves the size of the output without the rules that change the
+  // length of a character. Longer outputs grow the buffers geometrically,
+  // so that long inputs do not reserve several times their size.
+  size_t reserved_size = input.size() + 2 * kSpaceSymbolSize;
+  if (options.escape_whitespaces()) {
+    reserved_size +=
+        (kSpaceSymbolSize - 1) * std::count(input.begin(), input.end(), ' ');
+  }
+  normalized->reserve(reserved_size);
+  if (norm_to_orig != nullptr) norm_to_orig->reserve(reserved_size + 1);
 
   // Replaces white space with U+2581 (LOWER ONE EIGHT BLOCK)
   // if escape_whitespaces() is set (default = true).
   const absl::string_view kSpaceSymbol = "\xe2\x96\x81";
 
   // adds kSpaceSymbol to the current context.
-  auto add_ws = [this, &consumed, &normalized, &norm_to_orig, &kSpaceSymbol]() {
-    if (spec_->escape_whitespaces()) {
+  auto add_ws = [&options, &consumed, &normalized, &norm_to_orig,
+                 &kSpaceSymbol]() {
+    if (options.escape_whitespaces()) {
       normalized->append(kSpaceSymbol.data(), kSpaceSymbol.size());
-      for (size_t n = 0; n < kSpaceSymbol.size(); ++n) {
-        norm_to_orig->push_back(consumed);
+      if (norm_to_orig != nullptr) {
+        norm_to_orig->insert(norm_to_orig->end(), kSpaceSymbol.size(),
+                             consumed);
       }
     } else {
       normalized->append(" ");
-      norm_to_orig->push_back(consumed);
+      if (norm_to_orig != nullptr) norm_to_orig->push_back(consumed);
     }
   };
 
@@ -129,24 +458,14 @@ util::Status Normalizer::Normalize(absl::string_view input,
   // With this prefix, "world" and "hello world" are converted into
   // "_world" and "_hello_world", which help the trainer to extract
   // "_world" as one symbol.
-  if (!treat_whitespace_as_suffix_ && spec_->add_dummy_prefix()) add_ws();
+  if (options.add_dummy_prefix()) add_ws();
 
-  typedef std::function<std::pair<absl::string_view, int>(absl::string_view)> NormalizePrefixFn;
-  NormalizePrefixFn normalize_prefix_fn = [this](absl::string_view input) { 
-    return NormalizePrefix(input); 
-  };
+  // Bytes not produced by the case encoder.
+  const size_t case_offset = normalized->size();
 
-  std::unique_ptr<CaseEncoder> case_encoder = CaseEncoder::Create(spec_->encode_case(), spec_->decode_case(), spec_->remove_extra_whitespaces());
-  if(case_encoder) {
-    case_encoder->setNormalizer(normalize_prefix_fn);
-    normalize_prefix_fn = [&case_encoder](absl::string_view input) { 
-      return case_encoder->normalizePrefix(input); 
-    };
-  }
-
-  bool is_prev_space = spec_->remove_extra_whitespaces();
+  bool is_prev_space = options.remove_extra_whitespaces();
   while (!input.empty()) {
-    auto p = normalize_prefix_fn(input);
+    auto p = normalize_prefix(input);
     absl::string_view sp = p.first;
 
     // Removes heading spaces in sentence piece,
@@ -155,18 +474,28 @@ util::Status Normalizer::Normalize(absl::string_view input,
     }
 
     if (!sp.empty()) {
+      // All bytes of sp are aligned to the same original position, so runs
+      // without whitespace are appended in bulk.
       const char *data = sp.data();
-      for (size_t n = 0; n < sp.size(); ++n) {
-        if (spec_->escape_whitespaces() && data[n] == ' ') {
-          // replace ' ' with kSpaceSymbol.
-          normalized->append(kSpaceSymbol.data(), kSpaceSymbol.size());
-          for (size_t m = 0; m < kSpaceSymbol.size(); ++m) {
-            norm_to_orig->push_back(consumed);
-          }
-        } else {
-          *normalized += data[n];
-          norm_to_orig->push_back(consumed); 
+      const char *end = data + sp.size();
+      while (data < end) {
+        const char *ws =
+            options.escape_whitespaces()
+                ? static_cast<const char *>(std::memchr(data, ' ', end - data))
+                : nullptr;
+        const char *run_end = ws == nullptr ? end : ws;
+        normalized->append(data, run_end - data);
+        if (norm_to_orig != nullptr) {
+          norm_to_orig->insert(norm_to_orig->end(), run_end - data, consumed);
+        }
+        if (ws == nullptr) break;
+        // replace ' ' with kSpaceSymbol.
+        normalized->append(kSpaceSymbol.data(), kSpaceSymbol.size());
+        if (norm_to_orig != nullptr) {
+          norm_to_orig->insert(norm_to_orig->end(), kSpaceSymbol.size(),
+                               consumed);
         }
+        data = ws + 1;
       }
       // Checks whether the last character of sp is whitespace.
       is_prev_space = absl::EndsWith(sp, " ");
@@ -174,60 +503,139 @@ util::Status Normalizer::Normalize(absl::string_view input,
 
     consumed += p.second; 
     input.remove_prefix(p.second);
-    if (!spec_->remove_extra_whitespaces()) {
+    if (!options.remove_extra_whitespaces()) {
       is_prev_space = false;
     }
   }
 
   // Ignores tailing space.
-  if (spec_->remove_extra_whitespaces()) {
+  if (options.remove_extra_whitespaces()) {
     const absl::string_view space =
-        spec_->escape_whitespaces() ? kSpaceSymbol : " ";
+        options.escape_whitespaces() ? kSpaceSymbol : " ";
     while (absl::EndsWith(*normalized, space)) {
       const int length = normalized->size() - space.size();
       CHECK_GE_OR_RETURN(length, 0);
-      consumed = (*norm_to_orig)[length];
       normalized->resize(length);
-      norm_to_orig->resize(length);
+      if (norm_to_orig != nullptr) {
+        consumed = (*norm_to_orig)[length];
+        norm_to_orig->resize(length);
+      }
     }
   }
 
   // Adds a space symbol as a suffix (default is false)
-  if (treat_whitespace_as_suffix_ && spec_->add_dummy_prefix()) add_ws();
+  if (options.add_dummy_suffix()) add_ws();
 
-  norm_to_orig->push_back(consumed);
+  if (norm_to_orig != nullptr) norm_to_orig->push_back(consumed);
 
-  if(case_encoder)
-    case_encoder->postProcess(normalized, norm_to_orig);
+  if (case_encoder)
+    case_encoder->postProcess(normalized, norm_to_orig, case_offset);
 
-  CHECK_EQ_OR_RETURN(norm_to_orig->size(), normalized->size() + 1);
+  if (norm_to_orig != nullptr) {
+    CHECK_EQ_OR_RETURN(norm_to_orig->size(), normalized->size() + 1);
+  }
 
   return util::OkStatus();
 }
 
 std::string Normalizer::Normalize(absl::string_view input) const {
-  std::vector<size_t> norm_to_orig;
   std::string normalized;
-  Normalize(input, &normalized, &norm_to_orig).IgnoreError();
+  Normalize(input, &normalized, nullptr).IgnoreError();
   return normalized;
 }
 
+size_t Normalizer::MemoryUsage() const {
+  // The shared charsmap is counted by SharedCharsMapsMemoryUsage().
+  return merged_trie_ == nullptr ? 0 : merged_trie_->owned_size();
+}
+
+// static
+uint64 Normalizer::FingerprintPrecompiledCharsMap(absl::string_view blob) {
+  return port::Fingerprint(blob);
+}
+
+// static
+util::Status Normalizer::BuildSpecializedCharsMap(absl::string_view blob,
+                                                  std::vector<int32> *values) {
+  CHECK_OR_RETURN(values);
+  absl::string_view trie_blob, normalized;
+  std::string buffer;
+  RETURN_IF_ERROR(
+      DecodePrecompiledCharsMap(blob, &trie_blob, &normalized, &buffer));
+  Darts::DoubleArray trie;
+  trie.set_array(const_cast<char *>(trie_blob.data()),
+                 trie_blob.size() / trie.unit_size());
+
+  // NUL is never a key, and is left to the trie.
+  values->assign(256, SpecializedCharsMap::kTrie);
+  for (int c = 1; c < 256; ++c) {
+    char key[2];
+    size_t key_size = 1;
+    if (c < 0x80) {
+      key[0] = static_cast<char>(c);
+    } else {
+      key[0] = static_cast<char>(0xC0 | (c >> 6));
+      key[1] = static_cast<char>(0x80 | (c & 0x3F));
+      key_size = 2;
+    }
+    size_t node_pos = 0, key_pos = 0;
+    const int value = trie.traverse(key, node_pos, key_pos, key_size);
+    if (value != -2 && HasChildren(trie, node_pos)) continue;
+    (*values)[c] = value >= 0 ? value : SpecializedCharsMap::kNoRule;
+  }
+  return util::OkStatus();
+}
+
 std::pair<absl::string_view, int> Normalizer::NormalizePrefix(
     absl::string_view input) const {
   std::pair<absl::string_view, int> result;
 
   if (input.empty()) return result;
 
-  if (matcher_ != nullptr) {
-    bool found = false;
-    const int mblen = matcher_->PrefixMatch(input, &found);
-    if (found) return std::make_pair(input.substr(0, mblen), mblen);
-  }
-
   size_t longest_length = 0;
   int longest_value = 0;
 
-  if (trie_ != nullptr) {
+  const unsigned char first = static_cast<unsigned char>(input[0]);
+  const bool user_defined =
+      merged_trie_ != nullptr && user_defined_first_bytes_[first];
+  if (specialized_ != nullptr && !user_defined &&
+      (first < 0x80 || ((first == 0xC2 || first == 0xC3) &&
+                        input.size() >= 2 && (input[1] & 0xC0) == 0x80))) {
+    // U+0000 - U+00FF, which are one byte long, or 0xC2 or 0xC3 followed by
+    // a continuation byte.
+    const int length = first < 0x80 ? 1 : 2;
+    const int c =
+        first < 0x80 ? first : ((first & 0x1F) << 6) | (input[1] & 0x3F);
+    const int32 value = specialized_->values[c];
+    if (value == SpecializedCharsMap::kNoRule) {
+      return std::make_pair(input.substr(0, length), length);
+    } else if (value != SpecializedCharsMap::kTrie) {
+      return std::make_pair(absl::string_view(&normalized_[value]), length);
+    }
+  }
+
+  if (user_defined) {
+    // Walks the merged trie once for both the longest user defined symbol,
+    // which is never normalized, and the longest rule.
+    size_t user_defined_length = 0;
+    size_t node_pos = 0, key_pos = 0;
+    while (key_pos < input.size()) {
+      const int value =
+          merged_trie_->traverse(input.data(), node_pos, key_pos, key_pos + 1);
+      if (value == -2) break;
+      if (value < 0) continue;
+      if (value == kUserDefinedSymbolValue) {
+        user_defined_length = key_pos;
+      } else {
+        longest_length = key_pos;
+        longest_value = value >> 1;
+      }
+    }
+    if (user_defined_length > 0) {
+      return std::make_pair(input.substr(0, user_defined_length),
+                            user_defined_length);
+    }
+  } else if (trie_ != nullptr && trie_first_bytes_[first]) {
     // Allocates trie_results in stack, which makes the encoding speed 36%
     // faster. (38k sentences/sec => 60k sentences/sec). Builder checks that the
     // result size never exceeds kMaxTrieResultsSize. This array consumes
@@ -249,6 +657,12 @@ std::pair<absl::string_view, int> Normalizer::NormalizePrefix(
   }
 
   if (longest_length == 0) {
+    // ASCII characters are always valid and one byte long.
+    if (first < 0x80) {
+      result.second = 1;
+      result.first = absl::string_view(input.data(), 1);
+      return result;
+    }
     size_t length = 0;
     if (!string_util::IsValidDecodeUTF8(input, &length)) {
       // Found a malformed utf8.
@@ -335,46 +749,87 @@ PrefixMatcher::PrefixMatcher(const std::set<absl::string_view> &dic) {
   trie_ = absl::make_unique<Darts::DoubleArray>();
   CHECK_EQ(0, trie_->build(key.size(), const_cast<char **>(&key[0]), nullptr,
                            nullptr));
+  first_bytes_ = GetFirstBytes(*trie_);
 }
 
-int PrefixMatcher::PrefixMatch(absl::string_view w, bool *found) const {
-  if (trie_ == nullptr) {
-    if (found) *found = false;
-    return std::min<int>(w.size(), string_util::OneCharLen(w.data()));
-  }
-
-  constexpr int kResultSize = 64;
-  Darts::DoubleArray::result_pair_type trie_results[kResultSize];
-  const int num_nodes =
-      trie_->commonPrefixSearch(w.data(), trie_results, kResultSize, w.size());
+size_t PrefixMatcher::MemoryUsage() const {
+  return trie_ == nullptr ? 0 : trie_->owned_size();
+}
 
-  if (found) *found = (num_nodes > 0);
-  if (num_nodes == 0) {
-    return std::min<int>(w.size(), string_util::OneCharLen(w.data()));
+size_t PrefixMatcher::LongestMatch(absl::string_view w) const {
+  if (trie_ == nullptr || w.empty() ||
+      !first_bytes_[static_cast<unsigned char>(w[0])]) {
+    return 0;
   }
 
-  int mblen = 0;
-  for (int i = 0; i < num_nodes; ++i) {
-    mblen = std::max<int>(trie_results[i].length, mblen);
+  size_t longest_length = 0;
+  size_t node_pos = 0, key_pos = 0;
+  while (key_pos < w.size()) {
+    const int value = trie_->traverse(w.data(), node_pos, key_pos, key_pos + 1);
+    if (value == -2) break;
+    if (value >= 0) longest_length = key_pos;
   }
+  return longest_length;
+}
 
+int PrefixMatcher::PrefixMatch(absl::string_view w, bool *found) const {
+  const size_t mblen = LongestMatch(w);
+  if (found) *found = (mblen > 0);
+  if (mblen == 0) {
+    return std::min<int>(w.size(), string_util::OneCharLen(w.data()));
+  }
   return mblen;
 }
 
 std::string PrefixMatcher::GlobalReplace(absl::string_view w,
                                          absl::string_view out) const {
-  std::string result;
-  while (!w.empty()) {
-    bool found = false;
-    const int mblen = PrefixMatch(w, &found);
-    if (found) {
-      result.append(out.data(), out.size());
-    } else {
-      result.append(w.data(), mblen);
+  std::string result(w.data(), w.size());
+  GlobalReplace(&result, out);
+  return result;
+}
+
+bool PrefixMatcher::GlobalReplace(std::string *w, absl::string_view out) const {
+  if (trie_ == nullptr) return false;
+
+  // Moves the unmatched bytes [begin, read) and the replacements to the
+  // front of |w|. |write| never passes |read| as long as no replacement is
+  // longer than its entry.
+  char *data = &(*w)[0];
+  const size_t size = w->size();
+  size_t begin = 0, read = 0, write = 0;
+  bool replaced = false;
+  while (read < size) {
+    const size_t mblen =
+        LongestMatch(absl::string_view(data + read, size - read));
+    if (mblen == 0) {
+      read += std::min<size_t>(size - read,
+                               string_util::OneCharLen(data + read));
+      continue;
     }
-    w.remove_prefix(mblen);
+
+    if (write != begin) std::memmove(data + write, data + begin, read - begin);
+    write += read - begin;
+    if (out.size() > mblen) {
+      // The replacement does not fit, and the rest goes to a new string.
+      std::string rest = GlobalReplace(
+          absl::string_view(data + read + mblen, size - read - mblen), out);
+      w->resize(write);
+      w->append(out.data(), out.size());
+      w->append(rest);
+      return true;
+    }
+    std::memcpy(data + write, out.data(), out.size());
+    write += out.size();
+    read += mblen;
+    begin = read;
+    replaced = true;
   }
-  return result;
+
+  if (!replaced) return false;
+  if (write != begin) std::memmove(data + write, data + begin, read - begin);
+  write += read - begin;
+  w->resize(write);
+  return true;
 }
 
 }  // namespace normalizer
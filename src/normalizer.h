@@ -15,6 +15,8 @@
 #ifndef NORMALIZER_NORMALIZER_H_
 #define NORMALIZER_NORMALIZER_H_
 
+#include <bitset>
+#include <cstddef>
 #include <memory>
 #include <set>
 #include <string>
@@ -31,6 +33,9 @@
 namespace sentencepiece {
 namespace normalizer {
 
+class CaseEncoder;
+class Normalizer;
+
 // Given a list of strings, finds the longest string which is a
 // prefix of a query.
 class PrefixMatcher {
@@ -47,8 +52,43 @@ class PrefixMatcher {
   // Replaces entries in `w` with `out`.
   std::string GlobalReplace(absl::string_view w, absl::string_view out) const;
 
+  // Replaces entries in `w` with `out` in place. Returns false, leaving `w`
+  // untouched, when no entry is found.
+  bool GlobalReplace(std::string *w, absl::string_view out) const;
+
+  // Returns the bytes of the trie of the entries.
+  size_t MemoryUsage() const;
+
  private:
+  friend class Normalizer;
+
+  // Returns the byte length of the longest entry which is a prefix of `w`,
+  // or 0 if no entry is found.
+  size_t LongestMatch(absl::string_view w) const;
+
   std::unique_ptr<Darts::DoubleArray> trie_;
+
+  // Bytes that start at least one entry. Positions starting with any other
+  // byte skip the trie lookup.
+  std::bitset<256> first_bytes_;
+};
+
+// A decision table for the characters U+0000 - U+00FF of one precompiled
+// charsmap. compile_charsmap generates the tables of the production rules
+// into specialized_normalizer_rule.h, and a Normalizer whose charsmap has the
+// fingerprint of a table looks these characters up there instead of walking
+// the trie.
+struct SpecializedCharsMap {
+  // values[c] when no rule starts with the character c.
+  static constexpr int32 kNoRule = -1;
+  // values[c] when a rule longer than c starts with c.
+  static constexpr int32 kTrie = -2;
+
+  const char *name;
+  uint64 fingerprint;  // Normalizer::FingerprintPrecompiledCharsMap().
+  // 256 values by character. The others are the offsets of the normalized
+  // strings of the rules in the charsmap.
+  const int32 *values;
 };
 
 // Normalizer implements a simple text normalizer with
@@ -69,9 +109,11 @@ class Normalizer {
   Normalizer(const NormalizerSpec &spec, const TrainerSpec &trainer_Spec);
   virtual ~Normalizer();
 
-  virtual void SetPrefixMatcher(const PrefixMatcher *matcher) {
-    matcher_ = matcher;
-  }
+  // Sets the matcher of the user defined symbols, which are never
+  // normalized. The symbols are merged with the rules into one trie, so
+  // |matcher| should not be deleted until Normalizer is destroyed or the
+  // matcher is replaced.
+  virtual void SetPrefixMatcher(const PrefixMatcher *matcher);
 
   // Returns Status.
   // Normalizes function is valid only when status is OK.
@@ -79,7 +121,8 @@ class Normalizer {
 
   // Normalizes a plain utf8 string into an internal representation for
   // Sentencepiece model. |norm_to_orig| stores the byte-alignment from
-  // normalized string to the original input.
+  // normalized string to the original input. |norm_to_orig| can be nullptr,
+  // in which case no alignment is tracked.
   // This function can do the following normalizations:
   // - Character normalization.
   //   (NFKC / full-width to half-width conversion etc).
@@ -90,17 +133,147 @@ class Normalizer {
                                  std::string *normalized,
                                  std::vector<size_t> *norm_to_orig) const;
 
+  // Same as above with 32-bit alignments, which take half the memory. Fails
+  // if |input| is 4GB or longer.
+  virtual util::Status Normalize(absl::string_view input,
+                                 std::string *normalized,
+                                 std::vector<uint32> *norm_to_orig) const;
+
+  // Same as above without alignments.
+  util::Status Normalize(absl::string_view input, std::string *normalized,
+                         std::nullptr_t) const {
+    return Normalize(input, normalized,
+                     static_cast<std::vector<size_t> *>(nullptr));
+  }
+
   // Returns a normalized string without alignments.
   // This function is used in sentencepiece training.
   virtual std::string Normalize(absl::string_view input) const;
 
+  // Returns the bytes of the tries this normalizer builds. The rules
+  // themselves are part of the NormalizerSpec, and their decoded form is
+  // counted by SharedCharsMapsMemoryUsage().
+  size_t MemoryUsage() const;
+
+  // Returns the number of distinct precompiled charsmaps the live
+  // normalizers of the process share, and the bytes they hold. The
+  // normalizers of the same charsmap, e.g., of the models built with the
+  // same normalization rule, share one decoded copy of it.
+  static size_t NumSharedCharsMaps();
+  static size_t SharedCharsMapsMemoryUsage();
+
+  // The decoded form of a precompiled charsmap, defined in the .cc file.
+  struct CharsMap;
+
+  // Returns the fingerprint of the precompiled charsmap |blob|, which
+  // selects its SpecializedCharsMap.
+  static uint64 FingerprintPrecompiledCharsMap(absl::string_view blob);
+
+  // Computes the 256 SpecializedCharsMap::values of the precompiled
+  // charsmap |blob|.
+  static util::Status BuildSpecializedCharsMap(absl::string_view blob,
+                                               std::vector<int32> *values);
+
   friend class Builder;
 
  private:
   FRIEND_TEST(NormalizerTest, EncodeDecodePrecompiledCharsMapTest);
+  FRIEND_TEST(NormalizerTest, SpecializedCharsMapTest);
+  FRIEND_TEST(NormalizerTest, SharedCharsMapTest);
 
   void Init();
 
+  // Returns in |charsmap| the CharsMap of |blob|, shared with the other
+  // normalizers of the same blob.
+  static util::Status GetSharedCharsMap(
+      absl::string_view blob, std::shared_ptr<const CharsMap> *charsmap);
+
+  // The whitespace options of |spec_| and |treat_whitespace_as_suffix_|,
+  // which Init() reads once.
+  class Options {
+   public:
+    Options() {}
+    Options(bool escape_whitespaces, bool remove_extra_whitespaces,
+            bool add_dummy_prefix, bool add_dummy_suffix)
+        : escape_whitespaces_(escape_whitespaces),
+          remove_extra_whitespaces_(remove_extra_whitespaces),
+          add_dummy_prefix_(add_dummy_prefix),
+          add_dummy_suffix_(add_dummy_suffix) {}
+
+    bool escape_whitespaces() const { return escape_whitespaces_; }
+    bool remove_extra_whitespaces() const { return remove_extra_whitespaces_; }
+    bool add_dummy_prefix() const { return add_dummy_prefix_; }
+    bool add_dummy_suffix() const { return add_dummy_suffix_; }
+
+   private:
+    bool escape_whitespaces_ = true;
+    bool remove_extra_whitespaces_ = true;
+    bool add_dummy_prefix_ = true;
+    bool add_dummy_suffix_ = false;
+  };
+
+  // Options fixed at compile time, for which the compiler removes the
+  // branches on the options from the loop of NormalizeInternal().
+  template <bool kEscapeWhitespaces, bool kRemoveExtraWhitespaces,
+            bool kAddDummyPrefix>
+  struct FixedOptions {
+    explicit FixedOptions(const Options &) {}
+    static constexpr bool escape_whitespaces() { return kEscapeWhitespaces; }
+    static constexpr bool remove_extra_whitespaces() {
+      return kRemoveExtraWhitespaces;
+    }
+    static constexpr bool add_dummy_prefix() { return kAddDummyPrefix; }
+    static constexpr bool add_dummy_suffix() { return false; }
+  };
+
+  // The loop of NormalizeWithOptions() for alignments of type T.
+  template <typename T>
+  using NormalizeFn = util::Status (Normalizer::*)(
+      absl::string_view input, std::string *normalized,
+      std::vector<T> *norm_to_orig) const;
+
+  // Implements Normalize() for alignments of type T. `normalize_fn` runs the
+  // normalization without case encoding.
+  template <typename T>
+  util::Status NormalizeAligned(absl::string_view input,
+                                std::string *normalized,
+                                std::vector<T> *norm_to_orig,
+                                NormalizeFn<T> normalize_fn) const;
+
+  // Runs the main normalization loop. `normalize_prefix` has the same
+  // signature as NormalizePrefix(). It is a template parameter so that the
+  // loop without case encoding calls NormalizePrefix() directly.
+  // `case_encoder` is nullptr when case encoding is disabled. `options` is
+  // an Options or a FixedOptions. T is size_t or uint32.
+  template <typename OptionsT, typename NormalizePrefixFn, typename T>
+  util::Status NormalizeInternal(absl::string_view input,
+                                 const OptionsT &options,
+                                 NormalizePrefixFn normalize_prefix,
+                                 CaseEncoder *case_encoder,
+                                 std::string *normalized,
+                                 std::vector<T> *norm_to_orig) const;
+
+  // Runs NormalizeInternal() without case encoding. Init() points
+  // |normalize_fn_| and |normalize32_fn_| to the instances for the options
+  // of |spec_|.
+  template <typename OptionsT, typename T>
+  util::Status NormalizeWithOptions(absl::string_view input,
+                                    std::string *normalized,
+                                    std::vector<T> *norm_to_orig) const;
+
+  // Sets |normalize_fn_| and |normalize32_fn_| to NormalizeWithOptions()
+  // with OptionsT.
+  template <typename OptionsT>
+  void SetNormalizeFns();
+
+  // Runs NormalizeInternal() with `case_encoder`, whose concrete type
+  // EncoderT avoids a virtual call for every character.
+  template <typename EncoderT, typename T>
+  util::Status NormalizeWithCaseEncoder(absl::string_view input,
+                                        EncoderT *case_encoder,
+                                        std::string *normalized,
+                                        std::vector<T> *norm_to_orig) const;
+
   // Normalizes the prefix of |input| and returns the pair of
   // normalized prefix and length we must consume after
   // normalization.
@@ -130,8 +303,19 @@ class Normalizer {
   // to the maximum size of shared common prefix in the chars map.
   static constexpr int kMaxTrieResultsSize = 32;
 
-  // Internal trie for efficient longest matching.
-  std::unique_ptr<Darts::DoubleArray> trie_;
+  // The charsmap of |spec_|, or nullptr for identity normalization.
+  std::shared_ptr<const CharsMap> charsmap_;
+
+  // Internal trie for efficient longest matching, owned by |charsmap_|.
+  const Darts::DoubleArray *trie_ = nullptr;
+
+  // Bytes that start at least one key of |trie_|. Inputs starting with any
+  // other byte skip the trie lookup.
+  std::bitset<256> trie_first_bytes_;
+
+  // The table of the characters U+0000 - U+00FF of the charsmap, or nullptr
+  // if none was generated for it.
+  const SpecializedCharsMap *specialized_ = nullptr;
 
   // "\0" delimitered output string.
   // the value of |trie_| stores pointers to this string.
@@ -143,14 +327,22 @@ class Normalizer {
   // Prefix matcher;
   const PrefixMatcher *matcher_ = nullptr;
 
+  // The keys of |matcher_| and the keys of |trie_| starting with
+  // |user_defined_first_bytes_| in one trie, which is only built when
+  // |matcher_| has symbols. The value of a rule is its value in |trie_|
+  // shifted left by one bit, and kUserDefinedSymbolValue marks a user
+  // defined symbol. Inputs starting with other bytes look up |trie_|.
+  std::unique_ptr<Darts::DoubleArray> merged_trie_;
+  std::bitset<256> user_defined_first_bytes_;
+  static constexpr int kUserDefinedSymbolValue = 1;
+
   // Split hello world into "hello_" and "world_" instead of
   // "_hello" and "_world".
   const bool treat_whitespace_as_suffix_ = false;
 
-#ifdef IS_BIG_ENDIAN
-  // Stores the blob for TRIE encoded in big-endian.
-  std::string precompiled_charsmap_buffer_;
-#endif
+  Options options_;
+  NormalizeFn<size_t> normalize_fn_ = nullptr;
+  NormalizeFn<uint32> normalize32_fn_ = nullptr;
 
   // Normalizer's status.
   util::Status status_;
@@ -14,10 +14,14 @@
 
 #include "normalizer.h"
 
+#include <random>
+#include <regex>
 #include <vector>
 
 #include "builder.h"
+#include "case_encoder.h"
 #include "sentencepiece_trainer.h"
+#include "specialized_normalizer_rule.h"
 #include "testharness.h"
 #include "util.h"
 
@@ -33,6 +37,23 @@ namespace {
 NormalizerSpec MakeDefaultSpec() {
   return SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
 }
+
+NormalizerSpec MakeCaseEncoderSpec() {
+  auto spec = MakeDefaultSpec();
+  spec.set_encode_case(true);
+  EXPECT_TRUE(SentencePieceTrainer::PopulateNormalizerSpec(&spec, false).ok());
+  return spec;
+}
+
+NormalizerSpec MakeCaseDecoderSpec() {
+  NormalizerSpec spec;
+  spec.set_decode_case(true);
+  spec.set_add_dummy_prefix(false);
+  spec.set_remove_extra_whitespaces(false);
+  spec.set_escape_whitespaces(false);
+  EXPECT_TRUE(SentencePieceTrainer::PopulateNormalizerSpec(&spec, true).ok());
+  return spec;
+}
 }  // namespace
 
 TEST(NormalizerTest, NormalizeTest) {
@@ -357,6 +378,156 @@ TEST(NormalizerTest, NormalizeFullTest) {
   }
 }
 
+TEST(NormalizerTest, Normalize32BitAlignmentTest) {
+  auto no_escape = MakeDefaultSpec();
+  no_escape.set_escape_whitespaces(false);
+  auto suffix = MakeDefaultSpec();
+  suffix.set_remove_extra_whitespaces(false);
+  const std::vector<NormalizerSpec> specs = {
+      MakeDefaultSpec(), no_escape, suffix, MakeCaseEncoderSpec(),
+      MakeCaseDecoderSpec()};
+  const std::vector<std::string> inputs = {
+      "", "   ", "I saw a girl", " I   saw a\xE3\x80\x80 \xE3\x80\x80girl ",
+      "\xE3\x8D\xBF \xE2\x91\xA0", "THE QUICK BROWN FOX Jumps", "\xC3"};
+  for (const auto &spec : specs) {
+    const Normalizer normalizer(spec);
+    for (const auto &input : inputs) {
+      std::string expected, output;
+      std::vector<size_t> expected_n2i;
+      std::vector<uint32> n2i;
+      ASSERT_TRUE(normalizer.Normalize(input, &expected, &expected_n2i).ok());
+      ASSERT_TRUE(normalizer.Normalize(input, &output, &n2i).ok());
+      EXPECT_EQ(expected, output);
+      EXPECT_EQ(expected_n2i, std::vector<size_t>(n2i.begin(), n2i.end()));
+    }
+  }
+}
+
+TEST(NormalizerTest, CaseEncoderTest) {
+  const auto encoder_spec = MakeCaseEncoderSpec();
+  const auto decoder_spec = MakeCaseDecoderSpec();
+  const Normalizer encoder(encoder_spec);
+  const Normalizer decoder(decoder_spec);
+
+  struct CaseTest {
+    std::string input;
+    std::string encoded;
+    std::string decoded;
+  };
+  const std::vector<CaseTest> kTests = {
+      {"Hello World", WS "Thello" WS "Tworld", WS "Hello" WS "World"},
+      {"HELLO WORLD", WS "Uhello" WS "Uworld", WS "HELLO" WS "WORLD"},
+      {"McDonald's is OK", WS "TmcTdonald's" WS "is" WS "Uok",
+       WS "McDonald's" WS "is" WS "OK"},
+      {"a B c D e F", WS "a" WS "Tb" WS "c" WS "Td" WS "e" WS "Tf",
+       WS "a" WS "B" WS "c" WS "D" WS "e" WS "F"},
+      {"XMLHttpRequest", WS "UxmlhLttpTrequest", WS "XMLHttpRequest"},
+      {" Leading   Spaces  AND TRAILING  ",
+       WS "Tleading" WS "Tspaces" WS "Uand" WS "Utrailing",
+       WS "Leading" WS "Spaces" WS "AND" WS "TRAILING"},
+      {"lower case only", WS "lower" WS "case" WS "only",
+       WS "lower" WS "case" WS "only"},
+      {"THE QUICK BROWN FOX", WS "Athe" WS "quick" WS "brown" WS "fox",
+       WS "THE" WS "QUICK" WS "BROWN" WS "FOX"},
+      {"ABC DEF GHI jkl MNO", WS "Aabc" WS "def" WS "ghi" WS "Ljkl" WS "Umno",
+       WS "ABC" WS "DEF" WS "GHI" WS "jkl" WS "MNO"},
+      {"NASA, ESA, JAXA  ", WS "Anasa," WS "esa," WS "jaxa",
+       WS "NASA," WS "ESA," WS "JAXA"},
+      // Uppercase spans longer than the lookahead of the decoder.
+      {"ÉCOLES SUPERCALIFRAGILISTICEXPIALIDOCIOUS ÉTÉ ok",
+       WS "Aécoles" WS "supercalifragilisticexpialidocious" WS "été" WS "Lok",
+       WS "ÉCOLES" WS "SUPERCALIFRAGILISTICEXPIALIDOCIOUS" WS "ÉTÉ" WS "ok"}};
+
+  // Runs twice to make sure that no state survives between the inputs.
+  for (int n = 0; n < 2; ++n) {
+    for (const auto &test : kTests) {
+      EXPECT_EQ(test.encoded, encoder.Normalize(test.input));
+      EXPECT_EQ(test.decoded, decoder.Normalize(test.encoded));
+    }
+  }
+
+  // The alignment-free mode produces the same output.
+  for (const auto &test : kTests) {
+    std::string normalized;
+    std::vector<size_t> norm_to_orig;
+    EXPECT_TRUE(
+        encoder.Normalize(test.input, &normalized, &norm_to_orig).ok());
+    EXPECT_EQ(test.encoded, normalized);
+    EXPECT_EQ(normalized.size() + 1, norm_to_orig.size());
+    EXPECT_TRUE(encoder.Normalize(test.input, &normalized, nullptr).ok());
+    EXPECT_EQ(test.encoded, normalized);
+  }
+
+  std::string normalized;
+  std::vector<size_t> norm_to_orig;
+  EXPECT_TRUE(
+      encoder.Normalize("McDonald's is OK", &normalized, &norm_to_orig).ok());
+  EXPECT_EQ(std::vector<size_t>({0,  0,  0,  0,  0,  1,  2,  2,  3,
+                                 4,  5,  6,  7,  8,  9,  10, 10, 10,
+                                 11, 12, 13, 13, 13, 14, 14, 15, 16}),
+            norm_to_orig);
+
+  EXPECT_TRUE(
+      encoder.Normalize("ABC DEF GHI", &normalized, &norm_to_orig).ok());
+  EXPECT_EQ(WS "Aabc" WS "def" WS "ghi", normalized);
+  EXPECT_EQ(std::vector<size_t>({0, 0, 0, 0, 0, 1, 2, 3, 3, 3, 4,  5,
+                                 6, 7, 7, 7, 8, 9, 10, 11}),
+            norm_to_orig);
+}
+
+TEST(NormalizerTest, CaseEncoderSearchTest) {
+  // The language of the fsa, where '$' is the end of the signature.
+  const std::regex pattern(
+      "Uu+(sss|p|\\$)+Uu+(sss|p|\\$)+(Uu+(sss|p|\\$)+)+");
+
+  // Leftmost longest matches, restarting after each match.
+  auto reference = [&](const std::string &input) {
+    std::vector<std::pair<size_t, size_t>> spans;
+    for (size_t i = 0; i < input.size(); ++i) {
+      for (size_t j = input.size(); j > i; --j) {
+        const std::string span = input.substr(i, j - i);
+        if (std::regex_match(span, pattern) ||
+            (j == input.size() && std::regex_match(span + "$", pattern))) {
+          spans.emplace_back(i, j);
+          i = j - 1;
+          break;
+        }
+      }
+    }
+    return spans;
+  };
+
+  // Random signatures of mostly uppercase words and near matches.
+  const std::vector<std::string> kWords = {"Uu", "Uuu", "Uu", "Uuu", "Uu",
+                                           "U",  "Ll",  "l",  "uu"};
+  const std::vector<std::string> kSpaces = {"sss", "sss", "p", "pp",
+                                            "",    "s",   "ssssss"};
+  std::mt19937 rand(0);
+  std::vector<std::pair<const char *, const char *>> results;
+  for (int n = 0; n < 500; ++n) {
+    std::string input;
+    const int size = rand() % 10;
+    for (int i = 0; i < size; ++i) {
+      input += kWords[rand() % kWords.size()];
+      input += kSpaces[rand() % kSpaces.size()];
+    }
+
+    std::vector<std::pair<size_t, size_t>> spans;
+    search(input, &results);
+    for (const auto &span : results) {
+      spans.emplace_back(span.first - input.data(),
+                         span.second - input.data());
+    }
+    EXPECT_EQ(reference(input), spans);
+    EXPECT_EQ(results, search(input));
+  }
+
+  search("UusssUupUu", &results);
+  EXPECT_EQ(1, results.size());
+  search("UuuLuu", &results);
+  EXPECT_TRUE(results.empty());
+}
+
 TEST(NormalizerTest, EncodeDecodePrecompiledCharsMapTest) {
   const std::string blob = Normalizer::EncodePrecompiledCharsMap("foo", "bar");
   std::string buf;
@@ -372,6 +543,83 @@ TEST(NormalizerTest, EncodeDecodePrecompiledCharsMapTest) {
                    .ok());
 }
 
+TEST(NormalizerTest, SpecializedCharsMapTest) {
+  // The generated tables are those of the precompiled charsmaps.
+  for (const auto &specialized : kSpecializedCharsMaps) {
+    std::string blob;
+    ASSERT_TRUE(Builder::GetPrecompiledCharsMap(specialized.name, &blob).ok());
+    EXPECT_EQ(specialized.fingerprint,
+              Normalizer::FingerprintPrecompiledCharsMap(blob));
+    std::vector<int32> values;
+    ASSERT_TRUE(Normalizer::BuildSpecializedCharsMap(blob, &values).ok());
+    EXPECT_EQ(values, std::vector<int32>(specialized.values,
+                                         specialized.values + 256));
+  }
+
+  const auto spec = SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
+  const Normalizer normalizer(spec);
+  ASSERT_TRUE(normalizer.specialized_ != nullptr);
+  Normalizer generic(spec);
+  generic.specialized_ = nullptr;
+  EXPECT_TRUE(Normalizer(SentencePieceTrainer::GetNormalizerSpec("nfkc")).specialized_ == nullptr);
+
+  // Every character up to U+00FF alone, followed by combining marks and
+  // truncated.
+  std::vector<std::string> inputs;
+  for (char32 c = 0; c < 0x100; ++c) {
+    const std::string s = string_util::UnicodeCharToUTF8(c);
+    inputs.push_back(s);
+    inputs.push_back(s + "\xCC\x81");
+    inputs.push_back(s + "\xE3\x82\x99");
+    inputs.push_back(s.substr(0, 1) + "A");
+  }
+  inputs.push_back("\xC2");
+  inputs.push_back("\xC3\xC3\xA9");
+  for (const auto &input : inputs) {
+    const auto expected = generic.NormalizePrefix(input);
+    const auto actual = normalizer.NormalizePrefix(input);
+    EXPECT_EQ(expected.first, actual.first);
+    EXPECT_EQ(expected.second, actual.second);
+  }
+
+  // User defined symbols take precedence over the table.
+  Normalizer with_symbols(spec);
+  const PrefixMatcher matcher({"(c)", "\xC2\xA0x"});
+  with_symbols.SetPrefixMatcher(&matcher);
+  EXPECT_EQ("(c)", with_symbols.NormalizePrefix("(c)").first);
+  EXPECT_EQ("\xC2\xA0x", with_symbols.NormalizePrefix("\xC2\xA0x").first);
+  EXPECT_EQ(" ", with_symbols.NormalizePrefix("\xC2\xA0y").first);
+}
+
+TEST(NormalizerTest, SharedCharsMapTest) {
+  const size_t num_maps = Normalizer::NumSharedCharsMaps();
+  const size_t bytes = Normalizer::SharedCharsMapsMemoryUsage();
+  {
+    // Specs of the same charsmap share it, even when they are copies.
+    const auto spec = SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
+    const NormalizerSpec copy = spec;
+    const Normalizer normalizer(spec), other(copy);
+    EXPECT_EQ(num_maps + 1, Normalizer::NumSharedCharsMaps());
+    EXPECT_LT(bytes + spec.precompiled_charsmap().size(),
+              Normalizer::SharedCharsMapsMemoryUsage());
+    EXPECT_EQ(normalizer.trie_, other.trie_);
+    EXPECT_EQ(WS "AB" WS "c", other.Normalize("\xEF\xBC\xA1\xEF\xBC\xA2 c"));
+
+    const Normalizer nfkc(SentencePieceTrainer::GetNormalizerSpec("nfkc"));
+    EXPECT_EQ(num_maps + 2, Normalizer::NumSharedCharsMaps());
+    EXPECT_NE(normalizer.trie_, nfkc.trie_);
+
+    // Identity normalization has no charsmap.
+    const Normalizer identity(
+        SentencePieceTrainer::GetNormalizerSpec("identity"));
+    EXPECT_EQ(num_maps + 2, Normalizer::NumSharedCharsMaps());
+  }
+
+  // The charsmaps are released with their last normalizer.
+  EXPECT_EQ(num_maps, Normalizer::NumSharedCharsMaps());
+  EXPECT_EQ(bytes, Normalizer::SharedCharsMapsMemoryUsage());
+}
+
 TEST(NormalizerTest, StatusTest) {
   NormalizerSpec spec;
   {
@@ -392,6 +640,29 @@ TEST(NormalizerTest, StatusTest) {
   }
 }
 
+TEST(NormalizerTest, UserDefinedSymbolWithCharsMapTest) {
+  auto spec = MakeDefaultSpec();
+  spec.set_add_dummy_prefix(false);
+  Normalizer normalizer(spec);
+
+  // "ｸ" is a prefix of the rule "ｸﾞ" and "①" has its own rule.
+  const PrefixMatcher matcher({"ＡＢ", "①", "ｸ", "<tag>"});
+  normalizer.SetPrefixMatcher(&matcher);
+
+  EXPECT_EQ("ＡＢC", normalizer.Normalize("ＡＢＣ"));
+  EXPECT_EQ("A", normalizer.Normalize("Ａ"));
+  EXPECT_EQ("①2", normalizer.Normalize("①②"));
+  EXPECT_EQ("ｸ", normalizer.Normalize("ｸ"));
+  EXPECT_EQ("ｸ", normalizer.Normalize("ｸﾞ").substr(0, 3));
+  EXPECT_EQ("A" WS "ｸ", normalizer.Normalize("Ａ ｸ"));
+  EXPECT_EQ("<tag>株式会社", normalizer.Normalize("<tag>㍿"));
+  EXPECT_EQ("<tag" WS "123", normalizer.Normalize("<tag 123"));
+
+  normalizer.SetPrefixMatcher(nullptr);
+  EXPECT_EQ("ABC", normalizer.Normalize("ＡＢＣ"));
+  EXPECT_EQ("12", normalizer.Normalize("①②"));
+}
+
 TEST(NormalizerTest, PrefixMatcherTest) {
   const PrefixMatcher matcher({"abc", "ab", "xy", "京都"});
   bool found;
@@ -413,6 +684,19 @@ TEST(NormalizerTest, PrefixMatcherTest) {
   EXPECT_EQ("", matcher.GlobalReplace("", ""));
   EXPECT_EQ("", matcher.GlobalReplace("abc", ""));
   EXPECT_EQ("--de-pqr", matcher.GlobalReplace("xyabcdeabpqr", "-"));
+  EXPECT_EQ("<><>de<>pqr", matcher.GlobalReplace("xyabcdeabpqr", "<>"));
+  EXPECT_EQ("[-][-]de[-]pqr", matcher.GlobalReplace("xyabcdeabpqr", "[-]"));
+  EXPECT_EQ("-大学", matcher.GlobalReplace("京都大学", "-"));
+
+  std::string w = "test東京大学";
+  EXPECT_FALSE(matcher.GlobalReplace(&w, "-"));
+  EXPECT_EQ("test東京大学", w);
+  w = "testabc京都の大学";
+  EXPECT_TRUE(matcher.GlobalReplace(&w, "-"));
+  EXPECT_EQ("test--の大学", w);
+  w = "xy";
+  EXPECT_TRUE(matcher.GlobalReplace(&w, ""));
+  EXPECT_EQ("", w);
 }
 
 TEST(NormalizerTest, PrefixMatcherWithEmptyTest) {
@@ -435,6 +719,10 @@ TEST(NormalizerTest, PrefixMatcherWithEmptyTest) {
 
   EXPECT_EQ("", matcher.GlobalReplace("", ""));
   EXPECT_EQ("abc", matcher.GlobalReplace("abc", ""));
+
+  std::string w = "abc";
+  EXPECT_FALSE(matcher.GlobalReplace(&w, ""));
+  EXPECT_EQ("abc", w);
 }
 
 }  // namespace normalizer
@@ -0,0 +1,154 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef ORDERED_PIPELINE_H_
+#define ORDERED_PIPELINE_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "third_party/absl/memory/memory.h"
+#include "util.h"
+
+namespace sentencepiece {
+
+// Processes batches of a stream on a thread pool and writes them in the
+// order they were submitted, for the command line tools. The calling thread
+// reads and submits the batches, `num_threads` workers run `process` and a
+// writer thread runs `write`. At most 2 * `num_threads` batches are in
+// flight, so a slow writer blocks the reader instead of growing the queue.
+//
+//   OrderedPipeline<Batch> pipeline(num_threads, process, write);
+//   auto batch = absl::make_unique<Batch>();
+//   while (Read(&line)) {
+//     batch->lines.push_back(line);
+//     if (batch->lines.size() == batch_size) {
+//       batch = pipeline.Submit(std::move(batch));
+//     }
+//   }
+//   pipeline.Submit(std::move(batch));
+//   pipeline.Finish();
+//
+// `Batch` must have Clear(), which empties it for the next use and may keep
+// its buffers. With `num_threads` <= 1, Submit() processes and writes the
+// batch in the calling thread.
+template <typename Batch>
+class OrderedPipeline {
+ public:
+  OrderedPipeline(int num_threads, std::function<void(Batch *)> process,
+                  std::function<void(Batch *)> write)
+      : process_(std::move(process)),
+        write_(std::move(write)),
+        max_batches_(2 * std::max(num_threads, 1)) {
+    if (num_threads <= 1) return;
+    pool_ = absl::make_unique<ThreadPool>(num_threads);
+    writer_ = std::thread([this]() { RunWriter(); });
+  }
+
+  ~OrderedPipeline() { Finish(); }
+
+  // Processes and writes `batch` and returns an empty batch to fill next.
+  std::unique_ptr<Batch> Submit(std::unique_ptr<Batch> batch) {
+    if (pool_ == nullptr) {
+      process_(batch.get());
+      write_(batch.get());
+      batch->Clear();
+      return batch;
+    }
+
+    auto slot = std::make_shared<Slot>();
+    slot->batch = std::move(batch);
+    std::unique_ptr<Batch> next;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return in_flight_.size() < max_batches_; });
+      in_flight_.push_back(slot);
+      if (!free_.empty()) {
+        next = std::move(free_.back());
+        free_.pop_back();
+      }
+    }
+    pool_->Schedule([this, slot]() {
+      process_(slot->batch.get());
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slot->done = true;
+      }
+      cv_.notify_all();
+    });
+    return next ? std::move(next) : absl::make_unique<Batch>();
+  }
+
+  // Waits until all submitted batches are written. No batch can be
+  // submitted afterwards.
+  void Finish() {
+    if (pool_ == nullptr) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    cv_.notify_all();
+    writer_.join();
+    pool_.reset();
+  }
+
+ private:
+  struct Slot {
+    std::unique_ptr<Batch> batch;
+    bool done = false;
+  };
+
+  // Writes the batches in the submission order as they are processed.
+  void RunWriter() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() {
+        return (!in_flight_.empty() && in_flight_.front()->done) ||
+               (finished_ && in_flight_.empty());
+      });
+      if (in_flight_.empty()) return;
+      std::shared_ptr<Slot> slot = std::move(in_flight_.front());
+      in_flight_.pop_front();
+      lock.unlock();
+      cv_.notify_all();  // a submitter may wait for room.
+      write_(slot->batch.get());
+      slot->batch->Clear();
+      lock.lock();
+      free_.push_back(std::move(slot->batch));
+    }
+  }
+
+  const std::function<void(Batch *)> process_;
+  const std::function<void(Batch *)> write_;
+  const size_t max_batches_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<Slot>> in_flight_;  // in the submission order.
+  std::vector<std::unique_ptr<Batch>> free_;     // written and cleared.
+  bool finished_ = false;
+
+  std::thread writer_;
+  std::unique_ptr<ThreadPool> pool_;
+};
+
+}  // namespace sentencepiece
+#endif  // ORDERED_PIPELINE_H_
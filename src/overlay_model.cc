@@ -0,0 +1,247 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "overlay_model.h"
+
+#include <set>
+#include <utility>
+
+#include "third_party/absl/memory/memory.h"
+#include "util.h"
+
+namespace sentencepiece {
+
+OverlayModel::OverlayModel(const ModelInterface *base,
+                           const std::vector<std::string> &user_defined_symbols)
+    : base_(base),
+      base_size_(base->GetPieceSize()),
+      symbols_(user_defined_symbols) {
+  model_proto_ = &base_->model_proto();
+  special_ids_ = base_->special_piece_ids();
+  unk_id_ = special_ids_.unk;
+  status_ = base_->status();
+  if (!status_.ok()) return;
+
+  // The user defined symbols of the base model are still escaped in the
+  // normalizer, which uses the matcher of this model.
+  std::set<absl::string_view> dic;
+  for (int id = 0; id < base_size_; ++id) {
+    if (base_->IsUserDefined(id)) dic.insert(base_->IdToPiece(id));
+  }
+
+  for (size_t i = 0; i < symbols_.size(); ++i) {
+    const std::string &symbol = symbols_[i];
+    if (symbol.empty()) {
+      status_ = util::InvalidArgumentError("symbol must not be empty.");
+      return;
+    }
+    if (base_->IdToPiece(base_->PieceToId(symbol)) == symbol ||
+        !port::InsertIfNotPresent(&symbol_ids_, symbol,
+                                  base_size_ + static_cast<int>(i))) {
+      status_ = util::InvalidArgumentError(symbol + " is already defined.");
+      return;
+    }
+    dic.insert(symbol);
+  }
+
+  matcher_ = absl::make_unique<normalizer::PrefixMatcher>(dic);
+}
+
+OverlayModel::~OverlayModel() {}
+
+bool OverlayModel::ForEachSegment(
+    absl::string_view normalized,
+    const std::function<void(absl::string_view, int)> &fn) const {
+  if (symbol_ids_.empty()) return false;
+
+  // `fn` is first called at the first new symbol, so that the callers
+  // encode texts without any in one call to the base model.
+  size_t pos = 0;
+  size_t begin = 0;
+  bool has_symbol = false;
+  while (pos < normalized.size()) {
+    bool found = false;
+    const int mblen = matcher_->PrefixMatch(normalized.substr(pos), &found);
+    if (found) {
+      const auto it = symbol_ids_.find(normalized.substr(pos, mblen));
+      if (it != symbol_ids_.end()) {
+        has_symbol = true;
+        if (begin < pos) fn(normalized.substr(begin, pos - begin), -1);
+        fn(normalized.substr(pos, mblen), it->second);
+        begin = pos + mblen;
+      }
+    }
+    pos += mblen;
+  }
+  if (has_symbol && begin < normalized.size()) {
+    fn(normalized.substr(begin), -1);
+  }
+  return has_symbol;
+}
+
+EncodeResult OverlayModel::Encode(absl::string_view normalized) const {
+  return EncodeWithVocabulary(normalized, nullptr);
+}
+
+EncodeResult OverlayModel::EncodeWithVocabulary(
+    absl::string_view normalized, const VocabularyMask *vocabulary) const {
+  EncodeResult result;
+  EncodeInto(normalized, vocabulary, &result);
+  return result;
+}
+
+void OverlayModel::EncodeInto(absl::string_view normalized,
+                              const VocabularyMask *vocabulary,
+                              EncodeResult *result) const {
+  if (!status().ok() || normalized.empty()) {
+    result->clear();
+    return;
+  }
+
+  vocabulary = ActiveVocabulary(vocabulary);
+  result->clear();
+  EncodeResult segment;
+  const bool has_symbol = ForEachSegment(
+      normalized, [&](absl::string_view text, int id) {
+        if (id >= 0) {
+          result->emplace_back(text, id);
+          return;
+        }
+        base_->EncodeInto(text, vocabulary, &segment);
+        result->insert(result->end(), segment.begin(), segment.end());
+      });
+  if (!has_symbol) base_->EncodeInto(normalized, vocabulary, result);
+}
+
+NBestEncodeResult OverlayModel::NBestEncode(absl::string_view normalized,
+                                            int nbest_size) const {
+  if (!status().ok() || normalized.empty()) {
+    return {{{}, 0.0}};
+  }
+
+  std::pair<EncodeResult, float> best;
+  best.second = 0.0;
+  const bool has_symbol = ForEachSegment(
+      normalized, [&](absl::string_view text, int id) {
+        if (id >= 0) {
+          best.first.emplace_back(text, id);
+          return;
+        }
+        const auto nbests = base_->NBestEncode(text, 1);
+        if (nbests.empty()) return;
+        best.first.insert(best.first.end(), nbests[0].first.begin(),
+                          nbests[0].first.end());
+        best.second += nbests[0].second;
+      });
+  if (!has_symbol) return base_->NBestEncode(normalized, nbest_size);
+  return {std::move(best)};
+}
+
+EncodeResult OverlayModel::SampleEncode(absl::string_view normalized,
+                                        float alpha) const {
+  if (!status().ok() || normalized.empty()) {
+    return {};
+  }
+
+  EncodeResult result;
+  const bool has_symbol = ForEachSegment(
+      normalized, [&](absl::string_view text, int id) {
+        if (id >= 0) {
+          result.emplace_back(text, id);
+          return;
+        }
+        const auto segment = base_->SampleEncode(text, alpha);
+        result.insert(result.end(), segment.begin(), segment.end());
+      });
+  if (!has_symbol) return base_->SampleEncode(normalized, alpha);
+  return result;
+}
+
+NBestEncodeResult OverlayModel::SampleEncodeAndScore(
+    absl::string_view normalized, float alpha, int num_samples,
+    bool unique) const {
+  if (!status().ok() || normalized.empty()) {
+    return {};
+  }
+
+  // Every sample draws one segmentation of each text between the symbols, and
+  // its score is the sum of theirs.
+  NBestEncodeResult results;
+  std::set<std::vector<int>> seen;
+  for (int n = 0; n < num_samples; ++n) {
+    std::pair<EncodeResult, float> sample;
+    sample.second = 0.0;
+    const bool has_symbol = ForEachSegment(
+        normalized, [&](absl::string_view text, int id) {
+          if (id >= 0) {
+            sample.first.emplace_back(text, id);
+            return;
+          }
+          const auto segments =
+              base_->SampleEncodeAndScore(text, alpha, 1, false);
+          if (segments.empty()) return;
+          sample.first.insert(sample.first.end(), segments[0].first.begin(),
+                              segments[0].first.end());
+          sample.second += segments[0].second;
+        });
+    if (!has_symbol) {
+      return base_->SampleEncodeAndScore(normalized, alpha, num_samples,
+                                         unique);
+    }
+    if (unique) {
+      std::vector<int> ids;
+      ids.reserve(sample.first.size());
+      for (const auto &p : sample.first) ids.push_back(p.second);
+      if (!seen.insert(std::move(ids)).second) continue;
+    }
+    results.push_back(std::move(sample));
+  }
+  return results;
+}
+
+int OverlayModel::PieceToId(absl::string_view piece) const {
+  const auto it = symbol_ids_.find(piece);
+  return it != symbol_ids_.end() ? it->second : base_->PieceToId(piece);
+}
+
+const std::string &OverlayModel::IdToPiece(int id) const {
+  return id < base_size_ ? base_->IdToPiece(id) : symbols_[id - base_size_];
+}
+
+float OverlayModel::GetScore(int id) const {
+  return id < base_size_ ? base_->GetScore(id) : 0.0;
+}
+
+bool OverlayModel::IsUnknown(int id) const {
+  return id < base_size_ && base_->IsUnknown(id);
+}
+
+bool OverlayModel::IsControl(int id) const {
+  return id < base_size_ && base_->IsControl(id);
+}
+
+bool OverlayModel::IsUnused(int id) const {
+  if (vocabulary_ != nullptr) return vocabulary_->IsUnused(id);
+  return id < base_size_ && base_->IsUnused(id);
+}
+
+bool OverlayModel::IsUserDefined(int id) const {
+  return id >= base_size_ || base_->IsUserDefined(id);
+}
+
+bool OverlayModel::IsByte(int id) const {
+  return id < base_size_ && base_->IsByte(id);
+}
+
+}  // namespace sentencepiece
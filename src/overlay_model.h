@@ -0,0 +1,104 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef OVERLAY_MODEL_H_
+#define OVERLAY_MODEL_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "model_interface.h"
+#include "normalizer.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// A base model extended with user defined symbols, which take the ids from
+// base->GetPieceSize() on. The pieces, tries and tables of the base model
+// are used in place, so that extending a model only builds a trie of the
+// user defined symbols. The normalized text is cut at the new symbols, and
+// the base model encodes the text between them.
+class OverlayModel : public ModelInterface {
+ public:
+  // `base` must outlive this model.
+  OverlayModel(const ModelInterface *base,
+               const std::vector<std::string> &user_defined_symbols);
+  ~OverlayModel() override;
+
+  EncodeResult Encode(absl::string_view normalized) const override;
+  EncodeResult EncodeWithVocabulary(
+      absl::string_view normalized,
+      const VocabularyMask *vocabulary) const override;
+  void EncodeInto(absl::string_view normalized,
+                  const VocabularyMask *vocabulary,
+                  EncodeResult *result) const override;
+
+  // A text with new symbols has only its best segmentation.
+  NBestEncodeResult NBestEncode(absl::string_view normalized,
+                                int nbest_size) const override;
+
+  // The text between the new symbols is sampled independently.
+  EncodeResult SampleEncode(absl::string_view normalized,
+                            float alpha) const override;
+  NBestEncodeResult SampleEncodeAndScore(absl::string_view normalized,
+                                         float alpha, int num_samples,
+                                         bool unique) const override;
+
+  bool IsSampleEncodeAvailable() const override {
+    return base_->IsSampleEncodeAvailable();
+  }
+  bool IsSampleEncodeAndScoreAvailable() const override {
+    return base_->IsSampleEncodeAndScoreAvailable();
+  }
+  bool IsNBestEncodeAvailable() const override {
+    return base_->IsNBestEncodeAvailable();
+  }
+
+  int PieceToId(absl::string_view piece) const override;
+  const std::string &IdToPiece(int id) const override;
+  int GetPieceSize() const override {
+    return base_size_ + static_cast<int>(symbols_.size());
+  }
+  float GetScore(int id) const override;
+  bool IsUnknown(int id) const override;
+  bool IsControl(int id) const override;
+  bool IsUnused(int id) const override;
+  bool IsUserDefined(int id) const override;
+  bool IsByte(int id) const override;
+  bool ByteFallbackEnabled() const override {
+    return base_->ByteFallbackEnabled();
+  }
+  bool VerifyOutputsEquivalent(absl::string_view expected,
+                               absl::string_view actual) const override {
+    return base_->VerifyOutputsEquivalent(expected, actual);
+  }
+
+ private:
+  // Cuts `normalized` into the new symbols, for which `fn` is called with
+  // their ids, and the texts between them, for which `fn` is called with -1.
+  // Returns false without calling `fn` if `normalized` has no new symbol.
+  bool ForEachSegment(
+      absl::string_view normalized,
+      const std::function<void(absl::string_view, int)> &fn) const;
+
+  const ModelInterface *base_;
+  const int base_size_;
+
+  // The new symbols by their ids minus `base_size_`.
+  std::vector<std::string> symbols_;
+  PieceToIdMap symbol_ids_;
+};
+}  // namespace sentencepiece
+#endif  // OVERLAY_MODEL_H_
@@ -0,0 +1,115 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#endif  // __linux__
+
+namespace sentencepiece {
+namespace test {
+
+const char *PerfCounterName(int counter) {
+  static const char *const kNames[kNumPerfCounters] = {
+      "cycles", "instructions", "l1d_misses",
+      "llc_misses", "branch_misses", "dtlb_misses"};
+  return counter >= 0 && counter < kNumPerfCounters ? kNames[counter] : "";
+}
+
+#ifdef __linux__
+namespace {
+
+constexpr uint64 CacheMiss(uint64 cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// Opens `counter` for the calling thread on any CPU. Returns -1 on errors.
+int OpenCounter(int counter) {
+  static const struct {
+    uint32 type;
+    uint64 config;
+  } kEvents[kNumPerfCounters] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, CacheMiss(PERF_COUNT_HW_CACHE_L1D)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, CacheMiss(PERF_COUNT_HW_CACHE_DTLB)},
+  };
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = kEvents[counter].type;
+  attr.config = kEvents[counter].config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(
+      syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+}  // namespace
+
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < kNumPerfCounters; ++i) fds_[i] = OpenCounter(i);
+}
+
+PerfCounters::~PerfCounters() {
+  for (int i = 0; i < kNumPerfCounters; ++i) {
+    if (fds_[i] >= 0) close(fds_[i]);
+  }
+}
+
+void PerfCounters::Read(uint64 values[kNumPerfCounters]) const {
+  for (int i = 0; i < kNumPerfCounters; ++i) {
+    values[i] = 0;
+    // The value, the time enabled and the time running.
+    uint64 data[3] = {0, 0, 0};
+    if (fds_[i] < 0 || read(fds_[i], data, sizeof(data)) != sizeof(data)) {
+      continue;
+    }
+    values[i] = data[2] == 0 || data[2] >= data[1]
+                    ? data[0]
+                    : static_cast<uint64>(static_cast<double>(data[0]) *
+                                          data[1] / data[2]);
+  }
+}
+#else
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < kNumPerfCounters; ++i) fds_[i] = -1;
+}
+
+PerfCounters::~PerfCounters() {}
+
+void PerfCounters::Read(uint64 values[kNumPerfCounters]) const {
+  for (int i = 0; i < kNumPerfCounters; ++i) values[i] = 0;
+}
+#endif  // __linux__
+
+bool PerfCounters::enabled() const {
+  for (int i = 0; i < kNumPerfCounters; ++i) {
+    if (available(i)) return true;
+  }
+  return false;
+}
+
+}  // namespace test
+}  // namespace sentencepiece
@@ -0,0 +1,65 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include "common.h"
+
+namespace sentencepiece {
+namespace test {
+
+// The hardware counters read by PerfCounters.
+enum PerfCounter {
+  kCycles = 0,
+  kInstructions,
+  kL1dMisses,  // L1 data cache read misses.
+  kLlcMisses,  // last level cache misses.
+  kBranchMisses,
+  kDtlbMisses,  // data TLB read misses.
+  kNumPerfCounters,
+};
+
+// Returns the short name of `counter`, e.g., "cycles".
+const char *PerfCounterName(int counter);
+
+// Counts the hardware events of the calling thread with perf_event_open(2)
+// on Linux, in user space only. A counter which cannot be opened, e.g., on
+// other systems, in most VMs or with kernel.perf_event_paranoid > 2, is not
+// available and always reads 0.
+class PerfCounters {
+ public:
+  PerfCounters();
+  ~PerfCounters();
+
+  // Returns true if `counter` is available.
+  bool available(int counter) const { return fds_[counter] >= 0; }
+
+  // Returns true if any counter is available.
+  bool enabled() const;
+
+  // Writes the counts so far to `values`, scaled up for the time the kernel
+  // multiplexed the counter out when more are open than the CPU has.
+  void Read(uint64 values[kNumPerfCounters]) const;
+
+ private:
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  int fds_[kNumPerfCounters];
+};
+
+}  // namespace test
+}  // namespace sentencepiece
+#endif  // PERF_COUNTERS_H_
@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "pretokenizer_for_training.h"
 #include "third_party/absl/strings/str_replace.h"
@@ -29,7 +31,43 @@ const char kUPPBoundaryStr[] = "\t";
 
 std::string PretokenizerForTrainingInterface::PreTokenize(
     absl::string_view text) const {
-  return Postprocess(Tokenize(Preprocess(text)));
+  return PreTokenizeBatch({text})[0];
+}
+
+std::vector<std::string> PretokenizerForTrainingInterface::PreTokenizeBatch(
+    const std::vector<absl::string_view> &texts) const {
+  std::vector<std::string> preprocessed;
+  preprocessed.reserve(texts.size());
+  for (const auto text : texts) preprocessed.push_back(Preprocess(text));
+
+  const std::vector<absl::string_view> views(preprocessed.begin(),
+                                             preprocessed.end());
+  std::vector<std::pair<uint32, uint32>> pieces;
+  std::vector<size_t> offsets;
+  TokenizeBatch(views, &pieces, &offsets);
+  CHECK_EQ(offsets.size(), views.size() + 1);
+
+  std::vector<std::string> outputs(views.size());
+  for (size_t i = 0; i < views.size(); ++i) {
+    outputs[i] = Postprocess(views[i], pieces.data() + offsets[i],
+                             pieces.data() + offsets[i + 1]);
+  }
+  return outputs;
+}
+
+void PretokenizerForTrainingInterface::TokenizeBatch(
+    const std::vector<absl::string_view> &texts,
+    std::vector<std::pair<uint32, uint32>> *pieces,
+    std::vector<size_t> *offsets) const {
+  pieces->clear();
+  offsets->assign(1, 0);
+  for (const auto text : texts) {
+    const SentencePieceText spt = Tokenize(text);
+    for (const auto &piece : spt.pieces()) {
+      pieces->emplace_back(piece.begin(), piece.end());
+    }
+    offsets->push_back(pieces->size());
+  }
 }
 
 // static
@@ -41,18 +79,22 @@ std::string PretokenizerForTrainingInterface::Preprocess(
 
 // static
 std::string PretokenizerForTrainingInterface::Postprocess(
-    const SentencePieceText &spt) {
+    absl::string_view text, const std::pair<uint32, uint32> *begin,
+    const std::pair<uint32, uint32> *end) {
   // Inserts kUPPBoundaryStr before/after of token boundaries.
   std::string output;
-  int prev = 0;
-  for (const auto &piece : spt.pieces()) {
-    if (prev == piece.begin() && piece.begin() != 0) {
+  uint32 prev = 0;
+  for (const auto *piece = begin; piece != end; ++piece) {
+    CHECK_LE(prev, piece->first);
+    CHECK_LE(piece->first, piece->second);
+    CHECK_LE(piece->second, text.size());
+    if (prev == piece->first && piece->first != 0) {
       output += kUPPBoundaryStr;
     } else {
-      output.append(piece.begin() - prev, ' ');
+      output.append(piece->first - prev, ' ');
     }
-    output += piece.surface();
-    prev = piece.end();
+    output.append(text.data() + piece->first, piece->second - piece->first);
+    prev = piece->second;
   }
 
   // Restores kWSStr.
@@ -17,6 +17,8 @@
 
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "common.h"
 #include "sentencepiece.pb.h"
@@ -46,15 +48,34 @@ class PretokenizerForTrainingInterface {
   // output: I love sentence<tab>piece.
   std::string PreTokenize(absl::string_view text) const;
 
+  // Same as PreTokenize(), but pre-tokenizes all |texts| with one call of
+  // TokenizeBatch().
+  std::vector<std::string> PreTokenizeBatch(
+      const std::vector<absl::string_view> &texts) const;
+
   // Returns pre-tokenized result.
   // Note that the pre-tokenized constraint is specified with the
   // byte offsets (SentencePiece::begin, SentencePiece::end) over
   // the input text.
   virtual SentencePieceText Tokenize(absl::string_view text) const = 0;
 
+  // Returns pre-tokenized results of |texts| without building protos.
+  // The byte offsets {begin, end} of the pieces of texts[i] are stored in
+  // (*pieces)[(*offsets)[i], (*offsets)[i + 1]), so |offsets| has
+  // texts.size() + 1 elements.
+  // The default implementation calls Tokenize() for every text. Pre-tokenizers
+  // with a per-call overhead (e.g. RPC) should override it.
+  // The trainer calls this method from multiple threads at the same time.
+  virtual void TokenizeBatch(
+      const std::vector<absl::string_view> &texts,
+      std::vector<std::pair<uint32, uint32>> *pieces,
+      std::vector<size_t> *offsets) const;
+
  private:
   static std::string Preprocess(absl::string_view text);
-  static std::string Postprocess(const SentencePieceText &spt);
+  static std::string Postprocess(absl::string_view text,
+                                 const std::pair<uint32, uint32> *begin,
+                                 const std::pair<uint32, uint32> *end);
 };
 
 }  // namespace pretokenizer
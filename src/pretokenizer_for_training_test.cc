@@ -98,5 +98,49 @@ TEST(PretokenizerForTrainingTest, BaseTest) {
   }
 }
 
+// Splits texts at spaces, and at every occurrence of "piece".
+class MockBatchPretokenizer : public PretokenizerForTrainingInterface {
+ public:
+  SentencePieceText Tokenize(absl::string_view text) const override {
+    return SentencePieceText();
+  }
+
+  void TokenizeBatch(const std::vector<absl::string_view> &texts,
+                     std::vector<std::pair<uint32, uint32>> *pieces,
+                     std::vector<size_t> *offsets) const override {
+    pieces->clear();
+    offsets->assign(1, 0);
+    for (const auto text : texts) {
+      uint32 begin = 0;
+      for (uint32 i = 0; i <= text.size(); ++i) {
+        const bool at_piece = text.substr(i, 5) == "piece";
+        if (i == text.size() || text[i] == ' ' || (at_piece && i > begin)) {
+          if (i > begin) pieces->emplace_back(begin, i);
+          begin = at_piece ? i : i + 1;
+        }
+      }
+      offsets->push_back(pieces->size());
+    }
+  }
+
+  util::Status status() const override { return util::OkStatus(); }
+};
+
+TEST(PretokenizerForTrainingTest, BatchTest) {
+  MockBatchPretokenizer mock;
+
+  const std::vector<std::string> outputs = mock.PreTokenizeBatch(
+      {"I love sentencepiece", "", absl::StrCat("a", TrainerInterface::kWSStr,
+                                                "piece")});
+  ASSERT_EQ(3, outputs.size());
+  EXPECT_EQ(absl::StrCat("I", TrainerInterface::kWSStr, "love",
+                         TrainerInterface::kWSStr, "sentence\tpiece"),
+            outputs[0]);
+  EXPECT_EQ("", outputs[1]);
+  EXPECT_EQ(absl::StrCat("a", TrainerInterface::kWSStr, "piece"), outputs[2]);
+
+  EXPECT_EQ(outputs[0], mock.PreTokenize("I love sentencepiece"));
+}
+
 }  // namespace pretokenizer
 }  // namespace sentencepiece
@@ -0,0 +1,90 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "sentence_store.h"
+
+#include <cstring>
+
+namespace sentencepiece {
+
+SentenceStore::SentenceStore(
+    std::initializer_list<std::pair<absl::string_view, int64>> sentences)
+    : SentenceStore() {
+  for (const auto &it : sentences) emplace_back(it.first, it.second);
+}
+
+void SentenceStore::reserve(size_t size, size_t text_bytes) {
+  pool_.reserve(text_bytes);
+  offsets_.reserve(size + 1);
+  freqs_.reserve(size);
+}
+
+void SentenceStore::emplace_back(absl::string_view text, int64 freq) {
+  pool_.append(text.data(), text.size());
+  offsets_.push_back(pool_.size());
+  freqs_.push_back(freq);
+}
+
+void SentenceStore::clear() {
+  pool_.clear();
+  offsets_.assign(1, 0);
+  freqs_.clear();
+}
+
+void SentenceStore::swap(SentenceStore &other) {
+  pool_.swap(other.pool_);
+  offsets_.swap(other.offsets_);
+  freqs_.swap(other.freqs_);
+}
+
+bool SentenceStore::operator==(const SentenceStore &other) const {
+  return pool_ == other.pool_ && offsets_ == other.offsets_ &&
+         freqs_ == other.freqs_;
+}
+
+void SentenceStore::Concat(std::vector<SentenceStore> *shards,
+                           ThreadPool *pool) {
+  // Offsets of every shard in the new arrays.
+  std::vector<size_t> sizes(shards->size() + 1, 0);
+  std::vector<size_t> bytes(shards->size() + 1, 0);
+  for (size_t n = 0; n < shards->size(); ++n) {
+    sizes[n + 1] = sizes[n] + (*shards)[n].size();
+    bytes[n + 1] = bytes[n] + (*shards)[n].text_bytes();
+  }
+
+  // The old pool is released before the new one is allocated.
+  std::string().swap(pool_);
+  std::vector<uint64>(1, 0).swap(offsets_);
+  std::vector<int64>().swap(freqs_);
+  pool_.resize(bytes.back());
+  offsets_.resize(sizes.back() + 1);
+  freqs_.resize(sizes.back());
+
+  for (size_t n = 0; n < shards->size(); ++n) {
+    pool->Schedule([&, n]() {
+      SentenceStore &shard = (*shards)[n];
+      if (!shard.pool_.empty()) {
+        std::memcpy(&pool_[bytes[n]], shard.pool_.data(), shard.pool_.size());
+      }
+      for (size_t i = 0; i < shard.size(); ++i) {
+        offsets_[sizes[n] + i + 1] = bytes[n] + shard.offsets_[i + 1];
+        freqs_[sizes[n] + i] = shard.freqs_[i];
+      }
+      SentenceStore().swap(shard);
+    });
+  }
+  pool->Wait();
+}
+
+}  // namespace sentencepiece
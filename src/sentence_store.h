@@ -0,0 +1,141 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SENTENCE_STORE_H_
+#define SENTENCE_STORE_H_
+
+#include <algorithm>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "third_party/absl/strings/string_view.h"
+#include "util.h"
+
+namespace sentencepiece {
+
+// Sentences with their frequencies, stored in one contiguous byte pool with
+// flat arrays of offsets and frequencies. A sentence costs 16 bytes besides
+// its text, instead of a std::string header and a heap block. The sentences
+// are read as views, which are invalidated by any change of the store.
+class SentenceStore {
+ public:
+  using value_type = std::pair<absl::string_view, int64>;
+
+  class const_iterator {
+   public:
+    const_iterator(const SentenceStore *store, size_t index)
+        : store_(store), index_(index) {}
+    value_type operator*() const { return (*store_)[index_]; }
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
+    }
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    const SentenceStore *store_;
+    size_t index_;
+  };
+
+  SentenceStore() : offsets_(1, 0) {}
+  SentenceStore(
+      std::initializer_list<std::pair<absl::string_view, int64>> sentences);
+
+  size_t size() const { return freqs_.size(); }
+  bool empty() const { return freqs_.empty(); }
+
+  // Returns the number of bytes of all the texts.
+  size_t text_bytes() const { return pool_.size(); }
+
+  absl::string_view text(size_t i) const {
+    return absl::string_view(pool_.data() + offsets_[i],
+                             offsets_[i + 1] - offsets_[i]);
+  }
+  int64 freq(size_t i) const { return freqs_[i]; }
+  int64 *mutable_freq(size_t i) { return &freqs_[i]; }
+
+  value_type operator[](size_t i) const { return value_type(text(i), freq(i)); }
+  value_type back() const { return (*this)[size() - 1]; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+
+  // Reserves room for |size| sentences of |text_bytes| bytes in total.
+  void reserve(size_t size, size_t text_bytes);
+
+  // Appends a sentence. |text| must not point into this store.
+  void emplace_back(absl::string_view text, int64 freq);
+
+  void clear();
+  void swap(SentenceStore &other);
+
+  // Returns true if both stores have the same sentences in the same order.
+  bool operator==(const SentenceStore &other) const;
+  bool operator!=(const SentenceStore &other) const {
+    return !(*this == other);
+  }
+
+  // Rewrites the sentences with |num_shards| threads of |pool|. Every shard
+  // calls fn(shard, i, text, freq, &output) for the i-th sentences of a
+  // contiguous range in order, which appends the new text to |output| and
+  // returns false to drop the sentence. The rewritten shards are written
+  // into a new pool, which replaces this one, so the sentences keep their
+  // order.
+  template <typename Fn>
+  void Rewrite(int num_shards, ThreadPool *pool, Fn fn);
+
+  // Replaces the contents with the concatenation of |shards|, copying the
+  // shards in parallel.
+  void Concat(std::vector<SentenceStore> *shards, ThreadPool *pool);
+
+ private:
+  std::string pool_;
+  std::vector<uint64> offsets_;  // size() + 1 offsets into |pool_|.
+  std::vector<int64> freqs_;
+};
+
+template <typename Fn>
+void SentenceStore::Rewrite(int num_shards, ThreadPool *pool, Fn fn) {
+  num_shards = std::max(1, num_shards);
+  const size_t chunk_size = (size() + num_shards - 1) / num_shards;
+  std::vector<SentenceStore> shards(num_shards);
+  for (int n = 0; n < num_shards; ++n) {
+    pool->Schedule([&, n]() {
+      const size_t begin = std::min(n * chunk_size, size());
+      const size_t end = std::min(begin + chunk_size, size());
+      SentenceStore &shard = shards[n];
+      shard.reserve(end - begin, offsets_[end] - offsets_[begin]);
+      std::string output;
+      for (size_t i = begin; i < end; ++i) {
+        output.clear();
+        if (fn(n, i, text(i), freq(i), &output)) {
+          shard.emplace_back(output, freq(i));
+        }
+      }
+    });
+  }
+  pool->Wait();
+  Concat(&shards, pool);
+}
+
+}  // namespace sentencepiece
+#endif  // SENTENCE_STORE_H_
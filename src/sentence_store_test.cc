@@ -0,0 +1,104 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "sentence_store.h"
+
+#include <string>
+#include <vector>
+
+#include "testharness.h"
+
+namespace sentencepiece {
+namespace {
+
+TEST(SentenceStoreTest, BasicTest) {
+  SentenceStore store;
+  EXPECT_TRUE(store.empty());
+  store.emplace_back("hello", 2);
+  store.emplace_back("", 1);
+  store.emplace_back("world", 3);
+  EXPECT_EQ(3, store.size());
+  EXPECT_EQ(10, store.text_bytes());
+  EXPECT_EQ("hello", store.text(0));
+  EXPECT_EQ("", store.text(1));
+  EXPECT_EQ("world", store[2].first);
+  EXPECT_EQ(3, store[2].second);
+  *store.mutable_freq(0) += 5;
+  EXPECT_EQ(7, store.freq(0));
+  EXPECT_EQ("world", store.back().first);
+
+  std::vector<std::string> texts;
+  int64 total = 0;
+  for (const auto &it : store) {
+    texts.emplace_back(it.first.data(), it.first.size());
+    total += it.second;
+  }
+  EXPECT_EQ(std::vector<std::string>({"hello", "", "world"}), texts);
+  EXPECT_EQ(11, total);
+
+  const SentenceStore expected = {{"hello", 7}, {"", 1}, {"world", 3}};
+  EXPECT_TRUE(expected == store);
+  SentenceStore other = {{"hello", 7}};
+  EXPECT_TRUE(expected != other);
+  other.swap(store);
+  EXPECT_TRUE(expected == other);
+  EXPECT_EQ(1, store.size());
+  store.clear();
+  EXPECT_TRUE(store.empty());
+  EXPECT_EQ(0, store.text_bytes());
+}
+
+TEST(SentenceStoreTest, RewriteTest) {
+  SentenceStore store;
+  std::vector<std::string> expected;
+  for (int i = 0; i < 1000; ++i) {
+    store.emplace_back(std::to_string(i), i);
+    if (i % 3 != 0) expected.push_back(std::to_string(i) + "x");
+  }
+
+  for (int num_shards : {1, 3, 16}) {
+    SentenceStore copy = store;
+    ThreadPool pool(num_shards);
+    std::vector<int> visited(copy.size(), 0);
+    copy.Rewrite(num_shards, &pool,
+                 [&](int shard, size_t i, absl::string_view text, int64 freq,
+                     std::string *output) {
+                   EXPECT_LT(shard, num_shards);
+                   EXPECT_EQ(static_cast<int64>(i), freq);
+                   ++visited[i];
+                   if (freq % 3 == 0) return false;
+                   output->assign(text.data(), text.size());
+                   *output += "x";
+                   return true;
+                 });
+    EXPECT_EQ(std::vector<int>(store.size(), 1), visited);
+    ASSERT_EQ(expected.size(), copy.size());
+    for (size_t i = 0; i < copy.size(); ++i) {
+      EXPECT_EQ(expected[i], copy.text(i));
+      EXPECT_EQ(std::stoi(expected[i]), copy.freq(i));
+    }
+  }
+
+  // An empty store stays empty.
+  SentenceStore empty;
+  ThreadPool pool(2);
+  empty.Rewrite(2, &pool,
+                [](int, size_t, absl::string_view, int64, std::string *) {
+                  return true;
+                });
+  EXPECT_TRUE(empty.empty());
+}
+
+}  // namespace
+}  // namespace sentencepiece
@@ -14,16 +14,30 @@
 
 #include "sentencepiece_processor.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <map>
+#include <memory>
+#include <numeric>
 #include <set>
+#include <unordered_map>
 #include <utility>
 
+#include "batch_viterbi.h"
+#include "case_encoder.h"
 #include "common.h"
+#include "decode_model.h"
+#include "encode_cache.h"
+#include "encode_stats.h"
 #include "filesystem.h"
 #include "model_factory.h"
 #include "model_interface.h"
 #include "normalizer.h"
+#include "overlay_model.h"
 #include "sentencepiece.pb.h"
+#include "shared_encode_cache.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/numbers.h"
 #include "third_party/absl/strings/str_cat.h"
@@ -45,1023 +59,4884 @@ const char kSpaceSymbol[] = "\xe2\x96\x81";
 // since this character can be useful both for user and
 // developer. We can easily figure out that <unk> is emitted.
 const char kDefaultUnknownSymbol[] = " \xE2\x81\x87 ";
-}  // namespace
-
-SentencePieceProcessor::SentencePieceProcessor() {}
-SentencePieceProcessor::~SentencePieceProcessor() {}
 
-util::Status SentencePieceProcessor::Load(absl::string_view filename) {
-  auto model_proto = absl::make_unique<ModelProto>();
-  RETURN_IF_ERROR(io::LoadModelProto(filename, model_proto.get()));
-  return Load(std::move(model_proto));
+// Counts an encode call of `input` in SentencePieceProcessor::GetStats().
+void AddEncodeStats(absl::string_view input, absl::string_view normalized,
+                    size_t num_tokens) {
+  stats::Add(stats::kNumCalls, 1);
+  stats::Add(stats::kBytesIn, input.size());
+  stats::Add(stats::kBytesOut, normalized.size());
+  stats::Add(stats::kTokensOut, num_tokens);
 }
 
-void SentencePieceProcessor::LoadOrDie(absl::string_view filename) {
-  CHECK_OK(Load(filename));
+// A precompiled model starts with a header of six little-endian uint32:
+// magic, version, trie_results_size, the byte sizes of the trie and of the
+// serialized ModelProto, and the self-test fingerprint. The trie units
+// follow the header so that they are aligned when the file is memory-mapped,
+// and the serialized ModelProto follows the trie. The self-test fingerprint
+// is PrecompiledFingerprint() of everything after the header if the model
+// passed its self-test when it was saved, and 0 otherwise.
+//
+// Version 2 adds a seventh uint32 to the header, the byte size of the
+// quantized score table of ModelInterface::QuantizeTables(), which sits
+// between the trie and the ModelProto so that it stays aligned too.
+// Version 1 is still written for models without the table.
+const char kPrecompiledModelMagic[] = "SPMP";
+constexpr uint32 kPrecompiledModelVersion = 1;
+constexpr uint32 kQuantizedPrecompiledModelVersion = 2;
+constexpr size_t kPrecompiledModelHeaderSize = 24;
+constexpr size_t kQuantizedPrecompiledModelHeaderSize = 28;
+
+uint32 DecodeUint32(const char *data) {
+  uint32 value = 0;
+  for (int i = 3; i >= 0; --i) {
+    value = (value << 8) | static_cast<unsigned char>(data[i]);
+  }
+  return value;
 }
 
-util::Status SentencePieceProcessor::Load(const ModelProto &model_proto) {
-  auto model_proto_copy = absl::make_unique<ModelProto>();
-  *model_proto_copy = model_proto;
-  return Load(std::move(model_proto_copy));
+void EncodeUint32(uint32 value, std::string *output) {
+  for (int i = 0; i < 4; ++i) {
+    output->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
 }
 
-util::Status SentencePieceProcessor::LoadFromSerializedProto(
-    absl::string_view serialized) {
-  auto model_proto = absl::make_unique<ModelProto>();
-  CHECK_OR_RETURN(
-      model_proto->ParseFromArray(serialized.data(), serialized.size()));
-  return Load(std::move(model_proto));
+// Returns the FNV-1a hash of the little-endian uint32 words of `data`,
+// folded to 32 bits. It is never 0, which marks an unverified model.
+uint32 PrecompiledFingerprint(absl::string_view data) {
+  constexpr uint64 kPrime = 0x100000001b3;
+  uint64 hash = 0xcbf29ce484222325;
+  size_t i = 0;
+  for (; i + 4 <= data.size(); i += 4) {
+    hash = (hash ^ DecodeUint32(data.data() + i)) * kPrime;
+  }
+  for (; i < data.size(); ++i) {
+    hash = (hash ^ static_cast<unsigned char>(data[i])) * kPrime;
+  }
+  const uint32 fingerprint = static_cast<uint32>(hash ^ (hash >> 32));
+  return fingerprint == 0 ? 1 : fingerprint;
 }
 
-util::Status SentencePieceProcessor::Load(
-    std::unique_ptr<ModelProto> model_proto) {
-  model_proto_ = std::move(model_proto);
-  model_ = ModelFactory::Create(*model_proto_);
+// Calls `fn(begin, end)` for the chunks of kBatchChunkSize consecutive
+// elements of [0, size) on up to `num_threads` threads of the shared pool.
+// Chunks are handed out dynamically so that skewed input lengths do not
+// leave threads idle.
+constexpr int64 kBatchChunkSize = 16;
+
+void ParallelForBatch(int64 size, int num_threads,
+                      const std::function<void(int64, int64)> &fn) {
+  if (size <= kBatchChunkSize) {
+    fn(0, size);
+  } else {
+    SharedParallelFor(size, kBatchChunkSize, num_threads, fn);
+  }
+}
 
-  normalizer_ = absl::make_unique<normalizer::Normalizer>(
-      model_proto_->normalizer_spec(), model_proto_->trainer_spec());
+bool IsPrecompiledModel(absl::string_view blob) {
+  return absl::StartsWith(blob, kPrecompiledModelMagic);
+}
 
-  if (model_proto_->has_denormalizer_spec() &&
-      !model_proto_->denormalizer_spec().precompiled_charsmap().empty()) {
-    denormalizer_ = absl::make_unique<normalizer::Normalizer>(
-        model_proto_->denormalizer_spec());
+// Calls `fn(piece, count)` for every maximal run of identical pieces in `spt`.
+// Continuous unknown pieces are already merged by PopulateSentencePieceText,
+// so comparing ids is equivalent to comparing the piece strings.
+template <typename Fn>
+void ForEachRepeatRun(const SentencePieceText &spt, Fn fn) {
+  const int size = spt.pieces_size();
+  for (int i = 0; i < size;) {
+    const auto &sp = spt.pieces(i);
+    int j = i + 1;
+    while (j < size && spt.pieces(j).id() == sp.id() &&
+           spt.pieces(j).piece() == sp.piece()) {
+      ++j;
+    }
+    fn(sp, j - i);
+    i = j;
   }
+}
 
-  // Escapes user-defined-symbols in normalizer.
-  normalizer_->SetPrefixMatcher(model_->prefix_matcher());
+// Calls `emit(i)` for each element of a run-length encoded sequence of `size`
+// elements, expanding `x (#startrepeat) d1 .. dk (#endrepeat)` into `n` calls
+// with the index of `x`, where d1..dk are the decimal digits of `n`, and
+// `x c1 .. ck` into 1 + c1 + .. + ck calls, where c1..ck are count pieces.
+// The predicates classify the element at index `i`; `to_digit` returns -1 for
+// non-digit elements and `to_count` 0 for non-count elements. Malformed
+// repeat groups are emitted as they are. Fails before expanding a run into
+// more than `max_count` elements, or all runs into more than `max_expansion`
+// elements besides the first ones of the runs.
+constexpr int64 kMaxRepeatCount = kint32max / 10;
+
+// Returns an error if a run of `count` elements exceeds `max_count`.
+util::Status CheckRepeatRun(int64 count, int max_count) {
+  if (count <= max_count) return util::OkStatus();
+  return util::OutOfRangeError(absl::StrCat(
+      "A repeat run of ", count, " pieces exceeds the limit of ", max_count,
+      " set by SetDecodeMaxRepeatCount()."));
+}
 
-  RETURN_IF_ERROR(status());
+// Returns an error if the runs expanded into `expansion` extra elements in
+// total, which exceeds `max_expansion`.
+util::Status CheckRepeatExpansion(int64 expansion, int64 max_expansion) {
+  if (expansion <= max_expansion) return util::OkStatus();
+  return util::OutOfRangeError(absl::StrCat(
+      "The repeat runs expand into ", expansion,
+      " pieces, which exceeds the limit of ", max_expansion,
+      " set by SetDecodeMaxExpansion()."));
+}
 
-  // Running self-testing.
-  std::vector<std::string> errors, sps;
-  for (const auto &s : model_proto_->self_test_data().samples()) {
-    RETURN_IF_ERROR(Encode(s.input(), &sps));
-    const std::string result = absl::StrJoin(sps, " ");
-    if (!model_->VerifyOutputsEquivalent(s.expected(), result)) {
-      errors.emplace_back(
-          absl::StrCat(s.input(), "\t", s.expected(), "\t", result));
+template <typename IsStart, typename IsEnd, typename ToDigit,
+          typename ToCount, typename Emit>
+util::Status ForEachExpandedRepeat(int size, int max_count,
+                                   int64 max_expansion, IsStart is_start,
+                                   IsEnd is_end, ToDigit to_digit,
+                                   ToCount to_count, Emit emit) {
+  int prev = -1;
+  int64 run = 0;        // elements emitted for the run of `prev`.
+  int64 expansion = 0;  // elements emitted for the counts of all runs.
+  for (int i = 0; i < size; ++i) {
+    if (prev >= 0) {
+      const int count = to_count(i);
+      if (count > 0) {
+        run += count;
+        expansion += count;
+        RETURN_IF_ERROR(CheckRepeatRun(run, max_count));
+        RETURN_IF_ERROR(CheckRepeatExpansion(expansion, max_expansion));
+        for (int k = 0; k < count; ++k) emit(prev);
+        continue;
+      }
     }
-  }
-
-  if (!errors.empty()) {
-    LOG(INFO) << errors.size() << "/"
-              << model_proto_->self_test_data().samples_size()
-              << " samples did not pass the test.";
-    for (const auto &e : errors) {
-      LOG(INFO) << e;
+    if (prev >= 0 && is_start(i)) {
+      int64 count = 0;
+      int j = i + 1;
+      for (; j < size && !is_end(j); ++j) {
+        const int d = to_digit(j);
+        if (d < 0 || count > kMaxRepeatCount) break;
+        count = count * 10 + d;
+      }
+      if (j > i + 1 && j < size && is_end(j)) {
+        if (count > 1) {
+          run += count - 1;
+          expansion += count - 1;
+        }
+        RETURN_IF_ERROR(CheckRepeatRun(run, max_count));
+        RETURN_IF_ERROR(CheckRepeatExpansion(expansion, max_expansion));
+        for (int64 k = 1; k < count; ++k) emit(prev);
+        i = j;
+        continue;
+      }
     }
-    return util::InternalError("Self-test failures. See LOG(INFO).");
+    emit(i);
+    prev = i;
+    run = 1;
   }
-
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::SetEncoderVersion(
-    EncoderVersion encoder_version) {
-  return model_->SetEncoderVersion(encoder_version);
+// Calls `fn(d)` for each decimal digit of `n > 0`, most significant first.
+template <typename Fn>
+void ForEachDecimalDigit(int n, Fn fn) {
+  int digits[16];
+  int size = 0;
+  for (; n > 0; n /= 10) digits[size++] = n % 10;
+  while (size > 0) fn(digits[--size]);
 }
 
-EncoderVersion SentencePieceProcessor::GetEncoderVersion() const {
-  return model_->GetEncoderVersion();
+// Calls `fn(i)` for the count pieces i whose counts sum to `extra` > 0,
+// largest first.
+template <typename Fn>
+void ForEachRepeatCountPiece(int64 extra, Fn fn) {
+  for (int i = kNumRepeatCountPieces - 1; i >= 15 && extra >= 16;) {
+    if (RepeatCountPieceValue(i) <= extra) {
+      fn(i);
+      extra -= RepeatCountPieceValue(i);
+    } else {
+      --i;
+    }
+  }
+  if (extra > 0) fn(static_cast<int>(extra) - 1);
 }
 
-util::Status SentencePieceProcessor::SetEncodeExtraOptions(
-    absl::string_view extra_options) {
-  return ParseExtraOptions(extra_options, &encode_extra_options_);
+// Calls `fn(id, piece)` for the ids that follow the first id of a run of
+// `count` > 1 identical ids: the count pieces summing to `count` - 1 if
+// `model` has them, or "(#startrepeat)", the decimal digits of `count` and
+// "(#endrepeat)". `piece` outlives `model`'s pieces.
+template <typename Fn>
+void ForEachRepeatMarker(const ModelInterface &model, int64 count, Fn fn) {
+  static constexpr char kDigits[] = "0123456789";
+  const auto &special = model.special_piece_ids();
+  if (special.has_repeat_counts) {
+    ForEachRepeatCountPiece(count - 1, [&](int i) {
+      const int id = special.repeat_counts[i];
+      fn(id, absl::string_view(model.IdToPiece(id)));
+    });
+    return;
+  }
+  fn(special.start_repeat, absl::string_view(kStartRepeatSymbol));
+  ForEachDecimalDigit(count, [&](int d) {
+    fn(special.digits[d], absl::string_view(kDigits + d, 1));
+  });
+  fn(special.end_repeat, absl::string_view(kEndRepeatSymbol));
 }
 
-util::Status SentencePieceProcessor::SetDecodeExtraOptions(
-    absl::string_view extra_options) {
-  return ParseExtraOptions(extra_options, &decode_extra_options_);
+// Calls `emit(id)` for each id of ids[0, size) with the repeat runs
+// expanded. Repeat markers that are not in the vocab are decoded as unknown
+// pieces. Fails as ForEachExpandedRepeat() does.
+template <typename Emit>
+util::Status ForEachExpandedId(const int *ids, size_t size, int max_count,
+                               int64 max_expansion,
+                               const SpecialPieceIds &special, Emit emit) {
+  const bool has_repeat_symbols =
+      special.start_repeat != special.unk && special.end_repeat != special.unk;
+  auto to_digit = [&](int i) {
+    for (int d = 0; d < 10; ++d) {
+      if (ids[i] == special.digits[d]) return ids[i] == special.unk ? -1 : d;
+    }
+    return -1;
+  };
+  return ForEachExpandedRepeat(
+      size, max_count, max_expansion,
+      [&](int i) {
+        return has_repeat_symbols && ids[i] == special.start_repeat;
+      },
+      [&](int i) { return ids[i] == special.end_repeat; }, to_digit,
+      [&](int i) { return special.RepeatCount(ids[i]); },
+      [&](int i) { emit(ids[i]); });
 }
 
-util::Status SentencePieceProcessor::status() const {
-  CHECK_OR_RETURN(model_) << "Model is not initialized.";
-  CHECK_OR_RETURN(normalizer_) << "Normalizer is not initialized.";
-  RETURN_IF_ERROR(model_->status());
-  RETURN_IF_ERROR(normalizer_->status());
-  return util::OkStatus();
+template <typename Emit>
+util::Status ForEachExpandedId(const std::vector<int> &ids, int max_count,
+                               int64 max_expansion,
+                               const SpecialPieceIds &special, Emit emit) {
+  return ForEachExpandedId(ids.data(), ids.size(), max_count, max_expansion,
+                           special, emit);
 }
 
-util::Status SentencePieceProcessor::SetVocabulary(
-    const std::vector<std::string> &valid_vocab) {
-  RETURN_IF_ERROR(status());
-
-  // TODO(taku): supports vocabulary constraint in BPE model.
-  const auto type = model_proto_->trainer_spec().model_type();
-  CHECK_OR_RETURN(type == TrainerSpec::UNIGRAM || type == TrainerSpec::BPE)
-      << "Vocabulary constraint is only enabled in subword units.";
-
-  const std::set<std::string> vocab(valid_vocab.begin(), valid_vocab.end());
-
-  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
-    auto *piece = model_proto_->mutable_pieces(i);
-    if (piece->type() == ModelProto::SentencePiece::CONTROL ||
-        piece->type() == ModelProto::SentencePiece::UNKNOWN ||
-        piece->type() == ModelProto::SentencePiece::USER_DEFINED) {
-      continue;
-    }
-    if (vocab.find(piece->piece()) != vocab.end() ||
-        string_util::OneCharLen(piece->piece().c_str()) ==
-            piece->piece().size()) {
-      piece->set_type(ModelProto::SentencePiece::NORMAL);
-    } else {
-      piece->set_type(ModelProto::SentencePiece::UNUSED);
-    }
+// Returns the number of ids a run of `count` identical ids is encoded into.
+size_t RepeatRunSize(const SpecialPieceIds &special, size_t count) {
+  size_t size = 1;
+  if (count <= 1) return size;
+  if (special.has_repeat_counts) {
+    ForEachRepeatCountPiece(count - 1, [&size](int) { ++size; });
+    return size;
   }
+  size += 2;
+  for (; count > 0; count /= 10) ++size;
+  return size;
+}
 
-  return util::OkStatus();
+// Returns true if `model_proto` allows cutting texts at IsWordBoundary().
+// Returns true if `piece` has inner whitespace, so that it may span a cut.
+bool HasInnerWhitespace(absl::string_view piece) {
+  return piece.find(' ') != absl::string_view::npos ||
+         piece.find(kSpaceSymbol, 1) != absl::string_view::npos;
 }
 
-util::Status SentencePieceProcessor::ResetVocabulary() {
-  RETURN_IF_ERROR(status());
-  for (auto &piece : *(model_proto_->mutable_pieces())) {
-    if (piece.type() == ModelProto::SentencePiece::UNUSED)
-      piece.set_type(ModelProto::SentencePiece::NORMAL);
+bool HasWordBoundaries(const ModelProto &model_proto) {
+  const auto &spec = model_proto.normalizer_spec();
+  // Otherwise the normalized texts of both sides of a cut do not concatenate
+  // to the normalized text of the whole.
+  if (!spec.add_dummy_prefix() || !spec.remove_extra_whitespaces() ||
+      model_proto.trainer_spec().treat_whitespace_as_suffix()) {
+    return false;
   }
-
-  return util::OkStatus();
+  for (const auto &sp : model_proto.pieces()) {
+    if (HasInnerWhitespace(sp.piece())) return false;
+  }
+  return true;
 }
 
-util::Status SentencePieceProcessor::LoadVocabulary(absl::string_view filename,
-                                                    int threshold) {
-  auto input = filesystem::NewReadableFile(filename);
-  RETURN_IF_ERROR(input->status());
-
-  std::string line;
-  std::vector<std::string> vocab;
+// Returns true if `text` can be cut before `text[pos]`, 0 < pos < size,
+// without changing the ids of the whole. `lowercase_before_boundary` is
+// true with case encoding, where no span of uppercase words may be cut.
+bool IsWordBoundary(absl::string_view text, size_t pos,
+                    bool lowercase_before_boundary) {
+  auto is_alnum = [](char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9');
+  };
+  if (text[pos - 1] != ' ' || !is_alnum(text[pos])) return false;
+  size_t end = pos - 1;
+  while (end > 0 && text[end - 1] == ' ') --end;
+  if (end == 0) return true;
+  const char last = text[end - 1];
+  return lowercase_before_boundary ? (last >= 'a' && last <= 'z')
+                                   : is_alnum(last);
+}
 
-  while (input->ReadLine(&line)) {
-    const std::vector<std::string> v = absl::StrSplit(line, "\t");
-    CHECK_GE_OR_RETURN(v.size(), 1);
-    CHECK_OR_RETURN(!v[0].empty());
-    int32 freq = 1;
-    if (v.size() >= 2) {
-      CHECK_OR_RETURN(absl::SimpleAtoi(v[1], &freq))
-          << "Could not parse the frequency";
+// Returns the shortest prefix of `text`, or suffix if `from_end`, longer
+// than `size` bytes that is cut from the rest at an IsWordBoundary(), or
+// `text` if there is none.
+absl::string_view CutAtWordBoundary(absl::string_view text, size_t size,
+                                    bool from_end,
+                                    bool lowercase_before_boundary) {
+  if (text.size() <= size) return text;
+  if (from_end) {
+    for (size_t pos = text.size() - size; pos > 0; --pos) {
+      if (IsWordBoundary(text, pos, lowercase_before_boundary)) {
+        return text.substr(pos);
+      }
     }
-    if (freq >= threshold) {
-      vocab.emplace_back(v[0]);
+  } else {
+    for (size_t pos = size; pos < text.size(); ++pos) {
+      if (IsWordBoundary(text, pos, lowercase_before_boundary)) {
+        return text.substr(0, pos);
+      }
     }
   }
-
-  return SetVocabulary(vocab);
+  return text;
 }
 
-#define CHECK_OR_RETURN_STATUS_STL(container)               \
-  RETURN_IF_ERROR(status());                                \
-  CHECK_OR_RETURN(container) << "output container is null"; \
-  container->clear();
-
-#define CHECK_OR_RETURN_STATUS_PROTO(proto)         \
-  RETURN_IF_ERROR(status());                        \
-  CHECK_OR_RETURN(proto) << "output proto is null"; \
-  proto->Clear();
-
-//////////////////////////////////////////////////////////////
-// Simple API.
-//////////////////////////////////////////////////////////////
-std::vector<int> extract_each_digit(int x)
-{
-    std::vector<int> digits;
-    while(x>0)
-    {
-      digits.push_back(x%10);
-      x/=10;
-    }
-    std::reverse(digits.begin(), digits.end());
-    return digits;
+// Inputs longer than this are normalized and encoded in chunks of about
+// this size when the model allows cutting them between words, so that the
+// normalized text and the lattice of a chunk stay in the cache.
+constexpr size_t kEncodeChunkSize = 4096;
+
+// With SetEncodeNumThreads(), inputs of more than this many bytes are
+// encoded in parallel, which is one task of kBatchChunkSize chunks.
+constexpr size_t kParallelEncodeMinBytes = kBatchChunkSize * kEncodeChunkSize;
+
+// Cuts `input` into chunks of about kEncodeChunkSize bytes at
+// IsWordBoundary().
+std::vector<absl::string_view> CutIntoChunks(absl::string_view input,
+                                             bool lowercase_before_boundary) {
+  std::vector<absl::string_view> chunks;
+  chunks.reserve(input.size() / kEncodeChunkSize + 1);
+  while (!input.empty()) {
+    chunks.push_back(CutAtWordBoundary(input, kEncodeChunkSize, false,
+                                       lowercase_before_boundary));
+    input.remove_prefix(chunks.back().size());
+  }
+  return chunks;
 }
 
-void rle(std::vector<std::string> pieces, std::vector<std::string> *tokens){
-        int n = pieces.size();
-
-        for (int i = 0; i < n; i++) {
-    
-            int count = 1;
-            while (i < n - 1 && pieces[i] == pieces[i + 1]) {
-                count++;
-                i++;
-            }
-            // Word and its Count
-            if (count > 1){
-
-              tokens->emplace_back(pieces[i]);
-              tokens->emplace_back("(#startrepeat)");
-              
-              //tokens->emplace_back("xx");
-              
-              std::vector<int> digits = extract_each_digit(count) ;
-              for (auto d: digits){
-                // Guarantee that these are digit symbols
-                tokens->emplace_back(std::to_string(d)) ;
-              }
-
-              tokens->emplace_back("(#endrepeat)");
+// Returns the bytes of |pieces|, the traced input of a decode call.
+size_t PiecesBytes(const std::vector<std::string> &pieces) {
+  size_t bytes = 0;
+  for (const auto &piece : pieces) bytes += piece.size();
+  return bytes;
+}
 
-            }
-            else{
-              // 
-              tokens->emplace_back(pieces[i]);
-            }
-            
-        }
+// The id and the bytes of a piece of an EncodeResult or a
+// CompactEncodeResult of `normalized`.
+int PieceId(const std::pair<absl::string_view, int> &piece) {
+  return piece.second;
+}
+int PieceId(const CompactPiece &piece) { return piece.id; }
+absl::string_view PieceBytes(absl::string_view normalized,
+                             const std::pair<absl::string_view, int> &piece) {
+  return piece.first;
+}
+absl::string_view PieceBytes(absl::string_view normalized,
+                             const CompactPiece &piece) {
+  return absl::ClippedSubstr(normalized, piece.begin, piece.length);
+}
 
+// With SetCollapseRepeatRuns(), the runs of at least kMinCollapsedRunBytes
+// bytes which repeat a unit of up to kMaxRepeatPeriod bytes are segmented
+// with about kRepeatContextBytes bytes kept on both sides of their middle.
+constexpr size_t kMinCollapsedRunBytes = 1024;
+constexpr size_t kMaxRepeatPeriod = 8;
+constexpr size_t kRepeatContextBytes = 256;
+
+// `count` copies of a unit of `period` bytes starting at `begin`.
+struct RepeatRun {
+  size_t begin;
+  size_t period;
+  size_t count;
+};
+
+// Finds the disjoint runs of `text` of at least kMinCollapsedRunBytes bytes
+// with the shortest period, cut at whole UTF-8 characters.
+void FindRepeatRuns(absl::string_view text, std::vector<RepeatRun> *runs) {
+  runs->clear();
+  if (text.size() < kMinCollapsedRunBytes) return;
+  // matches[p] counts the bytes before `pos` equal to the byte p before them.
+  size_t matches[kMaxRepeatPeriod + 1] = {};
+  size_t last_end = 0;
+  for (size_t pos = 0; pos <= text.size(); ++pos) {
+    for (size_t p = 1; p <= kMaxRepeatPeriod; ++p) {
+      if (pos < text.size() && pos >= p && text[pos] == text[pos - p]) {
+        ++matches[p];
+        continue;
+      }
+      const size_t size = matches[p] + p;
+      matches[p] = 0;
+      if (size < kMinCollapsedRunBytes || pos - size < last_end) continue;
+      size_t begin = pos - size;
+      while (begin < pos && string_util::IsTrailByte(text[begin])) ++begin;
+      size_t count = (pos - begin) / p;
+      while (count > 0 && begin + count * p < text.size() &&
+             string_util::IsTrailByte(text[begin + count * p])) {
+        --count;
+      }
+      if (count * p < kMinCollapsedRunBytes) continue;
+      runs->push_back({begin, p, count});
+      last_end = begin + count * p;
     }
+  }
+}
 
-int VectorToInt(std::vector<int> v)
-{
-    std::reverse(v.begin(), v.end());
-    int decimal = 1;
-    int total = 0;
+// The binary vocabulary counts start with this magic, which no TSV
+// vocabulary starts with, followed by the number of pieces in 4 bytes and
+// the count of every piece id in 8 bytes. All integers are unsigned
+// little-endian.
+const absl::string_view kVocabularyCountsMagic("\0SPMVCNT", 8);
 
-    for (auto& it : v)
-    {
-        total += it * decimal;
-        decimal *= 10;
-    }
-    
-    return total;
+// Appends the lower `size` bytes of `value` in little-endian.
+void AppendLittleEndian(uint64 value, int size, std::string *output) {
+  for (int i = 0; i < size; ++i) {
+    output->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
 }
 
-std::vector<std::size_t> locate_all( const std::vector<absl::string_view>& seq, const std::string& what )
-{
-    std::vector<std::size_t> result ;
-    for( std::size_t i = 0 ; i < seq.size() ; ++i ) if( seq[i] == what ) result.push_back(i) ;
-    return result ;
+// Returns the unsigned little-endian integer of the bytes of `data`.
+uint64 DecodeLittleEndian(absl::string_view data) {
+  uint64 value = 0;
+  for (size_t i = data.size(); i > 0; --i) {
+    value = (value << 8) | static_cast<uint8>(data[i - 1]);
+  }
+  return value;
 }
 
-std::vector<std::string> _expand_from_pieces(std::vector<std::string> pieces){
+size_t Gcd(size_t a, size_t b) {
+  while (b != 0) {
+    const size_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
 
-  //std::cout<<pieces<<std::endl;
+// The workspace of the EncodeIds() calls of one thread made without one.
+// `in_use` is set during a call, so that a nested call takes its own.
+struct ThreadWorkspace {
+  EncodeWorkspace workspace;
+  bool in_use = false;
+};
+
+#ifndef SPM_NO_THREADLOCAL
+ThreadWorkspace *GetThreadWorkspace() {
+  thread_local static ThreadWorkspace workspace;
+  return &workspace;
+}
+#endif  // SPM_NO_THREADLOCAL
+
+// Lends the workspace of the calling thread while it is alive, or a new one
+// if that is in use. Threads thus reuse their buffers across calls without
+// sharing them or taking a lock. Buffers grown beyond
+// kMaxThreadWorkspaceBytes by a long input are released afterwards.
+class ScopedThreadWorkspace {
+ public:
+  static constexpr uint64 kMaxThreadWorkspaceBytes = 1 << 20;
+
+  // Lends nothing unless `needed`.
+  explicit ScopedThreadWorkspace(bool needed) {
+    if (!needed) return;
+#ifndef SPM_NO_THREADLOCAL
+    ThreadWorkspace *thread_workspace = GetThreadWorkspace();
+    if (!thread_workspace->in_use) {
+      thread_workspace->in_use = true;
+      thread_workspace_ = thread_workspace;
+      workspace_ = &thread_workspace->workspace;
+      return;
+    }
+#endif  // SPM_NO_THREADLOCAL
+    local_ = absl::make_unique<EncodeWorkspace>();
+    workspace_ = local_.get();
+  }
 
-  // Just look for the control symbol
-  auto it1 = std::find(pieces.begin(), pieces.end(), "(#startrepeat)");
-  //std::cout<<"----------------";
+  ~ScopedThreadWorkspace() {
+    if (thread_workspace_ == nullptr) return;
+    if (SentencePieceProcessor::EncodeWorkspaceMemoryUsage(*workspace_) >
+        kMaxThreadWorkspaceBytes) {
+      *workspace_ = EncodeWorkspace();
+    }
+    thread_workspace_->in_use = false;
+  }
 
-  auto it2 = std::find(pieces.begin(), pieces.end(), "(#endrepeat)");
-  int start_position = it1 - pieces.begin();
-  int end_position = it2 - pieces.begin();
-  std::string repeat_token = pieces[start_position-1];
+  EncodeWorkspace *get() const { return workspace_; }
 
-  //std::cout<<repeat_token<<std::endl;
-  std::vector<int> num;
+ private:
+  ThreadWorkspace *thread_workspace_ = nullptr;
+  std::unique_ptr<EncodeWorkspace> local_;
+  EncodeWorkspace *workspace_ = nullptr;
+};
+}  // namespace
 
-  if (it1!= pieces.end() and it2!= pieces.end()){
+void NBestIds::Add(const std::vector<int> &ids, float score) {
+  const int index = static_cast<int>(hypotheses_.size());
+  Entry entry = {-1, 0, static_cast<int>(ids_.size()),
+                 static_cast<int>(ids.size()), score};
+
+  // Follows the prefix tree as far as it matches `ids`.
+  int node = -1;
+  size_t pos = 0;
+  for (; pos < ids.size(); ++pos) {
+    int child = node < 0 ? root_child_ : first_child_[node];
+    while (child >= 0 && ids_[child] != ids[pos]) child = next_sibling_[child];
+    if (child < 0) break;
+    node = child;
+  }
+  if (node >= 0) {
+    entry.parent = owner_[node];
+    entry.shared = static_cast<int>(pos);
+  }
 
-    int j = start_position + 1;
-    while (j!=end_position){
-      num.push_back(std::stoi(std::string(pieces[j])));
-      j++;
-    }
-    int count = VectorToInt(num) - 1;
-    //std::cout<<count<<std::endl;
-    pieces.erase(it1, it2+1);
-    pieces.insert(it1, count, repeat_token);
+  // Stores the rest as a new branch.
+  for (; pos < ids.size(); ++pos) {
+    const int child = static_cast<int>(ids_.size());
+    ids_.push_back(ids[pos]);
+    first_child_.push_back(-1);
+    owner_.push_back(index);
+    int &head = node < 0 ? root_child_ : first_child_[node];
+    next_sibling_.push_back(head);
+    head = child;
+    node = child;
   }
-  return pieces;
+  hypotheses_.push_back(entry);
 }
 
-std::vector<std::string> expand_from_pieces(std::vector<std::string> pieces){
-  while (std::find(pieces.begin(), pieces.end(), "(#startrepeat)") != pieces.end()){
-    pieces = _expand_from_pieces(pieces);
-  }
-  return pieces;
+void NBestIds::Clear() {
+  hypotheses_.clear();
+  ids_.clear();
+  first_child_.clear();
+  next_sibling_.clear();
+  owner_.clear();
+  root_child_ = -1;
 }
 
-std::vector<int> SentencePieceProcessor::_expand_from_ids(const std::vector<int> ids) const {
+void NBestIds::Seek(int hypothesis, int pos, int *index, int *run_end) const {
+  int end = hypotheses_[hypothesis].size;
+  if (pos >= end) return;
+  // The ids before `shared` are those of the parent, up to `shared`.
+  while (pos < hypotheses_[hypothesis].shared) {
+    end = hypotheses_[hypothesis].shared;
+    hypothesis = hypotheses_[hypothesis].parent;
+  }
+  const Entry &entry = hypotheses_[hypothesis];
+  *index = entry.tail_begin + pos - entry.shared;
+  *run_end = end;
+}
 
-  // Just look for the control symbol
-  auto it1 = std::find(ids.begin(), ids.end(), model_->PieceToId("(#startrepeat)"));
-  int start_position = it1 - ids.begin();
-  auto it2 = std::find(ids.begin(), ids.end(), model_->PieceToId("(#endrepeat)"));
-  int end_position = it2 - ids.begin();
+struct CompiledModel::DecodeTable {
+  struct Piece {
+    uint32 begin = 0;  // of the surface in `surfaces`.
+    uint32 size = 0;
+    int byte = -1;  // the value of a byte piece, or -1.
+    // Bytes removed from the front of the surface at the beginning of the
+    // text, and from its back when the piece is the last one.
+    uint8 bos_strip = 0;
+    uint8 eos_strip = 0;
+  };
 
-  // // Erase the End Token
-  // ids.erase( it2 );
+  std::vector<Piece> pieces;  // indexed by id.
+  std::string surfaces;
+};
 
-  std::vector<int> num;
-  std::vector<int> new_ids;
+CompiledModel::CompiledModel() {}
+CompiledModel::~CompiledModel() {}
 
-  int p = 0;
-  while (p != start_position){
-    new_ids.push_back(ids[p]);
-    p++;
+void CompiledModel::AddMemoryUsage(MemoryUsage *usage) const {
+  usage->mapped_file += model_file_data_.size();
+  if (model_proto_ != nullptr) usage->model_proto += model_proto_->ByteSizeLong();
+  if (model_ != nullptr) model_->AddMemoryUsage(usage);
+  if (normalizer_ != nullptr) usage->normalizers += normalizer_->MemoryUsage();
+  if (denormalizer_ != nullptr) {
+    usage->normalizers += denormalizer_->MemoryUsage();
   }
+  if (decode_table_ != nullptr) {
+    usage->decode_table += port::ContainerBytes(decode_table_->pieces) +
+                           port::ContainerBytes(decode_table_->surfaces);
+  }
+  if (base_ != nullptr) base_->AddMemoryUsage(usage);
+}
 
-  // Get the Symbol
-  int symbol = *(it1-1);
-  it1 += 1;
+util::Status CompiledModel::PrefaultModelFiles(bool lock) const {
+  RETURN_IF_ERROR(filesystem::PrefaultMemory(model_file_data_, lock));
+  if (base_ != nullptr) return base_->PrefaultModelFiles(lock);
+  return util::OkStatus();
+}
 
-  // Get the Count
-  while (it1 != it2){
-    num.push_back( std::stoi(model_->IdToPiece(*it1)) );
-    it1 += 1;
-  }
-  int count = VectorToInt(num) -1;
-  //std::cout<<num<<std::endl;
+// static
+util::Status CompiledModel::Load(absl::string_view filename,
+                                 std::shared_ptr<const CompiledModel> *model) {
+  CHECK_OR_RETURN(model);
+  SentencePieceProcessor sp;
+  RETURN_IF_ERROR(sp.Load(filename));
+  *model = std::move(sp.compiled_model_);
+  return util::OkStatus();
+}
 
-  // Update the IDs
-  int i = 0;
-  while (i < count){
-    new_ids.push_back(symbol);
-    i++;
+// static
+util::Status CompiledModel::Load(std::unique_ptr<ModelProto> model_proto,
+                                 std::shared_ptr<const CompiledModel> *model) {
+  CHECK_OR_RETURN(model);
+  SentencePieceProcessor sp;
+  RETURN_IF_ERROR(sp.Load(std::move(model_proto)));
+  *model = std::move(sp.compiled_model_);
+  return util::OkStatus();
+}
+
+// static
+util::Status CompiledModel::Extend(
+    std::shared_ptr<const CompiledModel> base,
+    const std::vector<std::string> &user_defined_symbols,
+    std::shared_ptr<const CompiledModel> *model) {
+  CHECK_OR_RETURN(base && base->model_) << "Model is not initialized.";
+  CHECK_OR_RETURN(!base->decode_only_)
+      << "A model loaded with LoadMode::kDecodeOnly cannot be extended.";
+  CHECK_OR_RETURN(model);
+  RETURN_IF_ERROR(base->model_->status());
+
+  auto overlay =
+      absl::make_unique<OverlayModel>(base->model_.get(), user_defined_symbols);
+  RETURN_IF_ERROR(overlay->status());
+
+  // The normalizers are not shared with `base`, as the new symbols are
+  // escaped in the normalizer of the extended model.
+  std::shared_ptr<CompiledModel> extended(new CompiledModel());
+  const ModelProto &model_proto = base->model_proto();
+  extended->normalizer_ = absl::make_unique<normalizer::Normalizer>(
+      model_proto.normalizer_spec(), model_proto.trainer_spec());
+  extended->normalizer_->SetPrefixMatcher(overlay->prefix_matcher());
+  if (base->denormalizer_) {
+    extended->denormalizer_ = absl::make_unique<normalizer::Normalizer>(
+        model_proto.denormalizer_spec());
   }
 
-  // Append the Suffix
-  int s = end_position+1;
-  while(s != ids.size()){
-    new_ids.push_back(ids[s]);
-    s++;
+  extended->has_word_boundaries_ = base->has_word_boundaries_;
+  for (const auto &symbol : user_defined_symbols) {
+    if (HasInnerWhitespace(symbol)) extended->has_word_boundaries_ = false;
   }
-  
-  return new_ids;
-}
 
-std::vector<int> SentencePieceProcessor::expand_from_ids(const std::vector<int> ids) const {
+  // The decode table is not built, and Decode() looks the new ids up in the
+  // model instead.
+  extended->model_ = std::move(overlay);
+  extended->base_ = std::move(base);
+  *model = std::move(extended);
+  return util::OkStatus();
+}
 
-  std::vector<int> new_ids(ids);
-  while (std::find(new_ids.begin(), new_ids.end(), model_->PieceToId("(#startrepeat)")) != new_ids.end()){
-    new_ids = _expand_from_ids(new_ids);
-  }
-  return new_ids;
+const ModelProto &CompiledModel::model_proto() const {
+  return base_ ? base_->model_proto() : *model_proto_;
 }
 
-/////////////////////////////////////////////////////////////
-// Simple API.
-util::Status SentencePieceProcessor::Encode(
-    absl::string_view input, std::vector<std::string> *pieces) const {
-  CHECK_OR_RETURN_STATUS_STL(pieces);
+SentencePieceProcessor::SentencePieceProcessor() {}
+SentencePieceProcessor::~SentencePieceProcessor() {}
 
-  // std::cout<<"Encode 1"<<std::endl;
-  // std::cout<<input<<std::endl;
-  // std::cout<<"Encode 1"<<std::endl;
+util::Status SentencePieceProcessor::Load(absl::string_view filename) {
+  if (filename.empty()) {
+    return util::NotFoundError("model file path should not be empty.");
+  }
 
-  SentencePieceText spt;
-  RETURN_IF_ERROR(Encode(input, &spt));
+  auto input = filesystem::NewReadableFile(filename, true);
+  RETURN_IF_ERROR(input->status());
+  absl::string_view blob;
+  CHECK_OR_RETURN(input->ReadAllView(&blob));
+  if (IsPrecompiledModel(blob)) {
+    return LoadPrecompiled(filename, blob, std::move(input));
+  }
 
-  std::vector<std::string> temp_pieces;
+  auto model_proto = absl::make_unique<ModelProto>();
+  CHECK_OR_RETURN(model_proto->ParseFromArray(blob.data(), blob.size()));
+  return Load(std::move(model_proto));
+}
 
-  for (const auto &sp : spt.pieces()) {
-    temp_pieces.push_back(sp.piece());
+util::Status SentencePieceProcessor::LoadPrecompiled(
+    absl::string_view filename, absl::string_view blob,
+    std::unique_ptr<filesystem::ReadableFile> model_file) {
+  CHECK_OR_RETURN(blob.size() >= kPrecompiledModelHeaderSize)
+      << "precompiled model is truncated.";
+  const absl::string_view model_file_data = blob;
+  const uint32 version = DecodeUint32(blob.data() + 4);
+  const uint32 trie_results_size = DecodeUint32(blob.data() + 8);
+  const uint32 trie_size = DecodeUint32(blob.data() + 12);
+  const uint32 proto_size = DecodeUint32(blob.data() + 16);
+  const uint32 self_test_fingerprint = DecodeUint32(blob.data() + 20);
+  CHECK_OR_RETURN(version == kPrecompiledModelVersion ||
+                  version == kQuantizedPrecompiledModelVersion)
+      << "unsupported precompiled model version.";
+  uint32 table_size = 0;
+  if (version == kQuantizedPrecompiledModelVersion) {
+    CHECK_OR_RETURN(blob.size() >= kQuantizedPrecompiledModelHeaderSize)
+        << "precompiled model is truncated.";
+    table_size = DecodeUint32(blob.data() + 24);
+    blob.remove_prefix(kQuantizedPrecompiledModelHeaderSize);
+  } else {
+    blob.remove_prefix(kPrecompiledModelHeaderSize);
+  }
+  CHECK_OR_RETURN(static_cast<uint64>(trie_size) + table_size + proto_size ==
+                  blob.size())
+      << "precompiled model is truncated.";
+
+  // Only the self-test may be skipped. The unigram model still checks the
+  // bounds of the trie below.
+  bool run_self_test = self_test_mode_ != SelfTestMode::kSkip &&
+                       load_mode_ != LoadMode::kDecodeOnly;
+  if (run_self_test && self_test_mode_ == SelfTestMode::kCached &&
+      self_test_fingerprint != 0) {
+    run_self_test = self_test_fingerprint != PrecompiledFingerprint(blob);
   }
 
-  rle(temp_pieces, pieces);
+  const absl::string_view trie_array = blob.substr(0, trie_size);
+  const absl::string_view table = blob.substr(trie_size, table_size);
+  auto model_proto = absl::make_unique<ModelProto>();
+  CHECK_OR_RETURN(model_proto->ParseFromArray(
+      blob.data() + trie_size + table_size, proto_size));
+  CHECK_OR_RETURN((trie_array.empty() && table.empty()) ||
+                  model_proto->trainer_spec().model_type() ==
+                      TrainerSpec::UNIGRAM)
+      << "only unigram models store a precompiled trie.";
+
+  std::shared_ptr<CompiledModel> compiled_model(new CompiledModel());
+  compiled_model->model_proto_ = std::move(model_proto);
+  const ModelProto &compiled_proto = *compiled_model->model_proto_;
+  if (load_mode_ == LoadMode::kDecodeOnly) {
+    // The trie is left in the file unread.
+    compiled_model->model_ = absl::make_unique<DecodeModel>(compiled_proto);
+    compiled_model->decode_only_ = true;
+  } else if (trie_array.empty()) {
+    compiled_model->model_ = ModelFactory::Create(compiled_proto);
+  } else {
+    compiled_model->model_ = absl::make_unique<unigram::Model>(
+        compiled_proto, trie_array, trie_results_size);
+  }
+  if (!table.empty()) compiled_model->model_->SetQuantizedTables(table);
+  compiled_model->model_file_ = std::move(model_file);
+  compiled_model->precompiled_model_file_.assign(filename.data(),
+                                                 filename.size());
+  compiled_model->model_file_data_ = model_file_data;
 
-  return util::OkStatus();
+  return InitializeModel(std::move(compiled_model), run_self_test);
 }
 
-util::Status SentencePieceProcessor::Encode(absl::string_view input,
-                                            std::vector<int> *ids) const {
-  CHECK_OR_RETURN_STATUS_STL(ids);
+util::Status SentencePieceProcessor::LoadStatic(const StaticModel &model) {
+  CHECK_OR_RETURN(model.data != nullptr) << "static model is null.";
+  CHECK_EQ_OR_RETURN(reinterpret_cast<uintptr_t>(model.data) % 4, 0)
+      << "static model is not aligned.";
+  const absl::string_view blob(reinterpret_cast<const char *>(model.data),
+                               model.size);
+  CHECK_OR_RETURN(IsPrecompiledModel(blob))
+      << "static model is not a precompiled model.";
+  // Not a file that Python's pickle could map again.
+  return LoadPrecompiled("", blob, nullptr);
+}
 
-  // std::cout<<"Encode 2"<<std::endl;
-  // std::cout<<input<<std::endl;
-  // std::cout<<"Encode 2"<<std::endl;
+void SentencePieceProcessor::LoadOrDie(absl::string_view filename) {
+  CHECK_OK(Load(filename));
+}
 
-  SentencePieceText spt;
+util::Status SentencePieceProcessor::Load(const ModelProto &model_proto) {
+  auto model_proto_copy = absl::make_unique<ModelProto>();
+  *model_proto_copy = model_proto;
+  return Load(std::move(model_proto_copy));
+}
 
-  RETURN_IF_ERROR(Encode(input, &spt));
-  std::vector<std::string> temp_pieces;
-  for (const auto &sp : spt.pieces()) {
-    temp_pieces.push_back(sp.piece());
-  }
+util::Status SentencePieceProcessor::LoadFromSerializedProto(
+    absl::string_view serialized) {
+  auto model_proto = absl::make_unique<ModelProto>();
+  CHECK_OR_RETURN(
+      model_proto->ParseFromArray(serialized.data(), serialized.size()));
+  return Load(std::move(model_proto));
+}
 
-  std::vector<std::string> pieces;
-  rle(temp_pieces, &pieces);
-  for (const auto piece: pieces) {
-   
-    ids->emplace_back(model_->PieceToId(piece));
+util::Status SentencePieceProcessor::Load(
+    std::unique_ptr<ModelProto> model_proto) {
+  std::shared_ptr<CompiledModel> compiled_model(new CompiledModel());
+  compiled_model->model_proto_ = std::move(model_proto);
+  if (load_mode_ == LoadMode::kDecodeOnly) {
+    compiled_model->model_ =
+        absl::make_unique<DecodeModel>(*compiled_model->model_proto_);
+    compiled_model->decode_only_ = true;
+  } else {
+    compiled_model->model_ =
+        ModelFactory::Create(*compiled_model->model_proto_);
   }
 
-  return util::OkStatus();
+  return InitializeModel(std::move(compiled_model),
+                         self_test_mode_ != SelfTestMode::kSkip &&
+                             load_mode_ != LoadMode::kDecodeOnly);
 }
 
-util::Status SentencePieceProcessor::Decode(
-    const std::vector<std::string> &pieces, std::string *detokenized) const {
-  CHECK_OR_RETURN_STATUS_STL(detokenized);
+util::Status SentencePieceProcessor::Load(
+    std::shared_ptr<const CompiledModel> model) {
+  CHECK_OR_RETURN(model) << "Model is not initialized.";
+  SetCompiledModel(std::const_pointer_cast<CompiledModel>(std::move(model)),
+                   true);
+  return status();
+}
 
-  auto new_pieces = expand_from_pieces(pieces);
+util::Status SentencePieceProcessor::InitializeModel(
+    std::shared_ptr<CompiledModel> compiled_model, bool run_self_test) {
+  const ModelProto &model_proto = *compiled_model->model_proto_;
+  if (!compiled_model->decode_only_) {
+    compiled_model->normalizer_ = absl::make_unique<normalizer::Normalizer>(
+        model_proto.normalizer_spec(), model_proto.trainer_spec());
+  }
 
-  SentencePieceText spt;
-  RETURN_IF_ERROR(Decode(new_pieces, &spt));
-  *detokenized = std::move(spt.text());
+  if (model_proto.has_denormalizer_spec() &&
+      !model_proto.denormalizer_spec().precompiled_charsmap().empty()) {
+    compiled_model->denormalizer_ = absl::make_unique<normalizer::Normalizer>(
+        model_proto.denormalizer_spec());
+  }
 
-  return util::OkStatus();
-}
+  // Escapes user-defined-symbols in normalizer.
+  if (compiled_model->normalizer_) {
+    compiled_model->normalizer_->SetPrefixMatcher(
+        compiled_model->model_->prefix_matcher());
+    compiled_model->has_word_boundaries_ = HasWordBoundaries(model_proto);
+  }
 
-util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
-                                            std::string *detokenized) const {
-  CHECK_OR_RETURN_STATUS_STL(detokenized);
+  SetCompiledModel(std::move(compiled_model), false);
+  RETURN_IF_ERROR(status());
 
-  auto new_ids = expand_from_ids(ids);
-  SentencePieceText spt;
-  RETURN_IF_ERROR(Decode(new_ids, &spt));
-  *detokenized = std::move(spt.text());
+  compiled_model_->decode_table_ = MakeDecodeTable();
+  decode_table_ = compiled_model_->decode_table_.get();
 
-  return util::OkStatus();
+  return run_self_test ? SelfTest() : util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::NBestEncode(
-    absl::string_view input, int nbest_size,
-    std::vector<std::vector<std::string>> *pieces) const {
-  CHECK_OR_RETURN_STATUS_STL(pieces);
+util::Status SentencePieceProcessor::SelfTest() const {
+  RETURN_IF_ERROR(CheckCanEncode());
 
-  NBestSentencePieceText spt;
-  RETURN_IF_ERROR(NBestEncode(input, nbest_size, &spt));
-  for (const auto &nbest : spt.nbests()) {
-    std::vector<std::string> result;
-    for (const auto &sp : nbest.pieces()) {
-      result.emplace_back(sp.piece());
+  std::vector<std::string> errors, sps;
+  for (const auto &s : model_proto_->self_test_data().samples()) {
+    RETURN_IF_ERROR(Encode(s.input(), &sps));
+    const std::string result = absl::StrJoin(sps, " ");
+    if (!model_->VerifyOutputsEquivalent(s.expected(), result)) {
+      errors.emplace_back(
+          absl::StrCat(s.input(), "\t", s.expected(), "\t", result));
     }
-    pieces->emplace_back(result);
+  }
+
+  if (!errors.empty()) {
+    LOG(INFO) << errors.size() << "/"
+              << model_proto_->self_test_data().samples_size()
+              << " samples did not pass the test.";
+    for (const auto &e : errors) {
+      LOG(INFO) << e;
+    }
+    return util::InternalError("Self-test failures. See LOG(INFO).");
   }
 
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::NBestEncode(
-    absl::string_view input, int nbest_size,
-    std::vector<std::vector<int>> *ids) const {
-  CHECK_OR_RETURN_STATUS_STL(ids);
-
-  NBestSentencePieceText spt;
-  RETURN_IF_ERROR(NBestEncode(input, nbest_size, &spt));
-  for (const auto &nbest : spt.nbests()) {
-    std::vector<int> result;
-    for (const auto &sp : nbest.pieces()) {
-      result.emplace_back(sp.id());
+bool SentencePieceProcessor::VerifyOutputsEquivalent(
+    const std::vector<int> &expected, const std::vector<int> &actual) const {
+  if (expected == actual) return true;
+  if (!status().ok()) return false;
+  auto to_pieces = [this](const std::vector<int> &ids, std::string *pieces) {
+    for (const int id : ids) {
+      if (id < 0 || id >= GetPieceSize()) return false;
+      if (!pieces->empty()) pieces->push_back(' ');
+      pieces->append(IdToPiece(id));
     }
-    ids->emplace_back(result);
+    return true;
+  };
+  std::string expected_pieces, actual_pieces;
+  return to_pieces(expected, &expected_pieces) &&
+         to_pieces(actual, &actual_pieces) &&
+         model_->VerifyOutputsEquivalent(expected_pieces, actual_pieces);
+}
+
+void SentencePieceProcessor::SetCompiledModel(
+    std::shared_ptr<CompiledModel> compiled_model, bool is_shared) {
+  compiled_model_ = std::move(compiled_model);
+  is_shared_model_ = is_shared;
+  model_ = compiled_model_ ? compiled_model_->model_.get() : nullptr;
+  normalizer_ = compiled_model_ ? compiled_model_->normalizer_.get() : nullptr;
+  denormalizer_ =
+      compiled_model_ ? compiled_model_->denormalizer_.get() : nullptr;
+  model_proto_ = !compiled_model_      ? nullptr
+                 : compiled_model_->base_ ? &compiled_model_->model_proto()
+                                          : compiled_model_->model_proto_.get();
+  decode_table_ =
+      compiled_model_ ? compiled_model_->decode_table_.get() : nullptr;
+  InvalidateEncodeCache();
+  UpdateBatchEncoder();
+}
+
+util::Status SentencePieceProcessor::CheckModelIsNotShared() const {
+  if (is_shared_model_) {
+    return util::FailedPreconditionError(
+        "The model is shared with other processors and cannot be changed.");
   }
+  return util::OkStatus();
+}
 
+util::Status SentencePieceProcessor::SetEncoderVersion(
+    EncoderVersion encoder_version) {
+  RETURN_IF_ERROR(CheckModelIsNotShared());
+  RETURN_IF_ERROR(model_->SetEncoderVersion(encoder_version));
+  InvalidateEncodeCache();
+  UpdateBatchEncoder();
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::SampleEncode(
-    absl::string_view input, int nbest_size, float alpha,
-    std::vector<std::string> *pieces) const {
-  CHECK_OR_RETURN_STATUS_STL(pieces);
+EncoderVersion SentencePieceProcessor::GetEncoderVersion() const {
+  return model_->GetEncoderVersion();
+}
 
-  SentencePieceText spt;
-  RETURN_IF_ERROR(SampleEncode(input, nbest_size, alpha, &spt));
-  for (const auto &sp : spt.pieces()) {
-    pieces->emplace_back(sp.piece());
-  }
+util::Status SentencePieceProcessor::SetSelfTestMode(
+    SelfTestMode self_test_mode) {
+  self_test_mode_ = self_test_mode;
+  return util::OkStatus();
+}
 
+util::Status SentencePieceProcessor::SetLoadMode(LoadMode load_mode) {
+  load_mode_ = load_mode;
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::SampleEncode(absl::string_view input,
-                                                  int nbest_size, float alpha,
-                                                  std::vector<int> *ids) const {
-  CHECK_OR_RETURN_STATUS_STL(ids);
+util::Status SentencePieceProcessor::SetWordCacheSize(int max_words) {
+  RETURN_IF_ERROR(CheckCanEncode());
+  RETURN_IF_ERROR(CheckModelIsNotShared());
+  return model_->SetWordCacheSize(max_words);
+}
 
-  SentencePieceText spt;
-  RETURN_IF_ERROR(SampleEncode(input, nbest_size, alpha, &spt));
-  for (const auto &sp : spt.pieces()) {
-    ids->emplace_back(sp.id());
-  }
+util::Status SentencePieceProcessor::SetSampleBeam(float beam) {
+  RETURN_IF_ERROR(CheckCanEncode());
+  RETURN_IF_ERROR(CheckModelIsNotShared());
+  return model_->SetSampleBeam(beam);
+}
 
+util::Status SentencePieceProcessor::SetCollapseRepeatRuns(bool collapse) {
+  collapse_repeat_runs_ = collapse;
+  InvalidateEncodeCache();
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::PopulateSentencePieceText(
-    absl::string_view input, absl::string_view normalized,
-    const std::vector<size_t> &norm_to_orig, const EncodeResult &result,
-    SentencePieceText *spt) const {
-  size_t consumed = 0;
-  bool is_prev_unk = false;
-  for (const auto &p : result) {
-    const absl::string_view w = p.first;  // piece
-    const int id = p.second;              // id
+util::Status SentencePieceProcessor::SetCheckPreNormalized(bool check) {
+  check_pre_normalized_ = check;
+  return util::OkStatus();
+}
 
-    CHECK_OR_RETURN(!w.empty()) << "Empty piece is not allowed.";
+util::Status SentencePieceProcessor::SetEncodeExtraOptions(
+    absl::string_view extra_options) {
+  const auto status = ParseExtraOptions(extra_options, &encode_extra_options_);
+  InvalidateEncodeCache();
+  return status;
+}
 
-    const bool is_unk = IsUnknown(id);
+util::Status SentencePieceProcessor::SetDecodeExtraOptions(
+    absl::string_view extra_options) {
+  return ParseExtraOptions(extra_options, &decode_extra_options_);
+}
 
-    if (IsControl(id)) {
-      // Control symbol has no corresponding source surface, so begin == end.
-      auto *sp = spt->add_pieces();
-      sp->set_piece(w.data(), w.size());
-      sp->set_id(id);
-      sp->set_begin(norm_to_orig[consumed]);
-      sp->set_end(norm_to_orig[consumed]);
-    } else {
-      const size_t begin = consumed;
-      const size_t end = consumed + w.size();
-      CHECK_LT_OR_RETURN(begin, norm_to_orig.size());
-      CHECK_LT_OR_RETURN(end, norm_to_orig.size());
-      const size_t orig_begin = norm_to_orig[begin];
-      const size_t orig_end = norm_to_orig[end];
-      CHECK_LE_OR_RETURN(orig_begin, input.size());
-      CHECK_LE_OR_RETURN(orig_end, input.size());
-      CHECK_LE_OR_RETURN(orig_begin, orig_end);
-      const auto surface =
-          absl::ClippedSubstr(input, orig_begin, orig_end - orig_begin);
+util::Status SentencePieceProcessor::MakeExtraOptions(
+    absl::string_view extra_option,
+    std::shared_ptr<const ExtraOptions> *extra_options) const {
+  CHECK_OR_RETURN(extra_options);
+  auto new_options = std::make_shared<ExtraOptions>();
+  RETURN_IF_ERROR(ParseExtraOptions(extra_option, &new_options->options_));
+  *extra_options = std::move(new_options);
+  return util::OkStatus();
+}
 
-      if (is_unk && model_->ByteFallbackEnabled()) {
-        // Decomposes an unknown piece into UTF-8 bytes
-        for (int i = 0; i < w.size(); ++i) {
-          // Create a byte piece
-          const char b = w[i];
-          auto *sp = spt->add_pieces();
-          const auto piece = ByteToPiece(b);
-          auto sp_id = model_->PieceToId(piece);
-          sp->set_piece(piece.data(), piece.size());
-          sp->set_id(sp_id);
+const std::vector<SentencePieceProcessor::ExtraOption> &
+SentencePieceProcessor::EncodeExtraOptions(
+    const EncodeWorkspace &workspace) const {
+  return workspace.extra_options != nullptr ? workspace.extra_options->options_
+                                            : encode_extra_options_;
+}
 
-          // The last byte piece holds the surface of the original unknown
-          // character. The other byte pieces have no surface.
-          if (i == w.size() - 1) {
-            sp->set_surface(surface.data(), surface.size());
-            sp->set_begin(orig_begin);
-            sp->set_end(orig_end);
-          } else {
-            // begin == end
-            sp->set_begin(orig_begin);
-            sp->set_end(orig_begin);
-          }
-        }
-      } else {
-        // Merges continuous run of unknown pieces so that decoder
-        // can copy or generate unknown tokens easily.
-        // Note that merged tokens are still unknown,
-        // since known pieces never consist of unknown characters.
-        if (is_prev_unk && is_unk) {
-          auto *sp = spt->mutable_pieces(spt->pieces_size() - 1);
-          sp->set_piece(sp->piece() + std::string(w));
-          sp->set_surface(sp->surface() + std::string(surface));
-          sp->set_end(orig_end);
-        } else {
-          auto *sp = spt->add_pieces();
-          sp->set_piece(w.data(), w.size());
-          sp->set_id(id);
-          sp->set_surface(surface.data(), surface.size());
-          sp->set_begin(orig_begin);
-          sp->set_end(orig_end);
-        }
-      }
-      consumed += w.size();
-    }
-    is_prev_unk = is_unk;
+util::Status SentencePieceProcessor::SetEncodeCacheSize(size_t max_bytes) {
+  if (max_bytes == 0) {
+    encode_cache_.reset();
+  } else {
+    encode_cache_ = absl::make_unique<EncodeCache>(max_bytes);
   }
+  return util::OkStatus();
+}
 
-  CHECK_EQ_OR_RETURN(consumed, normalized.size())
-      << "all normalized characters are not consumed.";
+util::Status SentencePieceProcessor::SetSharedEncodeCache(
+    absl::string_view name, size_t max_bytes) {
+  if (name.empty()) {
+    encode_cache_.reset();
+    return util::OkStatus();
+  }
+  std::unique_ptr<SharedEncodeCache> cache;
+  RETURN_IF_ERROR(SharedEncodeCache::Open(name, max_bytes, &cache));
+  encode_cache_ = std::move(cache);
+  InvalidateEncodeCache();
+  return util::OkStatus();
+}
 
-  RETURN_IF_ERROR(ApplyExtraOptions(encode_extra_options_, spt));
+void SentencePieceProcessor::InvalidateEncodeCache() {
+  if (encode_cache_ == nullptr) return;
+  // The fingerprint is only needed to share the entries between processes.
+  encode_cache_->Invalidate(
+      encode_cache_->is_shared() ? EncodeCacheFingerprint() : 0,
+      model_ != nullptr ? model_->GetPieceSize() : 0);
+}
 
-  spt->set_text(input.data(), input.size());
+uint64_t SentencePieceProcessor::EncodeCacheFingerprint() const {
+  uint64 fp = 0;
+  if (model_proto_ != nullptr) {
+    fp = port::Fingerprint(model_proto_->SerializeAsString());
+  }
+  if (model_ != nullptr) {
+    // The symbols of an extended model are not in its proto.
+    const int proto_size =
+        model_proto_ != nullptr ? model_proto_->pieces_size() : 0;
+    for (int id = proto_size; id < model_->GetPieceSize(); ++id) {
+      fp = port::FingerprintCat(fp, port::Fingerprint(model_->IdToPiece(id)));
+    }
+    fp = port::FingerprintCat(
+        fp, static_cast<uint64>(model_->GetEncoderVersion()));
+    const VocabularyMask *mask = model_->vocabulary_mask();
+    fp = port::FingerprintCat(fp, mask == nullptr ? 0 : mask->size());
+    for (int id = 0; mask != nullptr && id < mask->size(); ++id) {
+      if (mask->IsUnused(id)) fp = port::FingerprintCat(fp, id);
+    }
+  }
+  fp = port::FingerprintCat(fp, encode_extra_options_.size());
+  for (const ExtraOption option : encode_extra_options_) {
+    fp = port::FingerprintCat(fp, option);
+  }
+  fp = port::FingerprintCat(fp, max_tokens_);
+  fp = port::FingerprintCat(fp, static_cast<uint64>(truncation_side_));
+  return port::FingerprintCat(fp, collapse_repeat_runs_);
+}
 
+util::Status SentencePieceProcessor::SetEncodeNumThreads(int num_threads) {
+  CHECK_GE_OR_RETURN(num_threads, 1);
+  encode_num_threads_ = num_threads;
   return util::OkStatus();
-}  // namespace sentencepiece
-
-util::Status SentencePieceProcessor::Encode(absl::string_view input,
-                                            SentencePieceText *spt) const {
-  CHECK_OR_RETURN_STATUS_PROTO(spt);
-
-  std::string normalized;
-  std::vector<size_t> norm_to_orig;
-  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+}
 
-  const auto result = model_->Encode(normalized);
-  RETURN_IF_ERROR(
-      PopulateSentencePieceText(input, normalized, norm_to_orig, result, spt));
+util::Status SentencePieceProcessor::SetDecodeMaxRepeatCount(int max_count) {
+  CHECK_GE_OR_RETURN(max_count, 1);
+  decode_max_repeat_count_ = max_count;
+  return util::OkStatus();
+}
 
+util::Status SentencePieceProcessor::SetDecodeMaxExpansion(
+    int64_t max_expansion) {
+  CHECK_GE_OR_RETURN(max_expansion, 0);
+  decode_max_expansion_ = max_expansion;
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::NBestEncode(
-    absl::string_view input, int nbest_size,
-    NBestSentencePieceText *nbest_spt) const {
-  CHECK_OR_RETURN_STATUS_PROTO(nbest_spt);
+util::Status SentencePieceProcessor::SetEncodeMaxTokens(int max_tokens,
+                                                        TruncationSide side) {
+  CHECK_GE_OR_RETURN(max_tokens, 0);
+  max_tokens_ = max_tokens;
+  truncation_side_ = side;
+  InvalidateEncodeCache();
+  return util::OkStatus();
+}
 
-  std::string normalized;
-  std::vector<size_t> norm_to_orig;
-  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+util::Status SentencePieceProcessor::SetBatchEncodeBackend(
+    BatchEncodeBackend backend) {
+  RETURN_IF_ERROR(CheckCanEncode());
+  if (backend != BatchEncodeBackend::kDefault) {
+    RETURN_IF_ERROR(NewBatchViterbiEncoder(*model_, backend)->status());
+  }
+  batch_encode_backend_ = backend;
+  UpdateBatchEncoder();
+  return util::OkStatus();
+}
 
-  CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
-      << "NBestEncode is not available for the current model.";
+void SentencePieceProcessor::UpdateBatchEncoder() {
+  batch_encoder_.reset();
+  if (batch_encode_backend_ == BatchEncodeBackend::kDefault ||
+      model_ == nullptr) {
+    return;
+  }
+  // A model without a batch encoder is encoded as with kDefault.
+  auto encoder = NewBatchViterbiEncoder(*model_, batch_encode_backend_);
+  if (encoder->status().ok()) batch_encoder_ = std::move(encoder);
+}
 
-  const auto nbests = model_->NBestEncode(normalized, nbest_size);
-  CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+util::Status SentencePieceProcessor::status() const {
+  CHECK_OR_RETURN(model_) << "Model is not initialized.";
+  // A decode-only model has no normalizer.
+  CHECK_OR_RETURN(normalizer_ || compiled_model_->decode_only_)
+      << "Normalizer is not initialized.";
+  RETURN_IF_ERROR(model_->status());
+  if (normalizer_) RETURN_IF_ERROR(normalizer_->status());
+  return util::OkStatus();
+}
 
-  for (const auto &result : nbests) {
-    auto *spt = nbest_spt->add_nbests();
-    spt->set_score(result.second);
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              result.first, spt));
+util::Status SentencePieceProcessor::CheckCanEncode() const {
+  RETURN_IF_ERROR(status());
+  if (normalizer_ == nullptr) {
+    return util::FailedPreconditionError(
+        "The model was loaded with LoadMode::kDecodeOnly and cannot encode.");
   }
+  return util::OkStatus();
+}
 
+util::Status SentencePieceProcessor::SetVocabulary(
+    const std::vector<std::string> &valid_vocab) {
+  RETURN_IF_ERROR(CheckModelIsNotShared());
+  std::shared_ptr<const VocabularyMask> mask;
+  RETURN_IF_ERROR(MakeVocabularyMask(valid_vocab, &mask));
+  model_->SetVocabularyMask(std::move(mask));
+  InvalidateEncodeCache();
+  UpdateBatchEncoder();
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::SampleEncode(
-    absl::string_view input, int nbest_size, float alpha,
-    SentencePieceText *spt) const {
-  CHECK_OR_RETURN_STATUS_PROTO(spt);
+util::Status SentencePieceProcessor::ResetVocabulary() {
+  RETURN_IF_ERROR(status());
+  RETURN_IF_ERROR(CheckModelIsNotShared());
+  model_->SetVocabularyMask(nullptr);
+  InvalidateEncodeCache();
+  UpdateBatchEncoder();
+  return util::OkStatus();
+}
 
-  CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
+util::Status SentencePieceProcessor::MakeVocabularyMask(
+    const std::vector<std::string> &valid_vocab,
+    std::shared_ptr<const VocabularyMask> *mask) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(mask);
 
-  std::string normalized;
-  std::vector<size_t> norm_to_orig;
-  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+  // TODO(taku): supports vocabulary constraint in BPE model.
+  const auto type = model_proto_->trainer_spec().model_type();
+  CHECK_OR_RETURN(type == TrainerSpec::UNIGRAM || type == TrainerSpec::BPE)
+      << "Vocabulary constraint is only enabled in subword units.";
 
-  if (!model_->IsNBestEncodeAvailable() || nbest_size < 0) {
-    CHECK_OR_RETURN(model_->IsSampleEncodeAvailable())
-        << "SampleEncode is not available for the current model.";
-    const auto result = model_->SampleEncode(normalized, alpha);
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              result, spt));
-  } else if (nbest_size == 1 || nbest_size == 0) {
-    const auto result = model_->Encode(normalized);
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              result, spt));
-  } else if (nbest_size > 1) {
-    const auto nbests = model_->NBestEncode(normalized, nbest_size);
-    CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+  const absl::flat_hash_set<absl::string_view, string_util::string_view_hash>
+      vocab(valid_vocab.begin(), valid_vocab.end());
 
-    std::vector<float> probs(nbests.size(), 0.0);
-    for (size_t i = 0; i < nbests.size(); ++i) {
-      probs[i] = std::exp(alpha * nbests[i].second);
+  auto new_mask = std::make_shared<VocabularyMask>();
+  // Pieces added by CompiledModel::Extend() are user defined and stay in
+  // the vocabulary.
+  new_mask->unused_.resize(model_->GetPieceSize(), false);
+  for (int i = 0; i < model_proto_->pieces_size(); ++i) {
+    const auto &piece = model_proto_->pieces(i);
+    if (piece.type() == ModelProto::SentencePiece::CONTROL ||
+        piece.type() == ModelProto::SentencePiece::UNKNOWN ||
+        piece.type() == ModelProto::SentencePiece::USER_DEFINED) {
+      continue;
     }
-
-    auto *mt = random::GetRandomGenerator();
-    std::discrete_distribution<int> dist(probs.begin(), probs.end());
-    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
-                                              nbests[dist(*mt)].first, spt));
+    new_mask->unused_[i] =
+        vocab.find(piece.piece()) == vocab.end() &&
+        string_util::OneCharLen(piece.piece().c_str()) != piece.piece().size();
   }
+  new_mask->model_data_ = model_->MakeVocabularyData(*new_mask);
+  new_mask->model_ = model_;
+  *mask = std::move(new_mask);
 
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::Decode(
-    const std::vector<std::string> &pieces, SentencePieceText *spt) const {
-  CHECK_OR_RETURN_STATUS_PROTO(spt);
-
-  const char *unk_surface = kDefaultUnknownSymbol;
-  if (model_proto_ && model_proto_->trainer_spec().has_unk_surface())
-    unk_surface = model_proto_->trainer_spec().unk_surface().c_str();
-
-  auto DecodeSentencePiece = [&](absl::string_view piece, int id,
-                                 bool is_bos_ws, bool is_eos_ws) -> std::string {
-    if (IsControl(id)) {  // <s>, </s>
-      return "";          // invisible symbol.
-    } else if (IsUnknown(id)) {
-      if (IdToPiece(id) == piece) {  // <unk>
-        return unk_surface;
-      } else {  // return piece when piece is not <unk>.
-        return std::string(piece);
+util::Status SentencePieceProcessor::LoadVocabulary(absl::string_view filename,
+                                                    int threshold) {
+  std::vector<std::string> vocab;
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    RETURN_IF_ERROR(input->status());
+    std::string data;
+    if (input->Read(kVocabularyCountsMagic.size(), &data) &&
+        data == kVocabularyCountsMagic) {
+      RETURN_IF_ERROR(status());
+      std::string header;
+      CHECK_OR_RETURN(input->Read(4, &header) &&
+                      DecodeLittleEndian(header) == GetPieceSize())
+          << "The vocabulary counts are made for another model.";
+      CHECK_OR_RETURN(input->Read(8 * GetPieceSize(), &data) &&
+                      !input->Read(1, &header))
+          << "Broken vocabulary counts.";
+      for (int id = 0; id < GetPieceSize(); ++id) {
+        const uint64 freq = DecodeLittleEndian(
+            absl::string_view(data).substr(8 * id, 8));
+        if (freq > 0 && static_cast<int64>(freq) >= threshold) {
+          vocab.emplace_back(IdToPiece(id));
+        }
       }
+      return SetVocabulary(vocab);
     }
+  }
 
-    if(!model_proto_ || !model_proto_->has_trainer_spec()
-       || !model_proto_->trainer_spec().treat_whitespace_as_suffix()) {
-      if(is_bos_ws &&
-          (!model_proto_ ||
-           (model_proto_ &&
-            (model_proto_->normalizer_spec().add_dummy_prefix() ||
-             model_proto_->normalizer_spec().remove_extra_whitespaces())))) {
-        // Consume if the current position is bos and
-        // piece starts with kSpaceSymbol.
-        absl::ConsumePrefix(&piece, kSpaceSymbol);
-      }
-    } else {
-        if(is_eos_ws &&
-            (!model_proto_ ||
-             (model_proto_ &&
-              (model_proto_->normalizer_spec().add_dummy_prefix() ||
-               model_proto_->normalizer_spec().remove_extra_whitespaces())))) {
-          // Consume if the current position is eos and
-          // piece ends with kSpaceSymbol.
-          if(absl::EndsWith(piece, kSpaceSymbol))
-            piece.remove_suffix(3);
-        }
+  auto input = filesystem::NewReadableFile(filename);
+  RETURN_IF_ERROR(input->status());
+
+  std::string line;
+
+  while (input->ReadLine(&line)) {
+    const std::vector<std::string> v = absl::StrSplit(line, "\t");
+    CHECK_GE_OR_RETURN(v.size(), 1);
+    CHECK_OR_RETURN(!v[0].empty());
+    int32 freq = 1;
+    if (v.size() >= 2) {
+      CHECK_OR_RETURN(absl::SimpleAtoi(v[1], &freq))
+          << "Could not parse the frequency";
+    }
+    if (freq >= threshold) {
+      vocab.emplace_back(v[0]);
+    }
+  }
+
+  return SetVocabulary(vocab);
+}
+
+util::Status SentencePieceProcessor::SerializeVocabularyCounts(
+    const std::vector<uint64_t> &counts, std::string *output) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN(output) << "output is null.";
+  CHECK_EQ_OR_RETURN(counts.size(), static_cast<size_t>(GetPieceSize()))
+      << "One count per piece is expected.";
+  output->assign(kVocabularyCountsMagic.data(), kVocabularyCountsMagic.size());
+  output->reserve(output->size() + 4 + 8 * counts.size());
+  AppendLittleEndian(counts.size(), 4, output);
+  for (const uint64 count : counts) AppendLittleEndian(count, 8, output);
+  return util::OkStatus();
+}
+
+#define CHECK_OR_RETURN_STATUS_STL(container)               \
+  RETURN_IF_ERROR(CheckCanEncode());                        \
+  CHECK_OR_RETURN(container) << "output container is null"; \
+  container->clear();
+
+#define CHECK_OR_RETURN_STATUS_PROTO(proto)         \
+  RETURN_IF_ERROR(CheckCanEncode());                \
+  CHECK_OR_RETURN(proto) << "output proto is null"; \
+  proto->Clear();
+
+// Same as above for the decode methods, which decode-only models support.
+#define CHECK_OR_RETURN_DECODE_STATUS_STL(container)        \
+  RETURN_IF_ERROR(status());                                \
+  CHECK_OR_RETURN(container) << "output container is null"; \
+  container->clear();
+
+#define CHECK_OR_RETURN_DECODE_STATUS_PROTO(proto)  \
+  RETURN_IF_ERROR(status());                        \
+  CHECK_OR_RETURN(proto) << "output proto is null"; \
+  proto->Clear();
+
+//////////////////////////////////////////////////////////////
+// Simple API.
+//////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////
+// Simple API.
+util::Status SentencePieceProcessor::Encode(
+    absl::string_view input, std::vector<std::string> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  SentencePieceText spt;
+  RETURN_IF_ERROR(Encode(input, &spt));
+
+  stats::PhaseTimer timer;
+  pieces->reserve(spt.pieces_size());
+  ForEachRepeatRun(spt, [&](const SentencePieceText::SentencePiece &sp,
+                            int count) {
+    pieces->emplace_back(sp.piece());
+    if (count > 1) {
+      ForEachRepeatMarker(*model_, count, [&](int, absl::string_view piece) {
+        pieces->emplace_back(piece.data(), piece.size());
+      });
     }
+  });
+  timer.Lap(stats::kRleNs, pieces->size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodePiecesWithIds(
+    absl::string_view input, std::vector<int> *ids,
+    std::vector<std::string> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  SentencePieceText spt;
+  RETURN_IF_ERROR(Encode(input, &spt));
 
-    return absl::StrReplaceAll(piece, {{kSpaceSymbol, " "}});
+  stats::PhaseTimer timer;
+  ids->reserve(spt.pieces_size());
+  pieces->reserve(spt.pieces_size());
+  auto add = [&](int id, absl::string_view piece) {
+    ids->push_back(id);
+    pieces->emplace_back();
+    if (piece != IdToPiece(id)) {
+      pieces->back().assign(piece.data(), piece.size());
+    }
   };
+  ForEachRepeatRun(spt, [&](const SentencePieceText::SentencePiece &sp,
+                            int count) {
+    add(sp.id(), sp.piece());
+    if (count > 1) ForEachRepeatMarker(*model_, count, add);
+  });
+  timer.Lap(stats::kRleNs, pieces->size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodePiecesWithIds(
+    absl::string_view input, int nbest_size, float alpha,
+    std::vector<int> *ids, std::vector<std::string> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(pieces);
 
-  for (const std::string &w : pieces) {
-    auto *sp = spt->add_pieces();
-    sp->set_piece(w);
-    sp->set_id(PieceToId(w));
+  SentencePieceText spt;
+  RETURN_IF_ERROR(SampleEncode(input, nbest_size, alpha, &spt));
+  for (const auto &sp : spt.pieces()) {
+    ids->push_back(sp.id());
+    pieces->emplace_back();
+    if (sp.piece() != IdToPiece(sp.id())) pieces->back() = sp.piece();
   }
 
-  RETURN_IF_ERROR(ApplyExtraOptions(decode_extra_options_, spt));
+  return util::OkStatus();
+}
 
-  std::string *text = spt->mutable_text();
-  auto SetSurface = [&](int index, const std::string &surface) {
-    auto *sp = spt->mutable_pieces(index);
-    sp->set_surface(surface);
-    sp->set_begin(text->size());
-    sp->set_end(text->size() + surface.size());
-    *text += surface;
-  };
-  auto ProcessBytePieces = [&](int begin, int end) -> util::Status {
-    if (begin < end) {
-      // Constructs byte sequence.
-      std::string bytes;
-      for (int i = begin; i < end; ++i) {
-        const auto &sp = spt->pieces(i);
-        const int byte = PieceToByte(sp.piece());
-        CHECK_LE_OR_RETURN(0, byte);
-        bytes.append(1, byte);
+util::Status SentencePieceProcessor::NBestEncodePiecesWithIds(
+    absl::string_view input, int nbest_size,
+    std::vector<std::vector<int>> *ids,
+    std::vector<std::vector<std::string>> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+
+  NBestSentencePieceText spt;
+  RETURN_IF_ERROR(NBestEncode(input, nbest_size, &spt));
+  ids->resize(spt.nbests_size());
+  pieces->resize(spt.nbests_size());
+  for (int i = 0; i < spt.nbests_size(); ++i) {
+    for (const auto &sp : spt.nbests(i).pieces()) {
+      (*ids)[i].push_back(sp.id());
+      (*pieces)[i].emplace_back();
+      if (sp.piece() != IdToPiece(sp.id())) (*pieces)[i].back() = sp.piece();
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            std::vector<int> *ids) const {
+  return EncodeIds(input, ids);
+}
+
+util::Status SentencePieceProcessor::EncodeIds(
+    absl::string_view input, std::vector<int> *ids,
+    EncodeWorkspace *workspace) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  ScopedThreadWorkspace thread_workspace(workspace == nullptr);
+  if (workspace == nullptr) workspace = thread_workspace.get();
+
+  // The cache holds the ids of this processor's model and options, so a
+  // mask or options in the workspace bypass it.
+  EncodeCacheInterface *cache = workspace->vocabulary == nullptr &&
+                               workspace->extra_options == nullptr
+                           ? encode_cache_.get()
+                           : nullptr;
+  if (cache != nullptr) {
+    if (cache->Lookup(input, ids)) {
+      stats::Add(stats::kCacheHits, 1);
+      stats::Add(stats::kNumCalls, 1);
+      stats::Add(stats::kBytesIn, input.size());
+      return util::OkStatus();
+    }
+    stats::Add(stats::kCacheMisses, 1);
+  }
+
+  RETURN_IF_ERROR(EncodeRawIds(input, workspace));
+
+  stats::PhaseTimer timer;
+  AppendRepeatRuns(workspace->ids, ids);
+  timer.Lap(stats::kRleNs, ids->size());
+
+  if (cache != nullptr) cache->Insert(input, *ids);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeRawIds(
+    absl::string_view input, EncodeWorkspace *workspace) const {
+  CHECK_OR_RETURN(workspace->vocabulary == nullptr ||
+                  workspace->vocabulary->size() == GetPieceSize())
+      << "The vocabulary mask is made for another model.";
+
+  if (max_tokens_ > 0) {
+    RETURN_IF_ERROR(EncodeTruncatedIds(input, workspace));
+  } else if (input.size() > kEncodeChunkSize &&
+             compiled_model_->has_word_boundaries_) {
+    RETURN_IF_ERROR(EncodeChunkedIds(input, workspace));
+  } else {
+    stats::PhaseTimer timer;
+    std::string &normalized = workspace->normalized;
+    RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, nullptr));
+    timer.Lap(stats::kNormalizeNs);
+    RETURN_IF_ERROR(EncodeNormalizedIds(input, normalized, workspace));
+  }
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CountTokens(
+    absl::string_view input, size_t *num_tokens,
+    EncodeWorkspace *workspace) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN(num_tokens) << "output container is null";
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  ScopedThreadWorkspace thread_workspace(workspace == nullptr);
+  if (workspace == nullptr) workspace = thread_workspace.get();
+
+  // The ids of a cache hit go to the scratch buffer of the raw ids.
+  EncodeCacheInterface *cache = workspace->vocabulary == nullptr &&
+                               workspace->extra_options == nullptr
+                           ? encode_cache_.get()
+                           : nullptr;
+  if (cache != nullptr) {
+    if (cache->Lookup(input, &workspace->ids)) {
+      stats::Add(stats::kCacheHits, 1);
+      stats::Add(stats::kNumCalls, 1);
+      stats::Add(stats::kBytesIn, input.size());
+      *num_tokens = workspace->ids.size();
+      return util::OkStatus();
+    }
+    stats::Add(stats::kCacheMisses, 1);
+  }
+
+  RETURN_IF_ERROR(EncodeRawIds(input, workspace));
+
+  stats::PhaseTimer timer;
+  *num_tokens = RepeatRunsSize(workspace->ids);
+  timer.Lap(stats::kRleNs, *num_tokens);
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CountTokensBatch(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<size_t> *num_tokens, int num_threads) const {
+  CHECK_OR_RETURN_STATUS_STL(num_tokens);
+  num_tokens->resize(inputs.size());
+  std::vector<util::Status> status(inputs.size());
+
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    ScopedThreadWorkspace thread_workspace(true);
+    EncodeWorkspace &workspace = *thread_workspace.get();
+    for (int64 i = begin; i < end; ++i) {
+      status[i] = CountTokens(inputs[i], &(*num_tokens)[i], &workspace);
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeNormalizedIds(
+    absl::string_view input, absl::string_view normalized,
+    EncodeWorkspace *workspace) const {
+  stats::PhaseTimer timer;
+  std::vector<int> &raw = workspace->ids;
+  RETURN_IF_ERROR(SegmentNormalized(normalized, workspace));
+  timer.Lap(stats::kModelEncodeNs, workspace->compact_pieces.size());
+  RETURN_IF_ERROR(PopulateRawIds(normalized, workspace->compact_pieces, &raw));
+  RETURN_IF_ERROR(ApplyExtraOptions(EncodeExtraOptions(*workspace), &raw));
+  timer.Lap(stats::kProtoNs);
+  AddEncodeStats(input, normalized, workspace->compact_pieces.size());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodePreNormalized(
+    absl::string_view normalized, std::vector<int> *ids) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_EQ_OR_RETURN(max_tokens_, 0)
+      << "SetEncodeMaxTokens() needs the original input.";
+  stats::ScopedTrace trace(tracer_.get(), normalized.size());
+  if (check_pre_normalized_) {
+    RETURN_IF_ERROR(CheckPreNormalized(normalized, normalized, nullptr));
+  }
+
+  EncodeWorkspace workspace;
+  RETURN_IF_ERROR(EncodeNormalizedIds(normalized, normalized, &workspace));
+  stats::PhaseTimer timer;
+  AppendRepeatRuns(workspace.ids, ids);
+  timer.Lap(stats::kRleNs, ids->size());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodePreNormalized(
+    absl::string_view normalized, SentencePieceText *spt) const {
+  // The surfaces of the identity alignment are the bytes of `normalized`.
+  std::vector<uint32> norm_to_orig(normalized.size() + 1);
+  std::iota(norm_to_orig.begin(), norm_to_orig.end(), 0);
+  return EncodePreNormalized(normalized, normalized, norm_to_orig, spt);
+}
+
+util::Status SentencePieceProcessor::EncodePreNormalized(
+    absl::string_view input, absl::string_view normalized,
+    const std::vector<uint32> &norm_to_orig, SentencePieceText *spt) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN_STATUS_PROTO(spt);
+  // The normalizer outputs no alignment for an empty text.
+  if (!normalized.empty() || !norm_to_orig.empty()) {
+    CHECK_EQ_OR_RETURN(norm_to_orig.size(), normalized.size() + 1)
+        << "norm_to_orig must have an offset for every byte of the "
+           "normalized input and its end.";
+    CHECK_LE_OR_RETURN(norm_to_orig.back(), input.size());
+  }
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+  if (check_pre_normalized_) {
+    RETURN_IF_ERROR(CheckPreNormalized(normalized, input, &norm_to_orig));
+  }
+  return EncodeNormalized(input, normalized, norm_to_orig, spt);
+}
+
+util::Status SentencePieceProcessor::CheckPreNormalized(
+    absl::string_view normalized, absl::string_view input,
+    const std::vector<uint32> *norm_to_orig) const {
+  CHECK_OR_RETURN(string_util::IsStructurallyValid(normalized))
+      << "The normalized input is not valid UTF-8.";
+  CHECK_OR_RETURN(!model_proto_->normalizer_spec().escape_whitespaces() ||
+                  normalized.find(' ') == absl::string_view::npos)
+      << "The normalized input has an unescaped whitespace.";
+  if (norm_to_orig == nullptr) return util::OkStatus();
+
+  std::string expected;
+  std::vector<uint32> expected_norm_to_orig;
+  RETURN_IF_ERROR(
+      normalizer_->Normalize(input, &expected, &expected_norm_to_orig));
+  CHECK_OR_RETURN(expected == normalized)
+      << "The normalized input is not the normalization of the input.";
+  CHECK_OR_RETURN(expected_norm_to_orig == *norm_to_orig)
+      << "norm_to_orig is not the alignment of the normalized input.";
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SegmentNormalized(
+    absl::string_view normalized, EncodeWorkspace *workspace) const {
+  CHECK_LT_OR_RETURN(normalized.size(), static_cast<size_t>(kuint32max))
+      << "The normalized input is too long.";
+  if (!collapse_repeat_runs_ || !SegmentRepeatRuns(normalized, workspace)) {
+    model_->EncodeCompact(normalized, workspace->vocabulary,
+                          &workspace->pieces, &workspace->compact_pieces);
+  }
+  return util::OkStatus();
+}
+
+bool SentencePieceProcessor::SegmentRepeatRuns(
+    absl::string_view normalized, EncodeWorkspace *workspace) const {
+  std::vector<RepeatRun> runs;
+  FindRepeatRuns(normalized, &runs);
+  if (runs.empty()) return false;
+
+  // The runs are first shortened to about kRepeatContextBytes bytes on both
+  // sides of their middle, to find the piece repeated there. They are then
+  // segmented again with as many more units as make the removed bytes a
+  // multiple of that piece, so that it can be repeated in their place.
+  std::vector<size_t> kept(runs.size());
+  std::vector<int> ids(runs.size());
+  std::vector<uint32> lengths(runs.size());
+  std::vector<size_t> blocks(runs.size());  // in collapsed_pieces.
+  const auto &pieces = workspace->collapsed_pieces;
+  for (int pass = 0; pass < 2; ++pass) {
+    std::string &text = workspace->collapsed;
+    std::vector<std::pair<size_t, size_t>> ranges(runs.size());
+    text.clear();
+    size_t pos = 0;
+    for (size_t k = 0; k < runs.size(); ++k) {
+      const RepeatRun &run = runs[k];
+      const size_t min_kept =
+          (2 * kRepeatContextBytes + run.period - 1) / run.period;
+      if (pass == 0) {
+        kept[k] = min_kept;
+      } else {
+        const size_t step = lengths[k] / Gcd(run.period, lengths[k]);
+        kept[k] = min_kept + (run.count - min_kept) % step;
+        if (kept[k] > run.count) return false;
       }
-      // Decodes byte sequence as UTF-8 and encodes the result into UTF-8 bytes
-      // again.
-      int i = begin;
-      for (const char32 uc :
-           string_util::UTF8ToUnicodeText(absl::string_view(bytes))) {
-        if (uc == kUnicodeError) {
-          // Invalid UTF-8 bytes are mapped to REPLACEMENT CHARACTER (U+FFFD).
-          SetSurface(i++, string_util::UnicodeCharToUTF8(kUnicodeError));
-        } else {
-          const std::string utf8 = string_util::UnicodeCharToUTF8(uc);
-          for (int j = 0; j < utf8.size(); j++) {
-            // The last byte piece holds the surface of the original unknown
-            // character. The other byte pieces hold an empty string as
-            // surface.
-            if (j == utf8.size() - 1) {
-              SetSurface(i++, utf8);
-            } else {
-              SetSurface(i++, "");
-            }
-          }
-        }
+      text.append(normalized.data() + pos, run.begin - pos);
+      ranges[k].first = text.size();
+      text.append(normalized.data() + run.begin, kept[k] * run.period);
+      ranges[k].second = text.size();
+      pos = run.begin + run.count * run.period;
+    }
+    text.append(normalized.data() + pos, normalized.size() - pos);
+    model_->EncodeCompact(text, workspace->vocabulary, &workspace->pieces,
+                          &workspace->collapsed_pieces);
+
+    // Finds the pieces of the same id covering the middle of every run.
+    size_t i = 0;
+    for (size_t k = 0; k < runs.size(); ++k) {
+      const size_t begin = ranges[k].first, end = ranges[k].second;
+      const size_t middle = (begin + end) / 2;
+      while (i < pieces.size() && pieces[i].begin + pieces[i].length <= middle)
+        ++i;
+      if (i == pieces.size()) return false;
+      const CompactPiece &piece = pieces[i];
+      if (piece.length == 0 || IsUnknown(piece.id) || piece.begin < begin ||
+          piece.begin + piece.length > end) {
+        return false;
       }
-      CHECK_EQ_OR_RETURN(i, end);
+      size_t first = i, last = i;
+      while (first > 0 && pieces[first - 1].id == piece.id &&
+             pieces[first - 1].begin >= begin) {
+        --first;
+      }
+      while (last + 1 < pieces.size() && pieces[last + 1].id == piece.id &&
+             pieces[last + 1].begin + pieces[last + 1].length <= end) {
+        ++last;
+      }
+      if (first == last) return false;
+      if (pass == 0) {
+        ids[k] = piece.id;
+        lengths[k] = piece.length;
+      } else if (ids[k] != piece.id) {
+        return false;
+      }
+      blocks[k] = first;
     }
-    return util::OkStatus();
-  };
-  int byte_start = 0;
-  for (int i = 0; i < spt->pieces_size(); ++i) {
-    const auto &sp = spt->pieces(i);
-    if (!IsByte(sp.id())) {
-      RETURN_IF_ERROR(ProcessBytePieces(byte_start, i));
-      byte_start = i + 1;
-      bool is_eos_space = i == spt->pieces_size() - 1;
-      SetSurface(i, DecodeSentencePiece(sp.piece(), sp.id(), text->empty(), is_eos_space));
+  }
+
+  // Repeats the piece in place of the removed units.
+  auto &result = workspace->compact_pieces;
+  result.clear();
+  size_t k = 0;
+  uint32 shift = 0;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    CompactPiece piece = pieces[i];
+    piece.begin += shift;
+    result.push_back(piece);
+    if (k == runs.size() || i != blocks[k]) continue;
+    const uint32 removed = (runs[k].count - kept[k]) * runs[k].period;
+    for (uint32 n = 0; n < removed / piece.length; ++n) {
+      piece.begin += piece.length;
+      result.push_back(piece);
     }
+    shift += removed;
+    ++k;
   }
-  RETURN_IF_ERROR(ProcessBytePieces(byte_start, spt->pieces_size()));
+  return true;
+}
 
-  // If there is a denormalizer, we need to remap the surface strings on
-  // the individual pieces based on the norm_to_orig mapping from the
-  // denormalizer. Otherwise, if the number of characters differ across the
-  // denormalized and normalized form, the surface strings would be the 
-  // pre-denormalized surface strings, rather than post-denormalized. This
-  // is particularly a problem with case encoding.
-  if (denormalizer_) {
-    std::string normalized;
-    std::vector<size_t> norm_to_orig;
-    denormalizer_->Normalize(*text, &normalized, &norm_to_orig);
-    *text = normalized;
+void SentencePieceProcessor::AppendRepeatRuns(const std::vector<int> &raw,
+                                              std::vector<int> *ids) const {
+  // Pieces with the same id are identical except for unknown pieces, which
+  // only meet bos/eos pieces here and never form a run.
+  ids->reserve(raw.size());
+  for (size_t i = 0; i < raw.size();) {
+    size_t j = i + 1;
+    if (!IsUnknown(raw[i])) {
+      while (j < raw.size() && raw[j] == raw[i]) ++j;
+    }
+    ids->push_back(raw[i]);
+    if (j - i > 1) {
+      ForEachRepeatMarker(*model_, j - i, [&](int id, absl::string_view) {
+        ids->push_back(id);
+      });
+    }
+    i = j;
+  }
+}
 
-    // Since this is denormalization, we really want orig_to_norm mapping
-    // here instead. Constructing that
-    std::map<int, int> orig_to_norm;
-    for(int i = 0; i < norm_to_orig.size(); i++) {
-      if (orig_to_norm.find(norm_to_orig[i]) == orig_to_norm.end()) {
-        orig_to_norm[norm_to_orig[i]] = i;
+util::Status SentencePieceProcessor::EncodeTruncatedIds(
+    absl::string_view input, EncodeWorkspace *workspace) const {
+  const auto &extra_options = EncodeExtraOptions(*workspace);
+  size_t num_special_ids = 0;
+  for (const auto option : extra_options) {
+    if (option != REVERSE) ++num_special_ids;
+  }
+  CHECK_GE_OR_RETURN(static_cast<size_t>(max_tokens_), num_special_ids)
+      << "max_tokens leaves no room for the bos/eos ids.";
+  const size_t max_size = max_tokens_ - num_special_ids;
+  const bool keep_last = truncation_side_ == TruncationSide::kLeft;
+  const bool has_boundaries = compiled_model_->has_word_boundaries_;
+  const bool lowercase_before_boundary =
+      has_boundaries && model_proto_->normalizer_spec().encode_case();
+
+  // The input is encoded in chunks cut between words, from its end when the
+  // last ids are kept. The ids are then collected in reverse, so that both
+  // sides are truncated as a prefix.
+  stats::Add(stats::kNumCalls, 1);
+  std::vector<int> &ids = workspace->ids;
+  ids.clear();
+  // Few pieces are longer than 8 bytes, so the first chunk usually has
+  // enough ids.
+  size_t chunk_size = std::max<size_t>(256, 8 * max_size);
+  absl::string_view rest = input;
+  while (!rest.empty()) {
+    const absl::string_view chunk =
+        has_boundaries ? CutAtWordBoundary(rest, chunk_size, keep_last,
+                                           lowercase_before_boundary)
+                       : rest;
+    rest = keep_last ? rest.substr(0, rest.size() - chunk.size())
+                     : rest.substr(chunk.size());
+    RETURN_IF_ERROR(AppendChunkIds(chunk, keep_last, workspace, &ids));
+
+    // The last run may go on in the next chunk.
+    if (ClosedRunsSize(ids) >= max_size) break;
+    chunk_size *= 2;
+  }
+
+  TruncateRuns(max_size, &ids);
+  if (keep_last) std::reverse(ids.begin(), ids.end());
+  return ApplyExtraOptions(extra_options, &ids);
+}
+
+util::Status SentencePieceProcessor::EncodeChunkedIds(
+    absl::string_view input, EncodeWorkspace *workspace) const {
+  const bool lowercase_before_boundary =
+      model_proto_->normalizer_spec().encode_case();
+  stats::Add(stats::kNumCalls, 1);
+  std::vector<int> &ids = workspace->ids;
+  ids.clear();
+  if (encode_num_threads_ <= 1 || input.size() <= kParallelEncodeMinBytes) {
+    absl::string_view rest = input;
+    while (!rest.empty()) {
+      const absl::string_view chunk = CutAtWordBoundary(
+          rest, kEncodeChunkSize, false, lowercase_before_boundary);
+      rest.remove_prefix(chunk.size());
+      RETURN_IF_ERROR(AppendChunkIds(chunk, false, workspace, &ids));
+    }
+    return ApplyExtraOptions(EncodeExtraOptions(*workspace), &ids);
+  }
+
+  const auto chunks = CutIntoChunks(input, lowercase_before_boundary);
+  std::vector<std::vector<int>> chunk_ids(chunks.size());
+  std::vector<util::Status> status(chunks.size());
+  ParallelForBatch(chunks.size(), encode_num_threads_,
+                   [&](int64 begin, int64 end) {
+                     EncodeWorkspace chunk_workspace;
+                     chunk_workspace.vocabulary = workspace->vocabulary;
+                     for (int64 k = begin; k < end; ++k) {
+                       status[k] = AppendChunkIds(chunks[k], false,
+                                                  &chunk_workspace,
+                                                  &chunk_ids[k]);
+                     }
+                   });
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+  for (const auto &c : chunk_ids) {
+    // Continuous unknown pieces are merged into one across the cut too.
+    const bool skip_first = !ids.empty() && !c.empty() &&
+                            IsUnknown(ids.back()) && IsUnknown(c[0]);
+    ids.insert(ids.end(), c.begin() + (skip_first ? 1 : 0), c.end());
+  }
+  return ApplyExtraOptions(EncodeExtraOptions(*workspace), &ids);
+}
+
+util::Status SentencePieceProcessor::AppendChunkIds(
+    absl::string_view chunk, bool reverse, EncodeWorkspace *workspace,
+    std::vector<int> *ids) const {
+  stats::PhaseTimer timer;
+  std::string &normalized = workspace->normalized;
+  std::vector<int> &chunk_ids = workspace->chunk_ids;
+  RETURN_IF_ERROR(normalizer_->Normalize(chunk, &normalized, nullptr));
+  timer.Lap(stats::kNormalizeNs);
+  RETURN_IF_ERROR(SegmentNormalized(normalized, workspace));
+  timer.Lap(stats::kModelEncodeNs, workspace->compact_pieces.size());
+  RETURN_IF_ERROR(
+      PopulateRawIds(normalized, workspace->compact_pieces, &chunk_ids));
+  if (reverse) std::reverse(chunk_ids.begin(), chunk_ids.end());
+  // Continuous unknown pieces are merged into one across the cut too.
+  const bool skip_first = !ids->empty() && !chunk_ids.empty() &&
+                          IsUnknown(ids->back()) && IsUnknown(chunk_ids[0]);
+  ids->insert(ids->end(), chunk_ids.begin() + (skip_first ? 1 : 0),
+              chunk_ids.end());
+  timer.Lap(stats::kProtoNs);
+  stats::Add(stats::kBytesIn, chunk.size());
+  stats::Add(stats::kBytesOut, normalized.size());
+  stats::Add(stats::kTokensOut, workspace->compact_pieces.size());
+  return util::OkStatus();
+}
+
+void SentencePieceProcessor::TruncateRuns(size_t max_size,
+                                          std::vector<int> *ids) const {
+  const auto &special = model_->special_piece_ids();
+  size_t size = 0;
+  for (size_t i = 0; i < ids->size();) {
+    size_t j = i + 1;
+    if (!IsUnknown((*ids)[i])) {
+      while (j < ids->size() && (*ids)[j] == (*ids)[i]) ++j;
+    }
+    if (size + RepeatRunSize(special, j - i) > max_size) {
+      // Keeps the longest part of the run that fits. A run of two or more
+      // ids takes three ids and its digits, or its count pieces.
+      const size_t room = max_size - size;
+      size_t count = room > 0 ? 1 : 0;
+      if (special.has_repeat_counts && room >= 2) {
+        // The first count pieces of the run, which are the count pieces of
+        // their sum too.
+        size_t num_pieces = 0;
+        ForEachRepeatCountPiece(j - i - 1, [&](int k) {
+          if (++num_pieces < room) count += RepeatCountPieceValue(k);
+        });
+      } else if (!special.has_repeat_counts && room >= 4) {
+        count = 9;
+        for (size_t digits = 1; digits < room - 3 && count < j - i; ++digits) {
+          count = count * 10 + 9;
+        }
+        count = std::min(count, j - i);
       }
+      ids->resize(i + count);
+      return;
+    }
+    size += RepeatRunSize(special, j - i);
+    i = j;
+  }
+}
+
+size_t SentencePieceProcessor::RepeatRunsSize(
+    const std::vector<int> &ids) const {
+  size_t size = 0;
+  for (size_t i = 0; i < ids.size();) {
+    size_t j = i + 1;
+    if (!IsUnknown(ids[i])) {
+      while (j < ids.size() && ids[j] == ids[i]) ++j;
+    }
+    size += RepeatRunSize(model_->special_piece_ids(), j - i);
+    i = j;
+  }
+  return size;
+}
+
+size_t SentencePieceProcessor::ClosedRunsSize(
+    const std::vector<int> &ids) const {
+  size_t size = 0;
+  for (size_t i = 0; i < ids.size();) {
+    size_t j = i + 1;
+    if (!IsUnknown(ids[i])) {
+      while (j < ids.size() && ids[j] == ids[i]) ++j;
     }
+    if (j == ids.size()) break;
+    size += RepeatRunSize(model_->special_piece_ids(), j - i);
+    i = j;
+  }
+  return size;
+}
+
+util::Status SentencePieceProcessor::PopulateIds(
+    absl::string_view normalized, const EncodeResult &result,
+    std::vector<int> *ids) const {
+  RETURN_IF_ERROR(PopulateRawIds(normalized, result, ids));
+  return ApplyExtraOptions(encode_extra_options_, ids);
+}
+
+template <typename ResultT>
+util::Status SentencePieceProcessor::PopulateRawIds(
+    absl::string_view normalized, const ResultT &result,
+    std::vector<int> *ids) const {
+  // Mirrors PopulateSentencePieceText() without keeping pieces or surfaces.
+  ids->clear();
+  ids->reserve(result.size());
+  size_t consumed = 0;
+  bool is_prev_unk = false;
+  for (const auto &p : result) {
+    const int id = PieceId(p);
+    const bool is_unk = IsUnknown(id);
+    if (IsControl(id)) {
+      // Control symbol has no corresponding source surface.
+      ids->push_back(id);
+    } else {
+      const absl::string_view w = PieceBytes(normalized, p);
+      CHECK_OR_RETURN(!w.empty()) << "Empty piece is not allowed.";
+      CHECK_LE_OR_RETURN(consumed + w.size(), normalized.size());
+      if (is_unk && model_->ByteFallbackEnabled()) {
+        for (const char b : w) {
+          ids->push_back(model_->ByteToId(b));
+        }
+      } else if (!(is_prev_unk && is_unk)) {
+        // Continuous unknown pieces are merged into one.
+        ids->push_back(id);
+      }
+      consumed += w.size();
+    }
+    is_prev_unk = is_unk;
+  }
+
+  CHECK_EQ_OR_RETURN(consumed, normalized.size())
+      << "all normalized characters are not consumed.";
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<std::vector<int>> *ids, int num_threads) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  if (batch_encoder_ != nullptr && max_tokens_ == 0) {
+    return EncodeBatchWithEncoder(inputs, ids, num_threads);
+  }
+
+  ids->resize(inputs.size());
+  std::vector<util::Status> status(inputs.size());
+
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    ScopedThreadWorkspace thread_workspace(true);
+    EncodeWorkspace &workspace = *thread_workspace.get();
+    for (int64 i = begin; i < end; ++i) {
+      status[i] = EncodeIds(inputs[i], &(*ids)[i], &workspace);
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatchWithEncoder(
+    const std::vector<absl::string_view> &inputs,
+    std::vector<std::vector<int>> *ids, int num_threads) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  ids->resize(inputs.size());
+  std::vector<util::Status> status(inputs.size());
+
+  // Inputs encoded in chunks by EncodeIds() stay there, so that they are cut
+  // at the same words.
+  std::vector<int64> rows(inputs.size(), -1);
+  std::vector<size_t> batched;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (inputs[i].size() <= kEncodeChunkSize ||
+        !compiled_model_->has_word_boundaries_) {
+      rows[i] = batched.size();
+      batched.push_back(i);
+    }
+  }
+
+  std::vector<std::string> normalized(batched.size());
+  ParallelForBatch(batched.size(), num_threads, [&](int64 begin, int64 end) {
+    for (int64 k = begin; k < end; ++k) {
+      status[batched[k]] =
+          normalizer_->Normalize(inputs[batched[k]], &normalized[k], nullptr);
+    }
+  });
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  const std::vector<absl::string_view> views(normalized.begin(),
+                                             normalized.end());
+  std::vector<int> piece_ids, lengths;
+  std::vector<size_t> offsets;
+  RETURN_IF_ERROR(batch_encoder_->Encode(views, num_threads, &piece_ids,
+                                         &lengths, &offsets));
+
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    ScopedThreadWorkspace thread_workspace(true);
+    EncodeWorkspace &workspace = *thread_workspace.get();
+    for (int64 i = begin; i < end; ++i) {
+      auto &output = (*ids)[i];
+      output.clear();
+      const int64 k = rows[i];
+      if (k < 0) {
+        status[i] = EncodeIds(inputs[i], &output, &workspace);
+        continue;
+      }
+      const absl::string_view text = views[k];
+      auto &pieces = workspace.compact_pieces;
+      if (!collapse_repeat_runs_ || !SegmentRepeatRuns(text, &workspace)) {
+        pieces.clear();
+        uint32 pos = 0;
+        for (size_t j = offsets[k]; j < offsets[k + 1]; ++j) {
+          pieces.push_back(
+              {pos, static_cast<uint32>(lengths[j]), piece_ids[j]});
+          pos += lengths[j];
+        }
+      }
+      status[i] = PopulateRawIds(text, pieces, &workspace.ids);
+      if (status[i].ok()) {
+        status[i] = ApplyExtraOptions(encode_extra_options_, &workspace.ids);
+      }
+      if (!status[i].ok()) continue;
+      AppendRepeatRuns(workspace.ids, &output);
+      AddEncodeStats(inputs[i], text, pieces.size());
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs, std::vector<int> *ids,
+    std::vector<size_t> *offsets, int num_threads) const {
+  return EncodeBatch(inputs, ids, offsets, nullptr, nullptr, num_threads);
+}
+
+util::Status SentencePieceProcessor::EncodeBatch(
+    const std::vector<absl::string_view> &inputs, std::vector<int> *ids,
+    std::vector<size_t> *offsets, std::vector<size_t> *begins,
+    std::vector<size_t> *ends, int num_threads) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(offsets);
+  if (begins != nullptr) begins->clear();
+  if (ends != nullptr) ends->clear();
+  const bool with_offsets = begins != nullptr || ends != nullptr;
+
+  if (batch_encoder_ != nullptr && max_tokens_ == 0 && !with_offsets) {
+    std::vector<std::vector<int>> input_ids;
+    RETURN_IF_ERROR(EncodeBatchWithEncoder(inputs, &input_ids, num_threads));
+    offsets->resize(inputs.size() + 1);
+    (*offsets)[0] = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      (*offsets)[i + 1] = (*offsets)[i] + input_ids[i].size();
+    }
+    ids->reserve(offsets->back());
+    for (const auto &v : input_ids) ids->insert(ids->end(), v.begin(), v.end());
+    return util::OkStatus();
+  }
+
+  // Every chunk appends its ids to its own buffers. The buffers are
+  // concatenated in input order afterwards.
+  struct Chunk {
+    std::vector<int> ids;
+    std::vector<size_t> begins;
+    std::vector<size_t> ends;
+  };
+  const int64 num_chunks =
+      (inputs.size() + kBatchChunkSize - 1) / kBatchChunkSize;
+  std::vector<Chunk> chunks(num_chunks);
+  std::vector<size_t> sizes(inputs.size(), 0);
+  std::vector<util::Status> status(inputs.size());
+
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    ScopedThreadWorkspace thread_workspace(true);
+    EncodeWorkspace &workspace = *thread_workspace.get();
+    std::vector<int> input_ids;
+    std::vector<size_t> input_begins, input_ends;
+    std::vector<EncodedPiece> pieces;
+    auto *output = &chunks[begin / kBatchChunkSize];
+    for (int64 i = begin; i < end; ++i) {
+      status[i] = with_offsets
+                      ? EncodeIdsWithOffsets(inputs[i], &input_ids,
+                                             &input_begins, &input_ends,
+                                             &pieces, &workspace)
+                      : EncodeIds(inputs[i], &input_ids, &workspace);
+      if (!status[i].ok()) continue;
+      sizes[i] = input_ids.size();
+      output->ids.insert(output->ids.end(), input_ids.begin(),
+                         input_ids.end());
+      if (with_offsets) {
+        output->begins.insert(output->begins.end(), input_begins.begin(),
+                              input_begins.end());
+        output->ends.insert(output->ends.end(), input_ends.begin(),
+                            input_ends.end());
+      }
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  offsets->resize(inputs.size() + 1);
+  (*offsets)[0] = 0;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    (*offsets)[i + 1] = (*offsets)[i] + sizes[i];
+  }
+  ids->clear();
+  ids->reserve(offsets->back());
+  for (const auto &chunk : chunks) {
+    ids->insert(ids->end(), chunk.ids.begin(), chunk.ids.end());
+  }
+  if (begins != nullptr) {
+    begins->reserve(offsets->back());
+    for (const auto &chunk : chunks) {
+      begins->insert(begins->end(), chunk.begins.begin(), chunk.begins.end());
+    }
+  }
+  if (ends != nullptr) {
+    ends->reserve(offsets->back());
+    for (const auto &chunk : chunks) {
+      ends->insert(ends->end(), chunk.ends.begin(), chunk.ends.end());
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatchPadded(
+    const std::vector<absl::string_view> &inputs, size_t max_length,
+    int *ids, size_t *lengths, size_t *begins, size_t *ends,
+    int num_threads) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN(ids || inputs.empty() || max_length == 0)
+      << "output buffer is null";
+  const bool with_offsets = begins != nullptr || ends != nullptr;
+  const int pad = pad_id();
+  std::vector<util::Status> status(inputs.size());
+
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    ScopedThreadWorkspace thread_workspace(true);
+    EncodeWorkspace &workspace = *thread_workspace.get();
+    std::vector<int> input_ids;
+    std::vector<size_t> input_begins, input_ends;
+    std::vector<EncodedPiece> pieces;
+    for (int64 i = begin; i < end; ++i) {
+      status[i] = with_offsets
+                      ? EncodeIdsWithOffsets(inputs[i], &input_ids,
+                                             &input_begins, &input_ends,
+                                             &pieces, &workspace)
+                      : EncodeIds(inputs[i], &input_ids, &workspace);
+      if (!status[i].ok()) continue;
+      const size_t size = input_ids.size();
+      if (size > max_length) {
+        status[i] = util::StatusBuilder(util::StatusCode::kOutOfRange, GTL_LOC)
+                    << "inputs[" << i << "] has " << size
+                    << " ids, more than max_length " << max_length << ".";
+        continue;
+      }
+      const size_t row = i * max_length;
+      std::copy(input_ids.begin(), input_ids.end(), ids + row);
+      std::fill(ids + row + size, ids + row + max_length, pad);
+      if (lengths != nullptr) lengths[i] = size;
+      if (begins != nullptr) {
+        std::copy(input_begins.begin(), input_begins.end(), begins + row);
+        std::fill(begins + row + size, begins + row + max_length, 0);
+      }
+      if (ends != nullptr) {
+        std::copy(input_ends.begin(), input_ends.end(), ends + row);
+        std::fill(ends + row + size, ends + row + max_length, 0);
+      }
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeBatchBucketed(
+    const std::vector<absl::string_view> &inputs, size_t max_tokens,
+    std::vector<int> *ids, std::vector<size_t> *offsets,
+    std::vector<size_t> *order, std::vector<size_t> *batch_offsets,
+    int num_threads) const {
+  CHECK_OR_RETURN_STATUS_STL(order);
+  CHECK_OR_RETURN_STATUS_STL(batch_offsets);
+  CHECK_GT_OR_RETURN(max_tokens, 0) << "max_tokens must be positive.";
+  RETURN_IF_ERROR(EncodeBatch(inputs, ids, offsets, num_threads));
+
+  auto length = [offsets](size_t i) {
+    return std::max<size_t>((*offsets)[i + 1] - (*offsets)[i], 1);
+  };
+  order->resize(inputs.size());
+  std::iota(order->begin(), order->end(), 0);
+  std::stable_sort(order->begin(), order->end(),
+                   [&length](size_t a, size_t b) {
+                     return length(a) < length(b);
+                   });
+
+  // The inputs are sorted, so the last one of a batch is the longest.
+  batch_offsets->push_back(0);
+  for (size_t i = 0, size = 0; i < order->size(); ++i, ++size) {
+    if (size > 0 && (size + 1) * length((*order)[i]) > max_tokens) {
+      batch_offsets->push_back(i);
+      size = 0;
+    }
+  }
+  if (!order->empty()) batch_offsets->push_back(order->size());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CheckDecodeBatch(
+    const std::vector<int> &ids, const std::vector<size_t> &offsets) const {
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    CHECK_LE_OR_RETURN(offsets[i - 1], offsets[i]);
+  }
+  if (!offsets.empty()) {
+    CHECK_LE_OR_RETURN(offsets.back(), ids.size());
+  }
+  const int piece_size = GetPieceSize();
+  for (const int id : ids) {
+    if (id < 0 || id >= piece_size) {
+      return util::StatusBuilder(util::StatusCode::kOutOfRange, GTL_LOC)
+             << "piece id " << id << " is out of range.";
+    }
+  }
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::DecodeBatch(
+    const std::vector<int> &ids, const std::vector<size_t> &offsets,
+    std::vector<std::string> *detokenized, int num_threads) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN_DECODE_STATUS_STL(detokenized);
+  RETURN_IF_ERROR(CheckDecodeBatch(ids, offsets));
+
+  const int64 size = offsets.empty() ? 0 : offsets.size() - 1;
+  detokenized->resize(size);
+  std::vector<util::Status> status(size);
+
+  ParallelForBatch(size, num_threads, [&](int64 begin, int64 end) {
+    std::vector<int> input_ids;
+    for (int64 i = begin; i < end; ++i) {
+      input_ids.assign(ids.begin() + offsets[i], ids.begin() + offsets[i + 1]);
+      status[i] = Decode(input_ids, &(*detokenized)[i]);
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::DecodeBatch(
+    const std::vector<int> &ids, const std::vector<size_t> &offsets,
+    std::string *detokenized, std::vector<size_t> *detokenized_offsets,
+    int num_threads) const {
+  RETURN_IF_ERROR(status());
+  CHECK_OR_RETURN_DECODE_STATUS_STL(detokenized);
+  CHECK_OR_RETURN_DECODE_STATUS_STL(detokenized_offsets);
+  RETURN_IF_ERROR(CheckDecodeBatch(ids, offsets));
+
+  // Every range of ParallelForBatch() starts a chunk of kBatchChunkSize
+  // inputs, which is decoded into its own buffer. The buffers are then
+  // joined in order.
+  const int64 size = offsets.empty() ? 0 : offsets.size() - 1;
+  const int64 num_chunks = (size + kBatchChunkSize - 1) / kBatchChunkSize;
+  std::vector<std::string> chunks(num_chunks);
+  std::vector<size_t> sizes(size);
+  std::vector<util::Status> status(num_chunks);
+
+  ParallelForBatch(size, num_threads, [&](int64 begin, int64 end) {
+    const int64 chunk = begin / kBatchChunkSize;
+    std::string *output = &chunks[chunk];
+    std::vector<int> expanded, input_ids;
+    std::string decoded;
+    for (int64 i = begin; i < end; ++i) {
+      const size_t start = output->size();
+      if (decode_table_ != nullptr) {
+        status[chunk] = DecodeWithTable(
+            decode_extra_options_, ids.data() + offsets[i],
+            offsets[i + 1] - offsets[i], &expanded, output);
+      } else {
+        input_ids.assign(ids.begin() + offsets[i],
+                         ids.begin() + offsets[i + 1]);
+        status[chunk] = Decode(input_ids, &decoded);
+        output->append(decoded);
+      }
+      if (!status[chunk].ok()) return;
+      sizes[i] = output->size() - start;
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  detokenized_offsets->resize(size + 1);
+  (*detokenized_offsets)[0] = 0;
+  for (int64 i = 0; i < size; ++i) {
+    (*detokenized_offsets)[i + 1] = (*detokenized_offsets)[i] + sizes[i];
+  }
+
+  detokenized->clear();
+  if (num_chunks > 0 && chunks[0].size() == detokenized_offsets->back()) {
+    // All inputs were decoded into the first chunk.
+    detokenized->swap(chunks[0]);
+  } else {
+    detokenized->reserve(detokenized_offsets->back());
+    for (const auto &chunk : chunks) detokenized->append(chunk);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::NBestEncodeBatch(
+    const std::vector<absl::string_view> &inputs, int nbest_size,
+    std::vector<int> *ids, std::vector<size_t> *offsets,
+    std::vector<size_t> *nbest_offsets) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(offsets);
+  CHECK_OR_RETURN_STATUS_STL(nbest_offsets);
+  CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
+      << "NBestEncode is not available for the current model.";
+
+  EncodeWorkspace workspace;
+  offsets->push_back(0);
+  nbest_offsets->push_back(0);
+  for (const auto input : inputs) {
+    RETURN_IF_ERROR(
+        normalizer_->Normalize(input, &workspace.normalized, nullptr));
+    util::Status status;
+    model_->VisitNBestEncode(
+        workspace.normalized, nbest_size,
+        [&](const EncodeResult &result, float score) {
+          status = PopulateIds(workspace.normalized, result, &workspace.ids);
+          if (!status.ok()) return false;
+          ids->insert(ids->end(), workspace.ids.begin(), workspace.ids.end());
+          offsets->push_back(ids->size());
+          return true;
+        });
+    RETURN_IF_ERROR(status);
+    CHECK_GT_OR_RETURN(offsets->size() - 1, nbest_offsets->back())
+        << "NBestEncode returns empty result.";
+    nbest_offsets->push_back(offsets->size() - 1);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncode(
+    absl::string_view input, int nbest_size, float alpha, int num_samples,
+    bool unique, std::vector<std::vector<int>> *ids,
+    std::vector<float> *scores) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  if (scores != nullptr) scores->clear();
+
+  CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
+  CHECK_GE_OR_RETURN(num_samples, 1) << "num_samples must be positive.";
+
+  std::string normalized;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, nullptr));
+
+  NBestEncodeResult samples;
+  if (!model_->IsNBestEncodeAvailable() || nbest_size < 0) {
+    CHECK_OR_RETURN(model_->IsSampleEncodeAndScoreAvailable())
+        << "SampleEncodeAndScore is not available for the current model.";
+    samples = model_->SampleEncodeAndScore(normalized, alpha, num_samples,
+                                           unique);
+  } else if (nbest_size == 1 || nbest_size == 0) {
+    samples.assign(unique ? 1 : num_samples,
+                   std::make_pair(model_->Encode(normalized), 0.0f));
+  } else {
+    const auto nbests = model_->NBestEncode(normalized, nbest_size);
+    CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+
+    std::vector<float> probs(nbests.size(), 0.0);
+    double total = 0.0;
+    for (size_t i = 0; i < nbests.size(); ++i) {
+      probs[i] = std::exp(alpha * nbests[i].second);
+      total += probs[i];
+    }
+
+    auto mt = random::GetSamplingGenerator();
+    std::discrete_distribution<int> dist(probs.begin(), probs.end());
+    std::vector<bool> drawn(nbests.size(), false);
+    for (int n = 0; n < num_samples; ++n) {
+      mt.SetSample(n);
+      const int k = dist(mt);
+      if (unique && drawn[k]) continue;
+      drawn[k] = true;
+      samples.emplace_back(nbests[k].first, std::log(probs[k] / total));
+    }
+  }
+
+  std::vector<int> sample_ids;
+  for (const auto &sample : samples) {
+    RETURN_IF_ERROR(PopulateIds(normalized, sample.first, &sample_ids));
+    ids->push_back(sample_ids);
+    if (scores != nullptr) scores->push_back(sample.second);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodeBatch(
+    const std::vector<absl::string_view> &inputs, int nbest_size, float alpha,
+    std::vector<int> *ids, std::vector<size_t> *offsets) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(offsets);
+  CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
+
+  EncodeWorkspace workspace;
+  EncodeResult result;
+  offsets->push_back(0);
+  for (const auto input : inputs) {
+    RETURN_IF_ERROR(
+        normalizer_->Normalize(input, &workspace.normalized, nullptr));
+    RETURN_IF_ERROR(
+        SampleModel(workspace.normalized, nbest_size, alpha, &result));
+    RETURN_IF_ERROR(PopulateIds(workspace.normalized, result, &workspace.ids));
+    ids->insert(ids->end(), workspace.ids.begin(), workspace.ids.end());
+    offsets->push_back(ids->size());
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncodeBatch(
+    const std::vector<absl::string_view> &inputs, int nbest_size, float alpha,
+    uint64_t seed, std::vector<int> *ids, std::vector<size_t> *offsets,
+    int num_threads) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN_STATUS_STL(ids);
+  CHECK_OR_RETURN_STATUS_STL(offsets);
+  CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
+
+  // Every chunk appends its ids to its own buffer. The buffers are
+  // concatenated in input order afterwards.
+  const int64 num_chunks =
+      (inputs.size() + kBatchChunkSize - 1) / kBatchChunkSize;
+  std::vector<std::vector<int>> chunks(num_chunks);
+  std::vector<size_t> sizes(inputs.size(), 0);
+  std::vector<util::Status> status(inputs.size());
+
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    ScopedThreadWorkspace thread_workspace(true);
+    EncodeWorkspace &workspace = *thread_workspace.get();
+    EncodeResult result;
+    auto *output = &chunks[begin / kBatchChunkSize];
+    for (int64 i = begin; i < end; ++i) {
+      const random::ScopedCounterGenerator generator(seed, i);
+      status[i] = normalizer_->Normalize(inputs[i], &workspace.normalized,
+                                         nullptr);
+      if (status[i].ok()) {
+        status[i] =
+            SampleModel(workspace.normalized, nbest_size, alpha, &result);
+      }
+      if (status[i].ok()) {
+        status[i] = PopulateIds(workspace.normalized, result, &workspace.ids);
+      }
+      if (!status[i].ok()) continue;
+      sizes[i] = workspace.ids.size();
+      output->insert(output->end(), workspace.ids.begin(),
+                     workspace.ids.end());
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  offsets->resize(inputs.size() + 1);
+  (*offsets)[0] = 0;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    (*offsets)[i + 1] = (*offsets)[i] + sizes[i];
+  }
+  ids->clear();
+  ids->reserve(offsets->back());
+  for (const auto &chunk : chunks) {
+    ids->insert(ids->end(), chunk.begin(), chunk.end());
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CalculateEntropy(absl::string_view input,
+                                                      float alpha,
+                                                      float *entropy) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN(entropy) << "output is null";
+  CHECK_OR_RETURN(model_->IsLatticeStatisticsAvailable())
+      << "CalculateEntropy is not available for the current model.";
+
+  std::string normalized;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, nullptr));
+  *entropy = model_->CalculateEntropy(normalized, alpha);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::CalculateEntropy(
+    const std::vector<absl::string_view> &inputs, float alpha,
+    std::vector<float> *entropies, int num_threads) const {
+  CHECK_OR_RETURN_STATUS_STL(entropies);
+  CHECK_OR_RETURN(model_->IsLatticeStatisticsAvailable())
+      << "CalculateEntropy is not available for the current model.";
+
+  entropies->resize(inputs.size());
+  std::vector<util::Status> status(inputs.size());
+  ParallelForBatch(inputs.size(), num_threads, [&](int64 begin, int64 end) {
+    std::string normalized;
+    for (int64 i = begin; i < end; ++i) {
+      status[i] = normalizer_->Normalize(inputs[i], &normalized, nullptr);
+      if (!status[i].ok()) continue;
+      (*entropies)[i] = model_->CalculateEntropy(normalized, alpha);
+    }
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::PieceMarginals(
+    absl::string_view input, float alpha,
+    std::vector<float> *marginals) const {
+  return PieceMarginals(std::vector<absl::string_view>{input}, alpha,
+                        marginals);
+}
+
+util::Status SentencePieceProcessor::PieceMarginals(
+    const std::vector<absl::string_view> &inputs, float alpha,
+    std::vector<float> *marginals, int num_threads) const {
+  CHECK_OR_RETURN_STATUS_STL(marginals);
+  CHECK_OR_RETURN(model_->IsLatticeStatisticsAvailable())
+      << "PieceMarginals is not available for the current model.";
+
+  // Every part of the inputs sums its marginals into its own vector, so that
+  // the number of vocabulary-sized vectors only depends on `num_threads`.
+  // A few parts per thread balance inputs of different lengths.
+  const int64 size = inputs.size();
+  const int64 num_parts =
+      std::min<int64>(size, num_threads <= 1 ? 1 : 4 * num_threads);
+  std::vector<std::vector<float>> sums(num_parts);
+  std::vector<util::Status> status(num_parts);
+  auto fn = [&](int64 begin, int64 end) {
+    for (int64 part = begin; part < end; ++part) {
+      sums[part].assign(GetPieceSize(), 0.0);
+      std::string normalized;
+      for (int64 i = size * part / num_parts;
+           i < size * (part + 1) / num_parts; ++i) {
+        status[part] = normalizer_->Normalize(inputs[i], &normalized, nullptr);
+        if (!status[part].ok()) break;
+        model_->PopulateMarginals(normalized, alpha, &sums[part]);
+      }
+    }
+  };
+  SharedParallelFor(num_parts, 1, num_threads, fn);
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  marginals->assign(GetPieceSize(), 0.0);
+  for (const auto &sum : sums) {
+    for (size_t id = 0; id < sum.size(); ++id) (*marginals)[id] += sum[id];
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Decode(
+    const std::vector<std::string> &pieces, std::string *detokenized) const {
+  CHECK_OR_RETURN_DECODE_STATUS_STL(detokenized);
+  stats::ScopedTrace trace(tracer_.get(), PiecesBytes(pieces));
+  stats::PhaseTimer timer;
+
+  SentencePieceText spt;
+  RETURN_IF_ERROR(AddDecodedPieces(pieces, &spt));
+  RETURN_IF_ERROR(DecodeSentencePieceText(decode_extra_options_, &spt, true));
+  detokenized->swap(*spt.mutable_text());
+  timer.Lap(TraceStage::kDecode, spt.pieces_size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
+                                            std::string *detokenized) const {
+  return Decode(ids, nullptr, detokenized);
+}
+
+util::Status SentencePieceProcessor::Decode(
+    const std::vector<int> &ids, const ExtraOptions *extra_options,
+    std::string *detokenized) const {
+  CHECK_OR_RETURN_DECODE_STATUS_STL(detokenized);
+  stats::ScopedTrace trace(tracer_.get(), ids.size() * sizeof(int));
+  stats::PhaseTimer timer;
+
+  const auto &options = extra_options != nullptr ? extra_options->options_
+                                                 : decode_extra_options_;
+  if (decode_table_ != nullptr) {
+    std::vector<int> expanded;
+    detokenized->clear();
+    RETURN_IF_ERROR(DecodeWithTable(options, ids.data(), ids.size(),
+                                    &expanded, detokenized));
+    timer.Lap(TraceStage::kDecode, ids.size());
+    return util::OkStatus();
+  }
+
+  SentencePieceText spt;
+  RETURN_IF_ERROR(AddDecodedPieces(ids, &spt));
+  RETURN_IF_ERROR(DecodeSentencePieceText(options, &spt, true));
+  detokenized->swap(*spt.mutable_text());
+  timer.Lap(TraceStage::kDecode, spt.pieces_size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::NBestEncode(
+    absl::string_view input, int nbest_size,
+    std::vector<std::vector<std::string>> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+
+  NBestSentencePieceText spt;
+  RETURN_IF_ERROR(NBestEncode(input, nbest_size, &spt));
+  for (const auto &nbest : spt.nbests()) {
+    std::vector<std::string> result;
+    for (const auto &sp : nbest.pieces()) {
+      result.emplace_back(sp.piece());
+    }
+    pieces->emplace_back(result);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::NBestEncode(
+    absl::string_view input, int nbest_size,
+    std::vector<std::vector<int>> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+
+  // Builds the ids as NBestEncodeBatch() does, without the protos.
+  std::string normalized;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, nullptr));
+
+  CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
+      << "NBestEncode is not available for the current model.";
+
+  util::Status status;
+  model_->VisitNBestEncode(normalized, nbest_size,
+                           [&](const EncodeResult &result, float score) {
+                             ids->emplace_back();
+                             status = PopulateIds(normalized, result,
+                                                  &ids->back());
+                             return status.ok();
+                           });
+  RETURN_IF_ERROR(status);
+  CHECK_OR_RETURN(!ids->empty()) << "NBestEncode returns empty result.";
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::NBestEncode(absl::string_view input,
+                                                 int nbest_size,
+                                                 NBestIds *nbest) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN(nbest) << "output is null.";
+  nbest->Clear();
+
+  std::string normalized;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, nullptr));
+
+  CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
+      << "NBestEncode is not available for the current model.";
+
+  std::vector<int> ids;
+  util::Status status;
+  model_->VisitNBestEncode(normalized, nbest_size,
+                           [&](const EncodeResult &result, float score) {
+                             status = PopulateIds(normalized, result, &ids);
+                             if (!status.ok()) return false;
+                             nbest->Add(ids, score);
+                             return true;
+                           });
+  RETURN_IF_ERROR(status);
+  CHECK_OR_RETURN(!nbest->empty()) << "NBestEncode returns empty result.";
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncode(
+    absl::string_view input, int nbest_size, float alpha,
+    std::vector<std::string> *pieces) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+
+  SentencePieceText spt;
+  RETURN_IF_ERROR(SampleEncode(input, nbest_size, alpha, &spt));
+  for (const auto &sp : spt.pieces()) {
+    pieces->emplace_back(sp.piece());
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncode(absl::string_view input,
+                                                  int nbest_size, float alpha,
+                                                  std::vector<int> *ids) const {
+  CHECK_OR_RETURN_STATUS_STL(ids);
+
+  SentencePieceText spt;
+  RETURN_IF_ERROR(SampleEncode(input, nbest_size, alpha, &spt));
+  for (const auto &sp : spt.pieces()) {
+    ids->emplace_back(sp.id());
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::PopulateSentencePieceText(
+    absl::string_view input, absl::string_view normalized,
+    const std::vector<uint32> &norm_to_orig, const EncodeResult &result,
+    SentencePieceText *spt) const {
+  RETURN_IF_ERROR(
+      AppendSentencePieces(input, normalized, norm_to_orig, result, spt));
+
+  RETURN_IF_ERROR(ApplyExtraOptions(encode_extra_options_, spt));
+
+  spt->set_text(input.data(), input.size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::AppendSentencePieces(
+    absl::string_view input, absl::string_view normalized,
+    const std::vector<uint32> &norm_to_orig, const EncodeResult &result,
+    SentencePieceText *spt) const {
+  size_t consumed = 0;
+  bool is_prev_unk = false;
+  // The merged piece of the current run of unknown pieces. Its surface is
+  // cut from `input` once when the run ends, as appending it for every
+  // unknown piece is quadratic in the length of the run.
+  SentencePieceText::SentencePiece *unk_run = nullptr;
+  const auto finish_unk_run = [&]() {
+    if (unk_run == nullptr) return;
+    unk_run->set_surface(input.data() + unk_run->begin(),
+                         unk_run->end() - unk_run->begin());
+    unk_run = nullptr;
+  };
+  for (const auto &p : result) {
+    const absl::string_view w = p.first;  // piece
+    const int id = p.second;              // id
+
+    CHECK_OR_RETURN(!w.empty()) << "Empty piece is not allowed.";
+
+    const bool is_unk = IsUnknown(id);
+    if (!(is_prev_unk && is_unk)) finish_unk_run();
+
+    if (IsControl(id)) {
+      // Control symbol has no corresponding source surface, so begin == end.
+      auto *sp = spt->add_pieces();
+      sp->set_piece(w.data(), w.size());
+      sp->set_id(id);
+      sp->set_begin(norm_to_orig[consumed]);
+      sp->set_end(norm_to_orig[consumed]);
+    } else {
+      const size_t begin = consumed;
+      const size_t end = consumed + w.size();
+      CHECK_LT_OR_RETURN(begin, norm_to_orig.size());
+      CHECK_LT_OR_RETURN(end, norm_to_orig.size());
+      const size_t orig_begin = norm_to_orig[begin];
+      const size_t orig_end = norm_to_orig[end];
+      CHECK_LE_OR_RETURN(orig_begin, input.size());
+      CHECK_LE_OR_RETURN(orig_end, input.size());
+      CHECK_LE_OR_RETURN(orig_begin, orig_end);
+      const auto surface =
+          absl::ClippedSubstr(input, orig_begin, orig_end - orig_begin);
+
+      if (is_unk && model_->ByteFallbackEnabled()) {
+        // Decomposes an unknown piece into UTF-8 bytes
+        for (int i = 0; i < w.size(); ++i) {
+          // Create a byte piece
+          const char b = w[i];
+          auto *sp = spt->add_pieces();
+          const auto piece = ByteToPiece(b);
+          sp->set_piece(piece.data(), piece.size());
+          sp->set_id(model_->ByteToId(b));
+
+          // The last byte piece holds the surface of the original unknown
+          // character. The other byte pieces have no surface.
+          if (i == w.size() - 1) {
+            sp->set_surface(surface.data(), surface.size());
+            sp->set_begin(orig_begin);
+            sp->set_end(orig_end);
+          } else {
+            // begin == end
+            sp->set_begin(orig_begin);
+            sp->set_end(orig_begin);
+          }
+        }
+      } else {
+        // Merges continuous run of unknown pieces so that decoder
+        // can copy or generate unknown tokens easily.
+        // Note that merged tokens are still unknown,
+        // since known pieces never consist of unknown characters.
+        if (is_prev_unk && is_unk && unk_run != nullptr) {
+          unk_run->mutable_piece()->append(w.data(), w.size());
+          unk_run->set_end(orig_end);
+        } else {
+          auto *sp = spt->add_pieces();
+          sp->set_piece(w.data(), w.size());
+          sp->set_id(id);
+          sp->set_surface(surface.data(), surface.size());
+          sp->set_begin(orig_begin);
+          sp->set_end(orig_end);
+          if (is_unk) unk_run = sp;
+        }
+      }
+      consumed += w.size();
+    }
+    is_prev_unk = is_unk;
+  }
+  finish_unk_run();
+
+  CHECK_EQ_OR_RETURN(consumed, normalized.size())
+      << "all normalized characters are not consumed.";
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Encode(absl::string_view input,
+                                            SentencePieceText *spt) const {
+  CHECK_OR_RETURN_STATUS_PROTO(spt);
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  if (encode_num_threads_ > 1 && input.size() > kParallelEncodeMinBytes &&
+      compiled_model_->has_word_boundaries_ &&
+      !model_proto_->normalizer_spec().encode_case()) {
+    return EncodeChunksInParallel(input, spt);
+  }
+
+  stats::PhaseTimer timer;
+  std::string normalized;
+  std::vector<uint32> norm_to_orig;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+  timer.Lap(stats::kNormalizeNs);
+
+  return EncodeNormalized(input, normalized, norm_to_orig, spt);
+}
+
+util::Status SentencePieceProcessor::EncodeChunksInParallel(
+    absl::string_view input, SentencePieceText *spt) const {
+  stats::Add(stats::kNumCalls, 1);
+  const auto chunks = CutIntoChunks(input, false);
+  std::vector<SentencePieceText> chunk_spts(chunks.size());
+  // Where the normalized text of each chunk ends in the chunk.
+  std::vector<size_t> chunk_ends(chunks.size());
+  std::vector<util::Status> status(chunks.size());
+  ParallelForBatch(
+      chunks.size(), encode_num_threads_, [&](int64 begin, int64 end) {
+        std::string normalized;
+        std::vector<uint32> norm_to_orig;
+        for (int64 k = begin; k < end; ++k) {
+          stats::PhaseTimer timer;
+          status[k] =
+              normalizer_->Normalize(chunks[k], &normalized, &norm_to_orig);
+          if (!status[k].ok()) continue;
+          timer.Lap(stats::kNormalizeNs);
+          const auto result = model_->Encode(normalized);
+          timer.Lap(stats::kModelEncodeNs, result.size());
+          status[k] = AppendSentencePieces(chunks[k], normalized,
+                                           norm_to_orig, result,
+                                           &chunk_spts[k]);
+          timer.Lap(stats::kProtoNs);
+          chunk_ends[k] = norm_to_orig.empty() ? 0 : norm_to_orig.back();
+          stats::Add(stats::kBytesIn, chunks[k].size());
+          stats::Add(stats::kBytesOut, normalized.size());
+          stats::Add(stats::kTokensOut, result.size());
+        }
+      });
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+
+  // The pieces are moved to `spt` with their offsets in `input`. A chunk
+  // starts with a word whose dummy prefix stands for the whitespace cut
+  // from the end of the previous chunk, so the first piece of the chunk
+  // begins where the previous pieces end, as in the whole text.
+  int size = 0;
+  for (const auto &chunk_spt : chunk_spts) size += chunk_spt.pieces_size();
+  spt->mutable_pieces()->Reserve(size);
+  size_t prev_end = 0;
+  for (size_t k = 0; k < chunks.size(); ++k) {
+    const size_t offset = chunks[k].data() - input.data();
+    auto *pieces = chunk_spts[k].mutable_pieces();
+    for (int i = 0; i < pieces->size(); ++i) {
+      auto *piece = pieces->Mutable(i);
+      size_t begin = piece->begin() + offset;
+      const size_t end = piece->end() + offset;
+      const bool realigned =
+          i == 0 && spt->pieces_size() > 0 && begin == offset;
+      if (realigned) begin = prev_end;
+      if (i == 0 && spt->pieces_size() > 0 && IsUnknown(piece->id()) &&
+          IsUnknown(spt->pieces(spt->pieces_size() - 1).id())) {
+        // Continuous unknown pieces are merged into one across the cut too.
+        auto *last = spt->mutable_pieces(spt->pieces_size() - 1);
+        last->mutable_piece()->append(piece->piece());
+        last->set_end(end);
+        last->set_surface(input.data() + last->begin(), end - last->begin());
+        continue;
+      }
+      if (realigned && begin < end) {
+        piece->set_surface(input.data() + begin, end - begin);
+      }
+      piece->set_begin(begin);
+      piece->set_end(end);
+      spt->add_pieces()->Swap(piece);
+    }
+    // A chunk of whitespace only has no pieces and leaves the end as is.
+    if (!pieces->empty()) prev_end = chunk_ends[k] + offset;
+  }
+
+  RETURN_IF_ERROR(ApplyExtraOptions(encode_extra_options_, spt));
+  spt->set_text(input.data(), input.size());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeNormalized(
+    absl::string_view input, absl::string_view normalized,
+    const std::vector<uint32> &norm_to_orig, SentencePieceText *spt) const {
+  stats::PhaseTimer timer;
+  const auto result = model_->Encode(normalized);
+  timer.Lap(stats::kModelEncodeNs, result.size());
+  RETURN_IF_ERROR(
+      PopulateSentencePieceText(input, normalized, norm_to_orig, result, spt));
+  timer.Lap(stats::kProtoNs);
+  AddEncodeStats(input, normalized, result.size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::PopulateRawPieces(
+    absl::string_view input, absl::string_view normalized,
+    const std::vector<uint32> &norm_to_orig, const EncodeResult &result,
+    std::vector<EncodedPiece> *pieces) const {
+  // Mirrors PopulateSentencePieceText(). Merged unknown pieces stay views, as
+  // both their pieces and surfaces are adjacent.
+  pieces->reserve(result.size());
+  size_t consumed = 0;
+  bool is_prev_unk = false;
+  for (const auto &p : result) {
+    const absl::string_view w = p.first;  // piece
+    const int id = p.second;              // id
+
+    CHECK_OR_RETURN(!w.empty()) << "Empty piece is not allowed.";
+
+    const bool is_unk = IsUnknown(id);
+
+    if (IsControl(id)) {
+      CHECK_LT_OR_RETURN(consumed, norm_to_orig.size());
+      EncodedPiece sp;
+      sp.piece = w;
+      sp.id = id;
+      sp.begin = sp.end = norm_to_orig[consumed];
+      pieces->push_back(sp);
+    } else {
+      const size_t begin = consumed;
+      const size_t end = consumed + w.size();
+      CHECK_LT_OR_RETURN(begin, norm_to_orig.size());
+      CHECK_LT_OR_RETURN(end, norm_to_orig.size());
+      const size_t orig_begin = norm_to_orig[begin];
+      const size_t orig_end = norm_to_orig[end];
+      CHECK_LE_OR_RETURN(orig_begin, input.size());
+      CHECK_LE_OR_RETURN(orig_end, input.size());
+      CHECK_LE_OR_RETURN(orig_begin, orig_end);
+      const auto surface =
+          absl::ClippedSubstr(input, orig_begin, orig_end - orig_begin);
+
+      if (is_unk && model_->ByteFallbackEnabled()) {
+        for (size_t i = 0; i < w.size(); ++i) {
+          EncodedPiece sp;
+          sp.id = model_->ByteToId(w[i]);
+          sp.piece = model_->IdToPiece(sp.id);
+          sp.begin = orig_begin;
+          // The last byte piece holds the surface.
+          if (i == w.size() - 1) {
+            sp.surface = surface;
+            sp.end = orig_end;
+          } else {
+            sp.end = orig_begin;
+          }
+          pieces->push_back(sp);
+        }
+      } else if (is_prev_unk && is_unk) {
+        auto &sp = pieces->back();
+        sp.piece =
+            absl::string_view(sp.piece.data(), sp.piece.size() + w.size());
+        sp.surface =
+            absl::ClippedSubstr(input, sp.begin, orig_end - sp.begin);
+        sp.end = orig_end;
+      } else {
+        EncodedPiece sp;
+        sp.piece = w;
+        sp.id = id;
+        sp.surface = surface;
+        sp.begin = orig_begin;
+        sp.end = orig_end;
+        pieces->push_back(sp);
+      }
+      consumed += w.size();
+    }
+    is_prev_unk = is_unk;
+  }
+
+  CHECK_EQ_OR_RETURN(consumed, normalized.size())
+      << "all normalized characters are not consumed.";
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodePieces(
+    absl::string_view input, std::vector<EncodedPiece> *pieces,
+    EncodeWorkspace *workspace) const {
+  CHECK_OR_RETURN_STATUS_STL(pieces);
+  CHECK_OR_RETURN(workspace) << "workspace must not be null.";
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  stats::PhaseTimer timer;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &workspace->normalized,
+                                         &workspace->norm_to_orig));
+  timer.Lap(stats::kNormalizeNs);
+
+  CHECK_OR_RETURN(workspace->vocabulary == nullptr ||
+                  workspace->vocabulary->size() == GetPieceSize())
+      << "The vocabulary mask is made for another model.";
+
+  model_->EncodeInto(workspace->normalized, workspace->vocabulary,
+                     &workspace->pieces);
+  timer.Lap(stats::kModelEncodeNs, workspace->pieces.size());
+  RETURN_IF_ERROR(PopulateRawPieces(input, workspace->normalized,
+                                    workspace->norm_to_orig, workspace->pieces,
+                                    pieces));
+  RETURN_IF_ERROR(ApplyExtraOptions(EncodeExtraOptions(*workspace), pieces));
+  timer.Lap(stats::kProtoNs);
+  AddEncodeStats(input, workspace->normalized, workspace->pieces.size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodePieceViews(
+    absl::string_view input, EncodeWorkspace *workspace) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_OR_RETURN(workspace) << "workspace must not be null.";
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  std::vector<EncodedPiece> &raw = workspace->raw_pieces;
+  std::vector<EncodedPiece> &views = workspace->piece_views;
+  raw.clear();
+  views.clear();
+  RETURN_IF_ERROR(EncodePieces(input, &raw, workspace));
+
+  // Same as the repeat runs of Encode(input, pieces). Known pieces are taken
+  // from the vocabulary so that they outlive the workspace.
+  stats::PhaseTimer timer;
+  auto add_marker = [&](absl::string_view piece, int id, size_t end) {
+    EncodedPiece sp;
+    sp.piece = piece;
+    sp.id = id;
+    sp.surface = absl::ClippedSubstr(input, end, 0);
+    sp.begin = sp.end = end;
+    views.push_back(sp);
+  };
+  views.reserve(raw.size());
+  for (size_t i = 0; i < raw.size();) {
+    const EncodedPiece &first = raw[i];
+    size_t j = i + 1;
+    while (j < raw.size() && raw[j].id == first.id &&
+           raw[j].piece == first.piece) {
+      ++j;
+    }
+    EncodedPiece sp = first;
+    if (!IsUnknown(sp.id)) sp.piece = model_->IdToPiece(sp.id);
+    views.push_back(sp);
+    if (j - i > 1) {
+      // The pieces are in the reverse order of the input with REVERSE.
+      auto &run = views.back();
+      run.begin = std::min(run.begin, raw[j - 1].begin);
+      run.end = std::max(run.end, raw[j - 1].end);
+      const size_t end = run.end;
+      run.surface = absl::ClippedSubstr(input, run.begin, end - run.begin);
+      ForEachRepeatMarker(*model_, j - i,
+                          [&](int id, absl::string_view piece) {
+                            add_marker(piece, id, end);
+                          });
+    }
+    i = j;
+  }
+  timer.Lap(stats::kRleNs, views.size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::EncodeIdsWithOffsets(
+    absl::string_view input, std::vector<int> *ids,
+    std::vector<size_t> *begins, std::vector<size_t> *ends,
+    std::vector<EncodedPiece> *pieces, EncodeWorkspace *workspace) const {
+  ids->clear();
+  begins->clear();
+  ends->clear();
+  pieces->clear();
+  stats::ScopedTrace trace(tracer_.get(), input.size());
+
+  stats::PhaseTimer timer;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &workspace->normalized,
+                                         &workspace->norm_to_orig));
+  timer.Lap(stats::kNormalizeNs);
+
+  CHECK_OR_RETURN(workspace->vocabulary == nullptr ||
+                  workspace->vocabulary->size() == GetPieceSize())
+      << "The vocabulary mask is made for another model.";
+
+  model_->EncodeInto(workspace->normalized, workspace->vocabulary,
+                     &workspace->pieces);
+  timer.Lap(stats::kModelEncodeNs, workspace->pieces.size());
+  RETURN_IF_ERROR(PopulateRawPieces(input, workspace->normalized,
+                                    workspace->norm_to_orig, workspace->pieces,
+                                    pieces));
+  AddEncodeStats(input, workspace->normalized, workspace->pieces.size());
+
+  // Truncates the whole text as EncodeTruncatedIds() does.
+  const auto &extra_options = EncodeExtraOptions(*workspace);
+  if (max_tokens_ > 0) {
+    size_t num_special_ids = 0;
+    for (const auto option : extra_options) {
+      if (option != REVERSE) ++num_special_ids;
+    }
+    CHECK_GE_OR_RETURN(static_cast<size_t>(max_tokens_), num_special_ids)
+        << "max_tokens leaves no room for the bos/eos ids.";
+    const bool keep_last = truncation_side_ == TruncationSide::kLeft;
+    std::vector<int> &raw = workspace->ids;
+    raw.clear();
+    for (const auto &piece : *pieces) raw.push_back(piece.id);
+    if (keep_last) std::reverse(raw.begin(), raw.end());
+    TruncateRuns(max_tokens_ - num_special_ids, &raw);
+    if (keep_last) {
+      pieces->erase(pieces->begin(), pieces->end() - raw.size());
+    } else {
+      pieces->resize(raw.size());
+    }
+  }
+  RETURN_IF_ERROR(ApplyExtraOptions(extra_options, pieces));
+  timer.Lap(stats::kProtoNs);
+
+  // Same as the repeat runs of EncodeIds().
+  auto add_id = [&](int id, size_t begin, size_t end) {
+    ids->push_back(id);
+    begins->push_back(begin);
+    ends->push_back(end);
+  };
+  for (size_t i = 0; i < pieces->size();) {
+    const int id = (*pieces)[i].id;
+    size_t j = i + 1;
+    if (!IsUnknown(id)) {
+      while (j < pieces->size() && (*pieces)[j].id == id) ++j;
+    }
+    const size_t end = (*pieces)[j - 1].end;
+    add_id(id, (*pieces)[i].begin, end);
+    if (j - i > 1) {
+      ForEachRepeatMarker(*model_, j - i, [&](int id, absl::string_view) {
+        add_id(id, end, end);
+      });
+    }
+    i = j;
+  }
+  timer.Lap(stats::kRleNs, ids->size());
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::NBestEncode(
+    absl::string_view input, int nbest_size,
+    NBestSentencePieceText *nbest_spt) const {
+  CHECK_OR_RETURN_STATUS_PROTO(nbest_spt);
+
+  std::string normalized;
+  std::vector<uint32> norm_to_orig;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+
+  CHECK_OR_RETURN(model_->IsNBestEncodeAvailable())
+      << "NBestEncode is not available for the current model.";
+
+  const auto nbests = model_->NBestEncode(normalized, nbest_size);
+  CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+
+  for (const auto &result : nbests) {
+    auto *spt = nbest_spt->add_nbests();
+    spt->set_score(result.second);
+    RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
+                                              result.first, spt));
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleModel(
+    absl::string_view normalized, int nbest_size, float alpha,
+    EncodeResult *result) const {
+  if (!model_->IsNBestEncodeAvailable() || nbest_size < 0) {
+    CHECK_OR_RETURN(model_->IsSampleEncodeAvailable())
+        << "SampleEncode is not available for the current model.";
+    *result = model_->SampleEncode(normalized, alpha);
+  } else if (nbest_size == 1 || nbest_size == 0) {
+    *result = model_->Encode(normalized);
+  } else if (nbest_size > 1) {
+    auto nbests = model_->NBestEncode(normalized, nbest_size);
+    CHECK_OR_RETURN(!nbests.empty()) << "NBestEncode returns empty result.";
+
+    std::vector<float> probs(nbests.size(), 0.0);
+    for (size_t i = 0; i < nbests.size(); ++i) {
+      probs[i] = std::exp(alpha * nbests[i].second);
+    }
+
+    auto mt = random::GetSamplingGenerator();
+    std::discrete_distribution<int> dist(probs.begin(), probs.end());
+    *result = std::move(nbests[dist(mt)].first);
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::SampleEncode(
+    absl::string_view input, int nbest_size, float alpha,
+    SentencePieceText *spt) const {
+  CHECK_OR_RETURN_STATUS_PROTO(spt);
+
+  CHECK_LE_OR_RETURN(nbest_size, 512) << "nbest_size must be nbest_size <= 512";
+
+  std::string normalized;
+  std::vector<uint32> norm_to_orig;
+  RETURN_IF_ERROR(normalizer_->Normalize(input, &normalized, &norm_to_orig));
+
+  EncodeResult result;
+  RETURN_IF_ERROR(SampleModel(normalized, nbest_size, alpha, &result));
+  RETURN_IF_ERROR(PopulateSentencePieceText(input, normalized, norm_to_orig,
+                                            result, spt));
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Decode(
+    const std::vector<std::string> &pieces, SentencePieceText *spt) const {
+  CHECK_OR_RETURN_DECODE_STATUS_PROTO(spt);
+  stats::ScopedTrace trace(tracer_.get(), PiecesBytes(pieces));
+  stats::PhaseTimer timer;
+  RETURN_IF_ERROR(AddDecodedPieces(pieces, spt));
+  RETURN_IF_ERROR(DecodeSentencePieceText(decode_extra_options_, spt, false));
+  timer.Lap(TraceStage::kDecode, spt->pieces_size());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
+                                            SentencePieceText *spt) const {
+  CHECK_OR_RETURN_DECODE_STATUS_PROTO(spt);
+  stats::ScopedTrace trace(tracer_.get(), ids.size() * sizeof(int));
+  stats::PhaseTimer timer;
+  RETURN_IF_ERROR(AddDecodedPieces(ids, spt));
+  RETURN_IF_ERROR(DecodeSentencePieceText(decode_extra_options_, spt, false));
+  timer.Lap(TraceStage::kDecode, spt->pieces_size());
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::AddDecodedPieces(
+    const std::vector<std::string> &pieces, SentencePieceText *spt) const {
+  const auto &special = model_->special_piece_ids();
+  spt->mutable_pieces()->Reserve(pieces.size());
+  return ForEachExpandedRepeat(
+      pieces.size(), decode_max_repeat_count_, decode_max_expansion_,
+      [&](int i) { return pieces[i] == kStartRepeatSymbol; },
+      [&](int i) { return pieces[i] == kEndRepeatSymbol; },
+      [&](int i) {
+        const auto &w = pieces[i];
+        return w.size() == 1 && w[0] >= '0' && w[0] <= '9' ? w[0] - '0' : -1;
+      },
+      [&](int i) {
+        return special.has_repeat_counts && pieces[i].compare(0, 5, "<rep:") == 0
+                   ? special.RepeatCount(PieceToId(pieces[i]))
+                   : 0;
+      },
+      [&](int i) {
+        auto *sp = spt->add_pieces();
+        sp->set_piece(pieces[i]);
+        sp->set_id(PieceToId(pieces[i]));
+      });
+}
+
+util::Status SentencePieceProcessor::AddDecodedPieces(
+    const std::vector<int> &ids, SentencePieceText *spt) const {
+  spt->mutable_pieces()->Reserve(ids.size());
+  return ForEachExpandedId(ids, decode_max_repeat_count_,
+                           decode_max_expansion_, model_->special_piece_ids(),
+                           [&](int id) {
+                             auto *sp = spt->add_pieces();
+                             sp->set_piece(IdToPiece(id));
+                             sp->set_id(id);
+                           });
+}
+
+std::unique_ptr<const CompiledModel::DecodeTable>
+SentencePieceProcessor::MakeDecodeTable() const {
+  auto table = absl::make_unique<CompiledModel::DecodeTable>();
+  table->pieces.resize(GetPieceSize());
+  for (int id = 0; id < GetPieceSize(); ++id) {
+    auto &piece = table->pieces[id];
+    const std::string &w = IdToPiece(id);
+    if (IsByte(id)) {
+      piece.byte = model_->IdToByte(id);
+      if (piece.byte >= 0) continue;
+    }
+    const std::string surface = DecodePiece(w, id, false, false);
+    piece.begin = table->surfaces.size();
+    piece.size = surface.size();
+    piece.bos_strip = surface.size() - DecodePiece(w, id, true, false).size();
+    piece.eos_strip = surface.size() - DecodePiece(w, id, false, true).size();
+    table->surfaces += surface;
+  }
+  return std::move(table);
+}
+
+util::Status SentencePieceProcessor::DecodeWithTable(
+    const std::vector<ExtraOption> &extra_options, const int *ids, size_t size,
+    std::vector<int> *expanded_ids, std::string *detokenized) const {
+  std::vector<int> &expanded = *expanded_ids;
+  expanded.clear();
+  expanded.reserve(size);
+  RETURN_IF_ERROR(ForEachExpandedId(
+      ids, size, decode_max_repeat_count_, decode_max_expansion_,
+      model_->special_piece_ids(), [&](int id) { expanded.push_back(id); }));
+  RETURN_IF_ERROR(ApplyExtraOptions(extra_options, &expanded));
+  const size_t start = detokenized->size();
+
+  // Runs of byte pieces are decoded as UTF-8, mapping invalid bytes to
+  // U+FFFD as DecodeSentencePieceText() does.
+  std::string bytes;
+  auto flush_bytes = [&]() {
+    const char *begin = bytes.data();
+    const char *end = bytes.data() + bytes.size();
+    char utf8[8];
+    while (begin < end) {
+      size_t mblen;
+      const char32 uc = string_util::DecodeUTF8(begin, end, &mblen);
+      detokenized->append(utf8, string_util::EncodeUTF8(uc, utf8));
+      begin += mblen;
+    }
+    bytes.clear();
+  };
+
+  const auto &pieces = decode_table_->pieces;
+  const std::string &surfaces = decode_table_->surfaces;
+  for (size_t i = 0; i < expanded.size(); ++i) {
+    const int id = expanded[i];
+    CHECK_OR_RETURN(id >= 0 && id < static_cast<int>(pieces.size()))
+        << "Invalid id: " << id;
+    const auto &piece = pieces[id];
+    if (piece.byte >= 0) {
+      bytes.push_back(piece.byte);
+      continue;
+    }
+    flush_bytes();
+    size_t begin = piece.begin;
+    size_t length = piece.size;
+    if (detokenized->size() == start) {
+      begin += piece.bos_strip;
+      length -= piece.bos_strip;
+    }
+    if (i + 1 == expanded.size()) length -= piece.eos_strip;
+    detokenized->append(surfaces, begin, length);
+  }
+  flush_bytes();
+
+  if (denormalizer_) {
+    std::string denormalized;
+    RETURN_IF_ERROR(denormalizer_->Normalize(
+        absl::string_view(*detokenized).substr(start), &denormalized,
+        nullptr));
+    if (start == 0) {
+      detokenized->swap(denormalized);
+    } else {
+      detokenized->resize(start);
+      detokenized->append(denormalized);
+    }
+  }
+
+  return util::OkStatus();
+}
+
+std::string SentencePieceProcessor::DecodePiece(absl::string_view piece,
+                                                int id, bool is_bos_ws,
+                                                bool is_eos_ws) const {
+  if (IsControl(id)) {  // <s>, </s>
+    return "";          // invisible symbol.
+  } else if (IsUnknown(id)) {
+    if (IdToPiece(id) == piece) {  // <unk>
+      const char *unk_surface = kDefaultUnknownSymbol;
+      if (model_proto_ && model_proto_->trainer_spec().has_unk_surface())
+        unk_surface = model_proto_->trainer_spec().unk_surface().c_str();
+      return unk_surface;
+    } else {  // return piece when piece is not <unk>.
+      return std::string(piece);
+    }
+  }
+
+  if(!model_proto_ || !model_proto_->has_trainer_spec()
+     || !model_proto_->trainer_spec().treat_whitespace_as_suffix()) {
+    if(is_bos_ws &&
+        (!model_proto_ ||
+         (model_proto_ &&
+          (model_proto_->normalizer_spec().add_dummy_prefix() ||
+           model_proto_->normalizer_spec().remove_extra_whitespaces())))) {
+      // Consume if the current position is bos and
+      // piece starts with kSpaceSymbol.
+      absl::ConsumePrefix(&piece, kSpaceSymbol);
+    }
+  } else {
+      if(is_eos_ws &&
+          (!model_proto_ ||
+           (model_proto_ &&
+            (model_proto_->normalizer_spec().add_dummy_prefix() ||
+             model_proto_->normalizer_spec().remove_extra_whitespaces())))) {
+        // Consume if the current position is eos and
+        // piece ends with kSpaceSymbol.
+        if(absl::EndsWith(piece, kSpaceSymbol))
+          piece.remove_suffix(3);
+      }
+  }
+
+  return absl::StrReplaceAll(piece, {{kSpaceSymbol, " "}});
+}
+
+util::Status SentencePieceProcessor::DecodeSentencePieceText(
+    const std::vector<ExtraOption> &extra_options, SentencePieceText *spt,
+    bool text_only) const {
+  RETURN_IF_ERROR(ApplyExtraOptions(extra_options, spt));
+
+  std::string *text = spt->mutable_text();
+  auto SetSurface = [&](int index, const std::string &surface) {
+    if (text_only) {
+      *text += surface;
+      return;
+    }
+    auto *sp = spt->mutable_pieces(index);
+    sp->set_surface(surface);
+    sp->set_begin(text->size());
+    sp->set_end(text->size() + surface.size());
+    *text += surface;
+  };
+  auto ProcessBytePieces = [&](int begin, int end) -> util::Status {
+    if (begin < end) {
+      // Constructs byte sequence.
+      std::string bytes;
+      for (int i = begin; i < end; ++i) {
+        const auto &sp = spt->pieces(i);
+        const int byte = model_->IdToByte(sp.id());
+        CHECK_LE_OR_RETURN(0, byte);
+        bytes.append(1, byte);
+      }
+      // Decodes byte sequence as UTF-8 and encodes the result into UTF-8 bytes
+      // again.
+      int i = begin;
+      for (const char32 uc :
+           string_util::UTF8ToUnicodeText(absl::string_view(bytes))) {
+        if (uc == kUnicodeError) {
+          // Invalid UTF-8 bytes are mapped to REPLACEMENT CHARACTER (U+FFFD).
+          SetSurface(i++, string_util::UnicodeCharToUTF8(kUnicodeError));
+        } else {
+          const std::string utf8 = string_util::UnicodeCharToUTF8(uc);
+          for (int j = 0; j < utf8.size(); j++) {
+            // The last byte piece holds the surface of the original unknown
+            // character. The other byte pieces hold an empty string as
+            // surface.
+            if (j == utf8.size() - 1) {
+              SetSurface(i++, utf8);
+            } else {
+              SetSurface(i++, "");
+            }
+          }
+        }
+      }
+      CHECK_EQ_OR_RETURN(i, end);
+    }
+    return util::OkStatus();
+  };
+  int byte_start = 0;
+  for (int i = 0; i < spt->pieces_size(); ++i) {
+    const auto &sp = spt->pieces(i);
+    if (!IsByte(sp.id())) {
+      RETURN_IF_ERROR(ProcessBytePieces(byte_start, i));
+      byte_start = i + 1;
+      bool is_eos_space = i == spt->pieces_size() - 1;
+      SetSurface(i, DecodePiece(sp.piece(), sp.id(), text->empty(), is_eos_space));
+    }
+  }
+  RETURN_IF_ERROR(ProcessBytePieces(byte_start, spt->pieces_size()));
+
+  // If there is a denormalizer, we need to remap the surface strings on
+  // the individual pieces based on the norm_to_orig mapping from the
+  // denormalizer. Otherwise, if the number of characters differ across the
+  // denormalized and normalized form, the surface strings would be the
+  // pre-denormalized surface strings, rather than post-denormalized. This
+  // is particularly a problem with case encoding.
+  if (denormalizer_) {
+    std::string normalized;
+    if (text_only) {
+      RETURN_IF_ERROR(denormalizer_->Normalize(*text, &normalized, nullptr));
+      text->swap(normalized);
+      return util::OkStatus();
+    }
+
+    std::vector<size_t> norm_to_orig;
+    denormalizer_->Normalize(*text, &normalized, &norm_to_orig);
+
+    // Since this is denormalization, we really want orig_to_norm mapping
+    // here instead. orig_to_norm[j] is the first normalized position that
+    // maps to the position j of the text, or -1 if there is none.
+    std::vector<int> orig_to_norm(text->size() + 1, -1);
+    for (size_t i = 0; i < norm_to_orig.size(); ++i) {
+      const size_t orig = norm_to_orig[i];
+      if (orig < orig_to_norm.size() && orig_to_norm[orig] < 0) {
+        orig_to_norm[orig] = i;
+      }
+    }
+
+    // The surface of a piece ends at the normalized position of the last
+    // byte of its original surface which has one, and starts where the
+    // surface of the previous piece ended.
+    size_t normalized_piece_surface_index = 0;
+    size_t text_piece_surface_index = 0;
+    int last_consumed_byte = -1;
+    std::string new_surface;
+    for (int i = 0; i < spt->pieces_size(); ++i) {
+      auto *spiece = spt->mutable_pieces(i);
+      const size_t curr_surface_size = spiece->surface().size();
+
+      new_surface.clear();
+      for (size_t j = text_piece_surface_index + 1;
+           j <= text_piece_surface_index + curr_surface_size; ++j) {
+        const int norm_index = j < orig_to_norm.size() ? orig_to_norm[j] : -1;
+        if (norm_index >= 0) {
+          if (norm_index > last_consumed_byte + 1) {
+            new_surface.append(normalized, last_consumed_byte + 1,
+                               norm_index - last_consumed_byte - 1);
+          }
+          last_consumed_byte = norm_index - 1;
+        }
+      }
+
+      text_piece_surface_index += curr_surface_size;
+
+      // Reset the piece information with updated surface string
+      spiece->set_surface(new_surface);
+      spiece->set_begin(normalized_piece_surface_index);
+      normalized_piece_surface_index += new_surface.size();
+      spiece->set_end(normalized_piece_surface_index);
+    }
+    text->swap(normalized);
+  }
+
+  return util::OkStatus();
+}
+
+std::string SentencePieceProcessor::EncodeAsSerializedProto(
+    absl::string_view input) const {
+  SentencePieceText spt;
+  if (!Encode(input, &spt).ok()) return "";
+  return spt.SerializeAsString();
+}
+
+std::string SentencePieceProcessor::SampleEncodeAsSerializedProto(
+    absl::string_view input, int nbest_size, float alpha) const {
+  SentencePieceText spt;
+  if (!SampleEncode(input, nbest_size, alpha, &spt).ok()) return "";
+  return spt.SerializeAsString();
+}
+
+std::string SentencePieceProcessor::NBestEncodeAsSerializedProto(
+    absl::string_view input, int nbest_size) const {
+  NBestSentencePieceText spt;
+  if (!NBestEncode(input, nbest_size, &spt).ok()) return "";
+  return spt.SerializeAsString();
+}
+
+namespace {
+// Writes the rows of `ids` split at `row_offsets` as a flat result, with
+// `begins`, `ends` and the pieces of `sp` as `flags` selects.
+util::Status WriteFlatResult(const SentencePieceProcessor &sp, uint32 flags,
+                             const std::vector<int> &ids,
+                             const std::vector<size_t> &row_offsets,
+                             const std::vector<size_t> &begins,
+                             const std::vector<size_t> &ends,
+                             std::string *output) {
+  const bool with_offsets = flags & kFlatResultOffsets;
+  const bool with_pieces = flags & kFlatResultPieces;
+  uint64 pool_size = 0;
+  if (with_pieces) {
+    for (const int id : ids) pool_size += sp.IdToPiece(id).size();
+  }
+  if (with_offsets) {
+    CHECK_EQ_OR_RETURN(begins.size(), ids.size());
+    CHECK_EQ_OR_RETURN(ends.size(), ids.size());
+    for (const size_t end : ends) {
+      CHECK_LE_OR_RETURN(end, static_cast<size_t>(kuint32max))
+          << "The input is too long for a flat result.";
+    }
+  }
+  const uint64 num_words = FlatResultView::kHeaderSize / 4 +
+                           row_offsets.size() + ids.size() +
+                           (with_offsets ? 2 * ids.size() : 0) +
+                           (with_pieces ? ids.size() + 1 : 0);
+  CHECK_LE_OR_RETURN(4 * num_words + pool_size, static_cast<uint64>(kuint32max))
+      << "The flat result is too large.";
+
+  output->clear();
+  output->reserve(4 * num_words + pool_size);
+  output->append(FlatResultView::kMagic, 4);
+  EncodeUint32(FlatResultView::kVersion, output);
+  EncodeUint32(flags, output);
+  EncodeUint32(row_offsets.size() - 1, output);
+  EncodeUint32(ids.size(), output);
+  EncodeUint32(pool_size, output);
+  for (const size_t offset : row_offsets) EncodeUint32(offset, output);
+  for (const int id : ids) EncodeUint32(id, output);
+  if (with_offsets) {
+    for (const size_t begin : begins) EncodeUint32(begin, output);
+    for (const size_t end : ends) EncodeUint32(end, output);
+  }
+  if (with_pieces) {
+    uint32 offset = 0;
+    EncodeUint32(offset, output);
+    for (const int id : ids) {
+      offset += sp.IdToPiece(id).size();
+      EncodeUint32(offset, output);
+    }
+    for (const int id : ids) output->append(sp.IdToPiece(id));
+  }
+  return util::OkStatus();
+}
+}  // namespace
+
+util::Status SentencePieceProcessor::EncodeAsFlatResult(
+    const std::vector<absl::string_view> &inputs, uint32_t flags,
+    int num_threads, std::string *output) const {
+  CHECK_OR_RETURN_STATUS_STL(output);
+  CHECK_OR_RETURN((flags & ~(kFlatResultOffsets | kFlatResultPieces)) == 0)
+      << "Unknown flat result flags: " << flags;
+
+  const bool with_offsets = flags & kFlatResultOffsets;
+  std::vector<int> ids;
+  std::vector<size_t> offsets, begins, ends;
+  RETURN_IF_ERROR(EncodeBatch(inputs, &ids, &offsets,
+                              with_offsets ? &begins : nullptr,
+                              with_offsets ? &ends : nullptr, num_threads));
+  return WriteFlatResult(*this, flags, ids, offsets, begins, ends, output);
+}
+
+util::Status SentencePieceProcessor::NBestEncodeAsFlatResult(
+    absl::string_view input, int nbest_size, uint32_t flags,
+    std::string *output) const {
+  CHECK_OR_RETURN_STATUS_STL(output);
+  CHECK_OR_RETURN((flags & ~(kFlatResultOffsets | kFlatResultPieces)) == 0)
+      << "Unknown flat result flags: " << flags;
+
+  NBestSentencePieceText spt;
+  RETURN_IF_ERROR(NBestEncode(input, nbest_size, &spt));
+  std::vector<int> ids;
+  std::vector<size_t> offsets = {0}, begins, ends;
+  for (const auto &nbest : spt.nbests()) {
+    for (const auto &sp : nbest.pieces()) {
+      ids.push_back(sp.id());
+      begins.push_back(sp.begin());
+      ends.push_back(sp.end());
+    }
+    offsets.push_back(ids.size());
+  }
+  return WriteFlatResult(*this, flags, ids, offsets, begins, ends, output);
+}
+
+constexpr char FlatResultView::kMagic[];
+constexpr uint32_t FlatResultView::kVersion;
+constexpr size_t FlatResultView::kHeaderSize;
+
+util::Status FlatResultView::Init(absl::string_view data) {
+  *this = FlatResultView();
+  CHECK_OR_RETURN(data.size() >= kHeaderSize &&
+                  absl::StartsWith(data, absl::string_view(kMagic, 4)))
+      << "not a flat result.";
+  CHECK_EQ_OR_RETURN(DecodeUint32(data.data() + 4), kVersion)
+      << "unsupported flat result version.";
+  const uint32 flags = DecodeUint32(data.data() + 8);
+  const uint64 num_rows = DecodeUint32(data.data() + 12);
+  const uint64 num_ids = DecodeUint32(data.data() + 16);
+  const uint64 pool_size = DecodeUint32(data.data() + 20);
+  const bool with_offsets = flags & kFlatResultOffsets;
+  const bool with_pieces = flags & kFlatResultPieces;
+  const uint64 size = kHeaderSize +
+                      4 * (num_rows + 1 + num_ids +
+                           (with_offsets ? 2 * num_ids : 0) +
+                           (with_pieces ? num_ids + 1 : 0)) +
+                      (with_pieces ? pool_size : 0);
+  CHECK_LE_OR_RETURN(size, data.size()) << "flat result is truncated.";
+
+  const char *p = data.data() + kHeaderSize;
+  auto take = [&p](uint64 words) {
+    const char *array = p;
+    p += 4 * words;
+    return array;
+  };
+  row_offsets_ = take(num_rows + 1);
+  ids_ = take(num_ids);
+  if (with_offsets) {
+    begins_ = take(num_ids);
+    ends_ = take(num_ids);
+  }
+  if (with_pieces) {
+    piece_offsets_ = take(num_ids + 1);
+    pool_ = p;
+  }
+  flags_ = flags;
+  num_rows_ = num_rows;
+  num_ids_ = num_ids;
+  data_ = data.substr(0, size);
+
+  // The offsets are checked once here, so that the accessors need not.
+  for (size_t r = 0; r < num_rows_; ++r) {
+    CHECK_OR_RETURN(row_begin(r) <= row_end(r) && row_end(r) <= num_ids_)
+        << "invalid flat result row offsets.";
+  }
+  if (with_pieces) {
+    for (size_t i = 0; i < num_ids_; ++i) {
+      CHECK_OR_RETURN(Get(piece_offsets_, i) <= Get(piece_offsets_, i + 1) &&
+                      Get(piece_offsets_, i + 1) <= pool_size)
+          << "invalid flat result piece offsets.";
+    }
+  }
+  return util::OkStatus();
+}
+
+std::string SentencePieceProcessor::DecodePiecesAsSerializedProto(
+    const std::vector<std::string> &pieces) const {
+  SentencePieceText spt;
+  if (!Decode(pieces, &spt).ok()) return "";
+  return spt.SerializeAsString();
+}
+
+std::string SentencePieceProcessor::DecodeIdsAsSerializedProto(
+    const std::vector<int> &ids) const {
+  SentencePieceText spt;
+  if (!Decode(ids, &spt).ok()) return "";
+  return spt.SerializeAsString();
+}
+
+#define CHECK_STATUS_OR_RETURN_DEFAULT(value)                                \
+  if (!status().ok()) {                                                      \
+    LOG(ERROR) << status().message() << "\nReturns default value " << value; \
+    return value;                                                            \
+  }
+
+int SentencePieceProcessor::GetPieceSize() const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(0);
+  return model_->GetPieceSize();
+}
+
+int SentencePieceProcessor::PieceToId(absl::string_view piece) const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(0);
+  return model_->PieceToId(piece);
+}
+
+const std::string &SentencePieceProcessor::IdToPiece(int id) const {
+  static const std::string *kEmptyString = new std::string;
+  CHECK_STATUS_OR_RETURN_DEFAULT(*kEmptyString);
+  return model_->IdToPiece(id);
+}
+
+float SentencePieceProcessor::GetScore(int id) const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(0.0);
+  return model_->GetScore(id);
+}
+
+bool SentencePieceProcessor::IsControl(int id) const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(0);
+  return model_->IsControl(id);
+}
+
+bool SentencePieceProcessor::IsUnknown(int id) const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(0);
+  return model_->IsUnknown(id);
+}
+
+bool SentencePieceProcessor::IsUnused(int id) const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(false);
+  return model_->IsUnused(id);
+}
+
+bool SentencePieceProcessor::IsByte(int id) const {
+  CHECK_STATUS_OR_RETURN_DEFAULT(false);
+  return model_->IsByte(id);
+}
+
+int SentencePieceProcessor::unk_id() const {
+  const int id = PieceToId(absl::string_view(model_->unk_piece().data()));
+  if (IsUnknown(id)) return id;
+  return -1;
+}
+
+int SentencePieceProcessor::bos_id() const {
+  const int id = PieceToId(absl::string_view(model_->bos_piece().data()));
+  if (IsControl(id)) return id;
+  return -1;
+}
+
+int SentencePieceProcessor::eos_id() const {
+  const int id = PieceToId(absl::string_view(model_->eos_piece().data()));
+  if (IsControl(id)) return id;
+  return -1;
+}
+
+int SentencePieceProcessor::pad_id() const {
+  const int id = PieceToId(absl::string_view(model_->pad_piece().data()));
+  if (IsControl(id)) return id;
+  return -1;
+}
+
+// static
+util::Status SentencePieceProcessor::ApplyExtraOptions(
+    const std::vector<ExtraOption> &extra_options,
+    SentencePieceText *spt) const {
+  for (const auto &extra_option : extra_options) {
+    switch (extra_option) {
+      case REVERSE:
+        std::reverse(spt->mutable_pieces()->begin(),
+                     spt->mutable_pieces()->end());
+        break;
+      case EOS: {
+        auto *piece = spt->add_pieces();
+        piece->set_id(PieceToId(absl::string_view(model_->eos_piece().data())));
+        piece->set_piece(model_->eos_piece().data(),
+                         model_->eos_piece().size());
+      } break;
+      case BOS: {
+        auto *array = spt->mutable_pieces();
+        array->Add();
+        for (int i = array->size() - 1; i > 0; --i) {
+          array->SwapElements(i - 1, i);
+        }
+        auto *piece = array->Mutable(0);
+        piece->set_id(PieceToId(absl::string_view(model_->bos_piece().data())));
+        piece->set_piece(model_->bos_piece().data(),
+                         model_->bos_piece().size());
+      } break;
+      default:
+        return util::InternalError("unknown extra_option type.");
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::ApplyExtraOptions(
+    const std::vector<ExtraOption> &extra_options,
+    std::vector<int> *ids) const {
+  for (const auto &extra_option : extra_options) {
+    switch (extra_option) {
+      case REVERSE:
+        std::reverse(ids->begin(), ids->end());
+        break;
+      case EOS:
+        ids->push_back(
+            PieceToId(absl::string_view(model_->eos_piece().data())));
+        break;
+      case BOS:
+        ids->insert(ids->begin(),
+                    PieceToId(absl::string_view(model_->bos_piece().data())));
+        break;
+      default:
+        return util::InternalError("unknown extra_option type.");
+    }
+  }
+
+  return util::OkStatus();
+}
+
+util::Status SentencePieceProcessor::ApplyExtraOptions(
+    const std::vector<ExtraOption> &extra_options,
+    std::vector<EncodedPiece> *pieces) const {
+  for (const auto &extra_option : extra_options) {
+    switch (extra_option) {
+      case REVERSE:
+        std::reverse(pieces->begin(), pieces->end());
+        break;
+      case EOS: {
+        EncodedPiece piece;
+        piece.piece = model_->eos_piece();
+        piece.id = PieceToId(absl::string_view(model_->eos_piece().data()));
+        pieces->push_back(piece);
+      } break;
+      case BOS: {
+        EncodedPiece piece;
+        piece.piece = model_->bos_piece();
+        piece.id = PieceToId(absl::string_view(model_->bos_piece().data()));
+        pieces->insert(pieces->begin(), piece);
+      } break;
+      default:
+        return util::InternalError("unknown extra_option type.");
+    }
+  }
+
+  return util::OkStatus();
+}
+
+// static
+util::Status SentencePieceProcessor::ParseExtraOptions(
+    absl::string_view _extra_option,
+    std::vector<SentencePieceProcessor::ExtraOption> *extra_options) const {
+  absl::string_view extra_option(_extra_option.data(), _extra_option.size());
+
+  extra_options->clear();
+  if (extra_option.empty()) return util::OkStatus();
+
+  RETURN_IF_ERROR(status());
+
+  static std::map<absl::string_view, SentencePieceProcessor::ExtraOption>
+      extra_option_map = {{"bos", SentencePieceProcessor::BOS},
+                          {"eos", SentencePieceProcessor::EOS},
+                          {"reverse", SentencePieceProcessor::REVERSE}};
+  for (const auto &s : absl::StrSplit(extra_option, ":")) {
+    const auto it = extra_option_map.find(s);
+    CHECK_OR_RETURN(it != extra_option_map.end())
+        << "option \"" << s << "\" is not available.";
+    extra_options->push_back(it->second);
+
+    if (it->second == SentencePieceProcessor::BOS) {
+      CHECK_OR_RETURN(
+          !IsUnknown(PieceToId(absl::string_view(model_->bos_piece().data()))))
+          << "id for `" << model_->bos_piece() << "` is not defined.";
+    }
+    if (it->second == SentencePieceProcessor::EOS) {
+      CHECK_OR_RETURN(
+          !IsUnknown(PieceToId(absl::string_view(model_->eos_piece().data()))))
+          << "id for `" << model_->eos_piece() << "` is not defined.";
+    }
+  }
+  return util::OkStatus();
+}
+
+void SentencePieceProcessor::SetModel(std::unique_ptr<ModelInterface> &&model) {
+  if (compiled_model_ == nullptr || is_shared_model_) {
+    SetCompiledModel(std::shared_ptr<CompiledModel>(new CompiledModel()),
+                     false);
+  }
+  compiled_model_->model_ = std::move(model);
+  model_ = compiled_model_->model_.get();
+  compiled_model_->decode_table_.reset();
+  decode_table_ = nullptr;
+  // The pieces of `model` may differ from the model proto.
+  compiled_model_->has_word_boundaries_ = false;
+  compiled_model_->precompiled_model_file_.clear();
+  InvalidateEncodeCache();
+  UpdateBatchEncoder();
+}
+
+void SentencePieceProcessor::SetNormalizer(
+    std::unique_ptr<normalizer::Normalizer> &&normalizer) {
+  if (compiled_model_ == nullptr || is_shared_model_) {
+    SetCompiledModel(std::shared_ptr<CompiledModel>(new CompiledModel()),
+                     false);
+  }
+  compiled_model_->normalizer_ = std::move(normalizer);
+  normalizer_ = compiled_model_->normalizer_.get();
+  compiled_model_->has_word_boundaries_ = false;
+  compiled_model_->precompiled_model_file_.clear();
+  InvalidateEncodeCache();
+}
+
+const ModelProto &SentencePieceProcessor::model_proto() const {
+  return *model_proto_;
+}
+
+std::string SentencePieceProcessor::serialized_model_proto() const {
+  return model_proto_ ? model_proto_->SerializeAsString() : "";
+}
+
+std::string SentencePieceProcessor::precompiled_model_file() const {
+  return compiled_model_ ? compiled_model_->precompiled_model_file_ : "";
+}
+
+void SentencePieceProcessor::SetTracer(std::shared_ptr<Tracer> tracer) {
+  tracer_ = std::move(tracer);
+}
+
+// static
+EncodeStats SentencePieceProcessor::GetStats() { return stats::GetStats(); }
+
+MemoryUsage SentencePieceProcessor::GetMemoryUsage() const {
+  MemoryUsage usage;
+  if (encode_cache_ != nullptr) usage.encode_cache = encode_cache_->bytes();
+  if (compiled_model_ == nullptr) return usage;
+  compiled_model_->AddMemoryUsage(&usage);
+#ifndef SPM_NO_THREADLOCAL
+  usage.thread_buffers +=
+      EncodeWorkspaceMemoryUsage(GetThreadWorkspace()->workspace);
+#endif  // SPM_NO_THREADLOCAL
+  return usage;
+}
+
+// static
+uint64_t SentencePieceProcessor::EncodeWorkspaceMemoryUsage(
+    const EncodeWorkspace &workspace) {
+  return port::ContainerBytes(workspace.normalized) +
+         port::ContainerBytes(workspace.pieces) +
+         port::ContainerBytes(workspace.compact_pieces) +
+         port::ContainerBytes(workspace.collapsed) +
+         port::ContainerBytes(workspace.collapsed_pieces) +
+         port::ContainerBytes(workspace.ids) +
+         port::ContainerBytes(workspace.chunk_ids) +
+         port::ContainerBytes(workspace.norm_to_orig) +
+         port::ContainerBytes(workspace.raw_pieces) +
+         port::ContainerBytes(workspace.piece_views);
+}
+
+util::Status SentencePieceProcessor::WarmUp(
+    const WarmUpOptions &options) const {
+  RETURN_IF_ERROR(CheckCanEncode());
+  CHECK_GT_OR_RETURN(options.max_input_length, 0)
+      << "max_input_length must be positive.";
+  CHECK_GT_OR_RETURN(options.num_encodes, 0)
+      << "num_encodes must be positive.";
+  CHECK_GT_OR_RETURN(options.num_threads, 0)
+      << "num_threads must be positive.";
+  if (options.populate || options.lock_memory) {
+    RETURN_IF_ERROR(compiled_model_->PrefaultModelFiles(options.lock_memory));
+  }
+
+  // The pieces of the model in a scattered order, so that the input goes
+  // through many parts of the tries.
+  const size_t max_length = options.max_input_length;
+  const int piece_size = GetPieceSize();
+  constexpr int64 kStride = 7919;
+  std::string text;
+  for (int i = 0; i < piece_size && text.size() < max_length; ++i) {
+    const int id = static_cast<int>(i * kStride % piece_size);
+    if (IsControl(id) || IsUnknown(id) || IsUnused(id) || IsByte(id)) {
+      continue;
+    }
+    text += absl::StrReplaceAll(IdToPiece(id), {{kSpaceSymbol, " "}});
+  }
+  if (text.empty()) text = "warm up";
+  while (text.size() < max_length) text += std::string(text);
+
+  RETURN_IF_ERROR(WarmUpThread(text, options, options.workspace));
+
+  // The workers of the batch methods keep their buffers in the workspaces
+  // of their threads.
+  std::mutex mutex;
+  util::Status status;
+  ForEachSharedPoolWorker(options.num_threads, [&]() {
+    const util::Status worker_status = WarmUpThread(text, options, nullptr);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (status.ok()) status = worker_status;
+  });
+  return status;
+}
+
+util::Status SentencePieceProcessor::WarmUpThread(
+    absl::string_view text, const WarmUpOptions &options,
+    EncodeWorkspace *workspace) const {
+  // Returns the prefix of `text` of at most `size` bytes, at a character
+  // boundary.
+  auto prefix = [&text](size_t size) {
+    size = std::min(size, text.size());
+    while (size > 0 && size < text.size() &&
+           string_util::IsTrailByte(text[size])) {
+      --size;
+    }
+    return text.substr(0, size);
+  };
+
+  // Encodes as EncodeIds() does, without the encode cache, which would
+  // answer the next threads.
+  const size_t max_length = options.max_input_length;
+  ScopedThreadWorkspace thread_workspace(workspace == nullptr);
+  if (workspace == nullptr) workspace = thread_workspace.get();
+  std::string decoded;
+  for (int i = 1; i <= options.num_encodes; ++i) {
+    const absl::string_view input =
+        prefix(max_length * i / options.num_encodes);
+    RETURN_IF_ERROR(
+        normalizer_->Normalize(input, &workspace->normalized, nullptr));
+    RETURN_IF_ERROR(
+        EncodeNormalizedIds(input, workspace->normalized, workspace));
+    RETURN_IF_ERROR(Decode(workspace->ids, &decoded));
+  }
+
+  const absl::string_view sample =
+      prefix(max_length / options.num_encodes);
+  std::vector<int> ids;
+  if (model_->IsSampleEncodeAvailable()) {
+    RETURN_IF_ERROR(SampleEncode(sample, -1, 0.1, &ids));
+  }
+  if (model_->IsNBestEncodeAvailable()) {
+    NBestIds nbest;
+    RETURN_IF_ERROR(NBestEncode(sample, 8, &nbest));
+  }
+
+  return util::OkStatus();
+}
+
+StreamingEncoder::StreamingEncoder(const SentencePieceProcessor &processor)
+    : processor_(processor) {
+  if (!processor_.status().ok()) return;
+  has_boundaries_ = processor_.compiled_model_->has_word_boundaries_;
+  lowercase_before_boundary_ =
+      has_boundaries_ &&
+      processor_.model_proto().normalizer_spec().encode_case();
+}
+
+void StreamingEncoder::Reset() {
+  pending_.clear();
+  scanned_ = 0;
+  started_ = false;
+  is_prev_unk_ = false;
+  run_id_ = -1;
+  run_size_ = 0;
+}
+
+bool StreamingEncoder::IsBoundary(size_t pos) const {
+  return IsWordBoundary(pending_, pos, lowercase_before_boundary_);
+}
+
+util::Status StreamingEncoder::CheckExtraOptions() const {
+  RETURN_IF_ERROR(processor_.CheckCanEncode());
+  for (const auto option : processor_.encode_extra_options_) {
+    CHECK_OR_RETURN(option != SentencePieceProcessor::REVERSE)
+        << "The reverse extra option cannot be used with StreamingEncoder.";
+  }
+  return util::OkStatus();
+}
+
+util::Status StreamingEncoder::Push(absl::string_view input,
+                                    std::vector<int> *ids) {
+  CHECK_OR_RETURN(ids) << "output container is null";
+  ids->clear();
+  RETURN_IF_ERROR(CheckExtraOptions());
+
+  pending_.append(input.data(), input.size());
+  if (!has_boundaries_) return util::OkStatus();
+
+  size_t cut = 0;
+  for (size_t pos = std::max<size_t>(scanned_, 1); pos < pending_.size();
+       ++pos) {
+    if (IsBoundary(pos)) cut = pos;
+  }
+  scanned_ = pending_.size();
+  if (cut == 0) return util::OkStatus();
+
+  RETURN_IF_ERROR(EncodeChunk(absl::string_view(pending_).substr(0, cut), ids));
+  pending_.erase(0, cut);
+  scanned_ = pending_.size();
+  return util::OkStatus();
+}
+
+util::Status StreamingEncoder::Finish(std::vector<int> *ids) {
+  CHECK_OR_RETURN(ids) << "output container is null";
+  ids->clear();
+  RETURN_IF_ERROR(CheckExtraOptions());
+
+  RETURN_IF_ERROR(EncodeChunk(pending_, ids));
+  for (const auto option : processor_.encode_extra_options_) {
+    if (option == SentencePieceProcessor::EOS) {
+      AddId(processor_.PieceToId(
+                absl::string_view(processor_.model_->eos_piece().data())),
+            ids);
+    }
+  }
+  FlushRun(ids);
+  Reset();
+  return util::OkStatus();
+}
+
+util::Status StreamingEncoder::EncodeChunk(absl::string_view text,
+                                           std::vector<int> *ids) {
+  if (!started_) {
+    for (const auto option : processor_.encode_extra_options_) {
+      if (option == SentencePieceProcessor::BOS) {
+        AddId(processor_.PieceToId(
+                  absl::string_view(processor_.model_->bos_piece().data())),
+              ids);
+      }
+    }
+    started_ = true;
+  }
+
+  std::string &normalized = workspace_.normalized;
+  RETURN_IF_ERROR(processor_.normalizer_->Normalize(text, &normalized, nullptr));
+  std::vector<int> &raw = workspace_.ids;
+  RETURN_IF_ERROR(processor_.PopulateRawIds(
+      normalized, processor_.model_->Encode(normalized), &raw));
+  if (raw.empty()) return util::OkStatus();
+
+  // Continuous unknown pieces are merged into one across the cut too.
+  const bool skip_first = is_prev_unk_ && processor_.IsUnknown(raw[0]);
+  for (size_t i = skip_first ? 1 : 0; i < raw.size(); ++i) AddId(raw[i], ids);
+  is_prev_unk_ = processor_.IsUnknown(raw.back());
+  return util::OkStatus();
+}
+
+void StreamingEncoder::AddId(int id, std::vector<int> *ids) {
+  if (run_size_ > 0 && id == run_id_ && !processor_.IsUnknown(id)) {
+    ++run_size_;
+    return;
+  }
+  FlushRun(ids);
+  run_id_ = id;
+  run_size_ = 1;
+}
+
+void StreamingEncoder::FlushRun(std::vector<int> *ids) {
+  if (run_size_ == 0) return;
+  ids->push_back(run_id_);
+  if (run_size_ > 1) {
+    ForEachRepeatMarker(*processor_.model_, run_size_,
+                        [&](int id, absl::string_view) { ids->push_back(id); });
+  }
+  run_size_ = 0;
+}
+
+IncrementalEncoder::IncrementalEncoder(const SentencePieceProcessor &processor)
+    : processor_(processor) {
+  if (!processor_.status().ok()) return;
+  has_boundaries_ = processor_.compiled_model_->has_word_boundaries_;
+  lowercase_before_boundary_ =
+      has_boundaries_ &&
+      processor_.model_proto().normalizer_spec().encode_case();
+}
+
+util::Status IncrementalEncoder::SetText(absl::string_view text) {
+  text_.clear();
+  ids_.clear();
+  begins_.clear();
+  ends_.clear();
+  return Replace(0, 0, text);
+}
 
-    int normalized_piece_surface_index = 0;
-    int text_piece_surface_index = 0;
-    int last_consumed_byte = -1;
-    for(int i = 0; i < spt->pieces_size(); i++) {
-      auto *spiece = spt->mutable_pieces(i);
-      auto curr_surface = spiece->surface();
-
-      // Determine the new surface string based on orig_to_norm indices
-      std::string new_surface;
-      for(int j = text_piece_surface_index; j < text_piece_surface_index + curr_surface.size();
-          j++) {
-        auto norm_index = orig_to_norm.find(j + 1);
-        if(norm_index != orig_to_norm.end()) {
-          for(int k = last_consumed_byte + 1; k <=  norm_index->second - 1; k++)
-            new_surface.push_back(normalized[k]);
-          last_consumed_byte = norm_index->second - 1;
-        }
-      }
+int64_t IncrementalEncoder::PieceAtCut(size_t spaces, size_t pos) const {
+  // The first piece after the cut begins with the whitespace before it.
+  const size_t i =
+      std::lower_bound(begins_.begin(), begins_.end(), spaces) -
+      begins_.begin();
+  return i < begins_.size() && begins_[i] <= pos ? i : -1;
+}
 
-      text_piece_surface_index += curr_surface.size();
+util::Status IncrementalEncoder::EncodeWindow(size_t begin, size_t end) {
+  const absl::string_view input =
+      absl::string_view(text_).substr(begin, end - begin);
+  auto &pieces = workspace_.raw_pieces;
+  pieces.clear();
+  RETURN_IF_ERROR(processor_.normalizer_->Normalize(
+      input, &workspace_.normalized, &workspace_.norm_to_orig));
+  processor_.model_->EncodeInto(workspace_.normalized, nullptr,
+                                &workspace_.pieces);
+  RETURN_IF_ERROR(processor_.PopulateRawPieces(
+      input, workspace_.normalized, workspace_.norm_to_orig,
+      workspace_.pieces, &pieces));
+  for (auto &piece : pieces) {
+    piece.begin += begin;
+    piece.end += begin;
+  }
+  // The whitespace before a cut is in the dummy prefix of the first piece,
+  // unless it leads the text.
+  if (!pieces.empty() && pieces[0].begin == begin) {
+    size_t spaces = begin;
+    while (spaces > 0 && text_[spaces - 1] == ' ') --spaces;
+    if (spaces > 0) pieces[0].begin = spaces;
+  }
+  last_encoded_size_ = input.size();
+  return util::OkStatus();
+}
 
-      // Reset the piece information with updated surface string
-      spiece->set_surface(new_surface);
-      spiece->set_begin(normalized_piece_surface_index);
-      normalized_piece_surface_index += new_surface.size();
-      spiece->set_end(normalized_piece_surface_index);
+util::Status IncrementalEncoder::Replace(size_t offset, size_t length,
+                                         absl::string_view replacement) {
+  RETURN_IF_ERROR(processor_.CheckCanEncode());
+  CHECK_LE_OR_RETURN(offset, text_.size()) << "The edit is out of the text.";
+  CHECK_LE_OR_RETURN(length, text_.size() - offset)
+      << "The edit is out of the text.";
+  text_.replace(offset, length, replacement.data(), replacement.size());
+  const size_t edit_end = offset + replacement.size();
+  // Maps a byte after the edit to the text before it.
+  auto to_old = [&](size_t pos) { return pos - replacement.size() + length; };
+  auto spaces_before = [&](size_t pos) {
+    while (pos > 0 && text_[pos - 1] == ' ') --pos;
+    return pos;
+  };
+
+  // The window to encode is text_[begin, end), and replaces the pieces
+  // [first, last). A cut depends on the bytes from the last non-space byte
+  // before it to the byte after it, which must all be outside of the edit.
+  size_t begin = 0, end = text_.size();
+  int64 first = 0, last = ids_.size();
+  if (has_boundaries_) {
+    for (size_t pos = offset; pos-- > 1;) {
+      if (!IsWordBoundary(text_, pos, lowercase_before_boundary_)) continue;
+      const int64 i = PieceAtCut(spaces_before(pos), pos);
+      if (i < 0) continue;
+      begin = pos;
+      first = i;
+      break;
+    }
+    for (size_t pos = edit_end + 1; pos < text_.size(); ++pos) {
+      if (!IsWordBoundary(text_, pos, lowercase_before_boundary_)) continue;
+      const size_t spaces = spaces_before(pos);
+      if (spaces <= edit_end) continue;
+      const int64 i = PieceAtCut(to_old(spaces), to_old(pos));
+      if (i < 0) continue;
+      end = pos;
+      last = i;
+      break;
     }
   }
+  RETURN_IF_ERROR(EncodeWindow(begin, end));
 
+  // Moves the pieces after the window and splices the window in.
+  for (size_t i = last; i < ids_.size(); ++i) {
+    begins_[i] = begins_[i] + replacement.size() - length;
+    ends_[i] = ends_[i] + replacement.size() - length;
+  }
+  const auto &pieces = workspace_.raw_pieces;
+  ids_.erase(ids_.begin() + first, ids_.begin() + last);
+  begins_.erase(begins_.begin() + first, begins_.begin() + last);
+  ends_.erase(ends_.begin() + first, ends_.begin() + last);
+  std::vector<int> ids;
+  std::vector<size_t> begins, ends;
+  for (const auto &piece : pieces) {
+    ids.push_back(piece.id);
+    begins.push_back(piece.begin);
+    ends.push_back(piece.end);
+  }
+  ids_.insert(ids_.begin() + first, ids.begin(), ids.end());
+  begins_.insert(begins_.begin() + first, begins.begin(), begins.end());
+  ends_.insert(ends_.begin() + first, ends.begin(), ends.end());
+
+  // Continuous unknown pieces are merged into one across the cuts, as
+  // StreamingEncoder does.
+  auto merge_unknowns = [&](size_t i) {
+    if (i == 0 || i >= ids_.size() || !processor_.IsUnknown(ids_[i - 1]) ||
+        !processor_.IsUnknown(ids_[i])) {
+      return;
+    }
+    ends_[i - 1] = ends_[i];
+    ids_.erase(ids_.begin() + i);
+    begins_.erase(begins_.begin() + i);
+    ends_.erase(ends_.begin() + i);
+  };
+  merge_unknowns(first + pieces.size());
+  merge_unknowns(first);
   return util::OkStatus();
 }
 
-util::Status SentencePieceProcessor::Decode(const std::vector<int> &ids,
-                                            SentencePieceText *spt) const {
-  std::vector<std::string> pieces;
-  pieces.reserve(ids.size());
-  for (const int id : ids) {
-    pieces.emplace_back(IdToPiece(id));
-  }
-  return Decode(pieces, spt);
+util::Status IncrementalEncoder::GetIds(std::vector<int> *ids) const {
+  CHECK_OR_RETURN(ids) << "output container is null";
+  ids->clear();
+  RETURN_IF_ERROR(processor_.CheckCanEncode());
+  std::vector<int> raw = ids_;
+  RETURN_IF_ERROR(
+      processor_.ApplyExtraOptions(processor_.encode_extra_options_, &raw));
+  processor_.AppendRepeatRuns(raw, ids);
+  return util::OkStatus();
 }
 
-std::string SentencePieceProcessor::EncodeAsSerializedProto(
-    absl::string_view input) const {
-  SentencePieceText spt;
-  if (!Encode(input, &spt).ok()) return "";
-  return spt.SerializeAsString();
+StreamingDecoder::StreamingDecoder(const SentencePieceProcessor &processor)
+    : processor_(processor) {
+  if (!processor_.status().ok() || processor_.model_proto_ == nullptr) return;
+  const auto &model_proto = *processor_.model_proto_;
+  hold_last_piece_ = model_proto.trainer_spec().treat_whitespace_as_suffix();
+  // Otherwise the denormalized texts of both sides of a cut do not
+  // concatenate to the denormalized text of the whole.
+  const auto &spec = model_proto.denormalizer_spec();
+  has_boundaries_ = processor_.denormalizer_ != nullptr &&
+                    !spec.add_dummy_prefix() &&
+                    !spec.remove_extra_whitespaces();
+  decode_case_ = spec.decode_case();
 }
 
-std::string SentencePieceProcessor::SampleEncodeAsSerializedProto(
-    absl::string_view input, int nbest_size, float alpha) const {
-  SentencePieceText spt;
-  if (!SampleEncode(input, nbest_size, alpha, &spt).ok()) return "";
-  return spt.SerializeAsString();
+void StreamingDecoder::Reset() {
+  prev_id_ = -1;
+  run_count_ = 0;
+  group_.clear();
+  group_count_ = 0;
+  bytes_.clear();
+  held_id_ = -1;
+  has_surface_ = false;
+  surface_.clear();
+  scanned_ = 0;
+  all_upper_ = false;
 }
 
-std::string SentencePieceProcessor::NBestEncodeAsSerializedProto(
-    absl::string_view input, int nbest_size) const {
-  NBestSentencePieceText spt;
-  if (!NBestEncode(input, nbest_size, &spt).ok()) return "";
-  return spt.SerializeAsString();
+util::Status StreamingDecoder::CheckExtraOptions() const {
+  RETURN_IF_ERROR(processor_.status());
+  for (const auto option : processor_.decode_extra_options_) {
+    CHECK_OR_RETURN(option != SentencePieceProcessor::REVERSE)
+        << "The reverse extra option cannot be used with StreamingDecoder.";
+  }
+  return util::OkStatus();
 }
 
-std::string SentencePieceProcessor::DecodePiecesAsSerializedProto(
-    const std::vector<std::string> &pieces) const {
-  SentencePieceText spt;
-  if (!Decode(pieces, &spt).ok()) return "";
-  return spt.SerializeAsString();
+util::Status StreamingDecoder::Push(int id, std::string *text) {
+  return Push(std::vector<int>{id}, text);
 }
 
-std::string SentencePieceProcessor::DecodeIdsAsSerializedProto(
-    const std::vector<int> &ids) const {
-  SentencePieceText spt;
-  if (!Decode(ids, &spt).ok()) return "";
-  return spt.SerializeAsString();
+util::Status StreamingDecoder::Push(const std::vector<int> &ids,
+                                    std::string *text) {
+  CHECK_OR_RETURN(text) << "output container is null";
+  text->clear();
+  RETURN_IF_ERROR(CheckExtraOptions());
+
+  const int piece_size = processor_.GetPieceSize();
+  for (const int id : ids) {
+    CHECK_OR_RETURN(id >= 0 && id < piece_size)
+        << "Invalid id: " << id << ". The piece size is " << piece_size;
+    RETURN_IF_ERROR(AddId(id, text));
+  }
+  return Denormalize(false, text);
 }
 
-#define CHECK_STATUS_OR_RETURN_DEFAULT(value)                                \
-  if (!status().ok()) {                                                      \
-    LOG(ERROR) << status().message() << "\nReturns default value " << value; \
-    return value;                                                            \
+util::Status StreamingDecoder::Finish(std::string *text) {
+  CHECK_OR_RETURN(text) << "output container is null";
+  text->clear();
+  RETURN_IF_ERROR(CheckExtraOptions());
+
+  while (!group_.empty()) RETURN_IF_ERROR(FlushGroup(text));
+  DecodeBytes(true, text);
+  // The eos extra option appends a piece after the held one.
+  bool has_eos = false;
+  for (const auto option : processor_.decode_extra_options_) {
+    if (option == SentencePieceProcessor::EOS) has_eos = true;
+  }
+  DecodeHeldPiece(!has_eos, text);
+  RETURN_IF_ERROR(Denormalize(true, text));
+  Reset();
+  return util::OkStatus();
+}
+
+util::Status StreamingDecoder::AddId(int id, std::string *text) {
+  // Repeat markers that are not in the vocab are decoded as unknown pieces.
+  const auto &special = processor_.model_->special_piece_ids();
+  if (!group_.empty()) {
+    group_.push_back(id);
+    if (id == special.end_repeat) {
+      if (group_.size() == 2) return FlushGroup(text);
+      if (group_count_ > 1) run_count_ += group_count_ - 1;
+      RETURN_IF_ERROR(
+          CheckRepeatRun(run_count_, processor_.decode_max_repeat_count_));
+      for (int64 k = 1; k < group_count_; ++k) {
+        RETURN_IF_ERROR(AddPiece(prev_id_, text));
+      }
+      group_.clear();
+      return util::OkStatus();
+    }
+    int digit = -1;
+    for (int d = 0; d < 10; ++d) {
+      if (id == special.digits[d] && !processor_.IsUnknown(id)) digit = d;
+    }
+    if (digit < 0 || group_count_ > kMaxRepeatCount) return FlushGroup(text);
+    group_count_ = group_count_ * 10 + digit;
+    return util::OkStatus();
   }
 
-int SentencePieceProcessor::GetPieceSize() const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(0);
-  return model_->GetPieceSize();
+  if (prev_id_ >= 0 && id == special.start_repeat &&
+      !processor_.IsUnknown(special.start_repeat) &&
+      !processor_.IsUnknown(special.end_repeat)) {
+    group_.push_back(id);
+    group_count_ = 0;
+    return util::OkStatus();
+  }
+
+  if (prev_id_ >= 0) {
+    const int count = special.RepeatCount(id);
+    if (count > 0) {
+      run_count_ += count;
+      RETURN_IF_ERROR(
+          CheckRepeatRun(run_count_, processor_.decode_max_repeat_count_));
+    }
+    for (int k = 0; k < count; ++k) RETURN_IF_ERROR(AddPiece(prev_id_, text));
+    if (count > 0) return util::OkStatus();
+  }
+
+  prev_id_ = id;
+  run_count_ = 1;
+  return AddPiece(id, text);
 }
 
-int SentencePieceProcessor::PieceToId(absl::string_view piece) const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(0);
-  return model_->PieceToId(piece);
+util::Status StreamingDecoder::FlushGroup(std::string *text) {
+  // Decode() decodes the start marker as a piece and goes on after it.
+  const std::vector<int> rest(group_.begin() + 1, group_.end());
+  prev_id_ = group_[0];
+  run_count_ = 1;
+  group_.clear();
+  RETURN_IF_ERROR(AddPiece(prev_id_, text));
+  for (const int id : rest) RETURN_IF_ERROR(AddId(id, text));
+  return util::OkStatus();
 }
 
-const std::string &SentencePieceProcessor::IdToPiece(int id) const {
-  static const std::string *kEmptyString = new std::string;
-  CHECK_STATUS_OR_RETURN_DEFAULT(*kEmptyString);
-  return model_->IdToPiece(id);
+util::Status StreamingDecoder::AddPiece(int id, std::string *text) {
+  if (processor_.IsByte(id)) {
+    DecodeHeldPiece(false, text);
+    const int byte = processor_.model_->IdToByte(id);
+    CHECK_LE_OR_RETURN(0, byte);
+    bytes_.push_back(byte);
+    DecodeBytes(false, text);
+    return util::OkStatus();
+  }
+
+  DecodeBytes(true, text);
+  DecodeHeldPiece(false, text);
+  if (hold_last_piece_) {
+    held_id_ = id;
+  } else {
+    AddSurface(processor_.DecodePiece(processor_.IdToPiece(id), id,
+                                      !has_surface_, false),
+               text);
+  }
+  return util::OkStatus();
 }
 
-float SentencePieceProcessor::GetScore(int id) const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(0.0);
-  return model_->GetScore(id);
+void StreamingDecoder::DecodeBytes(bool flush, std::string *text) {
+  size_t pos = 0;
+  while (pos < bytes_.size()) {
+    // DecodeUTF8() reads at most the bytes the leading byte asks for.
+    const unsigned char lead = bytes_[pos];
+    const size_t length = (lead & 0xE0) == 0xC0   ? 2
+                          : (lead & 0xF0) == 0xE0 ? 3
+                          : (lead & 0xF8) == 0xF0 ? 4
+                                                  : 1;
+    if (!flush && bytes_.size() - pos < length) break;
+    size_t mblen = 0;
+    const char32 uc = string_util::DecodeUTF8(
+        bytes_.data() + pos, bytes_.data() + bytes_.size(), &mblen);
+    // Invalid UTF-8 bytes are mapped to REPLACEMENT CHARACTER (U+FFFD).
+    AddSurface(string_util::UnicodeCharToUTF8(uc), text);
+    pos += mblen;
+  }
+  bytes_.erase(0, pos);
 }
 
-bool SentencePieceProcessor::IsControl(int id) const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(0);
-  return model_->IsControl(id);
+void StreamingDecoder::DecodeHeldPiece(bool is_eos_ws, std::string *text) {
+  if (held_id_ < 0) return;
+  AddSurface(processor_.DecodePiece(processor_.IdToPiece(held_id_), held_id_,
+                                    !has_surface_, is_eos_ws),
+             text);
+  held_id_ = -1;
 }
 
-bool SentencePieceProcessor::IsUnknown(int id) const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(0);
-  return model_->IsUnknown(id);
+void StreamingDecoder::AddSurface(absl::string_view surface,
+                                  std::string *text) {
+  if (surface.empty()) return;
+  has_surface_ = true;
+  std::string *output =
+      processor_.denormalizer_ != nullptr ? &surface_ : text;
+  output->append(surface.data(), surface.size());
 }
 
-bool SentencePieceProcessor::IsUnused(int id) const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(false);
-  return model_->IsUnused(id);
+util::Status StreamingDecoder::Denormalize(bool flush, std::string *text) {
+  if (processor_.denormalizer_ == nullptr) return util::OkStatus();
+
+  // A case marker changes the text after it, but none is in effect after a
+  // space unless a span of uppercase words is open.
+  size_t cut = flush ? surface_.size() : 0;
+  if (!flush && has_boundaries_) {
+    for (size_t pos = scanned_; pos < surface_.size(); ++pos) {
+      const char c = surface_[pos];
+      if (decode_case_ && c == normalizer::cAllUppercase) {
+        all_upper_ = true;
+      } else if (decode_case_ && (c == normalizer::cTitlecase ||
+                                  c == normalizer::cLowercase)) {
+        all_upper_ = false;
+      } else if (c == ' ' && !all_upper_) {
+        cut = pos + 1;
+      }
+    }
+    scanned_ = surface_.size();
+  }
+  if (cut == 0) return util::OkStatus();
+
+  std::string denormalized;
+  RETURN_IF_ERROR(processor_.denormalizer_->Normalize(
+      absl::string_view(surface_).substr(0, cut), &denormalized, nullptr));
+  text->append(denormalized);
+  surface_.erase(0, cut);
+  scanned_ = surface_.size();
+  return util::OkStatus();
 }
 
-bool SentencePieceProcessor::IsByte(int id) const {
-  CHECK_STATUS_OR_RETURN_DEFAULT(false);
-  return model_->IsByte(id);
+ProcessorHandle::ProcessorHandle() {}
+ProcessorHandle::~ProcessorHandle() {}
+
+util::Status ProcessorHandle::Load(absl::string_view filename) {
+  auto processor = std::make_shared<SentencePieceProcessor>();
+  RETURN_IF_ERROR(processor->Load(filename));
+  return Publish(std::move(processor));
 }
 
-int SentencePieceProcessor::unk_id() const {
-  const int id = PieceToId(absl::string_view(model_->unk_piece().data()));
-  if (IsUnknown(id)) return id;
-  return -1;
+util::Status ProcessorHandle::Publish(
+    std::shared_ptr<const SentencePieceProcessor> processor) {
+  CHECK_OR_RETURN(processor) << "Processor is not initialized.";
+  RETURN_IF_ERROR(processor->status());
+  // The previous processor is released here, or by the last request still
+  // holding it, but never under the lock guarding the pointer.
+  auto previous = std::atomic_exchange(&processor_, std::move(processor));
+  return util::OkStatus();
 }
 
-int SentencePieceProcessor::bos_id() const {
-  const int id = PieceToId(absl::string_view(model_->bos_piece().data()));
-  if (IsControl(id)) return id;
-  return -1;
+std::shared_ptr<const SentencePieceProcessor> ProcessorHandle::Acquire()
+    const {
+  return std::atomic_load(&processor_);
 }
 
-int SentencePieceProcessor::eos_id() const {
-  const int id = PieceToId(absl::string_view(model_->eos_piece().data()));
-  if (IsControl(id)) return id;
-  return -1;
+MultiModelEncoder::MultiModelEncoder() {}
+MultiModelEncoder::~MultiModelEncoder() {}
+
+util::Status MultiModelEncoder::Init(
+    const std::vector<const SentencePieceProcessor *> &processors,
+    int num_threads) {
+  processors_.clear();
+  pool_.reset();
+  CHECK_OR_RETURN(!processors.empty()) << "No processor is given.";
+  for (const auto *processor : processors) {
+    CHECK_OR_RETURN(processor != nullptr) << "Processor is not initialized.";
+    RETURN_IF_ERROR(processor->CheckCanEncode());
+  }
+
+  // The normalizer keeps the user defined symbols as they are.
+  auto user_defined_symbols = [](const SentencePieceProcessor &processor) {
+    std::set<std::string> symbols;
+    for (int id = 0; id < processor.GetPieceSize(); ++id) {
+      if (processor.model_->IsUserDefined(id)) {
+        symbols.insert(processor.IdToPiece(id));
+      }
+    }
+    return symbols;
+  };
+
+  const ModelProto &first = processors[0]->model_proto();
+  const std::string spec = first.normalizer_spec().SerializeAsString();
+  const std::set<std::string> symbols = user_defined_symbols(*processors[0]);
+  for (size_t i = 1; i < processors.size(); ++i) {
+    const ModelProto &model_proto = processors[i]->model_proto();
+    CHECK_OR_RETURN(model_proto.normalizer_spec().SerializeAsString() == spec)
+        << "The normalizer spec of processor " << i
+        << " differs from the one of processor 0.";
+    CHECK_EQ_OR_RETURN(model_proto.trainer_spec().treat_whitespace_as_suffix(),
+                       first.trainer_spec().treat_whitespace_as_suffix())
+        << "The whitespace handling of processor " << i
+        << " differs from the one of processor 0.";
+    CHECK_OR_RETURN(user_defined_symbols(*processors[i]) == symbols)
+        << "The user defined symbols of processor " << i
+        << " differ from the ones of processor 0.";
+  }
+
+  processors_ = processors;
+  if (num_threads > 1 && processors_.size() > 1) {
+    // The calling thread runs models too.
+    pool_ = absl::make_unique<ThreadPool>(
+        std::min<int>(num_threads, processors_.size()) - 1);
+  }
+  return util::OkStatus();
 }
 
-int SentencePieceProcessor::pad_id() const {
-  const int id = PieceToId(absl::string_view(model_->pad_piece().data()));
-  if (IsControl(id)) return id;
-  return -1;
+void MultiModelEncoder::ForEachProcessor(
+    const std::function<void(int64_t)> &fn) const {
+  if (pool_ == nullptr) {
+    for (size_t i = 0; i < processors_.size(); ++i) fn(i);
+    return;
+  }
+  pool_->ParallelFor(processors_.size(), 1, [&](int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) fn(i);
+  });
 }
 
-// static
-util::Status SentencePieceProcessor::ApplyExtraOptions(
-    const std::vector<ExtraOption> &extra_options,
-    SentencePieceText *spt) const {
-  for (const auto &extra_option : extra_options) {
-    switch (extra_option) {
-      case REVERSE:
-        std::reverse(spt->mutable_pieces()->begin(),
-                     spt->mutable_pieces()->end());
-        break;
-      case EOS: {
-        auto *piece = spt->add_pieces();
-        piece->set_id(PieceToId(absl::string_view(model_->eos_piece().data())));
-        piece->set_piece(model_->eos_piece().data(),
-                         model_->eos_piece().size());
-      } break;
-      case BOS: {
-        auto *array = spt->mutable_pieces();
-        array->Add();
-        for (int i = array->size() - 1; i > 0; --i) {
-          array->SwapElements(i - 1, i);
-        }
-        auto *piece = array->Mutable(0);
-        piece->set_id(PieceToId(absl::string_view(model_->bos_piece().data())));
-        piece->set_piece(model_->bos_piece().data(),
-                         model_->bos_piece().size());
-      } break;
-      default:
-        return util::InternalError("unknown extra_option type.");
+util::Status MultiModelEncoder::EncodeIds(
+    absl::string_view input, std::vector<std::vector<int>> *ids) const {
+  CHECK_OR_RETURN(!processors_.empty()) << "Not initialized.";
+  CHECK_OR_RETURN(ids) << "output container is null";
+  ids->clear();
+  ids->resize(processors_.size());
+
+  stats::PhaseTimer timer;
+  std::string normalized;
+  RETURN_IF_ERROR(
+      processors_[0]->normalizer_->Normalize(input, &normalized, nullptr));
+  timer.Lap(stats::kNormalizeNs);
+
+  std::vector<util::Status> status(processors_.size());
+  ForEachProcessor([&](int64_t i) {
+    const SentencePieceProcessor &processor = *processors_[i];
+    auto &output = (*ids)[i];
+    if (processor.max_tokens_ > 0 || processor.encode_cache_ != nullptr) {
+      status[i] = processor.EncodeIds(input, &output);
+      return;
     }
-  }
+    EncodeWorkspace workspace;
+    status[i] = processor.EncodeNormalizedIds(input, normalized, &workspace);
+    if (status[i].ok()) processor.AppendRepeatRuns(workspace.ids, &output);
+  });
 
+  for (const auto &s : status) RETURN_IF_ERROR(s);
   return util::OkStatus();
 }
 
-// static
-util::Status SentencePieceProcessor::ParseExtraOptions(
-    absl::string_view _extra_option,
-    std::vector<SentencePieceProcessor::ExtraOption> *extra_options) const {
-  absl::string_view extra_option(_extra_option.data(), _extra_option.size());
+util::Status MultiModelEncoder::Encode(
+    absl::string_view input, std::vector<SentencePieceText> *spts) const {
+  CHECK_OR_RETURN(!processors_.empty()) << "Not initialized.";
+  CHECK_OR_RETURN(spts) << "output container is null";
+  spts->clear();
+  spts->resize(processors_.size());
 
-  extra_options->clear();
-  if (extra_option.empty()) return util::OkStatus();
+  stats::PhaseTimer timer;
+  std::string normalized;
+  std::vector<uint32> norm_to_orig;
+  RETURN_IF_ERROR(processors_[0]->normalizer_->Normalize(input, &normalized,
+                                                          &norm_to_orig));
+  timer.Lap(stats::kNormalizeNs);
+
+  std::vector<util::Status> status(processors_.size());
+  ForEachProcessor([&](int64_t i) {
+    status[i] = processors_[i]->EncodeNormalized(input, normalized,
+                                                 norm_to_orig, &(*spts)[i]);
+  });
+
+  for (const auto &s : status) RETURN_IF_ERROR(s);
+  return util::OkStatus();
+}
 
-  RETURN_IF_ERROR(status());
+class AsyncEncoder::Impl {
+ public:
+  Impl(const SentencePieceProcessor &processor, int num_threads,
+       int max_batch_size, int64 max_delay_us)
+      : processor_(processor),
+        max_batch_size_(std::max(max_batch_size, 1)),
+        max_delay_(std::max<int64>(max_delay_us, 0)),
+        pool_(absl::make_unique<ThreadPool>(num_threads)),
+        dispatcher_([this]() { Dispatch(); }) {}
+
+  ~Impl() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    dispatcher_.join();
+    pool_.reset();  // waits for the batches.
+  }
 
-  static std::map<absl::string_view, SentencePieceProcessor::ExtraOption>
-      extra_option_map = {{"bos", SentencePieceProcessor::BOS},
-                          {"eos", SentencePieceProcessor::EOS},
-                          {"reverse", SentencePieceProcessor::REVERSE}};
-  for (const auto &s : absl::StrSplit(extra_option, ":")) {
-    const auto it = extra_option_map.find(s);
-    CHECK_OR_RETURN(it != extra_option_map.end())
-        << "option \"" << s << "\" is not available.";
-    extra_options->push_back(it->second);
+  uint64 Add(absl::string_view input, const AsyncEncodeOptions &options,
+             Callback done) {
+    auto request = std::make_shared<Request>();
+    request->input.assign(input.data(), input.size());
+    request->options = options;
+    request->done = std::move(done);
+    request->arrival = Clock::now();
+    uint64 id = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = request->id = next_id_++;
+      queue_.push_back(request);
+      pending_.emplace(id, std::move(request));
+    }
+    cv_.notify_one();
+    return id;
+  }
 
-    if (it->second == SentencePieceProcessor::BOS) {
-      CHECK_OR_RETURN(
-          !IsUnknown(PieceToId(absl::string_view(model_->bos_piece().data()))))
-          << "id for `" << model_->bos_piece() << "` is not defined.";
+  util::Status WarmUp(const WarmUpOptions &options) {
+    // Every task waits until all the workers run one, so that no worker runs
+    // two. Concurrent calls would split the workers, so they take turns.
+    std::lock_guard<std::mutex> warm_up_lock(warm_up_mutex_);
+    const int num_workers = pool_->num_workers();
+    std::mutex mutex;
+    std::condition_variable cv;
+    int started = 0;
+    int finished = 0;
+    std::vector<util::Status> status(num_workers);
+    for (int i = 0; i < num_workers; ++i) {
+      pool_->Schedule([&, i]() {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          ++started;
+          cv.notify_all();
+          cv.wait(lock, [&]() { return started == num_workers; });
+        }
+        status[i] = processor_.WarmUp(options);
+        std::lock_guard<std::mutex> lock(mutex);
+        ++finished;
+        cv.notify_all();
+      });
     }
-    if (it->second == SentencePieceProcessor::EOS) {
-      CHECK_OR_RETURN(
-          !IsUnknown(PieceToId(absl::string_view(model_->eos_piece().data()))))
-          << "id for `" << model_->eos_piece() << "` is not defined.";
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return finished == num_workers; });
+    for (const auto &s : status) RETURN_IF_ERROR(s);
+    return util::OkStatus();
+  }
+
+  bool Cancel(uint64 id) {
+    std::shared_ptr<Request> request;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = pending_.find(id);
+      if (it == pending_.end()) return false;
+      request = std::move(it->second);
+      pending_.erase(it);
     }
+    // The request stays in the queue or its batch, which skip it.
+    request->done(util::CancelledError("The request was cancelled."), {});
+    return true;
   }
-  return util::OkStatus();
-}
 
-void SentencePieceProcessor::SetModel(std::unique_ptr<ModelInterface> &&model) {
-  model_ = std::move(model);
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Request {
+    uint64 id = 0;
+    std::string input;
+    AsyncEncodeOptions options;
+    Callback done;
+    Clock::time_point arrival;
+  };
+  using Batch = std::vector<std::shared_ptr<Request>>;
+
+  // Hands the queued requests to the workers in batches. A batch is sent
+  // when it is full, when its first request has waited for max_delay_, or
+  // at once when the encoder is destroyed.
+  void Dispatch() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) return;
+      if (!stop_ && queue_.size() < static_cast<size_t>(max_batch_size_)) {
+        cv_.wait_until(lock, queue_.front()->arrival + max_delay_, [this]() {
+          return stop_ ||
+                 queue_.size() >= static_cast<size_t>(max_batch_size_);
+        });
+      }
+      auto batch = std::make_shared<Batch>();
+      while (!queue_.empty() &&
+             batch->size() < static_cast<size_t>(max_batch_size_)) {
+        batch->push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+      lock.unlock();
+      pool_->Schedule([this, batch]() { Run(batch.get()); });
+      lock.lock();
+    }
+  }
+
+  void Run(Batch *batch) {
+    {
+      // Claims the requests which are not cancelled.
+      std::lock_guard<std::mutex> lock(mutex_);
+      batch->erase(std::remove_if(batch->begin(), batch->end(),
+                                  [this](const std::shared_ptr<Request> &r) {
+                                    return pending_.erase(r->id) == 0;
+                                  }),
+                   batch->end());
+    }
+    EncodeWorkspace workspace;
+    for (const auto &request : *batch) {
+      workspace.vocabulary = request->options.vocabulary.get();
+      workspace.extra_options = request->options.extra_options.get();
+      std::vector<int> ids;
+      const util::Status status =
+          processor_.EncodeIds(request->input, &ids, &workspace);
+      request->done(status, std::move(ids));
+    }
+  }
+
+  const SentencePieceProcessor &processor_;
+  const int max_batch_size_;
+  const std::chrono::microseconds max_delay_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<Request>> queue_;  // not yet dispatched.
+  // Requests not yet started or cancelled, by id.
+  std::unordered_map<uint64, std::shared_ptr<Request>> pending_;
+  uint64 next_id_ = 1;
+  bool stop_ = false;
+
+  std::mutex warm_up_mutex_;  // held by WarmUp().
+  std::unique_ptr<ThreadPool> pool_;
+  std::thread dispatcher_;  // started last.
+};
+
+AsyncEncoder::AsyncEncoder(const SentencePieceProcessor &processor,
+                           int num_threads, int max_batch_size,
+                           int64_t max_delay_us)
+    : impl_(absl::make_unique<Impl>(processor, num_threads, max_batch_size,
+                                    max_delay_us)) {}
+
+AsyncEncoder::~AsyncEncoder() {}
+
+uint64_t AsyncEncoder::EncodeAsync(absl::string_view input,
+                                   const AsyncEncodeOptions &options,
+                                   Callback done) {
+  return impl_->Add(input, options, std::move(done));
 }
 
-void SentencePieceProcessor::SetNormalizer(
-    std::unique_ptr<normalizer::Normalizer> &&normalizer) {
-  normalizer_ = std::move(normalizer);
+std::future<AsyncEncodeResult> AsyncEncoder::EncodeAsync(
+    absl::string_view input, const AsyncEncodeOptions &options,
+    uint64_t *request_id) {
+  auto promise = std::make_shared<std::promise<AsyncEncodeResult>>();
+  std::future<AsyncEncodeResult> result = promise->get_future();
+  const uint64 id = impl_->Add(
+      input, options, [promise](util::Status status, std::vector<int> ids) {
+        AsyncEncodeResult value;
+        value.status = std::move(status);
+        value.ids = std::move(ids);
+        promise->set_value(std::move(value));
+      });
+  if (request_id != nullptr) *request_id = id;
+  return result;
 }
 
-const ModelProto &SentencePieceProcessor::model_proto() const {
-  return *model_proto_;
+util::Status AsyncEncoder::WarmUp(const WarmUpOptions &options) {
+  return impl_->WarmUp(options);
 }
 
-std::string SentencePieceProcessor::serialized_model_proto() const {
-  return model_proto_ ? model_proto_->SerializeAsString() : "";
+bool AsyncEncoder::Cancel(uint64_t request_id) {
+  return impl_->Cancel(request_id);
 }
 
 namespace io {
@@ -1093,5 +4968,99 @@ util::Status SaveModelProto(absl::string_view filename,
 
   return util::OkStatus();
 }
+
+util::Status SavePrecompiledModel(absl::string_view filename,
+                                  const ModelProto &model_proto,
+                                  bool quantize_scores) {
+  if (filename.empty()) {
+    return util::NotFoundError("model file path should not be empty.");
+  }
+
+  std::string blob;
+  RETURN_IF_ERROR(
+      SerializePrecompiledModel(model_proto, quantize_scores, &blob));
+  auto output = filesystem::NewWritableFile(filename, true);
+  RETURN_IF_ERROR(output->status());
+  CHECK_OR_RETURN(output->Write(blob));
+
+  return util::OkStatus();
+}
+
+util::Status SerializePrecompiledModel(const ModelProto &model_proto,
+                                       bool quantize_scores,
+                                       std::string *blob) {
+  CHECK_OR_RETURN(blob) << "output is null.";
+
+  std::string trie_array;
+  std::string table;
+  int trie_results_size = 0;
+  if (model_proto.trainer_spec().model_type() == TrainerSpec::UNIGRAM) {
+    const unigram::Model model(model_proto);
+    RETURN_IF_ERROR(model.status());
+    const absl::string_view array = model.trie_array();
+    trie_array.assign(array.data(), array.size());
+#ifdef IS_BIG_ENDIAN
+    uint32 *data = reinterpret_cast<uint32 *>(&trie_array[0]);
+    for (size_t i = 0; i < trie_array.size() / 4; ++i)
+      data[i] = util::Swap32(data[i]);
+#endif
+    trie_results_size = model.trie_results_size();
+    if (quantize_scores) table = model.QuantizeTables();
+  } else {
+    CHECK_OR_RETURN(!quantize_scores)
+        << "only unigram models store quantized scores.";
+  }
+
+  const std::string serialized = model_proto.SerializeAsString();
+  const size_t trie_size = trie_array.size();
+  const size_t table_size = table.size();
+  std::string body = std::move(trie_array);
+  body.append(table);
+  body.append(serialized);
+
+  // A model which fails its self-test is still saved, and Load() reports
+  // the failures.
+  uint32 self_test_fingerprint = 0;
+  SentencePieceProcessor sp;
+  if (sp.Load(model_proto).ok()) {
+    self_test_fingerprint = PrecompiledFingerprint(body);
+  }
+
+  if (quantize_scores) {
+    // The quantized scores must not change the segmentation of the
+    // self-test samples.
+    unigram::Model quantized(model_proto);
+    quantized.SetQuantizedTables(table);
+    RETURN_IF_ERROR(quantized.status());
+    normalizer::Normalizer normalizer(model_proto.normalizer_spec(),
+                                      model_proto.trainer_spec());
+    normalizer.SetPrefixMatcher(quantized.prefix_matcher());
+    const unigram::Model original(model_proto);
+    for (const auto &sample : model_proto.self_test_data().samples()) {
+      std::string normalized;
+      RETURN_IF_ERROR(
+          normalizer.Normalize(sample.input(), &normalized, nullptr));
+      CHECK_OR_RETURN(original.Encode(normalized) ==
+                      quantized.Encode(normalized))
+          << "quantized scores change the segmentation of \""
+          << sample.input() << "\".";
+    }
+  }
+
+  std::string header(kPrecompiledModelMagic, 4);
+  EncodeUint32(quantize_scores ? kQuantizedPrecompiledModelVersion
+                               : kPrecompiledModelVersion,
+               &header);
+  EncodeUint32(trie_results_size, &header);
+  EncodeUint32(trie_size, &header);
+  EncodeUint32(serialized.size(), &header);
+  EncodeUint32(self_test_fingerprint, &header);
+  if (quantize_scores) EncodeUint32(table_size, &header);
+
+  *blob = std::move(header);
+  blob->append(body);
+
+  return util::OkStatus();
+}
 }  // namespace io
 }  // namespace sentencepiece
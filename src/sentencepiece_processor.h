@@ -15,7 +15,11 @@
 #ifndef SENTENCEPIECE_PROCESSOR_H_
 #define SENTENCEPIECE_PROCESSOR_H_
 
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <future>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <utility>
@@ -154,15 +158,22 @@ class Status {
 //   }
 //
 
+class BatchViterbiEncoder;
+class EncodeCacheInterface;
 class NBestSentencePieceText;
 class ModelInterface;
 class SentencePieceText;
 class ModelProto;
+class ThreadPool;
 
 namespace normalizer {
 class Normalizer;
 }  // namespace normalizer
 
+namespace filesystem {
+class ReadableFile;
+}  // namespace filesystem
+
 // Defines the multiple versions of encoder within each model. Currently only
 // the Unigram model has an optimized encoder.
 enum class EncoderVersion {
@@ -171,6 +182,47 @@ enum class EncoderVersion {
                // just in case).
 };
 
+// Where SentencePieceProcessor::EncodeBatch() segments the inputs.
+enum class BatchEncodeBackend {
+  kDefault,  // EncodeIds() for every input (default).
+  kHost      // The batch Viterbi on the CPU threads.
+};
+
+// The side SentencePieceProcessor::SetEncodeMaxTokens() truncates.
+enum class TruncationSide {
+  kRight,  // Keeps the first ids (default).
+  kLeft    // Keeps the last ids.
+};
+
+// How SentencePieceProcessor::Load() runs the self-test of a model, which
+// encodes the samples stored in the model and compares them with the pieces
+// they were encoded into at training. The structure of a precompiled model
+// is checked in every mode, as a corrupted trie would be read out of bounds.
+enum class SelfTestMode {
+  kRun,     // Runs the self-test on every load (default).
+  kCached,  // Skips the self-test of a precompiled model which passed it when
+            // io::SavePrecompiledModel() saved it and has not changed since.
+  kSkip     // Never runs the self-test. SelfTest() can run it later.
+};
+
+// What SentencePieceProcessor::Load() builds from a model.
+enum class LoadMode {
+  kFull,        // Encodes and decodes (default).
+  kDecodeOnly,  // Only decodes. The pieces and the decode table are built,
+                // but not the tries of the model and the normalizer, so
+                // loading is faster and takes less memory. Encode methods
+                // return an error.
+};
+
+// A precompiled model compiled into the program as a C++ array, which
+// spm_export_static generates from a model file. See
+// SentencePieceProcessor::LoadStatic().
+struct StaticModel {
+  const char *name;            // the model file it was generated from.
+  const unsigned char *data;   // the bytes of io::SavePrecompiledModel().
+  size_t size;
+};
+
 namespace util {
 // Redefine std::string for serialized_proto interface as Python's string is
 // a Unicode string. We can enforce the return value to be raw byte sequence
@@ -178,6 +230,506 @@ namespace util {
 using bytes = std::string;
 }  // namespace util
 
+// An immutable vocabulary restriction made by
+// SentencePieceProcessor::MakeVocabularyMask(). Encoders do not emit the
+// pieces marked as unused and may emit all the others. A mask can be shared
+// by threads, so callers with different vocabularies can share one
+// SentencePieceProcessor by passing their masks in EncodeWorkspace.
+class VocabularyMask {
+ public:
+  // Returns true if the piece `id` is out of the vocabulary.
+  bool IsUnused(int id) const { return unused_[id]; }
+
+  // Returns the number of pieces of the model the mask was made for.
+  int size() const { return static_cast<int>(unused_.size()); }
+
+ private:
+  friend class SentencePieceProcessor;
+  friend class ModelInterface;
+  std::vector<bool> unused_;
+
+  // What the model `model_` precomputed for this mask with
+  // ModelInterface::MakeVocabularyData(), or nullptr.
+  std::shared_ptr<const void> model_data_;
+  const void *model_ = nullptr;
+};
+
+class ExtraOptions;
+
+// A piece of SentencePieceProcessor::EncodePieces(), laid out as
+// SentencePieceText::SentencePiece but referring to the strings it was made
+// from instead of copying them.
+struct EncodedPiece {
+  absl::string_view piece;    // into the model or EncodeWorkspace.
+  int id = 0;
+  absl::string_view surface;  // into the input.
+  size_t begin = 0;           // byte offsets of `surface` in the input.
+  size_t end = 0;
+};
+
+// A piece output by the model as the byte range of the normalized input it
+// covers, in half the size of a (string_view, id) pair.
+struct CompactPiece {
+  uint32_t begin;
+  uint32_t length;  // 0 for control symbols, which cover no input.
+  int id;
+};
+
+// N-best hypotheses of ids stored as a prefix tree, as output by
+// SentencePieceProcessor::NBestEncode(). A hypothesis only stores the ids
+// following the longest prefix it shares with an earlier hypothesis, so the
+// hypotheses of one input, which mostly differ in a few pieces, take about
+// the space of the longest one. The hypotheses are read through views,
+// without copying their ids.
+class NBestIds {
+ public:
+  // Iterates the ids of one hypothesis, first to last.
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = int;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const int *;
+    using reference = const int &;
+
+    reference operator*() const { return nbest_->ids_[index_]; }
+    Iterator &operator++() {
+      if (++pos_ == run_end_) {
+        nbest_->Seek(hypothesis_, pos_, &index_, &run_end_);
+      } else {
+        ++index_;
+      }
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator it = *this;
+      ++*this;
+      return it;
+    }
+    bool operator==(const Iterator &other) const { return pos_ == other.pos_; }
+    bool operator!=(const Iterator &other) const { return pos_ != other.pos_; }
+
+   private:
+    friend class NBestIds;
+    Iterator(const NBestIds *nbest, int hypothesis, int pos)
+        : nbest_(nbest), hypothesis_(hypothesis), pos_(pos) {
+      nbest_->Seek(hypothesis_, pos_, &index_, &run_end_);
+    }
+
+    const NBestIds *nbest_;
+    int hypothesis_;
+    int pos_;            // in the hypothesis.
+    int index_ = 0;      // of the id at pos_ in ids_.
+    int run_end_ = 0;    // pos of the end of the run of ids_ at index_.
+  };
+
+  // A view of one hypothesis, valid until the NBestIds is modified.
+  class Hypothesis {
+   public:
+    Iterator begin() const { return Iterator(nbest_, index_, 0); }
+    Iterator end() const { return Iterator(nbest_, index_, size()); }
+    int size() const { return nbest_->hypotheses_[index_].size; }
+    float score() const { return nbest_->hypotheses_[index_].score; }
+    std::vector<int> ToVector() const {
+      return std::vector<int>(begin(), end());
+    }
+
+   private:
+    friend class NBestIds;
+    Hypothesis(const NBestIds *nbest, int index)
+        : nbest_(nbest), index_(index) {}
+
+    const NBestIds *nbest_;
+    int index_;
+  };
+
+  // Returns the number of hypotheses.
+  size_t size() const { return hypotheses_.size(); }
+  bool empty() const { return hypotheses_.empty(); }
+
+  // Returns the i-th best hypothesis.
+  Hypothesis operator[](size_t i) const {
+    return Hypothesis(this, static_cast<int>(i));
+  }
+
+  // Returns the number of ids actually stored for all the hypotheses.
+  size_t num_stored_ids() const { return ids_.size(); }
+
+  // Appends a hypothesis.
+  void Add(const std::vector<int> &ids, float score);
+
+  // Removes all hypotheses and keeps the buffers.
+  void Clear();
+
+ private:
+  struct Entry {
+    int parent;      // the hypothesis sharing the first `shared` ids.
+    int shared;
+    int tail_begin;  // of the following ids in ids_.
+    int size;
+    float score;
+  };
+
+  // Sets the index in ids_ of the id at `pos` of `hypothesis` and the pos of
+  // the end of the run of ids_ it starts.
+  void Seek(int hypothesis, int pos, int *index, int *run_end) const;
+
+  std::vector<Entry> hypotheses_;
+  std::vector<int> ids_;
+
+  // The prefix tree over ids_: the first child and the next sibling of every
+  // id, -1 if none, and the hypothesis which added it.
+  std::vector<int> first_child_;
+  std::vector<int> next_sibling_;
+  std::vector<int> owner_;
+  int root_child_ = -1;
+};
+
+// Contents of a flat result, a binary alternative to a serialized
+// SentencePieceText that is read in place. All integers are little-endian
+// uint32, so all arrays are 4-byte aligned when the buffer is:
+//
+//   "SPFR", version (1), flags, num_rows, num_ids, pool_size,
+//   row_offsets[num_rows + 1]  the ids of row r are [row_offsets[r],
+//                              row_offsets[r + 1]),
+//   ids[num_ids],
+//   begins[num_ids], ends[num_ids]  if flags & kFlatResultOffsets, the byte
+//                                   range of every id in its input,
+//   piece_offsets[num_ids + 1], pool[pool_size]  if flags &
+//                                   kFlatResultPieces, the piece of every id.
+//
+// A row holds the ids of one input, or of one hypothesis for n-best results.
+enum FlatResultFlags : uint32_t {
+  kFlatResultOffsets = 1,
+  kFlatResultPieces = 2,
+};
+
+// Reads a flat result in place. The view does not own the buffer, which
+// Init() does not copy. Init() only checks the sizes and the offsets, so
+// that the accessors can read the arrays without checks.
+class FlatResultView {
+ public:
+  static constexpr char kMagic[] = "SPFR";
+  static constexpr uint32_t kVersion = 1;
+  static constexpr size_t kHeaderSize = 24;
+
+  // Points the view to `data`. Fails if `data` is not a flat result of a
+  // known version or is truncated.
+  util::Status Init(absl::string_view data);
+
+  // Returns the bytes of the flat result, which may be followed by others in
+  // the buffer given to Init().
+  absl::string_view data() const { return data_; }
+
+  uint32_t flags() const { return flags_; }
+  bool has_offsets() const { return flags_ & kFlatResultOffsets; }
+  bool has_pieces() const { return flags_ & kFlatResultPieces; }
+  size_t num_rows() const { return num_rows_; }
+  size_t num_ids() const { return num_ids_; }
+
+  // The ids of row `r` are id(row_begin(r)) ... id(row_end(r) - 1).
+  size_t row_begin(size_t r) const { return Get(row_offsets_, r); }
+  size_t row_end(size_t r) const { return Get(row_offsets_, r + 1); }
+
+  int id(size_t i) const { return static_cast<int>(Get(ids_, i)); }
+
+  // Require has_offsets().
+  size_t begin(size_t i) const { return Get(begins_, i); }
+  size_t end(size_t i) const { return Get(ends_, i); }
+
+  // Requires has_pieces().
+  absl::string_view piece(size_t i) const {
+    const size_t offset = Get(piece_offsets_, i);
+    return absl::string_view(pool_ + offset,
+                             Get(piece_offsets_, i + 1) - offset);
+  }
+
+  // The raw little-endian arrays, which a little-endian host can use as
+  // uint32_t arrays when the buffer is aligned.
+  const char *ids_data() const { return ids_; }
+  const char *row_offsets_data() const { return row_offsets_; }
+
+ private:
+  static uint32_t Get(const char *array, size_t i) {
+    const unsigned char *p =
+        reinterpret_cast<const unsigned char *>(array + 4 * i);
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+           static_cast<uint32_t>(p[2]) << 16 |
+           static_cast<uint32_t>(p[3]) << 24;
+  }
+
+  absl::string_view data_;
+  uint32_t flags_ = 0;
+  size_t num_rows_ = 0;
+  size_t num_ids_ = 0;
+  const char *row_offsets_ = nullptr;
+  const char *ids_ = nullptr;
+  const char *begins_ = nullptr;
+  const char *ends_ = nullptr;
+  const char *piece_offsets_ = nullptr;
+  const char *pool_ = nullptr;
+};
+
+// Caller-owned scratch buffers for SentencePieceProcessor::EncodeIds().
+// Reusing one workspace across calls keeps its buffers allocated, so that
+// once they have grown to the input size, EncodeIds() into a reused output
+// vector does no heap allocation with the unigram and BPE models. A workspace
+// must not be used by multiple threads at the same time.
+struct EncodeWorkspace {
+  std::string normalized;
+  std::vector<std::pair<absl::string_view, int>> pieces;  // into `normalized`.
+  std::vector<CompactPiece> compact_pieces;  // ranges of `normalized`.
+  std::string collapsed;  // `normalized` with shortened repeat runs.
+  std::vector<CompactPiece> collapsed_pieces;  // ranges of `collapsed`.
+  std::vector<int> ids;  // before run-length encoding.
+  std::vector<int> chunk_ids;  // of a chunk of a long input.
+  std::vector<uint32_t> norm_to_orig;  // alignment of `normalized`.
+  std::vector<EncodedPiece> raw_pieces;  // before run-length encoding.
+
+  // Output of SentencePieceProcessor::EncodePieceViews().
+  std::vector<EncodedPiece> piece_views;
+
+  // Vocabulary restriction of the calls using this workspace. Overrides
+  // SetVocabulary() when not nullptr. Not owned.
+  const VocabularyMask *vocabulary = nullptr;
+
+  // Extra options of the calls using this workspace. Override
+  // SetEncodeExtraOptions() when not nullptr. Not owned.
+  const ExtraOptions *extra_options = nullptr;
+};
+
+// Counters of the encoder hot path, summed over all threads of the process.
+// They are only collected when the library is built with SPM_ENABLE_STATS,
+// and are all zero otherwise. The counters only grow, so the cost of a
+// section of code is the difference of two snapshots. Times are in
+// nanoseconds.
+struct EncodeStats {
+  bool enabled = false;          // true if built with SPM_ENABLE_STATS.
+  uint64_t num_calls = 0;        // Encode(), EncodeIds() and EncodePieces().
+  uint64_t normalize_ns = 0;     // normalization, including case encoding.
+  uint64_t case_encode_ns = 0;   // Normalize() with case encoding.
+  uint64_t model_encode_ns = 0;  // segmentation by the model.
+  uint64_t rle_ns = 0;           // run-length encoding of the outputs.
+  uint64_t proto_ns = 0;         // building of the pieces, ids or proto.
+  uint64_t bytes_in = 0;         // bytes of the inputs.
+  uint64_t bytes_out = 0;        // bytes of the normalized inputs.
+  uint64_t tokens_out = 0;       // pieces segmented by the model.
+  uint64_t lattice_nodes = 0;    // nodes of the unigram lattices.
+  uint64_t cache_hits = 0;       // EncodeIds() answered by the encode cache.
+  uint64_t cache_misses = 0;     // EncodeIds() not found in the encode cache.
+  // Probability mass dropped by SetSampleBeam(), in parts per billion,
+  // summed over the sampled inputs.
+  uint64_t sample_pruned_mass_ppb = 0;
+};
+
+// Estimated bytes of memory a loaded model holds, broken down by component,
+// as returned by SentencePieceProcessor::GetMemoryUsage(). Containers are
+// counted at their capacity. A precompiled model file used in place is
+// counted in `mapped_file` only, and not again in the tables pointing into
+// it. A model shared by several processors is counted in full by each.
+struct MemoryUsage {
+  uint64_t mapped_file = 0;      // precompiled model file used in place.
+  uint64_t model_proto = 0;      // ModelProto, estimated by its encoded size.
+  uint64_t piece_maps = 0;       // piece -> id maps and merge rules.
+  uint64_t score_tables = 0;     // scores, types and byte piece tables.
+  uint64_t model_tries = 0;      // tries of the pieces built by the model.
+  uint64_t prefix_matcher = 0;   // trie of the user defined symbols.
+  uint64_t normalizers = 0;      // tries of the normalizer and denormalizer.
+  uint64_t decode_table = 0;     // surfaces of the pieces for Decode().
+  uint64_t encode_cache = 0;     // entries of SetEncodeCacheSize(), or the
+                                 // table of SetSharedEncodeCache().
+  uint64_t thread_buffers = 0;   // lattices, word caches and workspace of
+                                 // this thread.
+
+  uint64_t total() const {
+    return mapped_file + model_proto + piece_maps + score_tables +
+           model_tries + prefix_matcher + normalizers + decode_table +
+           encode_cache + thread_buffers;
+  }
+};
+
+// Options of SentencePieceProcessor::WarmUp().
+struct WarmUpOptions {
+  // The bytes of the longest synthetic input encoded, which should be about
+  // the longest input expected, so that the buffers are grown to its size.
+  int max_input_length = 4096;
+
+  // The number of synthetic inputs, of lengths up to max_input_length.
+  int num_encodes = 4;
+
+  // Reads every page of a precompiled model file used in place, which is
+  // otherwise read in by the first encodes.
+  bool populate = true;
+
+  // Also locks these pages in memory with mlock(), so that they are never
+  // paged out. Needs the permission to lock that much memory.
+  bool lock_memory = false;
+
+  // A workspace grown by the synthetic encodes of the calling thread instead
+  // of its own one, e.g., the one the thread passes to EncodeIds(). Not
+  // owned.
+  EncodeWorkspace *workspace = nullptr;
+
+  // Also warms up every worker of the pool the batch methods run on, grown
+  // to num_threads - 1 workers first. Should be the largest num_threads the
+  // batch methods are called with.
+  int num_threads = 1;
+};
+
+// Stages of the encode and decode calls reported to a Tracer. The stages of
+// one call follow each other, except kCaseEncode, which is the part of
+// kNormalize that encodes the case.
+enum class TraceStage {
+  kNormalize,    // normalization of the input.
+  kCaseEncode,   // case encoding within the normalization.
+  kSegment,      // segmentation by the model.
+  kBuildOutput,  // ids, pieces or proto built from the segmentation.
+  kRle,          // run-length encoding of the output.
+  kDecode,       // Decode() of ids or pieces.
+};
+
+// Returns the name of `stage`, e.g., "normalize".
+const char *TraceStageName(TraceStage stage);
+
+// A stage of a traced call. Times are nanoseconds of the steady clock.
+struct TraceEvent {
+  TraceStage stage = TraceStage::kNormalize;
+  uint64_t request_id = 0;  // unique to the call in the process.
+  int64_t begin_ns = 0;
+  int64_t end_ns = 0;
+  size_t input_bytes = 0;  // of the input text, ids or pieces of the call.
+  size_t num_tokens = 0;   // output by the stage, or 0 if not counted.
+};
+
+// Receives the stages of the encode and decode calls of the processors it is
+// set on with SentencePieceProcessor::SetTracer(). A call is one request:
+// the calls it makes itself belong to it. Requests are sampled, and every
+// stage of a sampled request is reported. OnEvent() is called by the threads
+// making the calls, possibly concurrently.
+//
+//   auto tracer = std::make_shared<ChromeTraceWriter>(0.01);
+//   sp.SetTracer(tracer);
+//   ...
+//   CHECK_OK(tracer->WriteFile("/tmp/encode_trace.json"));
+class Tracer {
+ public:
+  // Samples a request with probability `sample_rate`.
+  explicit Tracer(double sample_rate = 1.0);
+  virtual ~Tracer();
+
+  // Returns true if the request `request_id` is traced. The default
+  // decision is a hash of `request_id`, so that it is the same in every
+  // thread and process.
+  virtual bool ShouldTrace(uint64_t request_id) const;
+
+  virtual void OnEvent(const TraceEvent &event) = 0;
+
+ private:
+  uint64_t threshold_;  // of the hashes of the sampled requests.
+};
+
+// Collects the events in memory and writes them in the Chrome trace event
+// JSON format, which chrome://tracing and Perfetto open. Every stage is a
+// complete ("X") event on the thread which made the call.
+class ChromeTraceWriter : public Tracer {
+ public:
+  explicit ChromeTraceWriter(double sample_rate = 1.0);
+  ~ChromeTraceWriter() override;
+
+  void OnEvent(const TraceEvent &event) override;
+
+  // Returns the events collected so far as a JSON object.
+  std::string ToJson() const;
+
+  // Writes ToJson() to `filename`.
+  util::Status WriteFile(absl::string_view filename) const;
+
+  // Drops the events collected so far.
+  void Clear();
+
+ private:
+  struct Rep;
+  std::unique_ptr<Rep> rep_;
+};
+
+// A loaded model with its normalizers. A CompiledModel is immutable, so one
+// instance can be shared by any number of SentencePieceProcessors and
+// threads, each processor keeping its own extra options. Per-call state
+// lives in EncodeWorkspace.
+//
+//   std::shared_ptr<const CompiledModel> model;
+//   CHECK_OK(CompiledModel::Load("//path/to/model", &model));
+//   SentencePieceProcessor sp1, sp2;
+//   CHECK_OK(sp1.Load(model));
+//   CHECK_OK(sp2.Load(model));
+class CompiledModel {
+ public:
+  ~CompiledModel();
+
+  // Loads the model in `filename` as SentencePieceProcessor::Load() does.
+  static util::Status Load(absl::string_view filename,
+                           std::shared_ptr<const CompiledModel> *model);
+
+  // Loads `model_proto`, which is moved.
+  static util::Status Load(std::unique_ptr<ModelProto> model_proto,
+                           std::shared_ptr<const CompiledModel> *model);
+
+  // Extends `base` with `user_defined_symbols`, which take the ids from the
+  // piece size of `base` on. The pieces and the tries of `base` are shared,
+  // so that only the new symbols are compiled. The symbols must not be in
+  // `base` already. `base` is kept alive by the extended model, whose
+  // model_proto() is the one of `base` without the new symbols.
+  static util::Status Extend(
+      std::shared_ptr<const CompiledModel> base,
+      const std::vector<std::string> &user_defined_symbols,
+      std::shared_ptr<const CompiledModel> *model);
+
+  const ModelProto &model_proto() const;
+
+ private:
+  friend class SentencePieceProcessor;
+  friend class StreamingEncoder;
+  friend class IncrementalEncoder;
+
+  CompiledModel();
+
+  // Surfaces of the pieces used by Decode(ids), defined in the .cc file.
+  struct DecodeTable;
+
+  // Adds the memory of this model, and of the model it extends, to `usage`.
+  void AddMemoryUsage(MemoryUsage *usage) const;
+
+  // Reads, and locks with `lock`, the pages of the precompiled model files
+  // of this model and of the model it extends.
+  util::Status PrefaultModelFiles(bool lock) const;
+
+  // Members are destroyed in the reverse order, so the model and the
+  // normalizers go before the proto and the file they refer to.
+  std::unique_ptr<filesystem::ReadableFile> model_file_;
+  std::string precompiled_model_file_;  // the name of `model_file_`.
+  absl::string_view model_file_data_;   // the bytes of `model_file_`.
+
+  // The model extended by Extend(), or nullptr. Its proto is used when
+  // `model_proto_` is nullptr.
+  std::shared_ptr<const CompiledModel> base_;
+
+  std::unique_ptr<ModelProto> model_proto_;
+  std::unique_ptr<ModelInterface> model_;
+  std::unique_ptr<normalizer::Normalizer> normalizer_;
+  std::unique_ptr<normalizer::Normalizer> denormalizer_;
+  std::unique_ptr<const DecodeTable> decode_table_;  // nullptr if not built.
+
+  // True if texts can be cut between words and encoded independently, as
+  // StreamingEncoder describes.
+  bool has_word_boundaries_ = false;
+
+  // True if loaded with LoadMode::kDecodeOnly, which has no normalizer.
+  bool decode_only_ = false;
+};
+
+class StreamingDecoder;
+class StreamingEncoder;
+
 class SentencePieceProcessor {
  public:
   SentencePieceProcessor();
@@ -203,6 +755,16 @@ class SentencePieceProcessor {
   // Useful to load the model from a platform independent blob object.
   virtual util::Status LoadFromSerializedProto(absl::string_view serialized);
 
+  // Loads the model compiled into the program as `model`. The trie and the
+  // quantized tables are used in place, so `model.data` must outlive this
+  // instance and be aligned to 4 bytes, as spm_export_static generates it.
+  virtual util::Status LoadStatic(const StaticModel &model);
+
+  // Uses `model`, which may be shared with other processors. Functions that
+  // change the model, e.g., SetVocabulary(), fail on a shared model; pass a
+  // VocabularyMask in EncodeWorkspace instead.
+  virtual util::Status Load(std::shared_ptr<const CompiledModel> model);
+
   // Returns the status. Encode/Decode methods are valid when status is OK.
   virtual util::Status status() const;
 
@@ -212,6 +774,83 @@ class SentencePieceProcessor {
   // Sets decode extra_option sequence.
   virtual util::Status SetDecodeExtraOptions(absl::string_view extra_option);
 
+  // Parses `extra_option` as SetEncodeExtraOptions() does, without changing
+  // this processor. EncodeIds() uses the options when they are passed in
+  // EncodeWorkspace::extra_options, and Decode(ids, extra_options, ...) when
+  // they are passed to it.
+  virtual util::Status MakeExtraOptions(
+      absl::string_view extra_option,
+      std::shared_ptr<const ExtraOptions> *extra_options) const;
+
+  // Caches the ids EncodeIds(), Encode(input, ids) and EncodeBatch() return
+  // for repeated inputs in about `max_bytes` bytes, evicting the least
+  // recently used inputs. 0 disables the cache. Sampling, NBest and inputs
+  // encoded with EncodeWorkspace::vocabulary bypass the cache. The cache is
+  // cleared when the model or the encode options change. Must not be called
+  // while other threads are encoding with this processor.
+  virtual util::Status SetEncodeCacheSize(size_t max_bytes);
+
+  // Same as SetEncodeCacheSize(), but keeps the ids in the table `name` of
+  // about `max_bytes` bytes in shared memory, which all the processes
+  // attaching `name` use, e.g., the worker processes of a data loader. `name`
+  // is a file name in /dev/shm or a path, and is created if it does not
+  // exist, readable and writable only by the user. A table of another user
+  // or writable by others is rejected. The entries are keyed by the model
+  // and the encode options, so the processes may encode with other models.
+  // The processor must load its model rather than take one from SetModel()
+  // or SetNormalizer(). An empty `name` disables the cache. Not supported on
+  // Windows.
+  virtual util::Status SetSharedEncodeCache(absl::string_view name,
+                                            size_t max_bytes);
+
+  // Makes the decode methods and StreamingDecoder fail with kOutOfRange on
+  // a repeat run of more than `max_count` pieces instead of expanding it,
+  // so that a few untrusted ids cannot expand into a huge output. The
+  // default is 2^20, the count of the largest count piece.
+  virtual util::Status SetDecodeMaxRepeatCount(int max_count);
+
+  // Makes the decode methods fail with kOutOfRange when the repeat runs of
+  // one call expand into more than `max_expansion` pieces besides the first
+  // pieces of the runs. Unlimited by default. StreamingDecoder, which
+  // decodes an unbounded stream, only checks SetDecodeMaxRepeatCount().
+  virtual util::Status SetDecodeMaxExpansion(int64_t max_expansion);
+
+  // Truncates the ids EncodeIds(), Encode(input, ids) and EncodeBatch()
+  // return to at most `max_tokens` ids, counting the bos/eos ids and the ids
+  // of the repeat runs. The text keeps its longest prefix, or suffix with
+  // kLeft, whose ids fit, and a repeat run is shortened to fit. When the
+  // text can be cut between words as for StreamingEncoder, only about as
+  // much of the input is normalized and segmented as the kept ids need.
+  // 0 disables the truncation.
+  virtual util::Status SetEncodeMaxTokens(
+      int max_tokens, TruncationSide side = TruncationSide::kRight);
+
+  // Makes EncodeIds(), Encode(input, ids) and Encode(input, spt) encode an
+  // input of more than 64 KB on `num_threads` threads when the model allows
+  // cutting texts between words as StreamingEncoder describes. The input is
+  // cut between words into chunks, which are normalized and segmented in
+  // parallel, and their ids and alignments are joined in order. The ids are
+  // the same as with 1 thread, the default, which encodes the same chunks.
+  // Encode(input, spt) with 1 thread segments the whole text instead, so
+  // the pieces may differ where two segmentations have the same score, as
+  // VerifyOutputsEquivalent() allows. Encode(input, spt) of a model
+  // encoding the case stays on one thread.
+  virtual util::Status SetEncodeNumThreads(int num_threads);
+
+  // Makes EncodeBatch(inputs, ids, num_threads) and EncodeBatch(inputs, ids,
+  // offsets, num_threads) segment the normalized inputs of a batch all at
+  // once on `backend`. The ids are the same as with kDefault. Only the
+  // optimized unigram encoder has a batch backend: the other models, the
+  // inputs long enough to be encoded in chunks and the truncated ids are
+  // encoded as with kDefault, and the encode cache is not used. Fails if
+  // the model does not support `backend`. Must not be called while other
+  // threads are encoding with this processor.
+  virtual util::Status SetBatchEncodeBackend(BatchEncodeBackend backend);
+
+  BatchEncodeBackend batch_encode_backend() const {
+    return batch_encode_backend_;
+  }
+
   //////////////////////////////////////////////////////////////
   // Vocabulary restriction.
   // Background:
@@ -219,27 +858,43 @@ class SentencePieceProcessor {
 
   // Restricts the vocabulary set.
   // The input sentences are encoded into the tokens in `valid_vocab`.
+  // Must not be called while other threads are encoding with this processor.
   virtual util::Status SetVocabulary(
       const std::vector<std::string> &valid_vocab);
 
   // Reverts the vocabulary restriction.
   virtual util::Status ResetVocabulary();
 
+  // Makes the restriction SetVocabulary(valid_vocab) would set, without
+  // changing this processor. EncodeIds() uses it when it is passed in
+  // EncodeWorkspace::vocabulary.
+  virtual util::Status MakeVocabularyMask(
+      const std::vector<std::string> &valid_vocab,
+      std::shared_ptr<const VocabularyMask> *mask) const;
+
   // Loads the valid vocabulary set from `filename` in TSV format.
   // Format:  <token> <tab> <freq>.
   // Any token with frequency < threshold will be treated as OOV.
+  // The file may also be in the binary format of
+  // SerializeVocabularyCounts(), in which tokens with frequency 0 are OOV
+  // too.
   virtual util::Status LoadVocabulary(absl::string_view filename,
                                       int threshold);
 
+  // Serializes `counts`, the frequency of every piece id of this model, to
+  // `output` in a binary format read by LoadVocabulary() without parsing
+  // the pieces. Fails unless there is one count per piece.
+  virtual util::Status SerializeVocabularyCounts(
+      const std::vector<uint64_t> &counts, std::string *output) const;
+
   //////////////////////////////////////////////////////////////
   // Simple API.
   //
   // Given a UTF8 input, encodes it into a sequence of sentence pieces.
-
-  // RLE Helper Functions
-  virtual std::vector<int> _expand_from_ids(const std::vector<int> ids) const;
-  virtual std::vector<int> expand_from_ids(const std::vector<int> ids) const;
-
+  // A run of n > 1 identical pieces is emitted as the piece followed by
+  // "(#startrepeat)", the decimal digits of n and "(#endrepeat)", or, when
+  // the model was trained with --compact_repeat_counts, by the "<rep:k>"
+  // pieces whose k add up to n - 1. Decode() expands these runs again.
   virtual util::Status Encode(absl::string_view input,
                               std::vector<std::string> *pieces) const;
 
@@ -247,6 +902,136 @@ class SentencePieceProcessor {
   virtual util::Status Encode(absl::string_view input,
                               std::vector<int> *ids) const;
 
+  // Same as Encode(input, ids), but builds no SentencePieceText and keeps
+  // its intermediate buffers in `workspace` when given, or in a workspace of
+  // the calling thread otherwise.
+  virtual util::Status EncodeIds(absl::string_view input,
+                                 std::vector<int> *ids,
+                                 EncodeWorkspace *workspace = nullptr) const;
+
+  // Stores in `num_tokens` the number of ids EncodeIds(input) returns,
+  // counting the repeat markers of every run, without storing the ids. A
+  // hit in the encode cache answers without encoding; a miss does not fill
+  // the cache.
+  virtual util::Status CountTokens(absl::string_view input,
+                                   size_t *num_tokens,
+                                   EncodeWorkspace *workspace = nullptr) const;
+
+  // Same as CountTokens() for every element of `inputs` using up to
+  // `num_threads` threads.
+  virtual util::Status CountTokensBatch(
+      const std::vector<absl::string_view> &inputs,
+      std::vector<size_t> *num_tokens, int num_threads) const;
+
+  // Same as Encode(input, pieces), but also stores the id of every piece in
+  // `ids` and leaves (*pieces)[i] empty where it is IdToPiece((*ids)[i]),
+  // so that language bindings can share one string object per id. Only
+  // merged unknown pieces and repeat markers outside of the vocab keep
+  // their text. SampleEncodePiecesWithIds() and NBestEncodePiecesWithIds()
+  // do the same for SampleEncode() and NBestEncode().
+  virtual util::Status EncodePiecesWithIds(
+      absl::string_view input, std::vector<int> *ids,
+      std::vector<std::string> *pieces) const;
+  virtual util::Status SampleEncodePiecesWithIds(
+      absl::string_view input, int nbest_size, float alpha,
+      std::vector<int> *ids, std::vector<std::string> *pieces) const;
+  virtual util::Status NBestEncodePiecesWithIds(
+      absl::string_view input, int nbest_size,
+      std::vector<std::vector<int>> *ids,
+      std::vector<std::vector<std::string>> *pieces) const;
+
+  // Encodes `normalized`, a text this processor's normalizer already made,
+  // e.g. cached by an earlier stage or output by spm_normalize with the same
+  // NormalizerSpec, without normalizing it again. Whitespace must be escaped
+  // as U+2581 as the normalizer does. The ids are those of EncodeIds() of the
+  // original input. Fails when SetEncodeMaxTokens() is set, since the
+  // truncation encodes prefixes of the original input, and the encode cache
+  // is not used.
+  virtual util::Status EncodePreNormalized(absl::string_view normalized,
+                                           std::vector<int> *ids) const;
+
+  // Same as above, but fills `spt` as Encode(input, spt) does. The surfaces
+  // and the text are those of `normalized`.
+  virtual util::Status EncodePreNormalized(absl::string_view normalized,
+                                           SentencePieceText *spt) const;
+
+  // Same as above, but the surfaces and the text are taken from the original
+  // `input` through `norm_to_orig`, the alignment the normalizer output with
+  // `normalized`: the byte offset in `input` of every byte of `normalized`
+  // and of its end.
+  virtual util::Status EncodePreNormalized(
+      absl::string_view input, absl::string_view normalized,
+      const std::vector<uint32_t> &norm_to_orig,
+      SentencePieceText *spt) const;
+
+  // Makes EncodePreNormalized() check its input, for debugging the stages
+  // that produce it. `normalized` must be valid UTF-8 and, when whitespace
+  // is escaped, have no ASCII space. With the original input, it must also
+  // be the normalization of `input` with the same alignment, which costs as
+  // much as normalizing again.
+  virtual util::Status SetCheckPreNormalized(bool check);
+
+  // Encodes every element of `inputs` into a sequence of ids using up to
+  // `num_threads` threads. (*ids)[i] holds the result of EncodeIds(inputs[i]).
+  // Returns the first error, in input order, if any input failed. The batch
+  // methods run on the calling thread and on the workers of a pool shared by
+  // all processors, which outlive the calls, so that the lattices and buffers
+  // the workers keep are reused from batch to batch.
+  virtual util::Status EncodeBatch(const std::vector<absl::string_view> &inputs,
+                                   std::vector<std::vector<int>> *ids,
+                                   int num_threads) const;
+
+  // Same as EncodeBatch(inputs, ids, num_threads), but stores all ids in one
+  // flat buffer. The ids of inputs[i] are (*ids)[(*offsets)[i]] ...
+  // (*ids)[(*offsets)[i + 1] - 1], and `offsets` has inputs.size() + 1
+  // elements.
+  virtual util::Status EncodeBatch(const std::vector<absl::string_view> &inputs,
+                                   std::vector<int> *ids,
+                                   std::vector<size_t> *offsets,
+                                   int num_threads) const;
+
+  // Same as EncodeBatch(inputs, ids, offsets, num_threads), but also stores
+  // the byte offsets in inputs[i] of the surface of every id in `begins` and
+  // `ends` when they are not nullptr, laid out as `ids`. The first id of a
+  // repeat run spans the surfaces of the whole run, and the markers of the
+  // run are empty at its end. The bos/eos ids are empty at 0 as in
+  // EncodePieces().
+  virtual util::Status EncodeBatch(const std::vector<absl::string_view> &inputs,
+                                   std::vector<int> *ids,
+                                   std::vector<size_t> *offsets,
+                                   std::vector<size_t> *begins,
+                                   std::vector<size_t> *ends,
+                                   int num_threads) const;
+
+  // Encodes every element of `inputs` into row i of `ids`, a row-major
+  // [inputs.size(), max_length] array allocated by the caller, so that a
+  // dense tensor can wrap it without a copy. Row i holds the ids
+  // EncodeIds(inputs[i]) returns followed by pad_id(), which is -1 if the
+  // model has no pad piece, and lengths[i] the number of these ids.
+  // `begins` and `ends`, arrays of the shape of `ids`, receive the byte
+  // offsets as in EncodeBatch(inputs, ids, offsets, begins, ends, ...), with
+  // 0 for the padding. Any of `lengths`, `begins` and `ends` may be nullptr.
+  // Returns kOutOfRange if an input has more than `max_length` ids;
+  // SetEncodeMaxTokens(max_length) truncates them instead.
+  virtual util::Status EncodeBatchPadded(
+      const std::vector<absl::string_view> &inputs, size_t max_length,
+      int *ids, size_t *lengths, size_t *begins, size_t *ends,
+      int num_threads) const;
+
+  // Same as EncodeBatch(inputs, ids, offsets, num_threads), but also groups
+  // the inputs into batches of similar lengths whose padded size, i.e., the
+  // number of inputs times the most ids of them, is at most `max_tokens`.
+  // `order` lists the indices of the inputs by increasing number of ids,
+  // and batch b holds the inputs order[(*batch_offsets)[b]] ...
+  // order[(*batch_offsets)[b + 1] - 1]. An input with more than
+  // `max_tokens` ids makes a batch of its own. Inputs without ids count as
+  // one token.
+  virtual util::Status EncodeBatchBucketed(
+      const std::vector<absl::string_view> &inputs, size_t max_tokens,
+      std::vector<int> *ids, std::vector<size_t> *offsets,
+      std::vector<size_t> *order, std::vector<size_t> *batch_offsets,
+      int num_threads) const;
+
   // Given a sequence of pieces, decodes it into a detokenized output.
   virtual util::Status Decode(const std::vector<std::string> &pieces,
                               std::string *detokenized) const;
@@ -255,6 +1040,30 @@ class SentencePieceProcessor {
   virtual util::Status Decode(const std::vector<int> &ids,
                               std::string *detokenized) const;
 
+  // Same as above, but applies `extra_options` instead of the ones set by
+  // SetDecodeExtraOptions() when it is not nullptr.
+  virtual util::Status Decode(const std::vector<int> &ids,
+                              const ExtraOptions *extra_options,
+                              std::string *detokenized) const;
+
+  // Decodes the flat buffer of EncodeBatch(inputs, ids, offsets, ...) using
+  // up to `num_threads` threads. (*detokenized)[i] holds the decoding of
+  // ids[offsets[i]] ... ids[offsets[i + 1] - 1]. Returns kOutOfRange when an
+  // id is not in [0, GetPieceSize()).
+  virtual util::Status DecodeBatch(const std::vector<int> &ids,
+                                   const std::vector<size_t> &offsets,
+                                   std::vector<std::string> *detokenized,
+                                   int num_threads) const;
+
+  // Same as above, but stores all decodings in one buffer `detokenized`,
+  // whose bytes [(*detokenized_offsets)[i], (*detokenized_offsets)[i + 1])
+  // hold the decoding of input i. This makes no string per input.
+  virtual util::Status DecodeBatch(const std::vector<int> &ids,
+                                   const std::vector<size_t> &offsets,
+                                   std::string *detokenized,
+                                   std::vector<size_t> *detokenized_offsets,
+                                   int num_threads) const;
+
   // Sets the encoder version. Normally users do not need to call this function.
   // But they can call this fucntion just in case if they want to fall back to
   // the original encoder.
@@ -263,6 +1072,58 @@ class SentencePieceProcessor {
   // Returns the current encoder version in use.
   virtual EncoderVersion GetEncoderVersion() const;
 
+  // Sets how the following Load() calls run the self-test of the model.
+  // The self-test encodes every sample stored in the model, which may slow
+  // down loading models trained with a large self_test_sample_size.
+  virtual util::Status SetSelfTestMode(SelfTestMode self_test_mode);
+
+  // Sets what the following Load() calls build, e.g., LoadMode::kDecodeOnly
+  // for detokenization services which never encode. A decode-only model
+  // skips the self-test and cannot be extended by CompiledModel::Extend().
+  virtual util::Status SetLoadMode(LoadMode load_mode);
+
+  // Runs the self-test of the loaded model, e.g., on another thread after
+  // loading it with SelfTestMode::kSkip. Returns an error if a sample is
+  // encoded differently than at training.
+  virtual util::Status SelfTest() const;
+
+  // Returns true if `expected` and `actual`, the ids of the same input
+  // encoded in two ways, e.g., by two encoder versions, are equivalent as
+  // in SelfTest(): the same pieces, or pieces whose scores differ only by
+  // float rounding errors.
+  virtual bool VerifyOutputsEquivalent(const std::vector<int> &expected,
+                                       const std::vector<int> &actual) const;
+
+  // Caches the segmentations of up to `max_words` words in every thread, so
+  // that words seen before are not segmented again. 0 disables the cache.
+  // Fails unless every piece with white space starts with it, as only then
+  // the words are segmented independently. With a unigram model, a word may
+  // rarely be segmented differently where two segmentations tie within
+  // float rounding. Sampling, NBest and vocabulary restrictions bypass the
+  // cache.
+  virtual util::Status SetWordCacheSize(int max_words);
+
+  // Samples the segmentations of SampleEncode() with nbest_size < 0 and of
+  // SampleEncodeAndScore() from a pruned lattice: a piece is dropped when
+  // the probability mass of the paths ending with it is below `beam` times
+  // that of the best piece ending at the same position. The samples follow
+  // the distribution restricted to the remaining paths, which makes
+  // sampling long documents cheaper while changing little. The mass of the
+  // dropped paths is added to EncodeStats::sample_pruned_mass_ppb. `beam`
+  // is in [0, 1], e.g., 1e-6, and 0, the default, samples from the full
+  // lattice. Only the unigram model samples from a lattice.
+  virtual util::Status SetSampleBeam(float beam);
+
+  // Segments the runs of at least 1024 bytes of the normalized input which
+  // repeat a unit of up to 8 bytes, e.g. "=====" or "-=-=-=", from a few
+  // hundred bytes of their middle, so that encoding them takes about the
+  // same time whatever their length. The middle of a run is output as the
+  // piece found there, repeated. A run may rarely be segmented differently
+  // near its ends where two segmentations tie within float rounding. Runs
+  // whose middle is not one piece repeated are segmented in full. Only
+  // affects the ids output by EncodeIds(), Encode() and EncodeBatch().
+  virtual util::Status SetCollapseRepeatRuns(bool collapse);
+
   //////////////////////////////////////////////////////////////
   // NBest API.
   // Same as Encode, but returns nbest results.
@@ -274,6 +1135,23 @@ class SentencePieceProcessor {
   virtual util::Status NBestEncode(absl::string_view input, int nbest_size,
                                    std::vector<std::vector<int>> *ids) const;
 
+  // Same as above, but stores the hypotheses in `nbest`, which shares their
+  // common prefixes. The hypotheses are added as the model finds them,
+  // without building a vector per hypothesis, so a reused `nbest` makes
+  // large nbest_size cheap.
+  virtual util::Status NBestEncode(absl::string_view input, int nbest_size,
+                                   NBestIds *nbest) const;
+
+  // Runs NBestEncode(inputs[i], nbest_size, ids) for every input and stores
+  // all hypotheses in one flat buffer. Hypothesis j consists of
+  // (*ids)[(*offsets)[j]] ... (*ids)[(*offsets)[j + 1] - 1], and the
+  // hypotheses of inputs[i] are (*nbest_offsets)[i] ...
+  // (*nbest_offsets)[i + 1] - 1.
+  virtual util::Status NBestEncodeBatch(
+      const std::vector<absl::string_view> &inputs, int nbest_size,
+      std::vector<int> *ids, std::vector<size_t> *offsets,
+      std::vector<size_t> *nbest_offsets) const;
+
   //////////////////////////////////////////////////////////////
   // Sampling API.
   // Unigram and BPE support sampling mode.
@@ -302,6 +1180,61 @@ class SentencePieceProcessor {
   virtual util::Status SampleEncode(absl::string_view input, int nbest_size,
                                     float alpha, std::vector<int> *ids) const;
 
+  // Draws `num_samples` segmentations of `input` as SampleEncode() does, but
+  // normalizes the input and builds the lattice (or nbest list) only once.
+  // When `unique` is true, repeated segmentations are returned only once, so
+  // fewer than `num_samples` results may be returned. (*scores)[k] is the
+  // log-probability of (*ids)[k] under the sampling distribution. `scores`
+  // can be nullptr.
+  virtual util::Status SampleEncode(absl::string_view input, int nbest_size,
+                                    float alpha, int num_samples, bool unique,
+                                    std::vector<std::vector<int>> *ids,
+                                    std::vector<float> *scores) const;
+
+  // Runs SampleEncode(inputs[i], nbest_size, alpha, ids) for every input and
+  // stores the results in one flat buffer. The ids of inputs[i] are
+  // (*ids)[(*offsets)[i]] ... (*ids)[(*offsets)[i + 1] - 1].
+  virtual util::Status SampleEncodeBatch(
+      const std::vector<absl::string_view> &inputs, int nbest_size,
+      float alpha, std::vector<int> *ids, std::vector<size_t> *offsets) const;
+
+  // Same as above, but samples on up to `num_threads` threads, drawing the
+  // random numbers of inputs[i] from a counter-based generator keyed by
+  // (`seed`, i). The results only depend on `seed` and the inputs, and not
+  // on the threads, the order of the calls or SetRandomGeneratorSeed().
+  virtual util::Status SampleEncodeBatch(
+      const std::vector<absl::string_view> &inputs, int nbest_size,
+      float alpha, uint64_t seed, std::vector<int> *ids,
+      std::vector<size_t> *offsets, int num_threads) const;
+
+  //////////////////////////////////////////////////////////////
+  // Lattice statistics API (--model_type=unigram only).
+  // The statistics describe the distribution over all segmentations of an
+  // input that SampleEncode(input, -1, alpha) draws from, computed exactly
+  // with the forward-backward algorithm on the lattice.
+  //
+  // Stores the entropy of the segmentations of `input` in `entropy`.
+  virtual util::Status CalculateEntropy(absl::string_view input, float alpha,
+                                        float *entropy) const;
+
+  // Stores the entropy of inputs[i] in (*entropies)[i], computing them on up
+  // to `num_threads` threads.
+  virtual util::Status CalculateEntropy(
+      const std::vector<absl::string_view> &inputs, float alpha,
+      std::vector<float> *entropies, int num_threads = 1) const;
+
+  // Stores in (*marginals)[id] the expected number of occurrences of piece
+  // `id` in a segmentation of `input`. `marginals` is resized to
+  // GetPieceSize().
+  virtual util::Status PieceMarginals(absl::string_view input, float alpha,
+                                      std::vector<float> *marginals) const;
+
+  // Same as above, but sums the expected numbers of occurrences over
+  // `inputs`, computing them on up to `num_threads` threads.
+  virtual util::Status PieceMarginals(
+      const std::vector<absl::string_view> &inputs, float alpha,
+      std::vector<float> *marginals, int num_threads = 1) const;
+
   //////////////////////////////////////////////////////////////
   // Advanced API returning SentencePieceText, which manages
   // utf8-byte alignments between user-input/detokenized text
@@ -311,6 +1244,25 @@ class SentencePieceProcessor {
   virtual util::Status Encode(absl::string_view input,
                               SentencePieceText *spt) const;
 
+  // Same as Encode(input, spt), but stores flat pieces in `pieces` instead of
+  // building a proto, so that repeated calls with one workspace and output
+  // vector copy no strings. The pieces point into `input`, the model and
+  // `workspace`, which must outlive them. `workspace` must not be nullptr.
+  virtual util::Status EncodePieces(absl::string_view input,
+                                    std::vector<EncodedPiece> *pieces,
+                                    EncodeWorkspace *workspace) const;
+
+  // Same as EncodeAsPieces(), but stores the pieces in
+  // `workspace->piece_views` without copying them. The pieces point into the
+  // vocabulary of the model, except for merged unknown pieces which point
+  // into `workspace`, and the repeat markers, which point into static
+  // strings. The surfaces and offsets are those of EncodePieces(), and the
+  // markers of a run have the empty surface at the end of the run. With a
+  // reused workspace, no heap allocation is made once the buffers have grown
+  // to the input size. `workspace` must not be nullptr.
+  virtual util::Status EncodePieceViews(absl::string_view input,
+                                        EncodeWorkspace *workspace) const;
+
   // Same as above, but returns NBestSentencePieceText.
   virtual util::Status NBestEncode(absl::string_view input, int nbest_size,
                                    NBestSentencePieceText *nbest_spt) const;
@@ -408,6 +1360,20 @@ class SentencePieceProcessor {
   virtual util::bytes DecodeIdsAsSerializedProto(
       const std::vector<int> &ids) const;
 
+  // Encodes every element of `inputs` into a row of the flat result
+  // `output`, which FlatResultView reads without parsing. `flags` is a
+  // combination of FlatResultFlags selecting the optional arrays. Uses up to
+  // `num_threads` threads.
+  virtual util::Status EncodeAsFlatResult(
+      const std::vector<absl::string_view> &inputs, uint32_t flags,
+      int num_threads, std::string *output) const;
+
+  // Same as above, but writes the `nbest_size` best segmentations of `input`
+  // as the rows of `output`.
+  virtual util::Status NBestEncodeAsFlatResult(absl::string_view input,
+                                               int nbest_size, uint32_t flags,
+                                               std::string *output) const;
+
   //////////////////////////////////////////////////////////////
   // Vocabulary management methods.
   //
@@ -458,12 +1424,41 @@ class SentencePieceProcessor {
   // Model management.
   //
   // Allows injection of a mock model instance. `model` is moved.
+  // A shared model is replaced with a new one holding `model` only.
   void SetModel(std::unique_ptr<ModelInterface> &&model);
 
   // Allows injection of a normalizer instance. `normalizer` is moved.
+  // A shared model is replaced as in SetModel().
   void SetNormalizer(std::unique_ptr<normalizer::Normalizer> &&normalizer);
 #endif
 
+  // Reports the stages of the encode and decode calls of this processor to
+  // `tracer`, or to none when it is nullptr, which is the default and costs
+  // one branch per call. Must not be called while other threads use this
+  // processor.
+  void SetTracer(std::shared_ptr<Tracer> tracer);
+
+  // Returns a snapshot of the encoder counters of all processors.
+  static EncodeStats GetStats();
+
+  // Returns the memory this processor holds, including the buffers the
+  // calling thread keeps for the model. Callers can add the buffers of their
+  // own workspaces with EncodeWorkspaceMemoryUsage().
+  MemoryUsage GetMemoryUsage() const;
+
+  // Returns the bytes of the buffers of `workspace`.
+  static uint64_t EncodeWorkspaceMemoryUsage(const EncodeWorkspace &workspace);
+
+  // Prepares the calling thread for its first requests. Reads the pages of a
+  // precompiled model file used in place, then encodes, samples and decodes
+  // synthetic inputs made of the pieces of the model, so that the lattices,
+  // the normalizer buffers and the random generator of the thread are
+  // allocated and grown beforehand. These are per thread, so call it on
+  // every thread which encodes, e.g., once per worker at its start. With
+  // options.num_threads, it also runs on the workers of the batch methods.
+  // The synthetic inputs bypass the encode cache.
+  util::Status WarmUp(const WarmUpOptions &options = WarmUpOptions()) const;
+
   // Returns immutable model proto. Useful to obtain extended
   // or experimental parameters encoded in model_proto.
   const ModelProto &model_proto() const;
@@ -472,30 +1467,698 @@ class SentencePieceProcessor {
   // Useful to save the state of this instance via Python's pickle object.
   util::bytes serialized_model_proto() const;
 
+  // Returns the name of the precompiled model file this instance uses in
+  // place, or an empty string if the model was not loaded from one. Python's
+  // pickle stores this name instead of the model, so that the processes
+  // unpickling it map the same file.
+  std::string precompiled_model_file() const;
+
  private:
+  friend class CompiledModel;
+  friend class ExtraOptions;
+  friend class MultiModelEncoder;
+  friend class IncrementalEncoder;
+  friend class StreamingDecoder;
+  friend class StreamingEncoder;
+
   enum ExtraOption { REVERSE, BOS, EOS };
 
+  // Returns the extra options of `workspace`, or the ones set by
+  // SetEncodeExtraOptions() when it has none.
+  const std::vector<ExtraOption> &EncodeExtraOptions(
+      const EncodeWorkspace &workspace) const;
+
   util::Status ParseExtraOptions(absl::string_view extra_option,
                                  std::vector<ExtraOption> *extra_options) const;
 
   util::Status ApplyExtraOptions(const std::vector<ExtraOption> &extra_options,
                                  SentencePieceText *spt) const;
 
+  // Same as ApplyExtraOptions() for a sequence of ids.
+  util::Status ApplyExtraOptions(const std::vector<ExtraOption> &extra_options,
+                                 std::vector<int> *ids) const;
+
+  // Same as ApplyExtraOptions() for the pieces of EncodePieces().
+  util::Status ApplyExtraOptions(const std::vector<ExtraOption> &extra_options,
+                                 std::vector<EncodedPiece> *pieces) const;
+
+  // Converts `result` of encoding `normalized` into ids in the same way as
+  // PopulateSentencePieceText(), including the extra options.
+  util::Status PopulateIds(absl::string_view normalized,
+                           const EncodeResult &result,
+                           std::vector<int> *ids) const;
+
+  // Encodes `input` into the ids truncated by SetEncodeMaxTokens(), with
+  // the extra options and without the repeat runs, in workspace->ids.
+  util::Status EncodeTruncatedIds(absl::string_view input,
+                                  EncodeWorkspace *workspace) const;
+
+  // Encodes a long `input` of a model with word boundaries in chunks cut
+  // between words, with the extra options and without the repeat runs, in
+  // workspace->ids. The chunks are encoded on encode_num_threads_ threads
+  // when `input` is long enough.
+  util::Status EncodeChunkedIds(absl::string_view input,
+                                EncodeWorkspace *workspace) const;
+
+  // Normalizes and encodes `chunk` of an input cut at word boundaries and
+  // appends its raw ids, reversed if `reverse`, to `ids`.
+  util::Status AppendChunkIds(absl::string_view chunk, bool reverse,
+                              EncodeWorkspace *workspace,
+                              std::vector<int> *ids) const;
+
+  // Segments `normalized` into workspace->compact_pieces, with its repeat
+  // runs collapsed when SetCollapseRepeatRuns() is set.
+  util::Status SegmentNormalized(absl::string_view normalized,
+                                 EncodeWorkspace *workspace) const;
+
+  // Segments `normalized` with its repeat runs shortened into
+  // workspace->compact_pieces. Returns false without changing it if there
+  // is no run or the middle of a run is not one piece repeated.
+  bool SegmentRepeatRuns(absl::string_view normalized,
+                         EncodeWorkspace *workspace) const;
+
+  // Keeps the longest prefix of `ids` whose repeat runs take at most
+  // `max_size` ids.
+  void TruncateRuns(size_t max_size, std::vector<int> *ids) const;
+
+  // Returns the number of ids the repeat runs of `ids` take without the
+  // last run.
+  size_t ClosedRunsSize(const std::vector<int> &ids) const;
+
+  // Returns the number of ids AppendRepeatRuns() writes for `ids`.
+  size_t RepeatRunsSize(const std::vector<int> &ids) const;
+
+  // Encodes `input` into workspace->ids as EncodeIds() does before the
+  // repeat runs are written.
+  util::Status EncodeRawIds(absl::string_view input,
+                            EncodeWorkspace *workspace) const;
+
+  // Segments `normalized`, which this processor's normalizer made from
+  // `input`, into ids with the extra options and without the repeat runs, in
+  // workspace->ids.
+  util::Status EncodeNormalizedIds(absl::string_view input,
+                                   absl::string_view normalized,
+                                   EncodeWorkspace *workspace) const;
+
+  // Fails unless `normalized` looks like an output of this processor's
+  // normalizer, as SetCheckPreNormalized() describes. `input` and
+  // `norm_to_orig` are checked when `norm_to_orig` is not nullptr.
+  util::Status CheckPreNormalized(
+      absl::string_view normalized, absl::string_view input,
+      const std::vector<uint32_t> *norm_to_orig) const;
+
+  // Segments `normalized` into `spt` as Encode(input, spt) does.
+  // `norm_to_orig` is the alignment of `normalized`.
+  util::Status EncodeNormalized(absl::string_view input,
+                                absl::string_view normalized,
+                                const std::vector<uint32_t> &norm_to_orig,
+                                SentencePieceText *spt) const;
+
+  // Appends `raw` to `ids` with every run of identical ids written as the
+  // id and its repeat markers, as Encode() writes them.
+  void AppendRepeatRuns(const std::vector<int> &raw,
+                        std::vector<int> *ids) const;
+
+  // Same as EncodeBatch(inputs, ids, num_threads) with batch_encoder_.
+  util::Status EncodeBatchWithEncoder(
+      const std::vector<absl::string_view> &inputs,
+      std::vector<std::vector<int>> *ids, int num_threads) const;
+
+  // Rebuilds batch_encoder_ for the current model and vocabulary.
+  void UpdateBatchEncoder();
+
+  // Drops the cached ids after the model or the encode options change.
+  void InvalidateEncodeCache();
+
+  // Returns the fingerprint of everything the ids of EncodeIds() depend on
+  // besides the input, which keys the entries of a shared encode cache.
+  uint64_t EncodeCacheFingerprint() const;
+
+  // Same as PopulateIds() without the extra options. `result` is an
+  // EncodeResult or a CompactEncodeResult.
+  template <typename ResultT>
+  util::Status PopulateRawIds(absl::string_view normalized,
+                              const ResultT &result,
+                              std::vector<int> *ids) const;
+
+  // Draws one segmentation of `normalized` as SampleEncode() does.
+  util::Status SampleModel(absl::string_view normalized, int nbest_size,
+                           float alpha, EncodeResult *result) const;
+
   util::Status PopulateSentencePieceText(
       absl::string_view input, absl::string_view normalized,
-      const std::vector<size_t> &norm_to_orig,
+      const std::vector<uint32_t> &norm_to_orig,
       const std::vector<std::pair<absl::string_view, int>> &result,
       SentencePieceText *spt) const;
 
-  std::unique_ptr<ModelInterface> model_;
-  std::unique_ptr<normalizer::Normalizer> normalizer_;
-  std::unique_ptr<normalizer::Normalizer> denormalizer_;
+  // Same as PopulateSentencePieceText(), but appends the pieces without the
+  // extra options and the text.
+  util::Status AppendSentencePieces(
+      absl::string_view input, absl::string_view normalized,
+      const std::vector<uint32_t> &norm_to_orig,
+      const std::vector<std::pair<absl::string_view, int>> &result,
+      SentencePieceText *spt) const;
 
-  // Underlying model protocol buffer. The same lifetime as model_.
-  std::unique_ptr<ModelProto> model_proto_;
+  // Encodes the pieces of a long `input` of a model with word boundaries
+  // into `spt` as Encode(input, spt) does, in chunks cut between words on
+  // encode_num_threads_ threads.
+  util::Status EncodeChunksInParallel(absl::string_view input,
+                                      SentencePieceText *spt) const;
+
+  // Same as EncodeIds(), but also stores the byte offsets of the ids as
+  // EncodeBatch(inputs, ids, offsets, begins, ends, ...) describes.
+  // `pieces` is a scratch buffer.
+  util::Status EncodeIdsWithOffsets(absl::string_view input,
+                                    std::vector<int> *ids,
+                                    std::vector<size_t> *begins,
+                                    std::vector<size_t> *ends,
+                                    std::vector<EncodedPiece> *pieces,
+                                    EncodeWorkspace *workspace) const;
+
+  // Same as PopulateSentencePieceText(), but stores flat pieces and applies
+  // no extra options.
+  util::Status PopulateRawPieces(absl::string_view input,
+                                 absl::string_view normalized,
+                                 const std::vector<uint32_t> &norm_to_orig,
+                                 const EncodeResult &result,
+                                 std::vector<EncodedPiece> *pieces) const;
+
+  // Returns the surface of `piece` before denormalization. `is_bos_ws` is
+  // true if no surface precedes it and `is_eos_ws` if it is the last piece.
+  std::string DecodePiece(absl::string_view piece, int id, bool is_bos_ws,
+                          bool is_eos_ws) const;
+
+  // Adds the pieces of `pieces` or `ids` to `spt` with the repeat runs
+  // expanded, for DecodeSentencePieceText().
+  util::Status AddDecodedPieces(const std::vector<std::string> &pieces,
+                                SentencePieceText *spt) const;
+  util::Status AddDecodedPieces(const std::vector<int> &ids,
+                                SentencePieceText *spt) const;
+
+  // Decodes the pieces stored in `spt` after applying `extra_options`,
+  // filling their surfaces and the text. Only the text is filled when
+  // `text_only` is true.
+  util::Status DecodeSentencePieceText(
+      const std::vector<ExtraOption> &extra_options, SentencePieceText *spt,
+      bool text_only) const;
+
+  // Loads a model saved by io::SavePrecompiledModel(). `blob` is the content
+  // of `model_file` named `filename`, which is kept open as the model uses the
+  // trie in place.
+  util::Status LoadPrecompiled(
+      absl::string_view filename, absl::string_view blob,
+      std::unique_ptr<filesystem::ReadableFile> model_file);
+
+  // Builds the normalizers of `compiled_model`, uses it and runs the
+  // self-test if `run_self_test` is true.
+  util::Status InitializeModel(std::shared_ptr<CompiledModel> compiled_model,
+                               bool run_self_test);
+
+  // Uses `compiled_model`. `is_shared` is true if other processors may use
+  // it too.
+  void SetCompiledModel(std::shared_ptr<CompiledModel> compiled_model,
+                        bool is_shared);
+
+  // Returns an error if the model may be shared with other processors.
+  util::Status CheckModelIsNotShared() const;
+
+  // Same as status(), but also returns an error if the model was loaded
+  // with LoadMode::kDecodeOnly. Checked by the encode methods.
+  util::Status CheckCanEncode() const;
+
+  // Runs the synthetic encodes of WarmUp() on prefixes of `text` on the
+  // calling thread, growing `workspace` or, if nullptr, the workspace of the
+  // thread.
+  util::Status WarmUpThread(absl::string_view text,
+                            const WarmUpOptions &options,
+                            EncodeWorkspace *workspace) const;
+
+  // Builds the surface of every piece as DecodePiece() returns it.
+  std::unique_ptr<const CompiledModel::DecodeTable> MakeDecodeTable() const;
+
+  // Decodes ids[0, size) with `extra_options` with `decode_table_`, and
+  // appends the result to `detokenized` without building a
+  // SentencePieceText. `expanded` holds the ids with the repeats expanded.
+  util::Status DecodeWithTable(const std::vector<ExtraOption> &extra_options,
+                               const int *ids, size_t size,
+                               std::vector<int> *expanded,
+                               std::string *detokenized) const;
+
+  // Checks the ids and the offsets of DecodeBatch().
+  util::Status CheckDecodeBatch(const std::vector<int> &ids,
+                                const std::vector<size_t> &offsets) const;
+
+  // Owns the model, the normalizers and the model proto below.
+  std::shared_ptr<CompiledModel> compiled_model_;
+
+  // True if compiled_model_ was passed to Load() and must not be changed.
+  bool is_shared_model_ = false;
+
+  // Parts of compiled_model_.
+  ModelInterface *model_ = nullptr;
+  const normalizer::Normalizer *normalizer_ = nullptr;
+  const normalizer::Normalizer *denormalizer_ = nullptr;
+  const ModelProto *model_proto_ = nullptr;
+  const CompiledModel::DecodeTable *decode_table_ = nullptr;
 
   std::vector<ExtraOption> encode_extra_options_;
   std::vector<ExtraOption> decode_extra_options_;
+
+  // Ids of repeated inputs, or nullptr when caching is disabled.
+  std::unique_ptr<EncodeCacheInterface> encode_cache_;
+
+  // Set by SetBatchEncodeBackend(). batch_encoder_ is nullptr with kDefault
+  // or when the model has no batch encoder.
+  BatchEncodeBackend batch_encode_backend_ = BatchEncodeBackend::kDefault;
+  std::unique_ptr<const BatchViterbiEncoder> batch_encoder_;
+
+  // Set by SetTracer(), or nullptr.
+  std::shared_ptr<Tracer> tracer_;
+
+  // Set by SetDecodeMaxRepeatCount().
+  int decode_max_repeat_count_ = 1 << 20;
+
+  // Set by SetDecodeMaxExpansion().
+  int64_t decode_max_expansion_ = INT64_MAX;
+
+  // Set by SetEncodeMaxTokens(). 0 if the ids are not truncated.
+  int max_tokens_ = 0;
+  TruncationSide truncation_side_ = TruncationSide::kRight;
+
+  // Set by SetEncodeNumThreads().
+  int encode_num_threads_ = 1;
+
+  // Set by SetCollapseRepeatRuns().
+  bool collapse_repeat_runs_ = false;
+
+  // Set by SetCheckPreNormalized().
+  bool check_pre_normalized_ = false;
+
+  SelfTestMode self_test_mode_ = SelfTestMode::kRun;
+  LoadMode load_mode_ = LoadMode::kFull;
+};
+
+// Extra options made by SentencePieceProcessor::MakeExtraOptions(). Like
+// VocabularyMask, they are immutable and can be shared by threads, so that
+// callers needing bos/eos ids or the reverse order can share one processor
+// by passing their options per call.
+class ExtraOptions {
+ public:
+  // Returns true if no option is set.
+  bool empty() const { return options_.empty(); }
+
+ private:
+  friend class SentencePieceProcessor;
+  std::vector<SentencePieceProcessor::ExtraOption> options_;
+};
+
+// Encodes a text given in fragments, e.g., by a speech recognizer, into the
+// ids SentencePieceProcessor::EncodeIds() returns for the whole text. Ids
+// are returned as soon as no further input can change them.
+//
+//   StreamingEncoder encoder(sp);
+//   std::vector<int> ids;
+//   CHECK_OK(encoder.Push("Hello wo", &ids));  // ids of "Hello".
+//   CHECK_OK(encoder.Push("rld.", &ids));      // no ids.
+//   CHECK_OK(encoder.Finish(&ids));            // ids of "world.".
+//
+// The text is cut before a word that follows a space, as the normalizer
+// treats the words on both sides independently there. With case encoding,
+// the word before the space must end with a lowercase letter so that no
+// span of uppercase words crosses the cut. No cut is made when pieces of the
+// model contain inner whitespace, when the extra whitespaces are kept, when
+// no dummy prefix is added or when whitespace is treated as a suffix. The
+// held-back text is the text after the last cut, usually the last word, and
+// the last id is held back while it may start a run of identical ids.
+// The "reverse" extra option is not supported.
+class StreamingEncoder {
+ public:
+  // `processor` must outlive this encoder and must not be changed while
+  // a text is encoded.
+  explicit StreamingEncoder(const SentencePieceProcessor &processor);
+
+  // Appends `input` to the text and stores the ids that became final in
+  // `ids`.
+  util::Status Push(absl::string_view input, std::vector<int> *ids);
+
+  // Ends the text and stores the remaining ids in `ids`. The encoder can
+  // encode another text afterwards.
+  util::Status Finish(std::vector<int> *ids);
+
+  // Clears the text without returning its remaining ids.
+  void Reset();
+
+  // Returns the number of bytes of the text held back.
+  size_t buffered_size() const { return pending_.size(); }
+
+ private:
+  // Returns true if the text can be cut before `pending_[pos]`.
+  bool IsBoundary(size_t pos) const;
+
+  // Encodes `text`, which ends at a cut or the end of the text.
+  util::Status EncodeChunk(absl::string_view text, std::vector<int> *ids);
+
+  // Appends `id` with run-length encoding as EncodeIds() does. The last run
+  // is held back until another id arrives.
+  void AddId(int id, std::vector<int> *ids);
+  void FlushRun(std::vector<int> *ids);
+
+  util::Status CheckExtraOptions() const;
+
+  const SentencePieceProcessor &processor_;
+
+  bool has_boundaries_ = false;
+  bool lowercase_before_boundary_ = false;
+
+  std::string pending_;  // text after the last cut.
+  size_t scanned_ = 0;   // bytes of `pending_` checked for cuts.
+  bool started_ = false;
+  bool is_prev_unk_ = false;
+  int run_id_ = -1;
+  int run_size_ = 0;
+  EncodeWorkspace workspace_;
+};
+
+// Keeps the ids of a text up to date while the text is edited, e.g., to show
+// a live token count in an editor. Replace() normalizes and segments only
+// the words around the edit, from the last cut before it to the first cut
+// after it, where the cuts are the word boundaries StreamingEncoder uses:
+// no piece and no span of case encoding crosses them. The pieces of the
+// words are spliced into the previous ones, so that the time to segment
+// does not grow with the text. A model whose texts cannot be cut between
+// words, e.g., with pieces containing inner whitespace, encodes the whole
+// text on every edit.
+//
+//   IncrementalEncoder encoder(sp);
+//   CHECK_OK(encoder.SetText(document));
+//   CHECK_OK(encoder.Replace(offset, length, "typed text"));
+//   std::cout << encoder.num_pieces();
+//   std::vector<int> ids;
+//   CHECK_OK(encoder.GetIds(&ids));  // == sp.EncodeIds(encoder.text()).
+class IncrementalEncoder {
+ public:
+  // `processor` must outlive this encoder and must not be changed while
+  // a text is encoded.
+  explicit IncrementalEncoder(const SentencePieceProcessor &processor);
+
+  // Encodes `text` as a whole.
+  util::Status SetText(absl::string_view text);
+
+  // Replaces the `length` bytes of the text at byte `offset` with
+  // `replacement` and updates the pieces.
+  util::Status Replace(size_t offset, size_t length,
+                       absl::string_view replacement);
+
+  const std::string &text() const { return text_; }
+
+  // The pieces of the text without the extra options and the repeat runs,
+  // and the byte ranges of text() they cover, as EncodeBatch() with offsets
+  // stores them.
+  size_t num_pieces() const { return ids_.size(); }
+  const std::vector<int> &raw_ids() const { return ids_; }
+  const std::vector<size_t> &begins() const { return begins_; }
+  const std::vector<size_t> &ends() const { return ends_; }
+
+  // Stores the ids EncodeIds() returns for text(), with the extra options
+  // and the repeat runs, but without the truncation of SetEncodeMaxTokens().
+  util::Status GetIds(std::vector<int> *ids) const;
+
+  // Returns the bytes of the text normalized and segmented by the last
+  // SetText() or Replace().
+  size_t last_encoded_size() const { return last_encoded_size_; }
+
+ private:
+  // Returns the first of the current pieces after a cut before byte `pos`
+  // of the text they cover, whose spaces before the cut begin at
+  // `spaces`, or -1 if an unknown piece spans the cut.
+  int64_t PieceAtCut(size_t spaces, size_t pos) const;
+
+  // Encodes text_[begin, end) into workspace_.raw_pieces, with the offsets
+  // in text_.
+  util::Status EncodeWindow(size_t begin, size_t end);
+
+  const SentencePieceProcessor &processor_;
+
+  bool has_boundaries_ = false;
+  bool lowercase_before_boundary_ = false;
+
+  std::string text_;
+  std::vector<int> ids_;
+  std::vector<size_t> begins_;
+  std::vector<size_t> ends_;
+  size_t last_encoded_size_ = 0;
+
+  EncodeWorkspace workspace_;
+};
+
+// Decodes ids given one at a time, e.g., by a language model, into the text
+// SentencePieceProcessor::Decode() returns for all of them. Only the text
+// that became final is returned, so decoding n ids takes O(n) time.
+//
+//   StreamingDecoder decoder(sp);
+//   std::string text;
+//   for (const int id : ids) {
+//     CHECK_OK(decoder.Push(id, &text));
+//     std::cout << text;
+//   }
+//   CHECK_OK(decoder.Finish(&text));
+//   std::cout << text;
+//
+// Ids are held back while they may still change the text: a repeat group
+// until its "(#endrepeat)", byte pieces until they form a UTF-8 character,
+// and, when whitespace is treated as a suffix, the last piece. With a
+// denormalizer, the text is held until a space outside a span of uppercase
+// words, as the case markers change the text that follows them. The
+// denormalization rules must not span a space. The "reverse" extra option is
+// not supported.
+class StreamingDecoder {
+ public:
+  // `processor` must outlive this decoder and must not be changed while
+  // ids are decoded.
+  explicit StreamingDecoder(const SentencePieceProcessor &processor);
+
+  // Decodes `id` after the ids given so far and stores the text that became
+  // final in `text`.
+  util::Status Push(int id, std::string *text);
+
+  // Same as Push() for every element of `ids`.
+  util::Status Push(const std::vector<int> &ids, std::string *text);
+
+  // Ends the ids and stores the remaining text in `text`. The decoder can
+  // decode other ids afterwards.
+  util::Status Finish(std::string *text);
+
+  // Clears the ids without returning their remaining text.
+  void Reset();
+
+ private:
+  // Expands the repeat groups as Decode() does.
+  util::Status AddId(int id, std::string *text);
+
+  // Passes the pending repeat group as it is.
+  util::Status FlushGroup(std::string *text);
+
+  util::Status AddPiece(int id, std::string *text);
+
+  // Decodes the pending byte pieces. Bytes that may start a UTF-8 character
+  // are kept unless `flush` is true.
+  void DecodeBytes(bool flush, std::string *text);
+
+  // Decodes the held piece, which is the last one if `is_eos_ws` is true.
+  void DecodeHeldPiece(bool is_eos_ws, std::string *text);
+
+  void AddSurface(absl::string_view surface, std::string *text);
+
+  // Denormalizes the pending surface up to the last cut.
+  util::Status Denormalize(bool flush, std::string *text);
+
+  util::Status CheckExtraOptions() const;
+
+  const SentencePieceProcessor &processor_;
+
+  bool hold_last_piece_ = false;
+  bool has_boundaries_ = false;
+  bool decode_case_ = false;
+
+  // Repeat expansion.
+  int prev_id_ = -1;
+  int64_t run_count_ = 0;  // pieces decoded for the run of `prev_id_`.
+  std::vector<int> group_;  // "(#startrepeat)" and the ids after it.
+  int64_t group_count_ = 0;
+
+  // Surfaces.
+  std::string bytes_;
+  int held_id_ = -1;
+  bool has_surface_ = false;
+
+  // Denormalization.
+  std::string surface_;  // surface after the last cut.
+  size_t scanned_ = 0;   // bytes of `surface_` checked for cuts.
+  bool all_upper_ = false;
+};
+
+// Publishes the SentencePieceProcessor of a serving process, so that the
+// model can be reloaded while other threads encode with the previous one.
+//
+//   ProcessorHandle handle;
+//   CHECK_OK(handle.Load("//path/to/model"));
+//
+//   // In the serving threads, for every request:
+//   std::shared_ptr<const SentencePieceProcessor> sp = handle.Acquire();
+//   CHECK_OK(sp->Encode(input, &ids));
+//
+//   // On deploy:
+//   CHECK_OK(handle.Load("//path/to/new_model"));
+//
+// A processor is built before it is published, and publishing only swaps a
+// pointer, so readers never wait for a load. A request keeps the processor
+// it acquired, and a replaced processor is freed when the last request
+// holding it releases it.
+class ProcessorHandle {
+ public:
+  ProcessorHandle();
+  ~ProcessorHandle();
+
+  ProcessorHandle(const ProcessorHandle &) = delete;
+  ProcessorHandle &operator=(const ProcessorHandle &) = delete;
+
+  // Loads the model in `filename` into a new processor and publishes it.
+  // The published processor is kept when the model cannot be loaded.
+  util::Status Load(absl::string_view filename);
+
+  // Publishes `processor`, which must not be changed afterwards. Use it to
+  // publish a processor with extra options or a shared CompiledModel.
+  util::Status Publish(std::shared_ptr<const SentencePieceProcessor> processor);
+
+  // Returns the published processor, or nullptr if nothing is published.
+  std::shared_ptr<const SentencePieceProcessor> Acquire() const;
+
+ private:
+  // Only read and written with std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const SentencePieceProcessor> processor_;
+};
+
+// Encodes every input with several models that normalize texts identically,
+// e.g., a production, a candidate and a routing vocabulary trained with the
+// same NormalizerSpec. The input is normalized once, and every model
+// segments the shared normalized text.
+//
+//   MultiModelEncoder encoder;
+//   CHECK_OK(encoder.Init({&production, &candidate, &router}));
+//   std::vector<std::vector<int>> ids;
+//   CHECK_OK(encoder.EncodeIds(input, &ids));  // ids[i] of processor i.
+//
+// The results are those of each processor's EncodeIds() and Encode(). A
+// processor with SetEncodeMaxTokens() or an encode cache encodes the input
+// on its own in EncodeIds(), as the truncation and the cache start from the
+// input.
+class MultiModelEncoder {
+ public:
+  MultiModelEncoder();
+  ~MultiModelEncoder();
+
+  MultiModelEncoder(const MultiModelEncoder &) = delete;
+  MultiModelEncoder &operator=(const MultiModelEncoder &) = delete;
+
+  // Uses `processors`, which must outlive this encoder and must not be
+  // changed while it is used. Fails unless they have the same NormalizerSpec,
+  // user defined symbols and whitespace handling. With `num_threads` > 1,
+  // the models of one input run concurrently on a pool of `num_threads` - 1
+  // persistent workers and the calling thread.
+  util::Status Init(const std::vector<const SentencePieceProcessor *> &processors,
+                    int num_threads = 1);
+
+  // Encodes `input` with every processor. (*ids)[i] holds the result of the
+  // i-th processor's EncodeIds(input). Returns the first error, in processor
+  // order, if any.
+  util::Status EncodeIds(absl::string_view input,
+                         std::vector<std::vector<int>> *ids) const;
+
+  // Same as EncodeIds(), but stores Encode(input, spt) of every processor.
+  util::Status Encode(absl::string_view input,
+                      std::vector<SentencePieceText> *spts) const;
+
+  // Returns the number of processors.
+  size_t size() const { return processors_.size(); }
+
+ private:
+  // Calls `fn(i)` for every processor, concurrently with a pool.
+  void ForEachProcessor(const std::function<void(int64_t)> &fn) const;
+
+  std::vector<const SentencePieceProcessor *> processors_;
+  std::unique_ptr<ThreadPool> pool_;  // nullptr with one thread.
+};
+
+// Per-request options of AsyncEncoder, used as EncodeWorkspace::vocabulary
+// and EncodeWorkspace::extra_options. They are kept alive until the request
+// is done.
+struct AsyncEncodeOptions {
+  std::shared_ptr<const VocabularyMask> vocabulary;
+  std::shared_ptr<const ExtraOptions> extra_options;
+};
+
+// The outcome of a request of AsyncEncoder.
+struct AsyncEncodeResult {
+  util::Status status;  // kCancelled if the request was cancelled.
+  std::vector<int> ids;
+};
+
+// Encodes texts for callers that must not block, e.g., the event loop of an
+// asynchronous server. Requests are queued and encoded by persistent worker
+// threads, and the ids are returned through a future or a callback.
+//
+//   AsyncEncoder encoder(sp, 4);
+//   std::future<AsyncEncodeResult> result = encoder.EncodeAsync(input);
+//   ...
+//   CHECK_OK(result.get().status);
+//
+// Small concurrent requests are encoded in batches: a request waits at most
+// `max_delay_us` microseconds for others, and up to `max_batch_size`
+// requests are handed to one worker, which encodes them with one
+// EncodeWorkspace. The ids are those of processor.EncodeIds().
+class AsyncEncoder {
+ public:
+  // Called exactly once per request, on a worker thread, or by Cancel().
+  using Callback =
+      std::function<void(util::Status status, std::vector<int> ids)>;
+
+  // `processor` must outlive this encoder and must not be changed while it
+  // is used.
+  explicit AsyncEncoder(const SentencePieceProcessor &processor,
+                        int num_threads = 1, int max_batch_size = 32,
+                        int64_t max_delay_us = 100);
+
+  // Encodes the queued requests without waiting for a batch, and returns
+  // when all requests are done.
+  ~AsyncEncoder();
+
+  AsyncEncoder(const AsyncEncoder &) = delete;
+  AsyncEncoder &operator=(const AsyncEncoder &) = delete;
+
+  // Queues `input`, which is copied, and returns the id of the request for
+  // Cancel(). `done` receives the status and the ids.
+  uint64_t EncodeAsync(absl::string_view input,
+                       const AsyncEncodeOptions &options, Callback done);
+
+  // Same as above, but returns a future of the result. The id of the request
+  // is stored in `request_id` when it is not nullptr.
+  std::future<AsyncEncodeResult> EncodeAsync(
+      absl::string_view input,
+      const AsyncEncodeOptions &options = AsyncEncodeOptions(),
+      uint64_t *request_id = nullptr);
+
+  // Cancels the request `request_id` unless a worker has started it. The
+  // request is then done with a kCancelled status, and true is returned.
+  bool Cancel(uint64_t request_id);
+
+  // Runs SentencePieceProcessor::WarmUp() once on every worker, after the
+  // requests already queued, and returns the first error.
+  util::Status WarmUp(const WarmUpOptions &options = WarmUpOptions());
+
+ private:
+  // The queue, the dispatcher and the workers, defined in the .cc file.
+  class Impl;
+  std::unique_ptr<Impl> impl_;
 };
 
 // Set seed value of random generator.
@@ -518,6 +2181,25 @@ util::Status LoadModelProto(absl::string_view, ModelProto *model_proto);
 
 // Saves `model_proto` as `filename`.
 util::Status SaveModelProto(absl::string_view, const ModelProto &model_proto);
+
+// Saves `model_proto` as `filename` in the precompiled format, which also
+// stores the double-array trie of unigram models. SentencePieceProcessor::Load()
+// reads this format too, memory-maps it where possible and uses the trie in
+// place instead of building it. When the model passes its self-test, the
+// file records it for SelfTestMode::kCached. With `quantize_scores`, a
+// unigram model also stores the scores as int16 with one per-model scale and
+// the piece types in four bits, which the encoders read in place instead of
+// the float tables. Saving fails if the quantized scores change the
+// segmentation of a self-test sample.
+util::Status SavePrecompiledModel(absl::string_view filename,
+                                  const ModelProto &model_proto,
+                                  bool quantize_scores = false);
+
+// Same as SavePrecompiledModel(), but stores the bytes of the file into
+// `blob`.
+util::Status SerializePrecompiledModel(const ModelProto &model_proto,
+                                       bool quantize_scores,
+                                       std::string *blob);
 }  // namespace io
 #endif  // SWIG
 }  // namespace sentencepiece
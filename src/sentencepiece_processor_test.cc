@@ -12,6 +12,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <set>
+#include <thread>
 #include <utility>
 
 #include "builder.h"
@@ -26,6 +33,7 @@
 #include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_split.h"
 #include "third_party/absl/strings/string_view.h"
 #include "util.h"
 
@@ -91,6 +99,23 @@ class ByteFallbackMockModel : public MockModel {
   bool ByteFallbackEnabled() const override { return true; }
 };
 
+class RepeatMockModel : public MockModel {
+ public:
+  RepeatMockModel() {
+    special_ids_.start_repeat = 5;
+    special_ids_.end_repeat = 6;
+    for (int d = 0; d < 10; ++d) special_ids_.digits[d] = 7 + d;
+  }
+
+  int PieceToId(absl::string_view piece) const override {
+    if (piece == "(#startrepeat)") return 5;
+    if (piece == "(#endrepeat)") return 6;
+    if (piece.size() == 1 && piece[0] >= '0' && piece[0] <= '9')
+      return 7 + piece[0] - '0';
+    return 0;
+  }
+};
+
 std::vector<std::string> GetSpVec(const EncodeResult &pieces) {
   std::vector<std::string> sps;
   for (const auto &p : pieces) {
@@ -232,6 +257,37 @@ TEST(SentencepieceProcessorTest, EncodeTest) {
     EXPECT_EQ(7, spt.pieces(3).end());
   }
 
+  // Long run of unknown pieces.
+  {
+    auto mock = absl::make_unique<MockModel>();
+
+    const std::string unknown(10000, 'x');
+    EncodeResult result = {{WS "AB", 3}};
+    for (size_t i = 0; i < unknown.size(); ++i) result.emplace_back("x", 0);
+    result.emplace_back("</s>", 2);
+
+    const std::string normalized = WS "AB" + unknown;
+    mock->SetEncodeResult(normalized, result);
+    sp.SetModel(std::move(mock));
+    sp.SetNormalizer(
+        absl::make_unique<normalizer::Normalizer>(normalization_spec));
+
+    const std::string input = "AB" + unknown;
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.Encode(input, &ids).ok());
+    EXPECT_EQ(std::vector<int>({3, 0, 2}), ids);
+
+    SentencePieceText spt;
+    EXPECT_TRUE(sp.Encode(input, &spt).ok());
+    EXPECT_EQ(3, spt.pieces_size());
+    EXPECT_EQ(unknown, spt.pieces(1).piece());
+    EXPECT_EQ(unknown, spt.pieces(1).surface());
+    EXPECT_EQ(0, spt.pieces(1).id());
+    EXPECT_EQ(2, spt.pieces(1).begin());
+    EXPECT_EQ(input.size(), spt.pieces(1).end());
+    EXPECT_EQ("", spt.pieces(2).surface());
+  }
+
   // Byte-fallback.
   {
     const absl::string_view kInput2 = WS "ABC" WS "DEFあ";
@@ -415,6 +471,43 @@ TEST(SentencepieceProcessorTest, EncodeTest) {
   }
 }
 
+TEST(SentencepieceProcessorTest, RepeatEncodeTest) {
+  SentencePieceProcessor sp;
+  const auto normalization_spec = MakeDefaultNormalizerSpec();
+
+  auto mock = absl::make_unique<RepeatMockModel>();
+  EncodeResult result = {{WS "A", 3}};
+  for (int i = 0; i < 12; ++i) result.emplace_back("B", 4);
+  result.emplace_back("A", 3);
+  result.emplace_back("A", 3);
+  result.emplace_back("</s>", 2);
+  const std::string input = WS "A" + std::string(12, 'B') + "AA";
+  mock->SetEncodeResult(input, result);
+  sp.SetModel(std::move(mock));
+  sp.SetNormalizer(
+      absl::make_unique<normalizer::Normalizer>(normalization_spec));
+
+  const std::string text = "A" + std::string(12, 'B') + "AA";
+
+  std::vector<std::string> pieces;
+  EXPECT_TRUE(sp.Encode(text, &pieces).ok());
+  EXPECT_EQ(std::vector<std::string>({WS "A", "B", "(#startrepeat)", "1", "2",
+                                      "(#endrepeat)", "A", "(#startrepeat)",
+                                      "2", "(#endrepeat)", "</s>"}),
+            pieces);
+
+  std::vector<int> ids;
+  EXPECT_TRUE(sp.Encode(text, &ids).ok());
+  EXPECT_EQ(std::vector<int>({3, 4, 5, 8, 9, 6, 3, 5, 9, 6, 2}), ids);
+
+  // The workspace can be reused across calls.
+  EncodeWorkspace workspace;
+  for (int n = 0; n < 2; ++n) {
+    EXPECT_TRUE(sp.EncodeIds(text, &ids, &workspace).ok());
+    EXPECT_EQ(std::vector<int>({3, 4, 5, 8, 9, 6, 3, 5, 9, 6, 2}), ids);
+  }
+}
+
 TEST(SentencepieceProcessorTest, NBestEncodeTest) {
   const std::string kInput = WS "ABC" WS "DEF";
   SentencePieceProcessor sp;
@@ -709,6 +802,114 @@ TEST(SentencepieceProcessorTest, DecodeTest) {
   }
 }
 
+TEST(SentencepieceProcessorTest, RepeatDecodeTest) {
+  class RepeatDecodeMockModel : public ModelInterface {
+   public:
+    RepeatDecodeMockModel() {
+      pieces_ = {"<unk>", "<s>", "</s>", WS "ABC", "F", "(#startrepeat)",
+                 "(#endrepeat)"};
+      for (char c = '0'; c <= '9'; ++c) pieces_.emplace_back(1, c);
+      special_ids_.start_repeat = 5;
+      special_ids_.end_repeat = 6;
+      for (int d = 0; d < 10; ++d) special_ids_.digits[d] = 7 + d;
+    }
+
+    EncodeResult Encode(absl::string_view normalized) const override {
+      return {};
+    }
+
+    int GetPieceSize() const override { return pieces_.size(); }
+
+    int PieceToId(absl::string_view piece) const override {
+      for (int i = 0; i < pieces_.size(); ++i) {
+        if (pieces_[i] == piece) return i;
+      }
+      return 0;
+    }
+
+    const std::string &IdToPiece(int id) const override { return pieces_[id]; }
+
+    bool IsUnknown(int id) const override { return (id == 0); }
+
+    bool IsControl(int id) const override {
+      return (id == 1 || id == 2 || id == 5 || id == 6);
+    }
+
+    bool IsByte(int id) const override { return false; }
+
+    float GetScore(int id) const override { return 0.0; }
+
+   private:
+    std::vector<std::string> pieces_;
+  };
+
+  SentencePieceProcessor sp;
+  sp.SetModel(absl::make_unique<RepeatDecodeMockModel>());
+  sp.SetNormalizer(
+      absl::make_unique<normalizer::Normalizer>(MakeDefaultNormalizerSpec()));
+
+  const std::vector<std::string> pieces = {
+      WS "ABC", "(#startrepeat)", "3", "(#endrepeat)", "F", "(#startrepeat)",
+      "1",      "2",              "(#endrepeat)"};
+  const std::string expected = "ABC ABC ABC" + std::string(12, 'F');
+
+  std::string text;
+  EXPECT_TRUE(sp.Decode(pieces, &text).ok());
+  EXPECT_EQ(expected, text);
+
+  std::vector<int> ids;
+  for (const auto &piece : pieces) ids.push_back(sp.PieceToId(piece));
+  EXPECT_TRUE(sp.Decode(ids, &text).ok());
+  EXPECT_EQ(expected, text);
+
+  SentencePieceText spt;
+  EXPECT_TRUE(spt.ParseFromString(sp.DecodeIdsAsSerializedProto(ids)));
+  EXPECT_EQ(15, spt.pieces_size());
+  EXPECT_EQ(expected, spt.text());
+
+  // Malformed repeat groups are decoded as they are.
+  EXPECT_TRUE(
+      sp.Decode(std::vector<std::string>({"(#startrepeat)", "2", "(#endrepeat)",
+                                          "F", "(#startrepeat)", "F"}),
+                &text)
+          .ok());
+  EXPECT_EQ("2FF", text);
+
+  // A run longer than SetDecodeMaxRepeatCount() is an error.
+  auto is_out_of_range = [](const util::Status &status) {
+    return status.code() == util::StatusCode::kOutOfRange;
+  };
+  std::vector<int> long_run = {sp.PieceToId("F"),
+                               sp.PieceToId("(#startrepeat)")};
+  long_run.insert(long_run.end(), 7, sp.PieceToId("9"));
+  long_run.push_back(sp.PieceToId("(#endrepeat)"));
+  EXPECT_TRUE(is_out_of_range(sp.Decode(long_run, &text)));
+  EXPECT_TRUE(is_out_of_range(sp.Decode(long_run, &spt)));
+
+  EXPECT_FALSE(sp.SetDecodeMaxRepeatCount(0).ok());
+  EXPECT_TRUE(sp.SetDecodeMaxRepeatCount(12).ok());
+  EXPECT_TRUE(sp.Decode(pieces, &text).ok());
+  EXPECT_EQ(expected, text);
+  EXPECT_TRUE(sp.SetDecodeMaxRepeatCount(11).ok());
+  EXPECT_TRUE(is_out_of_range(sp.Decode(pieces, &text)));
+  EXPECT_TRUE(is_out_of_range(sp.Decode(ids, &text)));
+  EXPECT_TRUE(is_out_of_range(sp.Decode(ids, &spt)));
+
+  StreamingDecoder decoder(sp);
+  EXPECT_TRUE(is_out_of_range(decoder.Push(ids, &text)));
+
+  // The runs expand into 2 + 11 pieces besides their first ones.
+  EXPECT_TRUE(sp.SetDecodeMaxRepeatCount(12).ok());
+  EXPECT_FALSE(sp.SetDecodeMaxExpansion(-1).ok());
+  EXPECT_TRUE(sp.SetDecodeMaxExpansion(13).ok());
+  EXPECT_TRUE(sp.Decode(ids, &text).ok());
+  EXPECT_EQ(expected, text);
+  EXPECT_TRUE(sp.SetDecodeMaxExpansion(12).ok());
+  EXPECT_TRUE(is_out_of_range(sp.Decode(pieces, &text)));
+  EXPECT_TRUE(is_out_of_range(sp.Decode(ids, &text)));
+  EXPECT_TRUE(is_out_of_range(sp.Decode(ids, &spt)));
+}
+
 TEST(SentencepieceProcessorTest, ByteFallbackDecodeTest) {
   class ByteFallbackDecodeMockModel : public ModelInterface {
    public:
@@ -844,147 +1045,3327 @@ void AddPiece(ModelProto *model_proto, absl::string_view piece,
   sp->set_score(score);
 }
 
-TEST(SentencePieceProcessorTest, LoadInvalidModelTest) {
+TEST(SentencepieceProcessorTest, EncodeBatchTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
   SentencePieceProcessor sp;
-  EXPECT_FALSE(sp.Load("").ok());
-  EXPECT_FALSE(sp.Load("__UNKNOWN_FILE__").ok());
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  std::vector<std::string> texts;
+  for (int i = 0; i < 100; ++i) {
+    texts.emplace_back(std::string(i % 7, 'a') + " ab" + std::string(i, 'b') +
+                       (i % 3 == 0 ? " xyz" : ""));
+  }
+  texts.emplace_back("");
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+
+  for (const int num_threads : {0, 1, 4}) {
+    std::vector<std::vector<int>> ids;
+    EXPECT_TRUE(sp.EncodeBatch(inputs, &ids, num_threads).ok());
+    EXPECT_EQ(inputs.size(), ids.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(sp.EncodeAsIds(inputs[i]), ids[i]);
+    }
+  }
+
+  EXPECT_FALSE(sp.EncodeBatch(inputs, nullptr, 4).ok());
+
+  // The flat buffer holds the same ids, and DecodeBatch() reverses it.
+  for (const int num_threads : {0, 1, 4}) {
+    std::vector<int> ids;
+    std::vector<size_t> offsets;
+    EXPECT_TRUE(sp.EncodeBatch(inputs, &ids, &offsets, num_threads).ok());
+    ASSERT_EQ(inputs.size() + 1, offsets.size());
+    EXPECT_EQ(0, offsets.front());
+    EXPECT_EQ(ids.size(), offsets.back());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(sp.EncodeAsIds(inputs[i]),
+                std::vector<int>(ids.begin() + offsets[i],
+                                 ids.begin() + offsets[i + 1]));
+    }
+
+    std::vector<std::string> detokenized;
+    EXPECT_TRUE(sp.DecodeBatch(ids, offsets, &detokenized, num_threads).ok());
+    ASSERT_EQ(inputs.size(), detokenized.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(sp.DecodeIds(sp.EncodeAsIds(inputs[i])), detokenized[i]);
+    }
+
+    // The flat output holds the same decodings.
+    std::string text;
+    std::vector<size_t> text_offsets;
+    EXPECT_TRUE(
+        sp.DecodeBatch(ids, offsets, &text, &text_offsets, num_threads).ok());
+    ASSERT_EQ(inputs.size() + 1, text_offsets.size());
+    EXPECT_EQ(0, text_offsets.front());
+    EXPECT_EQ(text.size(), text_offsets.back());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(detokenized[i], text.substr(text_offsets[i],
+                                            text_offsets[i + 1] -
+                                                text_offsets[i]));
+    }
+  }
+
+  std::vector<std::string> detokenized;
+  EXPECT_TRUE(sp.DecodeBatch({}, {}, &detokenized, 1).ok());
+  EXPECT_TRUE(detokenized.empty());
+  std::string text = "x";
+  std::vector<size_t> text_offsets;
+  EXPECT_TRUE(sp.DecodeBatch({}, {}, &text, &text_offsets, 1).ok());
+  EXPECT_TRUE(text.empty());
+  EXPECT_EQ(std::vector<size_t>({0}), text_offsets);
+  EXPECT_EQ(util::StatusCode::kOutOfRange,
+            sp.DecodeBatch({1, 5}, {0, 2}, &text, &text_offsets, 1).code());
+  EXPECT_FALSE(sp.DecodeBatch({1, 2}, {0, 2}, &text, nullptr, 1).ok());
+  EXPECT_EQ(util::StatusCode::kOutOfRange,
+            sp.DecodeBatch({1, 5}, {0, 2}, &detokenized, 1).code());
+  EXPECT_FALSE(sp.DecodeBatch({1, 2}, {0, 3}, &detokenized, 1).ok());
+  EXPECT_FALSE(sp.DecodeBatch({1, 2}, {0, 2, 1}, &detokenized, 1).ok());
+  EXPECT_FALSE(sp.DecodeBatch({1, 2}, {0, 2}, nullptr, 1).ok());
 }
 
-TEST(SentencePieceProcessorTest, LoadSerializedProtoTest) {
+TEST(SentencepieceProcessorTest, FlatResultTest) {
   ModelProto model_proto;
   auto *sp1 = model_proto.add_pieces();
   sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
   sp1->set_piece("<unk>");
-  AddPiece(&model_proto, WS, 0.0);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
   *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
   SentencePieceProcessor sp;
-  EXPECT_FALSE(sp.LoadFromSerializedProto("__NOT_A_PROTO__").ok());
-  EXPECT_TRUE(sp.LoadFromSerializedProto(model_proto.SerializeAsString()).ok());
-  EXPECT_EQ(model_proto.SerializeAsString(),
-            sp.model_proto().SerializeAsString());
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  const std::vector<absl::string_view> inputs = {"ab ba", "", "xab", "a"};
+  for (const uint32_t flags :
+       {0u, +kFlatResultOffsets, +kFlatResultPieces,
+        kFlatResultOffsets | kFlatResultPieces}) {
+    std::string output;
+    ASSERT_TRUE(sp.EncodeAsFlatResult(inputs, flags, 2, &output).ok());
+    FlatResultView view;
+    ASSERT_TRUE(view.Init(output).ok());
+    EXPECT_EQ(flags, view.flags());
+    EXPECT_EQ(output.size(), view.data().size());
+    ASSERT_EQ(inputs.size(), view.num_rows());
+
+    // The rows are those of Encode(), read in place.
+    size_t num_ids = 0;
+    for (size_t r = 0; r < inputs.size(); ++r) {
+      SentencePieceText spt;
+      ASSERT_TRUE(sp.Encode(inputs[r], &spt).ok());
+      ASSERT_EQ(spt.pieces_size(), view.row_end(r) - view.row_begin(r));
+      for (int k = 0; k < spt.pieces_size(); ++k) {
+        const size_t i = view.row_begin(r) + k;
+        EXPECT_EQ(spt.pieces(k).id(), view.id(i));
+        if (view.has_offsets()) {
+          EXPECT_EQ(spt.pieces(k).begin(), view.begin(i));
+          EXPECT_EQ(spt.pieces(k).end(), view.end(i));
+        }
+        if (view.has_pieces()) {
+          EXPECT_EQ(sp.IdToPiece(spt.pieces(k).id()), view.piece(i));
+        }
+      }
+      num_ids += spt.pieces_size();
+    }
+    EXPECT_EQ(num_ids, view.num_ids());
+
+    // Truncated and corrupted results are rejected.
+    EXPECT_FALSE(view.Init(absl::string_view(output).substr(
+                               0, output.size() - 1)).ok());
+    std::string corrupted = output;
+    corrupted[4] = 2;  // version
+    EXPECT_FALSE(view.Init(corrupted).ok());
+    corrupted = output;
+    corrupted[FlatResultView::kHeaderSize + 4] = 100;  // row_offsets[1]
+    EXPECT_FALSE(view.Init(corrupted).ok());
+  }
+
+  // One row per hypothesis.
+  std::string output;
+  ASSERT_TRUE(sp.NBestEncodeAsFlatResult("ab", 2, kFlatResultPieces, &output)
+                  .ok());
+  FlatResultView view;
+  ASSERT_TRUE(view.Init(output).ok());
+  std::vector<std::vector<std::string>> nbest;
+  ASSERT_TRUE(sp.NBestEncode("ab", 2, &nbest).ok());
+  ASSERT_EQ(nbest.size(), view.num_rows());
+  for (size_t r = 0; r < nbest.size(); ++r) {
+    std::vector<std::string> pieces;
+    for (size_t i = view.row_begin(r); i < view.row_end(r); ++i) {
+      pieces.emplace_back(view.piece(i));
+    }
+    EXPECT_EQ(nbest[r], pieces);
+  }
+
+  EXPECT_FALSE(sp.EncodeAsFlatResult(inputs, 4, 1, &output).ok());
+  EXPECT_FALSE(sp.EncodeAsFlatResult(inputs, 0, 1, nullptr).ok());
+  EXPECT_FALSE(view.Init("SPFR").ok());
+  EXPECT_FALSE(view.Init(std::string(24, 'x')).ok());
 }
 
-TEST(SentencePieceProcessorTest, EndToEndTest) {
+TEST(SentencepieceProcessorTest, EncodeBatchPaddedTest) {
   ModelProto model_proto;
   auto *sp1 = model_proto.add_pieces();
   auto *sp2 = model_proto.add_pieces();
   auto *sp3 = model_proto.add_pieces();
-
+  auto *sp4 = model_proto.add_pieces();
   sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
   sp1->set_piece("<unk>");
   sp2->set_type(ModelProto::SentencePiece::CONTROL);
   sp2->set_piece("<s>");
   sp3->set_type(ModelProto::SentencePiece::CONTROL);
   sp3->set_piece("</s>");
-
+  sp4->set_type(ModelProto::SentencePiece::CONTROL);
+  sp4->set_piece("<pad>");
   AddPiece(&model_proto, "a", 0.0);
   AddPiece(&model_proto, "b", 0.3);
-  AddPiece(&model_proto, "c", 0.2);
   AddPiece(&model_proto, "ab", 1.0);
   AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
-
+  for (const char *piece : {"(#startrepeat)", "(#endrepeat)", "0", "1", "2",
+                            "3", "4", "5", "6", "7", "8", "9"}) {
+    AddPiece(&model_proto, piece, -10.0);
+  }
   *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
-  {
-    auto output = filesystem::NewWritableFile(
-        util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "model"), true);
-    output->Write(model_proto.SerializeAsString());
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_EQ(3, sp.pad_id());
+
+  std::vector<std::string> texts;
+  for (int i = 0; i < 50; ++i) {
+    texts.emplace_back(std::string(i % 7, 'a') + "  ab" + std::string(i, 'b') +
+                       (i % 3 == 0 ? " xyz" : ""));
   }
+  texts.emplace_back("");
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+
+  // The offsets of the pieces of EncodePieces() with the repeat runs.
+  auto expected_offsets = [&](absl::string_view input,
+                              std::vector<size_t> *begins,
+                              std::vector<size_t> *ends) {
+    std::vector<EncodedPiece> pieces;
+    EncodeWorkspace workspace;
+    EXPECT_TRUE(sp.EncodePieces(input, &pieces, &workspace).ok());
+    begins->clear();
+    ends->clear();
+    for (size_t i = 0; i < pieces.size();) {
+      size_t j = i + 1;
+      while (j < pieces.size() && pieces[j].id == pieces[i].id &&
+             !sp.IsUnknown(pieces[i].id)) {
+        ++j;
+      }
+      begins->push_back(pieces[i].begin);
+      ends->push_back(pieces[j - 1].end);
+      if (j - i > 1) {
+        const size_t size = 2 + std::to_string(j - i).size();
+        begins->insert(begins->end(), size, pieces[j - 1].end);
+        ends->insert(ends->end(), size, pieces[j - 1].end);
+      }
+      i = j;
+    }
+  };
 
-  SentencePieceProcessor sp;
-  EXPECT_TRUE(
-      sp.Load(util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "model")).ok());
+  for (const std::string extra_options : {"", "bos:eos"}) {
+    ASSERT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+    for (const int num_threads : {0, 1, 4}) {
+      const size_t max_length = 60;
+      std::vector<int> ids(inputs.size() * max_length, -2);
+      std::vector<size_t> lengths(inputs.size()),
+          begins(inputs.size() * max_length), ends(inputs.size() * max_length);
+      EXPECT_TRUE(sp.EncodeBatchPadded(inputs, max_length, ids.data(),
+                                       lengths.data(), begins.data(),
+                                       ends.data(), num_threads)
+                      .ok());
+
+      std::vector<int> flat_ids;
+      std::vector<size_t> offsets, flat_begins, flat_ends;
+      EXPECT_TRUE(sp.EncodeBatch(inputs, &flat_ids, &offsets, &flat_begins,
+                                 &flat_ends, num_threads)
+                      .ok());
+      ASSERT_EQ(flat_ids.size(), flat_begins.size());
+      ASSERT_EQ(flat_ids.size(), flat_ends.size());
+
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        const std::vector<int> expected = sp.EncodeAsIds(inputs[i]);
+        std::vector<size_t> expected_begins, expected_ends;
+        expected_offsets(inputs[i], &expected_begins, &expected_ends);
+        ASSERT_EQ(expected.size(), lengths[i]);
+        std::vector<int> padded = expected;
+        padded.resize(max_length, sp.pad_id());
+        EXPECT_EQ(padded, std::vector<int>(ids.begin() + i * max_length,
+                                           ids.begin() + (i + 1) * max_length));
+        expected_begins.resize(max_length, 0);
+        expected_ends.resize(max_length, 0);
+        EXPECT_EQ(expected_begins,
+                  std::vector<size_t>(begins.begin() + i * max_length,
+                                      begins.begin() + (i + 1) * max_length));
+        EXPECT_EQ(expected_ends,
+                  std::vector<size_t>(ends.begin() + i * max_length,
+                                      ends.begin() + (i + 1) * max_length));
+
+        EXPECT_EQ(expected, std::vector<int>(flat_ids.begin() + offsets[i],
+                                             flat_ids.begin() + offsets[i + 1]));
+        EXPECT_EQ(std::vector<size_t>(begins.begin() + i * max_length,
+                                      begins.begin() + i * max_length +
+                                          lengths[i]),
+                  std::vector<size_t>(flat_begins.begin() + offsets[i],
+                                      flat_begins.begin() + offsets[i + 1]));
+      }
+
+      // The offsets are optional.
+      std::vector<int> ids_only(inputs.size() * max_length);
+      EXPECT_TRUE(sp.EncodeBatchPadded(inputs, max_length, ids_only.data(),
+                                       nullptr, nullptr, nullptr, num_threads)
+                      .ok());
+      EXPECT_EQ(ids, ids_only);
+    }
+  }
 
-  EXPECT_EQ(model_proto.SerializeAsString(),
-            sp.model_proto().SerializeAsString());
+  // Too long inputs fail unless they are truncated.
+  std::vector<int> ids(inputs.size() * 8);
+  std::vector<size_t> lengths(inputs.size()), begins(inputs.size() * 8);
+  EXPECT_EQ(util::StatusCode::kOutOfRange,
+            sp.EncodeBatchPadded(inputs, 8, ids.data(), lengths.data(),
+                                 nullptr, nullptr, 2)
+                .code());
+  for (const auto side : {TruncationSide::kRight, TruncationSide::kLeft}) {
+    ASSERT_TRUE(sp.SetEncodeMaxTokens(8, side).ok());
+    EXPECT_TRUE(sp.EncodeBatchPadded(inputs, 8, ids.data(), lengths.data(),
+                                     begins.data(), nullptr, 2)
+                    .ok());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      std::vector<int> expected = sp.EncodeAsIds(inputs[i]);
+      EXPECT_EQ(expected.size(), lengths[i]);
+      expected.resize(8, sp.pad_id());
+      EXPECT_EQ(expected,
+                std::vector<int>(ids.begin() + i * 8, ids.begin() + i * 8 + 8));
+    }
+  }
+}
 
-  EXPECT_EQ(8, sp.GetPieceSize());
-  EXPECT_EQ(0, sp.PieceToId("<unk>"));
-  EXPECT_EQ(1, sp.PieceToId("<s>"));
-  EXPECT_EQ(2, sp.PieceToId("</s>"));
-  EXPECT_EQ(3, sp.PieceToId("a"));
-  EXPECT_EQ(4, sp.PieceToId("b"));
-  EXPECT_EQ(5, sp.PieceToId("c"));
-  EXPECT_EQ(6, sp.PieceToId("ab"));
-  EXPECT_EQ(7, sp.PieceToId("\xE2\x96\x81"));
+TEST(SentencepieceProcessorTest, EncodeBatchBucketedTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
-  EXPECT_EQ("<unk>", sp.IdToPiece(0));
-  EXPECT_EQ("<s>", sp.IdToPiece(1));
-  EXPECT_EQ("</s>", sp.IdToPiece(2));
-  EXPECT_EQ("a", sp.IdToPiece(3));
-  EXPECT_EQ("b", sp.IdToPiece(4));
-  EXPECT_EQ("c", sp.IdToPiece(5));
-  EXPECT_EQ("ab", sp.IdToPiece(6));
-  EXPECT_EQ("\xE2\x96\x81", sp.IdToPiece(7));
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
 
-  EXPECT_NEAR(0.0, sp.GetScore(0), 0.001);
-  EXPECT_NEAR(0.0, sp.GetScore(1), 0.001);
-  EXPECT_NEAR(0.0, sp.GetScore(2), 0.001);
-  EXPECT_NEAR(0.0, sp.GetScore(3), 0.001);
-  EXPECT_NEAR(0.3, sp.GetScore(4), 0.001);
-  EXPECT_NEAR(0.2, sp.GetScore(5), 0.001);
-  EXPECT_NEAR(1.0, sp.GetScore(6), 0.001);
-  EXPECT_NEAR(3.0, sp.GetScore(7), 0.001);
+  std::vector<std::string> texts;
+  for (int i = 0; i < 100; ++i) {
+    std::string text;
+    for (int j = 0; j < (i * 37) % 23; ++j) text += j % 2 ? " a" : " b";
+    texts.push_back(text);
+  }
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+  std::vector<int> expected_ids;
+  std::vector<size_t> expected_offsets;
+  ASSERT_TRUE(
+      sp.EncodeBatch(inputs, &expected_ids, &expected_offsets, 1).ok());
 
-  EXPECT_TRUE(sp.IsUnknown(0));
-  EXPECT_FALSE(sp.IsUnknown(1));
-  EXPECT_FALSE(sp.IsUnknown(2));
-  EXPECT_FALSE(sp.IsUnknown(3));
-  EXPECT_FALSE(sp.IsUnknown(4));
-  EXPECT_FALSE(sp.IsUnknown(5));
-  EXPECT_FALSE(sp.IsUnknown(6));
-  EXPECT_FALSE(sp.IsUnknown(7));
+  for (const size_t max_tokens : {1, 20, 64, 1000}) {
+    std::vector<int> ids;
+    std::vector<size_t> offsets, order, batch_offsets;
+    ASSERT_TRUE(sp.EncodeBatchBucketed(inputs, max_tokens, &ids, &offsets,
+                                       &order, &batch_offsets, 4)
+                    .ok());
+    EXPECT_EQ(expected_ids, ids);
+    EXPECT_EQ(expected_offsets, offsets);
+
+    auto length = [&offsets](size_t i) {
+      return std::max<size_t>(offsets[i + 1] - offsets[i], 1);
+    };
+    std::vector<size_t> sorted = order;
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t i = 0; i < sorted.size(); ++i) EXPECT_EQ(i, sorted[i]);
+    for (size_t i = 1; i < order.size(); ++i) {
+      EXPECT_LE(length(order[i - 1]), length(order[i]));
+    }
 
-  EXPECT_FALSE(sp.IsControl(0));
-  EXPECT_TRUE(sp.IsControl(1));
-  EXPECT_TRUE(sp.IsControl(2));
-  EXPECT_FALSE(sp.IsControl(3));
-  EXPECT_FALSE(sp.IsControl(4));
-  EXPECT_FALSE(sp.IsControl(5));
-  EXPECT_FALSE(sp.IsControl(6));
-  EXPECT_FALSE(sp.IsControl(7));
+    // Every batch fits in max_tokens, and could not take the next input.
+    ASSERT_EQ(0, batch_offsets.front());
+    ASSERT_EQ(inputs.size(), batch_offsets.back());
+    for (size_t b = 0; b + 1 < batch_offsets.size(); ++b) {
+      const size_t size = batch_offsets[b + 1] - batch_offsets[b];
+      ASSERT_GT(size, 0);
+      const size_t longest = length(order[batch_offsets[b + 1] - 1]);
+      EXPECT_TRUE(size == 1 || size * longest <= max_tokens);
+      if (b + 2 < batch_offsets.size()) {
+        EXPECT_GT((size + 1) * length(order[batch_offsets[b + 1]]),
+                  max_tokens);
+      }
+    }
+    if (max_tokens == 1) EXPECT_EQ(inputs.size() + 1, batch_offsets.size());
+  }
 
-  EXPECT_EQ(0, sp.unk_id());
-  EXPECT_EQ(1, sp.bos_id());
-  EXPECT_EQ(2, sp.eos_id());
-  EXPECT_EQ(-1, sp.pad_id());
+  std::vector<int> ids;
+  std::vector<size_t> offsets, order, batch_offsets;
+  EXPECT_TRUE(sp.EncodeBatchBucketed({}, 10, &ids, &offsets, &order,
+                                     &batch_offsets, 1)
+                  .ok());
+  EXPECT_TRUE(order.empty());
+  EXPECT_EQ(std::vector<size_t>({0}), batch_offsets);
+  EXPECT_FALSE(sp.EncodeBatchBucketed(inputs, 0, &ids, &offsets, &order,
+                                      &batch_offsets, 1)
+                   .ok());
+  EXPECT_FALSE(sp.EncodeBatchBucketed(inputs, 10, &ids, &offsets, nullptr,
+                                      &batch_offsets, 1)
+                   .ok());
+}
 
-  {
-    // Verify the default encoder version.
-    EXPECT_EQ(EncoderVersion::kOptimized, sp.GetEncoderVersion());
+TEST(SentencepieceProcessorTest, NBestAndSampleEncodeBatchTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "ba", 0.5);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
 
-    // Set the encoder version to original and verify.
-    EXPECT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOriginal).ok());
-    EXPECT_EQ(EncoderVersion::kOriginal, sp.GetEncoderVersion());
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
 
-    // Set back to the default encoder version.
-    EXPECT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOptimized).ok());
+  std::vector<std::string> texts;
+  for (int i = 0; i < 20; ++i) {
+    texts.emplace_back(std::string(i % 5, 'a') + " abab" +
+                       std::string(i, i % 2 ? 'b' : 'a') +
+                       (i % 3 == 0 ? " xyz" : ""));
   }
+  texts.emplace_back("");
+  const std::vector<absl::string_view> inputs(texts.begin(), texts.end());
 
-  {
-    std::vector<std::string> sps;
-    const std::vector<std::string> expected_str = {WS, "ab", "c"};
-    EXPECT_TRUE(sp.Encode("abc", &sps).ok());
-    EXPECT_EQ(expected_str, sps);
+  std::vector<int> ids;
+  std::vector<size_t> offsets, nbest_offsets;
+  EXPECT_TRUE(
+      sp.NBestEncodeBatch(inputs, 5, &ids, &offsets, &nbest_offsets).ok());
+  EXPECT_EQ(inputs.size() + 1, nbest_offsets.size());
+  EXPECT_EQ(nbest_offsets.back() + 1, offsets.size());
+  EXPECT_EQ(ids.size(), offsets.back());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const auto nbests = sp.NBestEncodeAsIds(inputs[i], 5);
+    EXPECT_EQ(nbests.size(), nbest_offsets[i + 1] - nbest_offsets[i]);
+    for (size_t k = 0; k < nbests.size(); ++k) {
+      const size_t j = nbest_offsets[i] + k;
+      EXPECT_EQ(nbests[k], std::vector<int>(ids.begin() + offsets[j],
+                                            ids.begin() + offsets[j + 1]));
+    }
+  }
 
-    std::vector<int> ids;
-    const std::vector<int> expected_id = {7, 6, 5};
-    EXPECT_TRUE(sp.Encode("abc", &ids).ok());
-    EXPECT_EQ(expected_id, ids);
+  for (const int nbest_size : {-1, 1, 5}) {
+    random::GetRandomGenerator()->seed(nbest_size + 10);
+    EXPECT_TRUE(
+        sp.SampleEncodeBatch(inputs, nbest_size, 0.5, &ids, &offsets).ok());
+    EXPECT_EQ(inputs.size() + 1, offsets.size());
+    EXPECT_EQ(ids.size(), offsets.back());
+    random::GetRandomGenerator()->seed(nbest_size + 10);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      EXPECT_EQ(sp.SampleEncodeAsIds(inputs[i], nbest_size, 0.5),
+                std::vector<int>(ids.begin() + offsets[i],
+                                 ids.begin() + offsets[i + 1]));
+    }
   }
 
-  {
-    EXPECT_TRUE(sp.SetEncodeExtraOptions("bos").ok());
+  // The seeded batch does not depend on the threads and samples inputs[i]
+  // as SampleEncode() does with the generator keyed by (seed, i).
+  for (const int nbest_size : {-1, 1, 5}) {
+    std::vector<int> threaded_ids, other_ids;
+    std::vector<size_t> threaded_offsets, other_offsets;
+    EXPECT_TRUE(
+        sp.SampleEncodeBatch(inputs, nbest_size, 0.5, 7, &ids, &offsets, 1)
+            .ok());
+    EXPECT_TRUE(sp.SampleEncodeBatch(inputs, nbest_size, 0.5, 7,
+                                     &threaded_ids, &threaded_offsets, 4)
+                    .ok());
+    EXPECT_EQ(ids, threaded_ids);
+    EXPECT_EQ(offsets, threaded_offsets);
+    EXPECT_EQ(inputs.size() + 1, offsets.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      const random::ScopedCounterGenerator generator(7, i);
+      EXPECT_EQ(sp.SampleEncodeAsIds(inputs[i], nbest_size, 0.5),
+                std::vector<int>(ids.begin() + offsets[i],
+                                 ids.begin() + offsets[i + 1]));
+    }
+    if (nbest_size != 1) {
+      EXPECT_TRUE(sp.SampleEncodeBatch(inputs, nbest_size, 0.5, 8, &other_ids,
+                                       &other_offsets, 4)
+                      .ok());
+      EXPECT_NE(ids, other_ids);
+    }
+  }
 
-    std::vector<std::string> sps;
-    const std::vector<std::string> expected_str = {"<s>", WS, "ab", "c"};
-    EXPECT_TRUE(sp.Encode("abc", &sps).ok());
-    EXPECT_EQ(expected_str, sps);
+  EXPECT_FALSE(sp.SampleEncodeBatch(inputs, 1, 0.5, nullptr, &offsets).ok());
+  EXPECT_FALSE(
+      sp.SampleEncodeBatch(inputs, 1, 0.5, 7, nullptr, &offsets, 1).ok());
+  EXPECT_FALSE(sp.NBestEncodeBatch(inputs, 5, &ids, nullptr, nullptr).ok());
+}
 
-    std::vector<int> ids;
-    const std::vector<int> expected_id = {1, 7, 6, 5};
-    EXPECT_TRUE(sp.Encode("abc", &ids).ok());
+TEST(SentencepieceProcessorTest, NBestIdsTest) {
+  NBestIds nbest;
+  nbest.Add({1, 2, 3, 4}, -1.0);
+  nbest.Add({1, 2, 5}, -2.0);
+  nbest.Add({1, 2, 3, 6, 7}, -3.0);
+  nbest.Add({8}, -4.0);
+  nbest.Add({1, 2, 5}, -5.0);
+  nbest.Add({}, -6.0);
+  EXPECT_EQ(6, nbest.size());
+  EXPECT_EQ(8, nbest.num_stored_ids());
+  EXPECT_EQ(std::vector<int>({1, 2, 3, 4}), nbest[0].ToVector());
+  EXPECT_EQ(std::vector<int>({1, 2, 5}), nbest[1].ToVector());
+  EXPECT_EQ(std::vector<int>({1, 2, 3, 6, 7}), nbest[2].ToVector());
+  EXPECT_EQ(std::vector<int>({8}), nbest[3].ToVector());
+  EXPECT_EQ(std::vector<int>({1, 2, 5}), nbest[4].ToVector());
+  EXPECT_TRUE(nbest[5].ToVector().empty());
+  EXPECT_EQ(5, nbest[2].size());
+  EXPECT_EQ(-3.0, nbest[2].score());
+  int sum = 0;
+  for (const int id : nbest[2]) sum += id;
+  EXPECT_EQ(19, sum);
+  nbest.Clear();
+  EXPECT_TRUE(nbest.empty());
+  EXPECT_EQ(0, nbest.num_stored_ids());
+
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "ba", 0.5);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  for (const std::string options : {"", "reverse"}) {
+    ASSERT_TRUE(sp.SetEncodeExtraOptions(options).ok());
+    for (const std::string input : {"abababbabab xyz", "ab ba", ""}) {
+      std::vector<std::vector<int>> expected;
+      NBestSentencePieceText spt;
+      ASSERT_TRUE(sp.NBestEncode(input, 64, &expected).ok());
+      ASSERT_TRUE(sp.NBestEncode(input, 64, &spt).ok());
+      ASSERT_TRUE(sp.NBestEncode(input, 64, &nbest).ok());
+      ASSERT_EQ(expected.size(), nbest.size());
+      size_t total = 0;
+      for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(expected[i], nbest[i].ToVector());
+        EXPECT_EQ(expected[i].size(), nbest[i].size());
+        EXPECT_NEAR(spt.nbests(i).score(), nbest[i].score(), 1e-5);
+        total += expected[i].size();
+      }
+      EXPECT_LE(nbest.num_stored_ids(), total);
+      if (expected.size() > 1) EXPECT_LT(nbest.num_stored_ids(), total);
+    }
+  }
+  EXPECT_FALSE(sp.NBestEncode("ab", 5, static_cast<NBestIds *>(nullptr)).ok());
+}
+
+TEST(SentencepieceProcessorTest, SampleEncodeMultipleTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "ba", 0.5);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  const absl::string_view kInput = "abab bab";
+  std::vector<std::vector<int>> ids;
+  std::vector<float> scores;
+
+  EXPECT_TRUE(sp.SampleEncode(kInput, -1, 0.5, 30, false, &ids, &scores).ok());
+  EXPECT_EQ(30, ids.size());
+  EXPECT_EQ(30, scores.size());
+  for (const float score : scores) EXPECT_LE(score, 0.0);
+
+  for (const int nbest_size : {-1, 5}) {
+    EXPECT_TRUE(
+        sp.SampleEncode(kInput, nbest_size, 0.5, 200, true, &ids, &scores)
+            .ok());
+    EXPECT_EQ(ids.size(), scores.size());
+    EXPECT_EQ(ids.size(), std::set<std::vector<int>>(ids.begin(), ids.end())
+                              .size());
+    double total = 0.0;
+    for (const float score : scores) total += std::exp(score);
+    EXPECT_LE(total, 1.0 + 1e-5);
+    if (nbest_size > 0) {
+      const auto nbests = sp.NBestEncodeAsIds(kInput, nbest_size);
+      EXPECT_EQ(nbests.size(), ids.size());
+      EXPECT_NEAR(1.0, total, 1e-5);
+      for (const auto &sample : ids) {
+        EXPECT_TRUE(std::find(nbests.begin(), nbests.end(), sample) !=
+                    nbests.end());
+      }
+    }
+  }
+
+  EXPECT_TRUE(sp.SampleEncode(kInput, 1, 0.5, 3, false, &ids, nullptr).ok());
+  EXPECT_EQ(3, ids.size());
+  for (const auto &sample : ids) {
+    EXPECT_EQ(sp.SampleEncodeAsIds(kInput, 1, 0.5), sample);
+  }
+
+  EXPECT_TRUE(sp.SampleEncode("", -1, 0.5, 2, false, &ids, nullptr).ok());
+  EXPECT_EQ(2, ids.size());
+  EXPECT_TRUE(ids[0].empty());
+
+  EXPECT_FALSE(sp.SampleEncode(kInput, -1, 0.5, 0, false, &ids, nullptr).ok());
+  EXPECT_FALSE(sp.SampleEncode(kInput, 1024, 0.5, 1, false, &ids, nullptr).ok());
+  EXPECT_FALSE(sp.SampleEncode(kInput, -1, 0.5, 1, false, nullptr, nullptr).ok());
+}
+
+TEST(SentencepieceProcessorTest, SampleBeamTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "ba", 0.5);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_FALSE(sp.SetSampleBeam(-0.1).ok());
+  EXPECT_FALSE(sp.SetSampleBeam(1.5).ok());
+
+  std::string input;
+  for (int i = 0; i < 200; ++i) input += i % 3 ? "ab" : "ba b";
+  const EncodeStats before = SentencePieceProcessor::GetStats();
+  ASSERT_TRUE(sp.SetSampleBeam(1e-3).ok());
+  std::vector<std::vector<int>> ids;
+  std::vector<float> scores;
+  ASSERT_TRUE(sp.SampleEncode(input, -1, 1.0, 20, false, &ids, &scores).ok());
+  EXPECT_EQ(20, ids.size());
+  for (size_t i = 0; i < ids.size(); ++i) {
+    EXPECT_LE(scores[i], 0.0);
+    EXPECT_EQ(input, sp.DecodeIds(ids[i]));
+  }
+  std::vector<std::string> pieces;
+  ASSERT_TRUE(sp.SampleEncode(input, -1, 1.0, &pieces).ok());
+  EXPECT_EQ(input, sp.DecodePieces(pieces));
+  const EncodeStats after = SentencePieceProcessor::GetStats();
+  if (after.enabled) {
+    EXPECT_LT(before.sample_pruned_mass_ppb, after.sample_pruned_mass_ppb);
+  }
+
+  // The beam of 1 samples the best piece at every position.
+  ASSERT_TRUE(sp.SetSampleBeam(1.0).ok());
+  ASSERT_TRUE(sp.SampleEncode(input, -1, 1.0, 5, true, &ids, &scores).ok());
+  EXPECT_EQ(1, ids.size());
+  ASSERT_TRUE(sp.SetSampleBeam(0.0).ok());
+}
+
+TEST(SentencepieceProcessorTest, LatticeStatisticsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "ba", 0.5);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  const std::vector<absl::string_view> inputs = {"abab bab", "ba", "", "aaa",
+                                                 "b a b"};
+  std::vector<float> entropies;
+  EXPECT_TRUE(sp.CalculateEntropy(inputs, 0.5, &entropies, 2).ok());
+  ASSERT_EQ(inputs.size(), entropies.size());
+  std::vector<float> total(sp.GetPieceSize(), 0.0);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    float entropy = -1.0;
+    EXPECT_TRUE(sp.CalculateEntropy(inputs[i], 0.5, &entropy).ok());
+    EXPECT_NEAR(entropy, entropies[i], 1e-5);
+    EXPECT_GE(entropy, 0.0);
+
+    // Every character is covered by exactly one piece of a segmentation, so
+    // the expected numbers of characters sum to the normalized length.
+    std::vector<float> marginals;
+    EXPECT_TRUE(sp.PieceMarginals(inputs[i], 0.5, &marginals).ok());
+    ASSERT_EQ(sp.GetPieceSize(), marginals.size());
+    double num_chars = 0.0;
+    for (int id = 0; id < sp.GetPieceSize(); ++id) {
+      EXPECT_GE(marginals[id], 0.0);
+      if (sp.IsUnknown(id)) continue;
+      num_chars += marginals[id] *
+                   string_util::UTF8ToUnicodeText(sp.IdToPiece(id)).size();
+      total[id] += marginals[id];
+    }
+    // The normalizer only prepends "\xE2\x96\x81" and replaces the spaces.
+    EXPECT_NEAR(inputs[i].empty() ? 0 : inputs[i].size() + 1, num_chars,
+                1e-4);
+  }
+  EXPECT_EQ(0.0, entropies[2]);
+  EXPECT_EQ(0.0, entropies[3]);  // "\xE2\x96\x81aaa" has one segmentation.
+  EXPECT_GT(entropies[0], entropies[1]);
+
+  for (const int num_threads : {1, 3}) {
+    std::vector<float> marginals;
+    EXPECT_TRUE(sp.PieceMarginals(inputs, 0.5, &marginals, num_threads).ok());
+    ASSERT_EQ(total.size(), marginals.size());
+    for (size_t id = 0; id < total.size(); ++id) {
+      EXPECT_NEAR(total[id], marginals[id], 1e-4);
+    }
+  }
+
+  // A larger alpha concentrates the distribution on the best segmentation.
+  float sharp = -1.0;
+  EXPECT_TRUE(sp.CalculateEntropy(inputs[0], 10.0, &sharp).ok());
+  EXPECT_LT(sharp, entropies[0]);
+
+  EXPECT_FALSE(sp.CalculateEntropy(inputs[0], 0.5, nullptr).ok());
+  EXPECT_FALSE(sp.PieceMarginals(inputs[0], 0.5, nullptr).ok());
+}
+
+TEST(SentencePieceProcessorTest, LoadInvalidModelTest) {
+  SentencePieceProcessor sp;
+  EXPECT_FALSE(sp.Load("").ok());
+  EXPECT_FALSE(sp.Load("__UNKNOWN_FILE__").ok());
+}
+
+TEST(SentencePieceProcessorTest, LoadSerializedProtoTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, WS, 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  EXPECT_FALSE(sp.LoadFromSerializedProto("__NOT_A_PROTO__").ok());
+  EXPECT_TRUE(sp.LoadFromSerializedProto(model_proto.SerializeAsString()).ok());
+  EXPECT_EQ(model_proto.SerializeAsString(),
+            sp.model_proto().SerializeAsString());
+}
+
+TEST(SentencePieceProcessorTest, LoadPrecompiledModelTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "precompiled_model");
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    EXPECT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+
+    SentencePieceProcessor expected_sp, sp;
+    EXPECT_TRUE(expected_sp.Load(model_proto).ok());
+    EXPECT_TRUE(sp.Load(filename).ok());
+    EXPECT_EQ(model_proto.SerializeAsString(),
+              sp.model_proto().SerializeAsString());
+    std::vector<std::string> expected, pieces;
+    EXPECT_TRUE(expected_sp.Encode("abab b ba", &expected).ok());
+    EXPECT_TRUE(sp.Encode("abab b ba", &pieces).ok());
+    EXPECT_EQ(expected, pieces);
+    EXPECT_EQ(3, sp.PieceToId("ab"));
+    EXPECT_EQ(0, sp.PieceToId("abc"));
+    EXPECT_EQ(filename, sp.precompiled_model_file());
+    EXPECT_EQ("", expected_sp.precompiled_model_file());
+  }
+
+  std::string blob;
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&blob));
+  }
+  auto write_and_load = [&](absl::string_view data) {
+    {
+      auto output = filesystem::NewWritableFile(filename, true);
+      output->Write(data);
+    }
+    SentencePieceProcessor sp;
+    return sp.Load(filename);
+  };
+
+  EXPECT_TRUE(write_and_load(blob).ok());
+  EXPECT_FALSE(write_and_load(blob.substr(0, blob.size() - 1)).ok());
+  EXPECT_FALSE(write_and_load(blob.substr(0, 8)).ok());
+  std::string bad_version = blob;
+  bad_version[4] = 3;
+  EXPECT_FALSE(write_and_load(bad_version).ok());
+}
+
+TEST(SentencePieceProcessorTest, LoadStaticModelTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "static_model");
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    std::string blob;
+    ASSERT_TRUE(io::SerializePrecompiledModel(model_proto, false, &blob).ok());
+
+    // The bytes of the precompiled model file.
+    ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+    std::string file_blob;
+    {
+      auto input = filesystem::NewReadableFile(filename, true);
+      EXPECT_TRUE(input->ReadAll(&file_blob));
+    }
+    EXPECT_EQ(file_blob, blob);
+
+    // Aligned as the array generated by spm_export_static.
+    std::vector<uint32> data(blob.size() / 4 + 1);
+    memcpy(data.data(), blob.data(), blob.size());
+    const StaticModel model = {
+        "static_model", reinterpret_cast<const unsigned char *>(data.data()),
+        blob.size()};
+
+    SentencePieceProcessor expected_sp, sp;
+    EXPECT_TRUE(expected_sp.Load(model_proto).ok());
+    ASSERT_TRUE(sp.LoadStatic(model).ok());
+    EXPECT_EQ(model_proto.SerializeAsString(),
+              sp.model_proto().SerializeAsString());
+    std::vector<std::string> expected, pieces;
+    EXPECT_TRUE(expected_sp.Encode("abab b ba", &expected).ok());
+    EXPECT_TRUE(sp.Encode("abab b ba", &pieces).ok());
+    EXPECT_EQ(expected, pieces);
+    EXPECT_EQ(3, sp.PieceToId("ab"));
+    // Python's pickle cannot map a static model again.
+    EXPECT_EQ("", sp.precompiled_model_file());
+
+    SentencePieceProcessor bad_sp;
+    EXPECT_FALSE(bad_sp.LoadStatic({"truncated", model.data, 8}).ok());
+    EXPECT_FALSE(bad_sp.LoadStatic({"null", nullptr, 0}).ok());
+    EXPECT_FALSE(bad_sp.LoadStatic({"unaligned", model.data + 1, 8}).ok());
+  }
+
+  std::string serialized = model_proto.SerializeAsString();
+  serialized.resize(serialized.size() / 4 * 4 + 4);
+  std::vector<uint32> data(serialized.size() / 4);
+  memcpy(data.data(), serialized.data(), serialized.size());
+  SentencePieceProcessor sp;
+  EXPECT_FALSE(sp.LoadStatic({"proto",
+                              reinterpret_cast<const unsigned char *>(
+                                  data.data()),
+                              serialized.size()})
+                   .ok());
+}
+
+TEST(SentencePieceProcessorTest, QuantizedPrecompiledModelTest) {
+  const std::string model_prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "quantized");
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--input=", input, " --model_prefix=",
+                               model_prefix,
+                               " --vocab_size=1000 --self_test_sample_size=20"))
+                  .ok());
+  ModelProto model_proto;
+  ASSERT_TRUE(io::LoadModelProto(model_prefix + ".model", &model_proto).ok());
+  EXPECT_EQ(20, model_proto.self_test_data().samples_size());
+
+  const std::string filename = model_prefix + ".precompiled";
+  auto file_size = [&]() {
+    std::string blob;
+    auto input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&blob));
+    return blob.size();
+  };
+  ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+  const size_t float_size = file_size();
+  ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto, true).ok());
+  // The header has one more word, and the table 2.5 bytes per piece.
+  EXPECT_EQ(float_size + 4 + 4 + 2 * 1000 + 500, file_size());
+
+  SentencePieceProcessor expected, sp;
+  ASSERT_TRUE(expected.Load(model_proto).ok());
+  ASSERT_TRUE(sp.Load(filename).ok());
+  EXPECT_EQ(expected.GetScore(100), sp.GetScore(100));
+
+  std::vector<std::string> lines;
+  {
+    auto input_file = filesystem::NewReadableFile(input);
+    std::string line;
+    while (input_file->ReadLine(&line) && lines.size() < 300) {
+      lines.push_back(line);
+    }
+  }
+  for (const auto &line : lines) {
+    std::vector<int> ids, expected_ids;
+    EXPECT_TRUE(sp.Encode(line, &ids).ok());
+    EXPECT_TRUE(expected.Encode(line, &expected_ids).ok());
+    EXPECT_EQ(expected_ids, ids);
+  }
+
+  // The table must belong to the pieces of the model.
+  std::string blob;
+  {
+    auto input_file = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input_file->ReadAll(&blob));
+  }
+  const uint32 trie_size = static_cast<uint8>(blob[12]) |
+                           static_cast<uint8>(blob[13]) << 8 |
+                           static_cast<uint8>(blob[14]) << 16 |
+                           static_cast<uint8>(blob[15]) << 24;
+  // The packed type of piece 0 (UNKNOWN) becomes NORMAL.
+  blob[28 + trie_size + 4 + 2 * 1000] ^= 3;
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(blob);
+  }
+  SentencePieceProcessor bad_sp;
+  EXPECT_FALSE(bad_sp.Load(filename).ok());
+
+  // Only unigram models are quantized.
+  ModelProto bpe_proto = model_proto;
+  bpe_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::BPE);
+  EXPECT_FALSE(io::SavePrecompiledModel(filename, bpe_proto, true).ok());
+}
+
+TEST(SentencePieceProcessorTest, QuantizedScoresVerificationTest) {
+  // The large score makes the scale about 0.92, which rounds "a" and "b" to
+  // -1.83 each and "ab" to -2.75, so that the quantized model prefers "ab".
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", -1.4);
+  AddPiece(&model_proto, "b", -1.4);
+  AddPiece(&model_proto, "ab", -2.9);
+  AddPiece(&model_proto, "c", -30000.0);
+  AddPiece(&model_proto, WS, 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::UNIGRAM);
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "quantized_verify");
+  EXPECT_TRUE(io::SavePrecompiledModel(filename, model_proto, true).ok());
+
+  auto *sample = model_proto.mutable_self_test_data()->add_samples();
+  sample->set_input("ab");
+  sample->set_expected(WS " a b");
+  EXPECT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+  EXPECT_FALSE(io::SavePrecompiledModel(filename, model_proto, true).ok());
+}
+
+TEST(SentencePieceProcessorTest, SelfTestModeTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  auto *sample = model_proto.mutable_self_test_data()->add_samples();
+  sample->set_input("abba");
+  sample->set_expected(WS " ab b a");
+
+  ModelProto bad_model_proto = model_proto;
+  bad_model_proto.mutable_self_test_data()->mutable_samples(0)->set_expected(
+      WS " a b b a");
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "self_test_model");
+  auto read_fingerprint = [&]() {
+    std::string blob;
+    auto input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&blob));
+    EXPECT_LE(24, blob.size());
+    return blob.substr(20, 4);
+  };
+
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    bad_model_proto.mutable_trainer_spec()->set_model_type(type);
+
+    {
+      SentencePieceProcessor sp;
+      EXPECT_TRUE(sp.Load(model_proto).ok());
+      EXPECT_TRUE(sp.SelfTest().ok());
+      EXPECT_FALSE(sp.Load(bad_model_proto).ok());
+      EXPECT_TRUE(sp.SetSelfTestMode(SelfTestMode::kCached).ok());
+      EXPECT_FALSE(sp.Load(bad_model_proto).ok());
+      EXPECT_TRUE(sp.SetSelfTestMode(SelfTestMode::kSkip).ok());
+      EXPECT_TRUE(sp.Load(bad_model_proto).ok());
+      EXPECT_FALSE(sp.SelfTest().ok());
+      std::vector<std::string> pieces;
+      EXPECT_TRUE(sp.Encode("abba", &pieces).ok());
+      EXPECT_EQ(std::vector<std::string>({WS, "ab", "b", "a"}), pieces);
+    }
+
+    // Only the model which passes its self-test is marked as verified.
+    EXPECT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+    EXPECT_NE(std::string(4, '\0'), read_fingerprint());
+    for (const auto mode :
+         {SelfTestMode::kRun, SelfTestMode::kCached, SelfTestMode::kSkip}) {
+      SentencePieceProcessor sp;
+      EXPECT_TRUE(sp.SetSelfTestMode(mode).ok());
+      EXPECT_TRUE(sp.Load(filename).ok());
+      EXPECT_TRUE(sp.SelfTest().ok());
+    }
+
+    EXPECT_TRUE(io::SavePrecompiledModel(filename, bad_model_proto).ok());
+    EXPECT_EQ(std::string(4, '\0'), read_fingerprint());
+    for (const auto mode : {SelfTestMode::kRun, SelfTestMode::kCached}) {
+      SentencePieceProcessor sp;
+      EXPECT_TRUE(sp.SetSelfTestMode(mode).ok());
+      EXPECT_FALSE(sp.Load(filename).ok());
+    }
+    {
+      SentencePieceProcessor sp;
+      EXPECT_TRUE(sp.SetSelfTestMode(SelfTestMode::kSkip).ok());
+      EXPECT_TRUE(sp.Load(filename).ok());
+      EXPECT_FALSE(sp.SelfTest().ok());
+    }
+  }
+
+  // A changed model is tested again, as its fingerprint no longer matches.
+  EXPECT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+  std::string blob;
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&blob));
+  }
+  const size_t pos = blob.rfind(WS " ab b a");
+  ASSERT_NE(std::string::npos, pos);
+  blob.replace(pos, strlen(WS " ab b a"), WS " a bb a");
+  {
+    auto output = filesystem::NewWritableFile(filename, true);
+    output->Write(blob);
+  }
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.SetSelfTestMode(SelfTestMode::kCached).ok());
+  EXPECT_FALSE(sp.Load(filename).ok());
+}
+
+TEST(SentencePieceProcessorTest, PrecompiledTrieBoundsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::UNIGRAM);
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "trie_bounds_model");
+  ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+  std::string blob;
+  {
+    auto input = filesystem::NewReadableFile(filename, true);
+    EXPECT_TRUE(input->ReadAll(&blob));
+  }
+  ASSERT_LE(24, blob.size());
+
+  // The file stores little-endian words.
+  auto get = [](const std::string &data, size_t pos) {
+    uint32 value = 0;
+    for (int i = 3; i >= 0; --i)
+      value = (value << 8) | static_cast<unsigned char>(data[pos + i]);
+    return value;
+  };
+  auto set = [](std::string *data, size_t pos, uint32 value) {
+    for (int i = 0; i < 4; ++i) (*data)[pos + i] = (value >> (8 * i)) & 0xFF;
+  };
+  const uint32 trie_size = get(blob, 12);
+  ASSERT_LT(0, trie_size);
+  ASSERT_LE(24 + trie_size, blob.size());
+
+  // PrecompiledFingerprint() of the body of `data`.
+  auto fingerprint = [&](const std::string &data) {
+    uint64 hash = 0xcbf29ce484222325;
+    size_t i = 24;
+    for (; i + 4 <= data.size(); i += 4)
+      hash = (hash ^ get(data, i)) * 0x100000001b3;
+    for (; i < data.size(); ++i)
+      hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3;
+    const uint32 value = static_cast<uint32>(hash ^ (hash >> 32));
+    return value == 0 ? 1 : value;
+  };
+  ASSERT_EQ(get(blob, 20), fingerprint(blob));
+
+  // Stores the fingerprint of the changed body, as a verified model would
+  // have, so that SelfTestMode::kCached skips the self-test but not the
+  // checks of the trie.
+  auto write_and_load = [&](std::string data, SelfTestMode mode) {
+    set(&data, 20, fingerprint(data));
+    {
+      auto output = filesystem::NewWritableFile(filename, true);
+      output->Write(data);
+    }
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.SetSelfTestMode(mode).ok());
+    return sp.Load(filename);
+  };
+
+  const auto modes = {SelfTestMode::kRun, SelfTestMode::kCached,
+                      SelfTestMode::kSkip};
+  for (const auto mode : modes) {
+    EXPECT_TRUE(write_and_load(blob, mode).ok());
+  }
+
+  // The children of the root are moved out of the array.
+  std::string bad_offset = blob;
+  set(&bad_offset, 24, (get(blob, 24) & 0x3FF) | (0x1FFFFFU << 10));
+  for (const auto mode : modes) {
+    EXPECT_FALSE(write_and_load(bad_offset, mode).ok());
+  }
+
+  // A value is not a piece id.
+  size_t value_pos = 24;
+  while (value_pos < 24 + trie_size && (get(blob, value_pos) >> 31) == 0)
+    value_pos += 4;
+  ASSERT_LT(value_pos, 24 + trie_size);
+  std::string bad_value = blob;
+  set(&bad_value, value_pos, 0xFFFFFFFF);
+  for (const auto mode : modes) {
+    EXPECT_FALSE(write_and_load(bad_value, mode).ok());
+  }
+}
+
+TEST(SentencePieceProcessorTest, DecodeOnlyLoadModeTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  AddPiece(&model_proto, WS "ab", 2.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  // The self-test is not run, as it encodes.
+  auto *sample = model_proto.mutable_self_test_data()->add_samples();
+  sample->set_input("abba");
+  sample->set_expected(WS " a b b a");
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "decode_only_model");
+  const std::vector<int> ids = {5, 2, 3, 4, 1, 0};
+
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+
+    SentencePieceProcessor full;
+    ASSERT_TRUE(full.SetSelfTestMode(SelfTestMode::kSkip).ok());
+    ASSERT_TRUE(full.Load(model_proto).ok());
+
+    for (const bool precompiled : {false, true}) {
+      SentencePieceProcessor sp;
+      ASSERT_TRUE(sp.SetLoadMode(LoadMode::kDecodeOnly).ok());
+      ASSERT_TRUE(precompiled ? sp.Load(filename).ok()
+                              : sp.Load(model_proto).ok());
+      EXPECT_TRUE(sp.status().ok());
+
+      EXPECT_EQ(full.GetPieceSize(), sp.GetPieceSize());
+      for (int id = 0; id < sp.GetPieceSize(); ++id) {
+        EXPECT_EQ(full.IdToPiece(id), sp.IdToPiece(id));
+        EXPECT_EQ(id, sp.PieceToId(full.IdToPiece(id)));
+      }
+      std::string expected, detokenized;
+      EXPECT_TRUE(full.Decode(ids, &expected).ok());
+      EXPECT_TRUE(sp.Decode(ids, &detokenized).ok());
+      EXPECT_EQ(expected, detokenized);
+      EXPECT_EQ(full.DecodeIds(ids), sp.DecodeIds(ids));
+      EXPECT_EQ(full.DecodeIdsAsSerializedProto(ids),
+                sp.DecodeIdsAsSerializedProto(ids));
+      std::vector<std::string> batch;
+      EXPECT_TRUE(sp.DecodeBatch(ids, {0, 2, 6}, &batch, 1).ok());
+      EXPECT_EQ(2, batch.size());
+
+      // The encode methods fail without the normalizer.
+      std::vector<int> encoded;
+      const auto status = sp.Encode("abba", &encoded);
+      EXPECT_EQ(util::StatusCode::kFailedPrecondition, status.code());
+      EXPECT_TRUE(encoded.empty());
+      SentencePieceText spt;
+      EXPECT_FALSE(sp.Encode("abba", &spt).ok());
+      EXPECT_FALSE(sp.SelfTest().ok());
+      StreamingEncoder encoder(sp);
+      EXPECT_FALSE(encoder.Push("abba", &encoded).ok());
+
+      const MemoryUsage usage = sp.GetMemoryUsage();
+      EXPECT_EQ(0, usage.model_tries);
+      EXPECT_EQ(0, usage.normalizers);
+      EXPECT_LT(0, usage.decode_table);
+
+      // A full model can be loaded again.
+      ASSERT_TRUE(sp.SetLoadMode(LoadMode::kFull).ok());
+      ASSERT_TRUE(sp.SetSelfTestMode(SelfTestMode::kSkip).ok());
+      ASSERT_TRUE(sp.Load(model_proto).ok());
+      EXPECT_TRUE(sp.Encode("abba", &encoded).ok());
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, VerifyOutputsEquivalentTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);   // 1
+  AddPiece(&model_proto, "b", 0.3);   // 2
+  AddPiece(&model_proto, "ab", 1.0);  // 3
+  AddPiece(&model_proto, WS, 3.0);    // 4
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    EXPECT_TRUE(sp.VerifyOutputsEquivalent({}, {}));
+    EXPECT_TRUE(sp.VerifyOutputsEquivalent({4, 3}, {4, 3}));
+    EXPECT_FALSE(sp.VerifyOutputsEquivalent({4, 3}, {4, 1, 2}));
+    EXPECT_FALSE(sp.VerifyOutputsEquivalent({4, 3}, {4, 30}));
+    // Only the unigram model compares the scores of the pieces.
+    EXPECT_EQ(type == TrainerSpec::UNIGRAM,
+              sp.VerifyOutputsEquivalent({4, 1, 2}, {4, 2, 1}));
+  }
+}
+
+TEST(SentencePieceProcessorTest, SharedCompiledModelTest) {
+  auto model_proto = absl::make_unique<ModelProto>();
+  auto *sp1 = model_proto->add_pieces();
+  auto *sp2 = model_proto->add_pieces();
+  auto *sp3 = model_proto->add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(model_proto.get(), "a", 0.0);
+  AddPiece(model_proto.get(), "b", 0.3);
+  AddPiece(model_proto.get(), "ab", 1.0);
+  AddPiece(model_proto.get(), WS, 3.0);
+  *(model_proto->mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  const ModelProto *model_proto_ptr = model_proto.get();
+
+  std::shared_ptr<const CompiledModel> model;
+  EXPECT_FALSE(CompiledModel::Load("__UNKNOWN_FILE__", &model).ok());
+  EXPECT_TRUE(CompiledModel::Load(std::move(model_proto), &model).ok());
+
+  SentencePieceProcessor sp, sp_eos;
+  EXPECT_FALSE(sp.Load(std::shared_ptr<const CompiledModel>()).ok());
+  EXPECT_TRUE(sp.Load(model).ok());
+  EXPECT_TRUE(sp_eos.Load(model).ok());
+  EXPECT_TRUE(sp_eos.SetEncodeExtraOptions("eos").ok());
+  EXPECT_EQ(model_proto_ptr, &sp.model_proto());
+  EXPECT_EQ(model_proto_ptr, &sp_eos.model_proto());
+
+  // The processors keep the model alive.
+  model.reset();
+
+  std::vector<int> ids;
+  EXPECT_TRUE(sp.Encode("aba", &ids).ok());
+  EXPECT_EQ(std::vector<int>({6, 5, 3}), ids);
+  EXPECT_TRUE(sp_eos.Encode("aba", &ids).ok());
+  EXPECT_EQ(std::vector<int>({6, 5, 3, 2}), ids);
+
+  // A shared model cannot be changed, but takes per-call vocabularies.
+  EXPECT_FALSE(sp.SetVocabulary({"a", "b"}).ok());
+  EXPECT_FALSE(sp.ResetVocabulary().ok());
+  EXPECT_FALSE(sp.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+  std::shared_ptr<const VocabularyMask> mask;
+  EXPECT_TRUE(sp.MakeVocabularyMask({"a", "b"}, &mask).ok());
+  EncodeWorkspace workspace;
+  workspace.vocabulary = mask.get();
+  ids.clear();
+  EXPECT_TRUE(sp.EncodeIds("aba", &ids, &workspace).ok());
+  EXPECT_EQ(std::vector<int>({6, 3, 4, 3}), ids);
+
+  // Loading another model makes `sp` own its model again.
+  EXPECT_TRUE(sp.Load(sp_eos.model_proto()).ok());
+  EXPECT_TRUE(sp.SetVocabulary({"a", "b"}).ok());
+}
+
+TEST(SentencePieceProcessorTest, ExtendCompiledModelTest) {
+  std::vector<std::string> lines;
+  {
+    auto input = filesystem::NewReadableFile(
+        util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt"));
+    ASSERT_TRUE(input->status().ok());
+    std::string line;
+    while (input->ReadLine(&line) && lines.size() < 200) {
+      lines.push_back(line);
+    }
+  }
+
+  const std::vector<std::string> symbols = {"<tag>", "[SEP]", "<tag2>"};
+  for (const std::string type : {"unigram", "bpe"}) {
+    const std::string model_prefix = util::JoinPath(
+        absl::GetFlag(FLAGS_test_tmpdir), absl::StrCat("extend_", type));
+    ASSERT_TRUE(
+        SentencePieceTrainer::Train(
+            absl::StrCat("--input=",
+                         util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                        "botchan.txt"),
+                         " --model_prefix=", model_prefix,
+                         " --vocab_size=1000 --model_type=", type))
+            .ok());
+
+    std::shared_ptr<const CompiledModel> base, extended;
+    ASSERT_TRUE(CompiledModel::Load(model_prefix + ".model", &base).ok());
+    ASSERT_TRUE(CompiledModel::Extend(base, symbols, &extended).ok());
+    EXPECT_EQ(&base->model_proto(), &extended->model_proto());
+
+    // The same model with the symbols in its proto.
+    SentencePieceProcessor expected;
+    {
+      ModelProto model_proto = base->model_proto();
+      for (const auto &symbol : symbols) {
+        auto *sp = model_proto.add_pieces();
+        sp->set_piece(symbol);
+        sp->set_type(ModelProto::SentencePiece::USER_DEFINED);
+      }
+      ASSERT_TRUE(expected.Load(model_proto).ok());
+    }
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(extended).ok());
+    EXPECT_EQ(1003, sp.GetPieceSize());
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_EQ(1000 + i, sp.PieceToId(symbols[i]));
+      EXPECT_EQ(symbols[i], sp.IdToPiece(1000 + i));
+    }
+    EXPECT_EQ(expected.PieceToId("the"), sp.PieceToId("the"));
+
+    for (size_t i = 0; i + 1 < lines.size(); ++i) {
+      const std::string text =
+          absl::StrCat(lines[i], " <tag> ", lines[i + 1], "[SEP]<tag2>x");
+      std::vector<int> ids, expected_ids;
+      EXPECT_TRUE(sp.Encode(text, &ids).ok());
+      EXPECT_TRUE(expected.Encode(text, &expected_ids).ok());
+      EXPECT_EQ(expected_ids, ids);
+      std::string detokenized, expected_detokenized;
+      EXPECT_TRUE(sp.Decode(ids, &detokenized).ok());
+      EXPECT_TRUE(expected.Decode(ids, &expected_detokenized).ok());
+      EXPECT_EQ(expected_detokenized, detokenized);
+
+      // Texts without new symbols are encoded by the base model.
+      EXPECT_TRUE(sp.Encode(lines[i], &ids).ok());
+      EXPECT_TRUE(expected.Encode(lines[i], &expected_ids).ok());
+      EXPECT_EQ(expected_ids, ids);
+    }
+
+    // The base model is unchanged and kept alive by the extended one.
+    SentencePieceProcessor base_sp;
+    ASSERT_TRUE(base_sp.Load(base).ok());
+    EXPECT_EQ(1000, base_sp.GetPieceSize());
+    EXPECT_EQ(0, base_sp.PieceToId("<tag>"));
+    base.reset();
+    std::vector<std::string> pieces;
+    EXPECT_TRUE(sp.Encode("a<tag>b", &pieces).ok());
+    EXPECT_NE(pieces.end(), std::find(pieces.begin(), pieces.end(), "<tag>"));
+
+    // Symbols must be new, unique and non-empty.
+    std::shared_ptr<const CompiledModel> invalid;
+    EXPECT_FALSE(CompiledModel::Extend(extended, {"<tag>"}, &invalid).ok());
+    EXPECT_FALSE(
+        CompiledModel::Extend(extended, {sp.IdToPiece(100)}, &invalid).ok());
+    EXPECT_FALSE(CompiledModel::Extend(extended, {"<unk>"}, &invalid).ok());
+    EXPECT_FALSE(CompiledModel::Extend(extended, {"x", "x"}, &invalid).ok());
+    EXPECT_FALSE(CompiledModel::Extend(extended, {""}, &invalid).ok());
+    EXPECT_FALSE(CompiledModel::Extend(nullptr, {"x"}, &invalid).ok());
+
+    // An extended model can be extended again.
+    ASSERT_TRUE(CompiledModel::Extend(extended, {"<x>"}, &invalid).ok());
+    ASSERT_TRUE(sp.Load(invalid).ok());
+    EXPECT_EQ(1003, sp.PieceToId("<x>"));
+    EXPECT_EQ(1001, sp.PieceToId("[SEP]"));
+  }
+}
+
+TEST(SentencePieceProcessorTest, PerCallExtraOptionsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  std::shared_ptr<const CompiledModel> model;
+  ASSERT_TRUE(CompiledModel::Load(absl::make_unique<ModelProto>(model_proto),
+                                  &model)
+                  .ok());
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model).ok());
+  ASSERT_TRUE(sp.SetEncodeCacheSize(1 << 16).ok());
+
+  std::shared_ptr<const ExtraOptions> options;
+  EXPECT_FALSE(sp.MakeExtraOptions("foo", &options).ok());
+  EXPECT_FALSE(sp.MakeExtraOptions("bos", nullptr).ok());
+  EXPECT_TRUE(sp.MakeExtraOptions("", &options).ok());
+  EXPECT_TRUE(options->empty());
+
+  const std::string text = "aba ab";
+  for (const char *extra_option : {"bos", "eos", "bos:eos", "reverse:bos"}) {
+    SentencePieceProcessor expected;
+    ASSERT_TRUE(expected.Load(model).ok());
+    ASSERT_TRUE(expected.SetEncodeExtraOptions(extra_option).ok());
+    ASSERT_TRUE(expected.SetDecodeExtraOptions(extra_option).ok());
+    ASSERT_TRUE(sp.MakeExtraOptions(extra_option, &options).ok());
+    EXPECT_FALSE(options->empty());
+
+    EncodeWorkspace workspace;
+    workspace.extra_options = options.get();
+    std::vector<int> ids, expected_ids;
+    // Twice, as the cache of `sp` must not answer the second call.
+    for (int n = 0; n < 2; ++n) {
+      ids.clear();
+      EXPECT_TRUE(sp.EncodeIds(text, &ids, &workspace).ok());
+      EXPECT_TRUE(expected.Encode(text, &expected_ids).ok());
+      EXPECT_EQ(expected_ids, ids);
+    }
+
+    std::vector<EncodedPiece> pieces;
+    EXPECT_TRUE(sp.EncodePieces(text, &pieces, &workspace).ok());
+    SentencePieceText spt;
+    EXPECT_TRUE(expected.Encode(text, &spt).ok());
+    ASSERT_EQ(spt.pieces_size(), pieces.size());
+    for (int i = 0; i < spt.pieces_size(); ++i) {
+      EXPECT_EQ(spt.pieces(i).id(), pieces[i].id);
+    }
+
+    const std::vector<int> decoded_ids = {6, 5, 3, 6, 4};
+    std::string detokenized, expected_detokenized;
+    EXPECT_TRUE(sp.Decode(decoded_ids, options.get(), &detokenized).ok());
+    EXPECT_TRUE(expected.Decode(decoded_ids, &expected_detokenized).ok());
+    EXPECT_EQ(expected_detokenized, detokenized);
+  }
+
+  // Calls without options use the ones of the processor.
+  std::vector<int> ids;
+  EXPECT_TRUE(sp.EncodeIds(text, &ids).ok());
+  EXPECT_EQ(std::vector<int>({6, 5, 3, 6, 5}), ids);
+  std::string detokenized;
+  EXPECT_TRUE(sp.Decode({6, 5, 3}, nullptr, &detokenized).ok());
+  EXPECT_EQ("aba", detokenized);
+}
+
+TEST(SentencePieceProcessorTest, ProcessorHandleTest) {
+  auto make_model = [](float ab_score) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    AddPiece(&model_proto, "ab", ab_score);
+    AddPiece(&model_proto, WS, 3.0);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+    return model_proto;
+  };
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "handle.model");
+  ASSERT_TRUE(io::SaveModelProto(filename, make_model(1.0)).ok());
+  auto other = std::make_shared<SentencePieceProcessor>();
+  ASSERT_TRUE(other->Load(make_model(-1.0)).ok());
+
+  ProcessorHandle handle;
+  EXPECT_EQ(nullptr, handle.Acquire());
+  EXPECT_FALSE(handle.Load("__UNKNOWN_FILE__").ok());
+  EXPECT_FALSE(handle.Publish(nullptr).ok());
+  EXPECT_FALSE(
+      handle.Publish(std::make_shared<SentencePieceProcessor>()).ok());
+  EXPECT_EQ(nullptr, handle.Acquire());
+
+  ASSERT_TRUE(handle.Load(filename).ok());
+  std::shared_ptr<const SentencePieceProcessor> first = handle.Acquire();
+  ASSERT_NE(nullptr, first);
+  std::vector<int> ids;
+  EXPECT_TRUE(first->Encode("ab", &ids).ok());
+  EXPECT_EQ(std::vector<int>({4, 3}), ids);
+
+  // A failed reload keeps the published processor, and a request keeps the
+  // processor it acquired.
+  EXPECT_FALSE(handle.Load("__UNKNOWN_FILE__").ok());
+  EXPECT_EQ(first, handle.Acquire());
+  EXPECT_TRUE(handle.Publish(other).ok());
+  EXPECT_EQ(other, handle.Acquire());
+  EXPECT_TRUE(first->Encode("ab", &ids).ok());
+  EXPECT_EQ(std::vector<int>({4, 3}), ids);
+  EXPECT_TRUE(handle.Acquire()->Encode("ab", &ids).ok());
+  EXPECT_EQ(std::vector<int>({4, 1, 2}), ids);
+
+  // Readers see one of the models while they are reloaded.
+  std::atomic<bool> done(false);
+  std::atomic<int> num_errors(0);
+  std::vector<std::thread> readers;
+  for (int n = 0; n < 4; ++n) {
+    readers.emplace_back([&]() {
+      std::vector<int> ids;
+      while (!done) {
+        std::shared_ptr<const SentencePieceProcessor> sp = handle.Acquire();
+        if (!sp->Encode("ab", &ids).ok() ||
+            (ids != std::vector<int>({4, 3}) &&
+             ids != std::vector<int>({4, 1, 2}))) {
+          ++num_errors;
+        }
+      }
+    });
+  }
+  for (int n = 0; n < 20; ++n) {
+    if (n % 2 == 0) {
+      EXPECT_TRUE(handle.Load(filename).ok());
+    } else {
+      EXPECT_TRUE(handle.Publish(other).ok());
+    }
+  }
+  done = true;
+  for (auto &reader : readers) reader.join();
+  EXPECT_EQ(0, num_errors.load());
+
+  // Only the handle and `other` hold the published processor.
+  EXPECT_EQ(2, other.use_count());
+}
+
+TEST(SentencePieceProcessorTest, MultiModelEncoderTest) {
+  auto make_model = [](float ab_score) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.3);
+    AddPiece(&model_proto, "ab", ab_score);
+    AddPiece(&model_proto, WS, 3.0);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+    return model_proto;
+  };
+
+  SentencePieceProcessor sp1, sp2, sp3;
+  ASSERT_TRUE(sp1.Load(make_model(1.0)).ok());
+  ASSERT_TRUE(sp2.Load(make_model(-1.0)).ok());
+  ASSERT_TRUE(sp3.Load(make_model(1.0)).ok());
+  ASSERT_TRUE(sp3.SetEncodeExtraOptions("reverse").ok());
+  ASSERT_TRUE(sp3.SetEncodeMaxTokens(3).ok());
+
+  MultiModelEncoder encoder;
+  std::vector<std::vector<int>> ids;
+  EXPECT_FALSE(encoder.EncodeIds("ab", &ids).ok());
+  EXPECT_FALSE(encoder.Init({}).ok());
+  EXPECT_FALSE(encoder.Init({&sp1, nullptr}).ok());
+
+  // Models normalizing differently are rejected.
+  ModelProto other_spec = make_model(1.0);
+  other_spec.mutable_normalizer_spec()->set_add_dummy_prefix(false);
+  ModelProto other_symbols = make_model(1.0);
+  auto *symbol = other_symbols.add_pieces();
+  symbol->set_type(ModelProto::SentencePiece::USER_DEFINED);
+  symbol->set_piece("<sep>");
+  for (const auto &model_proto : {other_spec, other_symbols}) {
+    SentencePieceProcessor other;
+    ASSERT_TRUE(other.Load(model_proto).ok());
+    EXPECT_FALSE(encoder.Init({&sp1, &other}).ok());
+  }
+
+  for (const int num_threads : {1, 2, 4}) {
+    ASSERT_TRUE(encoder.Init({&sp1, &sp2, &sp3}, num_threads).ok());
+    EXPECT_EQ(3, encoder.size());
+    for (const char *input : {"", "ab", "aab b", "ab ab abb"}) {
+      EXPECT_TRUE(encoder.EncodeIds(input, &ids).ok());
+      std::vector<SentencePieceText> spts;
+      EXPECT_TRUE(encoder.Encode(input, &spts).ok());
+      ASSERT_EQ(3, ids.size());
+      ASSERT_EQ(3, spts.size());
+      int i = 0;
+      for (const auto *sp : {&sp1, &sp2, &sp3}) {
+        std::vector<int> expected_ids;
+        EXPECT_TRUE(sp->Encode(input, &expected_ids).ok());
+        EXPECT_EQ(expected_ids, ids[i]);
+        SentencePieceText expected_spt;
+        EXPECT_TRUE(sp->Encode(input, &expected_spt).ok());
+        EXPECT_EQ(expected_spt.SerializeAsString(),
+                  spts[i].SerializeAsString());
+        ++i;
+      }
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, AsyncEncoderTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  const std::vector<std::string> inputs = {"", "ab", "aab b", "ab ab abb"};
+
+  std::atomic<int> num_done(0);
+  {
+    AsyncEncoder encoder(sp, 4, 8, 1000);
+    std::vector<std::future<AsyncEncodeResult>> results;
+    for (int n = 0; n < 100; ++n) {
+      results.push_back(encoder.EncodeAsync(inputs[n % inputs.size()]));
+    }
+    AsyncEncodeOptions options;
+    ASSERT_TRUE(sp.MakeExtraOptions("bos:eos", &options.extra_options).ok());
+    auto with_options = encoder.EncodeAsync("ab", options);
+
+    for (int n = 0; n < 100; ++n) {
+      std::vector<int> expected;
+      EXPECT_TRUE(sp.EncodeIds(inputs[n % inputs.size()], &expected).ok());
+      const AsyncEncodeResult result = results[n].get();
+      EXPECT_TRUE(result.status.ok());
+      EXPECT_EQ(expected, result.ids);
+    }
+    EXPECT_EQ(std::vector<int>({1, 6, 5, 2}), with_options.get().ids);
+
+    // Callbacks from several threads.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&]() {
+        for (int n = 0; n < 50; ++n) {
+          encoder.EncodeAsync(
+              "ab", AsyncEncodeOptions(),
+              [&](util::Status status, std::vector<int> ids) {
+                if (status.ok() && ids == std::vector<int>({6, 5})) ++num_done;
+              });
+        }
+      });
+    }
+    for (auto &thread : threads) thread.join();
+  }
+  EXPECT_EQ(200, num_done);
+
+  // A request waiting for its batch can be cancelled, and the destructor
+  // encodes the others without waiting.
+  std::vector<util::Status> statuses;
+  std::vector<std::future<AsyncEncodeResult>> results;
+  {
+    AsyncEncoder encoder(sp, 1, 100, 60 * 1000 * 1000);
+    uint64_t first = 0, second = 0;
+    results.push_back(encoder.EncodeAsync("ab", AsyncEncodeOptions(), &first));
+    results.push_back(
+        encoder.EncodeAsync("aab", AsyncEncodeOptions(), &second));
+    EXPECT_NE(first, second);
+    EXPECT_TRUE(encoder.Cancel(first));
+    EXPECT_FALSE(encoder.Cancel(first));
+    EXPECT_FALSE(encoder.Cancel(12345));
+    EXPECT_EQ(util::StatusCode::kCancelled, results[0].get().status.code());
+  }
+  const AsyncEncodeResult result = results[1].get();
+  EXPECT_TRUE(result.status.ok());
+  EXPECT_EQ(std::vector<int>({6, 3, 5}), result.ids);
+}
+
+TEST(SentencePieceProcessorTest, EncodePiecesTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, WS "a", 0.3);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  AddPiece(&model_proto, WS, 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  // Runs of unknown characters are merged into one piece.
+  const std::string text = "ab  xy ａｂ 東京a b";
+
+  auto test_pieces = [&](const SentencePieceProcessor &sp) {
+    SentencePieceText spt;
+    EXPECT_TRUE(sp.Encode(text, &spt).ok());
+    EncodeWorkspace workspace;
+    std::vector<EncodedPiece> pieces;
+    // The workspace and the output can be reused.
+    for (int n = 0; n < 2; ++n) {
+      EXPECT_TRUE(sp.EncodePieces(text, &pieces, &workspace).ok());
+      ASSERT_EQ(spt.pieces_size(), pieces.size());
+      for (int i = 0; i < spt.pieces_size(); ++i) {
+        EXPECT_EQ(spt.pieces(i).piece(), pieces[i].piece);
+        EXPECT_EQ(spt.pieces(i).id(), pieces[i].id);
+        EXPECT_EQ(spt.pieces(i).surface(), pieces[i].surface);
+        EXPECT_EQ(spt.pieces(i).begin(), pieces[i].begin);
+        EXPECT_EQ(spt.pieces(i).end(), pieces[i].end);
+      }
+    }
+    EXPECT_FALSE(sp.EncodePieces(text, &pieces, nullptr).ok());
+  };
+
+  for (const char *extra_options : {"", "bos:eos", "reverse:bos"}) {
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_proto).ok());
+    EXPECT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+    test_pieces(sp);
+  }
+
+  // Unknown characters are split into byte pieces.
+  for (int i = 0; i < 256; ++i) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(ByteToPiece(i));
+    sp->set_type(ModelProto::SentencePiece::BYTE);
+  }
+  model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+  test_pieces(sp);
+}
+
+TEST(SentencePieceProcessorTest, EncodePieceViewsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  AddPiece(&model_proto, WS, 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::vector<std::string> texts = {"ab  xy abababababababababab",
+                                          "", "東京 ab", "ab ab bbb"};
+
+  for (const char *extra_options : {"", "bos:eos", "reverse"}) {
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    ASSERT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+
+    EncodeWorkspace workspace;
+    for (const auto &text : texts) {
+      const auto expected = sp.EncodeAsPieces(text);
+      EXPECT_TRUE(sp.EncodePieceViews(text, &workspace).ok());
+      const auto &views = workspace.piece_views;
+      ASSERT_EQ(expected.size(), views.size());
+      for (size_t i = 0; i < views.size(); ++i) {
+        EXPECT_EQ(expected[i], views[i].piece);
+        EXPECT_LE(views[i].begin, views[i].end);
+        EXPECT_LE(views[i].end, text.size());
+        EXPECT_EQ(text.substr(views[i].begin, views[i].end - views[i].begin),
+                  views[i].surface);
+        if (!sp.IsUnknown(views[i].id)) {
+          // Known pieces point into the vocabulary.
+          EXPECT_EQ(sp.IdToPiece(views[i].id).data(), views[i].piece.data());
+        }
+      }
+    }
+
+    // The run "ab ab" covers the surface of both pieces.
+    EXPECT_TRUE(sp.EncodePieceViews("ab ab", &workspace).ok());
+    const auto &views = workspace.piece_views;
+    const size_t run = extra_options == std::string("bos:eos") ? 1 : 0;
+    ASSERT_LT(run + 1, views.size());
+    EXPECT_EQ("ab ab", views[run].surface);
+    EXPECT_EQ(kStartRepeatSymbol, views[run + 1].piece);
+    EXPECT_EQ(5, views[run + 1].begin);
+
+    for (const auto &text : texts) {
+      util::Status status;
+      EXPECT_NO_ALLOCATIONS(
+          { status = sp.EncodePieceViews(text, &workspace); });
+      EXPECT_TRUE(status.ok());
+    }
+  }
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_FALSE(sp.EncodePieceViews("ab", nullptr).ok());
+}
+
+TEST(SentencePieceProcessorTest, GetMemoryUsageTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  auto *user = model_proto.add_pieces();
+  user->set_type(ModelProto::SentencePiece::USER_DEFINED);
+  user->set_piece("<user>");
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  auto check_total = [](const MemoryUsage &usage) {
+    EXPECT_EQ(usage.mapped_file + usage.model_proto + usage.piece_maps +
+                  usage.score_tables + usage.model_tries +
+                  usage.prefix_matcher + usage.normalizers +
+                  usage.decode_table + usage.encode_cache +
+                  usage.thread_buffers,
+              usage.total());
+  };
+
+  SentencePieceProcessor empty;
+  EXPECT_EQ(0, empty.GetMemoryUsage().total());
+
+  const std::string filename =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "memory_usage_model");
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    const MemoryUsage before = sp.GetMemoryUsage();
+    check_total(before);
+    EXPECT_EQ(0, before.mapped_file);
+    EXPECT_EQ(model_proto.ByteSizeLong(), before.model_proto);
+    EXPECT_GT(before.piece_maps, 0);
+    EXPECT_GT(before.score_tables, 0);
+    EXPECT_GT(before.prefix_matcher, 0);
+    EXPECT_EQ(0, before.encode_cache);
+    if (type == TrainerSpec::UNIGRAM) EXPECT_GT(before.model_tries, 0);
+
+    // The caches and the thread buffers grow with the inputs. A new thread
+    // starts without the buffers the previous tests left.
+    ASSERT_TRUE(sp.SetEncodeCacheSize(1 << 20).ok());
+    std::thread([&]() {
+      const MemoryUsage fresh = sp.GetMemoryUsage();
+      std::vector<int> ids;
+      ASSERT_TRUE(sp.Encode(std::string(1000, 'a'), &ids).ok());
+      const MemoryUsage after = sp.GetMemoryUsage();
+      check_total(after);
+      EXPECT_GT(after.encode_cache, 0);
+      EXPECT_GT(after.thread_buffers, fresh.thread_buffers);
+    }).join();
+
+    // A precompiled model is counted as the mapped file.
+    ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+    SentencePieceProcessor precompiled;
+    ASSERT_TRUE(precompiled.Load(filename).ok());
+    const MemoryUsage mapped = precompiled.GetMemoryUsage();
+    check_total(mapped);
+    EXPECT_GT(mapped.mapped_file, 0);
+    if (type == TrainerSpec::UNIGRAM) EXPECT_EQ(0, mapped.model_tries);
+  }
+
+  EncodeWorkspace workspace;
+  EXPECT_EQ(0, SentencePieceProcessor::EncodeWorkspaceMemoryUsage(workspace));
+  workspace.ids.reserve(100);
+  EXPECT_EQ(100 * sizeof(int),
+            SentencePieceProcessor::EncodeWorkspaceMemoryUsage(workspace));
+}
+
+TEST(SentencePieceProcessorTest, WarmUpTest) {
+  const std::string model_prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "warm_up");
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--input=",
+                               util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                              "botchan.txt"),
+                               " --model_prefix=", model_prefix,
+                               " --vocab_size=1000"))
+                  .ok());
+  ModelProto model_proto;
+  ASSERT_TRUE(io::LoadModelProto(model_prefix + ".model", &model_proto).ok());
+  const std::string filename = model_prefix + ".precompiled";
+  ASSERT_TRUE(io::SavePrecompiledModel(filename, model_proto).ok());
+
+  SentencePieceProcessor sp;
+  EXPECT_FALSE(sp.WarmUp().ok());
+  ASSERT_TRUE(sp.Load(filename).ok());
+  ASSERT_TRUE(sp.SetEncodeCacheSize(1 << 20).ok());
+
+  // A new thread gets its buffers from WarmUp(), also when the encode cache
+  // has seen the synthetic inputs.
+  for (int i = 0; i < 2; ++i) {
+    std::thread([&]() {
+      const uint64_t fresh = sp.GetMemoryUsage().thread_buffers;
+      EncodeWorkspace workspace;
+      WarmUpOptions options;
+      options.max_input_length = 2000;
+      options.workspace = &workspace;
+      ASSERT_TRUE(sp.WarmUp(options).ok());
+      EXPECT_GT(sp.GetMemoryUsage().thread_buffers, fresh);
+      EXPECT_GE(workspace.normalized.capacity(), 1000);
+      EXPECT_FALSE(workspace.ids.empty());
+    }).join();
+  }
+  EXPECT_EQ(0, sp.GetMemoryUsage().encode_cache);
+
+  // So do the workers of the batch methods.
+  WarmUpOptions options;
+  options.num_threads = 4;
+  ASSERT_TRUE(sp.WarmUp(options).ok());
+  std::mutex mutex;
+  std::vector<uint64_t> worker_buffers;
+  ForEachSharedPoolWorker(4, [&]() {
+    const uint64_t buffers = sp.GetMemoryUsage().thread_buffers;
+    std::lock_guard<std::mutex> lock(mutex);
+    worker_buffers.push_back(buffers);
+  });
+  EXPECT_GE(worker_buffers.size(), 3);
+  for (const uint64_t buffers : worker_buffers) EXPECT_GT(buffers, 0);
+
+  // Concurrent calls do not wait for each other's workers.
+  std::vector<std::thread> callers;
+  for (int i = 0; i < 3; ++i) {
+    callers.emplace_back([&sp]() {
+      WarmUpOptions options;
+      options.num_threads = 4;
+      options.max_input_length = 200;
+      EXPECT_TRUE(sp.WarmUp(options).ok());
+    });
+  }
+  for (auto &caller : callers) caller.join();
+
+  options = WarmUpOptions();
+  options.num_encodes = 0;
+  EXPECT_FALSE(sp.WarmUp(options).ok());
+  options = WarmUpOptions();
+  options.max_input_length = 0;
+  EXPECT_FALSE(sp.WarmUp(options).ok());
+  options = WarmUpOptions();
+  options.num_threads = 0;
+  EXPECT_FALSE(sp.WarmUp(options).ok());
+
+  AsyncEncoder encoder(sp, 3);
+  EXPECT_TRUE(encoder.WarmUp().ok());
+  callers.clear();
+  for (int i = 0; i < 3; ++i) {
+    callers.emplace_back([&encoder]() {
+      WarmUpOptions options;
+      options.num_threads = 4;
+      options.max_input_length = 200;
+      EXPECT_TRUE(encoder.WarmUp(options).ok());
+    });
+  }
+  for (auto &caller : callers) caller.join();
+  auto result = encoder.EncodeAsync("I saw a girl with a telescope.").get();
+  EXPECT_TRUE(result.status.ok());
+  EXPECT_EQ(sp.EncodeAsIds("I saw a girl with a telescope."), result.ids);
+}
+
+// Records the events of the traced requests.
+class RecordingTracer : public Tracer {
+ public:
+  explicit RecordingTracer(double sample_rate = 1.0) : Tracer(sample_rate) {}
+
+  void OnEvent(const TraceEvent &event) override { events.push_back(event); }
+
+  std::vector<TraceStage> stages() const {
+    std::vector<TraceStage> stages;
+    for (const auto &event : events) stages.push_back(event.stage);
+    return stages;
+  }
+
+  std::vector<TraceEvent> events;
+};
+
+TEST(SentencePieceProcessorTest, TracerTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, WS, 3.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  auto tracer = std::make_shared<RecordingTracer>();
+  sp.SetTracer(tracer);
+
+  std::vector<int> ids;
+  ASSERT_TRUE(sp.Encode("ab ab", &ids).ok());
+  EXPECT_EQ(std::vector<TraceStage>({TraceStage::kNormalize,
+                                     TraceStage::kSegment,
+                                     TraceStage::kBuildOutput,
+                                     TraceStage::kRle}),
+            tracer->stages());
+  const uint64_t request_id = tracer->events[0].request_id;
+  for (const auto &event : tracer->events) {
+    EXPECT_EQ(request_id, event.request_id);
+    EXPECT_EQ(5, event.input_bytes);
+    EXPECT_LE(event.begin_ns, event.end_ns);
+  }
+  EXPECT_LE(tracer->events[0].end_ns, tracer->events[1].begin_ns);
+  EXPECT_EQ(ids.size(), tracer->events.back().num_tokens);
+
+  // The calls of Encode(pieces) belong to its request.
+  tracer->events.clear();
+  std::vector<std::string> pieces;
+  ASSERT_TRUE(sp.Encode("ab ab", &pieces).ok());
+  ASSERT_EQ(4, tracer->events.size());
+  EXPECT_EQ(TraceStage::kRle, tracer->events.back().stage);
+  EXPECT_LT(request_id, tracer->events[0].request_id);
+  for (const auto &event : tracer->events) {
+    EXPECT_EQ(tracer->events[0].request_id, event.request_id);
+  }
+
+  tracer->events.clear();
+  std::string text;
+  ASSERT_TRUE(sp.Decode(ids, &text).ok());
+  EXPECT_EQ("ab ab", text);
+  EXPECT_EQ(std::vector<TraceStage>({TraceStage::kDecode}), tracer->stages());
+  EXPECT_EQ(ids.size() * sizeof(int), tracer->events[0].input_bytes);
+
+  // No request is sampled at rate 0.
+  auto none = std::make_shared<RecordingTracer>(0.0);
+  sp.SetTracer(none);
+  for (int i = 0; i < 100; ++i) ASSERT_TRUE(sp.Encode("ab", &ids).ok());
+  EXPECT_TRUE(none->events.empty());
+
+  // About half of the requests are sampled at rate 0.5.
+  auto half = std::make_shared<RecordingTracer>(0.5);
+  sp.SetTracer(half);
+  for (int i = 0; i < 1000; ++i) ASSERT_TRUE(sp.Decode(ids, &text).ok());
+  EXPECT_GT(half->events.size(), 400);
+  EXPECT_LT(half->events.size(), 600);
+
+  auto writer = std::make_shared<ChromeTraceWriter>();
+  sp.SetTracer(writer);
+  ASSERT_TRUE(sp.Encode("ab", &ids).ok());
+  const std::string json = writer->ToJson();
+  EXPECT_EQ(0, json.find("{\"traceEvents\":[{\"name\":\"normalize\""));
+  EXPECT_NE(std::string::npos, json.find("\"ph\":\"X\""));
+  EXPECT_NE(std::string::npos, json.find("\"input_bytes\":2"));
+  writer->Clear();
+  EXPECT_EQ("{\"traceEvents\":[]}", writer->ToJson());
+
+  sp.SetTracer(nullptr);
+  ASSERT_TRUE(sp.Encode("ab", &ids).ok());
+  EXPECT_EQ("{\"traceEvents\":[]}", writer->ToJson());
+}
+
+TEST(SentencePieceProcessorTest, GetStatsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  const std::string text = "ab  ab";  // normalized to "▁ab▁ab".
+  const EncodeStats before = SentencePieceProcessor::GetStats();
+  std::vector<int> ids;
+  EXPECT_TRUE(sp.Encode(text, &ids).ok());
+  std::vector<std::string> pieces;
+  EXPECT_TRUE(sp.Encode(text, &pieces).ok());
+  // The counters of exited threads are kept.
+  std::thread([&]() {
+    SentencePieceText spt;
+    EXPECT_TRUE(sp.Encode(text, &spt).ok());
+  }).join();
+  EXPECT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+  EXPECT_TRUE(sp.Encode(text, &ids).ok());
+  const EncodeStats after = SentencePieceProcessor::GetStats();
+
+#ifdef SPM_ENABLE_STATS
+  EXPECT_TRUE(after.enabled);
+  EXPECT_EQ(before.num_calls + 4, after.num_calls);
+  EXPECT_EQ(before.bytes_in + 4 * text.size(), after.bytes_in);
+  EXPECT_EQ(before.bytes_out + 4 * 10, after.bytes_out);
+  // The tokens are counted before the run-length encoding.
+  EXPECT_EQ(before.tokens_out + 4 * 2, after.tokens_out);
+  EXPECT_GE(after.normalize_ns, before.normalize_ns);
+  EXPECT_GE(after.model_encode_ns, before.model_encode_ns);
+  EXPECT_GE(after.rle_ns, before.rle_ns);
+  EXPECT_GE(after.proto_ns, before.proto_ns);
+  EXPECT_EQ(before.case_encode_ns, after.case_encode_ns);
+  // Only the original encoder builds a lattice.
+  EXPECT_LT(before.lattice_nodes, after.lattice_nodes);
+#else
+  EXPECT_FALSE(before.enabled);
+  EXPECT_FALSE(after.enabled);
+  EXPECT_EQ(0, after.num_calls);
+  EXPECT_EQ(0, after.bytes_in);
+  EXPECT_EQ(0, after.lattice_nodes);
+#endif
+}
+
+TEST(SentencePieceProcessorTest, EncodeIdsNoAllocationTest) {
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    ModelProto model_proto;
+    auto *sp1 = model_proto.add_pieces();
+    sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+    sp1->set_piece("<unk>");
+    AddPiece(&model_proto, WS "ab", 1.0);
+    AddPiece(&model_proto, WS, 0.0);
+    AddPiece(&model_proto, "ab", 0.5);
+    AddPiece(&model_proto, "a", 0.0);
+    AddPiece(&model_proto, "b", 0.0);
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+
+    // Once the workspace and the output have grown to the longest input,
+    // encoding makes no heap allocation.
+    const std::vector<std::string> texts = {"ab  ab", "abba ba xy", "",
+                                            "a b ab aab abba"};
+    EncodeWorkspace workspace;
+    std::vector<int> ids;
+    for (const auto &text : texts) {
+      EXPECT_TRUE(sp.EncodeIds(text, &ids, &workspace).ok());
+    }
+    for (const auto &text : texts) {
+      util::Status status;
+      EXPECT_NO_ALLOCATIONS(
+          { status = sp.EncodeIds(text, &ids, &workspace); });
+      EXPECT_TRUE(status.ok());
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, EncodeIdsThreadWorkspaceTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, WS, 0.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+
+  const std::vector<std::string> texts = {"ab  ab", "abba ba xy", "",
+                                          "a b ab aab abba"};
+  std::vector<std::vector<int>> expected(texts.size());
+  for (size_t i = 0; i < texts.size(); ++i) {
+    EncodeWorkspace workspace;
+    EXPECT_TRUE(sp.EncodeIds(texts[i], &expected[i], &workspace).ok());
+  }
+
+#ifndef SPM_NO_THREADLOCAL
+  // Calls without a workspace reuse the one of their thread.
+  std::vector<int> ids;
+  for (const auto &text : texts) {
+    EXPECT_TRUE(sp.EncodeIds(text, &ids).ok());
+  }
+  EXPECT_LT(0, sp.GetMemoryUsage().thread_buffers);
+  for (size_t i = 0; i < texts.size(); ++i) {
+    util::Status status;
+    EXPECT_NO_ALLOCATIONS({ status = sp.EncodeIds(texts[i], &ids); });
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(expected[i], ids);
+  }
+#endif  // SPM_NO_THREADLOCAL
+
+  // Threads do not share their workspaces.
+  std::atomic<int> num_errors(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t]() {
+      std::vector<int> ids;
+      for (int n = 0; n < 1000; ++n) {
+        const size_t i = (n + t) % texts.size();
+        if (!sp.EncodeIds(texts[i], &ids).ok() || ids != expected[i]) {
+          ++num_errors;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  EXPECT_EQ(0, num_errors.load());
+}
+
+TEST(SentencePieceProcessorTest, EncodeCacheTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp, cached;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(cached.Load(model_proto).ok());
+  ASSERT_TRUE(cached.SetEncodeCacheSize(1 << 20).ok());
+
+  const std::vector<absl::string_view> texts = {"ab  ab", "abab", "x", "",
+                                                "ab  ab", "abab"};
+  auto expect_same = [&]() {
+    const EncodeStats before = SentencePieceProcessor::GetStats();
+    for (const auto text : texts) {
+      std::vector<int> expected, ids;
+      EXPECT_TRUE(sp.Encode(text, &expected).ok());
+      EXPECT_TRUE(cached.Encode(text, &ids).ok());
+      EXPECT_EQ(expected, ids);
+    }
+    std::vector<std::vector<int>> expected, ids;
+    EXPECT_TRUE(sp.EncodeBatch(texts, &expected, 2).ok());
+    EXPECT_TRUE(cached.EncodeBatch(texts, &ids, 2).ok());
+    EXPECT_EQ(expected, ids);
+    const EncodeStats after = SentencePieceProcessor::GetStats();
+#ifdef SPM_ENABLE_STATS
+    // The first four texts are encoded and the others come from the cache.
+    EXPECT_EQ(before.cache_misses + 4, after.cache_misses);
+    EXPECT_EQ(before.cache_hits + 8, after.cache_hits);
+#else
+    EXPECT_EQ(before.cache_hits, after.cache_hits);
+    EXPECT_EQ(0, after.cache_misses);
+#endif
+  };
+
+  expect_same();
+
+  // Changing the options clears the cache.
+  ASSERT_TRUE(sp.SetEncodeExtraOptions("bos:eos").ok());
+  ASSERT_TRUE(cached.SetEncodeExtraOptions("bos:eos").ok());
+  expect_same();
+  ASSERT_TRUE(sp.SetVocabulary({WS "ab", "a", "b"}).ok());
+  ASSERT_TRUE(cached.SetVocabulary({WS "ab", "a", "b"}).ok());
+  expect_same();
+  ASSERT_TRUE(sp.ResetVocabulary().ok());
+  ASSERT_TRUE(cached.ResetVocabulary().ok());
+  expect_same();
+
+  // A mask in the workspace bypasses the cache.
+  std::shared_ptr<const VocabularyMask> mask;
+  ASSERT_TRUE(sp.MakeVocabularyMask({"a", "b"}, &mask).ok());
+  EncodeWorkspace workspace;
+  workspace.vocabulary = mask.get();
+  std::vector<int> expected, ids;
+  EXPECT_TRUE(sp.EncodeIds("abab", &expected, &workspace).ok());
+  EXPECT_TRUE(cached.EncodeIds("abab", &ids, &workspace).ok());
+  EXPECT_EQ(expected, ids);
+  EXPECT_TRUE(cached.EncodeIds("abab", &ids).ok());
+  EXPECT_NE(expected, ids);
+
+  ASSERT_TRUE(cached.SetEncodeCacheSize(0).ok());
+  EXPECT_TRUE(cached.EncodeIds("abab", &ids).ok());
+  EXPECT_TRUE(sp.EncodeIds("abab", &expected).ok());
+  EXPECT_EQ(expected, ids);
+}
+
+#ifndef OS_WIN
+TEST(SentencePieceProcessorTest, SharedEncodeCacheTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  const std::string name = util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir),
+                                          "shared_encode_cache");
+  std::remove(name.c_str());
+
+  // Two processors sharing the table, as two processes would.
+  SentencePieceProcessor sp, first, second;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  ASSERT_TRUE(first.Load(model_proto).ok());
+  ASSERT_TRUE(second.Load(model_proto).ok());
+  EXPECT_FALSE(first.SetSharedEncodeCache(name, 100).ok());
+  ASSERT_TRUE(first.SetSharedEncodeCache(name, 1 << 16).ok());
+  ASSERT_TRUE(second.SetSharedEncodeCache(name, 1 << 16).ok());
+  EXPECT_FALSE(sp.SetSharedEncodeCache(name, 1 << 17).ok());
+  EXPECT_GE(first.GetMemoryUsage().encode_cache, 1 << 16);
+
+  const std::vector<absl::string_view> texts = {"ab  ab", "abab", "x", ""};
+  auto expect_same = [&]() {
+    for (const auto text : texts) {
+      std::vector<int> expected, ids;
+      EXPECT_TRUE(sp.Encode(text, &expected).ok());
+      EXPECT_TRUE(first.Encode(text, &ids).ok());
+      EXPECT_EQ(expected, ids);
+      const EncodeStats before = SentencePieceProcessor::GetStats();
+      EXPECT_TRUE(second.Encode(text, &ids).ok());
+      EXPECT_EQ(expected, ids);
+      const EncodeStats after = SentencePieceProcessor::GetStats();
+#ifdef SPM_ENABLE_STATS
+      // The ids inserted by `first` are found by `second`.
+      EXPECT_EQ(before.cache_hits + 1, after.cache_hits);
+#else
+      EXPECT_EQ(before.cache_hits, after.cache_hits);
+#endif
+    }
+  };
+
+  expect_same();
+
+  // The entries are keyed by the options and the vocabulary.
+  ASSERT_TRUE(sp.SetEncodeExtraOptions("bos:eos").ok());
+  ASSERT_TRUE(first.SetEncodeExtraOptions("bos:eos").ok());
+  ASSERT_TRUE(second.SetEncodeExtraOptions("bos:eos").ok());
+  expect_same();
+  ASSERT_TRUE(sp.SetVocabulary({WS "ab", "a", "b"}).ok());
+  ASSERT_TRUE(first.SetVocabulary({WS "ab", "a", "b"}).ok());
+  ASSERT_TRUE(second.SetVocabulary({WS "ab", "a", "b"}).ok());
+  expect_same();
+
+  ASSERT_TRUE(first.SetSharedEncodeCache("", 0).ok());
+  EXPECT_EQ(0, first.GetMemoryUsage().encode_cache);
+  std::remove(name.c_str());
+}
+#endif  // OS_WIN
+
+TEST(SentencePieceProcessorTest, WordCacheTest) {
+  std::vector<std::string> lines;
+  {
+    auto input = filesystem::NewReadableFile(
+        util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt"));
+    ASSERT_TRUE(input->status().ok());
+    std::string line;
+    while (input->ReadLine(&line) && lines.size() < 1000) {
+      lines.push_back(line);
+    }
+  }
+
+  for (const std::string type : {"unigram", "bpe"}) {
+    const std::string model_prefix = util::JoinPath(
+        absl::GetFlag(FLAGS_test_tmpdir), absl::StrCat("word_cache_", type));
+    ASSERT_TRUE(
+        SentencePieceTrainer::Train(
+            absl::StrCat("--input=",
+                         util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                        "botchan.txt"),
+                         " --model_prefix=", model_prefix,
+                         " --vocab_size=1000 --model_type=", type))
+            .ok());
+
+    SentencePieceProcessor sp, cached;
+    ASSERT_TRUE(sp.Load(model_prefix + ".model").ok());
+    ASSERT_TRUE(cached.Load(model_prefix + ".model").ok());
+    EXPECT_FALSE(cached.SetWordCacheSize(-1).ok());
+    // A small cache, which is filled over and over.
+    ASSERT_TRUE(cached.SetWordCacheSize(64).ok());
+
+    for (int n = 0; n < 2; ++n) {
+      for (const auto &line : lines) {
+        std::vector<std::string> expected, pieces;
+        EXPECT_TRUE(sp.Encode(line, &expected).ok());
+        EXPECT_TRUE(cached.Encode(line, &pieces).ok());
+        EXPECT_EQ(expected, pieces);
+      }
+    }
+
+    std::vector<absl::string_view> texts(lines.begin(), lines.end());
+    std::vector<std::vector<int>> expected, ids;
+    EXPECT_TRUE(sp.EncodeBatch(texts, &expected, 4).ok());
+    EXPECT_TRUE(cached.EncodeBatch(texts, &ids, 4).ok());
+    EXPECT_EQ(expected, ids);
+
+    ASSERT_TRUE(cached.SetWordCacheSize(0).ok());
+    EXPECT_TRUE(cached.EncodeBatch(texts, &ids, 4).ok());
+    EXPECT_EQ(expected, ids);
+  }
+
+  // Pieces with white space in the middle join words.
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, "a" WS "b", 1.0);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  EXPECT_FALSE(sp.SetWordCacheSize(100).ok());
+  EXPECT_TRUE(sp.SetWordCacheSize(0).ok());
+}
+
+TEST(SentencePieceProcessorTest, EncodeChunkedIdsTest) {
+  std::vector<std::string> texts;
+  for (const std::string filename : {"botchan.txt", "wagahaiwa_nekodearu.txt"}) {
+    auto input = filesystem::NewReadableFile(
+        util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), filename));
+    ASSERT_TRUE(input->status().ok());
+    // Long texts of many lines, which are encoded in chunks.
+    std::string line, text;
+    for (int n = 0; n < 300 && input->ReadLine(&line); ++n) {
+      text += line;
+      text += n % 3 == 0 ? "   " : " ";
+      if (text.size() > 10000) {
+        texts.push_back(text);
+        text.clear();
+      }
+    }
+    texts.push_back(text);
+  }
+  // Unknown characters on both sides of the cuts.
+  std::string unknowns;
+  for (int n = 0; n < 2000; ++n) unknowns += "ab \xe2\x98\x83 ";
+  texts.push_back(unknowns);
+  // Whole files, which are encoded in parallel with SetEncodeNumThreads().
+  for (const std::string filename : {"botchan.txt", "wagahaiwa_nekodearu.txt"}) {
+    auto input = filesystem::NewReadableFile(
+        util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), filename));
+    ASSERT_TRUE(input->status().ok());
+    std::string line, text;
+    for (int n = 0; input->ReadLine(&line); ++n) {
+      text += line;
+      text += n % 3 == 0 ? "   " : " ";
+    }
+    texts.push_back(text);
+  }
+  texts.push_back(std::string(100000, ' ') + "a");
+
+  for (const std::string type : {"unigram", "bpe"}) {
+    const std::string model_prefix = util::JoinPath(
+        absl::GetFlag(FLAGS_test_tmpdir), absl::StrCat("chunked_", type));
+    ASSERT_TRUE(
+        SentencePieceTrainer::Train(
+            absl::StrCat("--input=",
+                         util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                        "botchan.txt"),
+                         " --model_prefix=", model_prefix,
+                         " --vocab_size=1000 --model_type=", type))
+            .ok());
+
+    SentencePieceProcessor sp, parallel;
+    ASSERT_TRUE(sp.Load(model_prefix + ".model").ok());
+    ASSERT_TRUE(parallel.Load(model_prefix + ".model").ok());
+    EXPECT_FALSE(parallel.SetEncodeNumThreads(0).ok());
+    ASSERT_TRUE(parallel.SetEncodeNumThreads(4).ok());
+    for (const std::string extra_options : {"", "bos:eos:reverse"}) {
+      ASSERT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+      ASSERT_TRUE(parallel.SetEncodeExtraOptions(extra_options).ok());
+      for (const auto &text : texts) {
+        // The proto is built from the pieces of the whole text, and has no
+        // repeat runs. The proto of the chunks encoded in parallel may
+        // break ties between segmentations differently.
+        SentencePieceText spt, parallel_spt;
+        EXPECT_TRUE(sp.Encode(text, &spt).ok());
+        EXPECT_TRUE(parallel.Encode(text, &parallel_spt).ok());
+        EXPECT_EQ(spt.text(), parallel_spt.text());
+        std::vector<int> spt_ids, parallel_ids;
+        for (const auto &piece : spt.pieces()) spt_ids.push_back(piece.id());
+        for (const auto &piece : parallel_spt.pieces()) {
+          parallel_ids.push_back(piece.id());
+        }
+        EXPECT_TRUE(sp.VerifyOutputsEquivalent(spt_ids, parallel_ids));
+        if (extra_options.empty() && spt.pieces_size() > 0) {
+          // The pieces cover the same bytes as the ones of the whole text.
+          ASSERT_EQ(spt.pieces_size(), parallel_spt.pieces_size());
+          EXPECT_EQ(spt.pieces(0).begin(), parallel_spt.pieces(0).begin());
+          for (int i = 0; i < parallel_spt.pieces_size(); ++i) {
+            const auto &piece = parallel_spt.pieces(i);
+            if (i > 0) {
+              EXPECT_EQ(parallel_spt.pieces(i - 1).end(), piece.begin());
+            }
+            EXPECT_EQ(text.substr(piece.begin(), piece.end() - piece.begin()),
+                      piece.surface());
+          }
+          EXPECT_EQ(spt.pieces(spt.pieces_size() - 1).end(),
+                    parallel_spt.pieces(parallel_spt.pieces_size() - 1).end());
+        }
+        std::vector<int> expected, ids;
+        for (int i = 0; i < parallel_spt.pieces_size();) {
+          const int id = parallel_spt.pieces(i).id();
+          int j = i + 1;
+          while (!sp.IsUnknown(id) && j < parallel_spt.pieces_size() &&
+                 parallel_spt.pieces(j).id() == id) {
+            ++j;
+          }
+          expected.push_back(id);
+          if (j - i > 1) {
+            expected.push_back(sp.PieceToId("(#startrepeat)"));
+            for (const char c : std::to_string(j - i)) {
+              expected.push_back(sp.PieceToId(std::string(1, c)));
+            }
+            expected.push_back(sp.PieceToId("(#endrepeat)"));
+          }
+          i = j;
+        }
+        EXPECT_TRUE(sp.EncodeIds(text, &ids).ok());
+        EXPECT_EQ(expected, ids);
+        EXPECT_TRUE(parallel.EncodeIds(text, &ids).ok());
+        EXPECT_EQ(expected, ids);
+      }
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, CollapseRepeatRunsTest) {
+  std::vector<std::string> texts = {
+      "", "hello world", std::string(1023, '='),
+      "I saw it " + std::string(10000, '=') + " and then " +
+          std::string(5000, '-') + " again.",
+      std::string(10000, 'a') + "x",
+      "--" + std::string(3001, 'o') + "\xE3\x81\x82",
+      "\xE3\x81\x82" + std::string(4000, ' ') + "end"};
+  std::string mixed = "(";
+  for (int i = 0; i < 5000; ++i) mixed += "-=";
+  for (int i = 0; i < 700; ++i) mixed += "\xE2\x80\x94";  // em dash.
+  for (int i = 0; i < 900; ++i) mixed += "abc.";
+  texts.push_back(mixed + ")");
+  const std::vector<absl::string_view> views(texts.begin(), texts.end());
+
+  for (const std::string type : {"unigram", "bpe"}) {
+    const std::string model_prefix = util::JoinPath(
+        absl::GetFlag(FLAGS_test_tmpdir), absl::StrCat("collapse_", type));
+    ASSERT_TRUE(
+        SentencePieceTrainer::Train(
+            absl::StrCat("--input=",
+                         util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                        "botchan.txt"),
+                         " --model_prefix=", model_prefix,
+                         " --vocab_size=1000 --model_type=", type,
+                         " --user_defined_symbols=====,-=-="))
+            .ok());
+
+    SentencePieceProcessor sp, collapsed;
+    ASSERT_TRUE(sp.Load(model_prefix + ".model").ok());
+    ASSERT_TRUE(collapsed.Load(model_prefix + ".model").ok());
+    ASSERT_TRUE(collapsed.SetCollapseRepeatRuns(true).ok());
+
+    EncodeWorkspace workspace;
+    for (const auto &text : texts) {
+      std::vector<int> expected, ids;
+      ASSERT_TRUE(sp.Encode(text, &expected).ok());
+      ASSERT_TRUE(collapsed.EncodeIds(text, &ids, &workspace).ok());
+      EXPECT_EQ(expected, ids);
+      ASSERT_TRUE(collapsed.Encode(text, &ids).ok());
+      EXPECT_EQ(expected, ids);
+    }
+
+    std::vector<std::vector<int>> expected, ids;
+    ASSERT_TRUE(sp.EncodeBatch(views, &expected, 2).ok());
+    ASSERT_TRUE(collapsed.EncodeBatch(views, &ids, 2).ok());
+    EXPECT_EQ(expected, ids);
+    if (type == "unigram") {
+      ASSERT_TRUE(
+          collapsed.SetBatchEncodeBackend(BatchEncodeBackend::kHost).ok());
+      ASSERT_TRUE(collapsed.EncodeBatch(views, &ids, 2).ok());
+      EXPECT_EQ(expected, ids);
+    }
+
+    ASSERT_TRUE(collapsed.SetCollapseRepeatRuns(false).ok());
+    ASSERT_TRUE(collapsed.EncodeBatch(views, &ids, 2).ok());
+    EXPECT_EQ(expected, ids);
+  }
+}
+
+TEST(SentencePieceProcessorTest, CountTokensTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  for (const char *piece : {"(#startrepeat)", "(#endrepeat)", "0", "1", "2",
+                            "3", "4", "5", "6", "7", "8", "9"}) {
+    AddPiece(&model_proto, piece, -10.0);
+  }
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  std::vector<std::string> texts = {"",         " ",           "ab ab",
+                                    "xxxx",     "abab x ab",   "bbbbbbbbbbbb",
+                                    "ab  ab ab", "x ab bbb xx"};
+  std::string text;
+  for (int i = 0; i < 3000; ++i) text += i % 7 == 0 ? "xx " : "ab bbb ";
+  texts.push_back(text);
+  texts.push_back(std::string(10000, 'b'));
+  const std::vector<absl::string_view> views(texts.begin(), texts.end());
+
+  auto expect_counts = [&](const SentencePieceProcessor &sp) {
+    EncodeWorkspace workspace;
+    std::vector<size_t> expected;
+    for (const auto &text : texts) {
+      std::vector<int> ids;
+      size_t num_tokens = 0;
+      ASSERT_TRUE(sp.EncodeIds(text, &ids).ok());
+      EXPECT_TRUE(sp.CountTokens(text, &num_tokens).ok());
+      EXPECT_EQ(ids.size(), num_tokens);
+      num_tokens = 0;
+      EXPECT_TRUE(sp.CountTokens(text, &num_tokens, &workspace).ok());
+      EXPECT_EQ(ids.size(), num_tokens);
+      expected.push_back(ids.size());
+    }
+    std::vector<size_t> num_tokens = {1, 2, 3};
+    EXPECT_TRUE(sp.CountTokensBatch(views, &num_tokens, 3).ok());
+    EXPECT_EQ(expected, num_tokens);
+  };
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  expect_counts(sp);
+  EXPECT_FALSE(sp.CountTokens("ab", nullptr).ok());
+  EXPECT_FALSE(sp.CountTokensBatch(views, nullptr, 1).ok());
+
+  ASSERT_TRUE(sp.SetEncodeExtraOptions("bos:eos").ok());
+  expect_counts(sp);
+  ASSERT_TRUE(sp.SetEncodeMaxTokens(20).ok());
+  expect_counts(sp);
+  ASSERT_TRUE(sp.SetEncodeMaxTokens(20, TruncationSide::kLeft).ok());
+  expect_counts(sp);
+  ASSERT_TRUE(sp.SetEncodeMaxTokens(0).ok());
+  ASSERT_TRUE(sp.SetWordCacheSize(100).ok());
+  expect_counts(sp);
+
+  // Counting answers from the cache, but does not fill it.
+  ASSERT_TRUE(sp.SetEncodeCacheSize(1 << 20).ok());
+  const EncodeStats before = SentencePieceProcessor::GetStats();
+  size_t num_tokens = 0;
+  EXPECT_TRUE(sp.CountTokens("ab ab", &num_tokens).ok());
+  EXPECT_EQ(6, num_tokens);  // <s>, the run of two "\u2581ab" and </s>.
+  EXPECT_EQ(0, sp.GetMemoryUsage().encode_cache);
+  expect_counts(sp);
+  const EncodeStats after = SentencePieceProcessor::GetStats();
+#ifdef SPM_ENABLE_STATS
+  EXPECT_LT(before.cache_hits, after.cache_hits);
+#else
+  EXPECT_EQ(before.cache_hits, after.cache_hits);
+#endif
+}
+
+TEST(SentencePieceProcessorTest, EncodeMaxTokensTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  for (const char *piece : {"(#startrepeat)", "(#endrepeat)", "0", "1", "2",
+                            "3", "4", "5", "6", "7", "8", "9"}) {
+    AddPiece(&model_proto, piece, -10.0);
+  }
+  const int start_repeat = 7, end_repeat = 8, zero = 9;
+
+  // Random texts with long repeat runs, unknown characters and spaces.
+  std::mt19937 mt(0);
+  const std::vector<std::string> words = {"ab", "abababab", "a", "b", "x",
+                                          "xx", " ", "  ", "bbbbbbbbbbbb"};
+  std::uniform_int_distribution<int> dist(0, words.size() - 1);
+  std::vector<std::string> texts = {"", " ", "ab", "ab ab ab ab"};
+  for (const int size : {5, 50, 200, 1000}) {
+    for (int n = 0; n < 10; ++n) {
+      std::string text;
+      for (int i = 0; i < size; ++i) text += words[dist(mt)];
+      texts.push_back(text);
+    }
+  }
+  texts.push_back(std::string(3000, 'b'));
+
+  auto expand = [&](const std::vector<int> &ids) {
+    std::vector<int> raw;
+    for (size_t i = 0; i < ids.size(); ++i) {
+      if (ids[i] != start_repeat) {
+        raw.push_back(ids[i]);
+        continue;
+      }
+      int count = 0;
+      for (++i; ids[i] != end_repeat; ++i) count = count * 10 + ids[i] - zero;
+      raw.insert(raw.end(), count - 1, raw.back());
+    }
+    return raw;
+  };
+  auto run_length_encode = [&](const std::vector<int> &raw) {
+    std::vector<int> ids;
+    for (size_t i = 0; i < raw.size();) {
+      size_t j = i + 1;
+      if (raw[i] != 0) {
+        while (j < raw.size() && raw[j] == raw[i]) ++j;
+      }
+      ids.push_back(raw[i]);
+      if (j - i > 1) {
+        ids.push_back(start_repeat);
+        for (const char c : std::to_string(j - i)) {
+          ids.push_back(zero + c - '0');
+        }
+        ids.push_back(end_repeat);
+      }
+      i = j;
+    }
+    return ids;
+  };
+
+  for (const bool remove_extra_whitespaces : {true, false}) {
+    // Without removing the extra whitespaces, the input is not cut.
+    *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+    model_proto.mutable_normalizer_spec()->set_remove_extra_whitespaces(
+        remove_extra_whitespaces);
+    SentencePieceProcessor sp, truncated;
+    ASSERT_TRUE(sp.Load(model_proto).ok());
+    ASSERT_TRUE(truncated.Load(model_proto).ok());
+    EXPECT_FALSE(truncated.SetEncodeMaxTokens(-1).ok());
+
+    for (const std::string extra_options : {"", "bos:eos", "reverse:bos"}) {
+      ASSERT_TRUE(truncated.SetEncodeExtraOptions(extra_options).ok());
+      for (const auto side : {TruncationSide::kRight, TruncationSide::kLeft}) {
+        for (const int max_tokens : {2, 3, 4, 5, 7, 30, 100, 1000}) {
+          ASSERT_TRUE(truncated.SetEncodeMaxTokens(max_tokens, side).ok());
+          for (const auto &text : texts) {
+            std::vector<int> ids;
+            EXPECT_TRUE(truncated.EncodeIds(text, &ids).ok());
+
+            // The longest part of the text whose ids fit.
+            std::vector<int> full;
+            EXPECT_TRUE(sp.EncodeIds(text, &full).ok());
+            const std::vector<int> raw = expand(full);
+            std::vector<int> expected;
+            for (size_t size = raw.size() + 1; size-- > 0;) {
+              expected.assign(side == TruncationSide::kRight
+                                  ? raw.begin()
+                                  : raw.end() - size,
+                              side == TruncationSide::kRight
+                                  ? raw.begin() + size
+                                  : raw.end());
+              for (const auto &option : absl::StrSplit(extra_options, ":")) {
+                if (option == "reverse") {
+                  std::reverse(expected.begin(), expected.end());
+                } else if (option == "bos") {
+                  expected.insert(expected.begin(), sp.bos_id());
+                } else if (option == "eos") {
+                  expected.push_back(sp.eos_id());
+                }
+              }
+              expected = run_length_encode(expected);
+              if (expected.size() <= static_cast<size_t>(max_tokens)) break;
+            }
+            EXPECT_EQ(expected, ids);
+          }
+        }
+      }
+
+      std::vector<absl::string_view> inputs(texts.begin(), texts.end());
+      std::vector<std::vector<int>> batch;
+      EXPECT_TRUE(truncated.EncodeBatch(inputs, &batch, 2).ok());
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        std::vector<int> ids;
+        EXPECT_TRUE(truncated.EncodeIds(inputs[i], &ids).ok());
+        EXPECT_EQ(ids, batch[i]);
+      }
+    }
+
+    // No room for bos and eos.
+    ASSERT_TRUE(truncated.SetEncodeExtraOptions("bos:eos").ok());
+    ASSERT_TRUE(truncated.SetEncodeMaxTokens(1).ok());
+    std::vector<int> ids;
+    EXPECT_FALSE(truncated.EncodeIds("ab", &ids).ok());
+    ASSERT_TRUE(truncated.SetEncodeMaxTokens(0).ok());
+    EXPECT_TRUE(truncated.EncodeIds("ab", &ids).ok());
+    EXPECT_EQ(std::vector<int>({1, 3, 2}), ids);
+  }
+}
+
+TEST(SentencePieceProcessorTest, StreamingEncoderTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, WS "ba", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, WS "a", 0.3);
+  AddPiece(&model_proto, WS "b", 0.3);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  // Unknown pieces and runs of pieces span the cuts.
+  const std::string text = "ab ba  abab x  y ab ab ab b ";
+
+  auto encode_streaming = [&](const SentencePieceProcessor &sp, int size,
+                              std::vector<int> *ids) {
+    StreamingEncoder encoder(sp);
+    ids->clear();
+    size_t max_buffered_size = 0;
+    std::vector<int> final_ids;
+    for (size_t begin = 0; begin < text.size(); begin += size) {
+      EXPECT_TRUE(encoder.Push(text.substr(begin, size), &final_ids).ok());
+      ids->insert(ids->end(), final_ids.begin(), final_ids.end());
+      max_buffered_size = std::max(max_buffered_size, encoder.buffered_size());
+    }
+    EXPECT_TRUE(encoder.Finish(&final_ids).ok());
+    ids->insert(ids->end(), final_ids.begin(), final_ids.end());
+    EXPECT_EQ(0, encoder.buffered_size());
+    return max_buffered_size;
+  };
+
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    for (const char *extra_options : {"", "bos:eos", "eos:bos:bos"}) {
+      SentencePieceProcessor sp;
+      EXPECT_TRUE(sp.Load(model_proto).ok());
+      EXPECT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+      std::vector<int> expected, ids;
+      EXPECT_TRUE(sp.EncodeIds(text, &expected).ok());
+      for (int size = 1; size <= 5; ++size) {
+        EXPECT_GE(size + 5, encode_streaming(sp, size, &ids));
+        EXPECT_EQ(expected, ids);
+      }
+    }
+  }
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  // Ids are returned once the next word begins and the next id differs.
+  {
+    StreamingEncoder encoder(sp);
+    std::vector<int> ids;
+    EXPECT_TRUE(encoder.Push("ab ba a", &ids).ok());
+    EXPECT_EQ(std::vector<int>({3}), ids);
+    EXPECT_EQ(1, encoder.buffered_size());
+    EXPECT_TRUE(encoder.Push("b", &ids).ok());
+    EXPECT_TRUE(ids.empty());
+    EXPECT_TRUE(encoder.Finish(&ids).ok());
+    EXPECT_EQ(std::vector<int>({4, 3}), ids);
+
+    // The encoder is reusable after Finish().
+    EXPECT_TRUE(encoder.Push("ab", &ids).ok());
+    EXPECT_TRUE(ids.empty());
+    EXPECT_TRUE(encoder.Finish(&ids).ok());
+    EXPECT_EQ(std::vector<int>({3}), ids);
+  }
+
+  // The reverse extra option needs the whole text.
+  {
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("reverse").ok());
+    StreamingEncoder encoder(sp);
+    std::vector<int> ids;
+    EXPECT_FALSE(encoder.Push("ab", &ids).ok());
+    EXPECT_FALSE(encoder.Finish(&ids).ok());
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("").ok());
+  }
+
+  // A piece spanning a word boundary keeps the whole text.
+  AddPiece(&model_proto, "b" WS "a", 2.0);
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+  std::vector<int> expected, ids;
+  EXPECT_TRUE(sp.EncodeIds(text, &expected).ok());
+  EXPECT_EQ(text.size(), encode_streaming(sp, 3, &ids));
+  EXPECT_EQ(expected, ids);
+}
+
+TEST(SentencePieceProcessorTest, IncrementalEncoderTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 1.0);
+  AddPiece(&model_proto, WS "ba", 1.0);
+  AddPiece(&model_proto, "ab", 0.5);
+  AddPiece(&model_proto, WS "a", 0.3);
+  AddPiece(&model_proto, WS "b", 0.3);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  // Random texts and edits with unknown pieces and runs of pieces.
+  std::mt19937 mt(0);
+  const std::vector<std::string> words = {"ab", "ba", "abab", "x", "xy",
+                                          " ",  "  ", "b",    "ab ab ab"};
+  std::uniform_int_distribution<int> word_dist(0, words.size() - 1);
+  auto random_text = [&](int num_words) {
+    std::string text;
+    for (int i = 0; i < num_words; ++i) text += words[word_dist(mt)];
+    return text;
+  };
+
+  auto expect_same = [](const SentencePieceProcessor &sp,
+                        const IncrementalEncoder &encoder) {
+    std::vector<int> expected, ids;
+    EXPECT_TRUE(sp.EncodeIds(encoder.text(), &expected).ok());
+    EXPECT_TRUE(encoder.GetIds(&ids).ok());
+    EXPECT_EQ(expected, ids);
+
+    // Raw pieces and offsets are before the extra options.
+    SentencePieceProcessor plain;
+    ASSERT_TRUE(plain.Load(sp.model_proto()).ok());
+    SentencePieceText spt;
+    EXPECT_TRUE(plain.Encode(encoder.text(), &spt).ok());
+    ASSERT_EQ(spt.pieces_size(), encoder.num_pieces());
+    for (int i = 0; i < spt.pieces_size(); ++i) {
+      EXPECT_EQ(spt.pieces(i).id(), encoder.raw_ids()[i]);
+      EXPECT_EQ(spt.pieces(i).begin(), encoder.begins()[i]);
+      EXPECT_EQ(spt.pieces(i).end(), encoder.ends()[i]);
+    }
+  };
+
+  for (const auto type : {TrainerSpec::UNIGRAM, TrainerSpec::BPE}) {
+    model_proto.mutable_trainer_spec()->set_model_type(type);
+    for (const char *extra_options : {"", "bos:eos:reverse"}) {
+      SentencePieceProcessor sp;
+      ASSERT_TRUE(sp.Load(model_proto).ok());
+      ASSERT_TRUE(sp.SetEncodeExtraOptions(extra_options).ok());
+      IncrementalEncoder encoder(sp);
+      ASSERT_TRUE(encoder.SetText(random_text(50)).ok());
+      expect_same(sp, encoder);
+      for (int n = 0; n < 300; ++n) {
+        const size_t size = encoder.text().size();
+        const size_t offset = std::uniform_int_distribution<size_t>(0, size)(mt);
+        const size_t length = std::uniform_int_distribution<size_t>(
+            0, std::min<size_t>(size - offset, 10))(mt);
+        ASSERT_TRUE(
+            encoder.Replace(offset, length, random_text(n % 3)).ok());
+        expect_same(sp, encoder);
+      }
+    }
+  }
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  IncrementalEncoder encoder(sp);
+  std::string text;
+  for (int i = 0; i < 1000; ++i) text += "abab ba ";
+  ASSERT_TRUE(encoder.SetText(text).ok());
+  EXPECT_EQ(text.size(), encoder.last_encoded_size());
+
+  // Only the words around the edit are encoded again.
+  ASSERT_TRUE(encoder.Replace(4000, 2, "b xab").ok());
+  expect_same(sp, encoder);
+  EXPECT_GT(30, encoder.last_encoded_size());
+  ASSERT_TRUE(encoder.Replace(0, 0, "ba").ok());
+  expect_same(sp, encoder);
+  EXPECT_GT(30, encoder.last_encoded_size());
+  ASSERT_TRUE(encoder.Replace(encoder.text().size(), 0, " x").ok());
+  expect_same(sp, encoder);
+  EXPECT_GT(30, encoder.last_encoded_size());
+  EXPECT_FALSE(encoder.Replace(encoder.text().size() + 1, 0, "a").ok());
+  EXPECT_FALSE(encoder.Replace(0, encoder.text().size() + 1, "a").ok());
+
+  // A piece spanning a word boundary needs the whole text.
+  AddPiece(&model_proto, "b" WS "a", 2.0);
+  ASSERT_TRUE(sp.Load(model_proto).ok());
+  IncrementalEncoder whole(sp);
+  ASSERT_TRUE(whole.SetText(text).ok());
+  ASSERT_TRUE(whole.Replace(4000, 2, "b xab").ok());
+  expect_same(sp, whole);
+  EXPECT_EQ(whole.text().size(), whole.last_encoded_size());
+}
+
+TEST(SentencePieceProcessorTest, DecodeIdsTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("</s>");
+  AddPiece(&model_proto, WS "ab", 0.0);  // 2
+  AddPiece(&model_proto, "c" WS, 0.0);   // 3
+  AddPiece(&model_proto, WS, 0.0);       // 4
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  auto decode = [&](const std::vector<int> &ids) {
+    std::string text;
+    EXPECT_TRUE(sp.Decode(ids, &text).ok());
+    SentencePieceText spt;
+    EXPECT_TRUE(sp.Decode(ids, &spt).ok());
+    EXPECT_EQ(spt.text(), text);
+    return text;
+  };
+
+  EXPECT_EQ("ab", decode({2}));
+  EXPECT_EQ("abc   ab", decode({2, 3, 4, 2}));
+  EXPECT_EQ(" ⁇ c  ab", decode({0, 3, 2}));
+
+  EXPECT_TRUE(sp.SetDecodeExtraOptions("reverse:eos").ok());
+  EXPECT_EQ("c  ab", decode({2, 3}));
+
+  std::string text;
+  EXPECT_FALSE(sp.Decode(std::vector<int>({2, 5}), &text).ok());
+  EXPECT_FALSE(sp.Decode(std::vector<int>({-1}), &text).ok());
+}
+
+TEST(SentencePieceProcessorTest, StreamingDecoderTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+  for (const char *piece : {WS "hello", WS, "lo", "U", "A", "T", "L", "x" WS,
+                            "(#startrepeat)", "(#endrepeat)", "0", "1", "2"}) {
+    AddPiece(&model_proto, piece, 0.0);
+  }
+  for (int i = 0; i < 256; ++i) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(ByteToPiece(i));
+    sp->set_type(ModelProto::SentencePiece::BYTE);
+  }
+  model_proto.mutable_trainer_spec()->set_byte_fallback(true);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  // Decodes `ids` given in fragments of `size` ids.
+  auto decode_streaming = [](const SentencePieceProcessor &sp,
+                             const std::vector<int> &ids, int size) {
+    StreamingDecoder decoder(sp);
+    std::string text, final_text;
+    for (size_t begin = 0; begin < ids.size(); begin += size) {
+      const std::vector<int> fragment(
+          ids.begin() + begin,
+          ids.begin() + std::min(ids.size(), begin + size));
+      EXPECT_TRUE(decoder.Push(fragment, &final_text).ok());
+      text += final_text;
+    }
+    EXPECT_TRUE(decoder.Finish(&final_text).ok());
+    return text + final_text;
+  };
+
+  // Random ids of the non-byte pieces and some bytes, so that byte pieces
+  // form both valid and invalid UTF-8.
+  std::vector<int> candidates;
+  for (int id = 0; id < 16; ++id) candidates.push_back(id);
+  for (const int byte : {0x41, 0x20, 0xE3, 0x81, 0x82, 0xC3, 0xA9, 0xFF}) {
+    candidates.push_back(16 + byte);
+  }
+  auto test_random_ids = [&](const SentencePieceProcessor &sp) {
+    std::mt19937 mt(0);
+    std::uniform_int_distribution<int> dist(0, candidates.size() - 1);
+    for (int n = 0; n < 300; ++n) {
+      std::vector<int> ids(n % 20);
+      for (auto &id : ids) id = candidates[dist(mt)];
+      std::string expected;
+      EXPECT_TRUE(sp.Decode(ids, &expected).ok());
+      // Decode() into a string skips SentencePieceText.
+      SentencePieceText spt;
+      EXPECT_TRUE(sp.Decode(ids, &spt).ok());
+      EXPECT_EQ(spt.text(), expected);
+      std::vector<std::string> pieces;
+      for (const int id : ids) pieces.push_back(sp.IdToPiece(id));
+      std::string pieces_text;
+      EXPECT_TRUE(sp.Decode(pieces, &pieces_text).ok());
+      EXPECT_TRUE(sp.Decode(pieces, &spt).ok());
+      EXPECT_EQ(spt.text(), pieces_text);
+      size_t end = 0;
+      for (const auto &piece : spt.pieces()) {
+        EXPECT_EQ(end, piece.begin());
+        end = piece.end();
+      }
+      EXPECT_EQ(expected, decode_streaming(sp, ids, 1));
+      EXPECT_EQ(expected, decode_streaming(sp, ids, 3));
+    }
+  };
+
+  {
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_proto).ok());
+    test_random_ids(sp);
+    EXPECT_TRUE(sp.SetDecodeExtraOptions("bos:eos").ok());
+    test_random_ids(sp);
+
+    // Only the final text is returned.
+    StreamingDecoder decoder(sp);
+    std::string text;
+    EXPECT_TRUE(decoder.Push(3, &text).ok());
+    EXPECT_EQ("hello", text);
+    EXPECT_TRUE(decoder.Push(std::vector<int>({5, 11, 14, 12}), &text).ok());
+    EXPECT_EQ("lo", text);
+    EXPECT_TRUE(decoder.Push(std::vector<int>({16 + 0xE3}), &text).ok());
+    EXPECT_TRUE(text.empty());
+    EXPECT_TRUE(
+        decoder.Push(std::vector<int>({16 + 0x81, 16 + 0x82}), &text).ok());
+    EXPECT_EQ("\xe3\x81\x82", text);
+    EXPECT_TRUE(decoder.Push(16 + 0xE3, &text).ok());
+    EXPECT_TRUE(text.empty());
+    EXPECT_TRUE(decoder.Finish(&text).ok());
+    EXPECT_EQ("\xef\xbf\xbd", text);
+
+    EXPECT_FALSE(decoder.Push(sp.GetPieceSize(), &text).ok());
+    EXPECT_TRUE(sp.SetDecodeExtraOptions("reverse").ok());
+    EXPECT_FALSE(decoder.Push(3, &text).ok());
+  }
+
+  // Whitespace as suffix.
+  {
+    auto suffix_model_proto = model_proto;
+    suffix_model_proto.mutable_trainer_spec()->set_treat_whitespace_as_suffix(
+        true);
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(suffix_model_proto).ok());
+    test_random_ids(sp);
+    EXPECT_TRUE(sp.SetDecodeExtraOptions("eos").ok());
+    test_random_ids(sp);
+  }
+
+  // Case decoding.
+  {
+    auto case_model_proto = model_proto;
+    auto *spec = case_model_proto.mutable_denormalizer_spec();
+    spec->set_decode_case(true);
+    spec->set_add_dummy_prefix(false);
+    spec->set_remove_extra_whitespaces(false);
+    spec->set_escape_whitespaces(false);
+    EXPECT_TRUE(SentencePieceTrainer::PopulateNormalizerSpec(spec, true).ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(case_model_proto).ok());
+    test_random_ids(sp);
+
+    // The text is held until a space outside a span of uppercase words.
+    StreamingDecoder decoder(sp);
+    std::string text, expected;
+    EXPECT_TRUE(decoder.Push(3, &text).ok());
+    EXPECT_TRUE(text.empty());
+    EXPECT_TRUE(decoder.Push(3, &text).ok());
+    EXPECT_EQ("hello ", text);
+    EXPECT_TRUE(decoder.Push(std::vector<int>({7, 5, 3}), &text).ok());
+    EXPECT_TRUE(text.empty());
+    EXPECT_TRUE(decoder.Finish(&text).ok());
+    EXPECT_TRUE(sp.Decode(std::vector<int>({3, 3, 7, 5, 3}), &expected).ok());
+    EXPECT_EQ(expected, "hello " + text);
+  }
+}
+
+TEST(SentencePieceProcessorTest, EndToEndTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  auto *sp2 = model_proto.add_pieces();
+  auto *sp3 = model_proto.add_pieces();
+
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  sp2->set_type(ModelProto::SentencePiece::CONTROL);
+  sp2->set_piece("<s>");
+  sp3->set_type(ModelProto::SentencePiece::CONTROL);
+  sp3->set_piece("</s>");
+
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.3);
+  AddPiece(&model_proto, "c", 0.2);
+  AddPiece(&model_proto, "ab", 1.0);
+  AddPiece(&model_proto, "\xE2\x96\x81", 3.0);  // kSpaceSymbol
+
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  {
+    auto output = filesystem::NewWritableFile(
+        util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "model"), true);
+    output->Write(model_proto.SerializeAsString());
+  }
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(
+      sp.Load(util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "model")).ok());
+
+  EXPECT_EQ(model_proto.SerializeAsString(),
+            sp.model_proto().SerializeAsString());
+
+  EXPECT_EQ(8, sp.GetPieceSize());
+  EXPECT_EQ(0, sp.PieceToId("<unk>"));
+  EXPECT_EQ(1, sp.PieceToId("<s>"));
+  EXPECT_EQ(2, sp.PieceToId("</s>"));
+  EXPECT_EQ(3, sp.PieceToId("a"));
+  EXPECT_EQ(4, sp.PieceToId("b"));
+  EXPECT_EQ(5, sp.PieceToId("c"));
+  EXPECT_EQ(6, sp.PieceToId("ab"));
+  EXPECT_EQ(7, sp.PieceToId("\xE2\x96\x81"));
+
+  EXPECT_EQ("<unk>", sp.IdToPiece(0));
+  EXPECT_EQ("<s>", sp.IdToPiece(1));
+  EXPECT_EQ("</s>", sp.IdToPiece(2));
+  EXPECT_EQ("a", sp.IdToPiece(3));
+  EXPECT_EQ("b", sp.IdToPiece(4));
+  EXPECT_EQ("c", sp.IdToPiece(5));
+  EXPECT_EQ("ab", sp.IdToPiece(6));
+  EXPECT_EQ("\xE2\x96\x81", sp.IdToPiece(7));
+
+  EXPECT_NEAR(0.0, sp.GetScore(0), 0.001);
+  EXPECT_NEAR(0.0, sp.GetScore(1), 0.001);
+  EXPECT_NEAR(0.0, sp.GetScore(2), 0.001);
+  EXPECT_NEAR(0.0, sp.GetScore(3), 0.001);
+  EXPECT_NEAR(0.3, sp.GetScore(4), 0.001);
+  EXPECT_NEAR(0.2, sp.GetScore(5), 0.001);
+  EXPECT_NEAR(1.0, sp.GetScore(6), 0.001);
+  EXPECT_NEAR(3.0, sp.GetScore(7), 0.001);
+
+  EXPECT_TRUE(sp.IsUnknown(0));
+  EXPECT_FALSE(sp.IsUnknown(1));
+  EXPECT_FALSE(sp.IsUnknown(2));
+  EXPECT_FALSE(sp.IsUnknown(3));
+  EXPECT_FALSE(sp.IsUnknown(4));
+  EXPECT_FALSE(sp.IsUnknown(5));
+  EXPECT_FALSE(sp.IsUnknown(6));
+  EXPECT_FALSE(sp.IsUnknown(7));
+
+  EXPECT_FALSE(sp.IsControl(0));
+  EXPECT_TRUE(sp.IsControl(1));
+  EXPECT_TRUE(sp.IsControl(2));
+  EXPECT_FALSE(sp.IsControl(3));
+  EXPECT_FALSE(sp.IsControl(4));
+  EXPECT_FALSE(sp.IsControl(5));
+  EXPECT_FALSE(sp.IsControl(6));
+  EXPECT_FALSE(sp.IsControl(7));
+
+  EXPECT_EQ(0, sp.unk_id());
+  EXPECT_EQ(1, sp.bos_id());
+  EXPECT_EQ(2, sp.eos_id());
+  EXPECT_EQ(-1, sp.pad_id());
+
+  {
+    // Verify the default encoder version.
+    EXPECT_EQ(EncoderVersion::kOptimized, sp.GetEncoderVersion());
+
+    // Set the encoder version to original and verify.
+    EXPECT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+    EXPECT_EQ(EncoderVersion::kOriginal, sp.GetEncoderVersion());
+
+    // Set back to the default encoder version.
+    EXPECT_TRUE(sp.SetEncoderVersion(EncoderVersion::kOptimized).ok());
+  }
+
+  {
+    std::vector<std::string> sps;
+    const std::vector<std::string> expected_str = {WS, "ab", "c"};
+    EXPECT_TRUE(sp.Encode("abc", &sps).ok());
+    EXPECT_EQ(expected_str, sps);
+
+    std::vector<int> ids;
+    const std::vector<int> expected_id = {7, 6, 5};
+    EXPECT_TRUE(sp.Encode("abc", &ids).ok());
+    EXPECT_EQ(expected_id, ids);
+  }
+
+  {
+    EXPECT_TRUE(sp.SetEncodeExtraOptions("bos").ok());
+
+    std::vector<std::string> sps;
+    const std::vector<std::string> expected_str = {"<s>", WS, "ab", "c"};
+    EXPECT_TRUE(sp.Encode("abc", &sps).ok());
+    EXPECT_EQ(expected_str, sps);
+
+    std::vector<int> ids;
+    const std::vector<int> expected_id = {1, 7, 6, 5};
+    EXPECT_TRUE(sp.Encode("abc", &ids).ok());
     EXPECT_EQ(expected_id, ids);
   }
 
@@ -1269,6 +4650,76 @@ TEST(SentencePieceProcessorTest, EndToEndTest) {
     EXPECT_TRUE(sp.Encode("abc", &ids).ok());
     EXPECT_EQ(expected_id, ids);
   }
+
+  // Per-call vocabulary restriction.
+  {
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_proto).ok());
+    std::shared_ptr<const VocabularyMask> mask;
+    EXPECT_TRUE(sp.MakeVocabularyMask({"a", "b", "c"}, &mask).ok());
+    EXPECT_FALSE(sp.IsUnused(6));  // "ab" is not removed from `sp`.
+
+    EncodeWorkspace workspace;
+    workspace.vocabulary = mask.get();
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.EncodeIds("abc", &ids, &workspace).ok());
+    EXPECT_EQ(std::vector<int>({7, 3, 4, 5}), ids);
+
+    ids.clear();
+    EXPECT_TRUE(sp.EncodeIds("abc", &ids).ok());
+    EXPECT_EQ(std::vector<int>({7, 6, 5}), ids);
+    EXPECT_EQ(model_proto.SerializeAsString(),
+              sp.model_proto().SerializeAsString());
+
+    // The per-call mask overrides SetVocabulary().
+    std::shared_ptr<const VocabularyMask> full_mask;
+    EXPECT_TRUE(sp.MakeVocabularyMask({"ab"}, &full_mask).ok());
+    EXPECT_TRUE(sp.SetVocabulary({"a"}).ok());
+    workspace.vocabulary = full_mask.get();
+    ids.clear();
+    EXPECT_TRUE(sp.EncodeIds("abc", &ids, &workspace).ok());
+    EXPECT_EQ(std::vector<int>({7, 6, 5}), ids);
+  }
+}
+
+TEST(SentencePieceProcessorTest, BPEVocabularyTest) {
+  ModelProto model_proto;
+  auto *sp1 = model_proto.add_pieces();
+  sp1->set_type(ModelProto::SentencePiece::UNKNOWN);
+  sp1->set_piece("<unk>");
+  AddPiece(&model_proto, "abcd", 10.0);
+  AddPiece(&model_proto, "abc", 5.0);
+  AddPiece(&model_proto, "ab", 2.0);
+  AddPiece(&model_proto, "cd", 1.0);
+  AddPiece(&model_proto, "a", 0.0);
+  AddPiece(&model_proto, "b", 0.0);
+  AddPiece(&model_proto, "c", 0.0);
+  AddPiece(&model_proto, "d", 0.0);
+  AddPiece(&model_proto, WS, 0.0);
+  model_proto.mutable_trainer_spec()->set_model_type(TrainerSpec::BPE);
+  *(model_proto.mutable_normalizer_spec()) = MakeDefaultNormalizerSpec();
+
+  SentencePieceProcessor sp;
+  EXPECT_TRUE(sp.Load(model_proto).ok());
+
+  // "abcd" and "abc" are resegmented with the merges that built them.
+  const std::vector<std::string> expected = {WS, "ab", "c", "d"};
+  std::vector<std::string> pieces;
+  EXPECT_TRUE(sp.SetVocabulary({"ab"}).ok());
+  EXPECT_TRUE(sp.Encode("abcd", &pieces).ok());
+  EXPECT_EQ(expected, pieces);
+
+  EXPECT_TRUE(sp.ResetVocabulary().ok());
+  EXPECT_TRUE(sp.Encode("abcd", &pieces).ok());
+  EXPECT_EQ(std::vector<std::string>({WS, "abcd"}), pieces);
+
+  std::shared_ptr<const VocabularyMask> mask;
+  EXPECT_TRUE(sp.MakeVocabularyMask({"ab"}, &mask).ok());
+  EncodeWorkspace workspace;
+  workspace.vocabulary = mask.get();
+  std::vector<int> ids;
+  EXPECT_TRUE(sp.EncodeIds("abcd", &ids, &workspace).ok());
+  EXPECT_EQ(std::vector<int>({9, 3, 7, 8}), ids);
 }
 
 TEST(SentencePieceProcessorTest, SkipNormalizationTest) {
@@ -1458,5 +4909,276 @@ TEST(SentencePieceProcessorTest, VocabularyTest) {
   EXPECT_TRUE(sp.IsUnused(5));
   EXPECT_FALSE(sp.IsUnused(6));
   EXPECT_FALSE(sp.IsUnused(7));
+
+  // Binary counts by piece id.
+  auto GetBinaryFilename = [](absl::string_view content) {
+    const std::string filename =
+        util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "vocab.counts");
+    auto out = filesystem::NewWritableFile(filename, true);
+    out->Write(content);
+    return filename;
+  };
+  auto GetCountsFilename = [&](const SentencePieceProcessor &model,
+                               const std::vector<uint64_t> &counts) {
+    std::string serialized;
+    EXPECT_TRUE(model.SerializeVocabularyCounts(counts, &serialized).ok());
+    return GetBinaryFilename(serialized);
+  };
+  std::string serialized;
+  EXPECT_FALSE(sp.SerializeVocabularyCounts({1, 2, 3}, &serialized).ok());
+  EXPECT_FALSE(
+      sp.SerializeVocabularyCounts(std::vector<uint64_t>(8), nullptr).ok());
+
+  EXPECT_TRUE(
+      sp.LoadVocabulary(GetCountsFilename(sp, {0, 0, 0, 0, 3, 1, 2, 0}), 2)
+          .ok());
+  EXPECT_TRUE(sp.IsUnused(3));
+  EXPECT_FALSE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_FALSE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  // Unlike in TSV, pieces which never appear are OOV with threshold 0.
+  EXPECT_TRUE(
+      sp.LoadVocabulary(GetCountsFilename(sp, {0, 0, 0, 5, 0, 0, 0, 0}), 0)
+          .ok());
+  EXPECT_FALSE(sp.IsUnused(3));
+  EXPECT_TRUE(sp.IsUnused(4));
+  EXPECT_TRUE(sp.IsUnused(5));
+  EXPECT_TRUE(sp.IsUnused(6));
+  EXPECT_FALSE(sp.IsUnused(7));
+
+  // The counts of another model and broken files are rejected.
+  SentencePieceProcessor other;
+  AddPiece(&model_proto, "ff", 0.0);
+  EXPECT_TRUE(other.Load(model_proto).ok());
+  EXPECT_FALSE(sp.LoadVocabulary(
+                     GetCountsFilename(other, std::vector<uint64_t>(9, 1)), 0)
+                   .ok());
+  EXPECT_TRUE(
+      sp.SerializeVocabularyCounts(std::vector<uint64_t>(8, 1), &serialized)
+          .ok());
+  EXPECT_FALSE(sp.LoadVocabulary(GetBinaryFilename(absl::string_view(
+                                     serialized.data(), serialized.size() - 1)),
+                                 0)
+                   .ok());
+  EXPECT_FALSE(
+      sp.LoadVocabulary(GetBinaryFilename(serialized + "x"), 0).ok());
+}
+TEST(SentencePieceProcessorTest, CompactRepeatCountsTest) {
+  auto train = [](const std::string &name, const std::string &args) {
+    const std::string model_prefix =
+        util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), name);
+    EXPECT_TRUE(
+        SentencePieceTrainer::Train(
+            absl::StrCat("--input=",
+                         util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                        "botchan.txt"),
+                         " --model_prefix=", model_prefix,
+                         " --vocab_size=1000 ", args))
+            .ok());
+    return model_prefix + ".model";
+  };
+
+  SentencePieceProcessor classic, sp;
+  ASSERT_TRUE(classic.Load(train("classic_repeat", "")).ok());
+  ASSERT_TRUE(sp.Load(train("compact_repeat", "--compact_repeat_counts")).ok());
+  EXPECT_TRUE(classic.IsUnknown(classic.PieceToId("<rep:1>")));
+  for (const char *piece :
+       {"<rep:1>", "<rep:15>", "<rep:16>", "<rep:1048576>"}) {
+    EXPECT_TRUE(sp.IsControl(sp.PieceToId(piece)));
+  }
+
+  // Expands the count pieces of `ids`.
+  auto expand = [&](const std::vector<int> &ids) {
+    std::vector<int> raw;
+    for (const int id : ids) {
+      const std::string &piece = sp.IdToPiece(id);
+      EXPECT_NE("(#startrepeat)", piece);
+      if (piece.compare(0, 5, "<rep:") == 0) {
+        raw.insert(raw.end(), std::stoi(piece.substr(5)), raw.back());
+      } else {
+        raw.push_back(id);
+      }
+    }
+    return raw;
+  };
+
+  const std::vector<std::string> texts = {
+      "", "hello world", "I am a cat!!", std::string(17, '!'),
+      std::string(1000, '!') + " ab " + std::string(47, '!')};
+  for (const auto &text : texts) {
+    // The proto has no repeat runs.
+    SentencePieceText spt;
+    ASSERT_TRUE(sp.Encode(text, &spt).ok());
+    std::vector<int> raw;
+    for (const auto &piece : spt.pieces()) raw.push_back(piece.id());
+
+    std::vector<int> ids, classic_ids;
+    ASSERT_TRUE(sp.Encode(text, &ids).ok());
+    ASSERT_TRUE(classic.Encode(text, &classic_ids).ok());
+    EXPECT_EQ(raw, expand(ids));
+    EXPECT_LE(ids.size(), classic_ids.size());
+    EXPECT_EQ(spt.text(), sp.DecodeIds(ids));
+
+    std::vector<std::string> pieces;
+    ASSERT_TRUE(sp.Encode(text, &pieces).ok());
+    ASSERT_EQ(ids.size(), pieces.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+      EXPECT_EQ(sp.IdToPiece(ids[i]), pieces[i]);
+    }
+    EXPECT_EQ(spt.text(), sp.DecodePieces(pieces));
+
+    StreamingDecoder decoder(sp);
+    std::string streamed, final_text;
+    for (const int id : ids) {
+      ASSERT_TRUE(decoder.Push({id}, &final_text).ok());
+      streamed += final_text;
+    }
+    ASSERT_TRUE(decoder.Finish(&final_text).ok());
+    EXPECT_EQ(spt.text(), streamed + final_text);
+
+    // A truncated run keeps its first count pieces.
+    SentencePieceProcessor truncated;
+    ASSERT_TRUE(truncated.Load(sp.model_proto()).ok());
+    for (size_t max_tokens = 1; max_tokens <= ids.size(); ++max_tokens) {
+      ASSERT_TRUE(truncated.SetEncodeMaxTokens(max_tokens).ok());
+      std::vector<int> truncated_ids;
+      ASSERT_TRUE(truncated.Encode(text, &truncated_ids).ok());
+      EXPECT_LE(truncated_ids.size(), max_tokens);
+      EXPECT_EQ(std::vector<int>(ids.begin(),
+                                 ids.begin() + truncated_ids.size() - 1),
+                std::vector<int>(truncated_ids.begin(),
+                                 truncated_ids.end() - 1));
+      const std::vector<int> prefix = expand(truncated_ids);
+      ASSERT_LE(prefix.size(), raw.size());
+      EXPECT_EQ(std::vector<int>(raw.begin(), raw.begin() + prefix.size()),
+                prefix);
+    }
+  }
+
+  // 1000 and 47 pieces take few count pieces.
+  std::vector<int> ids;
+  ASSERT_TRUE(sp.Encode(texts.back(), &ids).ok());
+  EXPECT_LT(ids.size(), 20);
+}
+
+TEST(SentencePieceProcessorTest, EncodePiecesWithIdsTest) {
+  const std::string model_prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "pieces_with_ids");
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--input=",
+                               util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                              "botchan.txt"),
+                               " --model_prefix=", model_prefix,
+                               " --vocab_size=1000"))
+                  .ok());
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_prefix + ".model").ok());
+
+  // Fills the pieces left empty with IdToPiece().
+  auto restore = [&](const std::vector<int> &ids,
+                     std::vector<std::string> pieces) {
+    EXPECT_EQ(ids.size(), pieces.size());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      if (pieces[i].empty()) pieces[i] = sp.IdToPiece(ids[i]);
+    }
+    return pieces;
+  };
+
+  for (const char *text :
+       {"", "hello world", "I have a pen.", "\xe2\x98\x83\xe2\x98\x83 abc"}) {
+    std::vector<int> ids, expected_ids;
+    std::vector<std::string> pieces, expected_pieces;
+    ASSERT_TRUE(sp.EncodePiecesWithIds(text, &ids, &pieces).ok());
+    ASSERT_TRUE(sp.Encode(text, &expected_ids).ok());
+    ASSERT_TRUE(sp.Encode(text, &expected_pieces).ok());
+    EXPECT_EQ(expected_ids, ids);
+    EXPECT_EQ(expected_pieces, restore(ids, pieces));
+
+    std::vector<std::vector<int>> nbest_ids;
+    std::vector<std::vector<std::string>> nbest_pieces;
+    ASSERT_TRUE(
+        sp.NBestEncodePiecesWithIds(text, 5, &nbest_ids, &nbest_pieces).ok());
+    std::vector<std::vector<std::string>> expected_nbest;
+    ASSERT_TRUE(sp.NBestEncode(text, 5, &expected_nbest).ok());
+    ASSERT_EQ(expected_nbest.size(), nbest_ids.size());
+    for (size_t i = 0; i < nbest_ids.size(); ++i) {
+      EXPECT_EQ(expected_nbest[i], restore(nbest_ids[i], nbest_pieces[i]));
+    }
+
+    ASSERT_TRUE(sp.SampleEncodePiecesWithIds(text, -1, 0.5, &ids, &pieces).ok());
+    const auto sampled = restore(ids, pieces);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      EXPECT_EQ(ids[i], sp.PieceToId(sampled[i]));
+    }
+  }
+}
+
+TEST(SentencePieceProcessorTest, EncodePreNormalizedTest) {
+  const std::string model_prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "pre_normalized");
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--input=",
+                               util::JoinPath(absl::GetFlag(FLAGS_test_srcdir),
+                                              "botchan.txt"),
+                               " --model_prefix=", model_prefix,
+                               " --vocab_size=1000"))
+                  .ok());
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(model_prefix + ".model").ok());
+  const normalizer::Normalizer normalizer(sp.model_proto().normalizer_spec(),
+                                          sp.model_proto().trainer_spec());
+
+  const std::vector<std::string> inputs = {
+      "", "hello  world", "\xef\xbc\xa8" "ello\xe3\x80\x80world",
+      "I am a cat.", "  ab" + std::string(50, '!')};
+  for (const auto &input : inputs) {
+    std::string normalized;
+    std::vector<uint32_t> norm_to_orig;
+    ASSERT_TRUE(normalizer.Normalize(input, &normalized, &norm_to_orig).ok());
+
+    std::vector<int> expected_ids, ids;
+    ASSERT_TRUE(sp.EncodeIds(input, &expected_ids).ok());
+    ASSERT_TRUE(sp.EncodePreNormalized(normalized, &ids).ok());
+    EXPECT_EQ(expected_ids, ids);
+
+    SentencePieceText expected, spt;
+    ASSERT_TRUE(sp.Encode(input, &expected).ok());
+    ASSERT_TRUE(
+        sp.EncodePreNormalized(input, normalized, norm_to_orig, &spt).ok());
+    EXPECT_EQ(expected.SerializeAsString(), spt.SerializeAsString());
+
+    // Without the alignment, the surfaces are those of `normalized`.
+    ASSERT_TRUE(sp.EncodePreNormalized(normalized, &spt).ok());
+    EXPECT_EQ(normalized, spt.text());
+    ASSERT_EQ(expected.pieces_size(), spt.pieces_size());
+    for (int i = 0; i < spt.pieces_size(); ++i) {
+      EXPECT_EQ(expected.pieces(i).id(), spt.pieces(i).id());
+    }
+
+    ASSERT_TRUE(sp.SetCheckPreNormalized(true).ok());
+    EXPECT_TRUE(sp.EncodePreNormalized(normalized, &ids).ok());
+    EXPECT_TRUE(
+        sp.EncodePreNormalized(input, normalized, norm_to_orig, &spt).ok());
+    ASSERT_TRUE(sp.SetCheckPreNormalized(false).ok());
+  }
+
+  // The checks catch inputs that the normalizer would not output.
+  std::vector<int> ids;
+  SentencePieceText spt;
+  EXPECT_TRUE(sp.EncodePreNormalized("hello world", &ids).ok());
+  ASSERT_TRUE(sp.SetCheckPreNormalized(true).ok());
+  EXPECT_FALSE(sp.EncodePreNormalized("hello world", &ids).ok());
+  EXPECT_FALSE(sp.EncodePreNormalized("\xff", &ids).ok());
+  std::vector<uint32_t> norm_to_orig = {0, 1, 2, 3, 4};
+  EXPECT_FALSE(
+      sp.EncodePreNormalized("abcd", "abcd", norm_to_orig, &spt).ok());
+  norm_to_orig.pop_back();
+  EXPECT_FALSE(
+      sp.EncodePreNormalized("abcd", "abcd", norm_to_orig, &spt).ok());
+
+  ASSERT_TRUE(sp.SetEncodeMaxTokens(4).ok());
+  EXPECT_FALSE(sp.EncodePreNormalized("\xe2\x96\x81" "abc", &ids).ok());
 }
 }  // namespace sentencepiece
@@ -287,6 +287,7 @@ util::Status SentencePieceTrainer::PopulateModelTypeFromString(
 
 namespace {
 const pretokenizer::PretokenizerForTrainingInterface *g_pretokenizer = nullptr;
+ShardReducerInterface *g_shard_reducer = nullptr;
 }  // namespace
 
 // static
@@ -302,4 +303,16 @@ SentencePieceTrainer::GetPretokenizerForTraining() {
   return g_pretokenizer;
 }
 
+// static
+util::Status SentencePieceTrainer::SetShardReducerForTraining(
+    ShardReducerInterface *shard_reducer) {
+  g_shard_reducer = shard_reducer;
+  return util::OkStatus();
+}
+
+// static
+ShardReducerInterface *SentencePieceTrainer::GetShardReducerForTraining() {
+  return g_shard_reducer;
+}
+
 }  // namespace sentencepiece
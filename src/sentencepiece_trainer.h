@@ -25,6 +25,8 @@ namespace sentencepiece {
 class TrainerSpec;
 class NormalizerSpec;
 
+class ShardReducerInterface;
+
 namespace pretokenizer {
 class PretokenizerForTrainingInterface;
 }  // namespace pretokenizer
@@ -124,6 +126,15 @@ class SentencePieceTrainer {
   static const pretokenizer::PretokenizerForTrainingInterface *
   GetPretokenizerForTraining();
 
+  // Injects global shard reducer for the sharded unigram training, where
+  // each process trains on its own shard of the corpus.
+  static util::Status SetShardReducerForTraining(
+      ShardReducerInterface *shard_reducer);
+
+  // Returns the current shard reducer. if no shard reducer is defined,
+  // returns nullptr.
+  static ShardReducerInterface *GetShardReducerForTraining();
+
   // Helper function to set `field_name=value` in `message`.
   // When `field_name` is repeated, multiple values can be passed
   // with comma-separated values. `field_name` must not be a nested message.
@@ -0,0 +1,160 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "shard_reducer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+
+#include "third_party/absl/strings/str_cat.h"
+#include "trainer_interface.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace {
+// The values are stored as the little-endian bits of doubles.
+std::string EncodeValues(const std::vector<double> &values) {
+  std::string data(values.size() * 8, '\0');
+  for (size_t i = 0; i < values.size(); ++i) {
+    uint64 bits = 0;
+    memcpy(&bits, &values[i], sizeof(bits));
+    for (int k = 0; k < 8; ++k) {
+      data[8 * i + k] = static_cast<char>(bits & 0xFF);
+      bits >>= 8;
+    }
+  }
+  return data;
+}
+
+double DecodeValue(absl::string_view data, size_t i) {
+  uint64 bits = 0;
+  for (int k = 7; k >= 0; --k) {
+    bits = (bits << 8) | static_cast<uint8>(data[8 * i + k]);
+  }
+  double value = 0.0;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+uint64 NewJobId() {
+  std::random_device rd;
+  const uint64 job_id = (static_cast<uint64>(rd()) << 32) | rd();
+  return job_id == 0 ? 1 : job_id;
+}
+}  // namespace
+
+FileShardReducer::FileShardReducer(absl::string_view prefix, int shard_id,
+                                   int num_shards, int timeout_sec)
+    : prefix_(prefix),
+      shard_id_(shard_id),
+      num_shards_(num_shards),
+      timeout_sec_(timeout_sec) {}
+
+FileShardReducer::~FileShardReducer() {
+  // Every step is a barrier: all shards have written the last step, so they
+  // are done with the previous one, but they may still be reading the last
+  // step.
+  if (step_ >= 2) std::remove(StepPath(step_ - 1, shard_id_).c_str());
+}
+
+std::string FileShardReducer::StepPath(int64 step, int shard_id) const {
+  return absl::StrCat(prefix_, ".", std::to_string(step), ".", shard_id);
+}
+
+util::Status FileShardReducer::Write(absl::string_view data) {
+  CHECK_OR_RETURN(shard_id_ >= 0 && shard_id_ < num_shards_)
+      << "Invalid shard id " << shard_id_ << " of " << num_shards_
+      << " shards.";
+  ++step_;
+  const std::string filename = StepPath(step_, shard_id_);
+  if (step_ == 1) {
+    const CheckpointReader reader(filename);
+    if (reader.status().code() != util::StatusCode::kNotFound) {
+      return util::StatusBuilder(util::StatusCode::kAlreadyExists, GTL_LOC)
+             << filename
+             << " exists. Another job may be running with the same prefix.";
+    }
+    if (shard_id_ == 0) {
+      job_id_ = NewJobId();
+    } else {
+      std::string unused;
+      RETURN_IF_ERROR(Read(0, &unused));
+    }
+  }
+  CheckpointWriter writer(filename);
+  RETURN_IF_ERROR(writer.status());
+  writer.PutUInt64(job_id_);
+  writer.PutString(data);
+  RETURN_IF_ERROR(writer.Close());
+  // Every shard is done with step - 2, since this shard has waited for all
+  // shards to write step - 1.
+  if (step_ > 2) std::remove(StepPath(step_ - 2, shard_id_).c_str());
+  return util::OkStatus();
+}
+
+util::Status FileShardReducer::Read(int shard_id, std::string *data) {
+  const std::string filename = StepPath(step_, shard_id);
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec_);
+  while (true) {
+    CheckpointReader reader(filename);
+    if (reader.status().ok()) {
+      uint64 job_id = 0;
+      CHECK_OR_RETURN(reader.GetUInt64(&job_id) && reader.GetString(data) &&
+                      reader.done())
+          << "Broken shard data: " << filename;
+      if (job_id_ == 0) job_id_ = job_id;
+      // A file of another job is replaced when the shard writes this step.
+      if (job_id == job_id_) return util::OkStatus();
+    } else if (reader.status().code() != util::StatusCode::kNotFound) {
+      return reader.status();
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      return util::StatusBuilder(util::StatusCode::kDeadlineExceeded, GTL_LOC)
+             << "Timed out waiting for " << filename;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+}
+
+util::Status FileShardReducer::AllReduce(std::vector<double> *values) {
+  RETURN_IF_ERROR(Write(EncodeValues(*values)));
+  values->assign(values->size(), 0.0);
+  std::string data;
+  for (int n = 0; n < num_shards_; ++n) {
+    RETURN_IF_ERROR(Read(n, &data));
+    CHECK_EQ_OR_RETURN(data.size(), values->size() * 8)
+        << "Shard " << n << " reduced a vector of a different size.";
+    for (size_t i = 0; i < values->size(); ++i) {
+      (*values)[i] += DecodeValue(data, i);
+    }
+  }
+  return util::OkStatus();
+}
+
+util::Status FileShardReducer::Broadcast(std::string *data) {
+  RETURN_IF_ERROR(Write(shard_id_ == 0 ? *data : ""));
+  // Waits for all shards, so that every step is a barrier.
+  std::string shard_data;
+  for (int n = 0; n < num_shards_; ++n) {
+    RETURN_IF_ERROR(Read(n, &shard_data));
+    if (n == 0) data->swap(shard_data);
+  }
+  return util::OkStatus();
+}
+
+}  // namespace sentencepiece
@@ -0,0 +1,92 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SHARD_REDUCER_H_
+#define SHARD_REDUCER_H_
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// Exchanges the statistics of the corpus shards in a sharded unigram
+// training. Every shard loads its own part of the corpus and computes the
+// E step and the pruning statistics over it. The shards then sum the
+// statistics with AllReduce(), so that all of them run the same M step and
+// pruning. Shard 0 is the coordinator: it extracts the seed pieces, which
+// are broadcast to the other shards, and saves the final model.
+//
+// All shards must call the methods in the same order with vectors of the
+// same sizes. The sums must be bitwise identical on all shards, e.g., by
+// summing in the order of the shard ids, since the shards would otherwise
+// make different pruning decisions.
+class ShardReducerInterface {
+ public:
+  ShardReducerInterface() {}
+  virtual ~ShardReducerInterface() {}
+
+  virtual int shard_id() const = 0;
+  virtual int num_shards() const = 0;
+
+  // Replaces |values| with the element-wise sums of |values| of all shards.
+  virtual util::Status AllReduce(std::vector<double> *values) = 0;
+
+  // Replaces |data| with the |data| of shard 0.
+  virtual util::Status Broadcast(std::string *data) = 0;
+};
+
+// Exchanges the statistics through files on storage shared by all shards.
+// Each step is written to "<prefix>.<step>.<shard_id>", which the other
+// shards poll for. Shard 0 draws a random job id, which the other shards
+// read from its first step and which every file carries, so that the files
+// left by an earlier or crashed job with the same |prefix| are skipped. The
+// first step fails if the file of this shard for it already exists, since
+// another job may then still be running with the same |prefix|.
+class FileShardReducer : public ShardReducerInterface {
+ public:
+  // Fails a step if the other shards do not catch up in |timeout_sec|.
+  FileShardReducer(absl::string_view prefix, int shard_id, int num_shards,
+                   int timeout_sec = 3600);
+  ~FileShardReducer() override;
+
+  int shard_id() const override { return shard_id_; }
+  int num_shards() const override { return num_shards_; }
+
+  util::Status AllReduce(std::vector<double> *values) override;
+  util::Status Broadcast(std::string *data) override;
+
+ private:
+  std::string StepPath(int64 step, int shard_id) const;
+
+  // Writes |data| as the data of this shard for the next step.
+  util::Status Write(absl::string_view data);
+
+  // Waits for the data of |shard_id| for the current step. Takes the job id
+  // of the file if it is not known yet.
+  util::Status Read(int shard_id, std::string *data);
+
+  const std::string prefix_;
+  const int shard_id_;
+  const int num_shards_;
+  const int timeout_sec_;
+  int64 step_ = 0;
+  uint64 job_id_ = 0;  // 0 until the first step.
+};
+
+}  // namespace sentencepiece
+#endif  // SHARD_REDUCER_H_
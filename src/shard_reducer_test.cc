@@ -0,0 +1,115 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "shard_reducer.h"
+
+#include <cstdio>
+#include <thread>
+
+#include "testharness.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+namespace sentencepiece {
+namespace {
+
+TEST(FileShardReducerTest, AllReduceAndBroadcastTest) {
+  constexpr int kNumShards = 3;
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "shard_reducer");
+
+  std::vector<std::vector<double>> values(kNumShards);
+  std::vector<std::string> data(kNumShards);
+  std::vector<util::Status> status(kNumShards);
+  std::vector<std::thread> threads;
+  for (int n = 0; n < kNumShards; ++n) {
+    threads.emplace_back([&, n]() {
+      FileShardReducer reducer(prefix, n, kNumShards);
+      EXPECT_EQ(n, reducer.shard_id());
+      EXPECT_EQ(kNumShards, reducer.num_shards());
+      // Several steps check that the files of the previous steps are not
+      // removed while they are read.
+      for (int step = 0; step < 5; ++step) {
+        values[n] = {1.0 * n, 0.5, -1.0 * step};
+        status[n] = reducer.AllReduce(&values[n]);
+        if (!status[n].ok()) return;
+      }
+      data[n] = absl::StrCat("shard", n) + std::string(1, '\0');
+      status[n] = reducer.Broadcast(&data[n]);
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  for (int n = 0; n < kNumShards; ++n) {
+    EXPECT_TRUE(status[n].ok());
+    EXPECT_EQ(std::vector<double>({3.0, 1.5, -12.0}), values[n]);
+    EXPECT_EQ(std::string("shard0\0", 7), data[n]);
+    // The files of the last step are left behind.
+    std::remove(absl::StrCat(prefix, ".6.", n).c_str());
+  }
+}
+
+TEST(FileShardReducerTest, ErrorTest) {
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "shard_reducer_error");
+  std::vector<double> values = {1.0};
+
+  FileShardReducer invalid(prefix, 2, 2);
+  EXPECT_FALSE(invalid.AllReduce(&values).ok());
+
+  // Shard 1 never shows up.
+  FileShardReducer reducer(prefix, 0, 2, 0);
+  EXPECT_EQ(util::StatusCode::kDeadlineExceeded,
+            reducer.AllReduce(&values).code());
+
+  // The first step of the timed out job is still there.
+  FileShardReducer next(prefix, 0, 2, 0);
+  EXPECT_EQ(util::StatusCode::kAlreadyExists, next.AllReduce(&values).code());
+  std::remove(absl::StrCat(prefix, ".1.0").c_str());
+}
+
+TEST(FileShardReducerTest, StaleFilesTest) {
+  constexpr int kNumShards = 2;
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "shard_reducer_stale");
+
+  // The second job runs with the files of the last steps of the first job,
+  // which must not be taken as its data.
+  for (const double value : {100.0, 1.0}) {
+    std::vector<util::Status> status(kNumShards);
+    std::vector<std::vector<double>> values(kNumShards);
+    std::vector<std::thread> threads;
+    for (int n = 0; n < kNumShards; ++n) {
+      threads.emplace_back([&, n]() {
+        FileShardReducer reducer(prefix, n, kNumShards);
+        for (int step = 0; step < 4; ++step) {
+          values[n] = {value * (n + 1)};
+          status[n] = reducer.AllReduce(&values[n]);
+          if (!status[n].ok()) return;
+        }
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    for (int n = 0; n < kNumShards; ++n) {
+      EXPECT_TRUE(status[n].ok());
+      EXPECT_EQ(std::vector<double>({value * 3}), values[n]);
+    }
+  }
+  for (int n = 0; n < kNumShards; ++n) {
+    std::remove(absl::StrCat(prefix, ".4.", n).c_str());
+  }
+}
+
+}  // namespace
+}  // namespace sentencepiece
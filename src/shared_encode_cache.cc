@@ -0,0 +1,270 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "shared_encode_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "third_party/absl/strings/str_cat.h"
+#include "util.h"
+
+#ifndef OS_WIN
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sentencepiece {
+
+constexpr size_t SharedEncodeCache::kSlotBytes;
+constexpr int SharedEncodeCache::kProbeLength;
+
+namespace {
+// "spmcache" followed by the version of the layout.
+constexpr uint64 kMagic = 0x73706d6361636865ULL ^ 1;
+constexpr size_t kHeaderBytes = 64;
+constexpr size_t kSlotDataBytes = SharedEncodeCache::kSlotBytes - 24;
+}  // namespace
+
+// The first bytes of the table. A new file is all zeros, which is an empty
+// table.
+struct SharedEncodeCache::Header {
+  std::atomic<uint64> layout;  // MakeLayout() once the table is attached.
+  std::atomic<uint64> hand;    // where the CLOCK sweeps of a window start.
+};
+
+// The entry of one input. A process killed while writing a slot leaves it
+// odd, and the slot is not used anymore.
+struct SharedEncodeCache::Slot {
+  std::atomic<uint32> sequence;    // odd while the slot is written.
+  std::atomic<uint32> referenced;  // 1 if hit since the last sweep.
+  std::atomic<uint64> key;         // 0 if the slot is empty.
+  uint32 input_size;
+  uint32 num_ids;
+  char data[kSlotDataBytes];  // the input followed by the ids.
+};
+
+namespace {
+uint64 MakeLayout(size_t num_slots) {
+  return port::FingerprintCat(kMagic, num_slots) | 1;
+}
+}  // namespace
+
+// static
+util::Status SharedEncodeCache::Open(
+    absl::string_view name, size_t max_bytes,
+    std::unique_ptr<SharedEncodeCache> *cache) {
+  CHECK_OR_RETURN(cache);
+  cache->reset();
+#ifdef OS_WIN
+  return util::StatusBuilder(util::StatusCode::kUnimplemented, GTL_LOC)
+         << "The shared encode cache is not supported on Windows.";
+#else
+  CHECK_OR_RETURN(!name.empty()) << "The name of the cache is empty.";
+  if (!std::atomic<uint64>().is_lock_free() ||
+      !std::atomic<uint32>().is_lock_free()) {
+    return util::StatusBuilder(util::StatusCode::kUnimplemented, GTL_LOC)
+           << "The shared encode cache needs lock-free atomics.";
+  }
+  const size_t num_slots = max_bytes / kSlotBytes;
+  CHECK_GE_OR_RETURN(num_slots, static_cast<size_t>(kProbeLength))
+      << "max_bytes must hold at least " << kProbeLength << " slots of "
+      << kSlotBytes << " bytes.";
+  const size_t size = kHeaderBytes + num_slots * kSlotBytes;
+
+  const std::string path = name.find('/') == absl::string_view::npos
+                               ? absl::StrCat("/dev/shm/", name)
+                               : std::string(name);
+
+  // The process creating the file sizes it. The others wait for the size,
+  // as a table mapped before would be cut.
+  int fd =
+      ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd >= 0) {
+    if (::ftruncate(fd, size) != 0) {
+      const int error = errno;
+      ::close(fd);
+      ::unlink(path.c_str());
+      return util::StatusBuilder(util::StatusCode::kResourceExhausted,
+                                 GTL_LOC)
+             << "\"" << path << "\": " << util::StrError(error);
+    }
+  } else if (errno == EEXIST) {
+    fd = ::open(path.c_str(), O_RDWR | O_NOFOLLOW);
+  }
+  if (fd < 0) {
+    return util::StatusBuilder(util::StatusCode::kPermissionDenied, GTL_LOC)
+           << "\"" << path << "\": " << util::StrError(errno);
+  }
+
+  // Another user could write ids into the encodes of this process.
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != ::geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+    ::close(fd);
+    return util::StatusBuilder(util::StatusCode::kPermissionDenied, GTL_LOC)
+           << "\"" << path
+           << "\" is not a regular file owned by the user and writable only "
+              "by it.";
+  }
+
+  for (int i = 0; i < 1000; ++i) {
+    if (::fstat(fd, &st) != 0 || st.st_size != 0) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (static_cast<size_t>(st.st_size) != size) {
+    ::close(fd);
+    return util::StatusBuilder(util::StatusCode::kFailedPrecondition, GTL_LOC)
+           << "\"" << path << "\" has " << st.st_size << " bytes, but "
+           << size << " bytes are expected for max_bytes=" << max_bytes
+           << ".";
+  }
+
+  void *data =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return util::StatusBuilder(util::StatusCode::kResourceExhausted, GTL_LOC)
+           << "\"" << path << "\": " << util::StrError(errno);
+  }
+
+  std::unique_ptr<SharedEncodeCache> new_cache(
+      new SharedEncodeCache(static_cast<char *>(data), size, num_slots));
+  uint64 layout = 0;
+  if (!new_cache->header()->layout.compare_exchange_strong(
+          layout, MakeLayout(num_slots)) &&
+      layout != MakeLayout(num_slots)) {
+    return util::StatusBuilder(util::StatusCode::kFailedPrecondition, GTL_LOC)
+           << "\"" << path << "\" is not an encode cache of this version.";
+  }
+  *cache = std::move(new_cache);
+  return util::OkStatus();
+#endif  // OS_WIN
+}
+
+SharedEncodeCache::SharedEncodeCache(char *data, size_t size, size_t num_slots)
+    : data_(data), size_(size), num_slots_(num_slots) {
+  static_assert(sizeof(Slot) == kSlotBytes, "unexpected slot layout");
+  static_assert(sizeof(Header) <= kHeaderBytes, "unexpected header layout");
+}
+
+SharedEncodeCache::~SharedEncodeCache() {
+#ifndef OS_WIN
+  ::munmap(data_, size_);
+#endif
+}
+
+SharedEncodeCache::Header *SharedEncodeCache::header() const {
+  return reinterpret_cast<Header *>(data_);
+}
+
+SharedEncodeCache::Slot *SharedEncodeCache::GetSlot(uint64 key,
+                                                    int probe) const {
+  const size_t index = (key % num_slots_ + probe) % num_slots_;
+  return reinterpret_cast<Slot *>(data_ + kHeaderBytes) + index;
+}
+
+uint64 SharedEncodeCache::MakeKey(absl::string_view input) const {
+  const uint64 key =
+      port::FingerprintCat(fingerprint_, port::Fingerprint(input));
+  return key == 0 ? 1 : key;
+}
+
+bool SharedEncodeCache::Lookup(absl::string_view input,
+                               std::vector<int> *ids) {
+  const uint64 key = MakeKey(input);
+  for (int probe = 0; probe < kProbeLength; ++probe) {
+    Slot *slot = GetSlot(key, probe);
+    if (slot->key.load(std::memory_order_relaxed) != key) continue;
+    const uint32 sequence = slot->sequence.load(std::memory_order_acquire);
+    if (sequence & 1) return false;  // being written.
+    const size_t input_size = slot->input_size;
+    const size_t num_ids = slot->num_ids;
+    if (input_size != input.size() ||
+        input_size + num_ids * sizeof(int) > kSlotDataBytes ||
+        std::memcmp(slot->data, input.data(), input_size) != 0) {
+      continue;
+    }
+    // The ids are copied out before they are validated, so that `ids` is
+    // left as is on a miss.
+    int buffer[kSlotDataBytes / sizeof(int)];
+    if (num_ids > 0) {
+      std::memcpy(buffer, slot->data + input_size, num_ids * sizeof(int));
+    }
+    // The bytes read above are valid only if no writer took the slot since.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != sequence) {
+      return false;
+    }
+    // The ids of a damaged or forged entry must not reach the caller.
+    for (size_t i = 0; i < num_ids; ++i) {
+      if (buffer[i] < 0 || buffer[i] >= piece_size_) return false;
+    }
+    ids->assign(buffer, buffer + num_ids);
+    slot->referenced.store(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+void SharedEncodeCache::Insert(absl::string_view input,
+                               const std::vector<int> &ids) {
+  if (input.size() + ids.size() * sizeof(int) > kSlotDataBytes) return;
+
+  const uint64 key = MakeKey(input);
+  for (int probe = 0; probe < kProbeLength; ++probe) {
+    // Inserted by another thread or process.
+    if (GetSlot(key, probe)->key.load(std::memory_order_relaxed) == key) {
+      return;
+    }
+  }
+
+  // Two sweeps of the window find an unmarked slot unless hits mark them
+  // again meanwhile.
+  const int start = static_cast<int>(
+      header()->hand.fetch_add(1, std::memory_order_relaxed) % kProbeLength);
+  Slot *victim = GetSlot(key, start);
+  for (int i = 0; i < 2 * kProbeLength; ++i) {
+    Slot *slot = GetSlot(key, (start + i) % kProbeLength);
+    if (slot->key.load(std::memory_order_relaxed) == 0 ||
+        slot->referenced.exchange(0, std::memory_order_relaxed) == 0) {
+      victim = slot;
+      break;
+    }
+  }
+
+  uint32 sequence = victim->sequence.load(std::memory_order_relaxed);
+  if ((sequence & 1) ||
+      !victim->sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                std::memory_order_acquire)) {
+    return;  // written by another thread or process.
+  }
+  victim->key.store(key, std::memory_order_relaxed);
+  victim->input_size = static_cast<uint32>(input.size());
+  victim->num_ids = static_cast<uint32>(ids.size());
+  std::memcpy(victim->data, input.data(), input.size());
+  if (!ids.empty()) {
+    std::memcpy(victim->data + input.size(), ids.data(),
+                ids.size() * sizeof(int));
+  }
+  victim->referenced.store(0, std::memory_order_relaxed);
+  victim->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+}  // namespace sentencepiece
@@ -0,0 +1,99 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SHARED_ENCODE_CACHE_H_
+#define SHARED_ENCODE_CACHE_H_
+
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "encode_cache.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// An encode cache in a table of fixed-size slots mapped from a file in
+// /dev/shm, which all the processes attaching the same file share, e.g., the
+// worker processes of a data loader encoding overlapping texts.
+//
+// Lookups and inserts take no lock. Each slot has a sequence number, which is
+// odd while the slot is written: a writer that finds it odd skips the insert,
+// and a reader that sees it change misses. An input is keyed by its
+// fingerprint and the one of the model and options passed to Invalidate(),
+// so processes with different models share a table without seeing the ids
+// of each other. A key is probed in kProbeLength consecutive slots, which
+// are evicted by CLOCK: a hit marks its slot, and an insert takes the first
+// empty or unmarked slot of the window, unmarking the ones it passes.
+class SharedEncodeCache : public EncodeCacheInterface {
+ public:
+  // Attaches the table `name`, which is a file name in /dev/shm or a path,
+  // creating it with about `max_bytes` bytes if it does not exist. Only the
+  // user creating the file can read and write it. Fails if the table exists
+  // with another size, is not a regular file owned by the user, or is
+  // writable by others. The file is not removed.
+  static util::Status Open(absl::string_view name, size_t max_bytes,
+                           std::unique_ptr<SharedEncodeCache> *cache);
+
+  ~SharedEncodeCache() override;
+
+  bool Lookup(absl::string_view input, std::vector<int> *ids) override;
+
+  // Inputs whose bytes and ids do not fit in a slot are not cached.
+  void Insert(absl::string_view input, const std::vector<int> &ids) override;
+
+  // Keys the next entries with `fingerprint`. The entries of the other
+  // fingerprints stay in the table for the other processes. Lookups miss
+  // entries with ids outside [0, piece_size), and all entries before the
+  // first call.
+  void Invalidate(uint64 fingerprint, int piece_size) override {
+    fingerprint_ = fingerprint;
+    piece_size_ = piece_size;
+  }
+
+  // Returns the size of the table, which is shared with the other
+  // processes.
+  size_t bytes() const override { return size_; }
+
+  bool is_shared() const override { return true; }
+
+  size_t num_slots() const { return num_slots_; }
+
+  static constexpr size_t kSlotBytes = 512;
+  static constexpr int kProbeLength = 8;
+
+ private:
+  struct Header;
+  struct Slot;
+
+  SharedEncodeCache(char *data, size_t size, size_t num_slots);
+
+  // Returns the key of `input`, which is never 0.
+  uint64 MakeKey(absl::string_view input) const;
+
+  // Returns the slot `probe` of the window of `key`.
+  Slot *GetSlot(uint64 key, int probe) const;
+
+  Header *header() const;
+
+  char *data_ = nullptr;  // the mapping.
+  const size_t size_ = 0;
+  const size_t num_slots_ = 0;
+  uint64 fingerprint_ = 0;
+  int piece_size_ = 0;
+};
+
+}  // namespace sentencepiece
+#endif  // SHARED_ENCODE_CACHE_H_
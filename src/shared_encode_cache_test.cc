@@ -0,0 +1,206 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "shared_encode_cache.h"
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "testharness.h"
+#include "util.h"
+
+#ifndef OS_WIN
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace sentencepiece {
+namespace {
+
+#ifndef OS_WIN
+// Returns the path of a new table named `name` in the test directory.
+std::string NewTablePath(absl::string_view name) {
+  const std::string path =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), name);
+  std::remove(path.c_str());
+  return path;
+}
+
+TEST(SharedEncodeCacheTest, LookupAndInsertTest) {
+  const std::string path = NewTablePath("shared_cache_lookup");
+  std::unique_ptr<SharedEncodeCache> cache, other;
+  EXPECT_FALSE(SharedEncodeCache::Open(path, 1024, &cache).ok());
+  ASSERT_TRUE(SharedEncodeCache::Open(path, 1 << 16, &cache).ok());
+  EXPECT_EQ((1 << 16) / SharedEncodeCache::kSlotBytes, cache->num_slots());
+  EXPECT_TRUE(cache->is_shared());
+
+  // Nothing is found before the piece size is known.
+  cache->Insert("xyz", {1});
+  std::vector<int> ids = {7};
+  EXPECT_FALSE(cache->Lookup("xyz", &ids));
+  cache->Invalidate(0, 100);
+
+  EXPECT_FALSE(cache->Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({7}), ids);
+
+  cache->Insert("abc", {1, 2, 3});
+  cache->Insert("", {});
+  EXPECT_TRUE(cache->Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), ids);
+  EXPECT_TRUE(cache->Lookup("", &ids));
+  EXPECT_TRUE(ids.empty());
+  EXPECT_FALSE(cache->Lookup("ab", &ids));
+
+  // The first entry is kept.
+  cache->Insert("abc", {4});
+  EXPECT_TRUE(cache->Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), ids);
+
+  // An entry larger than a slot is not cached.
+  cache->Insert("large", std::vector<int>(SharedEncodeCache::kSlotBytes, 1));
+  EXPECT_FALSE(cache->Lookup("large", &ids));
+
+  // Ids out of the range of the model are never returned.
+  cache->Insert("range", {1, 100});
+  EXPECT_FALSE(cache->Lookup("range", &ids));
+  cache->Insert("negative", {-1});
+  EXPECT_FALSE(cache->Lookup("negative", &ids));
+
+  // Another attachment of the table sees the entries.
+  ASSERT_TRUE(SharedEncodeCache::Open(path, 1 << 16, &other).ok());
+  other->Invalidate(0, 100);
+  EXPECT_TRUE(other->Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), ids);
+  EXPECT_FALSE(SharedEncodeCache::Open(path, 1 << 17, &other).ok());
+
+  // The entries of another fingerprint are not seen, but kept.
+  cache->Invalidate(1, 100);
+  EXPECT_FALSE(cache->Lookup("abc", &ids));
+  cache->Insert("abc", {5});
+  EXPECT_TRUE(cache->Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({5}), ids);
+  cache->Invalidate(0, 100);
+  EXPECT_TRUE(cache->Lookup("abc", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2, 3}), ids);
+
+  std::remove(path.c_str());
+}
+
+TEST(SharedEncodeCacheTest, EvictionTest) {
+  const std::string path = NewTablePath("shared_cache_eviction");
+  std::unique_ptr<SharedEncodeCache> cache;
+  ASSERT_TRUE(SharedEncodeCache::Open(
+                  path, SharedEncodeCache::kSlotBytes * 64, &cache)
+                  .ok());
+  EXPECT_EQ(64, cache->num_slots());
+  cache->Invalidate(0, 1000);
+
+  std::vector<int> ids;
+  for (int i = 0; i < 1000; ++i) {
+    cache->Insert(std::to_string(i), {i});
+    EXPECT_TRUE(cache->Lookup(std::to_string(i), &ids));
+    EXPECT_EQ(std::vector<int>({i}), ids);
+  }
+
+  // The table holds at most one entry per slot.
+  int found = 0;
+  for (int i = 0; i < 1000; ++i) {
+    if (cache->Lookup(std::to_string(i), &ids)) {
+      EXPECT_EQ(std::vector<int>({i}), ids);
+      ++found;
+    }
+  }
+  EXPECT_LE(found, 64);
+  EXPECT_GT(found, 0);
+
+  std::remove(path.c_str());
+}
+
+TEST(SharedEncodeCacheTest, ThreadsTest) {
+  const std::string path = NewTablePath("shared_cache_threads");
+  std::unique_ptr<SharedEncodeCache> cache;
+  ASSERT_TRUE(SharedEncodeCache::Open(path, 1 << 16, &cache).ok());
+  cache->Invalidate(0, 1000);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&cache]() {
+      std::vector<int> ids;
+      for (int i = 0; i < 10000; ++i) {
+        const std::string input = std::to_string(i % 1000);
+        if (cache->Lookup(input, &ids)) {
+          EXPECT_EQ(std::vector<int>({i % 1000, 7}), ids);
+        } else {
+          cache->Insert(input, {i % 1000, 7});
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  std::remove(path.c_str());
+}
+
+TEST(SharedEncodeCacheTest, ProcessesTest) {
+  const std::string path = NewTablePath("shared_cache_processes");
+  std::unique_ptr<SharedEncodeCache> cache;
+  ASSERT_TRUE(SharedEncodeCache::Open(path, 1 << 16, &cache).ok());
+
+  const pid_t pid = ::fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    // The child attaches the table on its own and writes through it.
+    std::unique_ptr<SharedEncodeCache> child;
+    if (!SharedEncodeCache::Open(path, 1 << 16, &child).ok()) ::_exit(1);
+    child->Insert("from child", {1, 2});
+    ::_exit(0);
+  }
+  int status = 0;
+  ASSERT_EQ(pid, ::waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+
+  std::vector<int> ids;
+  cache->Invalidate(0, 100);
+  EXPECT_TRUE(cache->Lookup("from child", &ids));
+  EXPECT_EQ(std::vector<int>({1, 2}), ids);
+  std::remove(path.c_str());
+}
+
+TEST(SharedEncodeCacheTest, PermissionsTest) {
+  const std::string path = NewTablePath("shared_cache_permissions");
+  std::unique_ptr<SharedEncodeCache> cache;
+  ASSERT_TRUE(SharedEncodeCache::Open(path, 1 << 16, &cache).ok());
+  struct stat st;
+  ASSERT_EQ(0, ::stat(path.c_str(), &st));
+  EXPECT_EQ(0600, st.st_mode & 0777);
+
+  // A table others can write is not attached.
+  ASSERT_EQ(0, ::chmod(path.c_str(), 0666));
+  EXPECT_FALSE(SharedEncodeCache::Open(path, 1 << 16, &cache).ok());
+
+  // Nor is a link to a table.
+  const std::string link = NewTablePath("shared_cache_permissions_link");
+  ASSERT_EQ(0, ::chmod(path.c_str(), 0600));
+  ASSERT_EQ(0, ::symlink(path.c_str(), link.c_str()));
+  EXPECT_FALSE(SharedEncodeCache::Open(link, 1 << 16, &cache).ok());
+
+  std::remove(link.c_str());
+  std::remove(path.c_str());
+}
+#endif  // OS_WIN
+
+}  // namespace
+}  // namespace sentencepiece
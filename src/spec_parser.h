@@ -55,6 +55,19 @@ namespace sentencepiece {
     return util::OkStatus();                                                  \
   }
 
+#define PARSE_REPEATED_INT32(param_name)                                      \
+  if (name == #param_name) {                                                  \
+    for (const std::string &val : util::StrSplitAsCSV(value)) {               \
+      int32 v;                                                                \
+      if (!string_util::lexical_cast(val, &v))                                \
+        return util::StatusBuilder(util::StatusCode::kInvalidArgument,        \
+                                   GTL_LOC)                                   \
+               << "cannot parse \"" << val << "\" as int.";                   \
+      message->add_##param_name(v);                                           \
+    }                                                                         \
+    return util::OkStatus();                                                  \
+  }
+
 #define PARSE_DOUBLE(param_name)                                              \
   if (name == #param_name) {                                                  \
     double v;                                                                 \
@@ -93,6 +106,10 @@ namespace sentencepiece {
   for (const auto &v : message.param_name()) \
     os << "  " << #param_name << ": " << v << "\n";
 
+#define PRINT_REPEATED_PARAM(param_name) \
+  for (const auto v : message.param_name()) \
+    os << "  " << #param_name << ": " << v << "\n";
+
 #define PRINT_ENUM(param_name, map_name)               \
   const auto it = map_name.find(message.param_name()); \
   if (it == map_name.end())                            \
@@ -141,6 +158,23 @@ inline std::string PrintProto(const TrainerSpec &message,
   PRINT_PARAM(byte_fallback);
   PRINT_PARAM(vocabulary_output_piece_score);
   PRINT_PARAM(train_extremely_large_corpus);
+  PRINT_PARAM(corpus_memory_budget_mb);
+  PRINT_PARAM(seed_from_unique_words);
+  PRINT_PARAM(checkpoint_dir);
+  PRINT_PARAM(resume);
+  PRINT_PARAM(profile_output);
+  PRINT_PARAM(seek_sampling);
+  PRINT_REPEATED_PARAM(vocab_sizes);
+  PRINT_PARAM(corpus_cache);
+  PRINT_PARAM(em_batch_size);
+  PRINT_PARAM(em_tolerance);
+  PRINT_PARAM(init_model);
+  PRINT_REPEATED_STRING(candidate_models);
+  PRINT_PARAM(compact_repeat_counts);
+  PRINT_PARAM(max_memory_mb);
+  PRINT_PARAM(dedup_input_sentences);
+  PRINT_PARAM(prune_incremental_rounds);
+  PRINT_PARAM(prune_score_margin);
   PRINT_PARAM(hard_vocab_limit);
   PRINT_PARAM(use_all_vocab);
   PRINT_PARAM(unk_id);
@@ -218,6 +252,23 @@ util::Status SentencePieceTrainer::SetProtoField(const std::string &name,
   PARSE_BOOL(hard_vocab_limit);
   PARSE_BOOL(vocabulary_output_piece_score);
   PARSE_BOOL(train_extremely_large_corpus);
+  PARSE_INT32(corpus_memory_budget_mb);
+  PARSE_BOOL(seed_from_unique_words);
+  PARSE_STRING(checkpoint_dir);
+  PARSE_BOOL(resume);
+  PARSE_STRING(profile_output);
+  PARSE_BOOL(seek_sampling);
+  PARSE_REPEATED_INT32(vocab_sizes);
+  PARSE_STRING(corpus_cache);
+  PARSE_INT32(em_batch_size);
+  PARSE_DOUBLE(em_tolerance);
+  PARSE_STRING(init_model);
+  PARSE_REPEATED_STRING(candidate_models);
+  PARSE_BOOL(compact_repeat_counts);
+  PARSE_INT32(max_memory_mb);
+  PARSE_BOOL(dedup_input_sentences);
+  PARSE_INT32(prune_incremental_rounds);
+  PARSE_DOUBLE(prune_score_margin);
   PARSE_BOOL(use_all_vocab);
   PARSE_INT32(unk_id);
   PARSE_INT32(bos_id);
@@ -0,0 +1,50 @@
+#ifndef SPECIALIZED_NORMALIZER_RULE_H_
+#define SPECIALIZED_NORMALIZER_RULE_H_
+// Generated by compile_charsmap --output_specialized_header.
+namespace sentencepiece {
+namespace normalizer {
+namespace {
+
+constexpr int32 kSpecializedCharsMap_nmt_nfkc[] = {
+-2, 0, 0, 0, 0, 0, 0, 0,
+0, 1, 1, 0, 1, 1, 0, 0,
+0, 0, 0, 0, 0, 0, 0, 0,
+0, 0, 0, 0, 0, 0, 0, 0,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -2, -2, -2, -1,
+-1, -2, -2, -2, -2, -2, -2, -2,
+-2, -2, -2, -2, -2, -2, -2, -2,
+-2, -1, -2, -2, -2, -2, -2, -2,
+-2, -2, -2, -1, -1, -1, -1, -1,
+-1, -2, -2, -2, -2, -2, -2, -2,
+-2, -2, -2, -2, -2, -2, -2, -2,
+-2, -1, -2, -2, -2, -2, -2, -2,
+-2, -2, -2, -1, -1, -1, -1, 0,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, 0,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, 0,
+1, -1, -1, -1, -1, -1, -1, -1,
+27, -1, -2, -1, -1, -1, -1, 11,
+-1, -1, 1259, 1418, 3, 3551, -1, -1,
+101, 968, -2, -1, 1208, 1196, 1468, -1,
+-1, -1, -1, -1, -1, -1, -2, -1,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-2, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -2, -1,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-1, -1, -1, -1, -1, -1, -1, -1,
+-2, -1, -1, -1, -1, -1, -1, -1,
+};
+
+constexpr SpecializedCharsMap kSpecializedCharsMaps[] = {
+{ "nmt_nfkc", 0x557973450d980bb9ULL, kSpecializedCharsMap_nmt_nfkc },
+};
+
+}  // namespace
+}  // namespace normalizer
+}  // namespace sentencepiece
+#endif  // SPECIALIZED_NORMALIZER_RULE_H_
@@ -0,0 +1,1023 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Benchmarks of encoding, decoding, normalization and training over fixed
+// workloads built from the test corpora in data/. The workloads and models
+// are deterministic, so that the numbers of two builds are comparable. The
+// "worst_*" workloads are pathological inputs, e.g. invalid UTF-8 or long
+// runs, whose throughput exposes the worst case of every component.
+//
+// % spm_benchmark --data_dir=data --filter=encode
+// % spm_benchmark --data_dir=data --filter=worst
+//
+// With --perf_counters, the hardware counters of every benchmark are read
+// with perf_event_open(2) on Linux and reported per token and per byte.
+//
+// With --compare_engines, the encoder engines, e.g. the original and the
+// optimized unigram encoders or the batch encoders, encode a corpus side by
+// side on all cores instead. The inputs which an engine encodes differently
+// than the first one are reported, unless their scores only differ by float
+// rounding errors, with the speedup of every engine over the first one.
+//
+// % spm_benchmark --compare_engines --model=m.model --corpus=a.txt,b.txt
+//
+// With --train_scaling, every model type is trained on a fixed synthetic
+// corpus with 1, 2, 4, ... threads instead. The wall and CPU times of every
+// training phase, as TrainerSpec::profile_output records them, are reported
+// with the speedup over one thread, which tells the serial phases from the
+// parallel ones.
+//
+// % spm_benchmark --train_scaling --num_threads=16 --tsv
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "allocation_counter.h"
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "normalizer.h"
+#include "perf_counters.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/memory/memory.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_split.h"
+#include "util.h"
+
+ABSL_FLAG(std::string, data_dir, "data",
+          "Directory of botchan.txt and wagahaiwa_nekodearu.txt.");
+ABSL_FLAG(double, min_time, 0.5,
+          "Minimum seconds to run each benchmark. Every benchmark runs over "
+          "its whole workload at least once.");
+ABSL_FLAG(std::string, filter, "",
+          "Runs only the benchmarks whose name contains this string.");
+ABSL_FLAG(bool, tsv, false, "Prints the results as TSV.");
+ABSL_FLAG(bool, perf_counters, false,
+          "Reports the hardware counters of the benchmarks, e.g., cycles and "
+          "cache misses, per token and per byte. Linux only.");
+ABSL_FLAG(bool, compare_engines, false,
+          "Instead of the benchmarks, encodes --corpus with --model by every "
+          "engine of --engines, and reports the mismatches with the first "
+          "engine and the speedups over it.");
+ABSL_FLAG(std::string, model, "", "Model file of --compare_engines.");
+ABSL_FLAG(std::string, corpus, "",
+          "Comma separated text files of --compare_engines. The corpora in "
+          "--data_dir if empty.");
+ABSL_FLAG(std::string, engines,
+          "original,optimized,word_cache,collapse_repeats,batch_host",
+          "Comma separated engines of --compare_engines. The first one is the "
+          "reference. The engines which the model or the build does not "
+          "support are skipped.");
+ABSL_FLAG(int32, num_threads, 0,
+          "Threads of --compare_engines, and the most threads of "
+          "--train_scaling. All cores if 0.");
+ABSL_FLAG(int32, max_mismatches, 10,
+          "Mismatches printed per engine by --compare_engines.");
+ABSL_FLAG(bool, train_scaling, false,
+          "Instead of the benchmarks, trains every model type on a synthetic "
+          "corpus with 1, 2, 4, ... --num_threads threads, and reports the "
+          "time and the speedup of every training phase.");
+ABSL_FLAG(int32, train_scaling_sentences, 50000,
+          "Sentences of the synthetic corpus of --train_scaling.");
+ABSL_FLAG(std::string, tmp_dir, "/tmp",
+          "Directory of the training profiles of --train_scaling.");
+
+namespace sentencepiece {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Opens the counters of --perf_counters. Returns nullptr if none of them
+// is available.
+const test::PerfCounters *OpenPerfCounters() {
+  if (!absl::GetFlag(FLAGS_perf_counters)) return nullptr;
+  auto counters = absl::make_unique<test::PerfCounters>();
+  if (!counters->enabled()) {
+    std::fprintf(stderr,
+                 "No hardware counter is available; --perf_counters is "
+                 "ignored.\n");
+    return nullptr;
+  }
+  for (int i = 0; i < test::kNumPerfCounters; ++i) {
+    if (!counters->available(i)) {
+      std::fprintf(stderr, "The %s counter is not available; it reads 0.\n",
+                   test::PerfCounterName(i));
+    }
+  }
+  return counters.release();
+}
+
+// Returns the counters of --perf_counters, or nullptr. They count the
+// events of the main thread, which runs the benchmarks.
+const test::PerfCounters *GetPerfCounters() {
+  static const test::PerfCounters *counters = OpenPerfCounters();
+  return counters;
+}
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::vector<std::string> ReadLines(absl::string_view filename) {
+  auto input = filesystem::NewReadableFile(filename);
+  CHECK_OK(input->status());
+  std::vector<std::string> lines;
+  std::string line;
+  while (input->ReadLine(&line)) {
+    if (!line.empty()) lines.push_back(line);
+  }
+  return lines;
+}
+
+// Iterates over the sentences in memory.
+class VectorIterator : public SentenceIterator {
+ public:
+  explicit VectorIterator(const std::vector<std::string> &sentences)
+      : sentences_(sentences) {}
+  bool done() const override { return index_ >= sentences_.size(); }
+  void Next() override { ++index_; }
+  const std::string &value() const override { return sentences_[index_]; }
+  util::Status status() const override { return util::OkStatus(); }
+
+ private:
+  const std::vector<std::string> &sentences_;
+  size_t index_ = 0;
+};
+
+struct Workload {
+  std::string name;
+  std::vector<std::string> inputs;
+  size_t bytes = 0;
+};
+
+Workload MakeWorkload(const std::string &name,
+                      std::vector<std::string> inputs) {
+  Workload workload;
+  workload.name = name;
+  workload.inputs = std::move(inputs);
+  for (const auto &input : workload.inputs) workload.bytes += input.size();
+  return workload;
+}
+
+// Adds the pathological workloads named "worst_*", which drive every
+// component to its worst case. A quadratic regression shows up in their
+// throughput long before it does in the others.
+void AddWorstCaseWorkloads(const std::vector<std::string> &en,
+                           const std::vector<std::string> &ja,
+                           std::vector<Workload> *workloads) {
+  // The 64 most frequent words, each repeated without spaces, so that many
+  // pieces match at every position of the lattice.
+  std::map<std::string, int> freq;
+  for (const auto &line : en) {
+    for (const auto &word : absl::StrSplit(line, " ")) {
+      if (!word.empty()) ++freq[std::string(word)];
+    }
+  }
+  std::vector<std::pair<int, std::string>> frequent;
+  for (const auto &it : freq) frequent.emplace_back(-it.second, it.first);
+  std::sort(frequent.begin(), frequent.end());
+  frequent.resize(std::min<size_t>(frequent.size(), 64));
+  std::vector<std::string> prefixes;
+  for (const auto &it : frequent) {
+    std::string run;
+    while (run.size() < 4096) run += it.second;
+    prefixes.push_back(run);
+  }
+  workloads->push_back(MakeWorkload("worst_prefix", std::move(prefixes)));
+
+  // Words whose case signature nearly matches the spans of uppercase words
+  // that the case encoder searches for: all but the last letter in upper
+  // case, alternating case and single uppercase letters.
+  std::vector<std::string> cased;
+  for (const auto &line : en) {
+    std::string text = line;
+    size_t k = 0;
+    for (size_t begin = 0; begin < text.size(); ++k) {
+      size_t end = text.find(' ', begin);
+      if (end == std::string::npos) end = text.size();
+      for (size_t i = begin; i < end; ++i) {
+        const bool upper = k % 3 == 0   ? i + 1 < end
+                           : k % 3 == 1 ? (i - begin) % 2 == 1
+                                        : i == begin;
+        if (upper) text[i] = toupper(static_cast<unsigned char>(text[i]));
+      }
+      begin = end + 1;
+    }
+    cased.push_back(text);
+  }
+  workloads->push_back(MakeWorkload("worst_case", std::move(cased)));
+
+  // Only bytes which cannot start a UTF-8 character, each normalized to
+  // the replacement character.
+  std::mt19937 mt(0);
+  std::vector<std::string> invalid(256);
+  for (auto &text : invalid) {
+    for (int i = 0; i < 1024; ++i) {
+      const uint32 r = mt();
+      text += static_cast<char>(r % 2 == 0 ? 0x80 + (r >> 8) % 0x40
+                                           : 0xF8 + (r >> 8) % 0x08);
+    }
+  }
+  workloads->push_back(MakeWorkload("worst_invalid_utf8", std::move(invalid)));
+
+  // Each corpus as one line without white space, which cannot be cut
+  // between words.
+  std::string en_line, ja_line;
+  for (const auto &line : en) {
+    for (const char c : line) {
+      if (c != ' ') en_line += c;
+    }
+  }
+  for (const auto &line : ja) ja_line += line;
+  workloads->push_back(MakeWorkload("worst_no_space", {en_line, ja_line}));
+
+  // Runs of thousands of words and characters, which the encoder emits as
+  // repeat runs with long counts.
+  std::vector<std::string> runs;
+  for (size_t i = 0; i < std::min<size_t>(frequent.size(), 16); ++i) {
+    std::string run;
+    for (int k = 0; k < 2000; ++k) run += frequent[i].second + " ";
+    runs.push_back(run);
+  }
+  for (const char c : {'=', '-', 'a'}) runs.push_back(std::string(50000, c));
+  workloads->push_back(MakeWorkload("worst_repeat", std::move(runs)));
+}
+
+// Builds the workloads from the English and the Japanese corpora.
+std::vector<Workload> MakeWorkloads(const std::vector<std::string> &en,
+                                    const std::vector<std::string> &ja) {
+  std::vector<Workload> workloads;
+
+  // Queries of one to four words.
+  std::vector<std::string> queries;
+  for (size_t i = 0; i < en.size(); ++i) {
+    const std::vector<std::string> words = absl::StrSplit(en[i], " ");
+    const size_t n = std::min<size_t>(words.size(), 1 + i % 4);
+    if (n == 0) continue;
+    std::string query = words[0];
+    for (size_t k = 1; k < n; ++k) query += " " + words[k];
+    queries.push_back(query);
+  }
+  workloads.push_back(MakeWorkload("short_en", std::move(queries)));
+
+  // Documents of 64 lines.
+  std::vector<std::string> docs;
+  for (size_t i = 0; i + 64 <= en.size(); i += 64) {
+    std::string doc = en[i];
+    for (size_t k = 1; k < 64; ++k) doc += " " + en[i + k];
+    docs.push_back(doc);
+  }
+  workloads.push_back(MakeWorkload("long_en", std::move(docs)));
+
+  workloads.push_back(MakeWorkload("cjk", ja));
+
+  std::vector<std::string> mixed;
+  for (size_t i = 0; i < std::min(en.size(), ja.size()); ++i) {
+    mixed.push_back(en[i] + " " + ja[i]);
+  }
+  workloads.push_back(MakeWorkload("mixed", std::move(mixed)));
+
+  // Every other line in upper case, which the case-encoding models spell
+  // with the case markers.
+  std::vector<std::string> cased = en;
+  for (size_t i = 0; i < cased.size(); i += 2) {
+    for (char &c : cased[i]) c = toupper(static_cast<unsigned char>(c));
+  }
+  workloads.push_back(MakeWorkload("case_en", std::move(cased)));
+
+  // Every word three times, which the encoder emits as repeat runs.
+  std::vector<std::string> repeats;
+  for (const auto &line : en) {
+    std::string repeated;
+    for (const auto &word : absl::StrSplit(line, " ")) {
+      for (int k = 0; k < 3; ++k) {
+        if (!repeated.empty()) repeated += " ";
+        repeated.append(word.data(), word.size());
+      }
+    }
+    repeats.push_back(repeated);
+  }
+  workloads.push_back(MakeWorkload("repeat_en", std::move(repeats)));
+
+  AddWorstCaseWorkloads(en, ja, &workloads);
+  return workloads;
+}
+
+struct Model {
+  std::string name;
+  std::vector<std::string> workloads;  // names of the workloads to run.
+  SentencePieceProcessor sp;
+};
+
+struct Result {
+  std::string name;
+  size_t calls = 0;
+  double seconds = 0.0;
+  size_t tokens = 0;
+  size_t bytes = 0;
+  uint64_t allocations = 0;
+  std::vector<double> ns;  // per call.
+  bool has_counters = false;
+  uint64 counters[test::kNumPerfCounters] = {};
+};
+
+void PrintHeader() {
+  if (absl::GetFlag(FLAGS_tsv)) {
+    std::printf(
+        "name\tcalls\tp50_ns\tp90_ns\tp99_ns\tns_per_token\tmb_per_sec\t"
+        "allocs_per_call");
+    if (GetPerfCounters() != nullptr) {
+      for (int i = 0; i < test::kNumPerfCounters; ++i) {
+        std::printf("\t%s_per_token\t%s_per_byte", test::PerfCounterName(i),
+                    test::PerfCounterName(i));
+      }
+    }
+    std::printf("\n");
+  } else {
+    std::printf("%-44s %9s %11s %11s %11s %9s %9s %9s\n", "name", "calls",
+                "p50_ns", "p90_ns", "p99_ns", "ns/token", "MB/s",
+                "allocs");
+  }
+}
+
+// Prints the counters of `result` per token and per byte, as more columns
+// of the TSV or as two more lines of the table.
+void PrintCounters(const Result &result) {
+  if (GetPerfCounters() == nullptr) return;
+  auto per = [&](int counter, size_t n) {
+    return !result.has_counters || n == 0
+               ? 0.0
+               : static_cast<double>(result.counters[counter]) / n;
+  };
+  if (absl::GetFlag(FLAGS_tsv)) {
+    for (int i = 0; i < test::kNumPerfCounters; ++i) {
+      std::printf("\t%.2f\t%.3f", per(i, result.tokens),
+                  per(i, result.bytes));
+    }
+    return;
+  }
+  if (!result.has_counters) return;
+  for (const bool per_token : {true, false}) {
+    std::printf("  %-10s", per_token ? "per token" : "per byte");
+    for (int i = 0; i < test::kNumPerfCounters; ++i) {
+      std::printf(" %s=%.*f", test::PerfCounterName(i), per_token ? 2 : 3,
+                  per(i, per_token ? result.tokens : result.bytes));
+    }
+    std::printf("\n");
+  }
+}
+
+void PrintResult(Result *result) {
+  auto &ns = result->ns;
+  std::sort(ns.begin(), ns.end());
+  auto percentile = [&ns](double p) {
+    return ns.empty() ? 0.0
+                      : ns[std::min(ns.size() - 1,
+                                    static_cast<size_t>(p * ns.size()))];
+  };
+  const double ns_per_token =
+      result->tokens == 0 ? 0.0 : result->seconds * 1e9 / result->tokens;
+  const double mb_per_sec =
+      result->seconds == 0.0 ? 0.0 : result->bytes / 1e6 / result->seconds;
+  const double allocs_per_call =
+      result->calls == 0 ? 0.0
+                         : static_cast<double>(result->allocations) /
+                               result->calls;
+  const bool tsv = absl::GetFlag(FLAGS_tsv);
+  const char *format =
+      tsv ? "%s\t%zu\t%.0f\t%.0f\t%.0f\t%.1f\t%.2f\t%.2f"
+          : "%-44s %9zu %11.0f %11.0f %11.0f %9.1f %9.2f %9.2f\n";
+  std::printf(format, result->name.c_str(), result->calls, percentile(0.5),
+              percentile(0.9), percentile(0.99), ns_per_token, mb_per_sec,
+              allocs_per_call);
+  PrintCounters(*result);
+  if (tsv) std::printf("\n");
+  std::fflush(stdout);
+}
+
+bool Selected(const std::string &name) {
+  return name.find(absl::GetFlag(FLAGS_filter)) != std::string::npos;
+}
+
+// Runs `fn(i)` over the inputs i = 0..n-1 repeatedly until --min_time has
+// passed. `fn` returns the number of tokens of the call.
+void Run(const std::string &name, size_t n, const std::vector<size_t> &bytes,
+         const std::function<size_t(size_t)> &fn) {
+  if (!Selected(name) || n == 0) return;
+  Result result;
+  result.name = name;
+  // Warms up the buffers and caches that the calls reuse.
+  for (size_t i = 0; i < n; ++i) fn(i);
+
+  const test::PerfCounters *counters = GetPerfCounters();
+  uint64 counters_before[test::kNumPerfCounters] = {};
+  if (counters != nullptr) counters->Read(counters_before);
+  const double min_time = absl::GetFlag(FLAGS_min_time);
+  const auto start = Clock::now();
+  do {
+    for (size_t i = 0; i < n; ++i) {
+      const uint64_t allocations = test::NumAllocations();
+      const auto call_start = Clock::now();
+      result.tokens += fn(i);
+      const auto call_end = Clock::now();
+      result.allocations += test::NumAllocations() - allocations;
+      result.ns.push_back(
+          std::chrono::duration<double, std::nano>(call_end - call_start)
+              .count());
+      result.bytes += bytes[i];
+      ++result.calls;
+    }
+  } while (SecondsSince(start) < min_time);
+  if (counters != nullptr) {
+    // Includes the timing of the calls, which is small next to them.
+    counters->Read(result.counters);
+    for (int i = 0; i < test::kNumPerfCounters; ++i) {
+      result.counters[i] -= counters_before[i];
+    }
+    result.has_counters = true;
+  }
+  for (double ns : result.ns) result.seconds += ns / 1e9;
+
+  PrintResult(&result);
+}
+
+void RunModel(Model *model, const std::vector<Workload> &workloads) {
+  auto &sp = model->sp;
+  const bool is_unigram =
+      sp.model_proto().trainer_spec().model_type() == TrainerSpec::UNIGRAM;
+  const normalizer::Normalizer normalizer(sp.model_proto().normalizer_spec());
+  CHECK_OK(normalizer.status());
+
+  for (const auto &workload : workloads) {
+    if (std::find(model->workloads.begin(), model->workloads.end(),
+                  workload.name) == model->workloads.end()) {
+      continue;
+    }
+    const auto &inputs = workload.inputs;
+    const std::string prefix = model->name + "/" + workload.name + "/";
+    std::vector<size_t> bytes;
+    for (const auto &input : inputs) bytes.push_back(input.size());
+
+    std::vector<std::vector<int>> encoded(inputs.size());
+    std::vector<size_t> num_tokens(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      CHECK_OK(sp.Encode(inputs[i], &encoded[i]));
+      num_tokens[i] = encoded[i].size();
+    }
+
+    EncodeWorkspace workspace;
+    std::vector<int> ids;
+    Run(prefix + "encode", inputs.size(), bytes, [&](size_t i) {
+      ids.clear();
+      CHECK_OK(sp.EncodeIds(inputs[i], &ids, &workspace));
+      return ids.size();
+    });
+
+    // Every input but the first pass hits the cache.
+    CHECK_OK(sp.SetEncodeCacheSize(64 << 20));
+    Run(prefix + "encode_cached", inputs.size(), bytes, [&](size_t i) {
+      ids.clear();
+      CHECK_OK(sp.EncodeIds(inputs[i], &ids, &workspace));
+      return ids.size();
+    });
+    CHECK_OK(sp.SetEncodeCacheSize(0));
+
+    // Only about the first 64 ids of the inputs are encoded.
+    CHECK_OK(sp.SetEncodeMaxTokens(64));
+    Run(prefix + "encode_max_tokens", inputs.size(), bytes, [&](size_t i) {
+      ids.clear();
+      CHECK_OK(sp.EncodeIds(inputs[i], &ids, &workspace));
+      return ids.size();
+    });
+    CHECK_OK(sp.SetEncodeMaxTokens(0));
+
+    // Words seen before are not segmented again.
+    if (sp.SetWordCacheSize(1 << 16).ok()) {
+      Run(prefix + "encode_word_cache", inputs.size(), bytes, [&](size_t i) {
+        ids.clear();
+        CHECK_OK(sp.EncodeIds(inputs[i], &ids, &workspace));
+        return ids.size();
+      });
+      CHECK_OK(sp.SetWordCacheSize(0));
+    }
+
+    Run(prefix + "encode_no_workspace", inputs.size(), bytes, [&](size_t i) {
+      std::vector<int> ids;
+      CHECK_OK(sp.Encode(inputs[i], &ids));
+      return ids.size();
+    });
+
+    Run(prefix + "encode_pieces", inputs.size(), bytes, [&](size_t i) {
+      std::vector<std::string> pieces;
+      CHECK_OK(sp.Encode(inputs[i], &pieces));
+      return pieces.size();
+    });
+
+    if (is_unigram) {
+      CHECK_OK(sp.SetEncoderVersion(EncoderVersion::kOriginal));
+      Run(prefix + "encode_original", inputs.size(), bytes, [&](size_t i) {
+        ids.clear();
+        CHECK_OK(sp.EncodeIds(inputs[i], &ids, &workspace));
+        return ids.size();
+      });
+      CHECK_OK(sp.SetEncoderVersion(EncoderVersion::kOptimized));
+    }
+
+    std::string text;
+    Run(prefix + "decode", inputs.size(), bytes, [&](size_t i) {
+      CHECK_OK(sp.Decode(encoded[i], &text));
+      return encoded[i].size();
+    });
+
+    // Repeat groups nested in each other and cut short, which the decoder
+    // scans and expands as they come.
+    if (workload.name == "worst_repeat") {
+      const int start = sp.PieceToId("(#startrepeat)");
+      const int end = sp.PieceToId("(#endrepeat)");
+      const int nine = sp.PieceToId("9");
+      std::vector<std::vector<int>> nested(inputs.size());
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        for (const int id : encoded[i]) {
+          nested[i].insert(nested[i].end(), {id, start, id, start, nine, nine,
+                                             end, end, start, nine, start});
+        }
+      }
+      Run(prefix + "decode_nested_repeats", inputs.size(), bytes,
+          [&](size_t i) {
+            CHECK_OK(sp.Decode(nested[i], &text));
+            return nested[i].size();
+          });
+    }
+
+    std::string normalized;
+    std::vector<uint32> norm_to_orig;
+    Run(prefix + "normalize", inputs.size(), bytes, [&](size_t i) {
+      CHECK_OK(normalizer.Normalize(inputs[i], &normalized, &norm_to_orig));
+      return num_tokens[i];
+    });
+  }
+}
+
+// Trains the model of `args` over `sentences`, printing the training time as
+// the benchmark "<name>/train".
+std::unique_ptr<Model> TrainModel(const std::string &name,
+                                  const std::vector<std::string> &sentences,
+                                  const std::string &args,
+                                  bool encode_case,
+                                  std::vector<std::string> workloads) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  CHECK_OK(SentencePieceTrainer::MergeSpecsFromArgs(
+      args, &trainer_spec, &normalizer_spec, &denormalizer_spec));
+  if (encode_case) {
+    normalizer_spec.set_encode_case(true);
+    denormalizer_spec.set_add_dummy_prefix(false);
+    denormalizer_spec.set_remove_extra_whitespaces(false);
+    denormalizer_spec.set_escape_whitespaces(false);
+    denormalizer_spec.set_decode_case(true);
+  }
+
+  size_t bytes = 0;
+  for (const auto &sentence : sentences) bytes += sentence.size();
+
+  std::string serialized;
+  VectorIterator it(sentences);
+  const uint64_t allocations = test::NumAllocations();
+  const auto start = Clock::now();
+  CHECK_OK(SentencePieceTrainer::Train(trainer_spec, normalizer_spec,
+                                       denormalizer_spec, &it, &serialized));
+  Result result;
+  result.name = name + "/train";
+  result.calls = 1;
+  result.seconds = SecondsSince(start);
+  result.ns.push_back(result.seconds * 1e9);
+  result.bytes = bytes;
+  result.allocations = test::NumAllocations() - allocations;
+  if (Selected(result.name)) PrintResult(&result);
+
+  auto model = absl::make_unique<Model>();
+  model->name = name;
+  model->workloads = std::move(workloads);
+  CHECK_OK(model->sp.LoadFromSerializedProto(serialized));
+  return model;
+}
+
+// Sets up `sp` as the encoder engine `name` of --engines.
+util::Status SetEngine(const std::string &name, SentencePieceProcessor *sp) {
+  if (name == "original") {
+    return sp->SetEncoderVersion(EncoderVersion::kOriginal);
+  } else if (name == "optimized") {
+    return sp->SetEncoderVersion(EncoderVersion::kOptimized);
+  } else if (name == "word_cache") {
+    return sp->SetWordCacheSize(1 << 16);
+  } else if (name == "collapse_repeats") {
+    return sp->SetCollapseRepeatRuns(true);
+  } else if (name == "batch_host") {
+    return sp->SetBatchEncodeBackend(BatchEncodeBackend::kHost);
+  }
+  return util::InvalidArgumentError(absl::StrCat("Unknown engine: ", name));
+}
+
+struct Engine {
+  std::string name;
+  std::unique_ptr<SentencePieceProcessor> sp;
+  double seconds = 0.0;
+  size_t identical = 0;
+  size_t equivalent = 0;  // within float rounding errors.
+  size_t mismatched = 0;
+};
+
+std::string JoinPieces(const SentencePieceProcessor &sp,
+                       const std::vector<int> &ids) {
+  std::string pieces;
+  for (const int id : ids) {
+    if (!pieces.empty()) pieces += " ";
+    pieces += sp.IdToPiece(id);
+  }
+  return pieces;
+}
+
+// Runs --compare_engines. Returns 1 if an engine mismatched.
+int CompareEngines() {
+  const std::string model = absl::GetFlag(FLAGS_model);
+  CHECK(!model.empty()) << "--compare_engines requires --model.";
+  std::vector<std::string> corpus;
+  if (absl::GetFlag(FLAGS_corpus).empty()) {
+    const std::string data_dir = absl::GetFlag(FLAGS_data_dir);
+    corpus = {util::JoinPath(data_dir, "botchan.txt"),
+              util::JoinPath(data_dir, "wagahaiwa_nekodearu.txt")};
+  } else {
+    corpus = util::StrSplitAsCSV(absl::GetFlag(FLAGS_corpus));
+  }
+  int num_threads = absl::GetFlag(FLAGS_num_threads);
+  if (num_threads <= 0) {
+    num_threads = std::max<int>(1, std::thread::hardware_concurrency());
+  }
+  const int max_mismatches = absl::GetFlag(FLAGS_max_mismatches);
+
+  std::vector<Engine> engines;
+  for (const auto &name : util::StrSplitAsCSV(absl::GetFlag(FLAGS_engines))) {
+    Engine engine;
+    engine.name = name;
+    engine.sp = absl::make_unique<SentencePieceProcessor>();
+    CHECK_OK(engine.sp->Load(model));
+    const auto status = SetEngine(engine.name, engine.sp.get());
+    if (!status.ok()) {
+      std::fprintf(stderr, "Skipping %s: %s\n", engine.name.c_str(),
+                   status.ToString().c_str());
+      continue;
+    }
+    engines.push_back(std::move(engine));
+  }
+  CHECK(!engines.empty()) << "No engine to compare.";
+  const SentencePieceProcessor &reference = *engines[0].sp;
+
+  // The corpus is encoded in blocks of lines by every engine in turn, so
+  // that it is read once and only the ids of a block are kept.
+  constexpr size_t kBlockLines = 1 << 16;
+  std::vector<std::string> lines;
+  std::vector<absl::string_view> inputs;
+  std::vector<int> expected_ids, ids, expected, actual;
+  std::vector<size_t> expected_offsets, offsets;
+  size_t num_lines = 0, bytes = 0;
+  auto compare_block = [&]() {
+    inputs.assign(lines.begin(), lines.end());
+    for (size_t e = 0; e < engines.size(); ++e) {
+      Engine &engine = engines[e];
+      std::vector<int> *output = e == 0 ? &expected_ids : &ids;
+      std::vector<size_t> *output_offsets =
+          e == 0 ? &expected_offsets : &offsets;
+      const auto start = Clock::now();
+      CHECK_OK(
+          engine.sp->EncodeBatch(inputs, output, output_offsets, num_threads));
+      engine.seconds += SecondsSince(start);
+      if (e == 0) {
+        engine.identical += lines.size();
+        continue;
+      }
+      for (size_t i = 0; i < lines.size(); ++i) {
+        expected.assign(expected_ids.begin() + expected_offsets[i],
+                        expected_ids.begin() + expected_offsets[i + 1]);
+        actual.assign(ids.begin() + offsets[i], ids.begin() + offsets[i + 1]);
+        if (expected == actual) {
+          ++engine.identical;
+        } else if (reference.VerifyOutputsEquivalent(expected, actual)) {
+          ++engine.equivalent;
+        } else if (engine.mismatched++ <
+                   static_cast<size_t>(max_mismatches)) {
+          std::printf(
+              "MISMATCH %s line %zu: %s\n  expected: %s\n  actual:   %s\n",
+              engine.name.c_str(), num_lines + i + 1, lines[i].c_str(),
+              JoinPieces(reference, expected).c_str(),
+              JoinPieces(reference, actual).c_str());
+        }
+      }
+    }
+    num_lines += lines.size();
+    lines.clear();
+  };
+
+  std::string line;
+  for (const auto &filename : corpus) {
+    auto input = filesystem::NewReadableFile(filename);
+    CHECK_OK(input->status());
+    while (input->ReadLine(&line)) {
+      bytes += line.size();
+      lines.push_back(line);
+      if (lines.size() == kBlockLines) compare_block();
+    }
+    CHECK_OK(input->status());
+  }
+  compare_block();
+
+  std::printf("%zu lines, %zu bytes, %d threads\n", num_lines, bytes,
+              num_threads);
+  std::printf("%-20s %9s %9s %8s %11s %11s %11s\n", "engine", "seconds",
+              "MB/s", "speedup", "identical", "equivalent", "mismatched");
+  bool mismatched = false;
+  for (const auto &engine : engines) {
+    std::printf("%-20s %9.3f %9.2f %8.2f %11zu %11zu %11zu\n",
+                engine.name.c_str(), engine.seconds,
+                engine.seconds == 0.0 ? 0.0 : bytes / 1e6 / engine.seconds,
+                engine.seconds == 0.0 ? 0.0
+                                      : engines[0].seconds / engine.seconds,
+                engine.identical, engine.equivalent, engine.mismatched);
+    mismatched |= engine.mismatched > 0;
+  }
+  return mismatched ? 1 : 0;
+}
+
+// Returns the synthetic corpus of --train_scaling: sentences of words drawn
+// with a Zipf-like distribution from a random lexicon, and one in eight
+// sentences of Japanese characters without spaces.
+std::vector<std::string> MakeSyntheticCorpus(size_t num_sentences) {
+  std::mt19937 mt(0);
+  // Letters drawn with a skewed distribution, so that the words share
+  // frequent substrings as in natural text.
+  const std::string kLetters = "eeeeettttaaaoooiiinnnsssrrhhlldcumfpgwybvkxjqz";
+  std::vector<std::string> lexicon(20000);
+  for (auto &word : lexicon) {
+    const int size = 2 + mt() % 9;
+    for (int i = 0; i < size; ++i) word += kLetters[mt() % kLetters.size()];
+  }
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  auto zipf = [&]() {
+    return static_cast<size_t>(std::exp(uniform(mt) *
+                                        std::log(lexicon.size()))) -
+           1;
+  };
+
+  std::vector<std::string> corpus(num_sentences);
+  for (size_t i = 0; i < num_sentences; ++i) {
+    std::string &sentence = corpus[i];
+    const int size = 5 + mt() % 26;
+    for (int k = 0; k < size; ++k) {
+      if (i % 8 == 7) {
+        // Hiragana and the first 500 CJK ideographs.
+        const size_t r = zipf() % 583;
+        const char32 c = r < 83 ? 0x3041 + r : 0x4E00 + (r - 83);
+        sentence += string_util::UnicodeCharToUTF8(c);
+      } else {
+        if (k > 0) sentence += " ";
+        sentence += lexicon[zipf()];
+      }
+    }
+  }
+  return corpus;
+}
+
+// Returns the value of the number `key` in the JSON object `line`, or 0.
+double JsonNumber(const std::string &line, const std::string &key) {
+  const size_t pos = line.find("\"" + key + "\":");
+  if (pos == std::string::npos) return 0.0;
+  return std::strtod(line.c_str() + pos + key.size() + 3, nullptr);
+}
+
+// Returns the value of the string `key` in the JSON object `line`, which
+// has no escaped characters.
+std::string JsonString(const std::string &line, const std::string &key) {
+  const size_t pos = line.find("\"" + key + "\":\"");
+  if (pos == std::string::npos) return "";
+  const size_t begin = pos + key.size() + 4;
+  return line.substr(begin, line.find('"', begin) - begin);
+}
+
+struct PhaseTime {
+  std::string phase;
+  double wall_sec = 0.0;
+  double cpu_sec = 0.0;
+};
+
+// Trains a model with `args` and `num_threads` over `corpus`. Returns the
+// times of the phases in their order of the profile, the phases recorded
+// several times, e.g., "em", summed up, and the whole training as "total".
+std::vector<PhaseTime> ProfileTraining(const std::vector<std::string> &corpus,
+                                       const std::string &args,
+                                       int num_threads) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  CHECK_OK(SentencePieceTrainer::MergeSpecsFromArgs(
+      absl::StrCat(args, " --num_threads=", num_threads), &trainer_spec,
+      &normalizer_spec, &denormalizer_spec));
+  const std::string profile =
+      util::JoinPath(absl::GetFlag(FLAGS_tmp_dir), "spm_train_scaling.jsonl");
+  trainer_spec.set_profile_output(profile);
+
+  std::string serialized;
+  VectorIterator it(corpus);
+  const auto start = Clock::now();
+  const std::clock_t cpu_start = std::clock();
+  CHECK_OK(SentencePieceTrainer::Train(trainer_spec, normalizer_spec,
+                                       denormalizer_spec, &it, &serialized));
+  PhaseTime total;
+  total.phase = "total";
+  total.wall_sec = SecondsSince(start);
+  total.cpu_sec =
+      static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+  std::vector<PhaseTime> phases;
+  for (const auto &line : ReadLines(profile)) {
+    const std::string name = JsonString(line, "phase");
+    auto phase = std::find_if(
+        phases.begin(), phases.end(),
+        [&name](const PhaseTime &phase) { return phase.phase == name; });
+    if (phase == phases.end()) {
+      phases.emplace_back();
+      phase = phases.end() - 1;
+      phase->phase = name;
+    }
+    phase->wall_sec += JsonNumber(line, "wall_sec");
+    phase->cpu_sec += JsonNumber(line, "cpu_sec");
+  }
+  phases.push_back(total);
+  return phases;
+}
+
+// Runs --train_scaling.
+int TrainScaling() {
+  int max_threads = absl::GetFlag(FLAGS_num_threads);
+  if (max_threads <= 0) {
+    max_threads = std::max<int>(1, std::thread::hardware_concurrency());
+  }
+  std::vector<int> threads;
+  for (int n = 1; n < max_threads; n *= 2) threads.push_back(n);
+  threads.push_back(max_threads);
+
+  const auto corpus =
+      MakeSyntheticCorpus(absl::GetFlag(FLAGS_train_scaling_sentences));
+  size_t bytes = 0;
+  for (const auto &sentence : corpus) bytes += sentence.size();
+  std::fprintf(stderr, "%zu sentences, %zu bytes\n", corpus.size(), bytes);
+
+  // The warnings about the long lines are dropped. Char and word models
+  // take as many pieces as the corpus has.
+  const std::string kCommon =
+      "--minloglevel=2 --character_coverage=0.9995 --hard_vocab_limit=false ";
+  const std::vector<std::pair<std::string, std::string>> kModels = {
+      {"unigram", "--model_type=unigram --vocab_size=8000"},
+      {"bpe", "--model_type=bpe --vocab_size=8000"},
+      {"char", "--model_type=char --vocab_size=8000"},
+      {"word", "--model_type=word --vocab_size=8000"}};
+
+  const bool tsv = absl::GetFlag(FLAGS_tsv);
+  if (tsv) {
+    std::printf(
+        "model\tphase\tthreads\twall_sec\tcpu_sec\tspeedup\t"
+        "efficiency\n");
+  } else {
+    std::printf("%-10s %-24s %7s %9s %9s %8s %10s\n", "model", "phase",
+                "threads", "wall_sec", "cpu_sec", "speedup", "efficiency");
+  }
+  for (const auto &model : kModels) {
+    if (!Selected(model.first)) continue;
+    std::vector<PhaseTime> serial;
+    for (const int num_threads : threads) {
+      const auto phases =
+          ProfileTraining(corpus, kCommon + model.second, num_threads);
+      if (serial.empty()) serial = phases;
+      for (const auto &phase : phases) {
+        // The speedup of a phase over its time with one thread, and the
+        // speedup per thread.
+        double speedup = 0.0;
+        for (const auto &base : serial) {
+          if (base.phase == phase.phase && phase.wall_sec > 0.0) {
+            speedup = base.wall_sec / phase.wall_sec;
+          }
+        }
+        std::printf(tsv ? "%s\t%s\t%d\t%.4f\t%.4f\t%.2f\t%.2f\n"
+                        : "%-10s %-24s %7d %9.4f %9.4f %8.2f %10.2f\n",
+                    model.first.c_str(), phase.phase.c_str(), num_threads,
+                    phase.wall_sec, phase.cpu_sec, speedup,
+                    speedup / num_threads);
+      }
+      std::fflush(stdout);
+    }
+  }
+  return 0;
+}
+
+int Main() {
+  if (absl::GetFlag(FLAGS_compare_engines)) return CompareEngines();
+  if (absl::GetFlag(FLAGS_train_scaling)) return TrainScaling();
+
+  const std::string data_dir = absl::GetFlag(FLAGS_data_dir);
+  const auto en = ReadLines(util::JoinPath(data_dir, "botchan.txt"));
+  const auto ja = ReadLines(util::JoinPath(data_dir, "wagahaiwa_nekodearu.txt"));
+  const auto workloads = MakeWorkloads(en, ja);
+  std::vector<std::string> both = en;
+  both.insert(both.end(), ja.begin(), ja.end());
+
+  if (!test::AllocationCounterEnabled()) {
+    std::fprintf(stderr,
+                 "Built without SPM_COUNT_ALLOCATIONS; allocs are not "
+                 "counted.\n");
+  }
+  PrintHeader();
+
+  // The warnings about the long lines of the Japanese corpus are dropped.
+  const std::string kCommon = "--minloglevel=2 --num_threads=1 ";
+  // The repeat symbols make the encoder spell the runs with their own ids
+  // rather than with <unk>.
+  const std::string kRepeatSymbols =
+      " --user_defined_symbols=(#startrepeat),(#endrepeat)";
+  const std::vector<std::string> kEnglish = {
+      "short_en",           "long_en",        "repeat_en",   "worst_prefix",
+      "worst_invalid_utf8", "worst_no_space", "worst_repeat"};
+
+  std::vector<std::unique_ptr<Model>> models;
+  models.push_back(TrainModel("unigram_en", en,
+                              kCommon + "--model_type=unigram "
+                                        "--vocab_size=4000",
+                              false, kEnglish));
+  models.push_back(TrainModel("unigram_en_rle", en,
+                              kCommon + "--model_type=unigram "
+                                        "--vocab_size=4000" +
+                                  kRepeatSymbols,
+                              false, {"repeat_en", "worst_repeat"}));
+  models.push_back(TrainModel("bpe_en", en,
+                              kCommon + "--model_type=bpe "
+                                        "--vocab_size=4000",
+                              false, kEnglish));
+  models.push_back(TrainModel("bpe_en_rle", en,
+                              kCommon + "--model_type=bpe "
+                                        "--vocab_size=4000" +
+                                  kRepeatSymbols,
+                              false, {"repeat_en", "worst_repeat"}));
+  models.push_back(TrainModel("unigram_ja", ja,
+                              kCommon + "--model_type=unigram "
+                                        "--vocab_size=8000 "
+                                        "--character_coverage=0.9995",
+                              false, {"cjk", "worst_no_space"}));
+  models.push_back(TrainModel("bpe_ja", ja,
+                              kCommon + "--model_type=bpe "
+                                        "--vocab_size=8000 "
+                                        "--character_coverage=0.9995",
+                              false, {"cjk"}));
+  models.push_back(TrainModel("unigram_mixed", both,
+                              kCommon + "--model_type=unigram "
+                                        "--vocab_size=8000 "
+                                        "--character_coverage=0.9995",
+                              false, {"mixed", "cjk", "long_en"}));
+  models.push_back(TrainModel("unigram_case", en,
+                              kCommon + "--model_type=unigram "
+                                        "--vocab_size=4000",
+                              true, {"case_en", "worst_case"}));
+
+  for (auto &model : models) RunModel(model.get(), workloads);
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+  return sentencepiece::Main();
+}
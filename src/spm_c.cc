@@ -0,0 +1,217 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "spm_c.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+#include "util.h"
+
+struct spm_processor {
+  sentencepiece::SentencePieceProcessor sp;
+  std::string error;
+};
+
+struct spm_workspace {
+  sentencepiece::EncodeWorkspace encode;
+  std::vector<absl::string_view> inputs;
+  std::vector<int> ids;
+  std::vector<size_t> offsets;
+  std::vector<std::string> texts;
+  std::string error;
+};
+
+namespace {
+
+spm_status ToStatus(const sentencepiece::util::Status &status,
+                    std::string *error) {
+  if (status.ok()) {
+    error->clear();
+  } else {
+    *error = status.ToString();
+  }
+  return static_cast<spm_status>(status.code());
+}
+
+spm_status InvalidArgument(const char *message, std::string *error) {
+  return ToStatus(sentencepiece::util::InvalidArgumentError(message), error);
+}
+
+// Copies the ids of |workspace| into the buffers of spm_encode_batch().
+spm_status CopyIds(spm_workspace *workspace, int *ids, size_t ids_capacity,
+                   size_t *offsets) {
+  std::copy(workspace->offsets.begin(), workspace->offsets.end(), offsets);
+  if (workspace->ids.size() > ids_capacity) {
+    return ToStatus(sentencepiece::util::OutOfRangeError(
+                        "ids_capacity is smaller than the number of ids."),
+                    &workspace->error);
+  }
+  std::copy(workspace->ids.begin(), workspace->ids.end(), ids);
+  workspace->error.clear();
+  return SPM_OK;
+}
+
+}  // namespace
+
+extern "C" {
+
+spm_processor *spm_processor_new(void) { return new spm_processor; }
+
+void spm_processor_free(spm_processor *processor) { delete processor; }
+
+spm_status spm_processor_load(spm_processor *processor, const char *filename) {
+  if (filename == nullptr) {
+    return InvalidArgument("filename is null.", &processor->error);
+  }
+  return ToStatus(processor->sp.Load(filename), &processor->error);
+}
+
+spm_status spm_processor_load_from_serialized_proto(spm_processor *processor,
+                                                    const char *data,
+                                                    size_t size) {
+  if (data == nullptr && size > 0) {
+    return InvalidArgument("data is null.", &processor->error);
+  }
+  return ToStatus(
+      processor->sp.LoadFromSerializedProto(absl::string_view(data, size)),
+      &processor->error);
+}
+
+const char *spm_processor_error(const spm_processor *processor) {
+  return processor->error.c_str();
+}
+
+int spm_processor_piece_size(const spm_processor *processor) {
+  return processor->sp.status().ok() ? processor->sp.GetPieceSize() : 0;
+}
+
+int spm_processor_piece_to_id(const spm_processor *processor,
+                              const char *piece, size_t size) {
+  return processor->sp.PieceToId(absl::string_view(piece, size));
+}
+
+const char *spm_processor_id_to_piece(const spm_processor *processor, int id,
+                                      size_t *size) {
+  if (id < 0 || id >= spm_processor_piece_size(processor)) return nullptr;
+  const std::string &piece = processor->sp.IdToPiece(id);
+  if (size != nullptr) *size = piece.size();
+  return piece.data();
+}
+
+spm_workspace *spm_workspace_new(void) { return new spm_workspace; }
+
+void spm_workspace_free(spm_workspace *workspace) { delete workspace; }
+
+const char *spm_workspace_error(const spm_workspace *workspace) {
+  return workspace->error.c_str();
+}
+
+spm_status spm_encode_batch(const spm_processor *processor,
+                            spm_workspace *workspace,
+                            const char *const *inputs,
+                            const size_t *input_sizes, size_t num_inputs,
+                            int *ids, size_t ids_capacity, size_t *offsets,
+                            int num_threads) {
+  std::string *error = &workspace->error;
+  if (num_inputs > 0 && (inputs == nullptr || input_sizes == nullptr)) {
+    return InvalidArgument("inputs are null.", error);
+  }
+  if (offsets == nullptr || (ids == nullptr && ids_capacity > 0)) {
+    return InvalidArgument("output buffers are null.", error);
+  }
+
+  workspace->inputs.clear();
+  for (size_t i = 0; i < num_inputs; ++i) {
+    workspace->inputs.emplace_back(inputs[i], input_sizes[i]);
+  }
+
+  if (num_threads > 1) {
+    const auto status = processor->sp.EncodeBatch(
+        workspace->inputs, &workspace->ids, &workspace->offsets, num_threads);
+    if (!status.ok()) return ToStatus(status, error);
+    return CopyIds(workspace, ids, ids_capacity, offsets);
+  }
+
+  // Copies the ids while they fit, and only counts them after that.
+  auto &scratch = workspace->ids;
+  size_t size = 0;
+  offsets[0] = 0;
+  for (size_t i = 0; i < num_inputs; ++i) {
+    const auto status =
+        processor->sp.EncodeIds(workspace->inputs[i], &scratch,
+                                &workspace->encode);
+    if (!status.ok()) return ToStatus(status, error);
+    for (const int id : scratch) {
+      if (size < ids_capacity) {
+        ids[size] = id;
+      }
+      ++size;
+    }
+    offsets[i + 1] = size;
+  }
+  if (size > ids_capacity) {
+    return ToStatus(sentencepiece::util::OutOfRangeError(
+                        "ids_capacity is smaller than the number of ids."),
+                    error);
+  }
+  error->clear();
+  return SPM_OK;
+}
+
+spm_status spm_decode_batch(const spm_processor *processor,
+                            spm_workspace *workspace, const int *ids,
+                            const size_t *offsets, size_t num_outputs,
+                            char *text, size_t text_capacity,
+                            size_t *text_offsets, int num_threads) {
+  std::string *error = &workspace->error;
+  if (offsets == nullptr || (num_outputs > 0 && offsets[num_outputs] > 0 &&
+                             ids == nullptr)) {
+    return InvalidArgument("inputs are null.", error);
+  }
+  if (text_offsets == nullptr || (text == nullptr && text_capacity > 0)) {
+    return InvalidArgument("output buffers are null.", error);
+  }
+
+  const size_t num_ids = num_outputs > 0 ? offsets[num_outputs] : 0;
+  workspace->ids.assign(ids, ids + num_ids);
+  workspace->offsets.assign(offsets, offsets + num_outputs + 1);
+  const auto status =
+      processor->sp.DecodeBatch(workspace->ids, workspace->offsets,
+                                &workspace->texts, num_threads);
+  if (!status.ok()) return ToStatus(status, error);
+
+  size_t size = 0;
+  text_offsets[0] = 0;
+  for (size_t i = 0; i < num_outputs; ++i) {
+    const std::string &decoded = workspace->texts[i];
+    if (size + decoded.size() <= text_capacity) {
+      decoded.copy(text + size, decoded.size());
+    }
+    size += decoded.size();
+    text_offsets[i + 1] = size;
+  }
+  if (size > text_capacity) {
+    return ToStatus(sentencepiece::util::OutOfRangeError(
+                        "text_capacity is smaller than the decoded texts."),
+                    error);
+  }
+  error->clear();
+  return SPM_OK;
+}
+
+}  // extern "C"
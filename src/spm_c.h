@@ -0,0 +1,127 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef SPM_C_H_
+#define SPM_C_H_
+
+#include <stddef.h>
+
+// C API of SentencePieceProcessor for foreign function interfaces.
+//
+// The handles are opaque and owned by the caller, who frees them with the
+// matching spm_*_free() function. Functions returning spm_status return
+// SPM_OK on success and an error code otherwise, whose message is returned
+// by spm_processor_error() or spm_workspace_error().
+//
+// Thread safety: once loaded, a processor can be used by any number of
+// threads at the same time, as long as every thread passes its own
+// workspace. spm_processor_load*() and spm_processor_free() must not run
+// concurrently with any other call on the same processor. A workspace must
+// not be used by multiple threads at the same time.
+//
+// The outputs are written into buffers of the caller. When a buffer is too
+// small, the functions return SPM_OUT_OF_RANGE after storing the offsets the
+// output would have, so that the caller can grow the buffer to the last
+// offset and call again.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Same values as sentencepiece::util::StatusCode.
+typedef enum {
+  SPM_OK = 0,
+  SPM_CANCELLED = 1,
+  SPM_UNKNOWN = 2,
+  SPM_INVALID_ARGUMENT = 3,
+  SPM_DEADLINE_EXCEEDED = 4,
+  SPM_NOT_FOUND = 5,
+  SPM_ALREADY_EXISTS = 6,
+  SPM_PERMISSION_DENIED = 7,
+  SPM_RESOURCE_EXHAUSTED = 8,
+  SPM_FAILED_PRECONDITION = 9,
+  SPM_ABORTED = 10,
+  SPM_OUT_OF_RANGE = 11,
+  SPM_UNIMPLEMENTED = 12,
+  SPM_INTERNAL = 13,
+  SPM_UNAVAILABLE = 14,
+  SPM_DATA_LOSS = 15,
+  SPM_UNAUTHENTICATED = 16
+} spm_status;
+
+typedef struct spm_processor spm_processor;
+typedef struct spm_workspace spm_workspace;
+
+// Processor.
+spm_processor *spm_processor_new(void);
+void spm_processor_free(spm_processor *processor);
+
+// Loads a model file or a serialized ModelProto of |size| bytes.
+spm_status spm_processor_load(spm_processor *processor, const char *filename);
+spm_status spm_processor_load_from_serialized_proto(spm_processor *processor,
+                                                    const char *data,
+                                                    size_t size);
+
+// Returns the message of the last failed load, or "" if the processor is
+// loaded. The string is owned by the processor.
+const char *spm_processor_error(const spm_processor *processor);
+
+// Returns the vocabulary size, or 0 if no model is loaded.
+int spm_processor_piece_size(const spm_processor *processor);
+
+// Returns the id of |piece| of |size| bytes, or the unknown id.
+int spm_processor_piece_to_id(const spm_processor *processor,
+                              const char *piece, size_t size);
+
+// Returns the piece of |id| and stores its length in |size|. The piece is
+// owned by the processor and is not NUL-terminated if it contains NUL.
+// Returns NULL if |id| is out of range.
+const char *spm_processor_id_to_piece(const spm_processor *processor, int id,
+                                      size_t *size);
+
+// Workspace holding the scratch buffers of the encode and decode calls.
+// Reusing one workspace avoids allocations once its buffers have grown.
+spm_workspace *spm_workspace_new(void);
+void spm_workspace_free(spm_workspace *workspace);
+
+// Returns the message of the last failed call with |workspace|, or "". The
+// string is owned by the workspace.
+const char *spm_workspace_error(const spm_workspace *workspace);
+
+// Encodes the |num_inputs| strings inputs[i] of input_sizes[i] bytes. The ids
+// of input i are ids[offsets[i]] ... ids[offsets[i + 1] - 1], and |offsets|
+// has num_inputs + 1 elements. |ids| has room for |ids_capacity| ids.
+// |num_threads| <= 1 encodes in the calling thread.
+spm_status spm_encode_batch(const spm_processor *processor,
+                            spm_workspace *workspace,
+                            const char *const *inputs,
+                            const size_t *input_sizes, size_t num_inputs,
+                            int *ids, size_t ids_capacity, size_t *offsets,
+                            int num_threads);
+
+// Decodes the |num_outputs| sequences ids[offsets[i]] ...
+// ids[offsets[i + 1] - 1] into text[text_offsets[i]] ...
+// text[text_offsets[i + 1] - 1]. The texts are not NUL-terminated.
+// |text_offsets| has num_outputs + 1 elements and |text| room for
+// |text_capacity| bytes.
+spm_status spm_decode_batch(const spm_processor *processor,
+                            spm_workspace *workspace, const int *ids,
+                            const size_t *offsets, size_t num_outputs,
+                            char *text, size_t text_capacity,
+                            size_t *text_offsets, int num_threads);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // SPM_C_H_
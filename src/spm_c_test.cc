@@ -0,0 +1,143 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "spm_c.h"
+
+#include <string>
+#include <vector>
+
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "sentencepiece_trainer.h"
+#include "testharness.h"
+
+namespace sentencepiece {
+namespace {
+
+#define WS "\xe2\x96\x81"
+
+std::string MakeSerializedModel() {
+  ModelProto model_proto;
+  auto *unk = model_proto.add_pieces();
+  unk->set_type(ModelProto::SentencePiece::UNKNOWN);
+  unk->set_piece("<unk>");
+  for (const char *piece : {WS "ab", "ab", "a", "b", WS}) {
+    auto *sp = model_proto.add_pieces();
+    sp->set_piece(piece);
+    sp->set_score(0.0);
+  }
+  *model_proto.mutable_normalizer_spec() =
+      SentencePieceTrainer::GetNormalizerSpec("nmt_nfkc");
+  return model_proto.SerializeAsString();
+}
+
+TEST(SpmCTest, LoadTest) {
+  spm_processor *processor = spm_processor_new();
+  EXPECT_EQ(0, spm_processor_piece_size(processor));
+  EXPECT_EQ(SPM_NOT_FOUND, spm_processor_load(processor, "__missing__"));
+  EXPECT_NE(std::string(""), spm_processor_error(processor));
+  EXPECT_EQ(SPM_INTERNAL,
+            spm_processor_load_from_serialized_proto(processor, "x", 1));
+
+  const std::string model = MakeSerializedModel();
+  EXPECT_EQ(SPM_OK, spm_processor_load_from_serialized_proto(
+                        processor, model.data(), model.size()));
+  EXPECT_EQ(std::string(""), spm_processor_error(processor));
+  EXPECT_EQ(6, spm_processor_piece_size(processor));
+  EXPECT_EQ(2, spm_processor_piece_to_id(processor, "ab", 2));
+  EXPECT_EQ(0, spm_processor_piece_to_id(processor, "xyz", 3));
+  size_t size = 0;
+  const char *piece = spm_processor_id_to_piece(processor, 1, &size);
+  EXPECT_EQ(std::string(WS "ab"), std::string(piece, size));
+  EXPECT_TRUE(spm_processor_id_to_piece(processor, 6, &size) == nullptr);
+  EXPECT_TRUE(spm_processor_id_to_piece(processor, -1, &size) == nullptr);
+  spm_processor_free(processor);
+}
+
+TEST(SpmCTest, EncodeDecodeBatchTest) {
+  const std::string model = MakeSerializedModel();
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.LoadFromSerializedProto(model).ok());
+  spm_processor *processor = spm_processor_new();
+  ASSERT_EQ(SPM_OK, spm_processor_load_from_serialized_proto(
+                        processor, model.data(), model.size()));
+  spm_workspace *workspace = spm_workspace_new();
+
+  const std::vector<std::string> texts = {"ab a", "", "abba b", "a b ab"};
+  std::vector<const char *> inputs;
+  std::vector<size_t> input_sizes;
+  std::vector<int> expected_ids;
+  std::vector<size_t> expected_offsets = {0};
+  for (const auto &text : texts) {
+    inputs.push_back(text.data());
+    input_sizes.push_back(text.size());
+    const auto ids = sp.EncodeAsIds(text);
+    expected_ids.insert(expected_ids.end(), ids.begin(), ids.end());
+    expected_offsets.push_back(expected_ids.size());
+  }
+
+  for (int num_threads : {1, 4}) {
+    // A small buffer receives the offsets needed to grow it.
+    std::vector<int> ids(2);
+    std::vector<size_t> offsets(texts.size() + 1);
+    EXPECT_EQ(SPM_OUT_OF_RANGE,
+              spm_encode_batch(processor, workspace, inputs.data(),
+                               input_sizes.data(), inputs.size(), ids.data(),
+                               ids.size(), offsets.data(), num_threads));
+    EXPECT_NE(std::string(""), spm_workspace_error(workspace));
+    EXPECT_EQ(expected_offsets, offsets);
+
+    ids.resize(offsets.back());
+    EXPECT_EQ(SPM_OK,
+              spm_encode_batch(processor, workspace, inputs.data(),
+                               input_sizes.data(), inputs.size(), ids.data(),
+                               ids.size(), offsets.data(), num_threads));
+    EXPECT_EQ(std::string(""), spm_workspace_error(workspace));
+    EXPECT_EQ(expected_ids, ids);
+    EXPECT_EQ(expected_offsets, offsets);
+
+    std::vector<char> text(1);
+    std::vector<size_t> text_offsets(texts.size() + 1);
+    EXPECT_EQ(SPM_OUT_OF_RANGE,
+              spm_decode_batch(processor, workspace, ids.data(),
+                               offsets.data(), texts.size(), text.data(),
+                               text.size(), text_offsets.data(), num_threads));
+    text.resize(text_offsets.back());
+    EXPECT_EQ(SPM_OK,
+              spm_decode_batch(processor, workspace, ids.data(),
+                               offsets.data(), texts.size(), text.data(),
+                               text.size(), text_offsets.data(), num_threads));
+    for (size_t i = 0; i < texts.size(); ++i) {
+      EXPECT_EQ(texts[i], std::string(text.data() + text_offsets[i],
+                                      text_offsets[i + 1] - text_offsets[i]));
+    }
+  }
+
+  // Out of range ids.
+  const int bad_ids[] = {1, 100};
+  const size_t bad_offsets[] = {0, 2};
+  std::vector<size_t> text_offsets(2);
+  EXPECT_EQ(SPM_OUT_OF_RANGE,
+            spm_decode_batch(processor, workspace, bad_ids, bad_offsets, 1,
+                             nullptr, 0, text_offsets.data(), 1));
+  EXPECT_EQ(SPM_INVALID_ARGUMENT,
+            spm_encode_batch(processor, workspace, nullptr, nullptr, 1,
+                             nullptr, 0, text_offsets.data(), 1));
+
+  spm_workspace_free(workspace);
+  spm_processor_free(processor);
+}
+
+}  // namespace
+}  // namespace sentencepiece
@@ -12,26 +12,48 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "common.h"
 #include "filesystem.h"
 #include "init.h"
+#include "ordered_pipeline.h"
 #include "sentencepiece.pb.h"
 #include "sentencepiece_processor.h"
 #include "third_party/absl/flags/flag.h"
+#include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/str_split.h"
 #include "util.h"
 
 ABSL_FLAG(std::string, model, "", "model file name");
 ABSL_FLAG(std::string, input, "", "input filename");
 ABSL_FLAG(std::string, output, "", "output filename");
-ABSL_FLAG(std::string, input_format, "piece", "choose from piece or id");
+ABSL_FLAG(std::string, input_format, "piece",
+          "choose from piece, id or binary_id");
 ABSL_FLAG(std::string, output_format, "string", "choose from string or proto");
 ABSL_FLAG(std::string, extra_options, "",
           "':' separated encoder extra options, e.g., \"reverse:bos:eos\"");
+ABSL_FLAG(int32, binary_id_width, 4,
+          "Bytes per id (2 or 4) of binary_id written by spm_encode.");
+ABSL_FLAG(int32, num_threads, 1,
+          "Number of threads for decoding. The output keeps the input order.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines decoded at once by a thread if --num_threads > 1.");
+
+namespace {
+// Decodes |size| little-endian bytes.
+uint32 DecodeLittleEndian(const char *data, int size) {
+  uint32 value = 0;
+  for (int i = size - 1; i >= 0; --i) {
+    value = (value << 8) | static_cast<uint8>(data[i]);
+  }
+  return value;
+}
+}  // namespace
 
 int main(int argc, char *argv[]) {
   sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
@@ -55,12 +77,35 @@ int main(int argc, char *argv[]) {
   CHECK_OK(sp.SetDecodeExtraOptions(absl::GetFlag(FLAGS_extra_options)));
 
   auto output =
-      sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+      sentencepiece::filesystem::NewBufferedWritableFile(
+          absl::GetFlag(FLAGS_output));
   CHECK_OK(output->status());
 
-  std::string detok, line;
-  sentencepiece::SentencePieceText spt;
-  std::function<void(const std::vector<std::string> &pieces)> process;
+  // Sentences are decoded in batches as spm_encode encodes them.
+  struct Batch {
+    std::vector<std::string> lines;         // piece or id input.
+    std::vector<std::vector<int>> id_lines;  // binary_id input.
+    std::string output;
+
+    // Buffers reused for the sentences of the batch.
+    std::string detok;
+    sentencepiece::SentencePieceText spt;
+
+    size_t size() const { return lines.size() + id_lines.size(); }
+    void Clear() {
+      lines.clear();
+      id_lines.clear();
+      output.clear();
+    }
+  };
+
+  auto append_line = [](absl::string_view text, Batch *batch) {
+    batch->output.append(text.data(), text.size());
+    batch->output.push_back('\n');
+  };
+
+  std::function<void(const std::vector<std::string> &pieces, Batch *batch)>
+      process;
 
   auto ToIds = [&](const std::vector<std::string> &pieces) {
     std::vector<int> ids;
@@ -70,46 +115,99 @@ int main(int argc, char *argv[]) {
     return ids;
   };
 
+  std::function<void(const std::vector<int> &ids, Batch *batch)> process_ids;
+  if (absl::GetFlag(FLAGS_output_format) == "string") {
+    process_ids = [&](const std::vector<int> &ids, Batch *batch) {
+      CHECK_OK(sp.Decode(ids, &batch->detok));
+      append_line(batch->detok, batch);
+    };
+  } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
+    process_ids = [&](const std::vector<int> &ids, Batch *batch) {
+      CHECK_OK(sp.Decode(ids, &batch->spt));
+    };
+  } else {
+    LOG(FATAL) << "Unknown output format: "
+               << absl::GetFlag(FLAGS_output_format);
+  }
+
+  const bool is_binary = absl::GetFlag(FLAGS_input_format) == "binary_id";
   if (absl::GetFlag(FLAGS_input_format) == "piece") {
     if (absl::GetFlag(FLAGS_output_format) == "string") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(pieces, &detok));
-        output->WriteLine(detok);
-      };
-    } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(pieces, &spt));
+      process = [&](const std::vector<std::string> &pieces, Batch *batch) {
+        CHECK_OK(sp.Decode(pieces, &batch->detok));
+        append_line(batch->detok, batch);
       };
     } else {
-      LOG(FATAL) << "Unknown output format: "
-                 << absl::GetFlag(FLAGS_output_format);
-    }
-  } else if (absl::GetFlag(FLAGS_input_format) == "id") {
-    if (absl::GetFlag(FLAGS_output_format) == "string") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(ToIds(pieces), &detok));
-        output->WriteLine(detok);
-      };
-    } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
-      process = [&](const std::vector<std::string> &pieces) {
-        CHECK_OK(sp.Decode(ToIds(pieces), &spt));
+      process = [&](const std::vector<std::string> &pieces, Batch *batch) {
+        CHECK_OK(sp.Decode(pieces, &batch->spt));
       };
-    } else {
-      LOG(FATAL) << "Unknown output format: "
-                 << absl::GetFlag(FLAGS_output_format);
     }
-  } else {
+  } else if (absl::GetFlag(FLAGS_input_format) == "id") {
+    process = [&](const std::vector<std::string> &pieces, Batch *batch) {
+      process_ids(ToIds(pieces), batch);
+    };
+  } else if (!is_binary) {
     LOG(FATAL) << "Unknown input format: " << absl::GetFlag(FLAGS_input_format);
   }
 
+  const int binary_id_width = absl::GetFlag(FLAGS_binary_id_width);
+  CHECK(!is_binary || binary_id_width == 2 || binary_id_width == 4)
+      << "--binary_id_width must be 2 or 4.";
+
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  CHECK_GE(num_threads, 1);
+  // Without threads, every sentence is written as soon as it is decoded.
+  const size_t batch_size =
+      num_threads > 1
+          ? static_cast<size_t>(std::max(1, absl::GetFlag(FLAGS_batch_size)))
+          : 1;
+
+  auto decode = [&](Batch *batch) {
+    for (const auto &line : batch->lines) {
+      const std::vector<std::string> pieces = absl::StrSplit(line, " ");
+      process(pieces, batch);
+    }
+    for (const auto &ids : batch->id_lines) process_ids(ids, batch);
+  };
+
+  auto write = [&output](Batch *batch) {
+    CHECK(output->Write(batch->output));
+  };
+
+  sentencepiece::OrderedPipeline<Batch> pipeline(num_threads, decode, write);
+  auto batch = absl::make_unique<Batch>();
+  auto submit_if_full = [&]() {
+    if (batch->size() == batch_size) batch = pipeline.Submit(std::move(batch));
+  };
+
+  std::string buffer, line;
   for (const auto &filename : rest_args) {
-    auto input = sentencepiece::filesystem::NewReadableFile(filename);
+    auto input = sentencepiece::filesystem::NewReadableFile(filename, is_binary);
     CHECK_OK(input->status());
+    if (is_binary) {
+      // Each sentence is the number of ids followed by the ids.
+      while (input->Read(4, &buffer)) {
+        const uint32 size = DecodeLittleEndian(buffer.data(), 4);
+        CHECK(input->Read(static_cast<size_t>(size) * binary_id_width, &buffer))
+            << "Truncated binary_id input: " << filename;
+        batch->id_lines.emplace_back(size);
+        auto &ids = batch->id_lines.back();
+        for (uint32 i = 0; i < size; ++i) {
+          ids[i] = DecodeLittleEndian(&buffer[i * binary_id_width],
+                                      binary_id_width);
+        }
+        submit_if_full();
+      }
+      continue;
+    }
     while (input->ReadLine(&line)) {
-      const auto pieces = absl::StrSplit(line, " ");
-      process(pieces);
+      batch->lines.push_back(line);
+      submit_if_full();
     }
   }
+  if (batch->size() > 0) pipeline.Submit(std::move(batch));
+  pipeline.Finish();
+  CHECK(output->Flush());
 
   return 0;
 }
@@ -12,25 +12,30 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
 #include <functional>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "common.h"
 #include "filesystem.h"
 #include "init.h"
+#include "ordered_pipeline.h"
 #include "sentencepiece.pb.h"
 #include "sentencepiece_processor.h"
-#include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/flags/flag.h"
+#include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_join.h"
 #include "trainer_interface.h"
 
 ABSL_FLAG(std::string, model, "", "model file name");
 ABSL_FLAG(std::string, output_format, "piece",
-          "choose from piece, id, proto, nbest_piece, nbest_id, nbest_proto, "
-          "sample_piece, sample_id or sample_proto.");
+          "choose from piece, id, binary_id, proto, nbest_piece, nbest_id, "
+          "nbest_proto, sample_piece, sample_id, sample_binary_id, "
+          "sample_proto or flat.");
 ABSL_FLAG(std::string, input, "", "input filename");
 ABSL_FLAG(std::string, output, "", "output filename");
 ABSL_FLAG(std::string, extra_options, "",
@@ -38,6 +43,10 @@ ABSL_FLAG(std::string, extra_options, "",
 ABSL_FLAG(int32, nbest_size, 10, "NBest size");
 ABSL_FLAG(double, alpha, 0.5, "Smoothing parameter for sampling mode.");
 ABSL_FLAG(int32, random_seed, -1, "Seed value for random generator.");
+ABSL_FLAG(int32, binary_id_width, 4,
+          "Bytes per id (2 or 4) of binary_id. Each sentence is written as "
+          "the number of ids in 4 bytes, followed by the ids. All integers "
+          "are unsigned little-endian.");
 
 // Piece restriction with vocabulary file.
 // https://github.com/rsennrich/subword-nmt#best-practice-advice-for-byte-pair-encoding-in-nmt
@@ -48,6 +57,33 @@ ABSL_FLAG(int32, vocabulary_threshold, 0,
           "Words with frequency < threshold will be treated as OOV");
 ABSL_FLAG(bool, generate_vocabulary, false,
           "Generates vocabulary file instead of segmentation");
+ABSL_FLAG(std::string, vocabulary_format, "tsv",
+          "Format of --generate_vocabulary. choose from tsv (<token> <tab> "
+          "<freq> lines) or counts (the frequencies of all pieces in a binary "
+          "file only valid for --model). Both are read by --vocabulary.");
+ABSL_FLAG(int32, num_threads, 1,
+          "Number of threads for encoding. The output keeps the input order, "
+          "but sampling is not reproducible with --random_seed if > 1.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines encoded at once by a thread if --num_threads > 1 "
+          "or --max_tokens_per_batch > 0.");
+ABSL_FLAG(bool, flat_result_pieces, false,
+          "If true, the flat results of --output_format=flat also hold the "
+          "pieces.");
+ABSL_FLAG(int32, max_tokens_per_batch, 0,
+          "If > 0, binary_id groups the sentences of every --batch_size "
+          "lines into batches of similar lengths with at most this many ids "
+          "including the padding. Every batch is written as the number of its "
+          "sentences in 4 bytes, followed by the sentences, shortest first.");
+
+namespace {
+// Appends the lower |size| bytes of |value| in little-endian.
+void AppendLittleEndian(uint32 value, int size, std::string *output) {
+  for (int i = 0; i < size; ++i) {
+    output->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+}  // namespace
 
 int main(int argc, char *argv[]) {
   sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
@@ -78,94 +114,270 @@ int main(int argc, char *argv[]) {
                                absl::GetFlag(FLAGS_vocabulary_threshold)));
   }
 
-  auto output =
-      sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+  const std::string &output_format = absl::GetFlag(FLAGS_output_format);
+  const bool is_binary = output_format == "binary_id" ||
+                         output_format == "sample_binary_id";
+  const int binary_id_width = absl::GetFlag(FLAGS_binary_id_width);
+  if (is_binary) {
+    CHECK(binary_id_width == 2 || binary_id_width == 4)
+        << "--binary_id_width must be 2 or 4.";
+    CHECK_LE(static_cast<int64>(sp.GetPieceSize()),
+             int64{1} << (8 * binary_id_width))
+        << "The vocabulary does not fit in --binary_id_width="
+        << binary_id_width;
+  }
+
+  // flat writes every batch of lines as one flat result of
+  // SentencePieceProcessor::EncodeAsFlatResult(), with the byte offsets.
+  const bool is_flat = !absl::GetFlag(FLAGS_generate_vocabulary) &&
+                       output_format == "flat";
+  const uint32 flat_flags =
+      sentencepiece::kFlatResultOffsets |
+      (absl::GetFlag(FLAGS_flat_result_pieces) ? sentencepiece::kFlatResultPieces
+                                               : 0);
+
+  const int max_tokens_per_batch = absl::GetFlag(FLAGS_max_tokens_per_batch);
+  const bool is_bucketed = max_tokens_per_batch > 0;
+  CHECK(!is_bucketed || (output_format == "binary_id" &&
+                         !absl::GetFlag(FLAGS_generate_vocabulary)))
+      << "--max_tokens_per_batch requires --output_format=binary_id.";
+
+  const std::string &vocabulary_format =
+      absl::GetFlag(FLAGS_vocabulary_format);
+  CHECK(vocabulary_format == "tsv" || vocabulary_format == "counts")
+      << "Unknown vocabulary format: " << vocabulary_format;
+  const bool is_counts_output =
+      absl::GetFlag(FLAGS_generate_vocabulary) && vocabulary_format == "counts";
+
+  auto output = sentencepiece::filesystem::NewBufferedWritableFile(
+      absl::GetFlag(FLAGS_output), is_binary || is_counts_output || is_flat);
   CHECK_OK(output->status());
 
-  std::string line;
-  std::vector<std::string> sps;
-  std::vector<int> ids;
-  std::vector<std::vector<std::string>> nbest_sps;
-  std::vector<std::vector<int>> nbest_ids;
-  absl::flat_hash_map<std::string, int> vocab;
-  sentencepiece::SentencePieceText spt;
-  sentencepiece::NBestSentencePieceText nbest_spt;
-  std::function<void(const std::string &line)> process;
+  // Lines are encoded in batches. With --num_threads > 1, the batches are
+  // encoded on a thread pool while the next ones are read, and the outputs
+  // are written in the input order.
+  struct Batch {
+    std::vector<std::string> lines;
+    std::string output;
+    std::vector<int> flat_ids;
+    // Rows of |flat_ids| and their batches with --max_tokens_per_batch.
+    std::vector<size_t> id_offsets;
+    std::vector<size_t> order;
+    std::vector<size_t> bucket_offsets;
+    // Frequencies by piece id with --generate_vocabulary, and the ids whose
+    // frequency is not 0. write() resets them, so that a batch does not
+    // clear the whole array.
+    std::vector<int64> counts;
+    std::vector<int> counted_ids;
+
+    void Clear() {
+      lines.clear();
+      output.clear();
+      flat_ids.clear();
+    }
+
+    // Buffers reused for the lines of the batch.
+    std::vector<std::string> sps;
+    std::vector<int> ids;
+    std::vector<absl::string_view> inputs;
+    std::vector<std::vector<std::string>> nbest_sps;
+    std::vector<std::vector<int>> nbest_ids;
+    sentencepiece::SentencePieceText spt;
+    sentencepiece::NBestSentencePieceText nbest_spt;
+  };
+
+  std::vector<int64> vocab_counts;
+  std::function<void(absl::string_view line, Batch *batch)> process;
 
   const int nbest_size = absl::GetFlag(FLAGS_nbest_size);
   const float alpha = absl::GetFlag(FLAGS_alpha);
 
+  auto append_line = [](absl::string_view text, Batch *batch) {
+    batch->output.append(text.data(), text.size());
+    batch->output.push_back('\n');
+  };
+
+  auto append_binary_ids = [binary_id_width](const std::vector<int> &ids,
+                                             Batch *batch) {
+    AppendLittleEndian(ids.size(), 4, &batch->output);
+    for (const int id : ids) {
+      AppendLittleEndian(id, binary_id_width, &batch->output);
+    }
+  };
+
   if (absl::GetFlag(FLAGS_generate_vocabulary)) {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.Encode(line, &spt));
-      for (const auto &piece : spt.pieces()) {
-        if (!sp.IsUnknown(piece.id()) && !sp.IsControl(piece.id()))
-          vocab[piece.piece()]++;
+    // Piece ids are dense, so every batch counts them in an array.
+    vocab_counts.resize(sp.GetPieceSize(), 0);
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.Encode(line, &batch->ids));
+      if (batch->counts.empty()) batch->counts.resize(sp.GetPieceSize(), 0);
+      for (const int id : batch->ids) {
+        if (sp.IsUnknown(id) || sp.IsControl(id)) continue;
+        if (batch->counts[id]++ == 0) batch->counted_ids.push_back(id);
       }
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "piece") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.Encode(line, &sps));
-      output->WriteLine(absl::StrJoin(sps, " "));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.Encode(line, &batch->sps));
+      append_line(absl::StrJoin(batch->sps, " "), batch);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "id") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.Encode(line, &ids));
-      output->WriteLine(absl::StrJoin(ids, " "));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.Encode(line, &batch->ids));
+      append_line(absl::StrJoin(batch->ids, " "), batch);
+    };
+  } else if (absl::GetFlag(FLAGS_output_format) == "binary_id") {
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.Encode(line, &batch->ids));
+      append_binary_ids(batch->ids, batch);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "proto") {
-    process = [&](const std::string &line) { CHECK_OK(sp.Encode(line, &spt)); };
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.Encode(line, &batch->spt));
+    };
   } else if (absl::GetFlag(FLAGS_output_format) == "sample_piece") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &sps));
-      output->WriteLine(absl::StrJoin(sps, " "));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &batch->sps));
+      append_line(absl::StrJoin(batch->sps, " "), batch);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "sample_id") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &ids));
-      output->WriteLine(absl::StrJoin(ids, " "));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &batch->ids));
+      append_line(absl::StrJoin(batch->ids, " "), batch);
+    };
+  } else if (absl::GetFlag(FLAGS_output_format) == "sample_binary_id") {
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &batch->ids));
+      append_binary_ids(batch->ids, batch);
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "sample_proto") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &spt));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.SampleEncode(line, nbest_size, alpha, &batch->spt));
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "nbest_piece") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.NBestEncode(line, nbest_size, &nbest_sps));
-      for (const auto &result : nbest_sps) {
-        output->WriteLine(absl::StrJoin(result, " "));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.NBestEncode(line, nbest_size, &batch->nbest_sps));
+      for (const auto &result : batch->nbest_sps) {
+        append_line(absl::StrJoin(result, " "), batch);
       }
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "nbest_id") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.NBestEncode(line, nbest_size, &nbest_ids));
-      for (const auto &result : nbest_ids) {
-        output->WriteLine(absl::StrJoin(result, " "));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.NBestEncode(line, nbest_size, &batch->nbest_ids));
+      for (const auto &result : batch->nbest_ids) {
+        append_line(absl::StrJoin(result, " "), batch);
       }
     };
   } else if (absl::GetFlag(FLAGS_output_format) == "nbest_proto") {
-    process = [&](const std::string &line) {
-      CHECK_OK(sp.NBestEncode(line, nbest_size, &nbest_spt));
+    process = [&](absl::string_view line, Batch *batch) {
+      CHECK_OK(sp.NBestEncode(line, nbest_size, &batch->nbest_spt));
     };
+  } else if (is_flat) {
+    // Batches are encoded at once by |encode_flat|.
   } else {
     LOG(FATAL) << "Unknown output format: "
                << absl::GetFlag(FLAGS_output_format);
   }
 
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  CHECK_GE(num_threads, 1);
+  // Without threads, every line is written as soon as it is encoded.
+  const size_t batch_size =
+      num_threads > 1 || is_bucketed || is_flat
+          ? static_cast<size_t>(std::max(1, absl::GetFlag(FLAGS_batch_size)))
+          : 1;
+
+  // Encodes the lines of |batch| at once and writes them by batches of
+  // max_tokens_per_batch.
+  auto encode_bucketed = [&](Batch *batch) {
+    batch->inputs.assign(batch->lines.begin(), batch->lines.end());
+    CHECK_OK(sp.EncodeBatchBucketed(batch->inputs, max_tokens_per_batch,
+                                    &batch->flat_ids, &batch->id_offsets,
+                                    &batch->order, &batch->bucket_offsets, 1));
+    for (size_t b = 0; b + 1 < batch->bucket_offsets.size(); ++b) {
+      const size_t begin = batch->bucket_offsets[b];
+      const size_t end = batch->bucket_offsets[b + 1];
+      AppendLittleEndian(end - begin, 4, &batch->output);
+      for (size_t k = begin; k < end; ++k) {
+        const size_t i = batch->order[k];
+        const size_t first = batch->id_offsets[i];
+        const size_t last = batch->id_offsets[i + 1];
+        AppendLittleEndian(last - first, 4, &batch->output);
+        for (size_t j = first; j < last; ++j) {
+          AppendLittleEndian(batch->flat_ids[j], binary_id_width,
+                             &batch->output);
+        }
+      }
+    }
+  };
+
+  // Encodes the lines of |batch| into one flat result.
+  auto encode_flat = [&](Batch *batch) {
+    batch->inputs.assign(batch->lines.begin(), batch->lines.end());
+    CHECK_OK(sp.EncodeAsFlatResult(batch->inputs, flat_flags, 1,
+                                   &batch->output));
+  };
+
+  // Runs |process| for all lines of |batch|.
+  auto encode = [&process, &encode_bucketed, &encode_flat, is_bucketed,
+                 is_flat](Batch *batch) {
+    if (is_bucketed) {
+      encode_bucketed(batch);
+      return;
+    }
+    if (is_flat) {
+      encode_flat(batch);
+      return;
+    }
+    for (const auto &line : batch->lines) process(line, batch);
+  };
+
+  // Writes the output of |batch|.
+  auto write = [&output, &vocab_counts](Batch *batch) {
+    CHECK(output->Write(batch->output));
+    for (const int id : batch->counted_ids) {
+      vocab_counts[id] += batch->counts[id];
+      batch->counts[id] = 0;
+    }
+    batch->counted_ids.clear();
+  };
+
+  sentencepiece::OrderedPipeline<Batch> pipeline(num_threads, encode, write);
+  auto batch = absl::make_unique<Batch>();
+  absl::string_view line;
   for (const auto &filename : rest_args) {
     auto input = sentencepiece::filesystem::NewReadableFile(filename);
     CHECK_OK(input->status());
-    while (input->ReadLine(&line)) {
-      process(line);
+    while (input->ReadLineView(&line)) {
+      batch->lines.emplace_back(line);
+      if (batch->lines.size() == batch_size) {
+        batch = pipeline.Submit(std::move(batch));
+      }
     }
+    CHECK_OK(input->status());
   }
+  if (!batch->lines.empty()) pipeline.Submit(std::move(batch));
+  pipeline.Finish();
 
-  if (absl::GetFlag(FLAGS_generate_vocabulary)) {
+  if (is_counts_output) {
+    const std::vector<uint64_t> counts(vocab_counts.begin(),
+                                       vocab_counts.end());
+    std::string serialized;
+    CHECK_OK(sp.SerializeVocabularyCounts(counts, &serialized));
+    CHECK(output->Write(serialized));
+  } else if (absl::GetFlag(FLAGS_generate_vocabulary)) {
+    std::vector<std::pair<std::string, int64>> vocab;
+    for (int id = 0; id < sp.GetPieceSize(); ++id) {
+      if (vocab_counts[id] > 0) {
+        vocab.emplace_back(sp.IdToPiece(id), vocab_counts[id]);
+      }
+    }
     for (const auto &it : sentencepiece::Sorted(vocab)) {
       output->WriteLine(it.first + "\t" +
                         sentencepiece::string_util::SimpleItoa(it.second));
     }
   }
+  CHECK(output->Flush());
 
   return 0;
 }
@@ -0,0 +1,393 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Measures the tokenization efficiency of several models over held-out
+// corpora, e.g.,
+//
+//   spm_eval --model=a.model,b.model --num_threads=8 en.txt ja.txt
+//
+// The corpus is read once. Every batch of lines is encoded by all models on
+// the threads of an OrderedPipeline, and one row of statistics is printed
+// per model and language, followed by the row of all languages:
+//
+//   model language sentences bytes chars tokens tokens_per_byte
+//   bytes_per_token unk_rate byte_fallback_rate repeat_runs
+//   repeat_marker_rate mb_per_sec
+//
+// The language of a line is the name of its input file without the
+// directory and the extension, or, with --language_tab, the field before
+// the first tab of the line. Rates are per token. mb_per_sec is the
+// throughput of one thread, i.e., the bytes over the time spent
+// normalizing and encoding them.
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "normalizer.h"
+#include "ordered_pipeline.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/memory/memory.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_format.h"
+#include "third_party/absl/strings/str_split.h"
+
+ABSL_FLAG(std::string, model, "", "comma separated model file names");
+ABSL_FLAG(std::string, input, "", "comma separated input file names");
+ABSL_FLAG(bool, language_tab, false,
+          "If true, text lines are <language> <tab> <sentence>. Lines "
+          "without a tab count for the language of their file.");
+ABSL_FLAG(std::string, output, "", "output filename");
+ABSL_FLAG(int32, num_threads, 1, "Number of threads for encoding.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines encoded at once by a thread.");
+
+namespace sentencepiece {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Stats {
+  int64 sentences = 0;
+  int64 bytes = 0;
+  int64 chars = 0;
+  int64 tokens = 0;
+  int64 unknowns = 0;        // unknown ids.
+  int64 byte_fallbacks = 0;  // byte pieces.
+  int64 repeat_runs = 0;     // runs written with repeat markers.
+  int64 repeat_markers = 0;  // ids of the repeat markers.
+  double seconds = 0.0;
+
+  void Add(const Stats &other) {
+    sentences += other.sentences;
+    bytes += other.bytes;
+    chars += other.chars;
+    tokens += other.tokens;
+    unknowns += other.unknowns;
+    byte_fallbacks += other.byte_fallbacks;
+    repeat_runs += other.repeat_runs;
+    repeat_markers += other.repeat_markers;
+    seconds += other.seconds;
+  }
+};
+
+struct Model {
+  std::string name;  // the file name.
+  SentencePieceProcessor sp;
+  // The markers of the repeat runs, or the unknown id if they are not
+  // pieces, in which case the runs are counted as unknown ids.
+  int start_repeat = -1;
+  int end_repeat = -1;
+  std::vector<bool> is_repeat_count;  // "<rep:k>" pieces.
+
+  // Adds the ids of one sentence to `stats`.
+  void Count(const std::vector<int> &ids, Stats *stats) const {
+    stats->tokens += ids.size();
+    for (size_t i = 0; i < ids.size(); ++i) {
+      const int id = ids[i];
+      if (id == start_repeat && !sp.IsUnknown(id)) {
+        ++stats->repeat_runs;
+        const size_t begin = i;
+        while (i + 1 < ids.size() && ids[i] != end_repeat) ++i;
+        stats->repeat_markers += i - begin + 1;
+      } else if (is_repeat_count[id]) {
+        if (i == 0 || !is_repeat_count[ids[i - 1]]) ++stats->repeat_runs;
+        ++stats->repeat_markers;
+      } else if (sp.IsUnknown(id)) {
+        ++stats->unknowns;
+      } else if (sp.IsByte(id)) {
+        ++stats->byte_fallbacks;
+      }
+    }
+  }
+};
+
+// Models whose normalizers make the same text. The text is normalized once
+// and encoded by every model with EncodePreNormalized().
+struct NormalizerGroup {
+  std::vector<int> models;
+  std::unique_ptr<normalizer::PrefixMatcher> matcher;
+  std::unique_ptr<normalizer::Normalizer> normalizer;
+};
+
+// Returns what the normalizer of `model_proto` depends on.
+std::string NormalizerKey(const ModelProto &model_proto) {
+  std::string key = model_proto.normalizer_spec().SerializeAsString();
+  key.push_back(model_proto.trainer_spec().treat_whitespace_as_suffix());
+  for (const auto &piece : model_proto.pieces()) {
+    if (piece.type() == ModelProto::SentencePiece::USER_DEFINED) {
+      key.push_back('\0');
+      key.append(piece.piece());
+    }
+  }
+  return key;
+}
+
+// Returns the name of `filename` without the directory and the extension.
+std::string FileLabel(absl::string_view filename) {
+  if (filename.empty()) return "stdin";
+  const size_t slash = filename.find_last_of('/');
+  if (slash != absl::string_view::npos) filename.remove_prefix(slash + 1);
+  const size_t dot = filename.find('.');
+  if (dot != 0 && dot != absl::string_view::npos) {
+    filename = filename.substr(0, dot);
+  }
+  return std::string(filename);
+}
+
+int64 NumChars(absl::string_view text) {
+  int64 chars = 0;
+  for (const char c : text) chars += (c & 0xC0) != 0x80;
+  return chars;
+}
+
+double Seconds(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+std::string FormatStats(const std::string &model, const std::string &language,
+                        const Stats &stats) {
+  auto per = [](int64 n, int64 d) {
+    return d == 0 ? 0.0 : static_cast<double>(n) / d;
+  };
+  return absl::StrCat(
+      model, "\t", language, "\t", stats.sentences, "\t", stats.bytes, "\t",
+      stats.chars, "\t", stats.tokens, "\t",
+      absl::StrFormat("%.4f\t%.3f\t%.6f\t%.6f\t",
+                      per(stats.tokens, stats.bytes),
+                      per(stats.bytes, stats.tokens),
+                      per(stats.unknowns, stats.tokens),
+                      per(stats.byte_fallbacks, stats.tokens)),
+      stats.repeat_runs, "\t",
+      absl::StrFormat("%.6f\t%.2f", per(stats.repeat_markers, stats.tokens),
+                      stats.seconds == 0.0
+                          ? 0.0
+                          : stats.bytes / stats.seconds / 1e6));
+}
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  using sentencepiece::Clock;
+  using sentencepiece::Stats;
+
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+  std::vector<std::string> rest_args;
+
+  if (absl::GetFlag(FLAGS_input).empty()) {
+    for (int i = 1; i < argc; ++i) {
+      rest_args.push_back(std::string(argv[i]));
+    }
+  } else {
+    const std::vector<std::string> inputs =
+        absl::StrSplit(absl::GetFlag(FLAGS_input), ",");
+    rest_args = inputs;
+  }
+
+  if (rest_args.empty())
+    rest_args.push_back("");  // empty means that reading from stdin.
+
+  CHECK(!absl::GetFlag(FLAGS_model).empty());
+
+  const bool language_tab = absl::GetFlag(FLAGS_language_tab);
+
+  // Loads the models and groups them by normalizer. The charsmaps of equal
+  // specs are shared by the normalizers anyway.
+  std::vector<std::unique_ptr<sentencepiece::Model>> models;
+  std::vector<sentencepiece::NormalizerGroup> groups;
+  std::map<std::string, size_t> group_index;
+  const std::vector<std::string> model_files =
+      absl::StrSplit(absl::GetFlag(FLAGS_model), ",");
+  for (const auto &filename : model_files) {
+    auto model = absl::make_unique<sentencepiece::Model>();
+    model->name = filename;
+    CHECK_OK(model->sp.Load(filename));
+    model->start_repeat = model->sp.PieceToId("(#startrepeat)");
+    model->end_repeat = model->sp.PieceToId("(#endrepeat)");
+    model->is_repeat_count.resize(model->sp.GetPieceSize());
+    for (int id = 0; id < model->sp.GetPieceSize(); ++id) {
+      const std::string &piece = model->sp.IdToPiece(id);
+      model->is_repeat_count[id] = piece.size() > 6 &&
+                                   piece.compare(0, 5, "<rep:") == 0 &&
+                                   piece.back() == '>';
+    }
+
+    const auto &model_proto = model->sp.model_proto();
+    const auto it = group_index.emplace(
+        sentencepiece::NormalizerKey(model_proto), groups.size());
+    if (it.second) {
+      groups.emplace_back();
+      auto &group = groups.back();
+      std::set<absl::string_view> user_defined_symbols;
+      for (const auto &piece : model_proto.pieces()) {
+        if (piece.type() ==
+            sentencepiece::ModelProto::SentencePiece::USER_DEFINED) {
+          user_defined_symbols.insert(piece.piece());
+        }
+      }
+      group.matcher =
+          absl::make_unique<sentencepiece::normalizer::PrefixMatcher>(
+              user_defined_symbols);
+      group.normalizer =
+          absl::make_unique<sentencepiece::normalizer::Normalizer>(
+              model_proto.normalizer_spec(), model_proto.trainer_spec());
+      group.normalizer->SetPrefixMatcher(group.matcher.get());
+    }
+    groups[it.first->second].models.push_back(models.size());
+    models.push_back(std::move(model));
+  }
+
+  auto output = sentencepiece::filesystem::NewWritableFile(
+      absl::GetFlag(FLAGS_output));
+  CHECK_OK(output->status());
+
+  // Every batch holds lines of one input file and counts them by model and
+  // language. write() adds the counts to `totals` in the input order.
+  struct Batch {
+    std::vector<std::string> lines;
+    std::vector<std::string> languages;  // of `lines` with --language_tab.
+    std::string label;
+    std::vector<std::map<std::string, Stats>> stats;  // by model.
+
+    void Clear() {
+      lines.clear();
+      languages.clear();
+      stats.clear();
+    }
+
+    // Buffers reused for the lines of the batch.
+    std::vector<absl::string_view> inputs;
+    std::vector<std::string> normalized;
+    std::vector<double> normalize_seconds;
+    std::vector<int> ids;
+  };
+
+  auto process = [&models, &groups](Batch *batch) {
+    batch->inputs.assign(batch->lines.begin(), batch->lines.end());
+    const auto &inputs = batch->inputs;
+    batch->stats.resize(models.size());
+    std::vector<Stats *> stats(inputs.size());
+
+    for (const auto &group : groups) {
+      // Models with a normalizer of their own encode as usual, so that their
+      // throughput is that of EncodeIds().
+      const bool shared = group.models.size() > 1;
+      if (shared) {
+        batch->normalized.resize(inputs.size());
+        batch->normalize_seconds.resize(inputs.size());
+        for (size_t i = 0; i < inputs.size(); ++i) {
+          const auto begin = Clock::now();
+          CHECK_OK(group.normalizer->Normalize(
+              inputs[i], &batch->normalized[i], nullptr));
+          batch->normalize_seconds[i] =
+              sentencepiece::Seconds(begin, Clock::now());
+        }
+      }
+
+      for (const int m : group.models) {
+        const auto &model = *models[m];
+        for (size_t i = 0; i < inputs.size(); ++i) {
+          const std::string &language =
+              i < batch->languages.size() && !batch->languages[i].empty()
+                  ? batch->languages[i]
+                  : batch->label;
+          Stats *s = &batch->stats[m][language];
+          const auto begin = Clock::now();
+          if (shared) {
+            CHECK_OK(model.sp.EncodePreNormalized(batch->normalized[i],
+                                                  &batch->ids));
+            s->seconds += batch->normalize_seconds[i];
+          } else {
+            CHECK_OK(model.sp.EncodeIds(inputs[i], &batch->ids));
+          }
+          s->seconds += sentencepiece::Seconds(begin, Clock::now());
+          ++s->sentences;
+          s->bytes += inputs[i].size();
+          s->chars += sentencepiece::NumChars(inputs[i]);
+          model.Count(batch->ids, s);
+        }
+      }
+    }
+  };
+
+  std::vector<std::map<std::string, Stats>> totals(models.size());
+  auto write = [&totals](Batch *batch) {
+    for (size_t m = 0; m < batch->stats.size(); ++m) {
+      for (const auto &it : batch->stats[m]) totals[m][it.first].Add(it.second);
+    }
+  };
+
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  CHECK_GE(num_threads, 1);
+  const size_t batch_size =
+      static_cast<size_t>(std::max(1, absl::GetFlag(FLAGS_batch_size)));
+
+  sentencepiece::OrderedPipeline<Batch> pipeline(num_threads, process, write);
+  auto batch = absl::make_unique<Batch>();
+  absl::string_view line;
+  for (const auto &filename : rest_args) {
+    const std::string label = sentencepiece::FileLabel(filename);
+    auto input = sentencepiece::filesystem::NewReadableFile(filename);
+    CHECK_OK(input->status());
+    batch->label = label;
+    while (input->ReadLineView(&line)) {
+      if (language_tab) {
+        const size_t tab = line.find('\t');
+        if (tab == absl::string_view::npos) {
+          batch->languages.emplace_back();
+        } else {
+          batch->languages.emplace_back(line.substr(0, tab));
+          line.remove_prefix(tab + 1);
+        }
+      }
+      batch->lines.emplace_back(line);
+      if (batch->lines.size() == batch_size) {
+        batch = pipeline.Submit(std::move(batch));
+        batch->label = label;
+      }
+    }
+    CHECK_OK(input->status());
+    // A batch does not mix the lines of two files.
+    if (!batch->lines.empty()) batch = pipeline.Submit(std::move(batch));
+  }
+  pipeline.Finish();
+
+  output->WriteLine(
+      "model\tlanguage\tsentences\tbytes\tchars\ttokens\ttokens_per_byte\t"
+      "bytes_per_token\tunk_rate\tbyte_fallback_rate\trepeat_runs\t"
+      "repeat_marker_rate\tmb_per_sec");
+  for (size_t m = 0; m < models.size(); ++m) {
+    Stats all;
+    for (const auto &it : totals[m]) {
+      output->WriteLine(
+          sentencepiece::FormatStats(models[m]->name, it.first, it.second));
+      all.Add(it.second);
+    }
+    output->WriteLine(
+        sentencepiece::FormatStats(models[m]->name, "all", all));
+  }
+
+  return 0;
+}
@@ -0,0 +1,123 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "filesystem.h"
+#include "init.h"
+#include "sentencepiece_model.pb.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/str_cat.h"
+
+ABSL_FLAG(std::string, model, "", "input model file name");
+ABSL_FLAG(std::string, output, "", "Output C++ source file name");
+ABSL_FLAG(std::string, name, "kSentencePieceModel",
+          "name of the sentencepiece::StaticModel defined by the output. "
+          "May be qualified with a namespace, e.g., myapp::kModel.");
+ABSL_FLAG(bool, quantize_scores, false,
+          "also stores the scores of a unigram model as int16 and the piece "
+          "types in four bits, as spm_export_vocab "
+          "--output_format=precompiled --quantize_scores does.");
+
+namespace {
+
+constexpr int kBytesPerLine = 16;
+
+// Returns `s` as a C++ string literal.
+std::string Quote(absl::string_view s) {
+  std::string result = "\"";
+  for (const char c : s) {
+    if (c == '"' || c == '\\') result += '\\';
+    result += c;
+  }
+  return result + "\"";
+}
+
+}  // namespace
+
+// Writes a C++ source file defining the model of --model as a
+// sentencepiece::StaticModel, which SentencePieceProcessor::LoadStatic()
+// loads without reading a file. The data is the model in the precompiled
+// format, in a constexpr array which the linker places in read-only pages.
+int main(int argc, char *argv[]) {
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  sentencepiece::SentencePieceProcessor sp;
+  CHECK_OK(sp.Load(absl::GetFlag(FLAGS_model)));
+  std::string blob;
+  CHECK_OK(sentencepiece::io::SerializePrecompiledModel(
+      sp.model_proto(), absl::GetFlag(FLAGS_quantize_scores), &blob));
+
+  // Splits the namespaces off --name.
+  std::string name = absl::GetFlag(FLAGS_name);
+  std::vector<std::string> namespaces;
+  for (size_t pos = name.find("::"); pos != std::string::npos;
+       pos = name.find("::")) {
+    namespaces.push_back(name.substr(0, pos));
+    name = name.substr(pos + 2);
+  }
+  CHECK(!name.empty()) << "--name is empty.";
+
+  auto output =
+      sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+  CHECK_OK(output->status());
+
+  output->WriteLine(absl::StrCat("// Generated by spm_export_static from ",
+                                 absl::GetFlag(FLAGS_model),
+                                 ". Do not edit."));
+  output->WriteLine("//");
+  output->WriteLine("// Declare it with");
+  std::string declaration = absl::StrCat(
+      "extern const sentencepiece::StaticModel ", name, ";");
+  for (auto it = namespaces.rbegin(); it != namespaces.rend(); ++it) {
+    declaration = absl::StrCat("namespace ", *it, " { ", declaration, " }");
+  }
+  output->WriteLine(absl::StrCat("//   ", declaration));
+  output->WriteLine(
+      "// and load it with SentencePieceProcessor::LoadStatic().");
+  output->WriteLine("");
+  output->WriteLine("#include \"sentencepiece_processor.h\"");
+  output->WriteLine("");
+  for (const auto &ns : namespaces) {
+    output->WriteLine(absl::StrCat("namespace ", ns, " {"));
+  }
+  output->WriteLine("namespace {");
+  output->WriteLine("");
+  output->WriteLine(absl::StrCat(
+      "// ", blob.size(), " bytes. LoadStatic() uses the trie in place."));
+  output->WriteLine("alignas(8) constexpr unsigned char kData[] = {");
+  for (size_t i = 0; i < blob.size(); i += kBytesPerLine) {
+    std::string line = "   ";
+    for (size_t j = i; j < blob.size() && j < i + kBytesPerLine; ++j) {
+      line += absl::StrCat(
+          " ", static_cast<int>(static_cast<unsigned char>(blob[j])), ",");
+    }
+    output->WriteLine(line);
+  }
+  output->WriteLine("};");
+  output->WriteLine("");
+  output->WriteLine("}  // namespace");
+  output->WriteLine("");
+  output->WriteLine(absl::StrCat(
+      "extern const sentencepiece::StaticModel ", name, " = {",
+      Quote(absl::GetFlag(FLAGS_model)), ", kData, sizeof(kData)};"));
+  for (auto it = namespaces.rbegin(); it != namespaces.rend(); ++it) {
+    output->WriteLine(absl::StrCat("}  // namespace ", *it));
+  }
+
+  return 0;
+}
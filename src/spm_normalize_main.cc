@@ -12,16 +12,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "builder.h"
 #include "common.h"
 #include "filesystem.h"
 #include "init.h"
 #include "normalizer.h"
+#include "ordered_pipeline.h"
 #include "sentencepiece.pb.h"
 #include "sentencepiece_model.pb.h"
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/flags/flag.h"
+#include "third_party/absl/memory/memory.h"
 
 ABSL_FLAG(std::string, model, "", "Model file name");
 ABSL_FLAG(bool, use_internal_normalization, false,
@@ -37,6 +44,12 @@ ABSL_FLAG(bool, decompile, false,
           "Decompile compiled charamap and output it as TSV.");
 ABSL_FLAG(std::string, input, "", "Input filename");
 ABSL_FLAG(std::string, output, "", "Output filename");
+ABSL_FLAG(int32, num_threads, 1,
+          "Number of threads for normalization. The output keeps the input "
+          "order.");
+ABSL_FLAG(int32, batch_size, 1000,
+          "Number of lines normalized at once by a thread if --num_threads > "
+          "1.");
 
 using sentencepiece::ModelProto;
 using sentencepiece::NormalizerSpec;
@@ -92,21 +105,60 @@ int main(int argc, char *argv[]) {
   } else {
     const Normalizer normalizer(spec);
     auto output =
-        sentencepiece::filesystem::NewWritableFile(absl::GetFlag(FLAGS_output));
+        sentencepiece::filesystem::NewBufferedWritableFile(
+            absl::GetFlag(FLAGS_output));
     CHECK_OK(output->status());
 
     if (rest_args.empty()) {
       rest_args.push_back("");  // empty means that read from stdin.
     }
 
-    std::string line;
+    struct Batch {
+      std::vector<std::string> lines;
+      std::string output;
+      void Clear() {
+        lines.clear();
+        output.clear();
+      }
+    };
+
+    const int num_threads = absl::GetFlag(FLAGS_num_threads);
+    CHECK_GE(num_threads, 1);
+    // Without threads, every line is written as soon as it is normalized.
+    const size_t batch_size =
+        num_threads > 1
+            ? static_cast<size_t>(std::max(1, absl::GetFlag(FLAGS_batch_size)))
+            : 1;
+
+    auto normalize = [&normalizer](Batch *batch) {
+      for (const auto &line : batch->lines) {
+        batch->output.append(normalizer.Normalize(line));
+        batch->output.push_back('\n');
+      }
+    };
+
+    auto write = [&output](Batch *batch) {
+      CHECK(output->Write(batch->output));
+    };
+
+    sentencepiece::OrderedPipeline<Batch> pipeline(num_threads, normalize,
+                                                   write);
+    auto batch = absl::make_unique<Batch>();
+    absl::string_view line;
     for (const auto &filename : rest_args) {
       auto input = sentencepiece::filesystem::NewReadableFile(filename);
       CHECK_OK(input->status());
-      while (input->ReadLine(&line)) {
-        output->WriteLine(normalizer.Normalize(line));
+      while (input->ReadLineView(&line)) {
+        batch->lines.emplace_back(line.data(), line.size());
+        if (batch->lines.size() == batch_size) {
+          batch = pipeline.Submit(std::move(batch));
+        }
       }
+      CHECK_OK(input->status());
     }
+    if (!batch->lines.empty()) pipeline.Submit(std::move(batch));
+    pipeline.Finish();
+    CHECK(output->Flush());
   }
 
   return 0;
@@ -0,0 +1,434 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+// Serves batched encode and decode requests for several models over a Unix
+// domain socket, so that co-located processes share one copy of the models
+// and one thread pool.
+//
+// % spm_serve --models=en=en.model,ja=ja.model --socket=/tmp/spm.sock
+//
+// A client sends requests and reads one response per request, in order, on
+// a connection. Every integer is an unsigned little-endian uint32, and a
+// string or an id list is its size followed by its bytes or ids.
+//
+//   request:  size of the rest, op (one byte), model name, count, items
+//   response: size of the rest, status code (one byte), then either the
+//             error message or count and items
+//
+// The ops are:
+//   1 encode: the items are texts, answered with their id lists.
+//   2 decode: the items are id lists, answered with their texts.
+//   3 stats:  no model and items, answered with one text of "name value"
+//             lines holding the encoder counters and the server counters.
+//   4 models: no model and items, answered with the model names.
+// The status codes are those of util::StatusCode.
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "init.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/flags/flag.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_split.h"
+#include "util.h"
+
+ABSL_FLAG(std::string, models, "",
+          "Comma separated name=filename pairs of the models to serve. "
+          "Precompiled models are memory-mapped.");
+ABSL_FLAG(std::string, socket, "/tmp/spm_serve.sock",
+          "Path of the Unix domain socket to listen on. An existing socket "
+          "there is replaced, any other file is left alone.");
+ABSL_FLAG(std::string, socket_mode, "0600",
+          "Octal permissions of the socket. Every process allowed to connect "
+          "can use the models and the threads of the server.");
+ABSL_FLAG(int32, max_connections, 64,
+          "Connections served at once. Further ones are closed as soon as "
+          "they are accepted.");
+ABSL_FLAG(int32, num_threads, 4,
+          "Number of persistent threads encoding and decoding the batches.");
+ABSL_FLAG(int32, max_request_bytes, 64 << 20, "Largest accepted request.");
+ABSL_FLAG(int32, max_response_bytes, 256 << 20,
+          "Largest decode response. Larger ones fail with kOutOfRange.");
+ABSL_FLAG(int32, decode_max_expansion, 1 << 20,
+          "Pieces the repeat runs of one decoded id list may expand into. "
+          "See SentencePieceProcessor::SetDecodeMaxExpansion().");
+
+namespace sentencepiece {
+namespace {
+
+enum Op { kEncode = 1, kDecode = 2, kStats = 3, kModels = 4 };
+
+// Inputs of a batch handed to one thread of the pool at once.
+constexpr int64 kChunkSize = 16;
+
+bool ReadFull(int fd, char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t n = read(fd, data, size);
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool WriteFull(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+void AppendUint32(uint32 value, std::string *output) {
+  for (int i = 0; i < 4; ++i) {
+    output->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+void AppendString(absl::string_view value, std::string *output) {
+  AppendUint32(value.size(), output);
+  output->append(value.data(), value.size());
+}
+
+// Reads the fields of a request, pointing into it.
+class Reader {
+ public:
+  explicit Reader(absl::string_view data) : data_(data) {}
+
+  bool ReadUint32(uint32 *value) {
+    if (data_.size() < 4) return false;
+    *value = 0;
+    for (int i = 0; i < 4; ++i) {
+      *value |= static_cast<uint32>(static_cast<unsigned char>(data_[i]))
+                << (8 * i);
+    }
+    data_.remove_prefix(4);
+    return true;
+  }
+
+  bool ReadString(absl::string_view *value) {
+    uint32 size = 0;
+    if (!ReadUint32(&size) || data_.size() < size) return false;
+    *value = data_.substr(0, size);
+    data_.remove_prefix(size);
+    return true;
+  }
+
+  bool ReadIds(std::vector<int> *ids) {
+    uint32 size = 0;
+    if (!ReadUint32(&size) || data_.size() / 4 < size) return false;
+    ids->resize(size);
+    for (uint32 i = 0; i < size; ++i) {
+      uint32 id = 0;
+      ReadUint32(&id);
+      (*ids)[i] = static_cast<int>(id);
+    }
+    return true;
+  }
+
+  size_t remaining() const { return data_.size(); }
+
+ private:
+  absl::string_view data_;
+};
+
+class Server {
+ public:
+  Server(std::map<std::string, std::unique_ptr<SentencePieceProcessor>> models,
+         int num_threads)
+      : models_(std::move(models)), pool_(num_threads) {}
+
+  // Counts a new connection, unless `max_connections` are already open.
+  bool AddConnection(uint64 max_connections) {
+    uint64 n = num_connections_;
+    do {
+      if (n >= max_connections) {
+        ++num_refused_;
+        return false;
+      }
+    } while (!num_connections_.compare_exchange_weak(n, n + 1));
+    return true;
+  }
+
+  // Serves the requests of the connection `fd`, counted by AddConnection(),
+  // until it is closed.
+  void Serve(int fd) {
+    const uint32 max_size = absl::GetFlag(FLAGS_max_request_bytes);
+    std::string request, response;
+    for (;;) {
+      char header[4];
+      if (!ReadFull(fd, header, sizeof(header))) break;
+      uint32 size = 0;
+      Reader(absl::string_view(header, sizeof(header))).ReadUint32(&size);
+      if (size > max_size) {
+        LOG(WARNING) << "Closes a connection sending " << size << " bytes.";
+        break;
+      }
+      request.resize(size);
+      if (!ReadFull(fd, &request[0], size)) break;
+
+      response.assign(4, '\0');
+      const auto status = Process(request, &response);
+      if (!status.ok()) {
+        ++num_errors_;
+        response.resize(4);
+        response.push_back(static_cast<char>(status.code()));
+        response.append(status.error_message());
+      }
+      const std::string size_bytes = Size(response.size() - 4);
+      response.replace(0, 4, size_bytes);
+      if (!WriteFull(fd, response.data(), response.size())) break;
+      ++num_requests_;
+    }
+    close(fd);
+    --num_connections_;
+  }
+
+ private:
+  static std::string Size(size_t size) {
+    std::string bytes;
+    AppendUint32(size, &bytes);
+    return bytes;
+  }
+
+  // Appends the status code and the items answering `request` to `response`.
+  util::Status Process(absl::string_view request, std::string *response) {
+    CHECK_OR_RETURN(!request.empty()) << "Empty request.";
+    const int op = static_cast<unsigned char>(request[0]);
+    Reader reader(request.substr(1));
+
+    if (op == kStats || op == kModels) {
+      response->push_back(static_cast<char>(util::StatusCode::kOk));
+      if (op == kModels) {
+        AppendUint32(models_.size(), response);
+        for (const auto &it : models_) AppendString(it.first, response);
+      } else {
+        AppendUint32(1, response);
+        AppendString(Stats(), response);
+      }
+      return util::OkStatus();
+    }
+
+    absl::string_view name;
+    uint32 count = 0;
+    CHECK_OR_RETURN(reader.ReadString(&name) && reader.ReadUint32(&count))
+        << "Malformed request.";
+    // Every item takes at least its 4 size bytes, so a larger count must not
+    // size the vectors below.
+    CHECK_OR_RETURN(count <= reader.remaining() / 4) << "Malformed request.";
+    const auto it = models_.find(std::string(name));
+    if (it == models_.end()) {
+      return util::NotFoundError(absl::StrCat("Unknown model: ", name));
+    }
+    const SentencePieceProcessor &sp = *it->second;
+
+    if (op == kEncode) {
+      std::vector<absl::string_view> inputs(count);
+      for (auto &input : inputs) {
+        CHECK_OR_RETURN(reader.ReadString(&input)) << "Malformed request.";
+      }
+      CHECK_EQ_OR_RETURN(0, reader.remaining()) << "Malformed request.";
+      std::vector<std::vector<int>> ids(count);
+      std::vector<util::Status> status(count);
+      pool_.ParallelFor(count, kChunkSize, [&](int64 begin, int64 end) {
+#ifdef SPM_NO_THREADLOCAL
+        EncodeWorkspace workspace;
+#else
+        // The workers of the pool persist, so that their buffers are reused
+        // across the chunks and the requests.
+        thread_local static EncodeWorkspace workspace;
+#endif
+        for (int64 i = begin; i < end; ++i) {
+          status[i] = sp.EncodeIds(inputs[i], &ids[i], &workspace);
+        }
+      });
+      for (const auto &s : status) RETURN_IF_ERROR(s);
+      response->push_back(static_cast<char>(util::StatusCode::kOk));
+      AppendUint32(count, response);
+      for (const auto &v : ids) {
+        AppendUint32(v.size(), response);
+        for (const int id : v) AppendUint32(id, response);
+      }
+      return util::OkStatus();
+    }
+
+    if (op == kDecode) {
+      std::vector<std::vector<int>> ids(count);
+      for (auto &v : ids) {
+        CHECK_OR_RETURN(reader.ReadIds(&v)) << "Malformed request.";
+      }
+      CHECK_EQ_OR_RETURN(0, reader.remaining()) << "Malformed request.";
+      std::vector<std::string> texts(count);
+      std::vector<util::Status> status(count);
+      // Every id list may expand into --decode_max_expansion pieces, so the
+      // remaining lists are skipped once the texts exceed the limit.
+      const uint64 max_bytes = absl::GetFlag(FLAGS_max_response_bytes);
+      std::atomic<uint64> num_bytes{0};
+      pool_.ParallelFor(count, kChunkSize, [&](int64 begin, int64 end) {
+        for (int64 i = begin; i < end && num_bytes <= max_bytes; ++i) {
+          status[i] = sp.Decode(ids[i], &texts[i]);
+          num_bytes += texts[i].size();
+        }
+      });
+      if (num_bytes > max_bytes) {
+        return util::OutOfRangeError(
+            absl::StrCat("The texts exceed --max_response_bytes=", max_bytes));
+      }
+      for (const auto &s : status) RETURN_IF_ERROR(s);
+      response->push_back(static_cast<char>(util::StatusCode::kOk));
+      AppendUint32(count, response);
+      for (const auto &text : texts) AppendString(text, response);
+      return util::OkStatus();
+    }
+
+    return util::InvalidArgumentError(absl::StrCat("Unknown op: ", op));
+  }
+
+  std::string Stats() const {
+    const EncodeStats stats = SentencePieceProcessor::GetStats();
+    std::string output;
+    auto add = [&output](absl::string_view name, uint64 value) {
+      output += absl::StrCat(name, " ", value, "\n");
+    };
+    add("connections", num_connections_);
+    add("refused_connections", num_refused_);
+    add("requests", num_requests_);
+    add("errors", num_errors_);
+    add("stats_enabled", stats.enabled);
+    add("num_calls", stats.num_calls);
+    add("normalize_ns", stats.normalize_ns);
+    add("case_encode_ns", stats.case_encode_ns);
+    add("model_encode_ns", stats.model_encode_ns);
+    add("rle_ns", stats.rle_ns);
+    add("proto_ns", stats.proto_ns);
+    add("bytes_in", stats.bytes_in);
+    add("bytes_out", stats.bytes_out);
+    add("tokens_out", stats.tokens_out);
+    add("lattice_nodes", stats.lattice_nodes);
+    add("cache_hits", stats.cache_hits);
+    add("cache_misses", stats.cache_misses);
+    add("sample_pruned_mass_ppb", stats.sample_pruned_mass_ppb);
+    return output;
+  }
+
+  const std::map<std::string, std::unique_ptr<SentencePieceProcessor>>
+      models_;
+  ThreadPool pool_;
+  std::atomic<uint64> num_connections_{0};
+  std::atomic<uint64> num_refused_{0};
+  std::atomic<uint64> num_requests_{0};
+  std::atomic<uint64> num_errors_{0};
+};
+
+}  // namespace
+}  // namespace sentencepiece
+
+int main(int argc, char *argv[]) {
+  sentencepiece::ParseCommandLineFlags(argv[0], &argc, &argv, true);
+
+  CHECK(!absl::GetFlag(FLAGS_models).empty());
+  std::map<std::string, std::unique_ptr<sentencepiece::SentencePieceProcessor>>
+      models;
+  for (const auto &entry : absl::StrSplit(absl::GetFlag(FLAGS_models), ",")) {
+    const std::vector<std::string> fields = absl::StrSplit(entry, "=");
+    CHECK_EQ(2, fields.size()) << "Expected name=filename: " << entry;
+    std::unique_ptr<sentencepiece::SentencePieceProcessor> sp(
+        new sentencepiece::SentencePieceProcessor);
+    CHECK_OK(sp->Load(fields[1]));
+    CHECK_OK(
+        sp->SetDecodeMaxExpansion(absl::GetFlag(FLAGS_decode_max_expansion)));
+    CHECK(models.emplace(fields[0], std::move(sp)).second)
+        << "Duplicated model name: " << fields[0];
+  }
+
+  const std::string &path = absl::GetFlag(FLAGS_socket);
+  const std::string &mode_flag = absl::GetFlag(FLAGS_socket_mode);
+  char *mode_end = nullptr;
+  const long mode = strtol(mode_flag.c_str(), &mode_end, 8);
+  CHECK(!mode_flag.empty() && *mode_end == '\0' && mode >= 0 && mode <= 0777)
+      << "Invalid --socket_mode: " << mode_flag;
+  const int32 max_connections = absl::GetFlag(FLAGS_max_connections);
+  CHECK_GT(max_connections, 0);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  CHECK_LT(path.size(), sizeof(address.sun_path)) << "Too long: " << path;
+  memcpy(address.sun_path, path.data(), path.size());
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK_GE(listener, 0) << sentencepiece::util::StrError(errno);
+  // Only a stale socket of a previous server is removed, never a file the
+  // path names by mistake.
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    CHECK(S_ISSOCK(st.st_mode)) << path << " exists and is not a socket.";
+    CHECK_EQ(0, unlink(path.c_str()))
+        << path << ": " << sentencepiece::util::StrError(errno);
+  }
+  // The socket is created private, so that no other user can connect before
+  // its permissions are set.
+  const mode_t umask_before = umask(0177);
+  const int bound =
+      bind(listener, reinterpret_cast<struct sockaddr *>(&address),
+           sizeof(address));
+  const int bind_errno = errno;
+  umask(umask_before);
+  CHECK_EQ(0, bound) << path << ": "
+                     << sentencepiece::util::StrError(bind_errno);
+  CHECK_EQ(0, chmod(path.c_str(), static_cast<mode_t>(mode)))
+      << path << ": " << sentencepiece::util::StrError(errno);
+  CHECK_EQ(0, listen(listener, SOMAXCONN))
+      << sentencepiece::util::StrError(errno);
+
+  sentencepiece::Server server(std::move(models),
+                               absl::GetFlag(FLAGS_num_threads));
+  LOG(INFO) << "Serving on " << path;
+
+  // Every connection has its own thread, which waits for the requests and
+  // hands their batches to the pool.
+  for (;;) {
+    const int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      LOG(ERROR) << sentencepiece::util::StrError(errno);
+      break;
+    }
+    if (!server.AddConnection(max_connections)) {
+      LOG(WARNING) << "Refuses a connection over --max_connections="
+                   << max_connections;
+      close(fd);
+      continue;
+    }
+    std::thread([&server, fd]() { server.Serve(fd); }).detach();
+  }
+
+  close(listener);
+  return 0;
+}
@@ -13,12 +13,15 @@
 // limitations under the License.!
 
 #include <map>
+#include <memory>
 
 #include "filesystem.h"
 #include "init.h"
 #include "sentencepiece_model.pb.h"
 #include "sentencepiece_trainer.h"
+#include "shard_reducer.h"
 #include "third_party/absl/flags/flag.h"
+#include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/ascii.h"
 #include "third_party/absl/strings/str_join.h"
 #include "third_party/absl/strings/str_split.h"
@@ -40,6 +43,10 @@ ABSL_FLAG(std::string, model_type, "unigram",
           "model algorithm: unigram, bpe, word or char");
 ABSL_FLAG(int32, vocab_size, kDefaultTrainerSpec.vocab_size(),
           "vocabulary size");
+ABSL_FLAG(std::string, vocab_sizes, "",
+          "comma separated list of vocabulary sizes. A unigram or bpe model "
+          "of every size is saved as <model_prefix>.<size>.model from a "
+          "single training. Overrides --vocab_size.");
 ABSL_FLAG(std::string, accept_language, "",
           "comma-separated list of languages this model can accept");
 ABSL_FLAG(int32, self_test_sample_size,
@@ -140,6 +147,65 @@ ABSL_FLAG(std::string, unk_surface, kDefaultTrainerSpec.unk_surface(),
 ABSL_FLAG(bool, train_extremely_large_corpus,
           kDefaultTrainerSpec.train_extremely_large_corpus(),
           "Increase bit depth for unigram tokenization.");
+ABSL_FLAG(int32, corpus_memory_budget_mb,
+          kDefaultTrainerSpec.corpus_memory_budget_mb(),
+          "If > 0, counts words while loading the corpus and spills the "
+          "counts to disk beyond this memory budget in MB.");
+ABSL_FLAG(bool, seed_from_unique_words,
+          kDefaultTrainerSpec.seed_from_unique_words(),
+          "Extract unigram seed pieces from the unique words weighted by "
+          "frequency.");
+ABSL_FLAG(std::string, checkpoint_dir, "",
+          "Directory to write training checkpoints to.");
+ABSL_FLAG(bool, resume, kDefaultTrainerSpec.resume(),
+          "Resume training from the checkpoints in --checkpoint_dir.");
+ABSL_FLAG(std::string, profile_output, "",
+          "Write per-phase training timings to this file as JSON lines.");
+ABSL_FLAG(bool, seek_sampling, kDefaultTrainerSpec.seek_sampling(),
+          "Sample --input_sentence_size lines at random file offsets "
+          "instead of reading the whole corpus.");
+ABSL_FLAG(std::string, corpus_cache, "",
+          "Cache of the normalized sentences, reused by the trainings with "
+          "the same input and normalization.");
+ABSL_FLAG(int32, em_batch_size, kDefaultTrainerSpec.em_batch_size(),
+          "If > 0, runs the unigram EM sub-iterations on mini-batches of "
+          "this many sentences.");
+ABSL_FLAG(double, em_tolerance, kDefaultTrainerSpec.em_tolerance(),
+          "Stops a mini-batch EM round when the relative change of the "
+          "objective is below this value.");
+ABSL_FLAG(std::string, init_model, "",
+          "Continue the training from this model of the same model type.");
+ABSL_FLAG(std::string, candidate_models, "",
+          "Comma separated unigram models trained on parts of the corpus, "
+          "e.g., one per language. Their pieces are merged and pruned on "
+          "--input instead of seeding from it.");
+ABSL_FLAG(bool, compact_repeat_counts,
+          kDefaultTrainerSpec.compact_repeat_counts(),
+          "Reserves the count pieces <rep:N>, with which a run of repeated "
+          "pieces is encoded as the piece and mostly one count piece.");
+ABSL_FLAG(int32, max_memory_mb, kDefaultTrainerSpec.max_memory_mb(),
+          "If > 0, samples the input and sizes the suffix array so that the "
+          "estimated peak memory of the training fits in this many MB.");
+ABSL_FLAG(bool, dedup_input_sentences,
+          kDefaultTrainerSpec.dedup_input_sentences(),
+          "Merges the duplicate input lines as they are read, so that each "
+          "unique line is normalized once.");
+ABSL_FLAG(int32, prune_incremental_rounds,
+          kDefaultTrainerSpec.prune_incremental_rounds(),
+          "If > 1, the unigram pruning reuses the Viterbi paths of the last "
+          "round and segments all sentences only every this many rounds.");
+ABSL_FLAG(double, prune_score_margin, kDefaultTrainerSpec.prune_score_margin(),
+          "A reused Viterbi path whose score moved by more than this since it "
+          "was found is segmented again.");
+ABSL_FLAG(int32, num_shards, 1,
+          "Number of processes that train a unigram model together, each "
+          "on its own shard of the corpus.");
+ABSL_FLAG(int32, shard_id, 0,
+          "Shard of this process in [0, num_shards). Shard 0 saves the "
+          "model.");
+ABSL_FLAG(std::string, shard_sync_prefix, "",
+          "Path prefix of the files on storage shared by all shards to "
+          "exchange the statistics through. Unique to each job.");
 ABSL_FLAG(int32, random_seed, -1, "Seed value for random generator.");
 
 int main(int argc, char *argv[]) {
@@ -197,6 +263,13 @@ int main(int argc, char *argv[]) {
   SetTrainerSpecFromFlag(input_format);
   SetTrainerSpecFromFlag(model_prefix);
   SetTrainerSpecFromFlag(vocab_size);
+  for (const auto &v :
+       sentencepiece::util::StrSplitAsCSV(absl::GetFlag(FLAGS_vocab_sizes))) {
+    int32 size = 0;
+    CHECK(sentencepiece::string_util::lexical_cast(v, &size))
+        << "cannot parse \"" << v << "\" as int.";
+    trainer_spec.add_vocab_sizes(size);
+  }
   SetTrainerSpecFromFlag(self_test_sample_size);
   SetTrainerSpecFromFlag(character_coverage);
   SetTrainerSpecFromFlag(input_sentence_size);
@@ -231,6 +304,22 @@ int main(int argc, char *argv[]) {
   SetRepeatedTrainerSpecFromFlag(control_symbols);
   SetRepeatedTrainerSpecFromFlag(user_defined_symbols);
   SetTrainerSpecFromFlag(train_extremely_large_corpus);
+  SetTrainerSpecFromFlag(corpus_memory_budget_mb);
+  SetTrainerSpecFromFlag(seed_from_unique_words);
+  SetTrainerSpecFromFlag(checkpoint_dir);
+  SetTrainerSpecFromFlag(resume);
+  SetTrainerSpecFromFlag(profile_output);
+  SetTrainerSpecFromFlag(seek_sampling);
+  SetTrainerSpecFromFlag(corpus_cache);
+  SetTrainerSpecFromFlag(em_batch_size);
+  SetTrainerSpecFromFlag(em_tolerance);
+  SetTrainerSpecFromFlag(init_model);
+  SetRepeatedTrainerSpecFromFlag(candidate_models);
+  SetTrainerSpecFromFlag(compact_repeat_counts);
+  SetTrainerSpecFromFlag(max_memory_mb);
+  SetTrainerSpecFromFlag(dedup_input_sentences);
+  SetTrainerSpecFromFlag(prune_incremental_rounds);
+  SetTrainerSpecFromFlag(prune_score_margin);
 
   SetRepeatedTrainerSpecFromFile(control_symbols);
   SetRepeatedTrainerSpecFromFile(user_defined_symbols);
@@ -254,6 +343,16 @@ int main(int argc, char *argv[]) {
   CHECK_OK(sentencepiece::SentencePieceTrainer::PopulateModelTypeFromString(
       absl::GetFlag(FLAGS_model_type), &trainer_spec));
 
+  std::unique_ptr<sentencepiece::FileShardReducer> shard_reducer;
+  if (absl::GetFlag(FLAGS_num_shards) > 1) {
+    CHECK(!absl::GetFlag(FLAGS_shard_sync_prefix).empty());
+    shard_reducer = absl::make_unique<sentencepiece::FileShardReducer>(
+        absl::GetFlag(FLAGS_shard_sync_prefix), absl::GetFlag(FLAGS_shard_id),
+        absl::GetFlag(FLAGS_num_shards));
+    CHECK_OK(sentencepiece::SentencePieceTrainer::SetShardReducerForTraining(
+        shard_reducer.get()));
+  }
+
   CHECK_OK(sentencepiece::SentencePieceTrainer::Train(
       trainer_spec, normalizer_spec, denormalizer_spec));
 
@@ -20,6 +20,7 @@
 #include <sstream>
 #include <string>
 
+#include "allocation_counter.h"
 #include "common.h"
 #include "init.h"
 #include "third_party/absl/flags/flag.h"
@@ -138,6 +139,20 @@ class Tester {
     sentencepiece::error::SetTestCounter(0); \
   };
 
+// Expects that the statement makes no heap allocation in the calling thread,
+// e.g., EXPECT_NO_ALLOCATIONS({ sp.EncodeIds(text, &ids, &workspace); }).
+// Passes trivially when test::AllocationCounterEnabled() is false.
+#define EXPECT_NO_ALLOCATIONS(...)                                           \
+  do {                                                                       \
+    const uint64 spm_allocations_begin =                                     \
+        sentencepiece::test::NumThreadAllocations();                         \
+    __VA_ARGS__;                                                             \
+    const uint64 spm_allocations =                                           \
+        sentencepiece::test::NumThreadAllocations() - spm_allocations_begin; \
+    EXPECT_EQ(spm_allocations, static_cast<uint64>(0))                       \
+        << "in " #__VA_ARGS__;                                               \
+  } while (0)
+
 #define ASSERT_TRUE EXPECT_TRUE
 #define ASSERT_FALSE EXPECT_FALSE
 #define ASSERT_STREQ EXPECT_STREQ
@@ -149,6 +164,7 @@ class Tester {
 #define ASSERT_LT EXPECT_LT
 #define ASSERT_NEAR EXPECT_NEAR
 #define ASSERT_NOT_OK EXPECT_NOT_OK
+#define ASSERT_NO_ALLOCATIONS EXPECT_NO_ALLOCATIONS
 #define ASSERT_DEATH ASSERT_DEATH
 
 template <typename T>
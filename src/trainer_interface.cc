@@ -12,26 +12,41 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "filesystem.h"
+#include "memory_plan.h"
 #include "model_factory.h"
 #include "model_interface.h"
 #include "normalizer.h"
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/numbers.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_format.h"
 #include "third_party/absl/strings/str_join.h"
 #include "third_party/absl/strings/str_split.h"
+#include "third_party/absl/strings/strip.h"
 #include "trainer_interface.h"
 #include "unicode_script.h"
 #include "util.h"
@@ -63,7 +78,7 @@ util::Status VerifySpec(const TrainerSpec &trainer_spec) {
   CHECK_RANGE(trainer_spec.character_coverage(), 0.98, 1.0);
   CHECK_RANGE(trainer_spec.max_sentencepiece_length(), 1, 512);
   CHECK_RANGE(trainer_spec.num_sub_iterations(), 1, 10);
-  CHECK_RANGE(trainer_spec.num_threads(), 1, 128);
+  CHECK_RANGE(trainer_spec.num_threads(), 1, 1024);
   CHECK_RANGE(trainer_spec.self_test_sample_size(), 0, 1000);
   CHECK_RANGE(trainer_spec.shrinking_factor(), 0.5, 0.95);
   CHECK_RANGE(trainer_spec.max_sentence_length(), 10, 1073741824);
@@ -71,17 +86,56 @@ util::Status VerifySpec(const TrainerSpec &trainer_spec) {
 
   CHECK_OR_RETURN(trainer_spec.input_sentence_size() <= 0 ||
                   trainer_spec.input_sentence_size() > 100);
+  CHECK_OR_RETURN(trainer_spec.em_batch_size() >= 0);
+  CHECK_OR_RETURN(trainer_spec.em_tolerance() >= 0.0);
+  CHECK_OR_RETURN(trainer_spec.max_memory_mb() >= 0);
+  CHECK_OR_RETURN(trainer_spec.prune_incremental_rounds() >= 0);
+  CHECK_OR_RETURN(trainer_spec.prune_score_margin() >= 0.0);
 
   CHECK_OR_RETURN(!trainer_spec.unk_piece().empty());
   CHECK_OR_RETURN(!trainer_spec.bos_piece().empty());
   CHECK_OR_RETURN(!trainer_spec.eos_piece().empty());
   CHECK_OR_RETURN(!trainer_spec.pad_piece().empty());
 
+  CHECK_OR_RETURN(trainer_spec.corpus_memory_budget_mb() <= 0 ||
+                  trainer_spec.split_by_whitespace())
+      << "--corpus_memory_budget_mb requires --split_by_whitespace=true.";
+  CHECK_OR_RETURN(!trainer_spec.seed_from_unique_words() ||
+                  trainer_spec.split_by_whitespace())
+      << "--seed_from_unique_words requires --split_by_whitespace=true.";
+  CHECK_OR_RETURN(!trainer_spec.resume() ||
+                  !trainer_spec.checkpoint_dir().empty())
+      << "--resume requires --checkpoint_dir.";
+  CHECK_OR_RETURN(!trainer_spec.seek_sampling() ||
+                  trainer_spec.input_sentence_size() > 0)
+      << "--seek_sampling requires --input_sentence_size.";
+  CHECK_OR_RETURN(trainer_spec.init_model().empty() ||
+                  trainer_spec.model_type() == TrainerSpec::UNIGRAM ||
+                  trainer_spec.model_type() == TrainerSpec::BPE)
+      << "--init_model is only supported in UNIGRAM and BPE mode.";
+  CHECK_OR_RETURN(trainer_spec.candidate_models().empty() ||
+                  trainer_spec.model_type() == TrainerSpec::UNIGRAM)
+      << "--candidate_models is only supported in UNIGRAM mode.";
+
+  if (trainer_spec.vocab_sizes_size() > 0) {
+    CHECK_OR_RETURN(trainer_spec.model_type() == TrainerSpec::UNIGRAM ||
+                    trainer_spec.model_type() == TrainerSpec::BPE)
+        << "--vocab_sizes is only supported in UNIGRAM and BPE mode.";
+    for (const int32 vocab_size : trainer_spec.vocab_sizes()) {
+      CHECK_GT_OR_RETURN(vocab_size, 0);
+    }
+  }
+
   if (SentencePieceTrainer::GetPretokenizerForTraining()) {
     CHECK_EQ_OR_RETURN(TrainerSpec::UNIGRAM, trainer_spec.model_type())
         << "PretokenizerForTraining is only supported in UNIGRAM mode.";
   }
 
+  if (SentencePieceTrainer::GetShardReducerForTraining()) {
+    CHECK_EQ_OR_RETURN(TrainerSpec::UNIGRAM, trainer_spec.model_type())
+        << "ShardReducerForTraining is only supported in UNIGRAM mode.";
+  }
+
   return util::OkStatus();
 }
 
@@ -98,7 +152,7 @@ class SentenceSelector {
       if (spec_->shuffle_input_sentence()) {
         constexpr size_t kSeed = 12345678;
         sampler_ = absl::make_unique<Sampler>(
-            sentences, spec_->input_sentence_size(), kSeed);
+            &sampled_, spec_->input_sentence_size(), kSeed);
       } else {
         LOG(INFO)
             << "First " << spec_->input_sentence_size()
@@ -107,7 +161,17 @@ class SentenceSelector {
     }
   }
 
-  void Finish() const {
+  // Moves the sampled sentences into the store.
+  void Finish() {
+    if (sampler_) {
+      size_t bytes = 0;
+      for (const auto &it : sampled_) bytes += it.first.size();
+      sentences_->reserve(sampled_.size(), bytes);
+      for (const auto &it : sampled_) {
+        sentences_->emplace_back(it.first, it.second);
+      }
+      std::vector<TrainerInterface::Sentence>().swap(sampled_);
+    }
     if (sentences_->size() > kTooBigSentencesSize) {
       LOG(WARNING) << "Too many sentences are loaded! (" << sentences_->size()
                    << "), which may slow down training.";
@@ -121,12 +185,12 @@ class SentenceSelector {
 
   bool Add(const std::pair<std::string, int64> &sentence) {
     if (spec_->input_sentence_size() <= 0) {
-      sentences_->emplace_back(sentence);
+      sentences_->emplace_back(sentence.first, sentence.second);
     } else {
       if (spec_->shuffle_input_sentence()) {
         sampler_->Add(sentence);
       } else {
-        sentences_->emplace_back(sentence);
+        sentences_->emplace_back(sentence.first, sentence.second);
         if (sentences_->size() >=
             static_cast<size_t>(spec_->input_sentence_size()))
           return false;
@@ -147,44 +211,657 @@ class SentenceSelector {
  private:
   TrainerInterface::Sentences *sentences_ = nullptr;
   const TrainerSpec *spec_ = nullptr;
+  std::vector<TrainerInterface::Sentence> sampled_;
   std::unique_ptr<Sampler> sampler_;
 };
+
+// Escapes '\\' and '\n' so that a word fits in one line of a shard file.
+std::string EscapeWord(absl::string_view word) {
+  if (word.find_first_of("\\\n") == absl::string_view::npos) {
+    return std::string(word);
+  }
+  std::string escaped;
+  for (const char c : word) {
+    if (c == '\\') {
+      escaped += "\\\\";
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+std::string UnescapeWord(absl::string_view escaped) {
+  std::string word;
+  for (size_t i = 0; i < escaped.size(); ++i) {
+    if (escaped[i] == '\\' && i + 1 < escaped.size()) {
+      word += escaped[++i] == 'n' ? '\n' : escaped[i];
+    } else {
+      word += escaped[i];
+    }
+  }
+  return word;
+}
+
+// Counts the whitespace-delimited words of the sentences while they are
+// loaded, so that the corpus does not have to be kept in memory.
+// Sentences are normalized in batches, and the word counts are spilled to a
+// shard file sorted by word whenever they exceed the memory budget.
+// Finish() merges the shards with a k-way merge.
+class WordCounter {
+ public:
+  using NormalizeFunc = std::function<std::string(absl::string_view)>;
+
+  WordCounter(const TrainerSpec &spec, NormalizeFunc normalize,
+              ThreadPool *pool, absl::string_view shard_prefix)
+      : treat_ws_as_suffix_(spec.treat_whitespace_as_suffix()),
+        num_shards_(std::max(1, spec.num_threads())),
+        budget_(static_cast<size_t>(spec.corpus_memory_budget_mb()) << 20),
+        normalize_(std::move(normalize)),
+        pool_(pool),
+        shard_prefix_(shard_prefix),
+        counts_(num_shards_) {}
+
+  ~WordCounter() {
+    for (const auto &filename : shard_files_) std::remove(filename.c_str());
+  }
+
+  util::Status Add(std::string sentence, int64 freq) {
+    batch_bytes_ += sentence.size() + kEntryOverhead;
+    batch_.emplace_back(std::move(sentence), freq);
+    ++num_sentences_;
+    // A quarter of the budget is used for the batch.
+    return 4 * batch_bytes_ < budget_ ? util::OkStatus() : Flush();
+  }
+
+  // Stores all unique words sorted by word into |words|.
+  util::Status Finish(TrainerInterface::Sentences *words) {
+    RETURN_IF_ERROR(Flush());
+    words->clear();
+    if (shard_files_.empty()) {
+      for (const auto *entry : SortedEntries()) {
+        words->emplace_back(entry->first, entry->second);
+      }
+      return util::OkStatus();
+    }
+    RETURN_IF_ERROR(Spill());
+
+    LOG(INFO) << "Merging " << shard_files_.size() << " word count shards";
+    std::vector<ShardReader> readers(shard_files_.size());
+    std::vector<size_t> agenda;
+    for (size_t i = 0; i < shard_files_.size(); ++i) {
+      readers[i].fp = filesystem::NewReadableFile(shard_files_[i], true);
+      RETURN_IF_ERROR(readers[i].fp->status());
+      if (readers[i].Next()) agenda.push_back(i);
+      RETURN_IF_ERROR(readers[i].status);
+    }
+
+    // The same heap ops as std::priority_queue, with the smallest word on
+    // top.
+    auto greater = [&readers](size_t a, size_t b) {
+      return readers[a].word > readers[b].word;
+    };
+    std::make_heap(agenda.begin(), agenda.end(), greater);
+    while (!agenda.empty()) {
+      std::pop_heap(agenda.begin(), agenda.end(), greater);
+      auto &reader = readers[agenda.back()];
+      if (!words->empty() && words->back().first == reader.word) {
+        *words->mutable_freq(words->size() - 1) += reader.count;
+      } else {
+        words->emplace_back(reader.word, reader.count);
+      }
+      if (reader.Next()) {
+        std::push_heap(agenda.begin(), agenda.end(), greater);
+      } else {
+        agenda.pop_back();
+      }
+      RETURN_IF_ERROR(reader.status);
+    }
+
+    return util::OkStatus();
+  }
+
+  int64 num_sentences() const { return num_sentences_; }
+
+ private:
+  using WordCounts = absl::flat_hash_map<std::string, int64>;
+  using Entry = std::pair<const std::string, int64>;
+
+  // Approximate memory used by a hash map entry in addition to the word.
+  static constexpr size_t kEntryOverhead =
+      sizeof(Entry) + 2 * sizeof(void *);
+
+  struct ShardReader {
+    std::unique_ptr<filesystem::ReadableFile> fp;
+    util::Status status;
+    std::string word;
+    int64 count = 0;
+
+    // Reads the next "count <tab> word" line.
+    bool Next() {
+      std::string line;
+      if (!fp->ReadLine(&line)) return false;
+      const size_t pos = line.find('\t');
+      if (pos == std::string::npos ||
+          !absl::SimpleAtoi(absl::string_view(line).substr(0, pos), &count)) {
+        status = util::InternalError("Broken word count shard.");
+        return false;
+      }
+      word = UnescapeWord(absl::string_view(line).substr(pos + 1));
+      return true;
+    }
+  };
+
+  std::vector<const Entry *> SortedEntries() const {
+    std::vector<const Entry *> entries;
+    for (const auto &counts : counts_) {
+      for (const auto &it : counts) entries.push_back(&it);
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry *a, const Entry *b) { return a->first < b->first; });
+    return entries;
+  }
+
+  // Normalizes the batch and adds its words to |counts_|. Each thread
+  // normalizes a stripe of the batch and partitions its words by hash, and
+  // then each partition is counted by one thread.
+  util::Status Flush() {
+    if (batch_.empty()) return util::OkStatus();
+
+    using Words = std::vector<std::pair<absl::string_view, int64>>;
+    std::vector<std::vector<Words>> words(num_shards_,
+                                          std::vector<Words>(num_shards_));
+    std::vector<char> has_space(num_shards_, false);
+    const string_util::string_view_hash hasher;
+    for (int n = 0; n < num_shards_; ++n) {
+      pool_->Schedule([&, n]() {
+        for (size_t i = n; i < batch_.size(); i += num_shards_) {
+          auto &sentence = batch_[i];
+          sentence.first = normalize_(sentence.first);
+          if (sentence.first.find(" ") != std::string::npos) {
+            has_space[n] = true;
+            continue;
+          }
+          for (const auto &w :
+               SplitIntoWords(sentence.first, treat_ws_as_suffix_)) {
+            if (w.empty()) continue;
+            words[n][hasher(w) % num_shards_].emplace_back(w, sentence.second);
+          }
+        }
+      });
+    }
+    pool_->Wait();
+    for (const char c : has_space) {
+      CHECK_OR_RETURN(!c) << "Normalized string must not include spaces";
+    }
+
+    std::vector<size_t> bytes(num_shards_, 0);
+    for (int shard = 0; shard < num_shards_; ++shard) {
+      pool_->Schedule([&, shard]() {
+        auto &counts = counts_[shard];
+        for (int n = 0; n < num_shards_; ++n) {
+          for (const auto &w : words[n][shard]) {
+            const auto it = counts.emplace(std::string(w.first), 0);
+            if (it.second) bytes[shard] += w.first.size() + kEntryOverhead;
+            it.first->second += w.second;
+          }
+        }
+      });
+    }
+    pool_->Wait();
+
+    for (const size_t b : bytes) bytes_ += b;
+    batch_.clear();
+    batch_bytes_ = 0;
+
+    // Keeps the counts and the next batch within the budget.
+    return 4 * bytes_ < 3 * budget_ ? util::OkStatus() : Spill();
+  }
+
+  // Writes |counts_| sorted by word to a new shard file.
+  util::Status Spill() {
+    const std::string filename =
+        absl::StrCat(shard_prefix_, ".", shard_files_.size());
+    LOG(INFO) << "Spilling " << bytes_ << " bytes of word counts to "
+              << filename;
+    shard_files_.push_back(filename);
+    {
+      auto output = filesystem::NewWritableFile(filename, true);
+      RETURN_IF_ERROR(output->status());
+      for (const auto *entry : SortedEntries()) {
+        CHECK_OR_RETURN(output->WriteLine(
+            absl::StrCat(std::to_string(entry->second), "\t",
+                         EscapeWord(entry->first))));
+      }
+    }
+    for (auto &counts : counts_) WordCounts().swap(counts);
+    bytes_ = 0;
+    return util::OkStatus();
+  }
+
+  const bool treat_ws_as_suffix_;
+  const int num_shards_;
+  const size_t budget_;
+  const NormalizeFunc normalize_;
+  ThreadPool *pool_ = nullptr;
+  const std::string shard_prefix_;
+
+  std::vector<TrainerInterface::Sentence> batch_;
+  size_t batch_bytes_ = 0;
+  int64 num_sentences_ = 0;
+
+  // Word counts partitioned by the hash of the word.
+  std::vector<WordCounts> counts_;
+  size_t bytes_ = 0;
+
+  std::vector<std::string> shard_files_;
+};
+
+// A word with its hash, which is computed once when the word is counted
+// and reused when the per-thread counts are merged.
+struct HashedWord {
+  absl::string_view word;
+  size_t hash;
+
+  bool operator==(const HashedWord &other) const {
+    return word == other.word;
+  }
+};
+
+struct HashedWordHash {
+  size_t operator()(const HashedWord &w) const { return w.hash; }
+};
+
+// The order of Sorted(): by frequency and then by the word.
+bool SentenceLess(const std::pair<absl::string_view, int64> &p1,
+                  const std::pair<absl::string_view, int64> &p2) {
+  return p1.second > p2.second ||
+         (p1.second == p2.second && p1.first < p2.first);
+}
 }  // namespace
 
+class MultiFileSentenceIterator::Reader {
+ public:
+  Reader(const std::vector<std::string> *files, size_t first, size_t step)
+      : files_(files), first_(first), step_(step) {
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  ~Reader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Returns the next chunk. Blocks until it is read.
+  Chunk Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !queue_.empty(); });
+    Chunk chunk = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    cv_.notify_all();
+    return chunk;
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 1024;
+  static constexpr size_t kMaxQueueSize = 8;
+
+  // Returns false if the iterator is destroyed.
+  bool Push(Chunk chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return stop_ || queue_.size() < kMaxQueueSize; });
+    if (stop_) return false;
+    queue_.push_back(std::move(chunk));
+    lock.unlock();
+    cv_.notify_all();
+    return true;
+  }
+
+  void Run() {
+    for (size_t i = first_; i < files_->size(); i += step_) {
+      auto fp = filesystem::NewReadableFile((*files_)[i]);
+      Chunk chunk;
+      absl::string_view line;
+      while (fp->status().ok() && fp->ReadLineView(&line)) {
+        chunk.lines.emplace_back(line);
+        if (chunk.lines.size() == kChunkSize) {
+          if (!Push(std::move(chunk))) return;
+          chunk = Chunk();
+        }
+      }
+      chunk.eof = true;
+      chunk.status = fp->status();
+      // The iteration stops at the first broken file.
+      const bool ok = chunk.status.ok();
+      if (!Push(std::move(chunk)) || !ok) return;
+    }
+  }
+
+  const std::vector<std::string> *files_ = nullptr;
+  const size_t first_ = 0;
+  const size_t step_ = 1;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Chunk> queue_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
 MultiFileSentenceIterator::MultiFileSentenceIterator(
-    const std::vector<std::string> &files)
+    const std::vector<std::string> &files, int num_threads)
     : files_(files) {
+  if (files_.empty()) {
+    done_ = true;
+    status_ = util::InternalError("No input files.");
+    return;
+  }
+  const size_t num_readers =
+      std::min(files_.size(), static_cast<size_t>(std::max(1, num_threads)));
+  for (size_t i = 0; i < num_readers; ++i) {
+    readers_.emplace_back(absl::make_unique<Reader>(&files_, i, num_readers));
+  }
+  LOG(INFO) << "Loading corpus: " << files_[0];
   Next();
 }
 
-bool MultiFileSentenceIterator::done() const {
-  return (!read_done_ && file_index_ == files_.size());
-}
+MultiFileSentenceIterator::~MultiFileSentenceIterator() {}
 
-util::Status MultiFileSentenceIterator::status() const {
-  CHECK_OR_RETURN(fp_);
-  return fp_->status();
-}
+bool MultiFileSentenceIterator::done() const { return done_; }
+
+util::Status MultiFileSentenceIterator::status() const { return status_; }
 
 void MultiFileSentenceIterator::Next() {
-  TryRead();
-
-  if (!read_done_ && file_index_ < files_.size()) {
-    const auto &filename = files_[file_index_++];
-    fp_ = filesystem::NewReadableFile(filename);
-    LOG(INFO) << "Loading corpus: " << filename;
-    if (fp_->status() != util::OkStatus()) {
-      file_index_ = files_.size();
-      read_done_ = false;
+  while (!done_) {
+    if (line_index_ < chunk_.lines.size()) {
+      value_.swap(chunk_.lines[line_index_++]);
       return;
     }
+    if (chunk_.eof) {
+      status_ = chunk_.status;
+      if (!status_.ok() || ++file_index_ == files_.size()) {
+        done_ = true;
+        return;
+      }
+      LOG(INFO) << "Loading corpus: " << files_[file_index_];
+    }
+    chunk_ = readers_[file_index_ % readers_.size()]->Pop();
+    line_index_ = 0;
+  }
+}
+
+namespace {
+// A line picked by SampledFileSentenceIterator.
+struct SampledLine {
+  size_t file = 0;
+  uint64 start = 0;  // offset of the line in the file.
+  std::string line;
+};
+
+bool SampledLineLess(const SampledLine &l1, const SampledLine &l2) {
+  return l1.file < l2.file || (l1.file == l2.file && l1.start < l2.start);
+}
+
+bool SampledLineEqual(const SampledLine &l1, const SampledLine &l2) {
+  return l1.file == l2.file && l1.start == l2.start;
+}
+}  // namespace
 
-    TryRead();
+SampledFileSentenceIterator::SampledFileSentenceIterator(
+    const std::vector<std::string> &files, size_t sample_size,
+    int num_threads, uint64 seed) {
+  status_ = Sample(files, sample_size, num_threads, seed);
+  if (!status_.ok()) {
+    done_ = true;
+    return;
   }
+  Next();
 }
 
-void MultiFileSentenceIterator::TryRead() {
-  read_done_ = fp_ && fp_->ReadLine(&value_);
+SampledFileSentenceIterator::~SampledFileSentenceIterator() {}
+
+bool SampledFileSentenceIterator::done() const { return done_; }
+
+util::Status SampledFileSentenceIterator::status() const { return status_; }
+
+void SampledFileSentenceIterator::Next() {
+  if (index_ == lines_.size()) {
+    done_ = true;
+    return;
+  }
+  value_.swap(lines_[index_++]);
+}
+
+util::Status SampledFileSentenceIterator::Sample(
+    const std::vector<std::string> &files, size_t sample_size,
+    int num_threads, uint64 seed) {
+  CHECK_OR_RETURN(!files.empty()) << "No input files.";
+
+  // begins[i] is the offset of files[i] in the concatenated files.
+  std::vector<uint64> begins(files.size() + 1, 0);
+  for (size_t i = 0; i < files.size(); ++i) {
+    std::ifstream is(WPATH(files[i].c_str()), std::ios::binary | std::ios::in);
+    if (!is) {
+      return util::StatusBuilder(util::StatusCode::kNotFound, GTL_LOC)
+             << "\"" << files[i] << "\": " << util::StrError(errno);
+    }
+    char magic[4] = {};
+    is.read(magic, sizeof(magic));
+    const bool compressed =
+        (is.gcount() >= 2 && std::memcmp(magic, "\x1f\x8b", 2) == 0) ||
+        (is.gcount() == 4 && std::memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0);
+    CHECK_OR_RETURN(!compressed)
+        << "\"" << files[i]
+        << "\" is compressed, which is not supported by --seek_sampling.";
+    is.clear();
+    is.seekg(0, std::ios::end);
+    begins[i + 1] = begins[i] + static_cast<uint64>(is.tellg());
+  }
+  const uint64 total_size = begins.back();
+  if (total_size == 0) return util::OkStatus();
+
+  // Reads the line picked by |offset| from |is|, which holds |file|.
+  auto read_line = [&begins](size_t file, uint64 offset, std::ifstream *is,
+                             SampledLine *sampled) {
+    const uint64 file_size = begins[file + 1] - begins[file];
+    uint64 start = 0;
+    if (offset > 0) {
+      is->clear();
+      is->seekg(offset - 1);
+      is->ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+      if (!is->eof()) start = static_cast<uint64>(is->tellg());
+      if (start >= file_size) start = 0;
+    }
+    is->clear();
+    is->seekg(start);
+    sampled->file = file;
+    sampled->start = start;
+    std::getline(*is, sampled->line);
+    return !is->bad();
+  };
+
+  std::mt19937_64 engine(seed);
+  std::uniform_int_distribution<uint64> dist(0, total_size - 1);
+  std::vector<SampledLine> sampled;
+
+  // Draws the offsets again for the lines picked twice.
+  constexpr int kMaxRounds = 4;
+  for (int round = 0; round < kMaxRounds && sampled.size() < sample_size;
+       ++round) {
+    std::vector<uint64> offsets(sample_size - sampled.size());
+    for (auto &offset : offsets) offset = dist(engine);
+    std::sort(offsets.begin(), offsets.end());
+
+    // Every thread reads a contiguous range of the sorted offsets, so that
+    // it only seeks forward in the files.
+    const size_t num_ranges =
+        std::min(offsets.size(), static_cast<size_t>(std::max(1, num_threads)));
+    std::vector<SampledLine> lines(offsets.size());
+    std::vector<util::Status> statuses(num_ranges);
+    auto read_range = [&](size_t n) {
+      std::ifstream is;
+      size_t opened = files.size();
+      for (size_t i = offsets.size() * n / num_ranges;
+           i < offsets.size() * (n + 1) / num_ranges; ++i) {
+        // The last file beginning at or before the offset, which skips the
+        // empty files.
+        const size_t file =
+            std::upper_bound(begins.begin(), begins.end(), offsets[i]) -
+            begins.begin() - 1;
+        if (file != opened) {
+          is.close();
+          is.clear();
+          is.open(WPATH(files[file].c_str()), std::ios::binary | std::ios::in);
+          opened = file;
+        }
+        if (!is || !read_line(file, offsets[i] - begins[file], &is, &lines[i])) {
+          statuses[n] = util::StatusBuilder(util::StatusCode::kDataLoss,
+                                            GTL_LOC)
+                        << "Failed to read \"" << files[file] << "\".";
+          return;
+        }
+      }
+    };
+    if (num_ranges <= 1) {
+      read_range(0);
+    } else {
+      ThreadPool pool(num_ranges);
+      for (size_t n = 0; n < num_ranges; ++n) {
+        pool.Schedule([&read_range, n]() { read_range(n); });
+      }
+      pool.Wait();
+    }
+    for (const auto &status : statuses) RETURN_IF_ERROR(status);
+
+    const size_t prev_size = sampled.size();
+    std::move(lines.begin(), lines.end(), std::back_inserter(sampled));
+    std::sort(sampled.begin(), sampled.end(), SampledLineLess);
+    sampled.erase(
+        std::unique(sampled.begin(), sampled.end(), SampledLineEqual),
+        sampled.end());
+    // No new line is found when the files have few lines.
+    if (sampled.size() == prev_size) break;
+  }
+
+  LOG(INFO) << "Sampled " << sampled.size() << " lines from " << total_size
+            << " bytes of " << files.size() << " files.";
+  lines_.reserve(sampled.size());
+  for (auto &line : sampled) lines_.push_back(std::move(line.line));
+  return util::OkStatus();
+}
+
+namespace {
+constexpr absl::string_view kCheckpointMagic("spm_ckpt\x01", 9);
+constexpr size_t kCheckpointBufferSize = 1 << 20;
+}  // namespace
+
+CheckpointWriter::CheckpointWriter(absl::string_view filename)
+    : filename_(filename),
+      tmp_filename_(absl::StrCat(filename, ".tmp")),
+      output_(filesystem::NewWritableFile(tmp_filename_, true)),
+      buffer_(kCheckpointMagic) {}
+
+CheckpointWriter::~CheckpointWriter() {
+  if (output_ != nullptr) {
+    output_.reset();
+    std::remove(tmp_filename_.c_str());
+  }
+}
+
+void CheckpointWriter::PutUInt64(uint64 value) {
+  for (int i = 0; i < 8; ++i) {
+    buffer_.push_back(static_cast<char>(value & 0xFF));
+    value >>= 8;
+  }
+  if (buffer_.size() >= kCheckpointBufferSize) Flush().IgnoreError();
+}
+
+void CheckpointWriter::PutFloat(float value) {
+  uint32 bits = 0;
+  static_assert(sizeof(bits) == sizeof(value), "");
+  memcpy(&bits, &value, sizeof(bits));
+  PutUInt64(bits);
+}
+
+void CheckpointWriter::PutString(absl::string_view value) {
+  PutUInt64(value.size());
+  buffer_.append(value.data(), value.size());
+  if (buffer_.size() >= kCheckpointBufferSize) Flush().IgnoreError();
+}
+
+util::Status CheckpointWriter::Flush() {
+  RETURN_IF_ERROR(status());
+  if (ok_ && !buffer_.empty()) ok_ = output_->Write(buffer_);
+  buffer_.clear();
+  CHECK_OR_RETURN(ok_) << "Failed to write " << tmp_filename_;
+  return util::OkStatus();
+}
+
+util::Status CheckpointWriter::Close() {
+  CHECK_OR_RETURN(output_ != nullptr);
+  RETURN_IF_ERROR(Flush());
+  output_.reset();
+#ifdef OS_WIN
+  std::remove(filename_.c_str());
+#endif
+  if (std::rename(tmp_filename_.c_str(), filename_.c_str()) != 0) {
+    std::remove(tmp_filename_.c_str());
+    return util::StatusBuilder(util::StatusCode::kInternal, GTL_LOC)
+           << "Failed to rename " << tmp_filename_ << " to " << filename_;
+  }
+  return util::OkStatus();
+}
+
+CheckpointReader::CheckpointReader(absl::string_view filename)
+    : input_(filesystem::NewReadableFile(filename, true)),
+      status_(input_->status()) {
+  if (!status_.ok()) return;
+  if (!input_->ReadAllView(&data_) ||
+      !absl::ConsumePrefix(&data_, kCheckpointMagic)) {
+    data_ = absl::string_view();
+    status_ = util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+              << "\"" << filename << "\" is not a checkpoint.";
+  }
+}
+
+bool CheckpointReader::GetUInt64(uint64 *value) {
+  if (data_.size() < 8) return false;
+  *value = 0;
+  for (int i = 7; i >= 0; --i) {
+    *value = (*value << 8) | static_cast<uint8>(data_[i]);
+  }
+  data_.remove_prefix(8);
+  return true;
+}
+
+bool CheckpointReader::GetFloat(float *value) {
+  uint64 bits = 0;
+  if (!GetUInt64(&bits) || bits > 0xFFFFFFFF) return false;
+  const uint32 bits32 = static_cast<uint32>(bits);
+  memcpy(value, &bits32, sizeof(bits32));
+  return true;
+}
+
+bool CheckpointReader::GetString(std::string *value) {
+  absl::string_view view;
+  if (!GetStringView(&view)) return false;
+  value->assign(view.data(), view.size());
+  return true;
+}
+
+bool CheckpointReader::GetStringView(absl::string_view *value) {
+  uint64 size = 0;
+  if (!GetUInt64(&size) || size > data_.size()) return false;
+  *value = data_.substr(0, size);
+  data_.remove_prefix(size);
+  return true;
 }
 
 TrainerInterface::TrainerInterface(const TrainerSpec &trainer_spec,
@@ -193,12 +870,35 @@ TrainerInterface::TrainerInterface(const TrainerSpec &trainer_spec,
     : trainer_spec_(trainer_spec),
       normalizer_spec_(normalizer_spec),
       denormalizer_spec_(denormalizer_spec) {
+  // The training runs up to the largest of the vocab_sizes.
+  if (trainer_spec_.vocab_sizes_size() > 0) {
+    trainer_spec_.set_vocab_size(*std::max_element(
+        trainer_spec_.vocab_sizes().begin(), trainer_spec_.vocab_sizes().end()));
+  }
   status_ = VerifySpec(trainer_spec_);
   if (status_.ok()) status_ = InitMetaPieces();
 }
 
 TrainerInterface::~TrainerInterface() {}
 
+ThreadPool *TrainerInterface::pool() const {
+  if (pool_ == nullptr) {
+    // The workers of a training spanning several sockets stay on their NUMA
+    // node, and allocate the per-thread statistics there.
+    pool_ = absl::make_unique<ThreadPool>(trainer_spec_.num_threads(),
+                                          /*numa_aware=*/true);
+  }
+  return pool_.get();
+}
+
+TrainerProfiler *TrainerInterface::profiler() const {
+  if (profiler_ == nullptr) {
+    profiler_ = absl::make_unique<TrainerProfiler>(
+        trainer_spec_.profile_output());
+  }
+  return profiler_.get();
+}
+
 bool TrainerInterface::IsValidSentencePiece(
     const string_util::UnicodeText &sentencepiece) const {
   // Returns false if the length of piece is invalid.
@@ -207,35 +907,63 @@ bool TrainerInterface::IsValidSentencePiece(
           static_cast<size_t>(trainer_spec_.max_sentencepiece_length())) {
     return false;
   }
+  std::vector<CharAttributes> attributes(sentencepiece.size());
+  for (size_t pos = 0; pos < sentencepiece.size(); ++pos) {
+    attributes[pos] = GetCharAttributes(sentencepiece[pos]);
+  }
+  return IsValidSentencePiece(attributes.data(), attributes.size());
+}
 
-  constexpr unicode_script::ScriptType kAnyType =
-      static_cast<unicode_script::ScriptType>(-1);
+TrainerInterface::CharAttributes TrainerInterface::GetCharAttributes(
+    char32 c) const {
+  CharAttributes attributes = {CharAttributes::kAnyScript, 0};
+  // UNK must not be included. NULL is not allowed for Darts (TRIE).
+  // kUPPBoundaryChar is included when split_by_upp_for_training is true.
+  if (c == kUNKChar || c == 0x0000 || c == kUPPBoundaryChar ||
+      !string_util::IsValidCodepoint(c)) {
+    attributes.flags |= CharAttributes::kInvalid;
+  }
+  if (c == 0x0020) attributes.flags |= CharAttributes::kSpace;
+  if (c == kWSChar) {
+    attributes.flags |= CharAttributes::kWhitespace;
+    return attributes;
+  }
 
-  auto is_number = [](char32 c) { return (c >= 0x30 && c <= 0x39); };
+  const bool is_number = c >= 0x30 && c <= 0x39;
+  if (is_number) attributes.flags |= CharAttributes::kDigit;
+  auto s = unicode_script::GetScript(c);
+  // Merge Hiragana/Katakana into Han.
+  if (s == unicode_script::U_Hiragana || s == unicode_script::U_Katakana ||
+      c == 0x30FC) {  // long vowel sound (Katakana) should be Katakana
+    s = unicode_script::U_Han;
+  }
+  // Digits join any script unless split_by_number is true.
+  if (trainer_spec_.split_by_number() || !is_number) {
+    attributes.script = static_cast<uint8>(s);
+  }
+  return attributes;
+}
 
-  unicode_script::ScriptType prev_script = kAnyType;
+bool TrainerInterface::IsValidSentencePiece(const CharAttributes *piece,
+                                            size_t size) const {
+  // Returns false if the length of piece is invalid.
+  if (size == 0 ||
+      size > static_cast<size_t>(trainer_spec_.max_sentencepiece_length())) {
+    return false;
+  }
 
-  for (size_t pos = 0; pos < sentencepiece.size(); ++pos) {
-    const char32 c = sentencepiece[pos];
-    if (c == kUNKChar) {  // UNK must not be included
-      return false;
-    }
-    if (c == 0x0000) {  // NULL is not allowed for Darts (TRIE).
-      return false;
-    }
-    // kUPPBoundaryChar is included when split_by_upp_for_training is true.
-    if (c == kUPPBoundaryChar) {
-      return false;
-    }
-    if (c == 0x0020) {
+  constexpr uint8 kAnyType = CharAttributes::kAnyScript;
+  uint8 prev_script = kAnyType;
+
+  for (size_t pos = 0; pos < size; ++pos) {
+    const CharAttributes &c = piece[pos];
+    if (c.flags & CharAttributes::kInvalid) return false;
+    if (c.flags & CharAttributes::kSpace) {
       LOG(WARNING) << "space must not be included in normalized string.";
       return false;
     }
-    if (!string_util::IsValidCodepoint(c)) {
-      return false;
-    }
 
-    if (c == kWSChar) {
+    if (c.flags & CharAttributes::kWhitespace) {
       // Only allows whitespace to appear as a prefix of piece.
       // When split_by_whitespace is false, we allow whitespaces to
       // appear in the middle, "foo_bar", but do not allow them
@@ -244,44 +972,31 @@ bool TrainerInterface::IsValidSentencePiece(
       // whitespace is treated as a prefix/infix of symbol or
       // independent symbol.
       if (trainer_spec_.treat_whitespace_as_suffix()) {
-        if ((trainer_spec_.split_by_whitespace() &&
-             pos < sentencepiece.size() - 1) ||
-            (!trainer_spec_.split_by_whitespace() &&
-             pos < sentencepiece.size() - 1 && pos == 0)) {
+        if ((trainer_spec_.split_by_whitespace() && pos < size - 1) ||
+            (!trainer_spec_.split_by_whitespace() && pos < size - 1 &&
+             pos == 0)) {
           return false;
         }
       } else {
         if ((trainer_spec_.split_by_whitespace() && pos > 0) ||
             (!trainer_spec_.split_by_whitespace() && pos > 0 &&
-             pos == sentencepiece.size() - 1)) {
+             pos == size - 1)) {
           return false;
         }
       }
     } else {
-      auto s = unicode_script::GetScript(c);
-
-      // Merge Hiragana/Katakana into Han.
-      if (s == unicode_script::U_Hiragana || s == unicode_script::U_Katakana ||
-          c == 0x30FC) {  // long vowel sound (Katakana) should be Katakana
-        s = unicode_script::U_Han;
-      }
-
-      if (!trainer_spec_.split_by_number() && is_number(c)) {
-        s = kAnyType;
-      }
-
-      if (trainer_spec_.split_digits() && is_number(c)) {
-        if (sentencepiece.size() > 1) return false;
+      if (trainer_spec_.split_digits() && (c.flags & CharAttributes::kDigit)) {
+        if (size > 1) return false;
       }
 
       // Do not allow a piece to include multiple Unicode scripts
       // when split_by_unicode_script() is true (default = true).
-      if (trainer_spec_.split_by_unicode_script() && s != kAnyType &&
-          prev_script != kAnyType && prev_script != s) {
+      if (trainer_spec_.split_by_unicode_script() && c.script != kAnyType &&
+          prev_script != kAnyType && prev_script != c.script) {
         return false;
       }
 
-      prev_script = s;
+      prev_script = c.script;
     }
   }
   return true;
@@ -307,6 +1022,162 @@ util::Status TrainerInterface::LoadSentences() {
       (output_model_proto_ == nullptr && !trainer_spec_.model_prefix().empty()))
       << "ModelProto and trainer_spec.model_prefix() must be exclusive.";
 
+  CHECK_OR_RETURN(trainer_spec_.corpus_cache().empty() ||
+                  sentence_iterator_ == nullptr)
+      << "--corpus_cache requires trainer_spec.input().";
+
+  RETURN_IF_ERROR(profiler()->status());
+
+  if (trainer_spec_.max_memory_mb() > 0) {
+    RETURN_IF_ERROR(PlanMemory());
+  }
+
+  if (HasCheckpoint("corpus")) {
+    TrainerProfiler::Phase phase(profiler(), "load_corpus_checkpoint");
+    RETURN_IF_ERROR(LoadCorpusCheckpoint());
+    phase.set_sentences(sentences_.size());
+    return util::OkStatus();
+  }
+
+  CharCounts char_counts;
+  int64 all_chars_count = 0;
+  const bool use_cache = !trainer_spec_.corpus_cache().empty();
+  if (!use_cache || !LoadCorpusCache(&char_counts, &all_chars_count)) {
+    RETURN_IF_ERROR(ReadSentences(&char_counts, &all_chars_count));
+    if (use_cache) {
+      RETURN_IF_ERROR(SaveCorpusCache(char_counts, all_chars_count));
+    }
+  }
+  RETURN_IF_ERROR(SelectRequiredChars(char_counts, all_chars_count));
+
+  if (!trainer_spec_.checkpoint_dir().empty()) {
+    RETURN_IF_ERROR(SaveCorpusCheckpoint());
+  }
+
+  return util::OkStatus();
+}
+
+util::Status TrainerInterface::PlanMemory() {
+  // The statistics are taken from this many lines at the beginning of the
+  // files, and a sample must have at least kMinSentences sentences.
+  constexpr int64 kSampleLines = 10000;
+  constexpr int64 kMinSentences = 10000;
+
+  const std::string &input_format = trainer_spec_.input_format();
+  CHECK_OR_RETURN(sentence_iterator_ == nullptr &&
+                  (input_format.empty() || input_format == "text" ||
+                   input_format == "tsv"))
+      << "--max_memory_mb requires text or tsv input files.";
+
+  const std::vector<std::string> files(trainer_spec_.input().begin(),
+                                       trainer_spec_.input().end());
+  CorpusStats stats;
+  RETURN_IF_ERROR(EstimateCorpusStats(files, kSampleLines, &stats));
+  MemoryPlan plan;
+  RETURN_IF_ERROR(MakeMemoryPlan(trainer_spec_, stats, kMinSentences, &plan));
+  LOG(INFO) << "Memory plan for " << stats.sampled_lines << " sampled lines"
+            << " of " << stats.line_bytes << " bytes on average"
+            << (stats.lines >= 0 ? absl::StrCat(" in about ", stats.lines,
+                                                " lines")
+                                 : std::string())
+            << ": " << plan.ToString();
+  ApplyMemoryPlan(plan, &trainer_spec_);
+  return util::OkStatus();
+}
+
+util::Status TrainerInterface::ReadFrequencyLists(int *too_long_lines) {
+  // A range is about this many bytes, so that a file is parsed by many
+  // threads and the entries of a range fit in the cache.
+  constexpr size_t kRangeBytes = 1 << 22;
+  const size_t max_length = trainer_spec_.max_sentence_length();
+
+  struct Range {
+    absl::string_view data;
+    SentenceStore entries;
+    int too_long_lines = 0;
+    int64 reserved_lines = 0;
+    util::Status status;
+  };
+
+  std::vector<SentenceStore> shards;
+  int64 reserved_lines = 0;
+  for (const auto &filename : trainer_spec_.input()) {
+    auto input = filesystem::NewReadableFile(filename);
+    RETURN_IF_ERROR(input->status());
+    absl::string_view data;
+    if (!input->ReadAllView(&data)) RETURN_IF_ERROR(input->status());
+
+    std::vector<Range> ranges;
+    while (!data.empty()) {
+      size_t end = std::min(kRangeBytes, data.size());
+      end = data.find('\n', end - 1);
+      end = end == absl::string_view::npos ? data.size() : end + 1;
+      ranges.emplace_back();
+      ranges.back().data = data.substr(0, end);
+      data.remove_prefix(end);
+    }
+
+    pool()->ParallelFor(ranges.size(), 1, [&](int64 begin, int64 end) {
+      for (int64 r = begin; r < end; ++r) {
+        Range &range = ranges[r];
+        absl::string_view rest = range.data;
+        while (!rest.empty()) {
+          // Splits the lines as std::getline does.
+          const size_t eol = rest.find('\n');
+          const absl::string_view line = rest.substr(0, eol);
+          rest.remove_prefix(eol == absl::string_view::npos ? rest.size()
+                                                            : eol + 1);
+
+          const size_t tab = line.find('\t');
+          int64 freq = 0;
+          if (tab == absl::string_view::npos ||
+              line.find('\t', tab + 1) != absl::string_view::npos) {
+            range.status = util::StatusBuilder(util::StatusCode::kInternal,
+                                               GTL_LOC)
+                           << "Input format must be: word <tab> freq. "
+                           << line;
+            break;
+          }
+          if (!absl::SimpleAtoi(line.substr(tab + 1), &freq) || freq < 1) {
+            range.status = util::StatusBuilder(util::StatusCode::kInternal,
+                                               GTL_LOC)
+                           << "Could not parse the frequency: " << line;
+            break;
+          }
+
+          const absl::string_view word = line.substr(0, tab);
+          if (word.empty()) continue;
+          if (word.size() > max_length) {
+            ++range.too_long_lines;
+          } else if (word.find(kUNKStr) != absl::string_view::npos) {
+            ++range.reserved_lines;
+          } else {
+            range.entries.emplace_back(word, freq);
+          }
+        }
+      }
+    });
+
+    for (auto &range : ranges) {
+      RETURN_IF_ERROR(range.status);
+      *too_long_lines += range.too_long_lines;
+      reserved_lines += range.reserved_lines;
+      shards.push_back(SentenceStore());
+      shards.back().swap(range.entries);
+    }
+  }
+
+  sentences_.Concat(&shards, pool());
+  if (reserved_lines > 0) {
+    LOG(INFO) << "Skipped " << reserved_lines
+              << " words with reserved chars.";
+  }
+  return util::OkStatus();
+}
+
+util::Status TrainerInterface::ReadSentences(CharCounts *char_counts,
+                                             int64 *all_chars_count) {
+  TrainerProfiler::Phase load_phase(profiler(), "load_sentences");
   const bool is_tsv = trainer_spec_.input_format() == "tsv";
 
   SentenceSelector selector(&sentences_, trainer_spec_);
@@ -315,13 +1186,82 @@ util::Status TrainerInterface::LoadSentences() {
 
   int too_long_lines = 0;
 
+  const normalizer::Normalizer normalizer(normalizer_spec_, trainer_spec_);
+  std::set<absl::string_view> meta_pieces_set;
+  for (const auto &it : meta_pieces_) {
+    LOG(INFO) << "Adding meta_piece: " << it.second.first;
+    meta_pieces_set.insert(it.second.first);
+  }
+  const normalizer::PrefixMatcher meta_pieces_matcher(meta_pieces_set);
+  auto normalize = [&normalizer,
+                    &meta_pieces_matcher](absl::string_view sentence) {
+    // Replaces the meta pieces in the buffer of the normalized sentence.
+    std::string normalized = normalizer.Normalize(sentence);
+    meta_pieces_matcher.GlobalReplace(&normalized, kUPPBoundaryStr);
+    return normalized;
+  };
+
+  // Counts words while loading the sentences when the memory is bounded.
+  // A sampled corpus is already bounded by input_sentence_size.
+  std::unique_ptr<WordCounter> word_counter;
+  if (trainer_spec_.corpus_memory_budget_mb() > 0) {
+    if (trainer_spec_.input_sentence_size() > 0) {
+      LOG(INFO) << "--corpus_memory_budget_mb is ignored since sampled "
+                   "sentences are kept in memory.";
+    } else {
+      const std::string &prefix = trainer_spec_.model_prefix();
+      word_counter = absl::make_unique<WordCounter>(
+          trainer_spec_, normalize, pool(),
+          absl::StrCat(prefix.empty() ? "sentencepiece" : prefix,
+                       ".word_counts"));
+    }
+  }
+
+  // Frequency lists of the input files are parsed in parallel, straight
+  // into |sentences_|. Sampling is left to the line by line reader.
+  const bool is_frequency_list = is_tsv && sentence_iterator_ == nullptr &&
+                                 !word_counter &&
+                                 trainer_spec_.input_sentence_size() <= 0;
+
+  // Merges the duplicate lines into their first copy in |sentences_| before
+  // they are normalized. The copies are found by the hash of the line and
+  // compared, and a line that only shares the hash is loaded on its own.
+  // Sampling needs every line, and counted words are already merged.
+  bool dedup = trainer_spec_.dedup_input_sentences() && !is_frequency_list;
+  if (dedup && (word_counter || trainer_spec_.input_sentence_size() > 0)) {
+    LOG(INFO) << "--dedup_input_sentences is ignored since the sentences are "
+                 "sampled or counted.";
+    dedup = false;
+  }
+  absl::flat_hash_map<uint64, size_t> line_index;
+  int64 num_lines = 0;
+
   std::unique_ptr<SentenceIterator> sentence_iterator_impl;
+  if (is_frequency_list) {
+    LOG(INFO) << "Reading frequency lists in parallel.";
+    RETURN_IF_ERROR(ReadFrequencyLists(&too_long_lines));
+    for (const auto &w : sentences_) {
+      if (trainer_spec_.self_test_sample_size() <= 0) break;
+      test_sentence_sampler.Add(std::string(w.first));
+    }
+    goto END;
+  }
+
   if (sentence_iterator_ == nullptr) {
-    LOG(INFO) << "SentenceIterator is not specified. Using "
-                 "MultiFileSentenceIterator.";
-    sentence_iterator_impl =
-        absl::make_unique<MultiFileSentenceIterator>(std::vector<std::string>(
-            trainer_spec_.input().begin(), trainer_spec_.input().end()));
+    const std::vector<std::string> files(trainer_spec_.input().begin(),
+                                         trainer_spec_.input().end());
+    if (trainer_spec_.seek_sampling()) {
+      LOG(INFO) << "SentenceIterator is not specified. Using "
+                   "SampledFileSentenceIterator.";
+      sentence_iterator_impl = absl::make_unique<SampledFileSentenceIterator>(
+          files, trainer_spec_.input_sentence_size(),
+          trainer_spec_.num_threads());
+    } else {
+      LOG(INFO) << "SentenceIterator is not specified. Using "
+                   "MultiFileSentenceIterator.";
+      sentence_iterator_impl = absl::make_unique<MultiFileSentenceIterator>(
+          files, trainer_spec_.num_threads());
+    }
     sentence_iterator_ = sentence_iterator_impl.get();
   }
 
@@ -361,6 +1301,21 @@ util::Status TrainerInterface::LoadSentences() {
 
     test_sentence_sampler.Add(sentence);
 
+    if (word_counter) {
+      RETURN_IF_ERROR(word_counter->Add(std::move(sentence), freq));
+      continue;
+    }
+
+    if (dedup) {
+      ++num_lines;
+      const auto it = line_index.emplace(std::hash<std::string>()(sentence),
+                                         sentences_.size());
+      if (!it.second && sentences_.text(it.first->second) == sentence) {
+        *sentences_.mutable_freq(it.first->second) += freq;
+        continue;
+      }
+    }
+
     if (!selector.Add(std::make_pair(sentence, freq))) {
       goto END;
     }
@@ -369,60 +1324,99 @@ util::Status TrainerInterface::LoadSentences() {
   RETURN_IF_ERROR(sentence_iterator_->status());
 
 END:
-  // Emits error message if any.
-  selector.Finish();
-
-  if (sentences_.size() == selector.total_size()) {
-    LOG(INFO) << "Loaded all " << sentences_.size() << " sentences";
+  const bool is_counted = word_counter != nullptr;
+  if (is_counted) {
+    RETURN_IF_ERROR(word_counter->Finish(&sentences_));
+    LOG(INFO) << "Counted " << sentences_.size() << " unique words in "
+              << word_counter->num_sentences() << " sentences";
+    load_phase.set_sentences(word_counter->num_sentences());
+    word_counter.reset();
   } else {
-    LOG(INFO) << "Sampled " << sentences_.size() << " sentences from "
-              << selector.total_size() << " sentences.";
+    // Emits error message if any.
+    selector.Finish();
+
+    if (dedup) {
+      LOG(INFO) << "Loaded all " << num_lines << " sentences, of which "
+                << sentences_.size() << " are unique";
+      load_phase.set_sentences(num_lines);
+      absl::flat_hash_map<uint64, size_t>().swap(line_index);
+    } else if (sentences_.size() == selector.total_size()) {
+      LOG(INFO) << "Loaded all " << sentences_.size() << " sentences";
+    } else {
+      LOG(INFO) << "Sampled " << sentences_.size() << " sentences from "
+                << selector.total_size() << " sentences.";
+    }
+    if (!dedup) load_phase.set_sentences(selector.total_size());
   }
   if (too_long_lines > 0)
     LOG(INFO) << "Skipped " << too_long_lines << " too long sentences.";
   if (self_test_samples_.size() > 0)
     LOG(INFO) << "Loaded " << self_test_samples_.size() << " test sentences";
 
-  // Normalize and removes empty string.
-  {
-    const normalizer::Normalizer normalizer(normalizer_spec_, trainer_spec_);
-    std::set<absl::string_view> meta_pieces_set;
-    for (const auto &it : meta_pieces_) {
-      LOG(INFO) << "Adding meta_piece: " << it.second.first;
-      meta_pieces_set.insert(it.second.first);
-    }
-    const normalizer::PrefixMatcher meta_pieces_matcher(meta_pieces_set);
+  load_phase.End();
+  CHECK_OR_RETURN(!sentences_.empty());
 
-    LOG(INFO) << "Normalizing sentences...";
-    CHECK_OR_RETURN(!sentences_.empty());
-    {
-      auto pool = absl::make_unique<ThreadPool>(trainer_spec_.num_threads());
-      pool->StartWorkers();
-      for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-        pool->Schedule([&, n]() {
-          for (size_t i = n; i < sentences_.size();
-               i += trainer_spec_.num_threads()) {
-            auto *s = &sentences_[i].first;
-            *s = meta_pieces_matcher.GlobalReplace(normalizer.Normalize(*s),
-                                                   kUPPBoundaryStr);
-          }
-        });
+  // Normalizes the sentences, removes the empty ones and counts the
+  // characters in one parallel pass. Counted words are already normalized.
+  // Each thread rewrites a contiguous chunk into its own pool, and the
+  // chunks are joined in the original order afterwards.
+  {
+    TrainerProfiler::Phase normalize_phase(
+        profiler(), is_counted ? "count_chars" : "normalize");
+    normalize_phase.set_sentences(sentences_.size());
+    if (!is_counted) LOG(INFO) << "Normalizing sentences...";
+
+    const int num_threads = std::max(1, trainer_spec_.num_threads());
+    std::vector<CharCounts> local_counts(num_threads);
+    std::vector<int64> local_all_counts(num_threads, 0);
+    std::vector<util::Status> statuses(num_threads);
+    sentences_.Rewrite(num_threads, pool(), [&](int n, size_t,
+                                                absl::string_view text,
+                                                int64 freq,
+                                                std::string *output) {
+      if (!statuses[n].ok()) return false;
+      if (is_counted) {
+        output->assign(text.data(), text.size());
+      } else {
+        *output = normalize(text);
       }
-    }
+      if (output->find(" ") != std::string::npos) {
+        statuses[n] =
+            util::InternalError("Normalized string must not include spaces");
+        return false;
+      }
+      if (output->empty()) return false;
+      auto &counts = local_counts[n];
+      for (const char32 c : string_util::UTF8ToUnicodeText(*output)) {
+        // UTF8ToUnicodeText returns a white space for an
+        // interchange-invalid character.
+        if (!string_util::IsValidCodepoint(c) || c == 0x0020) continue;
+        if (c == 0x0000) {
+          LOG(INFO) << "Found null character. The corpus must be "
+                       "encoded in utf-8.";
+          continue;
+        }
+        counts[c] += freq;
+        local_all_counts[n] += freq;
+      }
+      return true;
+    });
+    for (const auto &status : statuses) RETURN_IF_ERROR(status);
 
-    for (size_t i = 0; i < sentences_.size(); ++i) {
-      auto *s = &sentences_[i].first;
-      CHECK_OR_RETURN(s->find(" ") == std::string::npos)
-          << "Normalized string must not include spaces";
-      if (s->empty()) {
-        std::swap(sentences_[i], sentences_[sentences_.size() - 1]);
-        sentences_.resize(sentences_.size() - 1);
+    for (int n = 0; n < num_threads; ++n) {
+      for (const auto &it : local_counts[n]) {
+        (*char_counts)[it.first] += it.second;
       }
+      CharCounts().swap(local_counts[n]);
+      *all_chars_count += local_all_counts[n];
     }
   }
 
-  // Count character frequencies.
-  int64 all_chars_count = 0;
+  return util::OkStatus();
+}
+
+util::Status TrainerInterface::SelectRequiredChars(
+    const CharCounts &char_counts, int64 all_chars_count) {
   // A map from a character to {is_required_char, character count}.
   absl::flat_hash_map<char32, std::pair<bool, int64>> chars_count;
   for (const char32 c :
@@ -435,25 +1429,12 @@ END:
     }
     chars_count[c].first = true;  // is_required_character.
   }
-  for (const auto &w : sentences_) {
-    for (const char32 c : string_util::UTF8ToUnicodeText(w.first)) {
-      if (!string_util::IsValidCodepoint(c)) continue;
-      if (c == 0x0000) {
-        LOG(INFO)
-            << "Found null character. The corpus must be encoded in utf-8.";
-        continue;
-      }
-      if (c == 0x0020) {
-        // UTF8ToUnicodeText returns a white space if the text
-        // contains an interchange-invalid character.
-        CHECK_OR_RETURN(w.first.find(" ") == std::string::npos)
-            << "space must not be included in normalized string.";
-        continue;
-      }
-      chars_count[c].second += w.second;
-      all_chars_count += w.second;
-    }
+  for (const auto &it : char_counts) {
+    chars_count[it.first].second = it.second;
   }
+
+  TrainerProfiler::Phase chars_phase(profiler(), "required_chars");
+  chars_phase.set_sentences(sentences_.size());
   LOG(INFO) << "all chars count=" << all_chars_count;
 
   // Determines required_chars which must be included in the vocabulary.
@@ -461,7 +1442,7 @@ END:
   // Sorted() sorts the chars_count values in the decsending order of pair<>.
   // I.e. characters are sorted in the order of required characters and then
   // frequent characters.
-  for (const auto &w : Sorted(chars_count)) {
+  for (const auto &w : Sorted(chars_count, pool())) {
     const float coverage = 1.0 * accumulated_chars_count / all_chars_count;
     if (!trainer_spec_.use_all_vocab() &&
         coverage >= trainer_spec_.character_coverage()) {
@@ -482,17 +1463,46 @@ END:
   CHECK_OR_RETURN(!port::ContainsKey(required_chars_, kUNKChar));
 
   // Replaces rare characters (characters not included in required_chars_)
-  // with kUNKChar.
-  for (auto &w : sentences_) {
-    string_util::UnicodeText uw2;
-    for (const char32 c : string_util::UTF8ToUnicodeText(w.first)) {
-      if (port::ContainsKey(required_chars_, c)) {
-        uw2.push_back(c);
-      } else {
-        uw2.push_back(kUNKChar);
-      }
+  // with kUNKChar. The required characters are looked up in a bitmap of all
+  // code points, and a sentence is copied as it is up to its first rare
+  // character. An invalid byte is read as U+FFFD.
+  {
+    std::vector<uint64> required((0x10FFFF >> 6) + 1, 0);
+    for (const auto &it : required_chars_) {
+      required[it.first >> 6] |= static_cast<uint64>(1) << (it.first & 63);
     }
-    w.first = string_util::UnicodeTextToUTF8(uw2);
+    const auto is_required = [&required](char32 c) {
+      return static_cast<uint32>(c) <= 0x10FFFF &&
+             ((required[c >> 6] >> (c & 63)) & 1);
+    };
+    const std::string unk = string_util::UnicodeCharToUTF8(kUNKChar);
+    const std::string unicode_error =
+        string_util::UnicodeCharToUTF8(kUnicodeError);
+    const auto replace = [&](int, size_t, absl::string_view s, int64,
+                             std::string *output) {
+      const char *begin = s.data();
+      const char *end = begin + s.size();
+      const char *p = begin;
+      size_t mblen = 0;
+      for (; p < end; p += mblen) {
+        const char32 c = string_util::DecodeUTF8(p, end, &mblen);
+        if (!is_required(c) || (c == kUnicodeError && mblen != 3))
+          break;
+      }
+      output->assign(begin, p);
+      for (; p < end; p += mblen) {
+        const char32 c = string_util::DecodeUTF8(p, end, &mblen);
+        if (!is_required(c)) {
+          *output += unk;
+        } else if (c == kUnicodeError && mblen != 3) {
+          *output += unicode_error;
+        } else {
+          output->append(p, mblen);
+        }
+      }
+      return true;
+    };
+    sentences_.Rewrite(trainer_spec_.num_threads(), pool(), replace);
   }
 
   // +3 for meta pieces.
@@ -509,36 +1519,102 @@ END:
   }
 
   LOG(INFO) << "Done! preprocessed " << sentences_.size() << " sentences.";
+  chars_phase.set_vocab_size(required_chars_.size());
+  chars_phase.End();
 
   return util::OkStatus();
 }
 
 void TrainerInterface::SplitSentencesByWhitespace() {
+  TrainerProfiler::Phase phase(profiler(), "split_by_whitespace");
+  phase.set_sentences(sentences_.size());
   LOG(INFO) << "Tokenizing input sentences with whitespace: "
             << sentences_.size();
-  absl::flat_hash_map<std::string, int64> tokens;
-  for (const auto &s : sentences_) {
-    for (const auto &w :
-         SplitIntoWords(s.first, trainer_spec_.treat_whitespace_as_suffix())) {
-      tokens[std::string(w)] += s.second;
+  // Words are counted in parallel without sharing a map between threads.
+  // Each thread aggregates a stripe of sentences into |num_shards| maps
+  // partitioned by the word hash, and then each shard is merged and sorted
+  // by one thread. The sorted shards are merged pairwise. The result does
+  // not depend on the scheduling, since the unique words are ordered by
+  // frequency and then by the word itself, as with Sorted().
+  using WordCounts = absl::flat_hash_map<HashedWord, int64, HashedWordHash>;
+  const int num_shards = std::max(1, trainer_spec_.num_threads());
+  const bool treat_ws_as_suffix = trainer_spec_.treat_whitespace_as_suffix();
+  const string_util::string_view_hash hasher;
+  std::vector<std::vector<WordCounts>> counts(
+      num_shards, std::vector<WordCounts>(num_shards));
+  for (int n = 0; n < num_shards; ++n) {
+    pool()->Schedule([&, n]() {
+      auto &local = counts[n];
+      for (size_t i = n; i < sentences_.size(); i += num_shards) {
+        const auto &s = sentences_[i];
+        for (const auto &w : SplitIntoWords(s.first, treat_ws_as_suffix)) {
+          const HashedWord key = {w, hasher(w)};
+          local[key.hash % num_shards][key] += s.second;
+        }
+      }
+    });
+  }
+  pool()->Wait();
+
+  // The words are views into |sentences_| until they are copied into the
+  // new store.
+  using Words = std::vector<std::pair<absl::string_view, int64>>;
+  std::vector<Words> tokens(num_shards);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    pool()->Schedule([&, shard]() {
+      WordCounts &merged = counts[0][shard];
+      for (int n = 1; n < num_shards; ++n) {
+        for (const auto &it : counts[n][shard]) merged[it.first] += it.second;
+        WordCounts().swap(counts[n][shard]);
+      }
+      tokens[shard].reserve(merged.size());
+      for (const auto &it : merged) {
+        tokens[shard].emplace_back(it.first.word, it.second);
+      }
+      WordCounts().swap(merged);
+      std::sort(tokens[shard].begin(), tokens[shard].end(), SentenceLess);
+    });
+  }
+  pool()->Wait();
+
+  for (int width = 1; width < num_shards; width *= 2) {
+    for (int shard = 0; shard + width < num_shards; shard += 2 * width) {
+      pool()->Schedule([&, shard, width]() {
+        Words &first = tokens[shard];
+        Words &second = tokens[shard + width];
+        Words merged;
+        merged.reserve(first.size() + second.size());
+        std::merge(first.begin(), first.end(), second.begin(), second.end(),
+                   std::back_inserter(merged), SentenceLess);
+        first.swap(merged);
+        Words().swap(second);
+      });
     }
+    pool()->Wait();
   }
-  sentences_ = Sorted(tokens);
+  size_t bytes = 0;
+  for (const auto &w : tokens[0]) bytes += w.first.size();
+  Sentences words;
+  words.reserve(tokens[0].size(), bytes);
+  for (const auto &w : tokens[0]) words.emplace_back(w.first, w.second);
+  sentences_.swap(words);
   LOG(INFO) << "Done! " << sentences_.size();
 }
 
 util::Status TrainerInterface::Serialize(ModelProto *model_proto) const {
   RETURN_IF_ERROR(status());
 
-  // Duplicated sentencepiece is not allowed.
-  std::set<std::string> dup;
+  // Duplicated sentencepiece is not allowed. The views point to the pieces
+  // of |model_proto|, which are not moved while more pieces are added.
+  absl::flat_hash_set<absl::string_view, string_util::string_view_hash> dup;
 
   model_proto->Clear();
 
-#define CHECK_PIECE(piece)                                  \
-  CHECK_OR_RETURN(string_util::IsStructurallyValid(piece)); \
-  CHECK_OR_RETURN(!piece.empty());                          \
-  CHECK_OR_RETURN(dup.insert(piece).second) << piece << " is already defined";
+#define CHECK_PIECE(piece)                                     \
+  CHECK_OR_RETURN(string_util::IsStructurallyValid(piece));    \
+  CHECK_OR_RETURN(!piece.empty());                             \
+  CHECK_OR_RETURN(dup.insert(absl::string_view(piece)).second) \
+      << piece << " is already defined";
 
   size_t fid = 0;
   for (int id = 0; id < trainer_spec_.vocab_size(); ++id) {
@@ -585,37 +1661,47 @@ util::Status TrainerInterface::Serialize(ModelProto *model_proto) const {
                        static_cast<int32>(dup.size()));
   }
 
-  // Saves self-testing data.
+  // Saves self-testing data. The samples are encoded in parallel.
   if (!self_test_samples_.empty()) {
     SentencePieceProcessor sp;
     RETURN_IF_ERROR(sp.Load(*model_proto));
-    for (const auto &input : self_test_samples_) {
-      std::vector<std::string> sps;
-      RETURN_IF_ERROR(sp.Encode(input, &sps));
+    const size_t size = self_test_samples_.size();
+    std::vector<std::string> expected(size);
+    std::vector<util::Status> statuses(size);
+    const int num_threads = std::max(1, trainer_spec_.num_threads());
+    for (int n = 0; n < num_threads; ++n) {
+      pool()->Schedule([&, n]() {
+        std::vector<std::string> sps;
+        for (size_t i = n; i < size; i += num_threads) {
+          statuses[i] = sp.Encode(self_test_samples_[i], &sps);
+          expected[i] = absl::StrJoin(sps, " ");
+        }
+      });
+    }
+    pool()->Wait();
+    for (size_t i = 0; i < size; ++i) {
+      RETURN_IF_ERROR(statuses[i]);
       auto *sample = model_proto->mutable_self_test_data()->add_samples();
-      sample->set_input(input);
-      sample->set_expected(absl::StrJoin(sps, " "));
+      sample->set_input(self_test_samples_[i]);
+      sample->set_expected(std::move(expected[i]));
     }
   }
 
   return util::OkStatus();
 }
 
-util::Status TrainerInterface::SaveModel(absl::string_view filename) const {
+util::Status TrainerInterface::SaveModel(
+    absl::string_view filename, const ModelProto &model_proto) const {
   LOG(INFO) << "Saving model: " << filename;
-  ModelProto model_proto;
-  RETURN_IF_ERROR(Serialize(&model_proto));
-
   auto output = filesystem::NewWritableFile(filename.data(), true);
   RETURN_IF_ERROR(output->status());
   output->Write(model_proto.SerializeAsString());
   return util::OkStatus();
 }
 
-util::Status TrainerInterface::SaveVocab(absl::string_view filename) const {
+util::Status TrainerInterface::SaveVocab(
+    absl::string_view filename, const ModelProto &model_proto) const {
   LOG(INFO) << "Saving vocabs: " << filename;
-  ModelProto model_proto;
-  RETURN_IF_ERROR(Serialize(&model_proto));
   auto output = filesystem::NewWritableFile(filename);
   RETURN_IF_ERROR(output->status());
 
@@ -634,13 +1720,247 @@ util::Status TrainerInterface::SaveVocab(absl::string_view filename) const {
   return util::OkStatus();
 }
 
+uint64 TrainerInterface::CorpusCacheKey() const {
+  TrainerSpec spec;
+  *spec.mutable_input() = trainer_spec_.input();
+  spec.set_input_format(trainer_spec_.input_format());
+  spec.set_input_sentence_size(trainer_spec_.input_sentence_size());
+  spec.set_shuffle_input_sentence(trainer_spec_.shuffle_input_sentence());
+  spec.set_seek_sampling(trainer_spec_.seek_sampling());
+  spec.set_max_sentence_length(trainer_spec_.max_sentence_length());
+  spec.set_self_test_sample_size(trainer_spec_.self_test_sample_size());
+  spec.set_corpus_memory_budget_mb(trainer_spec_.corpus_memory_budget_mb());
+  spec.set_dedup_input_sentences(trainer_spec_.dedup_input_sentences());
+  spec.set_split_by_whitespace(trainer_spec_.split_by_whitespace());
+  spec.set_treat_whitespace_as_suffix(
+      trainer_spec_.treat_whitespace_as_suffix());
+
+  std::string key = spec.SerializeAsString();
+  key += normalizer_spec_.SerializeAsString();
+  for (const auto &it : meta_pieces_) {
+    key.append(it.second.first.data(), it.second.first.size() + 1);
+  }
+  // A modified input file is told by its size.
+  for (const auto &filename : trainer_spec_.input()) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    key += std::to_string(static_cast<int64>(in.tellg())) + "\n";
+  }
+
+  // 64-bit FNV-1a.
+  uint64 hash = 0xcbf29ce484222325ULL;
+  for (const char c : key) {
+    hash = (hash ^ static_cast<uint8>(c)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+util::Status TrainerInterface::SaveCorpusCache(const CharCounts &char_counts,
+                                               int64 all_chars_count) const {
+  const std::string &filename = trainer_spec_.corpus_cache();
+  LOG(INFO) << "Saving corpus cache: " << filename;
+  CheckpointWriter writer(filename);
+  RETURN_IF_ERROR(writer.status());
+  writer.PutUInt64(CorpusCacheKey());
+  writer.PutUInt64(sentences_.size());
+  writer.PutUInt64(sentences_.text_bytes());
+  for (const auto &w : sentences_) {
+    writer.PutString(w.first);
+    writer.PutUInt64(w.second);
+  }
+  writer.PutUInt64(char_counts.size());
+  for (const auto &it : char_counts) {
+    writer.PutUInt64(it.first);
+    writer.PutUInt64(it.second);
+  }
+  writer.PutUInt64(all_chars_count);
+  writer.PutUInt64(self_test_samples_.size());
+  for (const auto &w : self_test_samples_) writer.PutString(w);
+  return writer.Close();
+}
+
+bool TrainerInterface::LoadCorpusCache(CharCounts *char_counts,
+                                       int64 *all_chars_count) {
+  const std::string &filename = trainer_spec_.corpus_cache();
+  if (!filesystem::NewReadableFile(filename, true)->status().ok()) {
+    return false;
+  }
+  TrainerProfiler::Phase phase(profiler(), "load_corpus_cache");
+  CheckpointReader reader(filename);
+  uint64 key = 0;
+  if (!reader.status().ok() || !reader.GetUInt64(&key) ||
+      key != CorpusCacheKey()) {
+    LOG(INFO) << "Corpus cache " << filename
+              << " is not for this training. Rebuilding it.";
+    return false;
+  }
+
+  // The sentences are copied straight from the mapped file into the store.
+  auto load = [&]() {
+    uint64 size = 0, text_bytes = 0, value = 0, freq = 0;
+    if (!reader.GetUInt64(&size) || !reader.GetUInt64(&text_bytes)) {
+      return false;
+    }
+    sentences_.reserve(size, text_bytes);
+    absl::string_view w;
+    for (uint64 i = 0; i < size; ++i) {
+      if (!reader.GetStringView(&w) || !reader.GetUInt64(&freq)) return false;
+      sentences_.emplace_back(w, static_cast<int64>(freq));
+    }
+    if (!reader.GetUInt64(&size)) return false;
+    for (uint64 i = 0; i < size; ++i) {
+      if (!reader.GetUInt64(&value) || !reader.GetUInt64(&freq)) return false;
+      (*char_counts)[static_cast<char32>(value)] = static_cast<int64>(freq);
+    }
+    if (!reader.GetUInt64(&value)) return false;
+    *all_chars_count = static_cast<int64>(value);
+    if (!reader.GetUInt64(&size)) return false;
+    for (uint64 i = 0; i < size; ++i) {
+      if (!reader.GetStringView(&w)) return false;
+      self_test_samples_.emplace_back(w.data(), w.size());
+    }
+    return reader.done();
+  };
+
+  if (!load()) {
+    LOG(WARNING) << "Broken corpus cache " << filename << ". Rebuilding it.";
+    sentences_.clear();
+    char_counts->clear();
+    *all_chars_count = 0;
+    self_test_samples_.clear();
+    return false;
+  }
+
+  LOG(INFO) << "Restored " << sentences_.size()
+            << " sentences from corpus cache " << filename;
+  phase.set_sentences(sentences_.size());
+  return true;
+}
+
+std::string TrainerInterface::CheckpointPath(absl::string_view name) const {
+  if (trainer_spec_.checkpoint_dir().empty()) return "";
+  return util::JoinPath(trainer_spec_.checkpoint_dir(),
+                        absl::StrCat(name, ".ckpt"));
+}
+
+bool TrainerInterface::HasCheckpoint(absl::string_view name) const {
+  if (!trainer_spec_.resume()) return false;
+  return filesystem::NewReadableFile(CheckpointPath(name), true)
+      ->status()
+      .ok();
+}
+
+util::Status TrainerInterface::SaveCorpusCheckpoint() const {
+  const std::string filename = CheckpointPath("corpus");
+  LOG(INFO) << "Saving corpus checkpoint: " << filename;
+  CheckpointWriter writer(filename);
+  RETURN_IF_ERROR(writer.status());
+  writer.PutUInt64(sentences_.size());
+  for (const auto &w : sentences_) {
+    writer.PutString(w.first);
+    writer.PutUInt64(w.second);
+  }
+  writer.PutUInt64(required_chars_.size());
+  for (const auto &it : required_chars_) {
+    writer.PutUInt64(it.first);
+    writer.PutUInt64(it.second);
+  }
+  writer.PutUInt64(self_test_samples_.size());
+  for (const auto &w : self_test_samples_) writer.PutString(w);
+  return writer.Close();
+}
+
+util::Status TrainerInterface::LoadCorpusCheckpoint() {
+  const std::string filename = CheckpointPath("corpus");
+  LOG(INFO) << "Resuming from corpus checkpoint: " << filename;
+  CheckpointReader reader(filename);
+  RETURN_IF_ERROR(reader.status());
+
+  uint64 size = 0, value = 0, freq = 0;
+  CHECK_OR_RETURN(reader.GetUInt64(&size)) << "Broken checkpoint.";
+  std::string w;
+  for (uint64 i = 0; i < size; ++i) {
+    CHECK_OR_RETURN(reader.GetString(&w) && reader.GetUInt64(&freq))
+        << "Broken checkpoint.";
+    sentences_.emplace_back(w, static_cast<int64>(freq));
+  }
+  CHECK_OR_RETURN(reader.GetUInt64(&size)) << "Broken checkpoint.";
+  for (uint64 i = 0; i < size; ++i) {
+    CHECK_OR_RETURN(reader.GetUInt64(&value) && reader.GetUInt64(&freq))
+        << "Broken checkpoint.";
+    required_chars_.emplace(static_cast<char32>(value),
+                            static_cast<int64>(freq));
+  }
+  CHECK_OR_RETURN(reader.GetUInt64(&size)) << "Broken checkpoint.";
+  for (uint64 i = 0; i < size; ++i) {
+    CHECK_OR_RETURN(reader.GetString(&w)) << "Broken checkpoint.";
+    self_test_samples_.push_back(w);
+  }
+  CHECK_OR_RETURN(reader.done()) << "Broken checkpoint.";
+
+  LOG(INFO) << "Restored " << sentences_.size() << " sentences and "
+            << required_chars_.size() << " required chars";
+  return util::OkStatus();
+}
+
 util::Status TrainerInterface::Save() const {
+  TrainerProfiler::Phase phase(profiler(), "save");
+  phase.set_vocab_size(final_pieces_.size() + meta_pieces_.size());
   if (output_model_proto_) {
     RETURN_IF_ERROR(Serialize(output_model_proto_));
   } else {
-    RETURN_IF_ERROR(SaveModel(trainer_spec_.model_prefix() + ".model"));
-    RETURN_IF_ERROR(SaveVocab(trainer_spec_.model_prefix() + ".vocab"));
+    // Serializes once for both files.
+    ModelProto model_proto;
+    RETURN_IF_ERROR(Serialize(&model_proto));
+    RETURN_IF_ERROR(
+        SaveModel(trainer_spec_.model_prefix() + ".model", model_proto));
+    RETURN_IF_ERROR(
+        SaveVocab(trainer_spec_.model_prefix() + ".vocab", model_proto));
+  }
+  return util::OkStatus();
+}
+
+std::vector<int> TrainerInterface::GetVocabSizes() const {
+  std::vector<int> sizes(trainer_spec_.vocab_sizes().begin(),
+                         trainer_spec_.vocab_sizes().end());
+  std::sort(sizes.begin(), sizes.end());
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+  return sizes;
+}
+
+util::Status TrainerInterface::SaveForVocabSize(int vocab_size) {
+  CHECK_OR_RETURN(output_model_proto_ == nullptr)
+      << "--vocab_sizes requires --model_prefix.";
+  CHECK_OR_RETURN(meta_pieces_.empty() ||
+                  meta_pieces_.rbegin()->first < vocab_size)
+      << "The id of " << meta_pieces_.rbegin()->second.first
+      << " must be smaller than the vocab size " << vocab_size << ".";
+
+  // The model is saved with the spec of a training for |vocab_size|.
+  const TrainerSpec trainer_spec = trainer_spec_;
+  trainer_spec_.set_vocab_size(vocab_size);
+  trainer_spec_.set_model_prefix(
+      absl::StrCat(trainer_spec.model_prefix(), ".", vocab_size));
+  trainer_spec_.clear_vocab_sizes();
+  const auto status = Save();
+  trainer_spec_ = trainer_spec;
+  return status;
+}
+
+util::Status TrainerInterface::LoadInitPieces(
+    std::vector<std::pair<std::string, float>> *pieces) const {
+  pieces->clear();
+  ModelProto model_proto;
+  RETURN_IF_ERROR(io::LoadModelProto(trainer_spec_.init_model(), &model_proto));
+  CHECK_EQ_OR_RETURN(trainer_spec_.model_type(),
+                     model_proto.trainer_spec().model_type())
+      << "--init_model must be a model of the same model_type.";
+  for (const auto &sp : model_proto.pieces()) {
+    if (sp.type() == ModelProto::SentencePiece::NORMAL) {
+      pieces->emplace_back(sp.piece(), sp.score());
+    }
   }
+  LOG(INFO) << "Loaded " << pieces->size() << " pieces from "
+            << trainer_spec_.init_model();
   return util::OkStatus();
 }
 
@@ -715,6 +2035,13 @@ util::Status TrainerInterface::InitMetaPieces() {
     }
   }
 
+  if (trainer_spec_.compact_repeat_counts()) {
+    for (int i = 0; i < kNumRepeatCountPieces; ++i) {
+      CHECK_OR_RETURN(insert_meta_symbol(RepeatCountPiece(i),
+                                         ModelProto::SentencePiece::CONTROL));
+    }
+  }
+
   return util::OkStatus();
 }
 
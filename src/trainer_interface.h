@@ -16,6 +16,7 @@
 #define TRAINER_INTERFACE_H_
 
 #include <algorithm>
+#include <iterator>
 #include <map>
 #include <memory>
 #include <string>
@@ -24,22 +25,27 @@
 
 #include "common.h"
 #include "filesystem.h"
+#include "sentence_store.h"
 #include "sentencepiece_model.pb.h"
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "trainer_profiler.h"
 #include "util.h"
 
 namespace sentencepiece {
 
+// The order of Sorted(): by decreasing value and then by key.
+template <typename K, typename V>
+bool SortedLess(const std::pair<K, V> &p1, const std::pair<K, V> &p2) {
+  return (p1.second > p2.second ||
+          (p1.second == p2.second && p1.first < p2.first));
+}
+
 template <typename K, typename V>
 std::vector<std::pair<K, V>> Sorted(const std::vector<std::pair<K, V>> &m) {
   std::vector<std::pair<K, V>> v = m;
-  std::sort(v.begin(), v.end(),
-            [](const std::pair<K, V> &p1, const std::pair<K, V> &p2) {
-              return (p1.second > p2.second ||
-                      (p1.second == p2.second && p1.first < p2.first));
-            });
+  std::sort(v.begin(), v.end(), SortedLess<K, V>);
   return v;
 }
 
@@ -49,10 +55,170 @@ std::vector<std::pair<K, V>> Sorted(const absl::flat_hash_map<K, V> &m) {
   return Sorted(v);
 }
 
+// The smallest chunk the parallel sorts below sort on one thread.
+constexpr size_t kParallelSortMinChunkSize = 1 << 14;
+
+// Merges the consecutive sorted runs of |v|, the run i being
+// [bounds[i], bounds[i + 1]), pairwise on |pool| until one run is left.
+template <typename K, typename V>
+void MergeSortedRuns(std::vector<size_t> bounds,
+                     std::vector<std::pair<K, V>> *v, ThreadPool *pool) {
+  std::vector<std::pair<K, V>> buffer(v->size());
+  while (bounds.size() > 2) {
+    const size_t num_runs = bounds.size() - 1;
+    pool->ParallelFor((num_runs + 1) / 2, 1, [&](int64 begin, int64 end) {
+      for (int64 i = begin; i < end; ++i) {
+        const size_t run = 2 * i;
+        const auto first = v->begin() + bounds[run];
+        const auto middle = v->begin() + bounds[std::min(run + 1, num_runs)];
+        const auto last = v->begin() + bounds[std::min(run + 2, num_runs)];
+        std::merge(std::make_move_iterator(first),
+                   std::make_move_iterator(middle),
+                   std::make_move_iterator(middle),
+                   std::make_move_iterator(last), buffer.begin() + bounds[run],
+                   SortedLess<K, V>);
+      }
+    });
+    std::vector<size_t> merged;
+    for (size_t i = 0; i < num_runs; i += 2) merged.push_back(bounds[i]);
+    merged.push_back(bounds.back());
+    bounds.swap(merged);
+    v->swap(buffer);
+  }
+}
+
+// Returns the number of chunks of |size| entries the parallel sorts use.
+inline size_t NumSortChunks(size_t size, const ThreadPool *pool) {
+  if (pool == nullptr) return 1;
+  return std::max<size_t>(
+      1, std::min<size_t>(pool->num_workers() + 1,
+                          size / kParallelSortMinChunkSize));
+}
+
+// Sorts |v| in the order of Sorted(): the chunks of |v| are sorted on
+// |pool| and then merged pairwise. SortedLess is a strict total order on
+// entries with distinct keys, so the result does not depend on the number
+// of workers. Must not be called from a closure running on |pool|.
+template <typename K, typename V>
+void ParallelSort(std::vector<std::pair<K, V>> *v, ThreadPool *pool) {
+  const size_t num_chunks = NumSortChunks(v->size(), pool);
+  if (num_chunks == 1) {
+    std::sort(v->begin(), v->end(), SortedLess<K, V>);
+    return;
+  }
+  std::vector<size_t> bounds(num_chunks + 1);
+  for (size_t i = 0; i <= num_chunks; ++i) {
+    bounds[i] = v->size() * i / num_chunks;
+  }
+  pool->ParallelFor(num_chunks, 1, [&](int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      std::sort(v->begin() + bounds[i], v->begin() + bounds[i + 1],
+                SortedLess<K, V>);
+    }
+  });
+  MergeSortedRuns(std::move(bounds), v, pool);
+}
+
+// Keeps the first |k| entries of ParallelSort() of |v|. Every chunk of |v|
+// is cut to its first |k| entries on |pool|, so that only those are merged.
+template <typename K, typename V>
+void ParallelPartialSort(std::vector<std::pair<K, V>> *v, size_t k,
+                         ThreadPool *pool) {
+  k = std::min(k, v->size());
+  const size_t num_chunks = NumSortChunks(v->size(), pool);
+  if (num_chunks == 1) {
+    std::partial_sort(v->begin(), v->begin() + k, v->end(),
+                      SortedLess<K, V>);
+    v->resize(k);
+    return;
+  }
+  std::vector<size_t> bounds(num_chunks + 1);
+  for (size_t i = 0; i <= num_chunks; ++i) {
+    bounds[i] = v->size() * i / num_chunks;
+  }
+  pool->ParallelFor(num_chunks, 1, [&](int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      const auto first = v->begin() + bounds[i];
+      const auto last = v->begin() + bounds[i + 1];
+      std::partial_sort(first, first + std::min<size_t>(k, last - first),
+                        last, SortedLess<K, V>);
+    }
+  });
+
+  // Moves the first k entries of every chunk to the front.
+  std::vector<size_t> runs = {0};
+  for (size_t i = 0; i < num_chunks; ++i) {
+    const size_t size = std::min(k, bounds[i + 1] - bounds[i]);
+    if (runs.back() != bounds[i]) {
+      std::move(v->begin() + bounds[i], v->begin() + bounds[i] + size,
+                v->begin() + runs.back());
+    }
+    runs.push_back(runs.back() + size);
+  }
+  v->resize(runs.back());
+  MergeSortedRuns(std::move(runs), v, pool);
+  v->resize(k);
+}
+
+// Same as Sorted(), but sorts on |pool| with ParallelSort().
+template <typename K, typename V>
+std::vector<std::pair<K, V>> Sorted(const std::vector<std::pair<K, V>> &m,
+                                    ThreadPool *pool) {
+  std::vector<std::pair<K, V>> v = m;
+  ParallelSort(&v, pool);
+  return v;
+}
+
+template <typename K, typename V>
+std::vector<std::pair<K, V>> Sorted(const absl::flat_hash_map<K, V> &m,
+                                    ThreadPool *pool) {
+  std::vector<std::pair<K, V>> v(m.begin(), m.end());
+  ParallelSort(&v, pool);
+  return v;
+}
+
+// Returns the first |k| entries of Sorted() of the union of |shards|, whose
+// keys are distinct. Each shard is cut to its first |k| entries on |pool|,
+// so that only those are merged. Clears |shards|.
+template <typename K, typename V>
+std::vector<std::pair<K, V>> SortedTopK(
+    std::vector<std::vector<std::pair<K, V>>> *shards, size_t k,
+    ThreadPool *pool) {
+  for (auto &shard : *shards) {
+    pool->Schedule([&shard, k]() {
+      const size_t size = std::min(k, shard.size());
+      std::partial_sort(shard.begin(), shard.begin() + size, shard.end(),
+                        SortedLess<K, V>);
+      shard.resize(size);
+    });
+  }
+  pool->Wait();
+
+  std::vector<std::pair<K, V>> v;
+  size_t size = 0;
+  for (const auto &shard : *shards) size += shard.size();
+  v.reserve(size);
+  for (auto &shard : *shards) {
+    std::move(shard.begin(), shard.end(), std::back_inserter(v));
+    std::vector<std::pair<K, V>>().swap(shard);
+  }
+  shards->clear();
+  size = std::min(k, v.size());
+  std::partial_sort(v.begin(), v.begin() + size, v.end(), SortedLess<K, V>);
+  v.resize(size);
+  return v;
+}
+
+// Reads the lines of |files| in order. The files are read ahead by
+// |num_threads| reader threads, which split them into lines while the
+// caller consumes the previous ones. Reader i reads the files i,
+// i + num_threads, ... into its own bounded queue, so the lines are
+// returned in the same order as with one thread.
 class MultiFileSentenceIterator : public SentenceIterator {
  public:
-  explicit MultiFileSentenceIterator(const std::vector<std::string> &files);
-  ~MultiFileSentenceIterator() {}
+  explicit MultiFileSentenceIterator(const std::vector<std::string> &files,
+                                     int num_threads = 1);
+  ~MultiFileSentenceIterator();
 
   bool done() const override;
   void Next() override;
@@ -60,20 +226,116 @@ class MultiFileSentenceIterator : public SentenceIterator {
   util::Status status() const override;
 
  private:
-  void TryRead();
+  // A block of lines of one file. The last chunk of a file has |eof| set
+  // and stores the status of the file.
+  struct Chunk {
+    std::vector<std::string> lines;
+    bool eof = false;
+    util::Status status;
+  };
+
+  class Reader;
 
-  bool read_done_ = false;
+  bool done_ = false;
   size_t file_index_ = 0;
   std::vector<std::string> files_;
   std::string value_;
-  std::unique_ptr<filesystem::ReadableFile> fp_;
+  util::Status status_;
+  Chunk chunk_;
+  size_t line_index_ = 0;
+  std::vector<std::unique_ptr<Reader>> readers_;
+};
+
+// Samples about |sample_size| distinct lines of |files| without reading
+// them all. Random byte offsets are drawn uniformly over the concatenated
+// files, and each offset picks the line that starts after it, or the first
+// line of the file when no line starts after it. The line following a long
+// line is thus picked more often than with the reservoir sampler. Offsets
+// picking the same line are drawn again a few times, so fewer lines are
+// returned only when the files have few lines. |num_threads| threads read
+// the lines and they are returned in the order of the files. Compressed
+// files are not supported since they cannot be seeked.
+class SampledFileSentenceIterator : public SentenceIterator {
+ public:
+  SampledFileSentenceIterator(const std::vector<std::string> &files,
+                              size_t sample_size, int num_threads = 1,
+                              uint64 seed = 12345678);
+  ~SampledFileSentenceIterator();
+
+  bool done() const override;
+  void Next() override;
+  const std::string &value() const override { return value_; }
+  util::Status status() const override;
+
+ private:
+  util::Status Sample(const std::vector<std::string> &files,
+                      size_t sample_size, int num_threads, uint64 seed);
+
+  bool done_ = false;
+  std::vector<std::string> lines_;
+  size_t index_ = 0;
+  std::string value_;
+  util::Status status_;
+};
+
+// Writes a training checkpoint in a compact binary format: integers in
+// little endian and strings prefixed with their length. The data goes to a
+// temporary file which replaces |filename| on Close(), so that a killed job
+// leaves either the previous or the new checkpoint behind.
+class CheckpointWriter {
+ public:
+  explicit CheckpointWriter(absl::string_view filename);
+  ~CheckpointWriter();
+
+  util::Status status() const { return output_->status(); }
+
+  void PutUInt64(uint64 value);
+  void PutFloat(float value);
+  void PutString(absl::string_view value);
+
+  util::Status Close();
+
+ private:
+  util::Status Flush();
+
+  const std::string filename_;
+  const std::string tmp_filename_;
+  std::unique_ptr<filesystem::WritableFile> output_;
+  std::string buffer_;
+  bool ok_ = true;
+};
+
+// Reads a checkpoint written by CheckpointWriter. The Get methods return
+// false once the data is exhausted or broken.
+class CheckpointReader {
+ public:
+  explicit CheckpointReader(absl::string_view filename);
+
+  util::Status status() const { return status_; }
+
+  bool GetUInt64(uint64 *value);
+  bool GetFloat(float *value);
+  bool GetString(std::string *value);
+
+  // Same as GetString(), but returns a view of the checkpoint data, which is
+  // valid while the reader is alive.
+  bool GetStringView(absl::string_view *value);
+
+  // Returns true if all the data is consumed.
+  bool done() const { return data_.empty(); }
+
+ private:
+  std::unique_ptr<filesystem::ReadableFile> input_;
+  absl::string_view data_;
+  util::Status status_;
 };
 
 // Base trainer class
 class TrainerInterface {
  public:
   using Sentence = std::pair<std::string, int64>;
-  using Sentences = std::vector<Sentence>;
+  using Sentences = SentenceStore;
+  using CharCounts = absl::flat_hash_map<char32, int64>;
 
   static const char32 kWSChar;
   static const char32 kUNKChar;
@@ -106,6 +368,11 @@ class TrainerInterface {
   FRIEND_TEST(TrainerInterfaceTest, BytePiecesTest);
   FRIEND_TEST(TrainerInterfaceTest, SerializeTest);
   FRIEND_TEST(TrainerInterfaceTest, CharactersTest);
+  FRIEND_TEST(TrainerInterfaceTest, SplitSentencesByWhitespaceTest);
+  FRIEND_TEST(TrainerInterfaceTest, CorpusMemoryBudgetTest);
+  FRIEND_TEST(TrainerInterfaceTest, DedupInputSentencesTest);
+  FRIEND_TEST(TrainerInterfaceTest, FrequencyListTest);
+  FRIEND_TEST(TrainerInterfaceTest, CorpusCacheTest);
 
  protected:
   // Returns true if |piece| is valid sentence piece.
@@ -113,12 +380,34 @@ class TrainerInterface {
   // max_sentencepiece_length, split_by_whiespace, split_by_unicode_script.
   bool IsValidSentencePiece(const string_util::UnicodeText &piece) const;
 
+  // The properties of a character checked by IsValidSentencePiece(), so
+  // that the characters of a corpus are looked up only once.
+  struct CharAttributes {
+    enum : uint8 {
+      kAnyScript = 0xFF,  // `script` of characters joining any script.
+      kInvalid = 1 << 0,  // never in a piece.
+      kSpace = 1 << 1,
+      kWhitespace = 1 << 2,  // kWSChar.
+      kDigit = 1 << 3,
+    };
+    uint8 script;  // unicode_script::ScriptType with kana merged into Han.
+    uint8 flags;
+  };
+  CharAttributes GetCharAttributes(char32 c) const;
+
+  // Same as IsValidSentencePiece() over the attributes of the `size`
+  // characters of a piece.
+  bool IsValidSentencePiece(const CharAttributes *piece, size_t size) const;
+
   // Loads all sentences from spec.input() or SentenceIterator.
   // It loads at most input_sentence_size sentences.
+  // With corpus_memory_budget_mb, |sentences_| stores the unique words
+  // instead.
   util::Status LoadSentences();
 
   // Splits all sentencecs by whitespaces and
   // replace the |sentences_| with tokenized string.
+  // Each unique word appears once, weighted by its total frequency.
   // e.g.,
   //  [ ["hello world ", 1], ["hi world]" ] =>
   //  [ ["hello", 1], ["hi", 1], ["world", 2] ]
@@ -127,6 +416,27 @@ class TrainerInterface {
   // Save model files into spec.model_prefix().
   util::Status Save() const;
 
+  // Returns spec.vocab_sizes() in ascending order without duplicates.
+  std::vector<int> GetVocabSizes() const;
+
+  // Saves final_pieces_ as the model of |vocab_size| pieces into
+  // <spec.model_prefix()>.<vocab_size>.model and .vocab, whose trainer spec
+  // is the one of a training for |vocab_size|.
+  util::Status SaveForVocabSize(int vocab_size);
+
+  // Loads the normal pieces of spec.init_model() with their scores in the
+  // order of their ids.
+  util::Status LoadInitPieces(
+      std::vector<std::pair<std::string, float>> *pieces) const;
+
+  // Returns the path of the checkpoint |name| in spec.checkpoint_dir(), or
+  // an empty string if checkpointing is disabled.
+  std::string CheckpointPath(absl::string_view name) const;
+
+  // Returns true if the checkpoint |name| should be restored, i.e.,
+  // spec.resume() is set and the checkpoint exists.
+  bool HasCheckpoint(absl::string_view name) const;
+
   // Set of characters which must be included in the final vocab.
   // The value of this map stores the frequency.
   absl::flat_hash_map<char32, int64> required_chars_;
@@ -134,7 +444,7 @@ class TrainerInterface {
   // Final output pieces
   std::vector<std::pair<std::string, float>> final_pieces_;
 
-  // All sentences.
+  // All sentences, read as views into one pool.
   Sentences sentences_;
 
   // Trainer spec.
@@ -160,6 +470,14 @@ class TrainerInterface {
   // Emits model to this proto instead of file.
   ModelProto *output_model_proto_ = nullptr;
 
+  // Returns the worker threads shared by all parallel steps of training.
+  // The pool is created with trainer_spec_.num_threads() workers on first use.
+  ThreadPool *pool() const;
+
+  // Returns the profiler writing to trainer_spec_.profile_output(). It is
+  // created on first use and writes nothing when the path is empty.
+  TrainerProfiler *profiler() const;
+
  private:
   // Serialize final_pieces_ to |model_proto|.
   util::Status Serialize(ModelProto *model_proto) const;
@@ -167,15 +485,58 @@ class TrainerInterface {
   // Saves the best sentence split with the current model for debugging.
   util::Status SaveSplits(absl::string_view filename) const;
 
-  // Saves model file.
-  util::Status SaveModel(absl::string_view filename) const;
+  // Saves |model_proto| to the model file.
+  util::Status SaveModel(absl::string_view filename,
+                         const ModelProto &model_proto) const;
 
-  // Saves vocabulary file for NMT.
-  util::Status SaveVocab(absl::string_view filename) const;
+  // Saves the pieces of |model_proto| to the vocabulary file for NMT.
+  util::Status SaveVocab(absl::string_view filename,
+                         const ModelProto &model_proto) const;
+
+  mutable std::unique_ptr<ThreadPool> pool_;
+  mutable std::unique_ptr<TrainerProfiler> profiler_;
 
   // Initializes `meta_pieces_` from TrainerSpec.
   util::Status InitMetaPieces();
 
+  // Saves and restores the sentences, required chars and self-test samples
+  // produced by LoadSentences().
+  util::Status SaveCorpusCheckpoint() const;
+  util::Status LoadCorpusCheckpoint();
+
+  // Estimates the memory of the training from the input files and fits it
+  // in spec.max_memory_mb() by adjusting the sampling and the suffix array.
+  util::Status PlanMemory();
+
+  // Reads and normalizes the sentences of LoadSentences(), and counts their
+  // characters into |char_counts|, whose sum is |all_chars_count|.
+  util::Status ReadSentences(CharCounts *char_counts, int64 *all_chars_count);
+
+  // Loads the "word <tab> freq" lines of the tsv input files into
+  // sentences_ in the order of the files, skipping the lines ReadSentences()
+  // skips. A file is read at once and cut into byte ranges at line ends,
+  // which the pool parses in place. The skipped long lines are counted in
+  // |too_long_lines|.
+  util::Status ReadFrequencyLists(int *too_long_lines);
+
+  // Selects required_chars_ from the character counts by
+  // spec.character_coverage(), and replaces the other characters with
+  // kUNKChar.
+  util::Status SelectRequiredChars(const CharCounts &char_counts,
+                                   int64 all_chars_count);
+
+  // Returns the fingerprint of everything the result of ReadSentences()
+  // depends on, i.e., the input files, their sampling, the normalizer spec
+  // and the meta pieces.
+  uint64 CorpusCacheKey() const;
+
+  // Saves and restores the result of ReadSentences() in spec.corpus_cache().
+  // LoadCorpusCache() returns false if the cache is missing or was written
+  // for another key.
+  util::Status SaveCorpusCache(const CharCounts &char_counts,
+                               int64 all_chars_count) const;
+  bool LoadCorpusCache(CharCounts *char_counts, int64 *all_chars_count);
+
   // Randomly sampled raw sentences for self-testing.
   std::vector<std::string> self_test_samples_;
 };
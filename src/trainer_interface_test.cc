@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <cstdio>
+#include <set>
 #include <utility>
 
 #include "filesystem.h"
@@ -47,7 +49,16 @@ TEST(TrainerInterfaceTest, IsValidSentencePieceTest) {
                   &denormalizer_spec](const std::string &str) {
     TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
     const string_util::UnicodeText text = string_util::UTF8ToUnicodeText(str);
-    return trainer.IsValidSentencePiece(text);
+    const bool valid = trainer.IsValidSentencePiece(text);
+    // The seed extraction checks the attributes of the characters.
+    std::vector<TrainerInterface::CharAttributes> attributes;
+    for (const char32 c : text) {
+      attributes.push_back(trainer.GetCharAttributes(c));
+    }
+    EXPECT_EQ(valid, trainer.IsValidSentencePiece(attributes.data(),
+                                                  attributes.size()))
+        << str;
+    return valid;
   };
 
   EXPECT_FALSE(trainer.IsValidSentencePiece({0x01, 0x00, 0x01}));
@@ -148,6 +159,54 @@ TEST(TrainerInterfaceTest, IsValidSentencePieceTest) {
   EXPECT_FALSE(IsValid("2x"));
 }
 
+TEST(TrainerInterfaceTest, SortedTopKTest) {
+  // Many ties, so that the order of the keys matters.
+  std::vector<std::pair<std::string, int64>> all;
+  for (int i = 0; i < 1000; ++i) {
+    all.emplace_back(absl::StrCat("w", i), (i * 7919) % 37);
+  }
+  const auto expected = Sorted(all);
+
+  ThreadPool pool(4);
+  for (const int num_shards : {1, 3, 8}) {
+    for (const size_t k : {0, 1, 10, 999, 1000, 5000}) {
+      std::vector<std::vector<std::pair<std::string, int64>>> shards(
+          num_shards);
+      for (size_t i = 0; i < all.size(); ++i) {
+        shards[i % num_shards].push_back(all[i]);
+      }
+      const auto top = SortedTopK(&shards, k, &pool);
+      EXPECT_TRUE(shards.empty());
+      ASSERT_EQ(std::min(k, expected.size()), top.size());
+      for (size_t i = 0; i < top.size(); ++i) EXPECT_EQ(expected[i], top[i]);
+    }
+  }
+}
+
+TEST(TrainerInterfaceTest, ParallelSortTest) {
+  // Large enough to be sorted in several chunks, with many ties.
+  std::vector<std::pair<std::string, int64>> all;
+  absl::flat_hash_map<std::string, int64> map;
+  for (int i = 0; i < 100000; ++i) {
+    all.emplace_back(absl::StrCat("w", (i * 7919) % 100003), (i * 31) % 97);
+    map.insert(all.back());
+  }
+  const auto expected = Sorted(all);
+
+  for (const int num_threads : {1, 2, 5}) {
+    ThreadPool pool(num_threads);
+    EXPECT_EQ(expected, Sorted(all, &pool));
+    EXPECT_EQ(expected, Sorted(map, &pool));
+    EXPECT_EQ(expected, Sorted(all, nullptr));
+    for (const size_t k : {0, 1, 10, 20000, 99999, 100000, 200000}) {
+      auto top = all;
+      ParallelPartialSort(&top, k, &pool);
+      ASSERT_EQ(std::min(k, expected.size()), top.size());
+      EXPECT_TRUE(std::equal(top.begin(), top.end(), expected.begin()));
+    }
+  }
+}
+
 TEST(TrainerInterfaceTest, OverrideSpecialPiecesTest) {
   TrainerSpec base_trainer_spec;
   NormalizerSpec normalizer_spec;
@@ -504,6 +563,235 @@ TEST(TrainerInterfaceTest, CharactersTest) {
   }
 }
 
+TEST(TrainerInterfaceTest, SplitSentencesByWhitespaceTest) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.set_model_prefix("model");
+
+  const TrainerInterface::Sentences sentences = {
+      {WS "hello" WS "world", 1},
+      {WS "hi" WS "world", 2},
+      {WS "world" WS "hello" WS "hello", 3},
+      {WS "hi", 1}};
+  const TrainerInterface::Sentences expected = {
+      {WS "hello", 7}, {WS "world", 6}, {WS "hi", 3}};
+
+  for (const int num_threads : {1, 3, 8}) {
+    trainer_spec.set_num_threads(num_threads);
+    TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+    trainer.sentences_ = sentences;
+    trainer.SplitSentencesByWhitespace();
+    EXPECT_EQ(expected, trainer.sentences_);
+  }
+}
+
+TEST(TrainerInterfaceTest, CorpusMemoryBudgetTest) {
+  const std::string input_file =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "budget_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    for (int i = 0; i < 50000; ++i) {
+      output->WriteLine(absl::StrCat("a", absl::StrCat(i), " b",
+                                     absl::StrCat(i % 100), " c"));
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "budget_model"));
+  trainer_spec.set_character_coverage(1.0);
+  trainer_spec.set_num_threads(4);
+
+  TrainerInterface expected(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(expected.LoadSentences());
+  expected.SplitSentencesByWhitespace();
+
+  // The word counts of 50000 unique words are spilled several times.
+  trainer_spec.set_corpus_memory_budget_mb(1);
+  TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(trainer.LoadSentences());
+  EXPECT_EQ(50000 + 100 + 1, trainer.sentences_.size());
+  EXPECT_EQ(expected.required_chars_, trainer.required_chars_);
+  trainer.SplitSentencesByWhitespace();
+  EXPECT_EQ(expected.sentences_, trainer.sentences_);
+
+  // Shard files are removed.
+  auto shard = filesystem::NewReadableFile(
+      absl::StrCat(trainer_spec.model_prefix(), ".word_counts.0"));
+  EXPECT_FALSE(shard->status().ok());
+
+  // split_by_whitespace is required.
+  trainer_spec.set_split_by_whitespace(false);
+  TrainerInterface trainer2(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_FALSE(trainer2.status().ok());
+}
+
+TEST(TrainerInterfaceTest, DedupInputSentencesTest) {
+  const std::string input_file =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "dedup_input");
+  {
+    auto output = filesystem::NewWritableFile(input_file);
+    for (int i = 0; i < 1000; ++i) {
+      output->WriteLine(absl::StrCat("Home | About ", i % 7));
+      output->WriteLine(absl::StrCat("line ", i));
+    }
+  }
+
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "dedup_model"));
+  trainer_spec.set_character_coverage(1.0);
+  trainer_spec.set_num_threads(4);
+
+  TrainerInterface expected(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(expected.LoadSentences());
+  EXPECT_EQ(2000, expected.sentences_.size());
+
+  trainer_spec.set_dedup_input_sentences(true);
+  TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(trainer.LoadSentences());
+  EXPECT_EQ(1000 + 7, trainer.sentences_.size());
+  int64 total = 0;
+  for (const auto &w : trainer.sentences_) total += w.second;
+  EXPECT_EQ(2000, total);
+  EXPECT_EQ(expected.required_chars_, trainer.required_chars_);
+  expected.SplitSentencesByWhitespace();
+  trainer.SplitSentencesByWhitespace();
+  EXPECT_EQ(expected.sentences_, trainer.sentences_);
+
+  // Sampled sentences are not merged.
+  trainer_spec.set_input_sentence_size(1500);
+  TrainerInterface sampled(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(sampled.LoadSentences());
+  EXPECT_EQ(1500, sampled.sentences_.size());
+}
+
+TEST(TrainerInterfaceTest, FrequencyListTest) {
+  const std::string input_file1 =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "frequency_list1");
+  const std::string input_file2 =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "frequency_list2");
+  {
+    // More than one range of the parallel parser.
+    auto output = filesystem::NewWritableFile(input_file1);
+    for (int i = 0; i < 400000; ++i) {
+      output->WriteLine(absl::StrCat("w", i % 5000, "\t", i % 7 + 1));
+    }
+    output->WriteLine(absl::StrCat(std::string(100, 'a'), "\t3"));
+    output->WriteLine(absl::StrCat("a", TrainerInterface::kUNKStr, "\t3"));
+  }
+  {
+    // Without the last newline.
+    auto output = filesystem::NewWritableFile(input_file2);
+    output->Write("abc\t10\ndef\t2");
+  }
+
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.add_input(input_file1);
+  trainer_spec.add_input(input_file2);
+  trainer_spec.set_input_format("tsv");
+  trainer_spec.set_model_prefix(
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "frequency_model"));
+  trainer_spec.set_character_coverage(1.0);
+  trainer_spec.set_max_sentence_length(50);
+  trainer_spec.set_num_threads(4);
+
+  TrainerInterface trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(trainer.LoadSentences());
+  EXPECT_EQ(400000 + 2, trainer.sentences_.size());
+
+  // The line by line reader takes the first lines of a sample of any size.
+  trainer_spec.set_input_sentence_size(1000000);
+  trainer_spec.set_shuffle_input_sentence(false);
+  TrainerInterface expected(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(expected.LoadSentences());
+  EXPECT_EQ(expected.sentences_, trainer.sentences_);
+  EXPECT_EQ(expected.required_chars_, trainer.required_chars_);
+
+  // Malformed lines.
+  {
+    auto output = filesystem::NewWritableFile(input_file2);
+    output->WriteLine("abc\t10\t3");
+  }
+  trainer_spec.clear_input_sentence_size();
+  TrainerInterface two_tabs(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_FALSE(two_tabs.LoadSentences().ok());
+  {
+    auto output = filesystem::NewWritableFile(input_file2);
+    output->WriteLine("abc\t0");
+  }
+  TrainerInterface zero(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_FALSE(zero.LoadSentences().ok());
+}
+
+TEST(TrainerInterfaceTest, CorpusCacheTest) {
+  const std::string input_file =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "cache_input");
+  const std::string cache_file =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "corpus.cache");
+  std::remove(cache_file.c_str());
+  auto write_input = [&](absl::string_view c) {
+    auto output = filesystem::NewWritableFile(input_file);
+    for (int i = 0; i < 1000; ++i) {
+      output->WriteLine(absl::StrCat(c, absl::StrCat(i), " b",
+                                     absl::StrCat(i % 10)));
+    }
+  };
+  write_input("a");
+
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  NormalizerSpec denormalizer_spec;
+  trainer_spec.add_input(input_file);
+  trainer_spec.set_model_prefix(
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "cache_model"));
+  trainer_spec.set_character_coverage(1.0);
+  trainer_spec.set_self_test_sample_size(3);
+  trainer_spec.set_corpus_cache(cache_file);
+
+  TrainerInterface expected(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(expected.LoadSentences());
+  EXPECT_EQ(1000, expected.sentences_.size());
+
+  // Another normalization rebuilds the cache.
+  NormalizerSpec no_prefix_spec = normalizer_spec;
+  no_prefix_spec.set_add_dummy_prefix(false);
+  TrainerInterface no_prefix(trainer_spec, no_prefix_spec, denormalizer_spec);
+  EXPECT_OK(no_prefix.LoadSentences());
+  EXPECT_TRUE(expected.sentences_ != no_prefix.sentences_);
+
+  // The same input is read from the cache with another character coverage.
+  TrainerInterface rebuilt(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(rebuilt.LoadSentences());
+  EXPECT_EQ(expected.sentences_, rebuilt.sentences_);
+  write_input("x");
+  trainer_spec.set_character_coverage(0.99);
+  TrainerInterface cached(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(cached.LoadSentences());
+  EXPECT_EQ(expected.sentences_, cached.sentences_);
+  EXPECT_EQ(rebuilt.self_test_samples_, cached.self_test_samples_);
+  EXPECT_EQ(expected.required_chars_, cached.required_chars_);
+
+  // A broken cache is rebuilt from the input.
+  {
+    auto output = filesystem::NewWritableFile(cache_file);
+    output->Write("broken");
+  }
+  TrainerInterface broken(trainer_spec, normalizer_spec, denormalizer_spec);
+  EXPECT_OK(broken.LoadSentences());
+  EXPECT_TRUE(port::ContainsKey(broken.required_chars_, ToChar32("x")));
+  EXPECT_FALSE(port::ContainsKey(broken.required_chars_, ToChar32("a")));
+}
+
 TEST(TrainerInterfaceTest, MultiFileSentenceIteratorTest) {
   std::vector<std::string> files;
   std::vector<std::string> expected;
@@ -520,11 +808,43 @@ TEST(TrainerInterfaceTest, MultiFileSentenceIteratorTest) {
     files.push_back(file);
   }
 
-  std::vector<std::string> results;
-  MultiFileSentenceIterator it(files);
-  for (; !it.done(); it.Next()) results.emplace_back(it.value());
-  EXPECT_OK(it.status());
-  EXPECT_EQ(expected, results);
+  for (const int num_threads : {1, 3, 16}) {
+    std::vector<std::string> results;
+    MultiFileSentenceIterator it(files, num_threads);
+    for (; !it.done(); it.Next()) results.emplace_back(it.value());
+    EXPECT_OK(it.status());
+    EXPECT_EQ(expected, results);
+  }
+}
+
+TEST(TrainerInterfaceTest, MultiFileSentenceIteratorLargeFileTest) {
+  // Each file has more lines than a chunk of a reader.
+  std::vector<std::string> files;
+  std::vector<std::string> expected;
+  for (int i = 0; i < 3; ++i) {
+    const std::string file = util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir),
+                                            absl::StrCat("large_input", i));
+    auto output = filesystem::NewWritableFile(file);
+    for (int n = 0; n < 5000; ++n) {
+      const auto value = absl::StrCat(i, "_", absl::StrCat(n));
+      expected.emplace_back(value);
+      output->WriteLine(value);
+    }
+    files.push_back(file);
+  }
+
+  for (const int num_threads : {1, 2, 4}) {
+    std::vector<std::string> results;
+    MultiFileSentenceIterator it(files, num_threads);
+    for (; !it.done(); it.Next()) results.emplace_back(it.value());
+    EXPECT_OK(it.status());
+    EXPECT_EQ(expected, results);
+  }
+
+  // Stops in the middle.
+  MultiFileSentenceIterator it(files, 4);
+  for (int n = 0; n < 10; ++n) it.Next();
+  EXPECT_FALSE(it.done());
 }
 
 TEST(TrainerInterfaceTest, MultiFileSentenceIteratorErrorTest) {
@@ -538,6 +858,68 @@ TEST(TrainerInterfaceTest, MultiFileSentenceIteratorErrorTest) {
   MultiFileSentenceIterator it(files);
   EXPECT_TRUE(it.done());  // no files can be loaded.
   EXPECT_FALSE(it.status().ok());
+
+  // Lines are returned until the first broken file.
+  const std::string file =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "input_exist");
+  filesystem::NewWritableFile(file)->WriteLine("hello");
+  for (const int num_threads : {1, 3}) {
+    MultiFileSentenceIterator it2({file, files[0], file}, num_threads);
+    ASSERT_FALSE(it2.done());
+    EXPECT_EQ("hello", it2.value());
+    it2.Next();
+    EXPECT_TRUE(it2.done());
+    EXPECT_FALSE(it2.status().ok());
+  }
+}
+
+TEST(TrainerInterfaceTest, SampledFileSentenceIteratorTest) {
+  std::vector<std::string> files;
+  std::set<std::string> all_lines;
+  for (int i = 0; i < 3; ++i) {
+    const std::string file = util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir),
+                                            absl::StrCat("sampled_input", i));
+    auto output = filesystem::NewWritableFile(file);
+    for (int n = 0; n < 5000; ++n) {
+      const auto value = absl::StrCat(i, "_", absl::StrCat(n));
+      all_lines.insert(value);
+      output->WriteLine(value);
+    }
+    files.push_back(file);
+  }
+  // An empty file is never sampled.
+  files.push_back(util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir),
+                                 "sampled_input_empty"));
+  filesystem::NewWritableFile(files.back());
+
+  std::vector<std::string> prev_results;
+  for (const int num_threads : {1, 4}) {
+    std::vector<std::string> results;
+    SampledFileSentenceIterator it(files, 1000, num_threads);
+    for (; !it.done(); it.Next()) results.emplace_back(it.value());
+    EXPECT_OK(it.status());
+    EXPECT_EQ(1000, results.size());
+    const std::set<std::string> unique(results.begin(), results.end());
+    EXPECT_EQ(results.size(), unique.size());
+    for (const auto &line : results) EXPECT_EQ(1, all_lines.count(line));
+    // The sample only depends on the seed.
+    if (!prev_results.empty()) EXPECT_EQ(prev_results, results);
+    prev_results = results;
+  }
+
+  // All the lines are returned when the files have few lines.
+  std::vector<std::string> results;
+  SampledFileSentenceIterator it({files.back(), files[0]}, 20000);
+  for (; !it.done(); it.Next()) results.emplace_back(it.value());
+  EXPECT_OK(it.status());
+  EXPECT_GT(results.size(), 4000);
+  EXPECT_LE(results.size(), 5000);
+
+  SampledFileSentenceIterator it2(
+      {util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "input_not_exist")},
+      10);
+  EXPECT_TRUE(it2.done());
+  EXPECT_FALSE(it2.status().ok());
 }
 
 }  // namespace sentencepiece
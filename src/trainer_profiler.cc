@@ -0,0 +1,97 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#include "trainer_profiler.h"
+
+#include <cmath>
+#include <sstream>
+
+#include "util.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace sentencepiece {
+namespace {
+// Returns the peak resident set size of the process in MB, or 0 where it
+// is not available.
+double PeakRssMb() {
+#ifdef _WIN32
+  return 0.0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0.0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);  // bytes.
+#else
+  return usage.ru_maxrss / 1024.0;  // kilobytes.
+#endif  // __APPLE__
+#endif  // _WIN32
+}
+}  // namespace
+
+TrainerProfiler::TrainerProfiler(absl::string_view filename) {
+  if (filename.empty()) return;
+  output_ = filesystem::NewWritableFile(filename);
+  status_ = output_->status();
+  if (!status_.ok()) output_.reset();
+}
+
+void TrainerProfiler::WriteLine(absl::string_view line) {
+  if (!status_.ok()) return;
+  if (!output_->WriteLine(line) || !output_->Flush()) {
+    status_ = util::StatusBuilder(util::StatusCode::kDataLoss, GTL_LOC)
+              << "Failed to write the training profile.";
+  }
+}
+
+TrainerProfiler::Phase::Phase(TrainerProfiler *profiler,
+                              absl::string_view name)
+    : profiler_(profiler != nullptr && profiler->enabled() ? profiler
+                                                           : nullptr),
+      name_(name.data(), name.size()) {
+  if (profiler_ == nullptr) return;
+  wall_start_ = std::chrono::steady_clock::now();
+  cpu_start_ = std::clock();
+}
+
+void TrainerProfiler::Phase::End() {
+  if (profiler_ == nullptr) return;
+  const double wall_sec = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - wall_start_)
+                              .count();
+  const double cpu_sec =
+      static_cast<double>(std::clock() - cpu_start_) / CLOCKS_PER_SEC;
+
+  // The phase names are plain identifiers, which need no escaping.
+  std::ostringstream os;
+  os << "{\"phase\":\"" << name_ << "\"";
+  if (iteration_ >= 0) os << ",\"iteration\":" << iteration_;
+  os << ",\"wall_sec\":" << wall_sec << ",\"cpu_sec\":" << cpu_sec
+     << ",\"peak_rss_mb\":" << PeakRssMb();
+  if (sentences_ >= 0) {
+    os << ",\"sentences\":" << sentences_ << ",\"sentences_per_sec\":"
+       << (wall_sec > 0.0 ? sentences_ / wall_sec : 0.0);
+  }
+  if (vocab_size_ >= 0) os << ",\"vocab_size\":" << vocab_size_;
+  if (has_objective_ && std::isfinite(objective_)) {
+    os << ",\"objective\":" << objective_;
+  }
+  os << "}";
+  profiler_->WriteLine(os.str());
+  profiler_ = nullptr;
+}
+
+}  // namespace sentencepiece
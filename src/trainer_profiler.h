@@ -0,0 +1,86 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.!
+
+#ifndef TRAINER_PROFILER_H_
+#define TRAINER_PROFILER_H_
+
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <string>
+
+#include "common.h"
+#include "filesystem.h"
+#include "sentencepiece_processor.h"
+#include "third_party/absl/strings/string_view.h"
+
+namespace sentencepiece {
+
+// Writes the profile of a training to TrainerSpec::profile_output(), one
+// JSON object per phase and line, e.g.,
+//
+// {"phase":"em","iteration":1,"wall_sec":0.52,"cpu_sec":2.01,
+//  "peak_rss_mb":153.2,"sentences":4288,"sentences_per_sec":8246.2,
+//  "vocab_size":12000,"objective":9.89}
+//
+// cpu_sec is the CPU time of all threads of the process, and peak_rss_mb is
+// the peak resident set size of the process so far. The other fields after
+// peak_rss_mb are only written when the phase sets them.
+class TrainerProfiler {
+ public:
+  // Writes nothing when |filename| is empty.
+  explicit TrainerProfiler(absl::string_view filename);
+
+  bool enabled() const { return output_ != nullptr; }
+  util::Status status() const { return status_; }
+
+  // Times one phase from its construction to End() or its destruction,
+  // which writes the record of the phase.
+  class Phase {
+   public:
+    Phase(TrainerProfiler *profiler, absl::string_view name);
+    ~Phase() { End(); }
+
+    void set_iteration(int64 iteration) { iteration_ = iteration; }
+    void set_sentences(int64 sentences) { sentences_ = sentences; }
+    void set_vocab_size(int64 vocab_size) { vocab_size_ = vocab_size; }
+    void set_objective(double objective) {
+      objective_ = objective;
+      has_objective_ = true;
+    }
+
+    // Writes the record. Does nothing when called again.
+    void End();
+
+   private:
+    TrainerProfiler *profiler_;
+    const std::string name_;
+    std::chrono::steady_clock::time_point wall_start_;
+    std::clock_t cpu_start_ = 0;
+    int64 iteration_ = -1;
+    int64 sentences_ = -1;
+    int64 vocab_size_ = -1;
+    double objective_ = 0.0;
+    bool has_objective_ = false;
+  };
+
+ private:
+  void WriteLine(absl::string_view line);
+
+  std::unique_ptr<filesystem::WritableFile> output_;
+  util::Status status_;
+};
+
+}  // namespace sentencepiece
+#endif  // TRAINER_PROFILER_H_
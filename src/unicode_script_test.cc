@@ -39,5 +39,14 @@ TEST(UnicodeScript, GetScriptTypeTest) {
   EXPECT_EQ(U_Common, GetScriptType("@"));
   EXPECT_EQ(U_Common, GetScriptType("-"));
 }
+
+TEST(UnicodeScript, GetScriptCodePointTest) {
+  EXPECT_EQ(U_Common, GetScript(0x0000));
+  EXPECT_EQ(U_Egyptian_Hieroglyphs, GetScript(0x13000));
+  EXPECT_EQ(U_Egyptian_Hieroglyphs, GetScript(0x1342E));
+  EXPECT_EQ(U_Common, GetScript(0x10FFFF));
+  EXPECT_EQ(U_Common, GetScript(0x110000));
+  EXPECT_EQ(U_Common, GetScript(0xFFFFFFFF));
+}
 }  // namespace unicode_script
 }  // namespace sentencepiece
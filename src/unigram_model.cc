@@ -15,12 +15,17 @@
 #include <algorithm>
 #include <cfloat>
 #include <cmath>
+#include <cstring>
+#include <limits>
 #include <map>
-#include <queue>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "batch_viterbi.h"
+#include "encode_stats.h"
+#include "flat_viterbi.h"
 #include "third_party/absl/memory/memory.h"
 #include "third_party/absl/strings/str_split.h"
 #include "third_party/absl/strings/string_view.h"
@@ -34,6 +39,9 @@ namespace {
 // Size of nodes pre-allocated in Lattice.
 constexpr size_t kPreallocateLatticeNodeSize = 1024;
 
+// Size of hypotheses pre-allocated in Lattice::NBest().
+constexpr size_t kPreallocatedHypothesisSize = 512;
+
 constexpr float kUnkPenalty = 10.0;
 constexpr float kEpsilon = 1e-7;
 
@@ -55,17 +63,126 @@ inline float LogSumExp(float x, float y, bool init_mode) {
     return vmax + log(std::exp(static_cast<double>(vmin - vmax)) + 1.0);
   }
 }
+// Returns exp(x) for x <= 0, using the range reduction and polynomial of
+// Cephes expf. Arguments below -87 return exp(-87).
+inline float ExpNonPositive(float x) {
+  constexpr float kLog2e = 1.44269504088896341f;
+  constexpr float kLn2Hi = 0.693359375f;
+  constexpr float kLn2Lo = -2.12194440e-4f;
+  x = std::max(x, -87.0f);
+  // Rounds x * log2(e) to the nearest integer. Truncation of t - 0.5
+  // rounds to nearest because t <= 0.
+  const int32 n = static_cast<int32>(x * kLog2e - 0.5f);
+  const float f = x - n * kLn2Hi - n * kLn2Lo;
+  float p = 1.9875691500e-4f;
+  p = p * f + 1.3981999507e-3f;
+  p = p * f + 8.3334519073e-3f;
+  p = p * f + 4.1665795894e-2f;
+  p = p * f + 1.6666665459e-1f;
+  p = p * f + 5.0000001201e-1f;
+  p = p * f * f + f + 1.0f;
+  // 2^n as a float. n >= -126, so the result is a normal number.
+  const uint32 bits = static_cast<uint32>(n + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+// Returns a lattice for the calling thread. Lattices keep their buffers
+// between sentences, so each thread reuses one instance rather than
+// allocating it for every encode call. `local` owns the lattice when
+// thread_local is disabled.
+Lattice *GetLattice(std::unique_ptr<Lattice> *local) {
+#ifdef SPM_NO_THREADLOCAL
+  local->reset(new Lattice);
+  return local->get();
+#else
+  thread_local static Lattice lattice;
+  return &lattice;
+#endif
+}
+
+// Appends the piece of `length` bytes from `begin` of `normalized` to
+// `results`.
+inline void AppendPiece(absl::string_view normalized, int begin, int length,
+                        int id, EncodeResult *results) {
+  results->emplace_back(normalized.substr(begin, length), id);
+}
+
+inline void AppendPiece(absl::string_view normalized, int begin, int length,
+                        int id, CompactEncodeResult *results) {
+  results->push_back({static_cast<uint32>(begin),
+                      static_cast<uint32>(length), id});
+}
+
+// Represents the last node of a best path in Model::EncodeOptimized().
+struct BestPathNode {
+  int id = -1;  // The vocab id. (maybe -1 for UNK)
+  float best_path_score =
+      0;  // The total score of the best path ending at this node.
+  int starts_at =
+      -1;  // The starting position (in utf-8) of this node. The entire best
+           // path can be constructed by backtracking along this link.
+};
+
+// Returns the best path buffer of the calling thread, which is reused as
+// GetLattice() reuses lattices.
+std::vector<BestPathNode> *GetBestPaths(
+    std::unique_ptr<std::vector<BestPathNode>> *local) {
+#ifdef SPM_NO_THREADLOCAL
+  local->reset(new std::vector<BestPathNode>);
+  return local->get();
+#else
+  thread_local static std::vector<BestPathNode> best_paths;
+  return &best_paths;
+#endif
+}
+
+// Returns true if no transition from any of the |size| units of the
+// double-array |units| leaves the array, and every value is a piece id below
+// |num_pieces|. A darts-clone array is built in blocks of 256 units, so the
+// whole block of children of a unit must be in the array.
+bool IsValidTrie(const uint32_t *units, size_t size, int num_pieces) {
+  if (size == 0 || size % 256 != 0 || (units[0] >> 31) != 0) return false;
+  for (size_t i = 0; i < size; ++i) {
+    const uint32_t unit = units[i];
+    if (unit >> 31) continue;  // A value unit has no children.
+    const size_t children = i ^ FlatTrieOffset(unit);
+    if ((children | 0xFF) >= size) return false;
+    if (((unit >> 8) & 1) &&
+        (units[children] & ((1U << 31) - 1)) >=
+            static_cast<uint32_t>(num_pieces))
+      return false;
+  }
+  return true;
+}
 }  // namespace
 
-Lattice::Lattice() : node_allocator_(kPreallocateLatticeNodeSize) {}
+float LogSumExp(const float *values, size_t size) {
+  if (size == 1) return values[0];
+  float vmax = values[0];
+  for (size_t i = 1; i < size; ++i) vmax = std::max(vmax, values[i]);
+  float sum = 0.0;
+  for (size_t i = 0; i < size; ++i) sum += ExpNonPositive(values[i] - vmax);
+  return vmax + std::log(sum);
+}
+
+// Clear() runs on every encode, so the allocators must not clear all the
+// nodes of the longest sentence seen so far.
+Lattice::Lattice()
+    : node_allocator_(kPreallocateLatticeNodeSize, true),
+      hypothesis_allocator_(kPreallocatedHypothesisSize, true) {}
 Lattice::~Lattice() {}
 
-const std::vector<Lattice::Node *> &Lattice::begin_nodes(int pos) const {
-  return begin_nodes_[pos];
+Lattice::NodeList Lattice::begin_nodes(int pos) const {
+  BuildNodeLists();
+  return NodeList(begin_nodes_.data() + begin_offsets_[pos],
+                  begin_nodes_.data() + begin_offsets_[pos + 1]);
 }
 
-const std::vector<Lattice::Node *> &Lattice::end_nodes(int pos) const {
-  return end_nodes_[pos];
+Lattice::NodeList Lattice::end_nodes(int pos) const {
+  BuildNodeLists();
+  return NodeList(end_nodes_.data() + end_offsets_[pos],
+                  end_nodes_.data() + end_offsets_[pos + 1]);
 }
 
 int Lattice::size() const {
@@ -79,24 +196,58 @@ const char *Lattice::sentence() const { return sentence_.data(); }
 
 const char *Lattice::surface(int pos) const { return surface_[pos]; }
 
-Lattice::Node *Lattice::bos_node() const { return end_nodes_[0][0]; }
+Lattice::Node *Lattice::bos_node() const { return nodes_[0]; }
 
-Lattice::Node *Lattice::eos_node() const { return begin_nodes_[size()][0]; }
+Lattice::Node *Lattice::eos_node() const { return nodes_[1]; }
 
 Lattice::Node *Lattice::NewNode() {
+  stats::Add(stats::kLatticeNodes, 1);
   Node *node = node_allocator_.Allocate();
   node->node_id = node_allocator_.size() - 1;
   return node;
 }
 
 void Lattice::Clear() {
-  begin_nodes_.clear();
-  end_nodes_.clear();
+  // Keeps the node vectors and their capacity for the next sentence.
   sentence_ = absl::string_view("");
   surface_.clear();
+  nodes_.clear();
+  node_lists_built_ = false;
   node_allocator_.Free();
 }
 
+void Lattice::BuildNodeLists() const {
+  if (node_lists_built_) return;
+
+  // A counting sort in two passes over nodes_, which keeps the order of
+  // insertion in every position. The number of nodes of pos is counted at
+  // offsets[pos + 2], so that offsets[pos + 1] is the next free slot of pos
+  // while the nodes are scattered, and the end of pos afterwards.
+  const int len = size();
+  begin_offsets_.assign(len + 3, 0);
+  end_offsets_.assign(len + 3, 0);
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    const Node *node = nodes_[i];
+    // BOS (i == 0) only ends at 0, and EOS (i == 1) only begins at len.
+    if (i != 0) ++begin_offsets_[node->pos + 2];
+    if (i != 1) ++end_offsets_[node->pos + node->length + 2];
+  }
+  for (int pos = 2; pos <= len + 2; ++pos) {
+    begin_offsets_[pos] += begin_offsets_[pos - 1];
+    end_offsets_[pos] += end_offsets_[pos - 1];
+  }
+
+  begin_nodes_.resize(begin_offsets_[len + 2]);
+  end_nodes_.resize(end_offsets_[len + 2]);
+  for (size_t i = 0; i < nodes_.size(); ++i) {
+    Node *node = nodes_[i];
+    if (i != 0) begin_nodes_[begin_offsets_[node->pos + 1]++] = node;
+    if (i != 1) end_nodes_[end_offsets_[node->pos + node->length + 1]++] = node;
+  }
+
+  node_lists_built_ = true;
+}
+
 void Lattice::SetSentence(absl::string_view sentence) {
   Clear();
 
@@ -111,25 +262,15 @@ void Lattice::SetSentence(absl::string_view sentence) {
   }
   surface_.push_back(sentence.data());
 
-  const int len = size();
-  begin_nodes_.resize(len + 1);
-  end_nodes_.resize(len + 1);
-
-  constexpr size_t kReservedNodeSize = 16;
-  for (int i = 0; i <= len; ++i) {
-    begin_nodes_[i].reserve(kReservedNodeSize);
-    end_nodes_[i].reserve(kReservedNodeSize);
-  }
-
   Node *bos = NewNode();
   bos->id = -1;
   bos->pos = 0;
-  end_nodes_[0].push_back(bos);
+  nodes_.push_back(bos);
 
   Node *eos = NewNode();
   eos->id = -1;
-  eos->pos = len;
-  begin_nodes_[len].push_back(eos);
+  eos->pos = size();
+  nodes_.push_back(eos);
 }
 
 Lattice::Node *Lattice::Insert(int pos, int length) {
@@ -139,8 +280,8 @@ Lattice::Node *Lattice::Insert(int pos, int length) {
   const int utf8_length =
       static_cast<int>(surface(pos + length) - surface(pos));
   node->piece = absl::string_view(surface(pos), utf8_length);
-  begin_nodes_[pos].push_back(node);
-  end_nodes_[pos + node->length].push_back(node);
+  nodes_.push_back(node);
+  node_lists_built_ = false;
 
   return node;
 }
@@ -149,11 +290,12 @@ std::vector<Lattice::Node *> Lattice::Viterbi() {
   const int len = size();
 
   for (int pos = 0; pos <= len; ++pos) {
-    for (Node *rnode : begin_nodes_[pos]) {
+    const NodeList lnodes = end_nodes(pos);
+    for (Node *rnode : begin_nodes(pos)) {
       rnode->prev = nullptr;
       float best_score = 0.0;
       Node *best_node = nullptr;
-      for (Node *lnode : end_nodes_[pos]) {
+      for (Node *lnode : lnodes) {
         const float score = lnode->backtrace_score + rnode->score;
         if (best_node == nullptr || score > best_score) {
           best_node = lnode;
@@ -171,7 +313,7 @@ std::vector<Lattice::Node *> Lattice::Viterbi() {
 
   // backtrace
   std::vector<Node *> results;
-  for (Node *node = begin_nodes_[len][0]->prev; node->prev != nullptr;
+  for (Node *node = eos_node()->prev; node->prev != nullptr;
        node = node->prev) {
     results.push_back(node);
   }
@@ -181,46 +323,86 @@ std::vector<Lattice::Node *> Lattice::Viterbi() {
   return results;
 }
 
+constexpr int BlockedCounts::kBlockBits;
+constexpr int BlockedCounts::kBlockSize;
+
+void BlockedCounts::Resize(int size) {
+  size_ = size;
+  blocks_.clear();
+  blocks_.resize((size + kBlockSize - 1) >> kBlockBits);
+}
+
+int BlockedCounts::num_allocated_blocks() const {
+  int n = 0;
+  for (const auto &block : blocks_) n += block != nullptr;
+  return n;
+}
+
 float Lattice::PopulateMarginal(float freq,
                                 std::vector<float> *expected) const {
+  return PopulateMarginal(1.0, freq, expected);
+}
+
+float Lattice::PopulateMarginal(float theta, float freq,
+                                std::vector<float> *expected) const {
+  return PopulateMarginalImpl(theta, freq, expected);
+}
+
+float Lattice::PopulateMarginal(float theta, float freq,
+                                BlockedCounts *expected) const {
+  return PopulateMarginalImpl(theta, freq, expected);
+}
+
+template <typename Counts>
+float Lattice::PopulateMarginalImpl(float theta, float freq,
+                                    Counts *expected) const {
   if (expected == nullptr) return 0.0;
 
   const int len = size();
 
   // alpha and beta (accumulative log prob) in Forward Backward.
-  // the index of alpha/beta is Node::node_id.
-  std::vector<float> alpha(node_allocator_.size(), 0.0);
-  std::vector<float> beta(node_allocator_.size(), 0.0);
-
+  // All nodes beginning at the same position share the same alpha, and all
+  // nodes ending at the same position share the same beta, so both are
+  // indexed by position and each pass visits every node only once.
+  // alpha[pos]: log prob of the paths from BOS to the nodes beginning at pos.
+  // beta[pos]: log prob of the paths from the nodes ending at pos to EOS.
+  std::vector<float> alpha(len + 1, 0.0);
+  std::vector<float> beta(len + 1, 0.0);
+
+  // BOS is the only node ending at 0 and EOS the only node beginning at len.
+  // Their own alpha/beta is 0.
+  std::vector<float> &terms = log_terms_;
   for (int pos = 0; pos <= len; ++pos) {
-    for (Node *rnode : begin_nodes_[pos]) {
-      for (Node *lnode : end_nodes_[pos]) {
-        alpha[rnode->node_id] = LogSumExp(alpha[rnode->node_id],
-                                          lnode->score + alpha[lnode->node_id],
-                                          lnode == end_nodes_[pos][0]);
-      }
+    const NodeList lnodes = end_nodes(pos);
+    if (lnodes.empty()) continue;
+    terms.clear();
+    for (const Node *lnode : lnodes) {
+      terms.push_back(theta * lnode->score +
+                      (pos == 0 ? 0.0f : alpha[lnode->pos]));
     }
+    alpha[pos] = LogSumExp(terms.data(), terms.size());
   }
 
   for (int pos = len; pos >= 0; --pos) {
-    for (Node *lnode : end_nodes_[pos]) {
-      for (Node *rnode : begin_nodes_[pos]) {
-        beta[lnode->node_id] =
-            LogSumExp(beta[lnode->node_id], rnode->score + beta[rnode->node_id],
-                      rnode == begin_nodes_[pos][0]);
-      }
+    const NodeList rnodes = begin_nodes(pos);
+    if (rnodes.empty()) continue;
+    terms.clear();
+    for (const Node *rnode : rnodes) {
+      terms.push_back(theta * rnode->score +
+                      (pos == len ? 0.0f : beta[rnode->pos + rnode->length]));
     }
+    beta[pos] = LogSumExp(terms.data(), terms.size());
   }
 
-  const float Z = alpha[begin_nodes_[len][0]->node_id];
+  const float Z = alpha[len];
   for (int pos = 0; pos < len; ++pos) {
-    for (Node *node : begin_nodes_[pos]) {
+    for (const Node *node : begin_nodes(pos)) {
       if (node->id >= 0) {
         // the index of |expected| is a Node::id, which is a vocabulary id.
         (*expected)[node->id] +=
-            freq *
-            std::exp(static_cast<double>(alpha[node->node_id] + node->score +
-                                         beta[node->node_id] - Z));
+            freq * std::exp(static_cast<double>(
+                       alpha[pos] + theta * node->score +
+                       beta[node->pos + node->length] - Z));
       }
     }
   }
@@ -228,14 +410,67 @@ float Lattice::PopulateMarginal(float freq,
   return freq * Z;
 }
 
+float Lattice::CalculateEntropy(float theta) const {
+  const int len = size();
+
+  // alpha[pos] is the log prob of the paths from BOS to the nodes ending at
+  // pos, as in PopulateMarginal(). entropy[pos] is the entropy of the
+  // distribution over these paths. By the chain rule, it is the entropy of
+  // the choice of the last node plus the expected entropy of the paths
+  // before it, which avoids subtracting the large log Z and the expected
+  // score of a long sentence from each other.
+  std::vector<float> alpha(len + 1, 0.0);
+  std::vector<double> entropy(len + 1, 0.0);
+  std::vector<float> &terms = log_terms_;
+  for (int pos = 1; pos <= len; ++pos) {
+    const NodeList lnodes = end_nodes(pos);
+    if (lnodes.empty()) continue;
+    terms.clear();
+    for (const Node *lnode : lnodes) {
+      terms.push_back(theta * lnode->score + alpha[lnode->pos]);
+    }
+    alpha[pos] = LogSumExp(terms.data(), terms.size());
+    double h = 0.0;
+    for (size_t i = 0; i < lnodes.size(); ++i) {
+      const double log_prob = terms[i] - alpha[pos];
+      h += std::exp(log_prob) * (entropy[lnodes[i]->pos] - log_prob);
+    }
+    entropy[pos] = h;
+  }
+
+  return entropy[len];
+}
+
+size_t Lattice::MemoryUsage() const {
+  return node_allocator_.capacity() * sizeof(Node) +
+         hypothesis_allocator_.capacity() * sizeof(Hypothesis) +
+         port::ContainerBytes(surface_) + port::ContainerBytes(nodes_) +
+         port::ContainerBytes(begin_nodes_) + port::ContainerBytes(end_nodes_) +
+         port::ContainerBytes(begin_offsets_) +
+         port::ContainerBytes(end_offsets_) + port::ContainerBytes(log_terms_) +
+         port::ContainerBytes(agenda_) + port::ContainerBytes(nbest_path_);
+}
+
 std::vector<std::vector<Lattice::Node *>> Lattice::NBest(size_t nbest_size) {
+  std::vector<std::vector<Node *>> results;
+  NBest(nbest_size, [&results](const std::vector<Node *> &path) {
+    results.push_back(path);
+    return true;
+  });
+  return results;
+}
+
+void Lattice::NBest(
+    size_t nbest_size,
+    const std::function<bool(const std::vector<Node *> &)> &fn) {
   if (nbest_size < 1) {
     LOG(WARNING) << "nbest_size >= 1. Returns empty result.";
-    return {};
+    return;
   }
 
   if (nbest_size == 1) {
-    return {Viterbi()};
+    fn(Viterbi());
+    return;
   }
 
   // Uses A* search to enumerate N-bests.
@@ -248,50 +483,70 @@ std::vector<std::vector<Lattice::Node *>> Lattice::NBest(size_t nbest_size) {
   //
   // As left-to-right Viterbi search can tell the *exact* value of h(x),
   // we can obtain the exact n-best results with A*.
-  struct Hypothesis {
-    Node *node;
-    Hypothesis *next;
-    float fx;
-    float gx;
+  //
+  // The agenda is a 4-ary max-heap on fx. It is half as deep as a binary
+  // heap, and the four children of an entry share a cache line.
+  constexpr size_t kArity = 4;
+  auto sift_down = [this](size_t i) {
+    const size_t size = agenda_.size();
+    const AgendaEntry entry = agenda_[i];
+    while (true) {
+      const size_t first = kArity * i + 1;
+      if (first >= size) break;
+      size_t best = first;
+      const size_t last = std::min(first + kArity, size);
+      for (size_t c = first + 1; c < last; ++c) {
+        if (agenda_[c].fx > agenda_[best].fx) best = c;
+      }
+      if (agenda_[best].fx <= entry.fx) break;
+      agenda_[i] = agenda_[best];
+      i = best;
+    }
+    agenda_[i] = entry;
   };
-
-  class HypothesisComparator {
-   public:
-    const bool operator()(Hypothesis *h1, Hypothesis *h2) {
-      return (h1->fx < h2->fx);
+  auto push = [this](float fx, Hypothesis *hyp) {
+    size_t i = agenda_.size();
+    agenda_.push_back(AgendaEntry());
+    while (i > 0) {
+      const size_t parent = (i - 1) / kArity;
+      if (agenda_[parent].fx >= fx) break;
+      agenda_[i] = agenda_[parent];
+      i = parent;
     }
+    agenda_[i] = {fx, hyp};
+  };
+  auto pop = [&]() {
+    Hypothesis *top = agenda_.front().hypothesis;
+    agenda_.front() = agenda_.back();
+    agenda_.pop_back();
+    if (!agenda_.empty()) sift_down(0);
+    return top;
   };
 
-  using Agenda = std::priority_queue<Hypothesis *, std::vector<Hypothesis *>,
-                                     HypothesisComparator>;
-  constexpr size_t kPreallocatedHypothesisSize = 512;
-  model::FreeList<Hypothesis> hypothesis_allocator(kPreallocatedHypothesisSize);
-
-  Agenda agenda;
-  std::vector<std::vector<Node *>> results;
+  hypothesis_allocator_.Free();
+  agenda_.clear();
+  size_t num_results = 0;
 
-  auto *eos = hypothesis_allocator.Allocate();
+  auto *eos = hypothesis_allocator_.Allocate();
   eos->node = eos_node();
   eos->next = nullptr;
-  eos->fx = eos->node->score;
   eos->gx = eos->node->score;
-  agenda.push(eos);
+  push(eos->node->score, eos);
 
   // Run Viterbi first to fill backtrace score.
   Viterbi();
 
-  while (!agenda.empty()) {
-    auto *top = agenda.top();
-    agenda.pop();
+  while (!agenda_.empty()) {
+    auto *top = pop();
     auto *node = top->node;
 
     // Reaches to BOS
     if (node == bos_node()) {
-      results.resize(results.size() + 1);
+      nbest_path_.clear();
       for (auto *n = top->next; n->next != nullptr; n = n->next) {
-        results.back().push_back(n->node);
+        nbest_path_.push_back(n->node);
       }
-      if (results.size() == nbest_size) {
+      if (!fn(nbest_path_) || ++num_results == nbest_size) {
         break;
       }
       continue;
@@ -299,74 +554,175 @@ std::vector<std::vector<Lattice::Node *>> Lattice::NBest(size_t nbest_size) {
 
     // Expands new node ending at node->pos
     for (Node *lnode : end_nodes(node->pos)) {
-      auto *hyp = hypothesis_allocator.Allocate();
+      auto *hyp = hypothesis_allocator_.Allocate();
       hyp->node = lnode;
       hyp->gx = lnode->score + top->gx;  // just adds node->score
-      hyp->fx =
-          lnode->backtrace_score + top->gx;  // backtrace_score is h(node).
       hyp->next = top;
-      agenda.push(hyp);
+      push(lnode->backtrace_score + top->gx,  // backtrace_score is h(node).
+           hyp);
     }
 
     // When the input is too long or contains duplicated phrases,
     // `agenda` will get extremely big. Here we avoid this case by
     // dynamically shrinking the agenda.
-    constexpr int kMaxAgendaSize = 100000;
-    constexpr int kMinAgendaSize = 512;
-    if (agenda.size() >= kMaxAgendaSize) {
+    constexpr size_t kMaxAgendaSize = 100000;
+    constexpr size_t kMinAgendaSize = 512;
+    if (agenda_.size() >= kMaxAgendaSize) {
       LOG(WARNING) << "Too big agenda. shrinking";
-      // Keeps the top `kMinAgendaSize` hypothesis.
-      Agenda new_agenda;
-      const int size = std::min<int>(kMinAgendaSize, nbest_size * 10);
-      for (int i = 0; i < size; ++i) {
-        new_agenda.push(agenda.top());
-        agenda.pop();
-      }
-      agenda = std::move(new_agenda);
+      // Keeps the top `kMinAgendaSize` hypothesis, selected in linear time,
+      // and rebuilds the heap on them.
+      const size_t size = std::min(kMinAgendaSize, nbest_size * 10);
+      std::nth_element(agenda_.begin(), agenda_.begin() + size - 1,
+                       agenda_.end(),
+                       [](const AgendaEntry &e1, const AgendaEntry &e2) {
+                         return e1.fx > e2.fx;
+                       });
+      agenda_.resize(size);
+      for (size_t i = (size - 1) / kArity + 1; i-- > 0;) sift_down(i);
     }
   }
-
-  return results;
 }
 
-std::vector<Lattice::Node *> Lattice::Sample(float theta) {
+void Lattice::ForwardAlgorithm(float theta, std::vector<float> *alpha) const {
   const int len = size();
-  if (len == 0) return {};
-
-  std::vector<float> alpha(node_allocator_.size(), 0.0);
+  alpha->assign(node_allocator_.size(), 0.0);
 
   for (int pos = 0; pos <= len; ++pos) {
-    for (Node *rnode : begin_nodes_[pos]) {
-      for (Node *lnode : end_nodes_[pos]) {
-        alpha[rnode->node_id] = LogSumExp(
-            alpha[rnode->node_id], theta * lnode->score + alpha[lnode->node_id],
-            lnode == end_nodes_[pos][0]);
+    const NodeList lnodes = end_nodes(pos);
+    for (Node *rnode : begin_nodes(pos)) {
+      for (Node *lnode : lnodes) {
+        (*alpha)[rnode->node_id] = LogSumExp(
+            (*alpha)[rnode->node_id],
+            theta * lnode->score + (*alpha)[lnode->node_id],
+            lnode == lnodes.front());
       }
     }
   }
+}
 
-  auto *mt = random::GetRandomGenerator();
+std::vector<Lattice::Node *> Lattice::Sample(float theta) {
+  if (size() == 0) return {};
+  return std::move(Sample(theta, 1, false)[0].first);
+}
 
-  std::vector<Node *> results;
+std::vector<std::pair<std::vector<Lattice::Node *>, float>> Lattice::Sample(
+    float theta, int num_samples, bool unique) {
+  std::vector<float> alpha;
+  ForwardAlgorithm(theta, &alpha);
+
+  auto mt = random::GetSamplingGenerator();
+
+  std::vector<std::pair<std::vector<Node *>, float>> results;
+  std::set<std::vector<Node *>> seen;
   std::vector<float> probs;
+  const float logZ = alpha[eos_node()->node_id];
+
+  for (int n = 0; n < num_samples; ++n) {
+    mt.SetSample(n);
+    std::vector<Node *> path;
+    float score = 0.0;
+    float Z = logZ;
+    Node *node = eos_node();
+    while (true) {
+      probs.clear();
+      const NodeList lnodes = end_nodes(node->pos);
+      for (const Node *lnode : lnodes) {
+        probs.push_back(std::exp(static_cast<double>(
+            alpha[lnode->node_id] + theta * lnode->score - Z)));
+      }
+      std::discrete_distribution<int> dist(probs.begin(), probs.end());
+      node = lnodes[dist(mt)];
+      if (node == bos_node()) break;
 
-  float Z = alpha[eos_node()->node_id];
-  Node *node = eos_node();
-  while (true) {
-    probs.clear();
-    for (const Node *lnode : end_nodes_[node->pos]) {
-      probs.push_back(std::exp(static_cast<double>(alpha[lnode->node_id] +
-                                                   theta * lnode->score - Z)));
+      Z = alpha[node->node_id];
+      score += node->score;
+      path.push_back(node);
     }
-    std::discrete_distribution<int> dist(probs.begin(), probs.end());
-    node = end_nodes_[node->pos][dist(*mt)];
-    if (node == bos_node()) break;
 
-    Z = alpha[node->node_id];
-    results.push_back(node);
+    std::reverse(path.begin(), path.end());
+    if (unique && !seen.insert(path).second) continue;
+    results.emplace_back(std::move(path), theta * score - logZ);
+  }
+
+  return results;
+}
+
+std::vector<std::pair<std::vector<Lattice::Node *>, float>>
+Lattice::SamplePruned(float theta, int num_samples, bool unique, float beam,
+                      float *pruned_mass) {
+  const int len = size();
+  const float log_beam = beam > 0.0 ? std::log(beam)
+                                    : -std::numeric_limits<float>::infinity();
+
+  // prefix[pos] is the log of the summed weights of the paths from BOS to
+  // pos over the kept nodes, and full[pos] the same over all nodes. The kept
+  // nodes ending at pos are kept[kept_offsets[pos], kept_offsets[pos + 1]),
+  // with the running sums of their weights relative to the largest one in
+  // `cumulative`, so that a sampling step is a binary search. Every node is
+  // visited once, as all nodes beginning at a position share their forward
+  // mass.
+  std::vector<float> prefix(len + 1, 0.0), full(len + 1, 0.0);
+  std::vector<Node *> kept;
+  std::vector<double> cumulative;
+  std::vector<uint32> kept_offsets(len + 2, 0);
+  std::vector<float> &values = log_terms_;
+  std::vector<float> full_values;
+  kept.push_back(bos_node());
+  cumulative.push_back(1.0);
+  for (int pos = 1; pos <= len; ++pos) {
+    kept_offsets[pos] = kept.size();
+    const NodeList lnodes = end_nodes(pos);
+    values.clear();
+    full_values.clear();
+    float vmax = -std::numeric_limits<float>::infinity();
+    for (const Node *lnode : lnodes) {
+      values.push_back(prefix[lnode->pos] + theta * lnode->score);
+      full_values.push_back(full[lnode->pos] + theta * lnode->score);
+      vmax = std::max(vmax, values.back());
+    }
+    full[pos] = LogSumExp(full_values.data(), full_values.size());
+
+    double sum = 0.0;
+    for (size_t i = 0; i < lnodes.size(); ++i) {
+      if (values[i] < vmax + log_beam) continue;
+      sum += std::exp(static_cast<double>(values[i] - vmax));
+      kept.push_back(lnodes[i]);
+      cumulative.push_back(sum);
+    }
+    prefix[pos] = vmax + std::log(sum);
+  }
+  kept_offsets[len + 1] = kept.size();
+
+  const float logZ = prefix[len];
+  if (pruned_mass != nullptr) {
+    *pruned_mass = std::max(
+        0.0, 1.0 - std::exp(static_cast<double>(logZ) - full[len]));
+  }
+
+  auto mt = random::GetSamplingGenerator();
+  std::vector<std::pair<std::vector<Node *>, float>> results;
+  std::set<std::vector<Node *>> seen;
+  for (int n = 0; n < num_samples; ++n) {
+    mt.SetSample(n);
+    std::vector<Node *> path;
+    float score = 0.0;
+    int pos = len;
+    while (pos > 0) {
+      const auto begin = cumulative.begin() + kept_offsets[pos];
+      const auto end = cumulative.begin() + kept_offsets[pos + 1];
+      std::uniform_real_distribution<double> dist(0.0, *(end - 1));
+      const auto it = std::min(std::upper_bound(begin, end, dist(mt)), end - 1);
+      Node *node = kept[it - cumulative.begin()];
+      score += node->score;
+      path.push_back(node);
+      pos = node->pos;
+    }
+
+    std::reverse(path.begin(), path.end());
+    if (unique && !seen.insert(path).second) continue;
+    results.emplace_back(std::move(path), theta * score - logZ);
   }
 
-  std::reverse(results.begin(), results.end());
   return results;
 }
 
@@ -374,38 +730,39 @@ std::vector<Lattice::Node *> Lattice::Sample(float theta) {
 // Model::~Model() {}
 
 void Model::PopulateNodes(Lattice *lattice) const {
-  auto get_chars_length = [&lattice](int begin_pos, const char *end) {
-    int pos = begin_pos;
-    while (lattice->surface(pos) < end) ++pos;
-    return pos - begin_pos;
-  };
+  PopulateNodes(lattice, vocabulary_.get());
+}
 
+void Model::PopulateNodes(Lattice *lattice,
+                          const VocabularyMask *vocabulary) const {
   const float unk_score = min_score() - kUnkPenalty;
 
   const int len = lattice->size();
   const char *end = lattice->sentence() + lattice->utf8_size();
-
-  // +1 just in case.
-  std::vector<Darts::DoubleArray::result_pair_type> trie_results(
-      trie_results_size_ + 1);
+  const int *trie_ids = trie_ids_.empty() ? nullptr : trie_ids_.data();
 
   for (int begin_pos = 0; begin_pos < len; ++begin_pos) {
     const char *begin = lattice->surface(begin_pos);
 
-    // Finds all pieces which are prefix of surface(begin_pos).
-    const size_t num_nodes = trie_->commonPrefixSearch(
-        begin, trie_results.data(), trie_results.size(),
-        static_cast<int>(end - begin));
-    CHECK_LT(num_nodes, trie_results.size());
-
+    // Walks the trie along surface(begin_pos) byte by byte, which visits
+    // the pieces that are prefixes of it from the shortest one. No piece is
+    // longer than max_piece_size_.
+    const size_t key_end =
+        std::min<size_t>(end - begin, static_cast<size_t>(max_piece_size_));
+    size_t node_pos = 0;
+    size_t key_pos = 0;
+    int length = 0;  // The number of characters in [begin, begin + key_pos).
     bool has_single_node = false;
 
     // Inserts pieces to the lattice.
-    for (size_t k = 0; k < num_nodes; ++k) {
-      const int length =
-          get_chars_length(begin_pos, begin + trie_results[k].length);
-      const int id = trie_results[k].value;
-      if (IsUnusedInlined(id)) continue;
+    while (key_pos < key_end) {
+      const int value = trie_->traverse(begin, node_pos, key_pos, key_pos + 1);
+      if (value == -2) break;
+      if (value < 0) continue;
+      const int id = trie_ids == nullptr ? value : trie_ids[value];
+      if (id < 0) continue;
+      while (lattice->surface(begin_pos + length) < begin + key_pos) ++length;
+      if (IsUnusedInlined(id, vocabulary)) continue;
       Lattice::Node *node = lattice->Insert(begin_pos, length);
       node->id = id;  // the value of Trie stores vocab_id.
       // User defined symbol receives extra bonus to always be selected.
@@ -424,16 +781,6 @@ void Model::PopulateNodes(Lattice *lattice) const {
   }
 }
 
-int Model::PieceToId(absl::string_view piece) const {
-  auto it = reserved_id_map_.find(piece);
-  if (it != reserved_id_map_.end()) {
-    return it->second;
-  }
-  int id = 0;
-  trie_->exactMatchSearch(piece.data(), id, piece.size());
-  return id == -1 ? unk_id_ : id;
-}
-
 void Model::BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces) {
   if (!status().ok()) return;
 
@@ -466,10 +813,13 @@ void Model::BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces) {
   std::vector<Darts::DoubleArray::result_pair_type> results(
       kMaxTrieResultsSize);
   trie_results_size_ = 0;
+  max_piece_size_ = 0;
   for (const auto &p : *pieces) {
     const int num_nodes = trie_->commonPrefixSearch(
         p.first.data(), results.data(), results.size(), p.first.size());
     trie_results_size_ = std::max(trie_results_size_, num_nodes);
+    max_piece_size_ =
+        std::max(max_piece_size_, static_cast<int>(p.first.size()));
   }
 
   pieces_.clear();
@@ -478,11 +828,52 @@ void Model::BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces) {
     status_ = util::InternalError("no entry is found in the trie.");
 }
 
-Model::Model(const ModelProto &model_proto) {
-  model_proto_ = &model_proto;
+void Model::SetTrie(absl::string_view trie_array, int trie_results_size) {
+  if (!status().ok()) return;
 
-  InitializePieces();
+  trie_ = absl::make_unique<Darts::DoubleArray>();
+  if (trie_array.empty() || trie_array.size() % trie_->unit_size() != 0 ||
+      trie_results_size <= 0) {
+    status_ = util::InternalError("invalid precompiled double-array.");
+    return;
+  }
+
+#ifdef IS_BIG_ENDIAN
+  trie_buffer_.assign(trie_array.data(), trie_array.size());
+  uint32 *data = reinterpret_cast<uint32 *>(&trie_buffer_[0]);
+  for (size_t i = 0; i < trie_buffer_.size() / 4; ++i)
+    data[i] = util::Swap32(data[i]);
+  trie_array = trie_buffer_;
+#endif
+
+  trie_->set_array(trie_array.data(), trie_array.size() / trie_->unit_size());
+  trie_results_size_ = trie_results_size;
+
+  // Checked before any lookup, as the array is read without bounds checks.
+  if (!IsValidTrie(static_cast<const uint32_t *>(trie_->array()),
+                   trie_->size(), model_proto_->pieces_size())) {
+    status_ = util::InternalError("invalid precompiled double-array.");
+    return;
+  }
+
+  // The trie must be the one built from the same pieces.
+  max_piece_size_ = 0;
+  for (const auto &it : pieces_) {
+    max_piece_size_ =
+        std::max(max_piece_size_, static_cast<int>(it.first.size()));
+    int id = -1;
+    trie_->exactMatchSearch(it.first.data(), id, it.first.size());
+    if (id != it.second) {
+      status_ = util::InternalError(
+          "precompiled double-array does not match the pieces.");
+      return;
+    }
+  }
 
+  pieces_.clear();
+}
+
+void Model::InitializeScores() {
   min_score_ = FLT_MAX;
   max_score_ = FLT_MIN;
   for (const auto &sp : model_proto_->pieces()) {
@@ -491,6 +882,13 @@ Model::Model(const ModelProto &model_proto) {
       max_score_ = std::max(max_score_, sp.score());
     }
   }
+}
+
+Model::Model(const ModelProto &model_proto) {
+  model_proto_ = &model_proto;
+
+  InitializePieces();
+  InitializeScores();
 
   std::vector<std::pair<absl::string_view, int>> pieces;
   for (const auto &it : pieces_) pieces.emplace_back(it.first, it.second);
@@ -498,53 +896,105 @@ Model::Model(const ModelProto &model_proto) {
   BuildTrie(&pieces);
 }
 
+Model::Model(const ModelProto &model_proto, absl::string_view trie_array,
+             int trie_results_size) {
+  model_proto_ = &model_proto;
+
+  InitializePieces();
+  InitializeScores();
+  SetTrie(trie_array, trie_results_size);
+}
+
+absl::string_view Model::trie_array() const {
+  if (trie_ == nullptr) return absl::string_view();
+  return absl::string_view(static_cast<const char *>(trie_->array()),
+                           trie_->total_size());
+}
+
 Model::~Model() {}
 
 EncodeResult Model::Encode(absl::string_view normalized) const {
+  return EncodeWithVocabulary(normalized, nullptr);
+}
+
+EncodeResult Model::EncodeWithVocabulary(
+    absl::string_view normalized, const VocabularyMask *vocabulary) const {
+  EncodeResult results;
+  EncodeInto(normalized, vocabulary, &results);
+  return results;
+}
+
+void Model::EncodeInto(absl::string_view normalized,
+                       const VocabularyMask *vocabulary,
+                       EncodeResult *results) const {
+  vocabulary = ActiveVocabulary(vocabulary);
   if (encoder_version_ == EncoderVersion::kOptimized) {
-    return EncodeOptimized(normalized);
+    // The word cache holds the segmentations of the full vocabulary.
+    if (vocabulary == nullptr &&
+        EncodeWords(normalized,
+                    [this](absl::string_view word, EncodeResult *result) {
+                      EncodeOptimized(word, nullptr, result);
+                    },
+                    results)) {
+      return;
+    }
+    EncodeOptimized(normalized, vocabulary, results);
+    return;
   }
 
+  results->clear();
   if (!status().ok() || normalized.empty()) {
-    return {};
+    return;
   }
 
-  Lattice lattice;
+  std::unique_ptr<Lattice> local;
+  Lattice &lattice = *GetLattice(&local);
   lattice.SetSentence(normalized);
-  PopulateNodes(&lattice);
+  PopulateNodes(&lattice, vocabulary);
 
-  EncodeResult results;
   for (const auto *node : lattice.Viterbi()) {
-    results.emplace_back(node->piece, node->id);
+    results->emplace_back(node->piece, node->id);
   }
-
-  return results;
 }
 
 NBestEncodeResult Model::NBestEncode(absl::string_view normalized,
                                      int nbest_size) const {
+  NBestEncodeResult nbest_results;
+  VisitNBestEncode(normalized, nbest_size,
+                   [&nbest_results](const EncodeResult &result, float score) {
+                     nbest_results.emplace_back(result, score);
+                     return true;
+                   });
+  return nbest_results;
+}
+
+void Model::VisitNBestEncode(
+    absl::string_view normalized, int nbest_size,
+    const std::function<bool(const EncodeResult &, float)> &fn) const {
   if (!status().ok() || normalized.empty()) {
-    return {{{}, 0.0}};
+    fn({}, 0.0);
+    return;
   }
 
   nbest_size = std::max<int>(1, std::min<int>(nbest_size, 1024));
 
-  Lattice lattice;
+  std::unique_ptr<Lattice> local;
+  Lattice &lattice = *GetLattice(&local);
   lattice.SetSentence(normalized);
   PopulateNodes(&lattice);
 
-  NBestEncodeResult nbest_results;
-  for (const auto &nbest : lattice.NBest(nbest_size)) {
-    EncodeResult results;
-    float score = 0.0;
-    for (const auto *node : nbest) {
-      score += node->score;
-      results.emplace_back(node->piece, node->id);
-    }
-    nbest_results.emplace_back(results, score);
-  }
-
-  return nbest_results;
+  // One buffer for all the results.
+  EncodeResult results;
+  lattice.NBest(nbest_size,
+                [&results, &fn](const std::vector<Lattice::Node *> &nbest) {
+                  results.clear();
+                  float score = 0.0;
+                  for (const auto *node : nbest) {
+                    score += node->score;
+                    results.emplace_back(node->piece, node->id);
+                  }
+                  return fn(results, score);
+                });
 }
 
 EncodeResult Model::SampleEncode(absl::string_view normalized,
@@ -553,18 +1003,106 @@ EncodeResult Model::SampleEncode(absl::string_view normalized,
     return {};
   }
 
-  Lattice lattice;
+  std::unique_ptr<Lattice> local;
+  Lattice &lattice = *GetLattice(&local);
   lattice.SetSentence(normalized);
   PopulateNodes(&lattice);
 
   EncodeResult results;
-  for (const auto *node : lattice.Sample(theta)) {
+  const std::vector<Lattice::Node *> path =
+      sample_beam() > 0.0
+          ? std::move(SamplePruned(&lattice, theta, 1, false)[0].first)
+          : lattice.Sample(theta);
+  for (const auto *node : path) {
     results.emplace_back(node->piece, node->id);
   }
 
   return results;
 }
 
+NBestEncodeResult Model::SampleEncodeAndScore(absl::string_view normalized,
+                                              float theta, int num_samples,
+                                              bool unique) const {
+  num_samples = std::max(num_samples, 0);
+  if (!status().ok() || normalized.empty()) {
+    return NBestEncodeResult(unique ? std::min(num_samples, 1) : num_samples,
+                             {{}, 0.0});
+  }
+
+  std::unique_ptr<Lattice> local;
+  Lattice &lattice = *GetLattice(&local);
+  lattice.SetSentence(normalized);
+  PopulateNodes(&lattice);
+
+  NBestEncodeResult samples;
+  for (const auto &sample :
+       sample_beam() > 0.0
+           ? SamplePruned(&lattice, theta, num_samples, unique)
+           : lattice.Sample(theta, num_samples, unique)) {
+    EncodeResult results;
+    for (const auto *node : sample.first) {
+      results.emplace_back(node->piece, node->id);
+    }
+    samples.emplace_back(std::move(results), sample.second);
+  }
+
+  return samples;
+}
+
+std::vector<std::pair<std::vector<Lattice::Node *>, float>>
+Model::SamplePruned(Lattice *lattice, float theta, int num_samples,
+                    bool unique) const {
+  float pruned_mass = 0.0;
+  auto samples = lattice->SamplePruned(theta, num_samples, unique,
+                                       sample_beam(), &pruned_mass);
+  stats::Add(stats::kSamplePrunedMass,
+             static_cast<uint64>(std::llround(pruned_mass * 1e9)));
+  return samples;
+}
+
+void Model::AddMemoryUsage(MemoryUsage *usage) const {
+  ModelInterface::AddMemoryUsage(usage);
+  // A trie set on a precompiled model points into it and owns nothing.
+  if (trie_ != nullptr) usage->model_tries += trie_->owned_size();
+  usage->model_tries += port::ContainerBytes(trie_ids_);
+#ifdef IS_BIG_ENDIAN
+  usage->model_tries += port::ContainerBytes(trie_buffer_);
+#endif
+#ifndef SPM_NO_THREADLOCAL
+  std::unique_ptr<Lattice> local_lattice;
+  std::unique_ptr<std::vector<BestPathNode>> local_best_paths;
+  usage->thread_buffers +=
+      GetLattice(&local_lattice)->MemoryUsage() +
+      port::ContainerBytes(*GetBestPaths(&local_best_paths));
+#endif  // SPM_NO_THREADLOCAL
+}
+
+float Model::CalculateEntropy(absl::string_view normalized,
+                              float theta) const {
+  if (!status().ok() || normalized.empty()) {
+    return 0.0;
+  }
+
+  std::unique_ptr<Lattice> local;
+  Lattice &lattice = *GetLattice(&local);
+  lattice.SetSentence(normalized);
+  PopulateNodes(&lattice);
+  return lattice.CalculateEntropy(theta);
+}
+
+void Model::PopulateMarginals(absl::string_view normalized, float theta,
+                              std::vector<float> *marginals) const {
+  if (!status().ok() || normalized.empty()) {
+    return;
+  }
+
+  std::unique_ptr<Lattice> local;
+  Lattice &lattice = *GetLattice(&local);
+  lattice.SetSentence(normalized);
+  PopulateNodes(&lattice);
+  lattice.PopulateMarginal(theta, 1.0, marginals);
+}
+
 bool Model::VerifyOutputsEquivalent(absl::string_view expected,
                                     absl::string_view actual) const {
   auto compute_unigram_model_score =
@@ -597,7 +1135,50 @@ bool Model::VerifyOutputsEquivalent(absl::string_view expected,
   return true;
 }
 
-EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
+bool Model::ExportFlatViterbi(FlatViterbiModel *flat) const {
+  if (!status().ok() || trie_ == nullptr ||
+      encoder_version_ != EncoderVersion::kOptimized) {
+    return false;
+  }
+  const absl::string_view trie = trie_array();
+  flat->trie.resize(trie.size() / sizeof(uint32));
+  memcpy(flat->trie.data(), trie.data(), flat->trie.size() * sizeof(uint32));
+  // The same pieces as EncodeOptimized() with the active vocabulary.
+  const VocabularyMask *vocabulary = ActiveVocabulary(nullptr);
+  const int size = GetPieceSize();
+  flat->scores.resize(size);
+  flat->kinds.resize(size);
+  for (int id = 0; id < size; ++id) {
+    flat->scores[id] = GetScoreInlined(id);
+    flat->kinds[id] = IsUnusedInlined(id, vocabulary) ? kFlatUnused
+                      : IsUserDefinedInlined(id)      ? kFlatUserDefined
+                                                      : kFlatNormal;
+  }
+  flat->unk_id = unk_id_;
+  flat->unk_score = min_score() - kUnkPenalty;
+  flat->max_score = max_score_;
+  flat->max_piece_size = max_piece_size_;
+  return true;
+}
+
+void Model::EncodeCompact(absl::string_view normalized,
+                          const VocabularyMask *vocabulary,
+                          EncodeResult *pieces,
+                          CompactEncodeResult *result) const {
+  vocabulary = ActiveVocabulary(vocabulary);
+  // The word cache stores EncodeResults.
+  if (encoder_version_ != EncoderVersion::kOptimized ||
+      (vocabulary == nullptr && word_cache_size() > 0)) {
+    ModelInterface::EncodeCompact(normalized, vocabulary, pieces, result);
+    return;
+  }
+  EncodeOptimized(normalized, vocabulary, result);
+}
+
+template <typename ResultT>
+void Model::EncodeOptimized(absl::string_view normalized,
+                            const VocabularyMask *vocabulary,
+                            ResultT *results) const {
   // An optimized Viterbi algorithm for unigram language models. Benchmarking
   // results show that it generates almost identical outputs and achieves 2.1x
   // speedup on average for 102 languages compared to the original
@@ -650,41 +1231,81 @@ EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
   // `Lattice::Node` used by the original encoder, but here in the optimized
   // encoder we only need to define 3 fields in `BestPathNode`.
 
+  results->clear();
   if (!status().ok() || normalized.empty()) {
-    return {};
+    return;
   }
-  // Represents the last node of the best path.
-  struct BestPathNode {
-    int id = -1;  // The vocab id. (maybe -1 for UNK)
-    float best_path_score =
-        0;  // The total score of the best path ending at this node.
-    int starts_at =
-        -1;  // The starting position (in utf-8) of this node. The entire best
-             // path can be constructed by backtracking along this link.
-  };
   const int size = normalized.size();
   const float unk_score = min_score() - kUnkPenalty;
-  // The ends are exclusive.
-  std::vector<BestPathNode> best_path_ends_at(size + 1);
+  // The best paths are stored for the positions from `base`, i.e.,
+  // best_path_ends_at[i] is the best path ending at `base + i`. When no node
+  // found so far ends after `starts_at`, every path goes through `starts_at`,
+  // so the best path up to it is final. Once kMaxBufferedBytes are stored,
+  // that path is emitted at such a position and the buffer restarts from
+  // there, which bounds the memory for long inputs.
+  constexpr int kMaxBufferedBytes = 8192;
+  int base = 0;
+  int max_ends_at = 0;  // The maximum end of the nodes found so far.
+  // The ends are exclusive. The buffer of the calling thread is reused.
+  std::unique_ptr<std::vector<BestPathNode>> local;
+  std::vector<BestPathNode> &best_path_ends_at = *GetBestPaths(&local);
+  best_path_ends_at.assign(std::min(size, kMaxBufferedBytes) + 1,
+                           BestPathNode());
+  auto node_ends_at = [&](int pos) -> BestPathNode & {
+    const size_t index = pos - base;
+    if (index >= best_path_ends_at.size()) {
+      best_path_ends_at.resize(std::max(index + 1, 2 * index));
+    }
+    return best_path_ends_at[index];
+  };
+  // Backtracks from `end` to `base` and appends the best path to `results`.
+  auto emit_best_path = [&](int end) {
+    const size_t first = results->size();
+    int ends_at = end;
+    while (ends_at > base) {
+      const auto &node = best_path_ends_at[ends_at - base];
+      AppendPiece(normalized, node.starts_at, ends_at - node.starts_at, node.id,
+                  results);
+      ends_at = node.starts_at;
+    }
+    std::reverse(results->begin() + first, results->end());
+  };
   // Generate lattice on-the-fly (not stored) and update best_path_ends_at.
   int starts_at = 0;
   while (starts_at < size) {
+    if (starts_at - base >= kMaxBufferedBytes && max_ends_at <= starts_at) {
+      emit_best_path(starts_at);
+      const BestPathNode last = best_path_ends_at[starts_at - base];
+      std::fill(best_path_ends_at.begin(),
+                best_path_ends_at.begin() + (starts_at - base) + 1,
+                BestPathNode());
+      best_path_ends_at[0] = last;
+      base = starts_at;
+    }
     std::size_t node_pos = 0;
     std::size_t key_pos = starts_at;
     const auto best_path_score_till_here =
-        best_path_ends_at[starts_at].best_path_score;
+        node_ends_at(starts_at).best_path_score;
     bool has_single_node = false;
     const int mblen =
         std::min<int>(string_util::OneCharLen(normalized.data() + starts_at),
                       size - starts_at);
-    while (key_pos < size) {
+    const std::size_t key_end = std::min(size, starts_at + max_piece_size_);
+    // The units of the transitions from the root are shared by every
+    // position, but the deeper ones of a large trie are rarely in cache.
+    // Fetching the second transition of the next position overlaps its miss
+    // with the traversal from this one.
+    if (starts_at + mblen + 2 <= size) {
+      trie_->prefetch(normalized.data() + starts_at + mblen, 2);
+    }
+    while (key_pos < key_end) {
       const int ret =
           trie_->traverse(normalized.data(), node_pos, key_pos, key_pos + 1);
       if (ret == -2) break;
       if (ret >= 0) {
-        if (IsUnusedInlined(ret)) continue;
+        if (IsUnusedInlined(ret, vocabulary)) continue;
         // Update the best path node.
-        auto &target_node = best_path_ends_at[key_pos];
+        auto &target_node = node_ends_at(key_pos);
         const auto length = (key_pos - starts_at);
         // User defined symbol receives extra bonus to always be selected.
         const auto score = IsUserDefinedInlined(ret)
@@ -698,13 +1319,14 @@ EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
           target_node.starts_at = starts_at;
           target_node.id = ret;
         }
+        max_ends_at = std::max<int>(max_ends_at, key_pos);
         if (!has_single_node && length == mblen) {
           has_single_node = true;
         }
       }
     }
     if (!has_single_node) {
-      auto &target_node = best_path_ends_at[starts_at + mblen];
+      auto &target_node = node_ends_at(starts_at + mblen);
       const auto candidate_best_path_score =
           unk_score + best_path_score_till_here;
       if (target_node.starts_at == -1 ||
@@ -713,21 +1335,13 @@ EncodeResult Model::EncodeOptimized(absl::string_view normalized) const {
         target_node.starts_at = starts_at;
         target_node.id = unk_id_;
       }
+      max_ends_at = std::max(max_ends_at, starts_at + mblen);
     }
     // Move by one unicode character.
     starts_at += mblen;
   }
   // Backtrack to identify the best path.
-  EncodeResult results;
-  int ends_at = size;
-  while (ends_at > 0) {
-    const auto &node = best_path_ends_at[ends_at];
-    results.emplace_back(
-        normalized.substr(node.starts_at, ends_at - node.starts_at), node.id);
-    ends_at = node.starts_at;
-  }
-  std::reverse(results.begin(), results.end());
-  return results;
+  emit_best_path(size);
 }
 }  // namespace unigram
 }  // namespace sentencepiece
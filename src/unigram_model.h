@@ -15,6 +15,7 @@
 #ifndef UNIGRAM_MODEL_H_
 #define UNIGRAM_MODEL_H_
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <utility>
@@ -29,6 +30,48 @@
 namespace sentencepiece {
 namespace unigram {
 
+// Returns log(sum_i exp(values[i])) for size > 0. The exponentials are
+// computed with a polynomial approximation in float, written as a plain loop
+// over `values` so that the compiler can vectorize it. The relative error of
+// each exponential is below 2e-7.
+float LogSumExp(const float *values, size_t size);
+
+// Counts indexed by vocab id, stored in blocks of kBlockSize ids that are
+// allocated and zeroed when one of their ids is first touched. The E step
+// of the trainer keeps one per thread, so that the threads only pay for the
+// parts of a large vocabulary their lattices hit.
+class BlockedCounts {
+ public:
+  static constexpr int kBlockBits = 8;
+  static constexpr int kBlockSize = 1 << kBlockBits;
+
+  BlockedCounts() = default;
+  explicit BlockedCounts(int size) { Resize(size); }
+
+  // Drops all blocks and makes room for |size| ids.
+  void Resize(int size);
+
+  float &operator[](int id) {
+    std::unique_ptr<float[]> &block = blocks_[id >> kBlockBits];
+    if (!block) block.reset(new float[kBlockSize]());
+    return block[id & (kBlockSize - 1)];
+  }
+
+  int size() const { return size_; }
+  int num_blocks() const { return static_cast<int>(blocks_.size()); }
+
+  // Returns the |index|-th block, or nullptr if none of its ids has been
+  // touched. The last block may be longer than the remaining ids.
+  const float *block(int index) const { return blocks_[index].get(); }
+
+  // Returns the number of allocated blocks.
+  int num_allocated_blocks() const;
+
+ private:
+  int size_ = 0;
+  std::vector<std::unique_ptr<float[]>> blocks_;
+};
+
 // Lattice represents a search space of sentence piece segmentation.
 class Lattice {
  public:
@@ -48,6 +91,23 @@ class Lattice {
     std::string DebugString() const;
   };
 
+  // Contiguous nodes of one position. It stays valid until the next call
+  // of Insert(), SetSentence() or Clear().
+  class NodeList {
+   public:
+    NodeList(Node *const *begin, Node *const *end) : begin_(begin), end_(end) {}
+    Node *const *begin() const { return begin_; }
+    Node *const *end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+    Node *front() const { return *begin_; }
+    Node *operator[](size_t index) const { return begin_[index]; }
+
+   private:
+    Node *const *begin_;
+    Node *const *end_;
+  };
+
   // Returns bos node.
   Node *bos_node() const;
 
@@ -55,10 +115,10 @@ class Lattice {
   Node *eos_node() const;
 
   // Returns nodes starting at |pos|.
-  const std::vector<Node *> &begin_nodes(int pos) const;
+  NodeList begin_nodes(int pos) const;
 
   // Returns nodes ending at |pos|.
-  const std::vector<Node *> &end_nodes(int pos) const;
+  NodeList end_nodes(int pos) const;
 
   // Returns Unicode character length.
   int size() const;
@@ -88,11 +148,37 @@ class Lattice {
   // Returns n-best results.
   std::vector<std::vector<Node *>> NBest(size_t nbest_size);
 
+  // Calls `fn` with the n-best paths, best first, as the search finds them,
+  // until `nbest_size` paths are found or `fn` returns false. The path
+  // passed to `fn` is only valid during the call.
+  void NBest(size_t nbest_size,
+             const std::function<bool(const std::vector<Node *> &)> &fn);
+
   // Samples one path from the lattice according to the
   // generation probability (Product of piece probabilities).
   // `theta` is a smoothing parameter.
   std::vector<Node *> Sample(float theta);
 
+  // Samples `num_samples` paths with a single forward pass and returns each
+  // path with its log-probability under the distribution used by Sample().
+  // When `unique` is true, repeated paths are returned only once, so the
+  // result can have fewer than `num_samples` paths.
+  std::vector<std::pair<std::vector<Node *>, float>> Sample(float theta,
+                                                            int num_samples,
+                                                            bool unique);
+
+  // Same as above, but prunes the forward pass with a relative beam: a node
+  // is dropped when its forward mass is below `beam` times the largest
+  // forward mass of the nodes ending at the same position. The paths are
+  // drawn exactly from the distribution restricted to the remaining nodes,
+  // with their log-probabilities under it. Stores in `pruned_mass` the
+  // probability of the dropped paths under the unpruned distribution if it
+  // is not nullptr. `beam` is in [0, 1], and 0 drops nothing. All nodes
+  // must be populated in advance.
+  std::vector<std::pair<std::vector<Node *>, float>> SamplePruned(
+      float theta, int num_samples, bool unique, float beam,
+      float *pruned_mass);
+
   // Populates marginal probability of every node in this lattice.
   // |freq| is the frequency of the sentence.
   //  for (auto *node : all_nodes_) {
@@ -101,34 +187,139 @@ class Lattice {
   // Returns the log-likelihood of this sentence.
   float PopulateMarginal(float freq, std::vector<float> *expected) const;
 
+  // Same as above, but scales the scores of the nodes by `theta` as
+  // Sample(theta) does.
+  float PopulateMarginal(float theta, float freq,
+                         std::vector<float> *expected) const;
+
+  // Same as above, but adds the marginals to blocked counts.
+  float PopulateMarginal(float theta, float freq,
+                         BlockedCounts *expected) const;
+
+  // Returns the entropy of the distribution over the paths that
+  // Sample(theta) draws from.
+  float CalculateEntropy(float theta) const;
+
+  // Returns the bytes of the buffers this lattice keeps for the next
+  // sentences.
+  size_t MemoryUsage() const;
+
  private:
+  // Partial path from EOS used in the A* search of NBest().
+  struct Hypothesis {
+    Node *node;
+    Hypothesis *next;
+    float gx;
+  };
+
+  // An entry of the agenda of NBest(). The priority is stored next to the
+  // hypothesis so that the heap operations do not dereference it.
+  struct AgendaEntry {
+    float fx;
+    Hypothesis *hypothesis;
+  };
+
   // Returns new node.
   // Lattice class has the ownership of the returned value.
   Node *NewNode();
 
+  // Groups nodes_ by their begin and end positions, unless it is done
+  // already since the last Insert().
+  void BuildNodeLists() const;
+
   absl::string_view sentence_;
   std::vector<const char *> surface_;
-  std::vector<std::vector<Node *>> begin_nodes_;
-  std::vector<std::vector<Node *>> end_nodes_;
   model::FreeList<Node> node_allocator_;
+
+  // All nodes in the order of insertion. BOS and EOS come first.
+  std::vector<Node *> nodes_;
+
+  // Nodes beginning at pos are
+  // begin_nodes_[begin_offsets_[pos], begin_offsets_[pos + 1]), in the order
+  // of insertion. end_nodes_ is laid out in the same way. They are rebuilt
+  // from nodes_ on demand and keep their capacity across sentences.
+  mutable std::vector<Node *> begin_nodes_;
+  mutable std::vector<Node *> end_nodes_;
+  mutable std::vector<uint32> begin_offsets_;
+  mutable std::vector<uint32> end_offsets_;
+  mutable bool node_lists_built_ = false;
+
+  template <typename Counts>
+  float PopulateMarginalImpl(float theta, float freq, Counts *expected) const;
+
+  // Scratch buffer for the terms of a log-sum-exp in PopulateMarginal.
+  mutable std::vector<float> log_terms_;
+
+  // Fills (*alpha)[node_id] with the forward log-probabilities of every
+  // node for Sample(), excluding the score of the node itself.
+  void ForwardAlgorithm(float theta, std::vector<float> *alpha) const;
+
+  // Hypotheses, the agenda (a 4-ary max-heap on fx) and the path buffer of
+  // NBest(). They are kept so that repeated n-best searches reuse their
+  // memory.
+  model::FreeList<Hypothesis> hypothesis_allocator_;
+  std::vector<AgendaEntry> agenda_;
+  std::vector<Node *> nbest_path_;
 };
 
 class Model : public ModelInterface {
  public:
   explicit Model(const ModelProto &model_proto);
+
+  // Uses |trie_array|, the units of the double-array trie returned by
+  // trie_array() of a model built from |model_proto|, instead of building
+  // the trie. |trie_array| is not copied and should not be deleted until
+  // Model is destroyed.
+  Model(const ModelProto &model_proto, absl::string_view trie_array,
+        int trie_results_size);
   Model() {}
   ~Model() override;
 
   EncodeResult Encode(absl::string_view normalized) const override;
 
+  EncodeResult EncodeWithVocabulary(
+      absl::string_view normalized,
+      const VocabularyMask *vocabulary) const override;
+
+  void EncodeInto(absl::string_view normalized,
+                  const VocabularyMask *vocabulary,
+                  EncodeResult *result) const override;
+
+  void EncodeCompact(absl::string_view normalized,
+                     const VocabularyMask *vocabulary, EncodeResult *pieces,
+                     CompactEncodeResult *result) const override;
+
   NBestEncodeResult NBestEncode(absl::string_view normalized,
                                 int nbest_size) const override;
 
+  void VisitNBestEncode(
+      absl::string_view normalized, int nbest_size,
+      const std::function<bool(const EncodeResult &, float)> &fn)
+      const override;
+
   EncodeResult SampleEncode(absl::string_view normalized,
                             float theta) const override;
 
+  NBestEncodeResult SampleEncodeAndScore(absl::string_view normalized,
+                                         float theta, int num_samples,
+                                         bool unique) const override;
+
   bool IsSampleEncodeAvailable() const override { return true; }
 
+  bool IsSampleEncodeAndScoreAvailable() const override { return true; }
+
+  float CalculateEntropy(absl::string_view normalized,
+                         float theta) const override;
+
+  void PopulateMarginals(absl::string_view normalized, float theta,
+                         std::vector<float> *marginals) const override;
+
+  bool IsLatticeStatisticsAvailable() const override { return true; }
+
+  void AddMemoryUsage(MemoryUsage *usage) const override;
+
+  bool ExportFlatViterbi(FlatViterbiModel *flat) const override;
+
   bool IsNBestEncodeAvailable() const override { return true; }
 
   // Returns the minimum score in sentence pieces.
@@ -144,8 +335,15 @@ class Model : public ModelInterface {
   // best segmentation.
   void PopulateNodes(Lattice *lattice) const;
 
-  // Returns a vocab id of |piece|.
-  int PieceToId(absl::string_view piece) const override;
+  // Same as PopulateNodes(lattice), but skips the pieces `vocabulary` marks
+  // as unused, or the UNUSED pieces when `vocabulary` is nullptr.
+  void PopulateNodes(Lattice *lattice, const VocabularyMask *vocabulary) const;
+
+  // Returns the units of the double-array trie in the host byte order.
+  absl::string_view trie_array() const;
+
+  // Returns the maximum number of shared prefixes in the trie.
+  int trie_results_size() const { return trie_results_size_; }
 
   // Verifies if two outputs are equivalent by comparing their scores.
   bool VerifyOutputsEquivalent(absl::string_view expected,
@@ -155,6 +353,12 @@ class Model : public ModelInterface {
   // Builds a Trie index.
   void BuildTrie(std::vector<std::pair<absl::string_view, int>> *pieces);
 
+  // Uses the prebuilt double-array |trie_array|. See the constructor.
+  void SetTrie(absl::string_view trie_array, int trie_results_size);
+
+  // Computes min_score_ and max_score_.
+  void InitializeScores();
+
   // The optimized Viterbi encode.
   // Main differences from the original function:
   // 1. Memorizes the best path at each postion so far,
@@ -164,7 +368,17 @@ class Model : public ModelInterface {
   // 5. Does not depend on `class Lattice` nor call `SetSentence()`,
   // `PopulateNodes()`, or `Viterbi()`. It does everything in one function.
   // For detailed explanations please see the comments inside the function body.
-  EncodeResult EncodeOptimized(absl::string_view normalized) const;
+  // Pieces are restricted to `vocabulary` as in PopulateNodes(). The pieces
+  // are stored in `results`, an EncodeResult or a CompactEncodeResult.
+  template <typename ResultT>
+  void EncodeOptimized(absl::string_view normalized,
+                       const VocabularyMask *vocabulary,
+                       ResultT *results) const;
+
+  // Samples from `lattice` with Lattice::SamplePruned() and the beam of
+  // SetSampleBeam(), and adds the pruned mass to the encode stats.
+  std::vector<std::pair<std::vector<Lattice::Node *>, float>> SamplePruned(
+      Lattice *lattice, float theta, int num_samples, bool unique) const;
 
   float min_score_ = 0.0;
   float max_score_ = 0.0;
@@ -173,6 +387,20 @@ class Model : public ModelInterface {
   // Maximum size of the return value of Trie, which corresponds
   // to the maximum size of shared common prefix in the sentence pieces.
   int trie_results_size_;
+
+  // The maximum byte length of the pieces in the trie, which bounds the trie
+  // walks of the encoders.
+  int max_piece_size_ = 0;
+
+  // Maps the values of trie_ to vocab ids, or to -1 for the pieces no longer
+  // in the vocabulary. Empty when the values are the vocab ids. Only
+  // PopulateNodes() consults it.
+  std::vector<int> trie_ids_;
+
+#ifdef IS_BIG_ENDIAN
+  // Stores the little-endian trie passed to SetTrie() in the host byte order.
+  std::string trie_buffer_;
+#endif
 };
 
 }  // namespace unigram
@@ -12,8 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
 #include <cmath>
 #include <map>
+#include <random>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -70,6 +73,20 @@ TEST(LatticeTest, SetSentenceTest) {
   lattice.Clear();
   EXPECT_EQ(0, lattice.size());
   EXPECT_EQ(0, lattice.utf8_size());
+
+  // Reusing the lattice for a shorter sentence starts from empty positions.
+  lattice.SetSentence("abcdef");
+  lattice.Insert(0, 3);
+  lattice.Insert(3, 3);
+  lattice.SetSentence("ab");
+  EXPECT_EQ(2, lattice.size());
+  EXPECT_EQ(0, lattice.begin_nodes(0).size());
+  EXPECT_EQ(0, lattice.end_nodes(2).size());
+  EXPECT_EQ(1, lattice.end_nodes(0).size());
+  EXPECT_EQ(1, lattice.begin_nodes(2).size());
+  EXPECT_EQ(lattice.eos_node(), lattice.begin_nodes(2).front());
+  EXPECT_EQ(lattice.bos_node(), lattice.end_nodes(0).front());
+  EXPECT_EQ(0, lattice.Insert(0, 2)->score);
 }
 
 TEST(LatticeTest, InsertTest) {
@@ -234,6 +251,89 @@ TEST(LatticeTest, NBestTest) {
 
   auto nbests1 = lattice.NBest(1);
   EXPECT_EQ(nbests1.size(), 1);
+
+  // The hypotheses of the previous search are reused.
+  auto nbests2 = lattice.NBest(3);
+  EXPECT_EQ(3, nbests2.size());
+  for (int i = 0; i < 3; ++i) EXPECT_EQ(nbests[i], nbests2[i]);
+}
+
+TEST(LatticeTest, NBestStreamingTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScore(&lattice, 0, 1, 0.0);   // A
+  InsertWithScore(&lattice, 1, 1, 0.0);   // B
+  InsertWithScore(&lattice, 2, 1, 0.0);   // C
+  InsertWithScore(&lattice, 0, 2, 2.0);   // AB
+  InsertWithScore(&lattice, 1, 2, 5.0);   // BC
+  InsertWithScore(&lattice, 0, 3, 10.0);  // ABC
+
+  // The search stops as soon as the callback returns false.
+  std::vector<std::string> tokenized;
+  lattice.NBest(10, [&tokenized](const std::vector<Lattice::Node *> &path) {
+    tokenized.push_back(GetTokenized(path));
+    return tokenized.size() < 2;
+  });
+  EXPECT_EQ(std::vector<std::string>({"ABC", "A BC"}), tokenized);
+
+  tokenized.clear();
+  lattice.NBest(3, [&tokenized](const std::vector<Lattice::Node *> &path) {
+    tokenized.push_back(GetTokenized(path));
+    return true;
+  });
+  EXPECT_EQ(std::vector<std::string>({"ABC", "A BC", "AB C"}), tokenized);
+}
+
+TEST(LatticeTest, NBestRandomTest) {
+  std::mt19937 mt(0);
+  std::uniform_real_distribution<float> score(-5.0, 0.0);
+  const std::string sentence = "ABCDEFGHIJ";
+  Lattice lattice;
+  for (int trial = 0; trial < 10; ++trial) {
+    lattice.SetSentence(sentence);
+    for (int pos = 0; pos < sentence.size(); ++pos) {
+      for (int length = 1; length <= 3 && pos + length <= sentence.size();
+           ++length) {
+        InsertWithScore(&lattice, pos, length, score(mt));
+      }
+    }
+
+    // Scores of all the paths, best first.
+    std::vector<float> expected;
+    std::vector<std::pair<int, float>> stack = {{0, 0.0}};
+    while (!stack.empty()) {
+      const auto top = stack.back();
+      stack.pop_back();
+      if (top.first == sentence.size()) {
+        expected.push_back(top.second);
+        continue;
+      }
+      for (const auto *node : lattice.begin_nodes(top.first)) {
+        stack.emplace_back(node->pos + node->length, top.second + node->score);
+      }
+    }
+    std::sort(expected.begin(), expected.end(), std::greater<float>());
+
+    for (const size_t nbest_size : {2, 17, 100}) {
+      std::vector<float> scores;
+      for (const auto &path : lattice.NBest(nbest_size)) {
+        float total = 0.0;
+        int pos = 0;
+        for (const auto *node : path) {
+          EXPECT_EQ(pos, node->pos);
+          pos += node->length;
+          total += node->score;
+        }
+        EXPECT_EQ(sentence.size(), pos);
+        scores.push_back(total);
+      }
+      ASSERT_EQ(nbest_size, scores.size());
+      for (size_t i = 0; i < nbest_size; ++i) {
+        EXPECT_NEAR(expected[i], scores[i], 1e-4);
+      }
+    }
+  }
 }
 
 TEST(LatticeTest, PopulateMarginalTest) {
@@ -271,6 +371,101 @@ TEST(LatticeTest, PopulateMarginalTest) {
   EXPECT_NEAR(std::log(static_cast<double>(Z)), logZ, 0.001);
 }
 
+TEST(LatticeTest, PopulateMarginalBlockedCountsTest) {
+  // The ids are in the first, third and last blocks of the counts.
+  const int kBlock = BlockedCounts::kBlockSize;
+  const std::vector<int> ids = {0, 2 * kBlock + 1, 2 * kBlock, 5 * kBlock + 3,
+                                1, 5 * kBlock + 4};
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+  InsertWithScoreAndId(&lattice, 0, 1, 1.0, ids[0]);  // A
+  InsertWithScoreAndId(&lattice, 1, 1, 1.2, ids[1]);  // B
+  InsertWithScoreAndId(&lattice, 2, 1, 2.5, ids[2]);  // C
+  InsertWithScoreAndId(&lattice, 0, 2, 3.0, ids[3]);  // AB
+  InsertWithScoreAndId(&lattice, 1, 2, 4.0, ids[4]);  // BC
+  InsertWithScoreAndId(&lattice, 0, 3, 2.0, ids[5]);  // ABC
+
+  const int size = 5 * kBlock + 10;
+  std::vector<float> dense(size, 0.0);
+  BlockedCounts blocked(size);
+  EXPECT_EQ(size, blocked.size());
+  EXPECT_EQ(6, blocked.num_blocks());
+  EXPECT_EQ(0, blocked.num_allocated_blocks());
+  for (const float freq : {1.0, 3.0}) {
+    EXPECT_EQ(lattice.PopulateMarginal(1.0, freq, &dense),
+              lattice.PopulateMarginal(1.0, freq, &blocked));
+  }
+  EXPECT_EQ(3, blocked.num_allocated_blocks());
+  EXPECT_EQ(nullptr, blocked.block(1));
+  EXPECT_EQ(nullptr, blocked.block(4));
+  for (int id = 0; id < size; ++id) {
+    const float *block = blocked.block(id / kBlock);
+    EXPECT_EQ(dense[id], block == nullptr ? 0.0 : block[id % kBlock]);
+  }
+
+  blocked.Resize(kBlock + 1);
+  EXPECT_EQ(2, blocked.num_blocks());
+  EXPECT_EQ(0, blocked.num_allocated_blocks());
+}
+
+TEST(LatticeTest, CalculateEntropyTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScoreAndId(&lattice, 0, 1, 1.0, 0);  // A
+  InsertWithScoreAndId(&lattice, 1, 1, 1.2, 1);  // B
+  InsertWithScoreAndId(&lattice, 2, 1, 2.5, 2);  // C
+  InsertWithScoreAndId(&lattice, 0, 2, 3.0, 3);  // AB
+  InsertWithScoreAndId(&lattice, 1, 2, 4.0, 4);  // BC
+  InsertWithScoreAndId(&lattice, 0, 3, 2.0, 5);  // ABC
+
+  // The scores of the paths as in PopulateMarginalTest.
+  const std::vector<double> scores = {1.0 + 1.2 + 2.5, 3.0 + 2.5, 1.0 + 4.0,
+                                      2.0};
+  for (const double theta : {0.0, 0.5, 1.0, 2.0}) {
+    double Z = 0.0;
+    for (const double score : scores) Z += std::exp(theta * score);
+    double entropy = 0.0;
+    for (const double score : scores) {
+      const double p = std::exp(theta * score) / Z;
+      entropy -= p * std::log(p);
+    }
+    EXPECT_NEAR(entropy, lattice.CalculateEntropy(theta), 1e-4);
+
+    // Scaling the scores by theta gives the marginals of Sample(theta).
+    std::vector<float> probs(6, 0.0);
+    const float logZ = lattice.PopulateMarginal(theta, 1.0, &probs);
+    EXPECT_NEAR(std::log(Z), logZ, 1e-4);
+    EXPECT_NEAR(std::exp(theta * scores[3]) / Z, probs[5], 1e-4);  // ABC
+  }
+
+  // The uniform distribution over the 4 paths.
+  EXPECT_NEAR(std::log(4.0), lattice.CalculateEntropy(0.0), 1e-4);
+}
+
+TEST(LatticeTest, LogSumExpTest) {
+  const float single = -3.5;
+  EXPECT_EQ(single, LogSumExp(&single, 1));
+
+  std::mt19937 mt(0);
+  std::uniform_real_distribution<double> dist(-100.0, 20.0);
+  for (size_t size : {2, 3, 7, 8, 17, 100, 1000}) {
+    std::vector<float> values(size);
+    for (auto &v : values) v = dist(mt);
+    double vmax = values[0];
+    for (const auto v : values) vmax = std::max<double>(vmax, v);
+    double sum = 0.0;
+    for (const auto v : values) sum += std::exp(v - vmax);
+    const double expected = vmax + std::log(sum);
+    EXPECT_NEAR(expected, LogSumExp(values.data(), values.size()),
+                1e-5 * std::max(1.0, std::abs(expected)));
+  }
+
+  // Terms far below the maximum do not contribute.
+  const std::vector<float> values = {0.0, -200.0, -1000.0};
+  EXPECT_NEAR(0.0, LogSumExp(values.data(), values.size()), 1e-6);
+}
+
 TEST(LatticeTest, SampleTest) {
   Lattice lattice;
   lattice.SetSentence("ABC");
@@ -310,6 +505,116 @@ TEST(LatticeTest, SampleTest) {
   }
 }
 
+TEST(LatticeTest, SampleMultipleTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScoreAndId(&lattice, 0, 1, 1.0, 0);  // A
+  InsertWithScoreAndId(&lattice, 1, 1, 1.2, 1);  // B
+  InsertWithScoreAndId(&lattice, 2, 1, 1.5, 2);  // C
+  InsertWithScoreAndId(&lattice, 0, 2, 1.6, 3);  // AB
+  InsertWithScoreAndId(&lattice, 1, 2, 1.7, 4);  // BC
+  InsertWithScoreAndId(&lattice, 0, 3, 1.8, 5);  // ABC
+
+  constexpr double kTheta = 0.5;
+  std::map<std::string, double> probs;
+  probs["A B C"] = exp(kTheta * (1.0 + 1.2 + 1.5));
+  probs["AB C"] = exp(kTheta * (1.6 + 1.5));
+  probs["A BC"] = exp(kTheta * (1.0 + 1.7));
+  probs["ABC"] = exp(kTheta * 1.8);
+  double Z = 0.0;
+  for (const auto &it : probs) Z += it.second;
+  for (auto &it : probs) it.second /= Z;
+
+  constexpr int kTrial = 100000;
+  const auto samples = lattice.Sample(kTheta, kTrial, false);
+  EXPECT_EQ(kTrial, samples.size());
+  std::map<std::string, int> freq;
+  for (const auto &sample : samples) {
+    const std::string tokenized = GetTokenized(sample.first);
+    EXPECT_NEAR(std::log(probs[tokenized]), sample.second, 1e-5);
+    freq[tokenized]++;
+  }
+  EXPECT_EQ(probs.size(), freq.size());
+  for (const auto &it : probs) {
+    EXPECT_NEAR(it.second, 1.0 * freq[it.first] / kTrial, 0.02);
+  }
+
+  const auto unique_samples = lattice.Sample(kTheta, 1000, true);
+  EXPECT_EQ(probs.size(), unique_samples.size());
+  std::set<std::string> seen;
+  for (const auto &sample : unique_samples) {
+    EXPECT_TRUE(seen.insert(GetTokenized(sample.first)).second);
+  }
+
+  EXPECT_TRUE(lattice.Sample(kTheta, 0, false).empty());
+}
+
+TEST(LatticeTest, SamplePrunedTest) {
+  Lattice lattice;
+  lattice.SetSentence("ABC");
+
+  InsertWithScoreAndId(&lattice, 0, 1, 1.0, 0);  // A
+  InsertWithScoreAndId(&lattice, 1, 1, 1.2, 1);  // B
+  InsertWithScoreAndId(&lattice, 2, 1, 1.5, 2);  // C
+  InsertWithScoreAndId(&lattice, 0, 2, 1.6, 3);  // AB
+  InsertWithScoreAndId(&lattice, 1, 2, 1.7, 4);  // BC
+  InsertWithScoreAndId(&lattice, 0, 3, 1.8, 5);  // ABC
+
+  constexpr double kTheta = 1.0;
+  std::map<std::string, double> full;
+  full["A B C"] = exp(kTheta * (1.0 + 1.2 + 1.5));
+  full["AB C"] = exp(kTheta * (1.6 + 1.5));
+  full["A BC"] = exp(kTheta * (1.0 + 1.7));
+  full["ABC"] = exp(kTheta * 1.8);
+  double Z = 0.0;
+  for (const auto &it : full) Z += it.second;
+  for (auto &it : full) it.second /= Z;
+
+  // At C, "A BC" and "ABC" are below 0.3 times "A B C" and "AB C", and at B,
+  // "AB" is below 0.6 times "A B".
+  const std::vector<std::pair<float, std::vector<std::string>>> kBeams = {
+      {0.0, {"A B C", "AB C", "A BC", "ABC"}},
+      {0.3, {"A B C", "AB C"}},
+      {0.6, {"A B C"}}};
+  for (const auto &beam : kBeams) {
+    std::map<std::string, double> probs;
+    double kept = 0.0;
+    for (const auto &tokenized : beam.second) kept += full[tokenized];
+    for (const auto &tokenized : beam.second) {
+      probs[tokenized] = full[tokenized] / kept;
+    }
+
+    constexpr int kTrial = 100000;
+    float pruned_mass = -1.0;
+    const auto samples =
+        lattice.SamplePruned(kTheta, kTrial, false, beam.first, &pruned_mass);
+    EXPECT_NEAR(1.0 - kept, pruned_mass, 1e-5);
+    EXPECT_EQ(kTrial, samples.size());
+    std::map<std::string, int> freq;
+    for (const auto &sample : samples) {
+      const std::string tokenized = GetTokenized(sample.first);
+      ASSERT_EQ(1, probs.count(tokenized));
+      EXPECT_NEAR(std::log(probs[tokenized]), sample.second, 1e-5);
+      freq[tokenized]++;
+    }
+    EXPECT_EQ(probs.size(), freq.size());
+    for (const auto &it : probs) {
+      EXPECT_NEAR(it.second, 1.0 * freq[it.first] / kTrial, 0.02);
+    }
+
+    const auto unique_samples =
+        lattice.SamplePruned(kTheta, 1000, true, beam.first, nullptr);
+    EXPECT_EQ(probs.size(), unique_samples.size());
+  }
+
+  // The beam of 1 keeps the best piece at every position.
+  const auto best = lattice.SamplePruned(kTheta, 10, true, 1.0, nullptr);
+  ASSERT_EQ(1, best.size());
+  EXPECT_EQ("A B C", GetTokenized(best[0].first));
+  EXPECT_NEAR(0.0, best[0].second, 1e-5);
+}
+
 ModelProto MakeBaseModelProto() {
   ModelProto model_proto;
   auto *sp1 = model_proto.add_pieces();
@@ -699,6 +1004,68 @@ TEST_P(UnigramModelTest, VerifyOutputsEquivalent) {
   EXPECT_FALSE(model.VerifyOutputsEquivalent("ab", "a b"));
 }
 
+TEST(UnigramModelTest, EncodeLongInputTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "ab", 0.0);         // 3
+  AddPiece(&model_proto, "cd", -0.1);        // 4
+  AddPiece(&model_proto, "abc", -0.2);       // 5
+  AddPiece(&model_proto, "a", -0.3);         // 6
+  AddPiece(&model_proto, "b", -0.4);         // 7
+  AddPiece(&model_proto, "c", -0.5);         // 8
+  AddPiece(&model_proto, "d", -0.6);         // 9
+  AddPiece(&model_proto, "abcdabcd", -0.5);  // 10
+  AddPiece(&model_proto, "dab", -0.4);       // 11
+  model_proto.mutable_pieces(10)->set_type(  // abcdabcd
+      ModelProto::SentencePiece::USER_DEFINED);
+
+  Model optimized(model_proto);
+  EXPECT_TRUE(optimized.SetEncoderVersion(EncoderVersion::kOptimized).ok());
+  Model original(model_proto);
+  EXPECT_TRUE(original.SetEncoderVersion(EncoderVersion::kOriginal).ok());
+
+  // Longer than the buffer of the optimized encoder, so that the best path
+  // is emitted in several chunks.
+  const std::vector<std::string> chunks = {"abcd", "ab", "dabc", "x", "cdab",
+                                           "東京", "abcdabcd", "c"};
+  std::string input;
+  for (int i = 0; input.size() < 50000; ++i) {
+    input += chunks[(i * 7 + i / 3) % chunks.size()];
+  }
+
+  const auto expected = original.Encode(input);
+  const auto result = optimized.Encode(input);
+  EXPECT_EQ(expected, result);
+
+  std::string joined;
+  for (const auto &w : result) joined.append(w.first.data(), w.first.size());
+  EXPECT_EQ(input, joined);
+}
+
+TEST_P(UnigramModelTest, EncodeIntoTest) {
+  ModelProto model_proto = MakeBaseModelProto();
+  AddPiece(&model_proto, "ab", 0.0);    // 3
+  AddPiece(&model_proto, "cd", -0.1);   // 4
+  AddPiece(&model_proto, "abc", -0.2);  // 5
+  AddPiece(&model_proto, "a", -0.3);    // 6
+  AddPiece(&model_proto, "b", -0.4);    // 7
+  AddPiece(&model_proto, "c", -0.5);    // 8
+  AddPiece(&model_proto, "d", -0.6);    // 9
+
+  Model model(model_proto);
+  EXPECT_TRUE(model.SetEncoderVersion(encoder_version_).ok());
+
+  // The result is overwritten, and its buffer is kept for shorter inputs.
+  EncodeResult result;
+  model.EncodeInto("abcdabcdxabcd", nullptr, &result);
+  EXPECT_EQ(model.Encode("abcdabcdxabcd"), result);
+  const auto *data = result.data();
+  for (const std::string input : {"abcd", "xab", "", "abcdx"}) {
+    model.EncodeInto(input, nullptr, &result);
+    EXPECT_EQ(model.Encode(input), result);
+    EXPECT_EQ(data, result.data());
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(ParametrizedUnigramModelTests, UnigramModelTest,
                          test::ValuesIn(GetEncoderVersions()));
 
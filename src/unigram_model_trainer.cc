@@ -18,6 +18,7 @@
 #include <functional>
 #include <memory>
 #include <numeric>
+#include <random>
 #include <string>
 #include <utility>
 #include <vector>
@@ -26,6 +27,7 @@
 #include "pretokenizer_for_training.h"
 #include "sentencepiece_trainer.h"
 #include "third_party/absl/container/flat_hash_map.h"
+#include "third_party/absl/container/flat_hash_set.h"
 #include "third_party/absl/memory/memory.h"
 #include "third_party/esaxx/esa.hxx"  // Suffix array library.
 #include "unicode_script.h"
@@ -36,6 +38,9 @@ namespace sentencepiece {
 namespace unigram {
 namespace {
 
+// The M step drops the pieces whose expected frequency is below this.
+constexpr float kExpectedFrequencyThreshold = 0.5;
+
 double Digamma(double x) {
   double result = 0.0;
   for (; x < 7; ++x) result -= 1 / x;
@@ -59,6 +64,85 @@ void ToLogProb(IT begin, IT end) {
     it->second = std::log(static_cast<double>(it->second)) - logsum;
   }
 }
+
+// Same as esaxx_private::suffixtree(): enumerates the internal nodes of the
+// suffix tree of T[0, n) from its suffix array SA. L and R are used as work
+// space. The permuted LCP array is computed in chunks on |pool|; every chunk
+// restarts the match length from 0, which is a valid lower bound.
+template <typename node_int_type>
+node_int_type MakeSuffixTree(const std::vector<char32> &T,
+                             const std::vector<node_int_type> &SA,
+                             std::vector<node_int_type> *L,
+                             std::vector<node_int_type> *R,
+                             std::vector<node_int_type> *D, ThreadPool *pool) {
+  const node_int_type n = T.size();
+  if (n == 0) return 0;
+  constexpr int64 kChunkSize = 1 << 16;
+
+  std::vector<node_int_type> &Psi = *L;
+  Psi[SA[0]] = SA[n - 1];
+  pool->ParallelFor(n - 1, kChunkSize, [&](int64 begin, int64 end) {
+    for (int64 i = begin + 1; i <= end; ++i) Psi[SA[i]] = SA[i - 1];
+  });
+
+  std::vector<node_int_type> &PLCP = *R;
+  pool->ParallelFor(n, kChunkSize, [&](int64 begin, int64 end) {
+    node_int_type h = 0;
+    for (node_int_type i = begin; i < end; ++i) {
+      const node_int_type j = Psi[i];
+      while (i + h < n && j + h < n && T[i + h] == T[j + h]) ++h;
+      PLCP[i] = h;
+      if (h > 0) --h;
+    }
+  });
+
+  std::vector<node_int_type> &H = *L;
+  pool->ParallelFor(n, kChunkSize, [&](int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) H[i] = PLCP[SA[i]];
+  });
+  H[0] = -1;
+
+  std::vector<std::pair<node_int_type, node_int_type>> S;
+  S.emplace_back(-1, -1);
+  node_int_type node_num = 0;
+  for (node_int_type i = 0;; ++i) {
+    std::pair<node_int_type, node_int_type> cur(i, (i == n) ? -1 : H[i]);
+    std::pair<node_int_type, node_int_type> cand(S.back());
+    while (cand.second > cur.second) {
+      if (i - cand.first > 1) {
+        (*L)[node_num] = cand.first;
+        (*R)[node_num] = i;
+        (*D)[node_num] = cand.second;
+        ++node_num;
+      }
+      cur.first = cand.first;
+      S.pop_back();
+      cand = S.back();
+    }
+    if (cand.second < cur.second) S.push_back(cur);
+    if (i == n) break;
+    S.emplace_back(i, n - SA[i] + 1);
+  }
+  return node_num;
+}
+
+// Maps the piece ids of `path`, a Viterbi path of an earlier pruning round
+// with the score `score`, to the current pieces with `remap`. Returns false,
+// leaving `path` untouched, if it used a pruned piece or its score with the
+// current pieces moved by more than `margin`, in which case another path may
+// be the best one now.
+bool RemapViterbiPath(const std::vector<int> &remap,
+                      const TrainerModel::SentencePieces &sentencepieces,
+                      float score, float margin, std::vector<int> *path) {
+  double new_score = 0.0;
+  for (const int id : *path) {
+    if (id < 0 || remap[id] < 0) return false;
+    new_score += sentencepieces[remap[id]].second;
+  }
+  if (std::fabs(new_score - score) > margin) return false;
+  for (int &id : *path) id = remap[id];
+  return true;
+}
 }  // namespace
 
 TrainerModel::TrainerModel(const TrainerSpec &trainer_spec,
@@ -78,6 +162,8 @@ void TrainerModel::SetSentencePieces(SentencePieces &&sentencepieces) {
   min_score_ = FLT_MAX;
   model_proto_data_.Clear();
   model_proto_ = &model_proto_data_;
+  scores_.clear();
+  types_.assign(sentencepieces_.size(), ModelProto::SentencePiece::NORMAL);
   std::vector<std::pair<absl::string_view, int>> pieces;
 
   for (size_t i = 0; i < sentencepieces_.size(); ++i) {
@@ -89,12 +175,44 @@ void TrainerModel::SetSentencePieces(SentencePieces &&sentencepieces) {
     auto *piece = model_proto_data_.add_pieces();
     piece->set_piece(w.data(), w.size());
     piece->set_score(score);
+    scores_.push_back(score);
   }
 
-  BuildTrie(&pieces);
+  // PieceToId() looks up the pieces in their own double-array.
+  pieces_.clear();
+  pieces_.insert(pieces.begin(), pieces.end());
+  BuildPieceIds();
+
+  // The pieces mostly shrink from one call to the next, so the trie is only
+  // rebuilt when it has too many disabled or missing pieces.
+  if (!ReuseTrie(pieces)) {
+    trie_ids_.clear();
+    trie_size_ = pieces.size();
+    BuildTrie(&pieces);
+  }
   CHECK(status().ok());
 }
 
+bool TrainerModel::ReuseTrie(
+    const std::vector<std::pair<absl::string_view, int>> &pieces) {
+  // The trie is rebuilt once fewer than half of its pieces are left.
+  constexpr size_t kTrieCompactionRatio = 2;
+  if (trie_ == nullptr || pieces.size() * kTrieCompactionRatio < trie_size_) {
+    return false;
+  }
+
+  std::vector<int> trie_ids(trie_size_, -1);
+  for (const auto &piece : pieces) {
+    int value = -1;
+    trie_->exactMatchSearch(piece.first.data(), value, piece.first.size());
+    if (value < 0) return false;
+    trie_ids[value] = piece.second;
+  }
+  trie_ids_.swap(trie_ids);
+  pieces_.clear();
+  return true;
+}
+
 // Returns seed sentencepieces for EM training.
 template <typename node_int_type>
 TrainerModel::SentencePieces Trainer::MakeSeedSentencePieces() const {
@@ -110,14 +228,64 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePieces() const {
   absl::flat_hash_map<std::string, int64> all_chars;
   constexpr char32 kSentenceBoundary = 0x0000;
 
-  for (const auto &w : sentences_) {
-    const auto ut = string_util::UTF8ToUnicodeText(
-        pretokenizer ? pretokenizer->PreTokenize(w.first) : w.first);
+  // With seed_from_unique_words, |sentences_| holds the unique words. Every
+  // word is terminated by kSentenceBoundary, and |word_begins| keeps the
+  // offset of every word in |array| to weight the occurrences.
+  const bool from_words = trainer_spec_.seed_from_unique_words();
+  std::vector<node_int_type> word_begins;
+  auto add_sentence = [&](absl::string_view sentence, int64 freq) {
+    if (from_words) word_begins.push_back(array.size());
+    const auto ut = string_util::UTF8ToUnicodeText(sentence);
     for (const auto &c : ut) {
       array.push_back(c);
       if (c != kUNKChar && c != kSentenceBoundary) {
-        all_chars[string_util::UnicodeCharToUTF8(c)] += w.second;
+        all_chars[string_util::UnicodeCharToUTF8(c)] += freq;
+      }
+    }
+    if (from_words) array.push_back(kSentenceBoundary);
+  };
+
+  if (pretokenizer == nullptr) {
+    for (const auto &w : sentences_) add_sentence(w.first, w.second);
+  } else {
+    // Sentences are pre-tokenized in blocks. The chunks of a block are
+    // passed to TokenizeBatch() on the workers, while this thread appends
+    // the previous block to |array|.
+    constexpr size_t kBlockSize = 1 << 16;
+    constexpr size_t kChunkSize = 256;
+    std::vector<std::string> blocks[2];
+    auto schedule_block = [&](size_t block_begin,
+                              std::vector<std::string> *out) {
+      const size_t block_end =
+          std::min(block_begin + kBlockSize, sentences_.size());
+      out->resize(block_end - block_begin);
+      for (size_t begin = block_begin; begin < block_end; begin += kChunkSize) {
+        pool()->Schedule([&, block_begin, block_end, begin, out]() {
+          const size_t end = std::min(begin + kChunkSize, block_end);
+          std::vector<absl::string_view> texts;
+          texts.reserve(end - begin);
+          for (size_t i = begin; i < end; ++i) {
+            texts.emplace_back(sentences_[i].first);
+          }
+          auto outputs = pretokenizer->PreTokenizeBatch(texts);
+          for (size_t i = begin; i < end; ++i) {
+            (*out)[i - block_begin] = std::move(outputs[i - begin]);
+          }
+        });
+      }
+    };
+
+    schedule_block(0, &blocks[0]);
+    pool()->Wait();
+    for (size_t block_begin = 0, k = 0; block_begin < sentences_.size();
+         block_begin += kBlockSize, k ^= 1) {
+      if (block_begin + kBlockSize < sentences_.size()) {
+        schedule_block(block_begin + kBlockSize, &blocks[k ^ 1]);
       }
+      for (size_t i = 0; i < blocks[k].size(); ++i) {
+        add_sentence(blocks[k][i], sentences_[block_begin + i].second);
+      }
+      pool()->Wait();
     }
   }
 
@@ -134,44 +302,90 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePieces() const {
   // Makes a suffix array to extract all sub strings occurring
   // more than 2 times in the sentence.
   constexpr node_int_type kAlphabetSize = 0x110000;  // All UCS4 range.
-  node_int_type node_num = 0;
   LOG(INFO) << "Making suffix array...";
-  CHECK_EQ(0, esaxx(array.begin(), SA.begin(), L.begin(), R.begin(), D.begin(),
-                    n, kAlphabetSize, node_num));
+  CHECK_EQ(0, saisxx(array.begin(), SA.begin(), n, kAlphabetSize));
+
+  // weights[k] is the total frequency of the words of SA[0, k), so that an
+  // internal node [L, R) occurs weights[R] - weights[L] times in the corpus.
+  std::vector<int64> weights;
+  if (from_words) {
+    weights.resize(n + 1);
+    weights[0] = 0;
+    pool()->ParallelFor(n, 1 << 16, [&](int64 begin, int64 end) {
+      for (int64 k = begin; k < end; ++k) {
+        const size_t word = std::upper_bound(word_begins.begin(),
+                                             word_begins.end(), SA[k]) -
+                            word_begins.begin() - 1;
+        weights[k + 1] = sentences_[word].second;
+      }
+    });
+    std::vector<node_int_type>().swap(word_begins);
+    for (node_int_type k = 0; k < n; ++k) weights[k + 1] += weights[k];
+  }
 
-  LOG(INFO) << "Extracting frequent sub strings...";
-  std::vector<std::pair<node_int_type, node_int_type>> substr_index;
-  for (node_int_type i = 0; i < node_num; ++i) {
-    const node_int_type offset = SA[L[i]];
-    const node_int_type len = D[i];
-    if (len <= 1) {
-      continue;
-    }
-    const char32 *begin = &array[0] + offset;
-    const char32 *end = &array[0] + offset + len;
-    // Skips if a substring contains a sentence boundary.
-    if (std::find(begin, end, kSentenceBoundary) != end) {
-      continue;
-    }
-    const UnicodeText uw(begin, end);
-    if (!IsValidSentencePiece(uw)) {
-      continue;
+  const node_int_type node_num = MakeSuffixTree(array, SA, &L, &R, &D, pool());
+
+  // The characters are classified once, so that the candidates, which
+  // overlap a lot, are checked over the attributes of their positions.
+  std::vector<CharAttributes> attributes(n);
+  pool()->ParallelFor(n, 1 << 16, [&](int64 begin, int64 end) {
+    for (int64 k = begin; k < end; ++k) {
+      attributes[k] = GetCharAttributes(array[k]);
     }
+  });
+
+  // The candidates of every chunk of nodes are collected in parallel and
+  // concatenated in the order of the nodes.
+  LOG(INFO) << "Extracting frequent sub strings...";
+  constexpr int64 kNodeChunkSize = 1 << 14;
+  std::vector<std::vector<std::pair<node_int_type, int64>>>
+      chunk_substr_index((node_num + kNodeChunkSize - 1) / kNodeChunkSize);
+  pool()->ParallelFor(node_num, kNodeChunkSize, [&](int64 first, int64 last) {
+    auto &chunk = chunk_substr_index[first / kNodeChunkSize];
+    for (node_int_type i = first; i < last; ++i) {
+      const node_int_type offset = SA[L[i]];
+      const node_int_type len = D[i];
+      if (len <= 1) {
+        continue;
+      }
+      // Sentence boundaries are invalid characters too.
+      if (!IsValidSentencePiece(&attributes[offset], len)) {
+        continue;
+      }
 
-    // character-wise coverage is the default score.
-    const node_int_type freq = R[i] - L[i];
-    const node_int_type score = freq * len;
-    substr_index.emplace_back(i, score);
+      // character-wise coverage is the default score.
+      const int64 freq =
+          from_words ? weights[R[i]] - weights[L[i]] : R[i] - L[i];
+      const int64 score = freq * len;
+      chunk.emplace_back(i, score);
+    }
+  });
+  std::vector<CharAttributes>().swap(attributes);
+  std::vector<std::pair<node_int_type, int64>> substr_index;
+  size_t num_substrs = 0;
+  for (const auto &chunk : chunk_substr_index) num_substrs += chunk.size();
+  substr_index.reserve(num_substrs);
+  for (auto &chunk : chunk_substr_index) {
+    substr_index.insert(substr_index.end(), chunk.begin(), chunk.end());
+    std::vector<std::pair<node_int_type, int64>>().swap(chunk);
   }
 
   // all_chars must be included in the seed sentencepieces.
   TrainerModel::SentencePieces seed_sentencepieces;
-  for (const auto &it : Sorted(all_chars)) {
+  for (const auto &it : Sorted(all_chars, pool())) {
     seed_sentencepieces.emplace_back(it);
   }
 
-  // Sort by the coverage of sub strings.
-  for (const auto &p : Sorted(substr_index)) {
+  // Sort by the coverage of sub strings. Only the candidates that fill up
+  // seed_sentencepiece_size are needed in order.
+  const size_t seed_size = trainer_spec_.seed_sentencepiece_size();
+  const size_t num_sorted =
+      seed_size >= seed_sentencepieces.size()
+          ? std::min(seed_size - seed_sentencepieces.size(),
+                     substr_index.size())
+          : substr_index.size();
+  ParallelPartialSort(&substr_index, num_sorted, pool());
+  for (const auto &p : substr_index) {
     const node_int_type offset = SA[L[p.first]];
     const node_int_type len = D[p.first];
     CHECK_GT(len, 0);
@@ -196,55 +410,296 @@ TrainerModel::SentencePieces Trainer::MakeSeedSentencePieces() const {
   return seed_sentencepieces;
 }
 
-std::vector<float> Trainer::RunEStep(const TrainerModel &model, float *obj,
-                                     int64 *num_tokens) const {
-  std::vector<std::vector<float>> expected(trainer_spec_.num_threads());
-  std::vector<float> objs(trainer_spec_.num_threads(), 0.0);
-  std::vector<int64> ntokens(trainer_spec_.num_threads(), 0.0);
+util::Status Trainer::AddInitPieces(
+    TrainerModel::SentencePieces *seed_sentencepieces) const {
+  TrainerModel::SentencePieces pieces;
+  RETURN_IF_ERROR(LoadInitPieces(&pieces));
+  absl::flat_hash_set<std::string> seen;
+  pieces.erase(std::remove_if(pieces.begin(), pieces.end(),
+                              [&](const std::pair<std::string, float> &w) {
+                                return !IsValidSentencePiece(
+                                           string_util::UTF8ToUnicodeText(
+                                               w.first)) ||
+                                       !seen.insert(w.first).second;
+                              }),
+               pieces.end());
+
+  // The seed pieces start with the characters, followed by the other pieces
+  // in the order of their scores.
+  const size_t num_init = pieces.size();
+  size_t num_new = 0;
+  for (auto &w : *seed_sentencepieces) {
+    if (!seen.insert(w.first).second) continue;
+    if (string_util::UTF8ToUnicodeText(w.first).size() > 1) {
+      if (num_new == static_cast<size_t>(trainer_spec_.vocab_size())) continue;
+      ++num_new;
+    }
+    pieces.emplace_back(std::move(w));
+  }
+  LOG(INFO) << "Seeding with " << num_init
+            << " pieces of the initial model and " << pieces.size() - num_init
+            << " new pieces";
+  *seed_sentencepieces = std::move(pieces);
+  return util::OkStatus();
+}
+
+util::Status Trainer::MakeCandidateSentencePieces(
+    TrainerModel::SentencePieces *seed_sentencepieces) const {
+  CHECK_OR_RETURN(!required_chars_.empty());
+  const int num_models = trainer_spec_.candidate_models_size();
+  std::vector<ModelProto> models(num_models);
+  std::vector<util::Status> statuses(num_models);
+  pool()->ParallelFor(num_models, 1, [&](int64 begin, int64 end) {
+    for (int64 i = begin; i < end; ++i) {
+      statuses[i] = io::LoadModelProto(trainer_spec_.candidate_models(i),
+                                       &models[i]);
+    }
+  });
+
+  // Sums the probabilities of the pieces in all the models.
+  absl::flat_hash_map<std::string, double> probs;
+  for (int i = 0; i < num_models; ++i) {
+    RETURN_IF_ERROR(statuses[i]);
+    CHECK_EQ_OR_RETURN(TrainerSpec::UNIGRAM,
+                       models[i].trainer_spec().model_type())
+        << trainer_spec_.candidate_models(i) << " is not a unigram model.";
+    CHECK_EQ_OR_RETURN(normalizer_spec_.name(),
+                       models[i].normalizer_spec().name())
+        << trainer_spec_.candidate_models(i)
+        << " is trained with another normalization.";
+    for (const auto &sp : models[i].pieces()) {
+      if (sp.type() != ModelProto::SentencePiece::NORMAL) continue;
+      const UnicodeText uw = string_util::UTF8ToUnicodeText(sp.piece());
+      if (!IsValidSentencePiece(uw) ||
+          std::any_of(uw.begin(), uw.end(), [this](char32 c) {
+            return !port::ContainsKey(required_chars_, c);
+          })) {
+        continue;
+      }
+      probs[sp.piece()] += std::exp(static_cast<double>(sp.score()));
+    }
+    LOG(INFO) << "Loaded " << models[i].pieces_size() << " pieces from "
+              << trainer_spec_.candidate_models(i);
+  }
 
-  auto pool = absl::make_unique<ThreadPool>(trainer_spec_.num_threads());
-  pool->StartWorkers();
+  // The characters which no model has take their frequency in the corpus.
+  int64 sum_chars = 0;
+  for (const auto &it : required_chars_) sum_chars += it.second;
+  std::vector<std::pair<std::string, double>> chars, pieces;
+  for (const auto &it : required_chars_) {
+    const std::string w = string_util::UnicodeCharToUTF8(it.first);
+    auto found = probs.find(w);
+    if (found == probs.end()) {
+      chars.emplace_back(w, static_cast<double>(it.second) / sum_chars);
+    } else {
+      chars.emplace_back(w, found->second);
+      probs.erase(found);
+    }
+  }
+  for (const auto &it : probs) pieces.emplace_back(it);
 
-  int64 all_sentence_freq = 0;
-  for (const auto &w : sentences_) {
-    all_sentence_freq += w.second;
+  // Same order as MakeSeedSentencePieces(): the characters, then the best
+  // pieces which fill up seed_sentencepiece_size.
+  seed_sentencepieces->clear();
+  for (const auto &it : Sorted(chars, pool())) {
+    seed_sentencepieces->emplace_back(it.first, it.second / num_models);
   }
+  const size_t seed_size = trainer_spec_.seed_sentencepiece_size();
+  const size_t num_pieces =
+      seed_size > chars.size()
+          ? std::min(seed_size - chars.size(), pieces.size())
+          : 0;
+  ParallelPartialSort(&pieces, num_pieces, pool());
+  for (size_t i = 0; i < num_pieces; ++i) {
+    seed_sentencepieces->emplace_back(pieces[i].first,
+                                      pieces[i].second / num_models);
+  }
+  ToLogProb(seed_sentencepieces->begin(), seed_sentencepieces->end());
+
+  LOG(INFO) << "Merged " << num_models << " candidate models into "
+            << seed_sentencepieces->size() << " seed sentencepieces";
+  return util::OkStatus();
+}
+
+std::vector<float> Trainer::RunEStep(const TrainerModel &model, float *obj,
+                                     int64 *num_tokens) const {
+  CHECK_EQ(sentence_order_.size(), sentences_.size());
+  return RunEStep(model, sentence_order_, 1.0, obj, num_tokens);
+}
 
-  // Executes E step in parallel
-  for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-    pool->Schedule([&, n]() {
+std::vector<float> Trainer::RunEStep(const TrainerModel &model,
+                                     const std::vector<size_t> &order,
+                                     float scale, float *obj,
+                                     int64 *num_tokens) const {
+  const int num_threads = trainer_spec_.num_threads();
+  // The counts of a thread only allocate the blocks of the vocab its
+  // lattices hit, so that a large seed vocab is not paid for once per
+  // thread.
+  std::vector<BlockedCounts> expected(num_threads);
+  std::vector<float> objs(num_threads, 0.0);
+  std::vector<int64> ntokens(num_threads, 0.0);
+
+  // Executes E step in parallel. Sentence lengths are skewed, so
+  // |order| is cut into chunks that are dealt to the threads round-robin,
+  // longest first. The assignment is fixed so that the sums of every
+  // thread, and hence the model, do not depend on scheduling.
+  constexpr size_t kChunkSize = 64;
+  for (int n = 0; n < num_threads; ++n) {
+    pool()->Schedule([&, n]() {
       Lattice lattice;
-      expected[n].resize(model.GetPieceSize(), 0.0);
-      for (size_t i = n; i < sentences_.size();
-           i += trainer_spec_.num_threads()) {
-        const std::string &w = sentences_[i].first;
-        const int64 freq = sentences_[i].second;
-        lattice.SetSentence(w);
-        model.PopulateNodes(&lattice);
-        const float Z = lattice.PopulateMarginal(freq, &expected[n]);
-        ntokens[n] += lattice.Viterbi().size();
-        CHECK(!std::isnan(Z))
-            << "likelihood is NAN. Input sentence may be too long";
-        objs[n] -= Z / all_sentence_freq;
+      expected[n].Resize(model.GetPieceSize());
+      for (size_t begin = n * kChunkSize; begin < order.size();
+           begin += num_threads * kChunkSize) {
+        const size_t end = std::min(begin + kChunkSize, order.size());
+        for (size_t i = begin; i < end; ++i) {
+          const auto &sentence = sentences_[order[i]];
+          const absl::string_view w = sentence.first;
+          const int64 freq = sentence.second;
+          lattice.SetSentence(w);
+          model.PopulateNodes(&lattice);
+          const float Z =
+              lattice.PopulateMarginal(1.0, scale * freq, &expected[n]);
+          ntokens[n] += lattice.Viterbi().size();
+          CHECK(!std::isnan(Z))
+              << "likelihood is NAN. Input sentence may be too long";
+          objs[n] -= Z / all_sentence_freq_;
+        }
       }
     });
   }
-  pool.reset(nullptr);
-
-  // Merges expectations
-  for (int n = 1; n < trainer_spec_.num_threads(); ++n) {
+  pool()->Wait();
+
+  // Merges expectations. Each block of the vocab is reduced independently,
+  // adding the threads in a fixed order.
+  const int piece_size = model.GetPieceSize();
+  std::vector<float> merged(piece_size, 0.0);
+  constexpr int64 kReduceBlocks = 16;
+  pool()->ParallelFor(
+      expected[0].num_blocks(), kReduceBlocks, [&](int64 begin, int64 end) {
+        for (int64 b = begin; b < end; ++b) {
+          const int offset = b << BlockedCounts::kBlockBits;
+          const int size =
+              std::min(piece_size - offset, +BlockedCounts::kBlockSize);
+          float *out = merged.data() + offset;
+          for (int n = 0; n < num_threads; ++n) {
+            const float *block = expected[n].block(b);
+            if (block == nullptr) continue;
+            for (int k = 0; k < size; ++k) out[k] += block[k];
+          }
+        }
+      });
+  for (int n = 1; n < num_threads; ++n) {
     objs[0] += objs[n];
     ntokens[0] += ntokens[n];
-    for (size_t k = 0; k < expected[0].size(); ++k) {
-      expected[0][k] += expected[n][k];
-    }
   }
 
   *obj = objs[0];
-  *num_tokens = ntokens[0];
+  *num_tokens = static_cast<int64>(static_cast<double>(ntokens[0]) * scale);
   CHECK(!std::isnan(*obj));
 
-  return expected[0];
+  return merged;
+}
+
+util::Status Trainer::RunMiniBatchEM(TrainerModel *model, int batches_per_pass,
+                                     int *em_iteration) const {
+  // The k-th update moves the statistics by the step size (k + 1)^-kStepDecay
+  // toward the batch statistics. Decays in (0.5, 1] make stepwise EM
+  // converge; smaller ones forget the older batches faster.
+  constexpr double kStepDecay = 0.7;
+  const size_t batch_size =
+      (sentences_.size() + batches_per_pass - 1) / batches_per_pass;
+
+  // Every batch is extrapolated to all the sentences of this shard.
+  int64 shard_freq = 0;
+  for (const auto &w : sentences_) shard_freq += w.second;
+
+  std::vector<size_t> order(sentences_.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::vector<float> stats;
+  float objective = 0.0;
+  float last_objective = 0.0;
+  int64 num_tokens = 0;
+  int step = 0;
+  for (int pass = 0; pass < trainer_spec_.num_sub_iterations(); ++pass) {
+    // The order of a pass only depends on the iteration, so that resumed
+    // trainings see the same batches.
+    std::mt19937 engine(*em_iteration);
+    std::shuffle(order.begin(), order.end(), engine);
+
+    for (int batch_index = 0; batch_index < batches_per_pass;
+         ++batch_index, ++step) {
+      TrainerProfiler::Phase em_phase(profiler(), "em");
+      em_phase.set_iteration((*em_iteration)++);
+
+      const size_t begin = std::min(batch_index * batch_size, order.size());
+      const size_t end = std::min(begin + batch_size, order.size());
+      std::vector<size_t> batch(order.begin() + begin, order.begin() + end);
+      std::stable_sort(batch.begin(), batch.end(), [this](size_t a, size_t b) {
+        return sentences_[a].first.size() > sentences_[b].first.size();
+      });
+      em_phase.set_sentences(batch.size());
+      int64 batch_freq = 0;
+      for (const size_t i : batch) batch_freq += sentences_[i].second;
+      const float scale =
+          batch_freq > 0 ? static_cast<double>(shard_freq) / batch_freq : 0.0;
+
+      float batch_objective = 0.0;
+      int64 batch_tokens = 0;
+      auto expected =
+          RunEStep(*model, batch, scale, &batch_objective, &batch_tokens);
+      RETURN_IF_ERROR(ReduceEStep(&expected, &batch_objective, &batch_tokens));
+
+      const float eta = std::pow(step + 1.0, -kStepDecay);
+      if (step == 0) stats.assign(expected.size(), 0.0);
+      CHECK_EQ_OR_RETURN(stats.size(), expected.size());
+      for (size_t k = 0; k < stats.size(); ++k) {
+        stats[k] = (1.0 - eta) * stats[k] + eta * expected[k];
+      }
+      objective = (1.0 - eta) * objective + eta * batch_objective;
+      num_tokens = static_cast<int64>((1.0 - eta) * num_tokens +
+                                      eta * batch_tokens);
+
+      // A piece missing from the first batches is not dropped yet. The
+      // pieces keep their ids until the end of the round, so that |stats|
+      // stays indexed by them.
+      std::vector<float> clamped = stats;
+      for (auto &freq : clamped) {
+        freq = std::max(freq, kExpectedFrequencyThreshold);
+      }
+      model->SetSentencePieces(RunMStep(*model, clamped));
+      em_phase.set_vocab_size(model->GetPieceSize());
+      em_phase.set_objective(objective);
+    }
+
+    LOG(INFO) << "EM pass=" << pass << " batches=" << batches_per_pass
+              << " size=" << model->GetPieceSize() << " obj=" << objective
+              << " num_tokens=" << num_tokens << " num_tokens/piece="
+              << 1.0 * num_tokens / model->GetPieceSize();
+    if (pass > 0 && std::fabs(objective - last_objective) <=
+                        trainer_spec_.em_tolerance() * std::fabs(objective)) {
+      break;
+    }
+    last_objective = objective;
+  }
+
+  // Drops the infrequent pieces with the final statistics.
+  if (!stats.empty()) model->SetSentencePieces(RunMStep(*model, stats));
+  return util::OkStatus();
+}
+
+util::Status Trainer::ReduceEStep(std::vector<float> *expected,
+                                  float *objective, int64 *num_tokens) const {
+  if (shard_reducer_ == nullptr) return util::OkStatus();
+  std::vector<double> values(expected->begin(), expected->end());
+  values.push_back(*objective);
+  values.push_back(*num_tokens);
+  RETURN_IF_ERROR(shard_reducer_->AllReduce(&values));
+  *num_tokens = static_cast<int64>(values.back());
+  values.pop_back();
+  *objective = values.back();
+  values.pop_back();
+  expected->assign(values.begin(), values.end());
+  return util::OkStatus();
 }
 
 TrainerModel::SentencePieces Trainer::RunMStep(
@@ -258,7 +713,6 @@ TrainerModel::SentencePieces Trainer::RunMStep(
     const float freq = expected[i];
 
     // Filter infrequent sentencepieces here.
-    constexpr float kExpectedFrequencyThreshold = 0.5;
     if (freq < kExpectedFrequencyThreshold) {
       continue;
     }
@@ -279,12 +733,12 @@ TrainerModel::SentencePieces Trainer::RunMStep(
   return new_sentencepieces;
 }
 
-TrainerModel::SentencePieces Trainer::PruneSentencePieces(
-    const TrainerModel &model) const {
+util::Status Trainer::PruneSentencePieces(
+    const TrainerModel &model, TrainerModel::SentencePieces *new_sentencepieces,
+    ViterbiCache *cache) const {
   const auto &sentencepieces = model.GetSentencePieces();
 
-  Lattice lattice;
-  std::vector<bool> always_keep(sentencepieces.size(), true);
+  std::vector<char> always_keep(sentencepieces.size(), true);
   std::vector<std::vector<int>> alternatives(sentencepieces.size());
 
   // First, segments the current sentencepieces to know
@@ -292,77 +746,184 @@ TrainerModel::SentencePieces Trainer::PruneSentencePieces(
   // from the vocabulary.
   // To do so, we take the second best segmentation of sentencepiece[i].
   // alternatives[i] stores the sequence of second best sentencepieces.
-  for (size_t i = 0; i < sentencepieces.size(); ++i) {
-    const auto &w = sentencepieces[i];
-    lattice.SetSentence(w.first);
-    model.PopulateNodes(&lattice);
-    const auto nbests = lattice.NBest(2);
-    if (nbests.size() == 1) {
-      // No second-best result is found. always keep this sentencepiece.
-      always_keep[i] = true;
-      continue;
-    } else if (nbests[0].size() >= 2) {
-      // Can safely remove this sentencepiece if its Viterbi path is split.
-      always_keep[i] = false;
-    } else if (nbests[0].size() == 1) {
-      always_keep[i] = true;
-      for (const auto *node : nbests[1]) {
-        alternatives[i].push_back(node->id);
-      }
+  // Every piece only writes its own entries, so chunks of the pieces are
+  // segmented in parallel.
+  constexpr int64 kPieceChunkSize = 256;
+  pool()->ParallelFor(
+      sentencepieces.size(), kPieceChunkSize, [&](int64 begin, int64 end) {
+        Lattice lattice;
+        for (int64 i = begin; i < end; ++i) {
+          const auto &w = sentencepieces[i];
+          lattice.SetSentence(w.first);
+          model.PopulateNodes(&lattice);
+          const auto nbests = lattice.NBest(2);
+          if (nbests.size() == 1) {
+            // No second-best result is found. always keep this sentencepiece.
+            always_keep[i] = true;
+            continue;
+          } else if (nbests[0].size() >= 2) {
+            // Can safely remove this sentencepiece if its Viterbi path is
+            // split.
+            always_keep[i] = false;
+          } else if (nbests[0].size() == 1) {
+            always_keep[i] = true;
+            for (const auto *node : nbests[1]) {
+              alternatives[i].push_back(node->id);
+            }
+          }
+        }
+      });
+
+  // Second, segments all sentences to compute likelihood
+  // with a unigram language model. The sentence indices where
+  // sentencepieces[i] appears are
+  // inverted[inverted_begins[i], inverted_begins[i + 1]), in the order of
+  // the threads and then of the sentences.
+  // With `cache`, the paths of the last round are reused unless every
+  // sentence is segmented in this round. remap[id] is the current id of the
+  // cached piece `id`, or -1 if it was pruned.
+  const bool reuse_paths =
+      cache != nullptr && cache->paths.size() == sentences_.size() &&
+      cache->rounds + 1 < trainer_spec_.prune_incremental_rounds();
+  std::vector<int> remap;
+  if (reuse_paths) {
+    absl::flat_hash_map<absl::string_view, int, string_util::string_view_hash>
+        ids;
+    for (size_t i = 0; i < sentencepieces.size(); ++i) {
+      ids.emplace(sentencepieces[i].first, i);
+    }
+    remap.resize(cache->pieces.size(), -1);
+    for (size_t i = 0; i < cache->pieces.size(); ++i) {
+      const auto it = ids.find(cache->pieces[i]);
+      if (it != ids.end()) remap[i] = it->second;
     }
+  } else if (cache != nullptr) {
+    cache->paths.assign(sentences_.size(), std::vector<int>());
+    cache->scores.assign(sentences_.size(), 0.0);
   }
+  const float margin = trainer_spec_.prune_score_margin();
 
-  // Second, segments all sentences to compute likelihood
-  // with a unigram language model. inverted[i] stores
-  // the set of sentence index where the sentencepieces[i] appears.
+  const int num_threads = trainer_spec_.num_threads();
   float vsum = 0.0;
   std::vector<float> freq(sentencepieces.size(), 0.0);
-  std::vector<std::vector<int>> inverted(sentencepieces.size());
+  std::vector<int> inverted;
+  std::vector<size_t> inverted_begins(sentencepieces.size() + 1, 0);
   {
-    std::vector<float> vsums(trainer_spec_.num_threads(), 0.0);
-    std::vector<std::vector<float>> freqs(trainer_spec_.num_threads());
-    std::vector<std::vector<std::vector<int>>> inverteds(
-        trainer_spec_.num_threads());
-
-    auto pool = absl::make_unique<ThreadPool>(trainer_spec_.num_threads());
-    pool->StartWorkers();
-    for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
+    std::vector<float> vsums(num_threads, 0.0);
+    std::vector<std::vector<float>> freqs(num_threads);
+    // (piece id, sentence index) of every piece on the Viterbi paths.
+    std::vector<std::vector<std::pair<int, int>>> occurrences(num_threads);
+    std::vector<std::vector<size_t>> counts(num_threads);
+    std::vector<int64> segmented(num_threads, 0);
+
+    for (int n = 0; n < num_threads; ++n) {
       freqs[n].resize(sentencepieces.size(), 0.0);
-      inverteds[n].resize(sentencepieces.size());
+      counts[n].resize(sentencepieces.size(), 0);
 
-      pool->Schedule([&, n]() {
+      pool()->Schedule([&, n]() {
         Lattice lattice;
-        for (size_t i = n; i < sentences_.size();
-             i += trainer_spec_.num_threads()) {
+        for (size_t i = n; i < sentences_.size(); i += num_threads) {
           const auto &w = sentences_[i];
+          vsums[n] += w.second;
+          auto add = [&](int id) {
+            freqs[n][id] += w.second;
+            occurrences[n].emplace_back(id, i);
+            ++counts[n][id];
+          };
+          if (reuse_paths &&
+              RemapViterbiPath(remap, sentencepieces, cache->scores[i],
+                               margin, &cache->paths[i])) {
+            for (const int id : cache->paths[i]) add(id);
+            continue;
+          }
+          ++segmented[n];
           lattice.SetSentence(w.first);
           model.PopulateNodes(&lattice);
-          vsums[n] += w.second;
-          for (const auto *node : lattice.Viterbi()) {
-            if (node->id >= 0) {
-              freqs[n][node->id] += w.second;
-              inverteds[n][node->id].push_back(i);
+          const auto path = lattice.Viterbi();
+          if (cache != nullptr) {
+            // Unknown pieces are kept as -1, so that the path is not reused.
+            auto &ids = cache->paths[i];
+            ids.clear();
+            float score = 0.0;
+            for (const auto *node : path) {
+              ids.push_back(node->id);
+              score += node->score;
             }
+            cache->scores[i] = score;
+          }
+          for (const auto *node : path) {
+            if (node->id >= 0) add(node->id);
           }
         }
       });
     }
-    pool.reset(nullptr);
+    pool()->Wait();
+
+    // counts[n][i] becomes the offset of the sentences of thread n in the
+    // range of sentencepieces[i].
+    size_t offset = 0;
+    for (size_t i = 0; i < sentencepieces.size(); ++i) {
+      inverted_begins[i] = offset;
+      for (int n = 0; n < num_threads; ++n) {
+        freq[i] += freqs[n][i];
+        const size_t count = counts[n][i];
+        counts[n][i] = offset;
+        offset += count;
+      }
+    }
+    inverted_begins[sentencepieces.size()] = offset;
+    for (int n = 0; n < num_threads; ++n) vsum += vsums[n];
 
-    for (int n = 0; n < trainer_spec_.num_threads(); ++n) {
-      vsum += vsums[n];
+    if (cache != nullptr) {
+      cache->pieces.resize(sentencepieces.size());
       for (size_t i = 0; i < sentencepieces.size(); ++i) {
-        freq[i] += freqs[n][i];
-        std::copy(inverteds[n][i].begin(), inverteds[n][i].end(),
-                  std::back_inserter(inverted[i]));
+        cache->pieces[i] = sentencepieces[i].first;
       }
+      cache->rounds = reuse_paths ? cache->rounds + 1 : 0;
+      LOG(INFO) << "Pruning segmented "
+                << std::accumulate(segmented.begin(), segmented.end(),
+                                   int64{0})
+                << " of " << sentences_.size() << " sentences.";
+    }
+
+    inverted.resize(offset);
+    for (int n = 0; n < num_threads; ++n) {
+      pool()->Schedule([&, n]() {
+        for (const auto &it : occurrences[n]) {
+          inverted[counts[n][it.first]++] = it.second;
+        }
+        std::vector<std::pair<int, int>>().swap(occurrences[n]);
+      });
     }
+    pool()->Wait();
+  }
+
+  // The frequency of the sentences where sentencepieces[i] appears, counted
+  // once per occurrence.
+  std::vector<float> sentence_freq(sentencepieces.size(), 0.0);
+  for (size_t i = 0; i < sentencepieces.size(); ++i) {
+    if (!always_keep[i] || alternatives[i].empty()) continue;
+    for (size_t k = inverted_begins[i]; k < inverted_begins[i + 1]; ++k) {
+      sentence_freq[i] += sentences_[inverted[k]].second;
+    }
+  }
+
+  if (shard_reducer_ != nullptr) {
+    std::vector<double> values(freq.begin(), freq.end());
+    values.insert(values.end(), sentence_freq.begin(), sentence_freq.end());
+    values.push_back(vsum);
+    RETURN_IF_ERROR(shard_reducer_->AllReduce(&values));
+    const size_t size = sentencepieces.size();
+    std::copy(values.begin(), values.begin() + size, freq.begin());
+    std::copy(values.begin() + size, values.begin() + 2 * size,
+              sentence_freq.begin());
+    vsum = values.back();
   }
 
   const float sum = std::accumulate(freq.begin(), freq.end(), 0.0);
   const float logsum = std::log(static_cast<double>(sum));
   std::vector<std::pair<int, float>> candidates;
-  TrainerModel::SentencePieces new_sentencepieces;
+  new_sentencepieces->clear();
 
   // Finally, computes how likely the LM likelihood is reduced if
   // the sentencepiece[i] is removed from the vocabulary.
@@ -375,13 +936,11 @@ TrainerModel::SentencePieces Trainer::PruneSentencePieces(
       continue;
     } else if (alternatives[i].empty()) {
       // no alternatives. Keeps this entry.
-      new_sentencepieces.push_back(sentencepieces[i]);
+      new_sentencepieces->push_back(sentencepieces[i]);
     } else {
-      float F = 0.0;  // the frequency of sentencepieces[i].
-      for (const int n : inverted[i]) {
-        F += sentences_[n].second;
-      }
-      F /= vsum;  // normalizes by all sentence frequency.
+      // the frequency of sentencepieces[i], normalized by all sentence
+      // frequency.
+      const float F = sentence_freq[i] / vsum;
 
       // The logprob with the sentencepiece[i].
       const float logprob_sp = std::log(static_cast<double>(freq[i])) - logsum;
@@ -412,14 +971,15 @@ TrainerModel::SentencePieces Trainer::PruneSentencePieces(
 
   // Keeps trainer_spec_.shrinking_factor * sentencepieces.size() pieces.
   // shrinking_factor is 0.75 by default.
-  for (const auto &w : Sorted(candidates)) {
-    if (new_sentencepieces.size() == static_cast<size_t>(pruned_size)) {
+  ParallelPartialSort(&candidates, pruned_size, pool());
+  for (const auto &w : candidates) {
+    if (new_sentencepieces->size() == static_cast<size_t>(pruned_size)) {
       break;
     }
-    new_sentencepieces.emplace_back(sentencepieces[w.first]);
+    new_sentencepieces->emplace_back(sentencepieces[w.first]);
   }
 
-  return new_sentencepieces;
+  return util::OkStatus();
 }
 
 TrainerModel::SentencePieces Trainer::FinalizeSentencePieces(
@@ -432,7 +992,7 @@ TrainerModel::SentencePieces Trainer::FinalizeSentencePieces(
   // required_chars_ must be included in the final sentencepieces.
   float min_score_penalty = 0.0;
   constexpr float kMinScorePenaltyDelta = 0.0001;
-  for (const auto &w : Sorted(required_chars_)) {
+  for (const auto &w : Sorted(required_chars_, pool())) {
     const std::string s = string_util::UnicodeCharToUTF8(w.first);
     if (port::ContainsKey(sp, s)) {
       final_sentencepieces[s] = sp[s];
@@ -449,7 +1009,7 @@ TrainerModel::SentencePieces Trainer::FinalizeSentencePieces(
   CHECK_GT(vocab_size_size, 0);
 
   // Then keeps sentencepieces with higher scores.
-  for (const auto &w : Sorted(sentencepieces)) {
+  for (const auto &w : Sorted(sentencepieces, pool())) {
     if (port::ContainsKey(final_sentencepieces, w.first)) {
       continue;
     }
@@ -459,7 +1019,40 @@ TrainerModel::SentencePieces Trainer::FinalizeSentencePieces(
     final_sentencepieces[w.first] = w.second;
   }
 
-  return Sorted(final_sentencepieces);
+  return Sorted(final_sentencepieces, pool());
+}
+
+util::Status Trainer::SavePiecesCheckpoint(
+    int round, const TrainerModel::SentencePieces &pieces) const {
+  CheckpointWriter writer(CheckpointPath("unigram"));
+  RETURN_IF_ERROR(writer.status());
+  writer.PutUInt64(round);
+  writer.PutUInt64(pieces.size());
+  for (const auto &w : pieces) {
+    writer.PutString(w.first);
+    writer.PutFloat(w.second);
+  }
+  return writer.Close();
+}
+
+util::Status Trainer::LoadPiecesCheckpoint(
+    int *round, TrainerModel::SentencePieces *pieces) const {
+  CheckpointReader reader(CheckpointPath("unigram"));
+  RETURN_IF_ERROR(reader.status());
+  uint64 value = 0, size = 0;
+  CHECK_OR_RETURN(reader.GetUInt64(&value) && reader.GetUInt64(&size))
+      << "Broken checkpoint.";
+  *round = static_cast<int>(value);
+  pieces->clear();
+  std::string piece;
+  float score = 0.0;
+  for (uint64 i = 0; i < size; ++i) {
+    CHECK_OR_RETURN(reader.GetString(&piece) && reader.GetFloat(&score))
+        << "Broken checkpoint.";
+    pieces->emplace_back(piece, score);
+  }
+  CHECK_OR_RETURN(reader.done() && !pieces->empty()) << "Broken checkpoint.";
+  return util::OkStatus();
 }
 
 util::Status Trainer::Train() {
@@ -473,54 +1066,211 @@ util::Status Trainer::Train() {
   RETURN_IF_ERROR(model.status());
   RETURN_IF_ERROR(LoadSentences());
 
-  if (trainer_spec_.train_extremely_large_corpus()) {
-    auto seed_sentencepieces = MakeSeedSentencePieces<int64>();
-    model.SetSentencePieces(std::move(seed_sentencepieces));
+  // The seed pieces can be extracted from the unique words, which are
+  // otherwise only needed for the EM training.
+  const bool split_before_seeding = trainer_spec_.split_by_whitespace() &&
+                                    trainer_spec_.seed_from_unique_words();
+  const bool checkpointing = !trainer_spec_.checkpoint_dir().empty();
+  int round = 0;
+  if (HasCheckpoint("unigram")) {
+    TrainerModel::SentencePieces pieces;
+    RETURN_IF_ERROR(LoadPiecesCheckpoint(&round, &pieces));
+    LOG(INFO) << "Resuming from " << pieces.size()
+              << " pieces after pruning round " << round;
+    model.SetSentencePieces(std::move(pieces));
+    if (trainer_spec_.split_by_whitespace()) {
+      SplitSentencesByWhitespace();
+    }
   } else {
-    auto seed_sentencepieces = MakeSeedSentencePieces<int32>();
+    if (split_before_seeding) {
+      SplitSentencesByWhitespace();
+    }
+
+    TrainerProfiler::Phase seed_phase(profiler(), "seed_extraction");
+    seed_phase.set_sentences(sentences_.size());
+
+    // In a sharded training, the coordinator seeds from its own shard.
+    TrainerModel::SentencePieces seed_sentencepieces;
+    if (shard_reducer_ == nullptr || shard_reducer_->shard_id() == 0) {
+      if (trainer_spec_.candidate_models_size() > 0) {
+        RETURN_IF_ERROR(MakeCandidateSentencePieces(&seed_sentencepieces));
+      } else if (trainer_spec_.train_extremely_large_corpus()) {
+        seed_sentencepieces = MakeSeedSentencePieces<int64>();
+      } else {
+        seed_sentencepieces = MakeSeedSentencePieces<int32>();
+      }
+      if (!trainer_spec_.init_model().empty()) {
+        RETURN_IF_ERROR(AddInitPieces(&seed_sentencepieces));
+      }
+    }
+    if (shard_reducer_ != nullptr) {
+      ModelProto seed_proto;
+      for (const auto &w : seed_sentencepieces) {
+        auto *sp = seed_proto.add_pieces();
+        sp->set_piece(w.first);
+        sp->set_score(w.second);
+      }
+      std::string data = seed_proto.SerializeAsString();
+      RETURN_IF_ERROR(shard_reducer_->Broadcast(&data));
+      CHECK_OR_RETURN(seed_proto.ParseFromString(data));
+      seed_sentencepieces.clear();
+      for (const auto &sp : seed_proto.pieces()) {
+        seed_sentencepieces.emplace_back(sp.piece(), sp.score());
+      }
+      CHECK_OR_RETURN(!seed_sentencepieces.empty());
+    }
     model.SetSentencePieces(std::move(seed_sentencepieces));
-  }
+    seed_phase.set_vocab_size(model.GetPieceSize());
+    seed_phase.End();
+    if (checkpointing) {
+      RETURN_IF_ERROR(SavePiecesCheckpoint(0, model.GetSentencePieces()));
+    }
 
-  if (trainer_spec_.split_by_whitespace()) {
-    SplitSentencesByWhitespace();
+    if (trainer_spec_.split_by_whitespace() && !split_before_seeding) {
+      SplitSentencesByWhitespace();
+    }
   }
 
   LOG(INFO) << "Using " << sentences_.size() << " sentences for EM training";
 
-  desired_vocab_size_ = static_cast<size_t>(trainer_spec_.vocab_size() * 1.1);
+  all_sentence_freq_ = 0;
+  for (const auto &w : sentences_) {
+    all_sentence_freq_ += w.second;
+  }
+  int64 all_sentence_size = sentences_.size();
+  if (shard_reducer_ != nullptr) {
+    std::vector<double> values = {static_cast<double>(all_sentence_freq_),
+                                  static_cast<double>(all_sentence_size)};
+    RETURN_IF_ERROR(shard_reducer_->AllReduce(&values));
+    all_sentence_freq_ = static_cast<int64>(values[0]);
+    all_sentence_size = static_cast<int64>(values[1]);
+    LOG(INFO) << "Training shard " << shard_reducer_->shard_id() << " of "
+              << shard_reducer_->num_shards() << " with "
+              << all_sentence_freq_ << " sentences in all shards";
+  }
+
+  sentence_order_.resize(sentences_.size());
+  std::iota(sentence_order_.begin(), sentence_order_.end(), 0);
+  std::stable_sort(sentence_order_.begin(), sentence_order_.end(),
+                   [this](size_t a, size_t b) {
+                     return sentences_[a].first.size() >
+                            sentences_[b].first.size();
+                   });
+
+  // With em_batch_size, every shard cuts its sentences into the same number
+  // of mini-batches, so that all shards reduce the same steps.
+  int batches_per_pass = 1;
+  if (trainer_spec_.em_batch_size() > 0) {
+    const int64 num_shards =
+        shard_reducer_ == nullptr ? 1 : shard_reducer_->num_shards();
+    const int64 size = num_shards * trainer_spec_.em_batch_size();
+    batches_per_pass = static_cast<int>((all_sentence_size + size - 1) / size);
+  }
+  if (batches_per_pass > 1) {
+    LOG(INFO) << "Running stepwise EM on " << batches_per_pass
+              << " mini-batches per pass";
+  }
+
+  // With vocab_sizes, the pruning stops at every size from the largest one,
+  // where the model of the size is saved, and goes on to the next size.
+  std::vector<int> vocab_sizes = GetVocabSizes();
+  std::reverse(vocab_sizes.begin(), vocab_sizes.end());
+  if (vocab_sizes.empty()) vocab_sizes.push_back(trainer_spec_.vocab_size());
+  auto desired_vocab_size = [](int vocab_size) {
+    return static_cast<size_t>(vocab_size * 1.1);
+  };
+  const bool is_coordinator =
+      shard_reducer_ == nullptr || shard_reducer_->shard_id() == 0;
+
+  // A resumed training skips the sizes it has passed.
+  size_t size_index = 0;
+  if (trainer_spec_.resume()) {
+    while (size_index + 1 < vocab_sizes.size() &&
+           model.GetPieceSize() < desired_vocab_size(vocab_sizes[size_index])) {
+      ++size_index;
+    }
+  }
+  trainer_spec_.set_vocab_size(vocab_sizes[size_index]);
+  desired_vocab_size_ = desired_vocab_size(vocab_sizes[size_index]);
 
+  int em_iteration = 0;
+  ViterbiCache viterbi_cache;
   while (true) {
     // Sub-EM iteration.
-    for (int iter = 0; iter < trainer_spec_.num_sub_iterations(); ++iter) {
-      // Executes E step
-      float objective = 0.0;
-      int64 num_tokens = 0;
-      const auto expected = RunEStep(model, &objective, &num_tokens);
-
-      // Executes M step.
-      auto new_sentencepieces = RunMStep(model, expected);
-      model.SetSentencePieces(std::move(new_sentencepieces));
-
-      LOG(INFO) << "EM sub_iter=" << iter << " size=" << model.GetPieceSize()
-                << " obj=" << objective << " num_tokens=" << num_tokens
-                << " num_tokens/piece="
-                << 1.0 * num_tokens / model.GetPieceSize();
-    }  // end of Sub EM iteration
+    if (batches_per_pass > 1) {
+      RETURN_IF_ERROR(RunMiniBatchEM(&model, batches_per_pass, &em_iteration));
+    } else {
+      for (int iter = 0; iter < trainer_spec_.num_sub_iterations(); ++iter) {
+        TrainerProfiler::Phase em_phase(profiler(), "em");
+        em_phase.set_iteration(em_iteration++);
+        em_phase.set_sentences(sentences_.size());
+
+        // Executes E step
+        float objective = 0.0;
+        int64 num_tokens = 0;
+        auto expected = RunEStep(model, &objective, &num_tokens);
+        RETURN_IF_ERROR(ReduceEStep(&expected, &objective, &num_tokens));
+
+        // Executes M step.
+        auto new_sentencepieces = RunMStep(model, expected);
+        model.SetSentencePieces(std::move(new_sentencepieces));
+
+        LOG(INFO) << "EM sub_iter=" << iter
+                  << " size=" << model.GetPieceSize() << " obj=" << objective
+                  << " num_tokens=" << num_tokens << " num_tokens/piece="
+                  << 1.0 * num_tokens / model.GetPieceSize();
+        em_phase.set_vocab_size(model.GetPieceSize());
+        em_phase.set_objective(objective);
+      }  // end of Sub EM iteration
+    }
 
     // Stops the iteration when the size of sentences reaches to the
     // desired symbol size.
     if (model.GetPieceSize() <= desired_vocab_size_) {
-      break;
+      if (size_index + 1 == vocab_sizes.size()) break;
+      TrainerProfiler::Phase finalize_phase(profiler(), "finalize");
+      final_pieces_ = FinalizeSentencePieces(model);
+      finalize_phase.set_vocab_size(final_pieces_.size());
+      finalize_phase.End();
+      if (is_coordinator) {
+        RETURN_IF_ERROR(SaveForVocabSize(vocab_sizes[size_index]));
+      }
+      ++size_index;
+      trainer_spec_.set_vocab_size(vocab_sizes[size_index]);
+      desired_vocab_size_ = desired_vocab_size(vocab_sizes[size_index]);
     }
 
     // Prunes pieces.
-    auto new_sentencepieces = PruneSentencePieces(model);
+    TrainerProfiler::Phase prune_phase(profiler(), "prune");
+    prune_phase.set_sentences(sentences_.size());
+    TrainerModel::SentencePieces new_sentencepieces;
+    RETURN_IF_ERROR(PruneSentencePieces(
+        model, &new_sentencepieces,
+        trainer_spec_.prune_incremental_rounds() > 1 ? &viterbi_cache
+                                                      : nullptr));
     model.SetSentencePieces(std::move(new_sentencepieces));
+    prune_phase.set_vocab_size(model.GetPieceSize());
+    prune_phase.End();
+    if (checkpointing) {
+      RETURN_IF_ERROR(
+          SavePiecesCheckpoint(++round, model.GetSentencePieces()));
+    }
   }  // end of EM iteration
 
   // Finally, adjusts the size of sentencepices to be |vocab_size|.
+  TrainerProfiler::Phase finalize_phase(profiler(), "finalize");
   final_pieces_ = FinalizeSentencePieces(model);
+  finalize_phase.set_vocab_size(final_pieces_.size());
+  finalize_phase.End();
 
+  // All shards have the same model, which is saved by the coordinator.
+  if (!is_coordinator) {
+    return util::OkStatus();
+  }
+
+  if (trainer_spec_.vocab_sizes_size() > 0) {
+    return SaveForVocabSize(trainer_spec_.vocab_size());
+  }
   return Save();
 }
 }  // namespace unigram
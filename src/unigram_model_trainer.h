@@ -21,6 +21,7 @@
 #include <vector>
 
 #include "sentencepiece_model.pb.h"
+#include "shard_reducer.h"
 #include "third_party/absl/strings/string_view.h"
 #include "trainer_interface.h"
 #include "unigram_model.h"
@@ -54,6 +55,14 @@ class TrainerModel : public Model {
   }
 
  private:
+  // Maps the values of the current trie to the ids of `pieces` in
+  // trie_ids_, instead of building a trie of `pieces`. Returns false when
+  // a piece is not in the trie or too few of its pieces are left.
+  bool ReuseTrie(const std::vector<std::pair<absl::string_view, int>> &pieces);
+
+  // The number of pieces the current trie was built from.
+  size_t trie_size_ = 0;
+
   SentencePieces sentencepieces_;
   TrainerSpec trainer_spec_;
   NormalizerSpec normalizer_spec_;
@@ -66,10 +75,17 @@ class Trainer : public TrainerInterface {
           const NormalizerSpec &normalizer_spec,
           const NormalizerSpec &denormalizer_spec)
       : TrainerInterface::TrainerInterface(trainer_spec, normalizer_spec,
-                                           denormalizer_spec) {}
+                                           denormalizer_spec),
+        shard_reducer_(SentencePieceTrainer::GetShardReducerForTraining()) {}
 
   util::Status Train() override;
 
+  // Trains on one shard of a sharded training. Overrides the global shard
+  // reducer.
+  void SetShardReducer(ShardReducerInterface *shard_reducer) {
+    shard_reducer_ = shard_reducer;
+  }
+
  private:
   FRIEND_TEST(TrainerTest, IsValidSentencePieceTest);
 
@@ -80,6 +96,19 @@ class Trainer : public TrainerInterface {
   template <typename node_int_type>
   TrainerModel::SentencePieces MakeSeedSentencePieces() const;
 
+  // Puts the pieces of spec.init_model() before the |seed_sentencepieces|,
+  // of which all the characters and the best vocab_size new pieces are kept,
+  // so that a warm-started training only prunes a few rounds.
+  util::Status AddInitPieces(
+      TrainerModel::SentencePieces *seed_sentencepieces) const;
+
+  // Makes seed pieces from the union of the pieces of
+  // spec.candidate_models() instead of the training corpus. The probability
+  // of a piece is its mean probability in the models. The characters of the
+  // corpus are always included, and pieces with other characters are not.
+  util::Status MakeCandidateSentencePieces(
+      TrainerModel::SentencePieces *seed_sentencepieces) const;
+
   // Executes the E step of EM and returns expected count.
   // The index of return array is the vocab id.
   // |objective| is a negative likelihood of the current model.
@@ -88,21 +117,75 @@ class Trainer : public TrainerInterface {
   std::vector<float> RunEStep(const TrainerModel &model, float *objective,
                               int64 *num_tokens) const;
 
+  // Runs the E step on the sentences_[i] for i in |order|, longest first,
+  // and scales the statistics by |scale|, which extrapolates a mini-batch to
+  // the whole corpus.
+  std::vector<float> RunEStep(const TrainerModel &model,
+                              const std::vector<size_t> &order, float scale,
+                              float *objective, int64 *num_tokens) const;
+
   // Executes the M step of EM with the expected frequency and
   // returns new pieces.
   TrainerModel::SentencePieces RunMStep(
       const TrainerModel &model, const std::vector<float> &expected) const;
 
+  // Runs the EM sub-iterations of one pruning round as stepwise EM on
+  // |batches_per_pass| mini-batches per pass over the sentences. The expected
+  // counts of every batch are interpolated into running statistics, from
+  // which the M step updates |model|. Stops after num_sub_iterations passes
+  // or when the objective changes by less than em_tolerance over a pass.
+  util::Status RunMiniBatchEM(TrainerModel *model, int batches_per_pass,
+                              int *em_iteration) const;
+
+  // Sums the E step statistics over all shards in a sharded training.
+  util::Status ReduceEStep(std::vector<float> *expected, float *objective,
+                           int64 *num_tokens) const;
+
+  // The Viterbi paths of the sentences found by a pruning round, which the
+  // next rounds reuse with --prune_incremental_rounds.
+  struct ViterbiCache {
+    // The pieces the ids of the paths refer to.
+    std::vector<std::string> pieces;
+    // The piece ids of the Viterbi path of every sentence and the score of
+    // the path when Viterbi last found it.
+    std::vector<std::vector<int>> paths;
+    std::vector<float> scores;
+    // The rounds since all the sentences were segmented.
+    int rounds = 0;
+  };
+
   // Heuristically prunes the current pieces.
-  // This is called after each EM sub-iteration.
-  TrainerModel::SentencePieces PruneSentencePieces(
-      const TrainerModel &model) const;
+  // This is called after each EM sub-iteration. With `cache`, the Viterbi
+  // paths of the last round are reused where they may still be the best
+  // ones, and the paths of this round are stored for the next one.
+  util::Status PruneSentencePieces(
+      const TrainerModel &model,
+      TrainerModel::SentencePieces *new_sentencepieces,
+      ViterbiCache *cache = nullptr) const;
 
   // Makes the final sentence pieces by incorporating the required characters
   // and control/user defined symbols.
   TrainerModel::SentencePieces FinalizeSentencePieces(
       const TrainerModel &model) const;
 
+  // Saves the pieces after |round| pruning rounds, where round 0 holds the
+  // seed pieces, and restores the latest ones when resuming.
+  util::Status SavePiecesCheckpoint(int round,
+                                    const TrainerModel::SentencePieces &pieces)
+      const;
+  util::Status LoadPiecesCheckpoint(int *round,
+                                    TrainerModel::SentencePieces *pieces) const;
+
+  // Sums the statistics of the shards. nullptr unless sharded.
+  ShardReducerInterface *shard_reducer_ = nullptr;
+
+  // Total frequency of the sentences of all shards.
+  int64 all_sentence_freq_ = 0;
+
+  // Indices of sentences_, longest sentence first. The E step hands out
+  // sentences in this order so that the expensive ones are not left for last.
+  std::vector<size_t> sentence_order_;
+
   // When the size of SentencePieces becomes less than desired_vocab_size_,
   // break the main training loop. desired_vocab_size_ = 1.1 * vocab_size_
   // for now.
@@ -12,9 +12,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "filesystem.h"
+#include "pretokenizer_for_training.h"
 #include "sentencepiece_model.pb.h"
 #include "sentencepiece_processor.h"
 #include "sentencepiece_trainer.h"
+#include "shard_reducer.h"
 #include "testharness.h"
 #include "third_party/absl/strings/str_cat.h"
 #include "third_party/absl/strings/str_join.h"
@@ -35,6 +49,27 @@ TEST(UnigramTrainerTest, TrainerModelTest) {
   EXPECT_EQ(EncodeResult(), model.Encode("test"));
 }
 
+TEST(UnigramTrainerTest, TrainerModelReuseTrieTest) {
+  TrainerSpec trainer_spec;
+  NormalizerSpec normalizer_spec;
+  const TrainerModel::SentencePieces all = {
+      {"a", -1.0}, {"b", -1.0}, {"c", -1.0}, {"ab", -1.5},
+      {"bc", -1.5}, {"abc", -2.5}, {"ca", -1.8}, {"cab", -2.0}};
+
+  // Shrinks the pieces of `model` and compares it with a fresh model.
+  TrainerModel model(trainer_spec, normalizer_spec);
+  model.SetSentencePieces(TrainerModel::SentencePieces(all));
+  for (const size_t size : {8, 6, 5, 4, 3}) {
+    const TrainerModel::SentencePieces pieces(all.begin(), all.begin() + size);
+    model.SetSentencePieces(TrainerModel::SentencePieces(pieces));
+    TrainerModel fresh(trainer_spec, normalizer_spec);
+    fresh.SetSentencePieces(TrainerModel::SentencePieces(pieces));
+    for (const char *text : {"abcab", "cabca", "bcabc", "aabbcc"}) {
+      EXPECT_EQ(fresh.Encode(text), model.Encode(text));
+    }
+  }
+}
+
 static constexpr char kTestInputData[] = "wagahaiwa_nekodearu.txt";
 
 TEST(UnigramTrainerTest, EndToEndTest) {
@@ -80,12 +115,543 @@ TEST(UnigramTrainerTest, EndToEndTest) {
   EXPECT_EQ(WS
             " 吾輩 《 わが はい 》 は 猫 である 。 名前 はまだ 無い 。 "
             "どこ で 生 れた か とん と 見当 《 けん とう 》 が つか ぬ 。 "
-            "何でも 薄 暗 い じめ じめ した 所で ニャーニャー "
+            "何でも 薄 暗 い じめ (#startrepeat) 2 (#endrepeat) した 所で "
+            "ニャーニャー "
             "泣 い ていた 事 だけは 記憶 している 。",
             absl::StrJoin(tok, " "));
 #endif
 }
 
+TEST(UnigramTrainerTest, SeedFromUniqueWordsTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_words");
+
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                               " --vocab_size=1000 --model_type=unigram",
+                               " --seed_from_unique_words=true"))
+                  .ok());
+
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+  EXPECT_EQ(1000, sp.GetPieceSize());
+  EXPECT_TRUE(sp.model_proto().trainer_spec().seed_from_unique_words());
+
+  const std::string text = "I saw a girl with a telescope.";
+  std::vector<int> ids;
+  ASSERT_TRUE(sp.Encode(text, &ids).ok());
+  std::string detok;
+  ASSERT_TRUE(sp.Decode(ids, &detok).ok());
+  EXPECT_EQ(text, detok);
+
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --vocab_size=1000 --model_type=unigram",
+                                " --seed_from_unique_words=true",
+                                " --split_by_whitespace=false"))
+                   .ok());
+}
+
+TEST(UnigramTrainerTest, CheckpointTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string checkpoint_dir = absl::GetFlag(FLAGS_test_tmpdir);
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_ckpt");
+
+  // The corpus is restored from the checkpoint when resuming, so the input
+  // does not have to exist.
+  auto train = [&](absl::string_view input, absl::string_view flags) {
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --vocab_size=1000 --model_type=unigram",
+                                 " --checkpoint_dir=", checkpoint_dir, flags))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  const auto expected = train(input, "");
+  ASSERT_EQ(1000, expected.size());
+
+  // Resumes after the last pruning round.
+  EXPECT_EQ(expected, train("not_found.txt", " --resume"));
+
+  // Resumes from the corpus without the pieces.
+  std::remove(util::JoinPath(checkpoint_dir, "unigram.ckpt").c_str());
+  EXPECT_EQ(expected, train("not_found.txt", " --resume"));
+
+  std::remove(util::JoinPath(checkpoint_dir, "unigram.ckpt").c_str());
+  std::remove(util::JoinPath(checkpoint_dir, "corpus.ckpt").c_str());
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --vocab_size=1000 --model_type=unigram",
+                                " --resume"))
+                   .ok());
+}
+
+TEST(UnigramTrainerTest, VocabSizesTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_sizes");
+
+  auto load = [](const std::string &filename, SentencePieceProcessor *sp) {
+    EXPECT_TRUE(sp->Load(filename).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp->model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                               " --model_type=unigram",
+                               " --vocab_sizes=1000,500,2000"))
+                  .ok());
+
+  const std::string text = "I saw a girl with a telescope.";
+  for (const int size : {500, 1000, 2000}) {
+    SentencePieceProcessor sp;
+    const auto pieces = load(absl::StrCat(prefix, ".", size, ".model"), &sp);
+    EXPECT_EQ(size, pieces.size());
+    EXPECT_EQ(size, sp.model_proto().trainer_spec().vocab_size());
+    EXPECT_EQ(0, sp.model_proto().trainer_spec().vocab_sizes_size());
+    std::vector<int> ids;
+    ASSERT_TRUE(sp.Encode(text, &ids).ok());
+    std::string detok;
+    ASSERT_TRUE(sp.Decode(ids, &detok).ok());
+    EXPECT_EQ(text, detok);
+  }
+
+  // The pruning stops at the largest size as in a training for that size.
+  ASSERT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                               " --model_type=unigram --vocab_size=2000"))
+                  .ok());
+  SentencePieceProcessor sp1, sp2;
+  EXPECT_EQ(load(absl::StrCat(prefix, ".model"), &sp1),
+            load(absl::StrCat(prefix, ".2000.model"), &sp2));
+}
+
+TEST(UnigramTrainerTest, MiniBatchEMTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_batch");
+
+  auto train = [&](absl::string_view flags) {
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --vocab_size=1000 --model_type=unigram",
+                                 flags))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+
+    const std::string text = "I saw a girl with a telescope.";
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.Encode(text, &ids).ok());
+    std::string detok;
+    EXPECT_TRUE(sp.Decode(ids, &detok).ok());
+    EXPECT_EQ(text, detok);
+    return pieces;
+  };
+
+  const auto expected =
+      train(" --em_batch_size=1000 --num_sub_iterations=4");
+  EXPECT_EQ(1000, expected.size());
+
+  // The batches are the same in every training.
+  EXPECT_EQ(expected, train(" --em_batch_size=1000 --num_sub_iterations=4"));
+
+  // A batch holding all the sentences runs the full EM.
+  EXPECT_EQ(train(""), train(" --em_batch_size=1000000"));
+
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --vocab_size=1000 --model_type=unigram",
+                                " --em_batch_size=-1"))
+                   .ok());
+}
+
+TEST(UnigramTrainerTest, PruneIncrementalRoundsTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_prune");
+
+  auto train = [&](absl::string_view flags) {
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --vocab_size=1000 --model_type=unigram",
+                                 flags))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+
+    const std::string text = "I saw a girl with a telescope.";
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.Encode(text, &ids).ok());
+    std::string detok;
+    EXPECT_TRUE(sp.Decode(ids, &detok).ok());
+    EXPECT_EQ(text, detok);
+    return pieces;
+  };
+
+  // A single round re-segments every sentence, as the default does.
+  EXPECT_EQ(train(""), train(" --prune_incremental_rounds=1"));
+
+  const auto expected = train(" --prune_incremental_rounds=4");
+  EXPECT_EQ(1000, expected.size());
+  EXPECT_EQ(expected, train(" --prune_incremental_rounds=4"));
+
+  for (const char *flags :
+       {" --prune_incremental_rounds=-1", " --prune_score_margin=-0.5"}) {
+    EXPECT_FALSE(SentencePieceTrainer::Train(
+                     absl::StrCat("--model_prefix=", prefix, " --input=",
+                                  input,
+                                  " --vocab_size=1000 --model_type=unigram",
+                                  flags))
+                     .ok());
+  }
+}
+
+TEST(UnigramTrainerTest, InitModelTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_init");
+  const std::string init_model = absl::StrCat(prefix, ".init.model");
+
+  auto train = [&](absl::string_view flags) {
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --vocab_size=1000 --model_type=unigram",
+                                 flags))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+    std::set<std::string> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.insert(piece.piece());
+    }
+
+    const std::string text = "I saw a girl with a telescope.";
+    std::vector<int> ids;
+    EXPECT_TRUE(sp.Encode(text, &ids).ok());
+    std::string detok;
+    EXPECT_TRUE(sp.Decode(ids, &detok).ok());
+    EXPECT_EQ(text, detok);
+    return pieces;
+  };
+
+  const auto init_pieces = train("");
+  std::rename(absl::StrCat(prefix, ".model").c_str(), init_model.c_str());
+
+  // Most pieces stay when continuing on the same corpus.
+  const auto pieces = train(absl::StrCat(" --init_model=", init_model));
+  EXPECT_EQ(1000, pieces.size());
+  std::vector<std::string> common;
+  std::set_intersection(init_pieces.begin(), init_pieces.end(),
+                        pieces.begin(), pieces.end(),
+                        std::back_inserter(common));
+  EXPECT_GT(common.size(), 800);
+}
+
+TEST(UnigramTrainerTest, CandidateModelsTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_candidate");
+
+  // Splits the corpus into two parts, as if they were two languages.
+  std::vector<std::string> parts = {absl::StrCat(prefix, ".part0.txt"),
+                                    absl::StrCat(prefix, ".part1.txt")};
+  {
+    auto reader = filesystem::NewReadableFile(input);
+    ASSERT_TRUE(reader->status().ok());
+    std::vector<std::unique_ptr<filesystem::WritableFile>> writers;
+    for (const auto &part : parts) {
+      writers.emplace_back(filesystem::NewWritableFile(part));
+    }
+    std::string line;
+    for (int i = 0; reader->ReadLine(&line); ++i) {
+      writers[i < 2500 ? 0 : 1]->WriteLine(line);
+    }
+  }
+
+  auto train = [&](const std::string &model_prefix, absl::string_view flags,
+                   absl::string_view model_type = "unigram") {
+    return SentencePieceTrainer::Train(
+        absl::StrCat("--model_prefix=", model_prefix,
+                     " --vocab_size=1000 --model_type=", model_type, flags));
+  };
+
+  std::vector<std::string> candidates;
+  std::set<std::string> candidate_pieces;
+  for (int i = 0; i < 2; ++i) {
+    const std::string model_prefix = absl::StrCat(prefix, ".part", i);
+    ASSERT_TRUE(
+        train(model_prefix, absl::StrCat(" --input=", parts[i])).ok());
+    candidates.push_back(absl::StrCat(model_prefix, ".model"));
+    SentencePieceProcessor sp;
+    ASSERT_TRUE(sp.Load(candidates.back()).ok());
+    for (const auto &piece : sp.model_proto().pieces()) {
+      candidate_pieces.insert(piece.piece());
+    }
+  }
+
+  // Merges the candidates on a sample of both parts.
+  ASSERT_TRUE(train(prefix, absl::StrCat(" --input=", input,
+                                         " --input_sentence_size=1000",
+                                         " --shuffle_input_sentence=true",
+                                         " --candidate_models=",
+                                         absl::StrJoin(candidates, ",")))
+                  .ok());
+  SentencePieceProcessor sp;
+  ASSERT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+  EXPECT_EQ(1000, sp.GetPieceSize());
+  int num_merged = 0;
+  for (const auto &piece : sp.model_proto().pieces()) {
+    if (candidate_pieces.count(piece.piece())) ++num_merged;
+  }
+  EXPECT_GT(num_merged, 900);
+
+  const std::string text = "I saw a girl with a telescope.";
+  std::vector<int> ids;
+  EXPECT_TRUE(sp.Encode(text, &ids).ok());
+  std::string detok;
+  EXPECT_TRUE(sp.Decode(ids, &detok).ok());
+  EXPECT_EQ(text, detok);
+
+  // Only unigram models of the same normalization can be merged.
+  ASSERT_TRUE(
+      train(absl::StrCat(prefix, ".bpe"), absl::StrCat(" --input=", parts[0]),
+            "bpe")
+          .ok());
+  EXPECT_FALSE(train(prefix, absl::StrCat(" --input=", input,
+                                          " --candidate_models=", prefix,
+                                          ".bpe.model"))
+                   .ok());
+  EXPECT_FALSE(train(prefix, absl::StrCat(" --input=", input,
+                                          " --normalization_rule_name=nfkc_cf",
+                                          " --candidate_models=",
+                                          candidates[0]))
+                   .ok());
+  EXPECT_FALSE(train(prefix,
+                     absl::StrCat(" --input=", input, " --candidate_models=",
+                                  candidates[0]),
+                     "bpe")
+                   .ok());
+}
+
+TEST(UnigramTrainerTest, ProfileOutputTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string prefix =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "tmp_model_profile");
+  const std::string profile =
+      util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), "profile.jsonl");
+  EXPECT_TRUE(SentencePieceTrainer::Train(
+                  absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                               " --vocab_size=1000 --model_type=unigram",
+                               " --profile_output=", profile))
+                  .ok());
+
+  auto reader = filesystem::NewReadableFile(profile);
+  ASSERT_TRUE(reader->status().ok());
+  std::vector<std::string> phases;
+  std::string line;
+  while (reader->ReadLine(&line)) {
+    ASSERT_EQ(0, line.find("{\"phase\":\"")) << line;
+    EXPECT_EQ('}', line.back());
+    EXPECT_NE(std::string::npos, line.find("\"wall_sec\":"));
+    EXPECT_NE(std::string::npos, line.find("\"peak_rss_mb\":"));
+    const size_t begin = line.find(':') + 2;
+    phases.push_back(line.substr(begin, line.find('"', begin) - begin));
+    if (phases.back() == "em") {
+      EXPECT_NE(std::string::npos, line.find("\"objective\":"));
+    }
+  }
+
+  for (const std::string phase : {"load_sentences", "normalize",
+                                  "required_chars", "seed_extraction", "em",
+                                  "prune", "finalize", "save"}) {
+    EXPECT_NE(phases.end(), std::find(phases.begin(), phases.end(), phase))
+        << phase;
+  }
+  EXPECT_EQ("load_sentences", phases.front());
+  EXPECT_EQ("save", phases.back());
+
+  EXPECT_FALSE(SentencePieceTrainer::Train(
+                   absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                " --vocab_size=1000 --model_type=unigram",
+                                " --profile_output=/not/found/profile.jsonl"))
+                   .ok());
+}
+
+TEST(UnigramTrainerTest, ShardedTrainingTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), "botchan.txt");
+  const std::string tmpdir = absl::GetFlag(FLAGS_test_tmpdir);
+  const std::string flags =
+      " --vocab_size=1000 --model_type=unigram --num_threads=2";
+
+  auto get_pieces = [](absl::string_view model_file) {
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(model_file).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  // A single shard trains the same model.
+  const std::string prefix = util::JoinPath(tmpdir, "tmp_model_unsharded");
+  ASSERT_TRUE(SentencePieceTrainer::Train(absl::StrCat(
+                                              "--model_prefix=", prefix,
+                                              " --input=", input, flags))
+                  .ok());
+  {
+    FileShardReducer reducer(util::JoinPath(tmpdir, "sync_single"), 0, 1);
+    ASSERT_TRUE(
+        SentencePieceTrainer::SetShardReducerForTraining(&reducer).ok());
+    const util::Status status = SentencePieceTrainer::Train(
+        absl::StrCat("--model_prefix=", prefix, "_single", " --input=", input,
+                     flags));
+    ASSERT_TRUE(SentencePieceTrainer::SetShardReducerForTraining(nullptr).ok());
+    ASSERT_TRUE(status.ok());
+  }
+  EXPECT_EQ(get_pieces(absl::StrCat(prefix, ".model")),
+            get_pieces(absl::StrCat(prefix, "_single.model")));
+
+  // Splits the corpus into two shards.
+  constexpr int kNumShards = 2;
+  std::vector<std::string> shard_files;
+  {
+    auto fp = filesystem::NewReadableFile(input);
+    ASSERT_TRUE(fp->status().ok());
+    std::vector<std::unique_ptr<filesystem::WritableFile>> outputs;
+    for (int n = 0; n < kNumShards; ++n) {
+      shard_files.push_back(
+          util::JoinPath(tmpdir, absl::StrCat("botchan_shard", n) + ".txt"));
+      outputs.push_back(filesystem::NewWritableFile(shard_files.back()));
+    }
+    std::string line;
+    for (int i = 0; fp->ReadLine(&line); ++i) {
+      outputs[i % kNumShards]->WriteLine(line);
+    }
+  }
+
+  // The first step fails on the files left by a run interrupted in its first
+  // steps, so every run uses its own prefix.
+  const std::string sync_prefix = util::JoinPath(
+      tmpdir, absl::StrCat("sync_sharded_") +
+                  std::to_string(std::chrono::system_clock::now()
+                                     .time_since_epoch()
+                                     .count()));
+  std::vector<util::Status> status(kNumShards);
+  std::vector<std::thread> threads;
+  for (int n = 0; n < kNumShards; ++n) {
+    const std::string shard_prefix =
+        util::JoinPath(tmpdir, absl::StrCat("tmp_model_shard", n));
+    std::remove(absl::StrCat(shard_prefix, ".model").c_str());
+    threads.emplace_back([&, n, shard_prefix]() {
+      TrainerSpec trainer_spec;
+      NormalizerSpec normalizer_spec, denormalizer_spec;
+      status[n] = SentencePieceTrainer::MergeSpecsFromArgs(
+          absl::StrCat("--model_prefix=", shard_prefix,
+                       " --input=", shard_files[n], flags),
+          &trainer_spec, &normalizer_spec, &denormalizer_spec);
+      if (!status[n].ok()) return;
+      status[n] =
+          SentencePieceTrainer::PopulateNormalizerSpec(&normalizer_spec, false);
+      if (!status[n].ok()) return;
+      FileShardReducer reducer(sync_prefix, n, kNumShards);
+      Trainer trainer(trainer_spec, normalizer_spec, denormalizer_spec);
+      trainer.SetShardReducer(&reducer);
+      status[n] = trainer.Train();
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  for (const auto &s : status) EXPECT_TRUE(s.ok());
+
+  // Only the coordinator saves the model.
+  const std::string model0 = util::JoinPath(tmpdir, "tmp_model_shard0.model");
+  const std::string model1 = util::JoinPath(tmpdir, "tmp_model_shard1.model");
+  EXPECT_EQ(1000, get_pieces(model0).size());
+  EXPECT_FALSE(filesystem::NewReadableFile(model1)->status().ok());
+}
+
+// Returns every text as one piece, which does not constrain the pieces.
+class WholeTextPretokenizer
+    : public pretokenizer::PretokenizerForTrainingInterface {
+ public:
+  SentencePieceText Tokenize(absl::string_view text) const override {
+    SentencePieceText spt;
+    if (!text.empty()) {
+      auto *piece = spt.add_pieces();
+      piece->set_surface(std::string(text));
+      piece->set_begin(0);
+      piece->set_end(text.size());
+    }
+    return spt;
+  }
+
+  util::Status status() const override { return util::OkStatus(); }
+};
+
+TEST(UnigramTrainerTest, PretokenizerTest) {
+  const std::string input =
+      util::JoinPath(absl::GetFlag(FLAGS_test_srcdir), kTestInputData);
+
+  auto train = [&](absl::string_view name) {
+    const std::string prefix =
+        util::JoinPath(absl::GetFlag(FLAGS_test_tmpdir), name);
+    EXPECT_TRUE(SentencePieceTrainer::Train(
+                    absl::StrCat("--model_prefix=", prefix, " --input=", input,
+                                 " --vocab_size=4000 --model_type=unigram",
+                                 " --normalization_rule_name=identity",
+                                 " --max_sentence_length=2048 --num_threads=4"))
+                    .ok());
+    SentencePieceProcessor sp;
+    EXPECT_TRUE(sp.Load(absl::StrCat(prefix, ".model")).ok());
+    std::vector<std::pair<std::string, float>> pieces;
+    for (const auto &piece : sp.model_proto().pieces()) {
+      pieces.emplace_back(piece.piece(), piece.score());
+    }
+    return pieces;
+  };
+
+  const auto expected = train("tmp_model_no_pretokenizer");
+
+  const WholeTextPretokenizer pretokenizer;
+  ASSERT_TRUE(SentencePieceTrainer::SetPretokenizerForTraining(&pretokenizer)
+                  .ok());
+  const auto actual = train("tmp_model_pretokenizer");
+  ASSERT_TRUE(SentencePieceTrainer::SetPretokenizerForTraining(nullptr).ok());
+
+  EXPECT_EQ(expected, actual);
+}
+
 }  // namespace
 }  // namespace unigram
 }  // namespace sentencepiece
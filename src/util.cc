@@ -14,8 +14,24 @@
 
 #include "util.h"
 
+#include <algorithm>
 #include <iostream>
 
+#include "cpu_dispatch.h"
+#include "third_party/absl/strings/str_cat.h"
+#include "third_party/absl/strings/str_split.h"
+#include "third_party/absl/strings/strip.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef OS_WIN
+#include <unistd.h>
+#endif
+
 namespace sentencepiece {
 namespace {
 constexpr unsigned int kDefaultSeed = static_cast<unsigned int>(-1);
@@ -31,7 +47,6 @@ uint32 GetRandomGeneratorSeed() {
 }
 
 namespace string_util {
-
 // mblen sotres the number of bytes consumed after decoding.
 char32 DecodeUTF8(const char *begin, const char *end, size_t *mblen) {
   const size_t len = end - begin;
@@ -71,8 +86,13 @@ char32 DecodeUTF8(const char *begin, const char *end, size_t *mblen) {
 bool IsStructurallyValid(absl::string_view str) {
   const char *begin = str.data();
   const char *end = str.data() + str.size();
+  const cpu::Kernels &kernels = cpu::GetKernels();
   size_t mblen = 0;
   while (begin < end) {
+    if (static_cast<unsigned char>(*begin) < 0x80) {
+      begin += kernels.ascii_prefix_length(begin, end);
+      continue;
+    }
     const char32 c = DecodeUTF8(begin, end, &mblen);
     if (c == kUnicodeError && mblen != 3) return false;
     if (!IsValidCodepoint(c)) return false;
@@ -121,15 +141,24 @@ size_t EncodeUTF8(char32 c, char *output) {
 std::string UnicodeCharToUTF8(const char32 c) { return UnicodeTextToUTF8({c}); }
 
 UnicodeText UTF8ToUnicodeText(absl::string_view utf8) {
-  UnicodeText uc;
+  // Every character takes at least one byte.
+  UnicodeText uc(utf8.size());
+  char32 *output = uc.data();
   const char *begin = utf8.data();
   const char *end = utf8.data() + utf8.size();
+  const cpu::Kernels &kernels = cpu::GetKernels();
   while (begin < end) {
+    if (static_cast<unsigned char>(*begin) < 0x80) {
+      const size_t ascii = kernels.decode_ascii_prefix(begin, end, output);
+      begin += ascii;
+      output += ascii;
+      continue;
+    }
     size_t mblen;
-    const char32 c = DecodeUTF8(begin, end, &mblen);
-    uc.push_back(c);
+    *output++ = DecodeUTF8(begin, end, &mblen);
     begin += mblen;
   }
+  uc.resize(output - uc.data());
   return uc;
 }
 
@@ -144,6 +173,26 @@ std::string UnicodeTextToUTF8(const UnicodeText &utext) {
 }
 }  // namespace string_util
 
+namespace port {
+
+uint64 Fingerprint(absl::string_view bytes) {
+  // The bytes are read as little-endian words, so that the fingerprint of
+  // the bytes does not depend on the platform.
+  uint64 fp = bytes.size();
+  for (size_t i = 0; i < bytes.size(); i += sizeof(uint64)) {
+    uint64 word = 0;
+    const size_t end = std::min(i + sizeof(uint64), bytes.size());
+    for (size_t k = i; k < end; ++k) {
+      word |= static_cast<uint64>(static_cast<unsigned char>(bytes[k]))
+              << (8 * (k - i));
+    }
+    fp = FingerprintCat(fp, word);
+  }
+  return fp;
+}
+
+}  // namespace port
+
 namespace random {
 #ifdef SPM_NO_THREADLOCAL
 namespace {
@@ -173,12 +222,60 @@ std::mt19937 *GetRandomGenerator() {
   static RandomGeneratorStorage *storage = new RandomGeneratorStorage;
   return storage->Get();
 }
+
+namespace {
+// Holds the CounterGenerator of the innermost ScopedCounterGenerator of
+// every thread.
+pthread_key_t *GetCounterGeneratorKey() {
+  static pthread_key_t *key = [] {
+    auto *key = new pthread_key_t;
+    pthread_key_create(key, nullptr);
+    return key;
+  }();
+  return key;
+}
+
+CounterGenerator *GetCounterGenerator() {
+  return static_cast<CounterGenerator *>(
+      pthread_getspecific(*GetCounterGeneratorKey()));
+}
+
+void SetCounterGenerator(CounterGenerator *generator) {
+  pthread_setspecific(*GetCounterGeneratorKey(), generator);
+}
+}  // namespace
 #else
 std::mt19937 *GetRandomGenerator() {
   thread_local static std::mt19937 mt(GetRandomGeneratorSeed());
   return &mt;
 }
+
+namespace {
+// The CounterGenerator of the innermost ScopedCounterGenerator.
+thread_local CounterGenerator *g_counter_generator = nullptr;
+
+CounterGenerator *GetCounterGenerator() { return g_counter_generator; }
+
+void SetCounterGenerator(CounterGenerator *generator) {
+  g_counter_generator = generator;
+}
+}  // namespace
 #endif
+
+ScopedCounterGenerator::ScopedCounterGenerator(uint64 seed, uint64 stream)
+    : generator_(seed, stream), previous_(GetCounterGenerator()) {
+  SetCounterGenerator(&generator_);
+}
+
+ScopedCounterGenerator::~ScopedCounterGenerator() {
+  SetCounterGenerator(previous_);
+}
+
+SamplingGenerator GetSamplingGenerator() {
+  CounterGenerator *counter = GetCounterGenerator();
+  if (counter != nullptr) return SamplingGenerator(counter, nullptr);
+  return SamplingGenerator(nullptr, GetRandomGenerator());
+}
 }  // namespace random
 
 namespace util {
@@ -235,6 +332,307 @@ std::vector<std::string> StrSplitAsCSV(absl::string_view text) {
 }
 }  // namespace util
 
+namespace numa {
+#ifdef __linux__
+namespace {
+// Parses the decimal number `str`.
+bool ParseNumber(absl::string_view str, int *number) {
+  if (str.empty()) return false;
+  *number = 0;
+  for (const char c : str) {
+    if (c < '0' || c > '9') return false;
+    *number = *number * 10 + (c - '0');
+  }
+  return true;
+}
+
+// Parses a CPU list of sysfs, e.g., "0-15,32-47".
+std::vector<int> ParseCpuList(absl::string_view list) {
+  std::vector<int> cpus;
+  for (const auto range : absl::StrSplit(list, ",\n")) {
+    const std::vector<absl::string_view> ends = absl::StrSplit(range, "-");
+    int first = 0, last = 0;
+    if (ends.empty() || !ParseNumber(ends[0], &first)) continue;
+    last = first;
+    if (ends.size() > 1 && !ParseNumber(ends[1], &last)) continue;
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+}  // namespace
+
+std::vector<std::vector<int>> GetNodeCpus() {
+  std::vector<std::vector<int>> nodes;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+
+  constexpr char kNodeDir[] = "/sys/devices/system/node";
+  DIR *dir = opendir(kNodeDir);
+  if (dir == nullptr) return nodes;
+  std::vector<int> ids;
+  while (const struct dirent *entry = readdir(dir)) {
+    absl::string_view name(entry->d_name);
+    int id = 0;
+    if (absl::ConsumePrefix(&name, "node") && ParseNumber(name, &id)) {
+      ids.push_back(id);
+    }
+  }
+  closedir(dir);
+  std::sort(ids.begin(), ids.end());
+
+  for (const int id : ids) {
+    const std::string path = absl::StrCat(kNodeDir, "/node", id, "/cpulist");
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == nullptr) continue;
+    char buffer[4096];
+    const size_t size = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    fclose(fp);
+    std::vector<int> cpus;
+    for (const int cpu : ParseCpuList(absl::string_view(buffer, size))) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+    if (!cpus.empty()) nodes.push_back(std::move(cpus));
+  }
+  return nodes;
+}
+#else
+std::vector<std::vector<int>> GetNodeCpus() { return {}; }
+#endif  // __linux__
+}  // namespace numa
+
+ThreadPool::ThreadPool(int32 n, bool numa_aware) {
+  n = std::max<int32>(n, 1);
+  for (int32 i = 0; i < n; ++i) {
+    queues_.emplace_back(new Queue);
+  }
+  for (int32 i = 0; i < n; ++i) {
+    workers_.emplace_back([this, i]() { Run(i); });
+  }
+
+#ifdef __linux__
+  if (!numa_aware) return;
+  const auto nodes = numa::GetNodeCpus();
+  if (nodes.size() < 2) return;
+  // Worker i takes the node holding the (i * num_cpus / n)-th allowed CPU,
+  // so that consecutive workers share a node.
+  size_t num_cpus = 0;
+  for (const auto &cpus : nodes) num_cpus += cpus.size();
+  for (int32 i = 0; i < n; ++i) {
+    size_t rank = static_cast<size_t>(i) * num_cpus / n;
+    size_t node = 0;
+    while (rank >= nodes[node].size()) rank -= nodes[node++].size();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : nodes[node]) CPU_SET(cpu, &set);
+    // Pinning is an optimization, so a failure only keeps the default.
+    pthread_setaffinity_np(workers_[i].native_handle(), sizeof(set), &set);
+  }
+#endif  // __linux__
+}
+
+ThreadPool::~ThreadPool() {
+  Wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::Schedule(std::function<void()> closure) {
+  const uint32 index = next_queue_.fetch_add(1) % queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+    queues_[index]->closures.emplace_back(std::move(closure));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++num_queued_;
+    ++num_pending_;
+  }
+  work_cv_.notify_one();
+}
+
+void ThreadPool::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this]() { return num_pending_ == 0; });
+}
+
+void ThreadPool::ParallelFor(int64 size, int64 chunk_size,
+                             const std::function<void(int64, int64)> &fn) {
+  ParallelFor(size, chunk_size, num_workers(), fn);
+}
+
+void ThreadPool::ParallelFor(int64 size, int64 chunk_size, int32 max_workers,
+                             const std::function<void(int64, int64)> &fn) {
+  if (size <= 0) return;
+  chunk_size = std::max<int64>(chunk_size, 1);
+  const int64 num_chunks = (size + chunk_size - 1) / chunk_size;
+
+  std::atomic<int64> next_chunk(0);
+  auto run = [&]() {
+    for (;;) {
+      const int64 chunk = next_chunk.fetch_add(1);
+      if (chunk >= num_chunks) break;
+      const int64 begin = chunk * chunk_size;
+      fn(begin, std::min(begin + chunk_size, size));
+    }
+  };
+
+  // The calling thread takes chunks too, so at most num_chunks - 1 helpers
+  // are useful.
+  const int64 num_helpers = std::min<int64>(
+      std::min(num_workers(), std::max<int32>(max_workers, 0)),
+      num_chunks - 1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  int64 num_running = num_helpers;
+  for (int64 i = 0; i < num_helpers; ++i) {
+    Schedule([&]() {
+      run();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--num_running == 0) cv.notify_all();
+    });
+  }
+
+  run();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return num_running == 0; });
+}
+
+void ThreadPool::Run(int32 index) {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this]() { return stop_ || num_queued_ > 0; });
+      if (num_queued_ == 0) return;  // stop_ is set.
+      // Claims one of the queued closures.
+      --num_queued_;
+    }
+
+    std::function<void()> closure;
+    while (!Pop(index, &closure)) {
+      std::this_thread::yield();
+    }
+    closure();
+    closure = nullptr;
+
+    bool done = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done = --num_pending_ == 0;
+    }
+    if (done) done_cv_.notify_all();
+  }
+}
+
+bool ThreadPool::Pop(int32 index, std::function<void()> *closure) {
+  {
+    Queue *queue = queues_[index].get();
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (!queue->closures.empty()) {
+      *closure = std::move(queue->closures.back());
+      queue->closures.pop_back();
+      return true;
+    }
+  }
+  for (size_t k = 1; k < queues_.size(); ++k) {
+    Queue *queue = queues_[(index + k) % queues_.size()].get();
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (!queue->closures.empty()) {
+      *closure = std::move(queue->closures.front());
+      queue->closures.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+// True on the threads running a chunk of SharedParallelFor() or a closure of
+// ForEachSharedPoolWorker(). A nested call on the pool would wait for
+// helpers queued behind these, which may all be waiting the same way.
+thread_local bool g_in_shared_pool = false;
+
+// Returns the pool of SharedParallelFor(), grown to at least `num_workers`.
+std::shared_ptr<ThreadPool> GetSharedPool(int num_workers) {
+  // Leaked, so that the workers outlive the static destructors.
+  static auto *mutex = new std::mutex;
+  static auto *shared_pool = new std::shared_ptr<ThreadPool>;
+  std::lock_guard<std::mutex> lock(*mutex);
+#ifndef OS_WIN
+  // A child forked from the process has none of the workers, so it leaks
+  // the pool, whose destructor would wait for them, and starts its own.
+  static pid_t pool_pid = 0;
+  if (pool_pid != getpid()) {
+    if (*shared_pool != nullptr) {
+      new std::shared_ptr<ThreadPool>(std::move(*shared_pool));
+      shared_pool->reset();
+    }
+    pool_pid = getpid();
+  }
+#endif
+  if (*shared_pool == nullptr ||
+      (*shared_pool)->num_workers() < num_workers) {
+    // Calls running on the smaller pool keep it until they return.
+    *shared_pool = std::make_shared<ThreadPool>(num_workers);
+  }
+  return *shared_pool;
+}
+}  // namespace
+
+void SharedParallelFor(int64 size, int64 chunk_size, int num_threads,
+                       const std::function<void(int64, int64)> &fn) {
+  if (num_threads <= 1 || size <= chunk_size || g_in_shared_pool) {
+    if (size > 0) fn(0, size);
+    return;
+  }
+  GetSharedPool(num_threads - 1)
+      ->ParallelFor(size, chunk_size, num_threads - 1,
+                    [&fn](int64 begin, int64 end) {
+                      g_in_shared_pool = true;
+                      fn(begin, end);
+                      g_in_shared_pool = false;
+                    });
+}
+
+void ForEachSharedPoolWorker(int num_threads,
+                             const std::function<void()> &fn) {
+  if (num_threads <= 1 || g_in_shared_pool) return;
+  // A worker waits until every closure has started, so that each one runs
+  // on its own worker. Two calls at once would split the workers between
+  // them and wait forever, so they run one after the other.
+  static auto *call_mutex = new std::mutex;
+  std::lock_guard<std::mutex> call_lock(*call_mutex);
+  const auto pool = GetSharedPool(num_threads - 1);
+  const int32 n = pool->num_workers();
+  std::mutex mutex;
+  std::condition_variable cv;
+  int32 num_started = 0;
+  int32 num_done = 0;
+  for (int32 i = 0; i < n; ++i) {
+    pool->Schedule([&]() {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (++num_started == n) cv.notify_all();
+        cv.wait(lock, [&]() { return num_started == n; });
+      }
+      g_in_shared_pool = true;
+      fn();
+      g_in_shared_pool = false;
+      std::lock_guard<std::mutex> lock(mutex);
+      if (++num_done == n) cv.notify_all();
+    });
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return num_done == n; });
+}
+
 #ifdef OS_WIN
 namespace win32 {
 std::wstring Utf8ToWide(const std::string &input) {
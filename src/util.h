@@ -19,8 +19,12 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <sstream>
 #include <string>
@@ -252,6 +256,26 @@ void InsertOrDie(Collection *const collection,
   CHECK(InsertIfNotPresent(collection, key, data)) << "duplicate key";
 }
 
+// Estimates of the heap bytes of a container, without the memory its
+// elements own themselves. Hash maps count their buckets and one node of
+// the element, its link and its cached hash per element.
+template <class T>
+size_t ContainerBytes(const std::vector<T> &container) {
+  return container.capacity() * sizeof(T);
+}
+
+inline size_t ContainerBytes(const std::string &container) {
+  // Short strings are stored in the object itself.
+  return container.capacity() > 15 ? container.capacity() + 1 : 0;
+}
+
+template <class Collection>
+size_t HashMapBytes(const Collection &collection) {
+  return collection.bucket_count() * sizeof(void *) +
+         collection.size() * (sizeof(typename Collection::value_type) +
+                              sizeof(void *) + sizeof(size_t));
+}
+
 // hash
 inline void mix(uint64 &a, uint64 &b, uint64 &c) {  // 64bit version
   a -= b;
@@ -298,12 +322,101 @@ inline uint64 FingerprintCat(uint64 x, uint64 y) {
   return y;
 }
 
+// Returns the fingerprint of `bytes`, which is the same on every platform,
+// so that it can identify data shared between processes or stored in files.
+uint64 Fingerprint(absl::string_view bytes);
+
 }  // namespace port
 
 namespace random {
 
 std::mt19937 *GetRandomGenerator();
 
+// A counter-based generator, whose draws are the SplitMix64 hashes of a key
+// and a counter. The key is made of a seed and a stream, e.g., the index of
+// a sentence in a batch, so the draws of a stream do not depend on the
+// thread making them or on the other streams. The counter is split into
+// the index of a sample and the index of a draw within it.
+class CounterGenerator {
+ public:
+  using result_type = uint32;
+
+  CounterGenerator(uint64 seed, uint64 stream)
+      : key_(Mix(Mix(seed + kGamma) ^ stream)) {}
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xFFFFFFFF; }
+
+  // Continues with the draws of the `sample`-th sample of the stream.
+  void SetSample(uint32 sample) {
+    counter_ = static_cast<uint64>(sample) << 32;
+  }
+
+  result_type operator()() {
+    return static_cast<result_type>(Mix(key_ + kGamma * ++counter_) >> 32);
+  }
+
+ private:
+  static constexpr uint64 kGamma = 0x9e3779b97f4a7c15ULL;
+
+  static uint64 Mix(uint64 z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64 key_;
+  uint64 counter_ = 0;
+};
+
+// Makes the samplers of this thread draw from CounterGenerator(seed, stream)
+// while it lives. Scopes may nest.
+class ScopedCounterGenerator {
+ public:
+  ScopedCounterGenerator(uint64 seed, uint64 stream);
+  ~ScopedCounterGenerator();
+
+  ScopedCounterGenerator(const ScopedCounterGenerator &) = delete;
+  ScopedCounterGenerator &operator=(const ScopedCounterGenerator &) = delete;
+
+ private:
+  CounterGenerator generator_;
+  CounterGenerator *previous_;
+};
+
+// The generator the samplers draw from: the CounterGenerator of the
+// innermost ScopedCounterGenerator of this thread, or GetRandomGenerator().
+class SamplingGenerator {
+ public:
+  using result_type = uint32;
+
+  SamplingGenerator() {}
+  SamplingGenerator(CounterGenerator *counter, std::mt19937 *mt)
+      : counter_(counter), mt_(mt) {}
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xFFFFFFFF; }
+
+  bool empty() const { return counter_ == nullptr && mt_ == nullptr; }
+
+  // Continues with the draws of the `sample`-th sample. Has no effect on
+  // GetRandomGenerator(), whose draws only depend on the previous ones.
+  void SetSample(uint32 sample) {
+    if (counter_ != nullptr) counter_->SetSample(sample);
+  }
+
+  result_type operator()() {
+    return counter_ != nullptr ? (*counter_)()
+                               : static_cast<result_type>((*mt_)());
+  }
+
+ private:
+  CounterGenerator *counter_ = nullptr;
+  std::mt19937 *mt_ = nullptr;
+};
+
+SamplingGenerator GetSamplingGenerator();
+
 template <typename T>
 class ReservoirSampler {
  public:
@@ -433,20 +546,87 @@ void STLDeleteElements(std::vector<T *> *vec) {
 }
 }  // namespace port
 
+namespace numa {
+// Returns the CPUs this process may run on, grouped by NUMA node, skipping
+// the nodes it may not use. Returns an empty vector when the topology is
+// unknown, e.g., outside Linux.
+std::vector<std::vector<int>> GetNodeCpus();
+}  // namespace numa
+
+// Fixed-size pool of persistent worker threads. Every worker owns a deque of
+// closures; idle workers steal from the other workers' deques.
 class ThreadPool {
  public:
-  ThreadPool(int32 n) {}
-  virtual ~ThreadPool() {
-    for (auto &task : tasks_) {
-      task.join();
-    }
-  }
+  // Starts `n` workers (at least one). With `numa_aware` on a machine with
+  // several NUMA nodes, the workers are spread over the nodes in proportion
+  // to their CPUs and each worker is pinned to the CPUs of its node, so that
+  // the memory a closure first touches is local to the CPUs running it.
+  explicit ThreadPool(int32 n, bool numa_aware = false);
+
+  // Waits for all scheduled closures and stops the workers.
+  virtual ~ThreadPool();
 
-  void Schedule(std::function<void()> closure) { tasks_.emplace_back(closure); }
+  // Runs `closure` on one of the workers.
+  void Schedule(std::function<void()> closure);
+
+  // Workers are started by the constructor. Kept for compatibility.
   void StartWorkers() {}
 
+  // Blocks until all closures scheduled so far have finished.
+  // Must not be called from a closure running on this pool.
+  void Wait();
+
+  // Calls `fn(begin, end)` for consecutive chunks of at most `chunk_size`
+  // elements covering [0, size). Chunks are handed out dynamically to the
+  // workers and the calling thread. Returns when all chunks are done.
+  // Must not be called from a closure running on this pool.
+  void ParallelFor(int64 size, int64 chunk_size,
+                   const std::function<void(int64, int64)> &fn);
+
+  // Same as above, but at most `max_workers` workers help the calling thread.
+  void ParallelFor(int64 size, int64 chunk_size, int32 max_workers,
+                   const std::function<void(int64, int64)> &fn);
+
+  // Returns the number of workers.
+  int32 num_workers() const { return static_cast<int32>(workers_.size()); }
+
  private:
-  std::vector<std::thread> tasks_;
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> closures;
+  };
+
+  void Run(int32 index);
+
+  // Pops a closure from the back of the own queue, or steals one from the
+  // front of another queue.
+  bool Pop(int32 index, std::function<void()> *closure);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  int64 num_queued_ = 0;   // closures in the queues not yet claimed.
+  int64 num_pending_ = 0;  // closures scheduled and not yet finished.
+  bool stop_ = false;
+  std::atomic<uint32> next_queue_{0};
 };
+
+// Calls `fn(begin, end)` for the chunks of at most `chunk_size` elements of
+// [0, size) on the calling thread and at most `num_threads` - 1 workers of a
+// pool shared by the process. The pool is created on first use and regrown
+// only when a call asks for more threads, so that its workers, and the
+// buffers they keep in thread_local storage, live across the calls. A call
+// from within a chunk runs all of its chunks on the calling thread.
+void SharedParallelFor(int64 size, int64 chunk_size, int num_threads,
+                       const std::function<void(int64, int64)> &fn);
+
+// Grows the pool of SharedParallelFor() to `num_threads` - 1 workers like
+// SharedParallelFor(), then calls `fn()` once on each of its workers and
+// returns when all calls are done, e.g., to prepare the thread_local state
+// of the workers. Does nothing with one thread or from within a chunk.
+void ForEachSharedPoolWorker(int num_threads, const std::function<void()> &fn);
 }  // namespace sentencepiece
 #endif  // UTIL_H_
@@ -13,6 +13,8 @@
 // limitations under the License.!
 
 #include <map>
+#include <set>
+#include <thread>
 
 #include "filesystem.h"
 #include "testharness.h"
@@ -282,6 +284,16 @@ TEST(UtilTest, IsStructurallyValidTest) {
   EXPECT_FALSE(string_util::IsStructurallyValid("\xe0\x9f\xbf"));
   EXPECT_FALSE(string_util::IsStructurallyValid("\xf0\x80\x81\x82"));
   EXPECT_FALSE(string_util::IsStructurallyValid("\xf0\x83\xbe\xbd"));
+
+  // Invalid bytes after ASCII runs of various lengths.
+  for (size_t n = 0; n < 40; ++n) {
+    const std::string ascii(n, 'a');
+    EXPECT_TRUE(string_util::IsStructurallyValid(ascii));
+    EXPECT_TRUE(string_util::IsStructurallyValid(ascii + "\xe3\x81\x81"));
+    EXPECT_FALSE(string_util::IsStructurallyValid(ascii + "\x80"));
+    EXPECT_FALSE(string_util::IsStructurallyValid(ascii + "\x80" + ascii));
+    EXPECT_FALSE(string_util::IsStructurallyValid(ascii + "\xe3\x81"));
+  }
 }
 
 TEST(UtilTest, UnicodeTextToUTF8Test) {
@@ -295,6 +307,19 @@ TEST(UtilTest, UnicodeTextToUTF8Test) {
 
   ut = string_util::UTF8ToUnicodeText("これはtest");
   EXPECT_EQ("これはtest", string_util::UnicodeTextToUTF8(ut));
+
+  // ASCII runs of various lengths between multi-byte and invalid characters.
+  for (size_t n = 0; n < 40; ++n) {
+    const std::string ascii(n, 'a');
+    const std::string text = ascii + "テ" + ascii + "\x80" + ascii;
+    ut = string_util::UTF8ToUnicodeText(text);
+    ASSERT_EQ(3 * n + 2, ut.size());
+    EXPECT_EQ(0x30C6, ut[n]);
+    EXPECT_EQ(kUnicodeError, ut[2 * n + 1]);
+    ut[2 * n + 1] = 0x80;
+    EXPECT_EQ(ascii + "テ" + ascii + "\xc2\x80" + ascii,
+              string_util::UnicodeTextToUTF8(ut));
+  }
 }
 
 TEST(UtilTest, MapUtilTest) {
@@ -424,6 +449,56 @@ TEST(UtilTest, ReservoirSamplerTest) {
   EXPECT_EQ(10000, sampler.total_size());
 }
 
+TEST(UtilTest, CounterGeneratorTest) {
+  auto draw = [](random::CounterGenerator *generator, int size) {
+    std::vector<uint32> values;
+    for (int i = 0; i < size; ++i) values.push_back((*generator)());
+    return values;
+  };
+
+  random::CounterGenerator generator(1, 2), same(1, 2), other_seed(2, 2),
+      other_stream(1, 3);
+  const auto values = draw(&generator, 100);
+  EXPECT_EQ(values, draw(&same, 100));
+  EXPECT_NE(values, draw(&other_seed, 100));
+  EXPECT_NE(values, draw(&other_stream, 100));
+
+  // A sample draws the same numbers wherever it starts.
+  generator.SetSample(3);
+  const auto sample = draw(&generator, 10);
+  generator.SetSample(3);
+  EXPECT_EQ(sample, draw(&generator, 10));
+  same.SetSample(0);
+  EXPECT_EQ(std::vector<uint32>(values.begin(), values.begin() + 10),
+            draw(&same, 10));
+
+  // The draws are roughly uniform.
+  int64 high = 0;
+  for (const uint32 value : draw(&generator, 10000)) {
+    high += value >> 31;
+  }
+  EXPECT_NEAR(5000, high, 300);
+
+  // The scopes nest and only affect the thread they live on.
+  {
+    const random::ScopedCounterGenerator outer(1, 2);
+    auto sampling = random::GetSamplingGenerator();
+    EXPECT_EQ(values[0], sampling());
+    {
+      const random::ScopedCounterGenerator inner(2, 2);
+      random::CounterGenerator expected(2, 2);
+      EXPECT_EQ(expected(), random::GetSamplingGenerator()());
+    }
+    EXPECT_EQ(values[1], random::GetSamplingGenerator()());
+    uint32 value = 0;
+    std::thread thread(
+        [&value]() { value = random::GetSamplingGenerator()(); });
+    thread.join();
+    EXPECT_NE(values[2], value);
+    EXPECT_EQ(values[2], random::GetSamplingGenerator()());
+  }
+}
+
 TEST(UtilTest, StrSplitAsCSVTest) {
   {
     const auto v = util::StrSplitAsCSV("foo,bar,buz");
@@ -448,4 +523,122 @@ TEST(UtilTest, StrSplitAsCSVTest) {
     EXPECT_EQ("1,2,3,4", v[1]);
   }
 }
+
+TEST(UtilTest, ThreadPoolTest) {
+  ThreadPool pool(4);
+  EXPECT_EQ(4, pool.num_workers());
+
+  // The same workers run several rounds of closures.
+  std::vector<int> counts(100, 0);
+  for (int round = 1; round <= 3; ++round) {
+    for (int i = 0; i < 100; ++i) {
+      pool.Schedule([&counts, i]() { ++counts[i]; });
+    }
+    pool.Wait();
+    EXPECT_EQ(std::vector<int>(100, round), counts);
+  }
+
+  // Every element is covered by exactly one chunk.
+  for (const int64 size : {0, 1, 7, 1000}) {
+    std::vector<int> covered(size, 0);
+    pool.ParallelFor(size, 16, [&covered](int64 begin, int64 end) {
+      EXPECT_LE(end - begin, 16);
+      for (int64 i = begin; i < end; ++i) ++covered[i];
+    });
+    EXPECT_EQ(std::vector<int>(size, 1), covered);
+  }
+
+  // Pending closures finish before the pool is destroyed.
+  std::atomic<int> done(0);
+  {
+    ThreadPool pool2(0);
+    EXPECT_EQ(1, pool2.num_workers());
+    for (int i = 0; i < 10; ++i) pool2.Schedule([&done]() { ++done; });
+  }
+  EXPECT_EQ(10, done.load());
+}
+
+TEST(UtilTest, SharedParallelForTest) {
+  // Every element is covered by exactly one chunk, on at most `num_threads`
+  // threads.
+  std::mutex mutex;
+  for (int round = 0; round < 20; ++round) {
+    std::set<std::thread::id> threads;
+    std::vector<int> covered(1000, 0);
+    SharedParallelFor(covered.size(), 8, 4, [&](int64 begin, int64 end) {
+      EXPECT_LE(end - begin, 8);
+      for (int64 i = begin; i < end; ++i) ++covered[i];
+      std::lock_guard<std::mutex> lock(mutex);
+      threads.insert(std::this_thread::get_id());
+    });
+    EXPECT_EQ(std::vector<int>(1000, 1), covered);
+    EXPECT_LE(threads.size(), 4);
+  }
+
+  // A nested call runs on the thread of its chunk.
+  std::atomic<int> done(0);
+  SharedParallelFor(100, 1, 4, [&](int64 begin, int64 end) {
+    const auto id = std::this_thread::get_id();
+    SharedParallelFor(100, 1, 4, [&](int64 inner_begin, int64 inner_end) {
+      EXPECT_EQ(0, inner_begin);
+      EXPECT_EQ(100, inner_end);
+      EXPECT_EQ(id, std::this_thread::get_id());
+      ++done;
+    });
+  });
+  EXPECT_EQ(100, done.load());
+
+  // One thread runs everything on the calling thread.
+  SharedParallelFor(100, 1, 1, [&](int64 begin, int64 end) {
+    EXPECT_EQ(0, begin);
+    EXPECT_EQ(100, end);
+  });
+}
+
+TEST(UtilTest, ForEachSharedPoolWorkerTest) {
+  // Every worker runs the closure once.
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  ForEachSharedPoolWorker(4, [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_TRUE(threads.insert(std::this_thread::get_id()).second);
+  });
+  EXPECT_GE(threads.size(), 3);
+  EXPECT_EQ(0, threads.count(std::this_thread::get_id()));
+
+  // Concurrent calls each run on every worker.
+  std::atomic<int> done(0);
+  std::vector<std::thread> callers;
+  for (int i = 0; i < 4; ++i) {
+    callers.emplace_back([&]() {
+      for (int round = 0; round < 20; ++round) {
+        ForEachSharedPoolWorker(4, [&]() { ++done; });
+      }
+    });
+  }
+  for (auto &caller : callers) caller.join();
+  EXPECT_EQ(4 * 20 * static_cast<int>(threads.size()), done.load());
+}
+
+TEST(UtilTest, NumaAwareThreadPoolTest) {
+  // The nodes hold distinct CPUs.
+  std::set<int> cpus;
+  size_t num_cpus = 0;
+  for (const auto &node : numa::GetNodeCpus()) {
+    EXPECT_FALSE(node.empty());
+    cpus.insert(node.begin(), node.end());
+    num_cpus += node.size();
+  }
+  EXPECT_EQ(num_cpus, cpus.size());
+
+  // Pinned or not, the workers run every closure.
+  for (const int n : {1, 3, 8}) {
+    ThreadPool pool(n, true);
+    EXPECT_EQ(n, pool.num_workers());
+    std::atomic<int> done(0);
+    for (int i = 0; i < 100; ++i) pool.Schedule([&done]() { ++done; });
+    pool.Wait();
+    EXPECT_EQ(100, done.load());
+  }
+}
 }  // namespace sentencepiece
@@ -31,9 +31,10 @@ EncodeResult Model::Encode(absl::string_view normalized) const {
   }
 
   EncodeResult output;
-  for (const auto &w : SplitIntoWords(normalized)) {
-    output.emplace_back(w, PieceToId(w));
-  }
+  const auto words = SplitIntoWords(normalized);
+  output.reserve(words.size());
+  for (const auto &w : words) output.emplace_back(w, 0);
+  PiecesToIds(&output);
 
   return output;
 }
@@ -12,8 +12,12 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.!
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "third_party/absl/container/flat_hash_map.h"
 #include "third_party/absl/strings/string_view.h"
@@ -32,32 +36,65 @@ util::Status Trainer::Train() {
 
   RETURN_IF_ERROR(LoadSentences());
 
-  absl::flat_hash_map<std::string, uint64> freq;
-  for (const auto &it : sentences_) {
-    for (const auto &s : SplitIntoWords(it.first)) {
-      freq[std::string(s)] += it.second;
-    }
+  TrainerProfiler::Phase count_phase(profiler(), "count_words");
+  count_phase.set_sentences(sentences_.size());
+
+  // Words are counted in parallel as in SplitSentencesByWhitespace(). Each
+  // thread counts a stripe of the sentences into maps partitioned by the
+  // word hash, and then each partition is merged and cut to the most
+  // frequent words by one thread.
+  using WordCounts = absl::flat_hash_map<absl::string_view, uint64,
+                                         string_util::string_view_hash>;
+  const int num_shards = std::max(1, trainer_spec_.num_threads());
+  const string_util::string_view_hash hasher;
+  std::vector<std::vector<WordCounts>> counts(
+      num_shards, std::vector<WordCounts>(num_shards));
+  for (int n = 0; n < num_shards; ++n) {
+    pool()->Schedule([&, n]() {
+      auto &local = counts[n];
+      for (size_t i = n; i < sentences_.size(); i += num_shards) {
+        const auto &it = sentences_[i];
+        for (const auto &w : SplitIntoWords(it.first)) {
+          local[hasher(w) % num_shards][w] += it.second;
+        }
+      }
+    });
+  }
+  pool()->Wait();
+
+  // The words with kUNKStr are counted in the sum, but are not pieces.
+  std::vector<std::vector<std::pair<std::string, uint64>>> shards(num_shards);
+  std::vector<uint64> sums(num_shards, 0);
+  for (int shard = 0; shard < num_shards; ++shard) {
+    pool()->Schedule([&, shard]() {
+      WordCounts &freq = counts[0][shard];
+      for (int n = 1; n < num_shards; ++n) {
+        for (const auto &it : counts[n][shard]) freq[it.first] += it.second;
+        WordCounts().swap(counts[n][shard]);
+      }
+      for (const auto &it : freq) {
+        sums[shard] += it.second;
+        if (it.first.find(kUNKStr) != absl::string_view::npos) continue;
+        shards[shard].emplace_back(std::string(it.first), it.second);
+      }
+      WordCounts().swap(freq);
+    });
   }
+  pool()->Wait();
 
   const int vocab_size = trainer_spec_.vocab_size() - meta_pieces_.size();
   CHECK_GE_OR_RETURN(vocab_size, 0);
 
   uint64 sum = 0;
-  for (const auto &it : freq) {
-    sum += it.second;
-  }
+  for (const uint64 s : sums) sum += s;
 
   const auto logsum = std::log(static_cast<float>(sum));
 
   CHECK_OR_RETURN(final_pieces_.empty());
-  for (const auto &it : Sorted(freq)) {
-    if (it.first.find(kUNKStr) != std::string::npos) {
-      continue;
-    }
-    if (!trainer_spec_.use_all_vocab() &&
-        final_pieces_.size() == static_cast<size_t>(vocab_size)) {
-      break;
-    }
+  const size_t num_pieces = trainer_spec_.use_all_vocab()
+                                ? std::numeric_limits<size_t>::max()
+                                : static_cast<size_t>(vocab_size);
+  for (const auto &it : SortedTopK(&shards, num_pieces, pool())) {
     final_pieces_.emplace_back(
         it.first, std::log(static_cast<float>(it.second)) - logsum);
   }
@@ -65,6 +102,8 @@ util::Status Trainer::Train() {
   if (trainer_spec_.use_all_vocab()) {
     trainer_spec_.set_vocab_size(final_pieces_.size() + meta_pieces_.size());
   }
+  count_phase.set_vocab_size(final_pieces_.size());
+  count_phase.End();
 
   return Save();
 }
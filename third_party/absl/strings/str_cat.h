@@ -34,6 +34,9 @@ inline std::string StrCat(absl::string_view str) {
   return std::string(str.data(), str.size());
 }
 
+template <typename... T>
+inline std::string StrCat(int first, const T &... rest);
+
 template <typename... T>
 inline std::string StrCat(absl::string_view first, const T &... rest) {
   return StrCat(first) + StrCat(rest...);
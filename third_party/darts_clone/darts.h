@@ -204,6 +204,11 @@ class DoubleArrayImpl {
   std::size_t total_size() const {
     return unit_size() * size();
   }
+  // owned_size() returns the number of bytes of the array of units owned by
+  // this object. It is 0 if set_array() is used.
+  std::size_t owned_size() const {
+    return buf_ != NULL ? total_size() : 0;
+  }
   // nonzero_size() exists for compatibility. It always returns the number of
   // units because it takes long time to count the number of non-zero units.
   std::size_t nonzero_size() const {
@@ -297,6 +302,14 @@ class DoubleArrayImpl {
   inline value_type traverse(const key_type *key, std::size_t &node_pos,
       std::size_t &key_pos, std::size_t length = 0) const;
 
+  // prefetch() follows the transitions labeled key[0], ..., key[length - 2]
+  // from `node_pos' and hints the processor to fetch the unit reached by the
+  // transition labeled key[length - 1], so that a later traverse() of the
+  // same key does not wait for it. It does nothing if one of the transitions
+  // does not exist, and never changes the dictionary or the results.
+  inline void prefetch(const key_type *key, std::size_t length,
+      std::size_t node_pos = 0) const;
+
  private:
   typedef Details::uchar_type uchar_type;
   typedef Details::id_type id_type;
@@ -512,6 +525,27 @@ inline std::size_t DoubleArrayImpl<A, B, T, C>::commonPrefixSearch(
   return num_results;
 }
 
+template <typename A, typename B, typename T, typename C>
+inline void DoubleArrayImpl<A, B, T, C>::prefetch(const key_type *key,
+    std::size_t length, std::size_t node_pos) const {
+  if (length == 0) {
+    return;
+  }
+  id_type id = static_cast<id_type>(node_pos);
+  unit_type unit = array_[id];
+  for (std::size_t i = 0; i + 1 < length; ++i) {
+    id ^= unit.offset() ^ static_cast<uchar_type>(key[i]);
+    unit = array_[id];
+    if (unit.label() != static_cast<uchar_type>(key[i])) {
+      return;
+    }
+  }
+  id ^= unit.offset() ^ static_cast<uchar_type>(key[length - 1]);
+#if defined(__GNUC__)
+  __builtin_prefetch(&array_[id]);
+#endif  // defined(__GNUC__)
+}
+
 template <typename A, typename B, typename T, typename C>
 inline typename DoubleArrayImpl<A, B, T, C>::value_type
 DoubleArrayImpl<A, B, T, C>::traverse(const key_type *key,